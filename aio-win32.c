@@ -17,9 +17,11 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qapi/error.h"
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/callback-profile.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -150,6 +152,18 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    /* Not implemented */
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    /* Not implemented */
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -239,11 +253,19 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
             (node->io_read || node->io_write)) {
             node->pfd.revents = 0;
             if ((revents & G_IO_IN) && node->io_read) {
+                int64_t start = callback_profile_start();
+
                 node->io_read(node->opaque);
+                callback_profile_end(CALLBACK_PROFILE_FD,
+                                     (void *)node->io_read, start);
                 progress = true;
             }
             if ((revents & G_IO_OUT) && node->io_write) {
+                int64_t start = callback_profile_start();
+
                 node->io_write(node->opaque);
+                callback_profile_end(CALLBACK_PROFILE_FD,
+                                     (void *)node->io_write, start);
                 progress = true;
             }
 
@@ -374,3 +396,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx)
 {
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
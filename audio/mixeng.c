@@ -267,6 +267,131 @@ f_sample *mixeng_clip[2][2][2][3] = {
     }
 };
 
+static void mixeng_add_default(struct st_sample *dst,
+                               const struct st_sample *src, int samples)
+{
+    int i;
+
+    for (i = 0; i < samples; i++) {
+        dst[i].l += src[i].l;
+        dst[i].r += src[i].r;
+    }
+}
+
+/* Mixes @src into @dst; used by st_rate_flow_mix when the rates match */
+static void (*mixeng_add)(struct st_sample *dst, const struct st_sample *src,
+                          int samples) = mixeng_add_default;
+
+#if defined CONFIG_AVX2_OPT && !defined FLOAT_MIXENG
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ * Signed 16 bit stereo, what nearly every guest and backend use.  A
+ * struct st_sample is two int64_t, so both directions work on a flat
+ * array of 2 * samples values.
+ */
+static void conv_natural_int16_t_to_stereo_avx2(struct st_sample *dst,
+                                                const void *src, int samples)
+{
+    const int16_t *in = src;
+    int64_t *out = (int64_t *)dst;
+    int i, n = samples * 2;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m256i lo = _mm256_cvtepi16_epi64(v);
+        __m256i hi = _mm256_cvtepi16_epi64(_mm_srli_si128(v, 8));
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi64(lo, 16));
+        _mm256_storeu_si256((__m256i *)(out + i + 4),
+                            _mm256_slli_epi64(hi, 16));
+    }
+    for (; i < n; i++) {
+        out[i] = (int64_t)in[i] << 16;
+    }
+}
+
+static void clip_natural_int16_t_from_stereo_avx2(void *dst,
+                                                  const struct st_sample *src,
+                                                  int samples)
+{
+    const int64_t *in = (const int64_t *)src;
+    int16_t *out = dst;
+    const __m256i max = _mm256_set1_epi64x(0x7f000000 - 1);
+    const __m256i min = _mm256_set1_epi64x(-2147483648LL);
+    const __m256i sat_max = _mm256_set1_epi64x(0x7fffLL << 16);
+    const __m256i sat_min = _mm256_set1_epi64x(0x8000LL << 16);
+    /* bytes 2-3 of each lane, which is (int16_t)(v >> 16) */
+    const __m256i pick = _mm256_setr_epi8(2, 3, 10, 11, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1,
+                                          2, 3, 10, 11, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+    int i, n = samples * 2;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+
+        v = _mm256_blendv_epi8(v, sat_max, _mm256_cmpgt_epi64(v, max));
+        v = _mm256_blendv_epi8(v, sat_min, _mm256_cmpgt_epi64(min, v));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pick), join);
+        _mm_storel_epi64((__m128i *)(out + i), _mm256_castsi256_si128(v));
+    }
+    if (i < n) {
+        clip_natural_int16_t_from_stereo(out + i,
+                                         (const struct st_sample *)(in + i),
+                                         (n - i) / 2);
+    }
+}
+
+static void mixeng_add_avx2(struct st_sample *dst,
+                            const struct st_sample *src, int samples)
+{
+    int64_t *d = (int64_t *)dst;
+    const int64_t *s = (const int64_t *)src;
+    int i, n = samples * 2;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_add_epi64(
+            _mm256_loadu_si256((const __m256i *)(d + i)),
+            _mm256_loadu_si256((const __m256i *)(s + i)));
+        _mm256_storeu_si256((__m256i *)(d + i), v);
+    }
+    for (; i < n; i++) {
+        d[i] += s[i];
+    }
+}
+
+static bool avx2_support(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+
+    return b & bit_AVX2;
+}
+
+static void __attribute__((constructor)) mixeng_init_accel(void)
+{
+    if (!avx2_support()) {
+        return;
+    }
+
+    /* [stereo][signed][natural][16 bit] */
+    mixeng_conv[1][1][0][1] = conv_natural_int16_t_to_stereo_avx2;
+    mixeng_clip[1][1][0][1] = clip_natural_int16_t_from_stereo_avx2;
+    mixeng_add = mixeng_add_avx2;
+}
+#pragma GCC pop_options
+#endif
+
 /*
  * August 21, 1998
  * Copyright 1998 Fabrice Bellard.
@@ -332,10 +457,12 @@ void *st_rate_start (int inrate, int outrate)
 
 #define NAME st_rate_flow_mix
 #define OP(a, b) a += b
+#define OP_BLOCK(dst, src, n) mixeng_add(dst, src, n)
 #include "rate_template.h"
 
 #define NAME st_rate_flow
 #define OP(a, b) a = b
+#define OP_BLOCK(dst, src, n) memcpy(dst, src, (n) * sizeof(struct st_sample))
 #include "rate_template.h"
 
 void st_rate_stop (void *opaque)
@@ -355,6 +482,10 @@ void mixeng_volume (struct st_sample *buf, int len, struct mixeng_volume *vol)
         return;
     }
 
+    if (vol->l == nominal_volume.l && vol->r == nominal_volume.r) {
+        return;
+    }
+
     while (len--) {
 #ifdef FLOAT_MIXENG
         buf->l = buf->l * vol->l;
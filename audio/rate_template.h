@@ -49,11 +49,8 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
     oend = obuf + *osamp;
 
     if (rate->opos_inc == (1ULL + UINT_MAX)) {
-        int i, n = *isamp > *osamp ? *osamp : *isamp;
-        for (i = 0; i < n; i++) {
-            OP (obuf[i].l, ibuf[i].l);
-            OP (obuf[i].r, ibuf[i].r);
-        }
+        int n = *isamp > *osamp ? *osamp : *isamp;
+        OP_BLOCK(obuf, ibuf, n);
         *isamp = n;
         *osamp = n;
         return;
@@ -109,3 +106,4 @@ the_end:
 
 #undef NAME
 #undef OP
+#undef OP_BLOCK
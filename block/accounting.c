@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,78 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+static void block_latency_histogram_clear(BlockLatencyHistogram *hist)
+{
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    memset(hist, 0, sizeof(*hist));
+}
+
+int block_latency_histogram_set(BlockAcctStats *stats,
+                                enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    uint64List *entry;
+    uint64_t prev = 0;
+    int i, nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    /* The boundaries must be strictly ascending */
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry != boundaries && entry->value <= prev) {
+            return -EINVAL;
+        }
+        prev = entry->value;
+        nbins++;
+    }
+
+    block_latency_histogram_clear(hist);
+    hist->nbins = nbins;
+    hist->boundaries = g_new(uint64_t, nbins - 1);
+    hist->bins = g_new0(uint64_t, nbins);
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        hist->boundaries[i] = entry->value;
+    }
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_clear(&stats->latency_histogram[i]);
+    }
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    int lo = 0, hi;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    /* Find the first boundary above the latency */
+    hi = hist->nbins - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +179,9 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +205,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
@@ -17,6 +17,7 @@
 #include "block/block.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/block_backup.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
@@ -26,13 +27,8 @@
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
 #define SLICE_TIME 100000000ULL /* ns */
-
-typedef struct CowRequest {
-    int64_t start;
-    int64_t end;
-    QLIST_ENTRY(CowRequest) list;
-    CoQueue wait_queue; /* coroutines blocked on this request */
-} CowRequest;
+#define BACKUP_MAX_IN_FLIGHT 8
+#define BACKUP_MAX_CHUNK_SIZE (1 << 20)
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -49,8 +45,25 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+    /* Zero areas of the source need not be written to the target */
+    bool target_zero_init;
+    /* Copy the data inside the host kernel while the drivers support it */
+    bool use_copy_range;
+
+    /* Copy coroutines started by backup_run_full() */
+    int in_flight;
+    bool waiting_for_io;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -100,13 +113,15 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       bool is_write_notifier)
 {
     BlockBackend *blk = job->common.blk;
+    BlockDriverState *bs = blk_bs(blk);
     CowRequest cow_request;
     struct iovec iov;
     QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t max_clusters = MAX(BACKUP_MAX_CHUNK_SIZE / job->cluster_size, 1);
+    int64_t start, end, nb_clusters;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -119,42 +134,91 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nb_clusters) {
+        BlockDriverState *file;
+        int64_t status;
+        int pnum;
+
+        nb_clusters = 1;
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
             continue; /* already copied */
         }
 
+        /* Copy a run of clusters that have not been copied yet at once */
+        while (nb_clusters < max_clusters && start + nb_clusters < end &&
+               !test_bit(start + nb_clusters, job->done_bitmap)) {
+            nb_clusters++;
+        }
+
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        n = MIN(nb_clusters * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        /* Areas that read as zero need not be read */
+        status = bdrv_get_block_status_above(bs, NULL,
+                                             start * sectors_per_cluster, n,
+                                             &pnum, &file);
+        if (status >= 0 && (status & BDRV_BLOCK_ZERO) &&
+            pnum >= MIN(sectors_per_cluster, n)) {
+            if (pnum < n) {
+                nb_clusters = pnum / sectors_per_cluster;
+                n = nb_clusters * sectors_per_cluster;
+            }
+            if (job->target_zero_init) {
+                ret = 0;
+            } else {
+                ret = blk_co_pwrite_zeroes(job->target,
+                                           start * job->cluster_size,
+                                           n * BDRV_SECTOR_SIZE,
+                                           BDRV_REQ_MAY_UNMAP);
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
         } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov, 0);
+            if (job->use_copy_range) {
+                ret = blk_co_copy_range(blk, start * job->cluster_size,
+                                        job->target, start * job->cluster_size,
+                                        n * BDRV_SECTOR_SIZE,
+                                        is_write_notifier ?
+                                        BDRV_REQ_NO_SERIALISING : 0);
+                if (ret == -ENOTSUP) {
+                    /* Don't try again for the rest of the job */
+                    job->use_copy_range = false;
+                }
+            }
+            if (!job->use_copy_range) {
+                if (!bounce_buffer) {
+                    bounce_buffer = blk_blockalign(blk, MIN(max_clusters,
+                                                            end - start) *
+                                                        job->cluster_size);
+                }
+                iov.iov_base = bounce_buffer;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+                ret = blk_co_preadv(blk, start * job->cluster_size,
+                                    bounce_qiov.size, &bounce_qiov,
+                                    is_write_notifier ? BDRV_REQ_NO_SERIALISING
+                                                      : 0);
+                if (ret < 0) {
+                    trace_backup_do_cow_read_fail(job, start, ret);
+                    if (error_is_read) {
+                        *error_is_read = true;
+                    }
+                    goto out;
+                }
+
+                if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+                    ret = blk_co_pwrite_zeroes(job->target,
+                                               start * job->cluster_size,
+                                               bounce_qiov.size,
+                                               BDRV_REQ_MAY_UNMAP);
+                } else {
+                    ret = blk_co_pwritev(job->target, start * job->cluster_size,
+                                         bounce_qiov.size, &bounce_qiov, 0);
+                }
+            }
         }
         if (ret < 0) {
             trace_backup_do_cow_write_fail(job, start, ret);
@@ -164,7 +228,7 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
             goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, nb_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -262,6 +326,57 @@ static const BlockJobDriver backup_job_driver = {
     .attached_aio_context   = backup_attached_aio_context,
 };
 
+void backup_do_checkpoint(BlockJob *job, Error **errp)
+{
+    BackupBlockJob *backup_job = container_of(job, BackupBlockJob, common);
+    int64_t len;
+
+    assert(job->driver->job_type == BLOCK_JOB_TYPE_BACKUP);
+
+    if (backup_job->sync_mode != MIRROR_SYNC_MODE_NONE) {
+        error_setg(errp, "The backup job only supports block checkpoint in"
+                   " sync=none mode");
+        return;
+    }
+
+    len = DIV_ROUND_UP(backup_job->common.len, backup_job->cluster_size);
+    bitmap_zero(backup_job->done_bitmap, len);
+}
+
+void coroutine_fn backup_wait_for_overlapping_requests(BlockJob *job,
+                                                       int64_t sector_num,
+                                                       int nb_sectors)
+{
+    BackupBlockJob *backup_job = container_of(job, BackupBlockJob, common);
+    int64_t sectors_per_cluster = cluster_size_sectors(backup_job);
+    int64_t start, end;
+
+    assert(job->driver->job_type == BLOCK_JOB_TYPE_BACKUP);
+
+    start = sector_num / sectors_per_cluster;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_cluster);
+    wait_for_overlapping_requests(backup_job, start, end);
+}
+
+void backup_cow_request_begin(CowRequest *req, BlockJob *job,
+                              int64_t sector_num, int nb_sectors)
+{
+    BackupBlockJob *backup_job = container_of(job, BackupBlockJob, common);
+    int64_t sectors_per_cluster = cluster_size_sectors(backup_job);
+    int64_t start, end;
+
+    assert(job->driver->job_type == BLOCK_JOB_TYPE_BACKUP);
+
+    start = sector_num / sectors_per_cluster;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_cluster);
+    cow_request_begin(req, backup_job, start, end);
+}
+
+void backup_cow_request_end(CowRequest *req)
+{
+    cow_request_end(req);
+}
+
 static BlockErrorAction backup_error_action(BackupBlockJob *job,
                                             bool read, int error)
 {
@@ -318,22 +433,24 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     bool error_is_read;
     int ret = 0;
-    int clusters_per_iter;
-    uint32_t granularity;
-    int64_t sector;
+    int64_t sector = 0;
+    int64_t nb_sectors;
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    HBitmapIter hbi;
-
-    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
-    bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
-
-    /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+    int64_t max_clusters = MAX(BACKUP_MAX_CHUNK_SIZE / job->cluster_size, 1);
+    int64_t end_sector = DIV_ROUND_UP(job->common.len, BDRV_SECTOR_SIZE);
+
+    /* Copy one whole run of dirty sectors at a time */
+    while (sector < end_sector) {
+        nb_sectors = end_sector - sector;
+        if (!bdrv_dirty_bitmap_next_dirty_area(job->sync_bitmap, &sector,
+                                               &nb_sectors)) {
+            break;
+        }
         cluster = sector / sectors_per_cluster;
+        end = DIV_ROUND_UP(sector + nb_sectors, sectors_per_cluster);
 
         /* Fake progress updates for any clusters we skipped */
         if (cluster != last_cluster + 1) {
@@ -341,13 +458,15 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                                    job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
+        while (cluster < end) {
+            int64_t n = MIN(end - cluster, max_clusters);
+
             do {
                 if (yield_and_check(job)) {
                     return ret;
                 }
                 ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
+                                    n * sectors_per_cluster, &error_is_read,
                                     false);
                 if ((ret < 0) &&
                     backup_error_action(job, error_is_read, -ret) ==
@@ -355,15 +474,11 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                     return ret;
                 }
             } while (ret < 0);
+            cluster += n;
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
-        }
-
-        last_cluster = cluster - 1;
+        last_cluster = end - 1;
+        sector = end * sectors_per_cluster;
     }
 
     /* Play some final catchup with the progress meter */
@@ -375,20 +490,158 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     return ret;
 }
 
+static bool coroutine_fn backup_cluster_is_allocated(BackupBlockJob *job,
+                                                     int64_t cluster)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    /* Check to see if these blocks are already in the backing file. */
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, cluster * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this backup. */
+    return alloced != 0;
+}
+
+static inline void backup_wait_for_io(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_io);
+    job->waiting_for_io = true;
+    qemu_coroutine_yield();
+    job->waiting_for_io = false;
+}
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job, w->cluster * sectors_per_cluster,
+                        w->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0 &&
+        (job->worker_ret == 0 || w->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = w->cluster;
+    }
+
+    job->in_flight--;
+    g_free(w);
+
+    if (job->waiting_for_io) {
+        qemu_coroutine_enter(job->common.co);
+    }
+}
+
+/* Copy the whole device (or, for sync=top, what is allocated in the top
+ * image) with up to BACKUP_MAX_IN_FLIGHT copy coroutines.  Errors are
+ * handled once the copies in flight have settled; the copy then resumes
+ * from the first failed cluster, skipping what is already done. */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t max_clusters = MAX(BACKUP_MAX_CHUNK_SIZE / job->cluster_size, 1);
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int ret = 0;
+
+    for (;;) {
+        while (start < end && job->worker_ret == 0) {
+            Coroutine *co;
+            BackupWorker *w;
+            int64_t nb_clusters;
+
+            if (yield_and_check(job)) {
+                break;
+            }
+
+            if (test_bit(start, job->done_bitmap) ||
+                (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+                 !backup_cluster_is_allocated(job, start))) {
+                start++;
+                continue;
+            }
+
+            nb_clusters = 1;
+            while (nb_clusters < max_clusters && start + nb_clusters < end &&
+                   !test_bit(start + nb_clusters, job->done_bitmap) &&
+                   (job->sync_mode != MIRROR_SYNC_MODE_TOP ||
+                    backup_cluster_is_allocated(job, start + nb_clusters))) {
+                nb_clusters++;
+            }
+
+            while (job->in_flight >= BACKUP_MAX_IN_FLIGHT) {
+                backup_wait_for_io(job);
+            }
+
+            w = g_new(BackupWorker, 1);
+            *w = (BackupWorker) {
+                .job         = job,
+                .cluster     = start,
+                .nb_clusters = nb_clusters,
+            };
+            start += nb_clusters;
+
+            job->in_flight++;
+            co = qemu_coroutine_create(backup_worker_entry, w);
+            qemu_coroutine_enter(co);
+        }
+
+        while (job->in_flight > 0) {
+            backup_wait_for_io(job);
+        }
+
+        if (job->worker_ret == 0) {
+            break;
+        }
+
+        /* Depending on error action, fail now or retry from the first
+         * cluster that failed */
+        ret = job->worker_ret;
+        job->worker_ret = 0;
+        if (backup_error_action(job, job->worker_error_is_read, -ret) ==
+            BLOCK_ERROR_ACTION_REPORT) {
+            break;
+        }
+        ret = 0;
+        start = job->worker_error_cluster;
+    }
+
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
     BlockBackend *target = job->target;
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -406,58 +659,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -555,6 +757,8 @@ void backup_start(const char *job_id, BlockDriverState *bs,
     job->sync_mode = sync_mode;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
+    job->target_zero_init = bdrv_has_zero_init(target) && !target->backing;
+    job->use_copy_range = true;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
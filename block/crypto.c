@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -38,8 +39,22 @@ typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+    int n_threads;
 };
 
+/* Encryption and decryption are spread over up to this many workers */
+#define BLOCK_CRYPTO_MAX_THREADS 8
+
+static int block_crypto_nthreads(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, BLOCK_CRYPTO_MAX_THREADS));
+}
+
 
 static int block_crypto_probe_generic(QCryptoBlockFormat format,
                                       const uint8_t *buf,
@@ -309,10 +324,12 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     if (flags & BDRV_O_NO_IO) {
         cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
     }
+    crypto->n_threads = block_crypto_nthreads();
     crypto->block = qcrypto_block_open(open_opts,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       crypto->n_threads,
                                        errp);
 
     if (!crypto->block) {
@@ -387,7 +404,108 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+#define BLOCK_CRYPTO_MAX_SECTORS 2048
+
+/* Requests smaller than two such pieces are handled in the coroutine */
+#define BLOCK_CRYPTO_JOB_SECTORS 64
+
+typedef struct BlockCryptoTask {
+    Coroutine *co;
+    int pending;
+    int ret;
+} BlockCryptoTask;
+
+typedef struct BlockCryptoJob {
+    QCryptoBlock *block;
+    BlockCryptoTask *task;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+    bool encrypt;
+} BlockCryptoJob;
+
+static int block_crypto_job_run(void *opaque)
+{
+    BlockCryptoJob *job = opaque;
+    int ret;
+
+    if (job->encrypt) {
+        ret = qcrypto_block_encrypt(job->block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(job->block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    }
+
+    return ret < 0 ? -EIO : 0;
+}
+
+static void block_crypto_job_cb(void *opaque, int ret)
+{
+    BlockCryptoJob *job = opaque;
+    BlockCryptoTask *task = job->task;
+
+    if (ret < 0) {
+        task->ret = ret;
+    }
+    if (--task->pending == 0) {
+        qemu_coroutine_enter(task->co);
+    }
+}
+
+/*
+ * Encrypt or decrypt @nb_sectors sectors in place at @buf.  Large buffers
+ * are cut into one piece per thread and handed to the thread pool, while
+ * the coroutine waits for all of them.
+ */
+static coroutine_fn int
+block_crypto_co_crypt(BlockDriverState *bs, uint64_t sector_num,
+                      uint8_t *buf, int nb_sectors, bool encrypt)
+{
+    BlockCrypto *crypto = bs->opaque;
+    BlockCryptoJob jobs[BLOCK_CRYPTO_MAX_THREADS];
+    BlockCryptoTask task = { .co = qemu_coroutine_self() };
+    ThreadPool *pool;
+    int i, n, njobs, job_sectors;
+
+    njobs = MIN(crypto->n_threads, nb_sectors / BLOCK_CRYPTO_JOB_SECTORS);
+    if (njobs <= 1) {
+        BlockCryptoJob job = {
+            .block = crypto->block,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = nb_sectors * 512,
+            .encrypt = encrypt,
+        };
+        return block_crypto_job_run(&job);
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    job_sectors = DIV_ROUND_UP(nb_sectors, njobs);
+    for (i = 0; nb_sectors; i++) {
+        n = MIN(job_sectors, nb_sectors);
+        jobs[i] = (BlockCryptoJob) {
+            .block = crypto->block,
+            .task = &task,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = n * 512,
+            .encrypt = encrypt,
+        };
+        task.pending++;
+        thread_pool_submit_aio(pool, block_crypto_job_run, &jobs[i],
+                               block_crypto_job_cb, &jobs[i]);
+
+        sector_num += n;
+        buf += n * 512;
+        nb_sectors -= n;
+    }
+
+    while (task.pending) {
+        qemu_coroutine_yield();
+    }
+    return task.ret;
+}
 
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -433,11 +551,9 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num, cipher_data,
+                                    cur_nr_sectors, false);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -494,11 +610,9 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num, cipher_data,
+                                    cur_nr_sectors, true);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -30,6 +30,7 @@
 #include "qemu/cutils.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
@@ -272,13 +273,28 @@ void bdrv_drain(BlockDriverState *bs)
     bdrv_drained_end(bs);
 }
 
+/* What one bdrv_drain_all_begin() quiesced.  Sections may nest; the
+ * innermost one is at the head of drain_all_sections.  bdrv_drain_all_end()
+ * only resumes these, so that nodes and jobs created inside the section are
+ * left alone, and holds a reference to each until then.
+ */
+typedef struct BdrvDrainAllSection {
+    GSList *nodes;
+    GSList *jobs;
+    QSLIST_ENTRY(BdrvDrainAllSection) next;
+} BdrvDrainAllSection;
+
+static QSLIST_HEAD(, BdrvDrainAllSection) drain_all_sections =
+    QSLIST_HEAD_INITIALIZER(drain_all_sections);
+
 /*
- * Wait for pending requests to complete across all BlockDriverStates
+ * Wait for pending requests to complete across all BlockDriverStates, and
+ * keep them quiesced until the matching bdrv_drain_all_end().
  *
- * This function does not flush data to disk, use bdrv_flush_all() for that
- * after calling this function.
+ * Parents attached to a node in the meantime are drained as with
+ * bdrv_drained_begin(); nodes added in the meantime are not drained.
  */
-void bdrv_drain_all(void)
+void bdrv_drain_all_begin(void)
 {
     /* Always run first iteration so any pending completion BHs run */
     bool busy = true;
@@ -286,6 +302,7 @@ void bdrv_drain_all(void)
     BdrvNextIterator it;
     BlockJob *job = NULL;
     GSList *aio_ctxs = NULL, *ctx;
+    BdrvDrainAllSection *section = g_new0(BdrvDrainAllSection, 1);
 
     while ((job = block_job_next(job))) {
         AioContext *aio_context = blk_get_aio_context(job->blk);
@@ -293,17 +310,26 @@ void bdrv_drain_all(void)
         aio_context_acquire(aio_context);
         block_job_pause(job);
         aio_context_release(aio_context);
+
+        block_job_ref(job);
+        section->jobs = g_slist_prepend(section->jobs, job);
     }
 
     for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
         AioContext *aio_context = bdrv_get_aio_context(bs);
 
         aio_context_acquire(aio_context);
-        bdrv_parent_drained_begin(bs);
+        if (!bs->quiesce_counter++) {
+            aio_disable_external(aio_context);
+            bdrv_parent_drained_begin(bs);
+        }
         bdrv_io_unplugged_begin(bs);
         bdrv_drain_recurse(bs);
         aio_context_release(aio_context);
 
+        bdrv_ref(bs);
+        section->nodes = g_slist_prepend(section->nodes, bs);
+
         if (!g_slist_find(aio_ctxs, aio_context)) {
             aio_ctxs = g_slist_prepend(aio_ctxs, aio_context);
         }
@@ -334,25 +360,59 @@ void bdrv_drain_all(void)
             aio_context_release(aio_context);
         }
     }
+    g_slist_free(aio_ctxs);
 
-    for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
+    QSLIST_INSERT_HEAD(&drain_all_sections, section, next);
+}
+
+void bdrv_drain_all_end(void)
+{
+    BdrvDrainAllSection *section = QSLIST_FIRST(&drain_all_sections);
+    GSList *l;
+
+    assert(section);
+    QSLIST_REMOVE_HEAD(&drain_all_sections, next);
+
+    for (l = section->nodes; l; l = l->next) {
+        BlockDriverState *bs = l->data;
         AioContext *aio_context = bdrv_get_aio_context(bs);
 
         aio_context_acquire(aio_context);
         bdrv_io_unplugged_end(bs);
-        bdrv_parent_drained_end(bs);
+        assert(bs->quiesce_counter > 0);
+        if (--bs->quiesce_counter == 0) {
+            bdrv_parent_drained_end(bs);
+            aio_enable_external(aio_context);
+        }
         aio_context_release(aio_context);
+        bdrv_unref(bs);
     }
-    g_slist_free(aio_ctxs);
+    g_slist_free(section->nodes);
 
-    job = NULL;
-    while ((job = block_job_next(job))) {
+    for (l = section->jobs; l; l = l->next) {
+        BlockJob *job = l->data;
         AioContext *aio_context = blk_get_aio_context(job->blk);
 
         aio_context_acquire(aio_context);
         block_job_resume(job);
         aio_context_release(aio_context);
+        block_job_unref(job);
     }
+    g_slist_free(section->jobs);
+
+    g_free(section);
+}
+
+/*
+ * Wait for pending requests to complete across all BlockDriverStates
+ *
+ * This function does not flush data to disk, use bdrv_flush_all() for that
+ * after calling this function.
+ */
+void bdrv_drain_all(void)
+{
+    bdrv_drain_all_begin();
+    bdrv_drain_all_end();
 }
 
 /**
@@ -1299,6 +1359,8 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->write_offset = offset;
+    req->write_qiov = qiov;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1349,6 +1411,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     ++bs->write_gen;
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
 
+    req->write_ret = ret;
+    notifier_list_notify(&bs->after_write_notifiers, req);
+    req->write_qiov = NULL;
+
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
     }
@@ -1615,6 +1681,156 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *src_bs, *dst_bs;
+    BdrvTrackedRequest req;
+    int64_t start_sector, end_sector;
+    int ret;
+
+    if (!src || !dst || !src->bs || !dst->bs) {
+        return -ENOMEDIUM;
+    }
+    src_bs = src->bs;
+    dst_bs = dst->bs;
+
+    if (!src_bs->drv || !dst_bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst_bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst_bs->open_flags & BDRV_O_INACTIVE));
+
+    ret = bdrv_check_byte_request(src_bs, src_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst_bs, dst_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+
+    /* Offloading bypasses the read-modify-write and decryption paths, so
+     * leave anything that would need them to the bounce buffer copy */
+    if (bdrv_is_encrypted(src_bs) || bdrv_is_encrypted(dst_bs) ||
+        !QEMU_IS_ALIGNED(src_offset | bytes, src_bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst_bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        if (!src_bs->drv->bdrv_co_copy_range_from) {
+            return -ENOTSUP;
+        }
+
+        tracked_request_begin(&req, src_bs, src_offset, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = src_bs->drv->bdrv_co_copy_range_from(src_bs, src, src_offset,
+                                                   dst, dst_offset,
+                                                   bytes, flags);
+
+        tracked_request_end(&req);
+        return ret;
+    }
+
+    if (!dst_bs->drv->bdrv_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+
+    start_sector = dst_offset >> BDRV_SECTOR_BITS;
+    end_sector = DIV_ROUND_UP(dst_offset + bytes, BDRV_SECTOR_SIZE);
+
+    tracked_request_begin(&req, dst_bs, dst_offset, bytes,
+                          BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+
+    req.write_offset = dst_offset;
+    ret = notifier_with_return_list_notify(&dst_bs->before_write_notifiers,
+                                           &req);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = dst_bs->drv->bdrv_co_copy_range_to(dst_bs, src, src_offset,
+                                             dst, dst_offset, bytes, flags);
+    if (ret == -ENOTSUP) {
+        /* Nothing was written, the caller falls back to a regular copy */
+        goto out;
+    }
+    if (ret >= 0 && (flags & BDRV_REQ_FUA)) {
+        ret = bdrv_co_flush(dst_bs);
+    }
+
+    ++dst_bs->write_gen;
+    bdrv_set_dirty(dst_bs, start_sector, end_sector - start_sector);
+
+    req.write_ret = ret;
+    notifier_list_notify(&dst_bs->after_write_notifiers, &req);
+
+    if (dst_bs->wr_highest_offset < dst_offset + bytes) {
+        dst_bs->wr_highest_offset = dst_offset + bytes;
+    }
+
+    if (ret >= 0) {
+        dst_bs->total_sectors = MAX(dst_bs->total_sectors, end_sector);
+        ret = 0;
+    }
+
+out:
+    tracked_request_end(&req);
+    return ret;
+}
+
+/*
+ * Copy a range from @src to @dst, starting the driver recursion at the
+ * source side.  Drivers call this from their .bdrv_co_copy_range_from to
+ * pass the request down to a child node.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                  bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/*
+ * Copy a range from @src to @dst, continuing the driver recursion at the
+ * destination side once the source has been resolved to its bottom node.
+ */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 typedef struct BdrvCoGetBlockStatusData {
     BlockDriverState *bs;
     BlockDriverState *base;
@@ -2223,12 +2439,50 @@ BlockAIOCB *bdrv_aio_pdiscard(BlockDriverState *bs, int64_t offset, int count,
     return &acb->common;
 }
 
+/* AIOCBs up to AIOCB_POOL_OBJ_SIZE bytes are all allocated with that size
+ * and recycled through a thread-local free list.  An AIOCB normally
+ * completes in the AioContext that submitted it, so the list acts as the
+ * per-AioContext pool; it keeps as many AIOCBs as were in flight at once,
+ * up to AIOCB_POOL_MAX_SIZE, and the hot path does not allocate.
+ */
+enum {
+    AIOCB_POOL_OBJ_SIZE = 256,
+    AIOCB_POOL_MAX_SIZE = 1024,
+};
+
+typedef struct AIOCBFree {
+    struct AIOCBFree *next;
+} AIOCBFree;
+
+static __thread AIOCBFree *aiocb_pool;
+static __thread unsigned int aiocb_pool_size;
+static __thread Notifier aiocb_pool_cleanup_notifier;
+
+static void aiocb_pool_cleanup(Notifier *n, void *value)
+{
+    AIOCBFree *p;
+
+    while ((p = aiocb_pool)) {
+        aiocb_pool = p->next;
+        g_free(p);
+    }
+    aiocb_pool_size = 0;
+}
+
 void *qemu_aio_get(const AIOCBInfo *aiocb_info, BlockDriverState *bs,
                    BlockCompletionFunc *cb, void *opaque)
 {
     BlockAIOCB *acb;
 
-    acb = g_malloc(aiocb_info->aiocb_size);
+    if (aiocb_info->aiocb_size > AIOCB_POOL_OBJ_SIZE) {
+        acb = g_malloc(aiocb_info->aiocb_size);
+    } else if (aiocb_pool) {
+        acb = (BlockAIOCB *)aiocb_pool;
+        aiocb_pool = aiocb_pool->next;
+        aiocb_pool_size--;
+    } else {
+        acb = g_malloc(AIOCB_POOL_OBJ_SIZE);
+    }
     acb->aiocb_info = aiocb_info;
     acb->bs = bs;
     acb->cb = cb;
@@ -2246,10 +2500,24 @@ void qemu_aio_ref(void *p)
 void qemu_aio_unref(void *p)
 {
     BlockAIOCB *acb = p;
+    AIOCBFree *f = p;
+
     assert(acb->refcnt > 0);
-    if (--acb->refcnt == 0) {
+    if (--acb->refcnt > 0) {
+        return;
+    }
+    if (acb->aiocb_info->aiocb_size > AIOCB_POOL_OBJ_SIZE ||
+        aiocb_pool_size >= AIOCB_POOL_MAX_SIZE) {
         g_free(acb);
+        return;
+    }
+    if (!aiocb_pool_cleanup_notifier.notify) {
+        aiocb_pool_cleanup_notifier.notify = aiocb_pool_cleanup;
+        qemu_thread_atexit_add(&aiocb_pool_cleanup_notifier);
     }
+    f->next = aiocb_pool;
+    aiocb_pool = f;
+    aiocb_pool_size++;
 }
 
 /**************************************************************/
@@ -2489,6 +2757,8 @@ out:
     ++bs->write_gen;
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
+    req.write_ret = ret;
+    notifier_list_notify(&bs->after_write_notifiers, &req);
     tracked_request_end(&req);
     return ret;
 }
@@ -2669,6 +2939,11 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier)
+{
+    notifier_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BdrvChild *child;
@@ -0,0 +1,393 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+
+#include <liburing.h>
+
+/*
+ * Queue size (per-AioContext).
+ *
+ * Requests beyond what the ring can hold stay in the submission queue and
+ * are pushed to the kernel as completions free up entries.
+ */
+#define MAX_ENTRIES 128
+
+/*
+ * Number of fixed file slots.  Registered files save the kernel an fget/fput
+ * pair per request; once the table is full further files simply use their
+ * normal descriptor.
+ */
+#define MAX_FIXED_FILES 64
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may complete short before EOF.  The remainder is
+     * resubmitted from this iovec until the kernel returns zero bytes.
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* Fixed file table, -1 marks a free slot */
+    bool fixed_files;
+    int fixed_fds[MAX_FIXED_FILES];
+};
+
+static void ioq_submit(LuringState *s);
+
+/*
+ * Completes an AIO request (stores the result and enters the coroutine).
+ */
+static void luring_process_completion(LuringAIOCB *luringcb, int ret)
+{
+    if (ret >= 0) {
+        int total = luringcb->total_read + ret;
+
+        if (total == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, total, 0,
+                              luringcb->qiov->size - total);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+
+    if (luringcb->resubmit_qiov.iov != NULL) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+
+    luringcb->ret = ret;
+    qemu_coroutine_enter(luringcb->co);
+}
+
+/*
+ * Requeues the unread tail of a request whose read completed short.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/* The completion BH reaps the completion queue and enters the coroutines
+ * waiting for the requests.
+ *
+ * Like its linux-aio counterpart, it supports nested event loops: each CQE
+ * is consumed before its coroutine is entered, and the BH reschedules itself
+ * so that a nested aio_poll() picks up whatever is left.  When the completion
+ * queue is empty the BH returns without rescheduling.
+ */
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        if (luringcb->is_read && ret > 0 &&
+            luringcb->total_read + ret < luringcb->qiov->size) {
+            luring_resubmit_short_read(s, luringcb, ret);
+            continue;
+        }
+
+        luring_process_completion(luringcb, ret);
+    }
+
+    if (!s->io_q.plugged && !QSIMPLEQ_EMPTY(&s->io_q.submit_queue)) {
+        ioq_submit(s);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+/*
+ * Completions are posted to the shared CQ ring, so they can be noticed
+ * without a system call.  Scheduling the BH from the event loop taking
+ * the request keeps them from waiting for the ring fd to be polled.
+ */
+static void luring_poll_completions(LuringState *s)
+{
+    if (io_uring_cq_ready(&s->ring)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    qemu_luring_completion_bh(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    int ret;
+    LuringAIOCB *luringcb, *luringcb_next;
+
+    while (s->io_q.in_queue > 0) {
+        /*
+         * Try to fill the submission ring.  Requests that do not fit stay
+         * queued until completions make room for them.
+         */
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* -EAGAIN/-EBUSY: retry once completions have been reaped */
+            break;
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    luring_poll_completions(s);
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(int fd, int fixed_index, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+    if (fixed_index >= 0) {
+        assert(s->fixed_fds[fixed_index] == fd);
+        sqe->fd = fixed_index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  int fixed_index, uint64_t offset,
+                                  QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(fd, fixed_index, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_coroutine_yield();
+    return luringcb.ret;
+}
+
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->fixed_files) {
+        return -1;
+    }
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == -1) {
+            break;
+        }
+    }
+    if (i == MAX_FIXED_FILES) {
+        return -1;
+    }
+
+    if (io_uring_register_files_update(&s->ring, i, &fd, 1) != 1) {
+        return -1;
+    }
+    s->fixed_fds[i] = fd;
+    return i;
+}
+
+void luring_unregister_fd(LuringState *s, int fixed_index)
+{
+    int fd = -1;
+
+    assert(fixed_index >= 0 && fixed_index < MAX_FIXED_FILES);
+    assert(s->fixed_fds[fixed_index] != -1);
+
+    /* The kernel drops its reference once in-flight requests complete */
+    if (io_uring_register_files_update(&s->ring, fixed_index, &fd, 1) != 1) {
+        fprintf(stderr, "%s: failed to unregister fixed file %d\n",
+                        __func__, fixed_index);
+    }
+    s->fixed_fds[fixed_index] = -1;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(new_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_bh, NULL, s);
+    aio_set_fd_poll(new_context, s->ring.ring_fd, qemu_luring_poll_cb);
+}
+
+LuringState *luring_init(void)
+{
+    LuringState *s;
+    int i;
+
+    s = g_malloc0(sizeof(*s));
+    if (io_uring_queue_init(MAX_ENTRIES, &s->ring, 0) < 0) {
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+
+    /* Sparse tables need Linux 5.5; without them just use plain fds */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    s->fixed_files = io_uring_register_files(&s->ring, s->fixed_fds,
+                                             MAX_FIXED_FILES) == 0;
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
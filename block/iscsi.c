@@ -48,14 +48,28 @@
 #include <scsi/sg.h>
 #endif
 
+typedef struct IscsiSession {
+    struct iscsi_context *iscsi;
+    struct IscsiLun *iscsilun;
+    int events;
+    int in_flight;
+    bool request_timed_out;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* The first session, which carries everything but reads and writes */
     struct iscsi_context *iscsi;
+    /* Reads and writes go to the least busy of these */
+    IscsiSession *sessions;
+    int nr_sessions;
+    int next_session;
+    int queue_depth;
+    CoQueue session_queue;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -85,7 +99,6 @@ typedef struct IscsiLun {
     bool lbprz;
     bool dpofua;
     bool has_write_same;
-    bool request_timed_out;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -97,6 +110,7 @@ typedef struct IscsiTask {
     Coroutine *co;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     QEMUTimer retry_timer;
     int err_code;
 } IscsiTask;
@@ -121,6 +135,7 @@ typedef struct IscsiAIOCB {
 #define EVENT_INTERVAL 1000
 #define NOP_INTERVAL 5000
 #define MAX_NOP_FAILURES 3
+#define ISCSI_MAX_SESSIONS 16
 #define ISCSI_CMD_RETRIES ARRAY_SIZE(iscsi_retry_times)
 static const unsigned iscsi_retry_times[] = {8, 32, 128, 512, 2048, 8192, 32768};
 
@@ -278,7 +293,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
                     /* make sure the request is rescheduled AFTER the
                      * reconnect is initiated */
                     retry_time = EVENT_INTERVAL * 2;
-                    iTask->iscsilun->request_timed_out = true;
+                    iTask->session->request_timed_out = true;
                 }
                 error_report("iSCSI Busy/TaskSetFull/TimeOut"
                              " (retry #%u in %u ms): %s",
@@ -312,9 +327,47 @@ static void iscsi_co_init_iscsitask(IscsiLun *iscsilun, struct IscsiTask *iTask)
     *iTask = (struct IscsiTask) {
         .co         = qemu_coroutine_self(),
         .iscsilun   = iscsilun,
+        .session    = &iscsilun->sessions[0],
     };
 }
 
+/* Pick the session for a read or write, waiting while all of them are at
+ * the queue depth limit.  Ties go round robin so that even a light load
+ * is spread over the connections.
+ */
+static IscsiSession *coroutine_fn iscsi_co_get_session(IscsiLun *iscsilun)
+{
+    IscsiSession *s, *best;
+    int i;
+
+    for (;;) {
+        best = NULL;
+        for (i = 0; i < iscsilun->nr_sessions; i++) {
+            s = &iscsilun->sessions[(iscsilun->next_session + i) %
+                                    iscsilun->nr_sessions];
+            if (!best || s->in_flight < best->in_flight) {
+                best = s;
+            }
+        }
+        if (!iscsilun->queue_depth || best->in_flight < iscsilun->queue_depth) {
+            break;
+        }
+        qemu_co_queue_wait(&iscsilun->session_queue);
+    }
+
+    iscsilun->next_session = (best - iscsilun->sessions + 1) %
+                             iscsilun->nr_sessions;
+    best->in_flight++;
+    return best;
+}
+
+static void coroutine_fn iscsi_co_put_session(IscsiLun *iscsilun,
+                                              IscsiSession *s)
+{
+    s->in_flight--;
+    qemu_co_queue_next(&iscsilun->session_queue);
+}
+
 static void
 iscsi_abort_task_cb(struct iscsi_context *iscsi, int status, void *command_data,
                     void *private_data)
@@ -351,36 +404,41 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *s)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = s->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsi),
+    if (ev != s->events) {
+        aio_set_fd_handler(s->iscsilun->aio_context, iscsi_get_fd(iscsi),
                            false,
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           s);
+        s->events = ev;
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
 
-    if (iscsilun->request_timed_out) {
-        iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+        /* check for timed out requests */
+        iscsi_service(s->iscsi, 0);
+
+        if (s->request_timed_out) {
+            s->request_timed_out = false;
+            iscsi_reconnect(s->iscsi);
+        }
 
-    /* newer versions of libiscsi may return zero events. Ensure we are able
-     * to return to service once this situation changes. */
-    iscsi_set_events(iscsilun);
+        /* newer versions of libiscsi may return zero events. Ensure we are
+         * able to return to service once this situation changes. */
+        iscsi_set_events(s);
+    }
 
     timer_mod(iscsilun->event_timer,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
@@ -389,21 +447,19 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *s = arg;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(s->iscsi, POLLIN);
+    iscsi_set_events(s);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *s = arg;
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(s->iscsi, POLLOUT);
+    iscsi_set_events(s);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -593,25 +649,29 @@ iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     lba = sector_qemu2lun(sector_num, iscsilun);
     num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
     iscsi_co_init_iscsitask(iscsilun, &iTask);
+    iTask.session = iscsi_co_get_session(iscsilun);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write16_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write10_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     }
     if (iTask.task == NULL) {
+        iscsi_co_put_session(iscsilun, iTask.session);
         return -ENOMEM;
     }
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -624,6 +684,7 @@ retry:
         iTask.complete = 0;
         goto retry;
     }
+    iscsi_co_put_session(iscsilun, iTask.session);
 
     if (iTask.status != SCSI_STATUS_GOOD) {
         iscsi_allocmap_set_invalid(iscsilun, sector_num, nb_sectors);
@@ -675,7 +736,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -790,26 +851,28 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
     num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
+    iTask.session = iscsi_co_get_session(iscsilun);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                       num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_read16_task(iTask.session->iscsi, iscsilun->lun,
+                                       lba, num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                       num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_read10_task(iTask.session->iscsi, iscsilun->lun,
+                                       lba, num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     }
     if (iTask.task == NULL) {
+        iscsi_co_put_session(iscsilun, iTask.session);
         return -ENOMEM;
     }
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -822,6 +885,7 @@ retry:
         iTask.complete = 0;
         goto retry;
     }
+    iscsi_co_put_session(iscsilun, iTask.session);
 
     if (iTask.status != SCSI_STATUS_GOOD) {
         return iTask.err_code;
@@ -843,7 +907,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1022,7 +1086,7 @@ static BlockAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(&iscsilun->sessions[0]);
 
     return &acb->common;
 }
@@ -1066,7 +1130,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1157,7 +1221,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1346,20 +1410,47 @@ static int parse_timeout(const char *target)
     return 0;
 }
 
+static int parse_number(const char *target, const char *name, int def)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+        if (opts) {
+            return qemu_opt_get_number(opts, name, def);
+        }
+    }
+
+    return def;
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
+
+        if (iscsi_get_nops_in_flight(s->iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            s->request_timed_out = true;
+        } else if (iscsi_nop_out_async(s->iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 }
 
 static void iscsi_readcapacity_sync(IscsiLun *iscsilun, Error **errp)
@@ -1487,10 +1578,15 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsilun->iscsi),
-                       false, NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
+
+        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(s->iscsi),
+                           false, NULL, NULL, NULL);
+        s->events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1508,9 +1604,12 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
     iscsilun->aio_context = new_context;
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->nr_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
@@ -1563,57 +1662,25 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+/* Create a context for @iscsi_url and log it in */
+static int iscsi_connect(struct iscsi_context **piscsi,
+                         struct iscsi_url *iscsi_url,
+                         const char *initiator_name, Error **errp)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
+    struct iscsi_context *iscsi;
     Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    int ret, timeout;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1622,7 +1689,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1631,13 +1698,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1647,7 +1714,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     /* timeout handling is broken in libiscsi before 1.15.0 */
@@ -1664,9 +1731,111 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    *piscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+/* Log out and free the sessions beyond the first one */
+static void iscsi_destroy_extra_sessions(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 1; i < iscsilun->nr_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_is_logged_in(iscsi)) {
+            iscsi_logout_sync(iscsi);
+        }
+        iscsi_destroy_context(iscsi);
+    }
+    g_free(iscsilun->sessions);
+    iscsilun->sessions = NULL;
+    iscsilun->nr_sessions = 0;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, nr_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
         goto out;
     }
 
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    ret = iscsi_connect(&iscsi, iscsi_url, initiator_name, errp);
+    if (ret) {
+        goto out;
+    }
+
+    nr_sessions = parse_number(iscsi_url->target, "sessions", 1);
+    if (nr_sessions < 1 || nr_sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
+        goto out;
+    }
+    iscsilun->queue_depth = parse_number(iscsi_url->target, "queue-depth", 0);
+    if (iscsilun->queue_depth < 0) {
+        error_setg(errp, "iSCSI: queue-depth must not be negative");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    iscsilun->sessions = g_new0(IscsiSession, nr_sessions);
+    qemu_co_queue_init(&iscsilun->session_queue);
+    while (iscsilun->nr_sessions < nr_sessions) {
+        IscsiSession *s = &iscsilun->sessions[iscsilun->nr_sessions];
+
+        if (iscsilun->nr_sessions == 0) {
+            s->iscsi = iscsi;
+        } else {
+            ret = iscsi_connect(&s->iscsi, iscsi_url, initiator_name, errp);
+            if (ret) {
+                goto out;
+            }
+        }
+        s->iscsilun = iscsilun;
+        iscsilun->nr_sessions++;
+    }
+
     iscsilun->iscsi = iscsi;
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
@@ -1780,6 +1949,7 @@ out:
     }
 
     if (ret) {
+        iscsi_destroy_extra_sessions(iscsilun);
         if (iscsi != NULL) {
             if (iscsi_is_logged_in(iscsi)) {
                 iscsi_logout_sync(iscsi);
@@ -1797,6 +1967,7 @@ static void iscsi_close(BlockDriverState *bs)
     struct iscsi_context *iscsi = iscsilun->iscsi;
 
     iscsi_detach_aio_context(bs);
+    iscsi_destroy_extra_sessions(iscsilun);
     if (iscsi_is_logged_in(iscsi)) {
         iscsi_logout_sync(iscsi);
     }
@@ -1938,6 +2109,7 @@ static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = 0;
 out:
+    iscsi_destroy_extra_sessions(iscsilun);
     if (iscsilun->iscsi != NULL) {
         iscsi_destroy_context(iscsilun->iscsi);
     }
@@ -2040,6 +2212,16 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
             .help = "Request timeout in seconds (default 0 = no timeout)",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions to spread reads and writes over "
+                    "(default 1)",
+        },{
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum requests in flight per session "
+                    "(default 0 = no limit)",
         },
         { /* end of list */ }
     },
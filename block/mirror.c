@@ -34,6 +34,21 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+/* A guest write to the source in write-blocking copy mode */
+typedef struct MirrorActiveWrite {
+    BdrvTrackedRequest *req;
+    int64_t offset;
+    int64_t bytes;
+    /* The data has been written to the target */
+    bool mirrored;
+    /* Other writes to the same chunks ran concurrently, so their
+     * order on the target may differ from the source */
+    bool contended;
+    /* The first and last chunk were clean when the write started */
+    bool first_clean, last_clean;
+    QLIST_ENTRY(MirrorActiveWrite) next;
+} MirrorActiveWrite;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -67,8 +82,16 @@ typedef struct MirrorBlockJob {
     int ret;
     bool unmap;
     bool waiting_for_io;
+    /* Copy the data inside the host kernel while the drivers support it */
+    bool use_copy_range;
     int target_cluster_sectors;
     int max_iov;
+
+    MirrorCopyMode copy_mode;
+    bool active;
+    NotifierWithReturn before_write;
+    Notifier after_write;
+    QLIST_HEAD(, MirrorActiveWrite) active_writes;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -164,6 +187,29 @@ static void mirror_read_complete(void *opaque, int ret)
                     0, mirror_write_complete, op);
 }
 
+/* Offloads the copy of op's range to the block layer.  The buffers are still
+ * taken from the pool, so the fallback to a regular read and write does not
+ * have to wait for them.
+ */
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                            s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                            op->nb_sectors * BDRV_SECTOR_SIZE, 0);
+    if (ret == -ENOTSUP) {
+        s->use_copy_range = false;
+        ret = blk_co_preadv(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                            op->qiov.size, &op->qiov, 0);
+        mirror_read_complete(op, ret);
+        return;
+    }
+    mirror_write_complete(op, ret);
+}
+
 static inline void mirror_clip_sectors(MirrorBlockJob *s,
                                        int64_t sector_num,
                                        int *nb_sectors)
@@ -220,6 +266,178 @@ static inline void mirror_wait_for_io(MirrorBlockJob *s)
     s->waiting_for_io = false;
 }
 
+static bool mirror_active_write_overlaps(MirrorBlockJob *s, int64_t chunk)
+{
+    MirrorActiveWrite *w;
+
+    QLIST_FOREACH(w, &s->active_writes, next) {
+        if (w->offset / s->granularity <= chunk &&
+            chunk <= (w->offset + w->bytes - 1) / s->granularity) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A background copy of these chunks is starting */
+static void mirror_contend_active_writes(MirrorBlockJob *s,
+                                         int64_t first_chunk,
+                                         int64_t nb_chunks)
+{
+    MirrorActiveWrite *w;
+
+    QLIST_FOREACH(w, &s->active_writes, next) {
+        if (w->offset / s->granularity < first_chunk + nb_chunks &&
+            first_chunk <= (w->offset + w->bytes - 1) / s->granularity) {
+            w->contended = true;
+        }
+    }
+}
+
+static MirrorActiveWrite *mirror_find_active_write(MirrorBlockJob *s,
+                                                   BdrvTrackedRequest *req)
+{
+    MirrorActiveWrite *w;
+
+    QLIST_FOREACH(w, &s->active_writes, next) {
+        if (w->req == req) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/* In write-blocking mode, guest writes are copied to the target before
+ * they are submitted to the source.  Once the source write has completed
+ * and set the dirty bits, mirror_after_write_notify() clears them again,
+ * since the target already has the data.
+ *
+ * This is only safe if nothing else touched the same chunks meanwhile:
+ * background copies in flight, concurrent guest writes, zero writes and
+ * discards (which are not copied) all make the write contended, and its
+ * chunks are left to the background copy.  mirror_iteration() does not
+ * start copies of chunks with active writes in flight.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    BlockDriverState *bs = blk_bs(s->common.blk);
+    QEMUIOVector *qiov = req->write_qiov;
+    MirrorActiveWrite *w, *other;
+    int64_t first_chunk, last_chunk, chunk_sectors;
+    int ret;
+
+    assert(req->bs == bs);
+
+    w = g_new0(MirrorActiveWrite, 1);
+    w->req = req;
+    if (qiov) {
+        w->offset = req->write_offset;
+        w->bytes = qiov->size;
+    } else {
+        w->offset = req->offset;
+        w->bytes = req->bytes;
+    }
+    if (w->offset >= s->bdev_length || w->bytes == 0) {
+        g_free(w);
+        return 0;
+    }
+    w->bytes = MIN(w->bytes, s->bdev_length - w->offset);
+
+    first_chunk = w->offset / s->granularity;
+    last_chunk = (w->offset + w->bytes - 1) / s->granularity;
+    chunk_sectors = s->granularity >> BDRV_SECTOR_BITS;
+
+    QLIST_FOREACH(other, &s->active_writes, next) {
+        if (other->offset / s->granularity <= last_chunk &&
+            first_chunk <= (other->offset + other->bytes - 1) /
+                           s->granularity) {
+            other->contended = true;
+            w->contended = true;
+        }
+    }
+    if (find_next_bit(s->in_flight_bitmap, last_chunk + 1, first_chunk) <=
+        last_chunk) {
+        w->contended = true;
+    }
+    /* Without COW on the target, partial clusters must first be copied
+     * by mirror_iteration() */
+    if (s->cow_bitmap && (!test_bit(first_chunk, s->cow_bitmap) ||
+                          !test_bit(last_chunk, s->cow_bitmap))) {
+        w->contended = true;
+    }
+    w->first_clean = !bdrv_get_dirty(bs, s->dirty_bitmap,
+                                     first_chunk * chunk_sectors);
+    w->last_clean = !bdrv_get_dirty(bs, s->dirty_bitmap,
+                                    last_chunk * chunk_sectors);
+    QLIST_INSERT_HEAD(&s->active_writes, w, next);
+
+    if (!qiov || w->contended) {
+        return 0;
+    }
+
+    if (w->bytes == qiov->size) {
+        ret = blk_co_pwritev(s->target, w->offset, w->bytes, qiov, 0);
+    } else {
+        QEMUIOVector target_qiov;
+
+        qemu_iovec_init(&target_qiov, qiov->niov);
+        qemu_iovec_concat(&target_qiov, qiov, 0, w->bytes);
+        ret = blk_co_pwritev(s->target, w->offset, w->bytes, &target_qiov, 0);
+        qemu_iovec_destroy(&target_qiov);
+    }
+    trace_mirror_active_write(s, w->offset, w->bytes, ret);
+    w->mirrored = ret >= 0;
+
+    /* Errors are left to the background copy, which reports them */
+    return 0;
+}
+
+static void mirror_after_write_notify(Notifier *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    MirrorActiveWrite *w = mirror_find_active_write(s, req);
+    int64_t chunk, first_chunk, last_chunk, chunk_sectors, end;
+
+    if (!w) {
+        return;
+    }
+
+    first_chunk = w->offset / s->granularity;
+    last_chunk = (w->offset + w->bytes - 1) / s->granularity;
+    chunk_sectors = s->granularity >> BDRV_SECTOR_BITS;
+    end = s->bdev_length / BDRV_SECTOR_SIZE;
+
+    if (w->mirrored && !w->contended && req->write_ret >= 0) {
+        for (chunk = first_chunk; chunk <= last_chunk; chunk++) {
+            int64_t chunk_start = chunk * s->granularity;
+            int64_t chunk_end = MIN(chunk_start + s->granularity,
+                                    s->bdev_length);
+            bool covered = w->offset <= chunk_start &&
+                           chunk_end <= w->offset + w->bytes;
+
+            if (covered ||
+                (chunk == first_chunk && w->first_clean) ||
+                (chunk == last_chunk && w->last_clean)) {
+                bdrv_reset_dirty_bitmap(s->dirty_bitmap,
+                                        chunk * chunk_sectors,
+                                        MIN(chunk_sectors,
+                                            end - chunk * chunk_sectors));
+            }
+        }
+    }
+
+    QLIST_REMOVE(w, next);
+    g_free(w);
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
 /* Submit async read while handling COW.
  * Returns: The number of sectors copied after and including sector_num,
  *          excluding any sectors copied prior to sector_num due to alignment.
@@ -284,8 +502,13 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     s->sectors_in_flight += nb_sectors;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
 
-    blk_aio_preadv(source, sector_num * BDRV_SECTOR_SIZE, &op->qiov, 0,
-                   mirror_read_complete, op);
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        qemu_coroutine_enter(co);
+    } else {
+        blk_aio_preadv(source, sector_num * BDRV_SECTOR_SIZE, &op->qiov, 0,
+                       mirror_read_complete, op);
+    }
     return ret;
 }
 
@@ -320,10 +543,11 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = blk_bs(s->common.blk);
-    int64_t sector_num, first_chunk;
+    int64_t sector_num, first_chunk, dirty_end;
     uint64_t delay_ns = 0;
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
+    int max_chunks;
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
@@ -339,35 +563,41 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     }
 
     first_chunk = sector_num / sectors_per_chunk;
-    while (test_bit(first_chunk, s->in_flight_bitmap)) {
+    while (test_bit(first_chunk, s->in_flight_bitmap) ||
+           mirror_active_write_overlaps(s, first_chunk)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
         mirror_wait_for_io(s);
     }
 
     block_job_pause_point(&s->common);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
-    while (nb_chunks * sectors_per_chunk < (s->buf_size >> BDRV_SECTOR_BITS)) {
-        int64_t hbitmap_next;
-        int64_t next_sector = sector_num + nb_chunks * sectors_per_chunk;
-        int64_t next_chunk = next_sector / sectors_per_chunk;
-        if (next_sector >= end ||
-            !bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            break;
-        }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
+    /* Find the number of consecutive dirty chunks following the first dirty
+     * one that are not in flight.  The end of the dirty run is looked up in
+     * the bitmap a word at a time. */
+    max_chunks = MAX((s->buf_size >> BDRV_SECTOR_BITS) / sectors_per_chunk, 1);
+    dirty_end = bdrv_dirty_bitmap_next_zero(s->dirty_bitmap, sector_num,
+                                            max_chunks * sectors_per_chunk);
+    if (dirty_end < 0) {
+        dirty_end = sector_num + max_chunks * sectors_per_chunk;
+    }
+    dirty_end = MIN(dirty_end, end);
+    while (sector_num + nb_chunks * sectors_per_chunk < dirty_end) {
+        int64_t next_chunk = first_chunk + nb_chunks;
+        if (test_bit(next_chunk, s->in_flight_bitmap) ||
+            mirror_active_write_overlaps(s, next_chunk)) {
             break;
         }
+        nb_chunks++;
+    }
 
-        hbitmap_next = hbitmap_iter_next(&s->hbi);
-        if (hbitmap_next > next_sector || hbitmap_next < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
+    /* Move the iterator past the chunks that are taken now */
+    if (nb_chunks > 1) {
+        int64_t next_sector = sector_num + nb_chunks * sectors_per_chunk;
+        if (next_sector < end) {
             bdrv_set_dirty_iter(&s->hbi, next_sector);
-            hbitmap_next = hbitmap_iter_next(&s->hbi);
+        } else {
+            bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
         }
-        assert(hbitmap_next == next_sector);
-        nb_chunks++;
     }
 
     /* Clear dirty bits before querying the block status, because
@@ -377,6 +607,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
                             nb_chunks * sectors_per_chunk);
     bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
+    mirror_contend_active_writes(s, sector_num / sectors_per_chunk, nb_chunks);
     while (nb_chunks > 0 && sector_num < end) {
         int ret;
         int io_sectors, io_sectors_acct;
@@ -679,6 +910,18 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->before_write.notify = mirror_before_write_notify;
+        s->after_write.notify = mirror_after_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+        s->active = true;
+
+        /* Writes submitted before the notifiers were added could still
+         * complete after an active write marked their chunks clean */
+        bdrv_co_drain(bs);
+    }
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
         uint64_t delay_ns = 0;
@@ -780,6 +1023,15 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->active) {
+        notifier_with_return_remove(&s->before_write);
+        while (!QLIST_EMPTY(&s->active_writes)) {
+            mirror_wait_for_io(s);
+        }
+        notifier_remove(&s->after_write);
+        s->active = false;
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -912,11 +1164,12 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              BlockMirrorBackingMode backing_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
-                             bool is_none_mode, BlockDriverState *base)
+                             bool is_none_mode, BlockDriverState *base,
+                             bool auto_complete)
 {
     MirrorBlockJob *s;
 
@@ -952,6 +1205,12 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
+    s->copy_mode = copy_mode;
+    QLIST_INIT(&s->active_writes);
+    if (auto_complete) {
+        s->should_complete = true;
+    }
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -974,7 +1233,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -989,15 +1248,16 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, target, replaces,
                      speed, granularity, buf_size, backing_mode,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp, &mirror_job_driver, is_none_mode, base,
+                     false);
 }
 
 void commit_active_start(const char *job_id, BlockDriverState *bs,
                          BlockDriverState *base, int64_t speed,
                          BlockdevOnError on_error,
                          BlockCompletionFunc *cb,
-                         void *opaque, Error **errp)
+                         void *opaque, Error **errp, bool auto_complete)
 {
     int64_t length, base_length;
     int orig_base_flags;
@@ -1037,8 +1297,9 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
 
     mirror_start_job(job_id, bs, base, NULL, speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN,
-                     on_error, on_error, false, cb, opaque, &local_err,
-                     &commit_active_job_driver, false, base);
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
+                     &commit_active_job_driver, false, base, auto_complete);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error_restore_flags;
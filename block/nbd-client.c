@@ -171,27 +171,55 @@ static void nbd_co_receive_reply(NbdClientSession *s,
                                  struct nbd_reply *reply,
                                  QEMUIOVector *qiov)
 {
+    uint32_t error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return;
+        }
+
+        /* A structured reply comes in chunks, the last one has the done
+         * flag set.  The first error reported by the server wins.  */
+        ret = nbd_receive_reply_chunk(s->ioc, reply, request->from, qiov);
+        if (ret < 0) {
+            /* The stream is out of sync, let the read handler fail */
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            reply->error = EIO;
+            s->reply.handle = 0;
+            return;
+        }
+        if (!error) {
+            error = reply->error;
         }
 
-        /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            break;
+        }
     }
+
+    reply->error = error;
 }
 
 static void nbd_coroutine_start(NbdClientSession *s,
@@ -375,7 +403,7 @@ int nbd_client_init(BlockDriverState *bs,
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 &client->nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
+                                &client->ioc, &client->structured_reply,
                                 &client->size, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
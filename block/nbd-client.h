@@ -22,6 +22,7 @@ typedef struct NbdClientSession {
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     uint16_t nbdflags;
     off_t size;
+    bool structured_reply;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -119,6 +119,8 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(blk));
+        info->has_group_weight = true;
+        info->group_weight = throttle_group_get_weight(blk);
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -361,6 +363,35 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_stats(BlockLatencyHistogram *hist, bool *has)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries, **bins;
+    int i;
+
+    *has = hist->nbins > 0;
+    if (!*has) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -395,6 +426,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_READ],
+        &ds->has_rd_latency_histogram);
+    ds->wr_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_WRITE],
+        &ds->has_wr_latency_histogram);
+    ds->flush_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_FLUSH],
+        &ds->has_flush_latency_histogram);
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -0,0 +1,1208 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/* NOTICE: BME here means Bitmaps Extension and used as a namespace for
+ * _internal_ constants. Please do not use this _internal_ abbreviation for
+ * other needs and/or outside of this file. */
+
+/* Bitmap directory entry constraints */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE (1U << 2)
+
+/* bits [1, 8] U [56, 63] are reserved */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows  */
+    /* name follows  */
+} Qcow2BitmapDirEntry;
+
+typedef enum BitmapType {
+    BT_DIRTY_TRACKING_BITMAP = 1
+} BitmapType;
+
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static int check_table_entry(uint64_t entry, int cluster_size)
+{
+    uint64_t offset;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    if (offset != 0) {
+        /* if offset specified, bit 0 is reserved */
+        if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            return -EINVAL;
+        }
+
+        if (offset % cluster_size != 0) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/* Number of bitmap table entries a bitmap of @granularity_bits needs to cover
+ * @nb_sectors sectors of guest data */
+static uint64_t calc_table_size(BDRVQcow2State *s, int64_t nb_sectors,
+                                int granularity_bits)
+{
+    uint64_t sectors_per_bit = 1ULL << (granularity_bits - BDRV_SECTOR_BITS);
+    uint64_t nb_bits = DIV_ROUND_UP(nb_sectors, sectors_per_bit);
+
+    return DIV_ROUND_UP(nb_bits, (uint64_t)s->cluster_size * 8);
+}
+
+static int bitmap_table_load(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **bitmap_table)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+    uint64_t *table;
+
+    assert(bm->table_size != 0);
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    assert(bm->table_size <= BME_MAX_TABLE_SIZE);
+    ret = bdrv_pread(bs->file, bm->table_offset,
+                     table, bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; ++i) {
+        be64_to_cpus(&table[i]);
+        ret = check_table_entry(table[i], s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+
+    return ret;
+}
+
+static void free_bitmap_clusters(BlockDriverState *bs, uint64_t *bitmap_table,
+                                 uint32_t bitmap_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bitmap_table_size; ++i) {
+        uint64_t addr = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (addr != 0) {
+            qcow2_free_clusters(bs, addr, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+}
+
+/* Frees the bitmap table and all data clusters of @bm */
+static int free_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    uint64_t *bitmap_table;
+    int ret;
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    free_bitmap_clusters(bs, bitmap_table, bm->table_size);
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    g_free(bitmap_table);
+
+    return 0;
+}
+
+static void set_dirty_range(BdrvDirtyBitmap *bitmap, int64_t start,
+                            int64_t count)
+{
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+
+    if (start < size) {
+        bdrv_set_dirty_bitmap(bitmap, start, MIN(count, size - start));
+    }
+}
+
+/* Deserializes the bitmap data of @bm into @bitmap.  Bit i of byte j in a
+ * data cluster covers granule j * 8 + i of the part of the image described by
+ * that cluster. */
+static int load_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            const uint64_t *bitmap_table,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sectors_per_bit = 1ULL << (bm->granularity_bits -
+                                        BDRV_SECTOR_BITS);
+    uint64_t bits_per_cluster = (uint64_t)s->cluster_size * 8;
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < bm->table_size; ++i) {
+        uint64_t entry = bitmap_table[i];
+        uint64_t data_offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+        int64_t start = i * bits_per_cluster * sectors_per_bit;
+        uint64_t j, run;
+
+        if (data_offset == 0) {
+            if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                set_dirty_range(bitmap, start,
+                                bits_per_cluster * sectors_per_bit);
+            }
+            /* else the whole cluster reads as zeros */
+            continue;
+        }
+
+        ret = bdrv_pread(bs->file, data_offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = 0;
+
+        j = 0;
+        while (j < bits_per_cluster) {
+            if (j % 8 == 0 && buf[j / 8] == 0) {
+                j += 8;
+                continue;
+            }
+            if (!(buf[j / 8] & (1 << (j % 8)))) {
+                j++;
+                continue;
+            }
+
+            for (run = j + 1; run < bits_per_cluster; run++) {
+                if (!(buf[run / 8] & (1 << (run % 8)))) {
+                    break;
+                }
+            }
+            set_dirty_range(bitmap, start + j * sectors_per_bit,
+                            (run - j) * sectors_per_bit);
+            j = run;
+        }
+    }
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                    Error **errp)
+{
+    int ret;
+    uint64_t *bitmap_table = NULL;
+    uint32_t granularity;
+    BdrvDirtyBitmap *bitmap = NULL;
+
+    granularity = 1U << bm->granularity_bits;
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
+    if (bitmap == NULL) {
+        return NULL;
+    }
+
+    if (bm->flags & BME_FLAG_IN_USE) {
+        /* The bitmap was not stored properly the last time the image was
+         * used, so nothing can be said about which areas are clean */
+        set_dirty_range(bitmap, 0, bdrv_dirty_bitmap_size(bitmap));
+    } else {
+        ret = bitmap_table_load(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not read the table of bitmap "
+                             "'%s' from image", bm->name);
+            goto fail;
+        }
+
+        ret = load_bitmap_data(bs, bm, bitmap_table, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s' from "
+                             "image", bm->name);
+            goto fail;
+        }
+        g_free(bitmap_table);
+    }
+
+    if (!(bm->flags & BME_FLAG_AUTO)) {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+    bdrv_dirty_bitmap_set_persistance(bitmap, true);
+
+    return bitmap;
+
+fail:
+    g_free(bitmap_table);
+    bdrv_release_dirty_bitmap(bs, bitmap);
+
+    return NULL;
+}
+
+/*
+ * Bitmap List
+ */
+
+/*
+ * Bitmap List private functions
+ * Only Bitmap List knows about bitmap directory structure in Qcow2.
+ */
+
+static inline void bitmap_dir_entry_to_cpu(Qcow2BitmapDirEntry *entry)
+{
+    be64_to_cpus(&entry->bitmap_table_offset);
+    be32_to_cpus(&entry->bitmap_table_size);
+    be32_to_cpus(&entry->flags);
+    be16_to_cpus(&entry->name_size);
+    be32_to_cpus(&entry->extra_data_size);
+}
+
+static inline void bitmap_dir_entry_to_be(Qcow2BitmapDirEntry *entry)
+{
+    cpu_to_be64s(&entry->bitmap_table_offset);
+    cpu_to_be32s(&entry->bitmap_table_size);
+    cpu_to_be32s(&entry->flags);
+    cpu_to_be16s(&entry->name_size);
+    cpu_to_be32s(&entry->extra_data_size);
+}
+
+static inline int calc_dir_entry_size(size_t name_size, size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) +
+                    name_size + extra_data_size, 8);
+}
+
+static inline int dir_entry_size(Qcow2BitmapDirEntry *entry)
+{
+    return calc_dir_entry_size(entry->name_size, entry->extra_data_size);
+}
+
+static inline const char *dir_entry_name_field(Qcow2BitmapDirEntry *entry)
+{
+    return (const char *)(entry + 1) + entry->extra_data_size;
+}
+
+static inline Qcow2BitmapDirEntry *next_dir_entry(Qcow2BitmapDirEntry *entry)
+{
+    return (Qcow2BitmapDirEntry *)((uint8_t *)entry + dir_entry_size(entry));
+}
+
+static int check_dir_entry(BlockDriverState *bs, Qcow2BitmapDirEntry *entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t expected_table_size;
+
+    if (entry->type != BT_DIRTY_TRACKING_BITMAP ||
+        entry->granularity_bits > BME_MAX_GRANULARITY_BITS ||
+        entry->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        entry->name_size == 0 ||
+        entry->name_size > BME_MAX_NAME_SIZE ||
+        entry->flags & BME_RESERVED_FLAGS ||
+        entry->bitmap_table_size == 0 ||
+        entry->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        entry->bitmap_table_offset == 0 ||
+        offset_into_cluster(s, entry->bitmap_table_offset)) {
+        return -EINVAL;
+    }
+
+    /* The size of bitmaps that were in use can't be trusted, but they are
+     * never read anyway */
+    expected_table_size = calc_table_size(s, bs->total_sectors,
+                                          entry->granularity_bits);
+    if (!(entry->flags & BME_FLAG_IN_USE) &&
+        expected_table_size != entry->bitmap_table_size) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Bitmap List public functions
+ */
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    return bm_list;
+}
+
+static uint32_t bitmap_list_count(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+    uint32_t nb_bitmaps = 0;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        nb_bitmaps++;
+    }
+
+    return nb_bitmaps;
+}
+
+/* bitmap_list_load
+ * Get bitmap list from qcow2 image. Actually reads bitmap directory,
+ * checks it and convert to bitmap list.
+ */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t size, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir, *dir_end;
+    Qcow2BitmapDirEntry *e;
+    uint32_t nb_dir_entries = 0;
+    Qcow2BitmapList *bm_list = NULL;
+
+    if (size == 0) {
+        error_setg(errp, "Requested bitmap directory size is zero");
+        return NULL;
+    }
+
+    if (size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Requested bitmap directory size is too big");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Failed to allocate space for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file, offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = bitmap_list_new();
+    for (e = (Qcow2BitmapDirEntry *)dir;
+         e < (Qcow2BitmapDirEntry *)dir_end;
+         e = next_dir_entry(e))
+    {
+        Qcow2Bitmap *bm;
+
+        if ((uint8_t *)(e + 1) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail;
+        }
+        bitmap_dir_entry_to_cpu(e);
+
+        if ((uint8_t *)next_dir_entry(e) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (e->extra_data_size != 0) {
+            error_setg(errp, "Bitmap extra data is not supported");
+            goto fail;
+        }
+
+        ret = check_dir_entry(bs, e);
+        if (ret < 0) {
+            error_setg(errp, "Bitmap '%.*s' doesn't satisfy the constraints",
+                       e->name_size, dir_entry_name_field(e));
+            goto fail;
+        }
+
+        bm = g_new(Qcow2Bitmap, 1);
+        bm->table_offset = e->bitmap_table_offset;
+        bm->table_size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = g_strndup(dir_entry_name_field(e), e->name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail;
+    }
+
+    if ((uint8_t *)e != dir_end) {
+        goto broken_dir;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    error_setg(errp, "Broken bitmap directory");
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+
+    return NULL;
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, NULL);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR: could not load the bitmap directory\n");
+        res->corruptions++;
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table = NULL;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: could not load the table of bitmap "
+                    "'%s'\n", bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; ++i) {
+            uint64_t entry = bitmap_table[i];
+            uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           offset, s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+
+        g_free(bitmap_table);
+    }
+
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+/* bitmap_list_store
+ * Store bitmap list to qcow2 image as a bitmap directory.
+ * Everything is checked.
+ */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size, bool in_place)
+{
+    int ret;
+    uint8_t *dir;
+    int64_t dir_offset = 0;
+    uint64_t dir_size = 0;
+    Qcow2Bitmap *bm;
+    Qcow2BitmapDirEntry *e;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += calc_dir_entry_size(strlen(bm->name), 0);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EINVAL;
+    }
+
+    if (in_place) {
+        if (*size != dir_size || *offset == 0) {
+            return -EINVAL;
+        }
+
+        dir_offset = *offset;
+    }
+
+    dir = g_try_malloc0(dir_size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+
+    e = (Qcow2BitmapDirEntry *)dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        e->bitmap_table_offset = bm->table_offset;
+        e->bitmap_table_size = bm->table_size;
+        e->flags = bm->flags;
+        e->type = BT_DIRTY_TRACKING_BITMAP;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = strlen(bm->name);
+        e->extra_data_size = 0;
+        memcpy(e + 1, bm->name, e->name_size);
+
+        if (check_dir_entry(bs, e) < 0) {
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        e = next_dir_entry(e);
+    }
+
+    e = (Qcow2BitmapDirEntry *)dir;
+    while ((uint8_t *)e < dir + dir_size) {
+        Qcow2BitmapDirEntry *next = next_dir_entry(e);
+        bitmap_dir_entry_to_be(e);
+        e = next;
+    }
+
+    if (!in_place) {
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            goto fail;
+        }
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(dir);
+
+    if (!in_place) {
+        *size = dir_size;
+        *offset = dir_offset;
+    }
+
+    return 0;
+
+fail:
+    g_free(dir);
+
+    if (!in_place && dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return ret;
+}
+
+/*
+ * Bitmap List end
+ */
+
+static int update_ext_header_and_dir_in_place(BlockDriverState *bs,
+                                              Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS) ||
+        bm_list == NULL || QSIMPLEQ_EMPTY(bm_list) ||
+        bitmap_list_count(bm_list) != s->nb_bitmaps)
+    {
+        return -EINVAL;
+    }
+
+    ret = bitmap_list_store(bs, bm_list, &s->bitmap_directory_offset,
+                            &s->bitmap_directory_size, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The directory must be safely on disk before the caller starts to
+     * modify the image data it describes */
+    return bdrv_flush(bs->file->bs);
+}
+
+static int update_ext_header_and_dir(BlockDriverState *bs,
+                                     Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+    uint64_t new_offset = 0;
+    uint64_t new_size = 0;
+    uint32_t new_nb_bitmaps = 0;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autocl = s->autoclear_features;
+
+    if (bm_list != NULL && !QSIMPLEQ_EMPTY(bm_list)) {
+        new_nb_bitmaps = bitmap_list_count(bm_list);
+
+        if (new_nb_bitmaps > QCOW2_MAX_BITMAPS) {
+            return -EINVAL;
+        }
+
+        ret = bitmap_list_store(bs, bm_list, &new_offset, &new_size, false);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* Everything the new directory refers to must be on disk, with its
+     * refcounts, before the header starts to point to it */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmap_directory_offset = new_offset;
+    s->bitmap_directory_size = new_size;
+    s->nb_bitmaps = new_nb_bitmaps;
+    if (new_nb_bitmaps > 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (old_size > 0) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+
+fail:
+    if (new_offset > 0) {
+        qcow2_free_clusters(bs, new_offset, new_size, QCOW2_DISCARD_OTHER);
+    }
+
+    s->bitmap_directory_offset = old_offset;
+    s->bitmap_directory_size = old_size;
+    s->nb_bitmaps = old_nb_bitmaps;
+    s->autoclear_features = old_autocl;
+
+    return ret;
+}
+
+/*
+ * Loads all bitmaps stored in the image and marks them in use, so that an
+ * unclean shutdown is detected the next time the image is opened.
+ */
+void qcow2_load_persistent_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    GSList *created_dirty_bitmaps = NULL;
+    int ret;
+
+    assert(!bs->read_only);
+
+    if (s->nb_bitmaps == 0) {
+        /* No bitmaps - nothing to do */
+        s->bitmaps_loaded = true;
+        return;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+
+        if (bitmap != NULL) {
+            /* The image is being reopened after cache invalidation; the
+             * bitmap in memory is the current one */
+            if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+                error_setg(errp, "Bitmap '%s' already exists and is not "
+                           "persistent", bm->name);
+                goto fail;
+            }
+        } else {
+            bitmap = load_bitmap(bs, bm, errp);
+            if (bitmap == NULL) {
+                goto fail;
+            }
+            created_dirty_bitmaps = g_slist_append(created_dirty_bitmaps,
+                                                   bitmap);
+        }
+
+        bm->flags |= BME_FLAG_IN_USE;
+    }
+
+    ret = update_ext_header_and_dir_in_place(bs, bm_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't update bitmap directory");
+        goto fail;
+    }
+
+    s->bitmaps_loaded = true;
+    g_slist_free(created_dirty_bitmaps);
+    bitmap_list_free(bm_list);
+
+    return;
+
+fail:
+    while (created_dirty_bitmaps != NULL) {
+        bdrv_release_dirty_bitmap(bs, created_dirty_bitmaps->data);
+        created_dirty_bitmaps = g_slist_delete_link(created_dirty_bitmaps,
+                                                    created_dirty_bitmaps);
+    }
+    bitmap_list_free(bm_list);
+}
+
+static bool buffer_is_all_ones(const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != 0xff) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* store_bitmap_data()
+ * Store bitmap to image, filling bitmap table accordingly.
+ */
+static uint64_t *store_bitmap_data(BlockDriverState *bs,
+                                   BdrvDirtyBitmap *bitmap,
+                                   uint32_t *bitmap_table_size, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sectors_per_bit = 1ULL << (granularity_bits - BDRV_SECTOR_BITS);
+    uint64_t sectors_per_cluster = (uint64_t)s->cluster_size * 8 *
+                                   sectors_per_bit;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint8_t *buf = NULL;
+    HBitmapIter hbi;
+    uint64_t *tb;
+    uint64_t tb_size;
+    int64_t sector;
+
+    tb_size = calc_table_size(s, bdrv_dirty_bitmap_size(bitmap),
+                              granularity_bits);
+    if (tb_size == 0 || tb_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too big", bm_name);
+        return NULL;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "Failed to allocate the table of bitmap '%s'",
+                   bm_name);
+        return NULL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    bdrv_dirty_iter_init(bitmap, &hbi);
+    sector = hbitmap_iter_next(&hbi);
+    while (sector >= 0) {
+        uint64_t cluster = sector / sectors_per_cluster;
+        int64_t cluster_start = cluster * sectors_per_cluster;
+        int64_t end = cluster_start + sectors_per_cluster;
+        int64_t off;
+
+        assert(cluster < tb_size);
+
+        memset(buf, 0, s->cluster_size);
+        do {
+            uint64_t bit = (sector - cluster_start) / sectors_per_bit;
+            buf[bit / 8] |= 1 << (bit % 8);
+            sector = hbitmap_iter_next(&hbi);
+        } while (sector >= 0 && sector < end);
+
+        if (buffer_is_all_ones(buf, s->cluster_size)) {
+            tb[cluster] = BME_TABLE_ENTRY_FLAG_ALL_ONES;
+            continue;
+        }
+
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (off < 0) {
+            error_setg_errno(errp, -off,
+                             "Failed to allocate clusters for bitmap '%s'",
+                             bm_name);
+            goto fail;
+        }
+        tb[cluster] = off;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+    }
+
+    *bitmap_table_size = tb_size;
+    g_free(buf);
+
+    return tb;
+
+fail:
+    free_bitmap_clusters(bs, tb, tb_size);
+    g_free(buf);
+    g_free(tb);
+
+    return NULL;
+}
+
+/* store_bitmap()
+ * Store bm->dirty_bitmap to qcow2.
+ * Set bm->table_offset and bm->table_size accordingly.
+ */
+static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                        BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    int ret;
+    uint32_t i;
+    uint64_t *tb;
+    int64_t tb_offset;
+    uint32_t tb_size;
+
+    tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
+    if (tb == NULL) {
+        return -EINVAL;
+    }
+
+    assert(tb_size <= BME_MAX_TABLE_SIZE);
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(tb[0]));
+    if (tb_offset < 0) {
+        error_setg_errno(errp, -tb_offset, "Failed to allocate clusters for "
+                         "the table of bitmap '%s'", bm->name);
+        ret = tb_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(tb[0]));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        goto fail;
+    }
+
+    for (i = 0; i < tb_size; ++i) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = bdrv_pwrite(bs->file, tb_offset, tb, tb_size * sizeof(tb[0]));
+    for (i = 0; i < tb_size; ++i) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the table of bitmap "
+                         "'%s' to file", bm->name);
+        goto fail;
+    }
+
+    g_free(tb);
+
+    bm->table_offset = tb_offset;
+    bm->table_size = tb_size;
+
+    return 0;
+
+fail:
+    free_bitmap_clusters(bs, tb, tb_size);
+
+    if (tb_offset > 0) {
+        qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(tb[0]),
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    g_free(tb);
+
+    return ret;
+}
+
+/*
+ * Writes all persistent bitmaps of @bs to the image and replaces the bitmaps
+ * stored before.  Bitmaps that are still frozen by a running operation are
+ * stored with the in-use flag, so they are considered fully dirty when loaded
+ * again.
+ */
+int qcow2_store_persistent_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list = NULL;
+    Qcow2BitmapList *old_bm_list = NULL;
+    Qcow2Bitmap *bm;
+    uint32_t nb_bitmaps = 0;
+    int ret;
+
+    if (!s->bitmaps_loaded) {
+        /* The bitmaps in the image are not ours to replace */
+        return 0;
+    }
+
+    if (s->nb_bitmaps > 0) {
+        old_bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                       s->bitmap_directory_size, errp);
+        if (old_bm_list == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    bm_list = bitmap_list_new();
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap) || name == NULL) {
+            continue;
+        }
+
+        if (++nb_bitmaps > QCOW2_MAX_BITMAPS) {
+            error_setg(errp, "Too many persistent bitmaps");
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->granularity_bits =
+            ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        switch (bdrv_dirty_bitmap_status(bitmap)) {
+        case DIRTY_BITMAP_STATUS_ACTIVE:
+            bm->flags = BME_FLAG_AUTO;
+            break;
+        case DIRTY_BITMAP_STATUS_FROZEN:
+            bm->flags = BME_FLAG_AUTO | BME_FLAG_IN_USE;
+            break;
+        default:
+            bm->flags = 0;
+            break;
+        }
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+
+        ret = store_bitmap(bs, bm, bitmap, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = update_ext_header_and_dir(bs, bm_list);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update bitmap extension");
+        goto fail;
+    }
+
+    /* Bitmap directory was successfully updated, so, old data can be
+     * dropped. */
+    if (old_bm_list != NULL) {
+        QSIMPLEQ_FOREACH(bm, old_bm_list, entry) {
+            free_bitmap(bs, bm);
+        }
+    }
+
+    s->bitmaps_loaded = false;
+    bitmap_list_free(old_bm_list);
+    bitmap_list_free(bm_list);
+
+    return 0;
+
+fail:
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->table_offset != 0) {
+            free_bitmap(bs, bm);
+        }
+    }
+
+    bitmap_list_free(old_bm_list);
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int granularity_bits = ctz32(granularity);
+    uint32_t nb_bitmaps = 0;
+    BdrvDirtyBitmap *bitmap;
+
+    if (s->qcow_version < 3) {
+        /* Without autoclear_features, we would always have to assume
+         * that a program without persistent dirty bitmap support has
+         * accessed this qcow2 file when opening it, and would thus
+         * have to drop all dirty bitmaps (defeating their purpose).
+         */
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (bs->read_only || !s->bitmaps_loaded) {
+        error_setg(errp, "Cannot store dirty bitmaps in an image that is not "
+                   "writable");
+        return false;
+    }
+
+    if (granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity exceeds maximum (%llu bytes)",
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity is under minimum (%llu bytes)",
+                   1ULL << BME_MIN_GRANULARITY_BITS);
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Name length exceeds maximum (%u characters)",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    if (calc_table_size(s, bs->total_sectors, granularity_bits) >
+        BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap would be too big for this image");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Maximum number of persistent bitmaps is already "
+                   "reached");
+        return false;
+    }
+
+    return true;
+}
@@ -172,6 +172,8 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
     int l1_start_index;
     int i, ret;
 
+    qcow2_extent_cache_invalidate(s);
+
     l1_start_index = l1_index & ~(L1_ENTRIES_PER_SECTOR - 1);
     for (i = 0; i < L1_ENTRIES_PER_SECTOR && l1_start_index + i < s->l1_size;
          i++)
@@ -389,30 +391,21 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
-static int coroutine_fn do_perform_cow(BlockDriverState *bs,
-                                       uint64_t src_cluster_offset,
-                                       uint64_t cluster_offset,
-                                       int offset_in_cluster,
-                                       int bytes)
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            unsigned offset_in_cluster,
+                                            QEMUIOVector *qiov)
 {
-    BDRVQcow2State *s = bs->opaque;
-    QEMUIOVector qiov;
-    struct iovec iov;
     int ret;
 
-    iov.iov_len = bytes;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
-    if (iov.iov_base == NULL) {
-        return -ENOMEM;
+    if (qiov->size == 0) {
+        return 0;
     }
 
-    qemu_iovec_init_external(&qiov, &iov, 1);
-
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
     if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
+        return -ENOMEDIUM;
     }
 
     /* Call .bdrv_co_readv() directly instead of using the public block-layer
@@ -420,45 +413,162 @@ static int coroutine_fn do_perform_cow(BlockDriverState *bs,
      * which can lead to deadlock when block layer copy-on-read is enabled.
      */
     ret = bs->drv->bdrv_co_preadv(bs, src_cluster_offset + offset_in_cluster,
-                                  bytes, &qiov, 0);
+                                  qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    if (bs->encrypted) {
+    return 0;
+}
+
+static bool do_perform_cow_encrypt(BlockDriverState *bs,
+                                   uint64_t cluster_offset,
+                                   unsigned offset_in_cluster,
+                                   uint8_t *buffer,
+                                   unsigned bytes)
+{
+    if (bytes && bs->encrypted) {
+        BDRVQcow2State *s = bs->opaque;
         Error *err = NULL;
         int64_t sector = (cluster_offset + offset_in_cluster)
                          >> BDRV_SECTOR_BITS;
         assert(s->cipher);
         assert((offset_in_cluster & ~BDRV_SECTOR_MASK) == 0);
         assert((bytes & ~BDRV_SECTOR_MASK) == 0);
-        if (qcow2_encrypt_sectors(s, sector, iov.iov_base, iov.iov_base,
+        if (qcow2_encrypt_sectors(s, sector, buffer, buffer,
                                   bytes >> BDRV_SECTOR_BITS, true, &err) < 0) {
-            ret = -EIO;
             error_free(err);
-            goto out;
+            return false;
         }
     }
+    return true;
+}
+
+static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             unsigned offset_in_cluster,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
+    }
 
     ret = qcow2_pre_write_overlap_check(bs, 0,
-            cluster_offset + offset_in_cluster, bytes);
+            cluster_offset + offset_in_cluster, qiov->size);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
     ret = bdrv_co_pwritev(bs->file, cluster_offset + offset_in_cluster,
-                          bytes, &qiov, 0);
+                          qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    ret = 0;
-out:
-    qemu_vfree(iov.iov_base);
-    return ret;
+    return 0;
+}
+
+/* How far past the request a cache miss looks for the rest of the run */
+#define QCOW2_EXTENT_SCAN_CLUSTERS 256
+
+void qcow2_extent_cache_invalidate(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_EXTENT_CACHE_SIZE; i++) {
+        s->extent_cache[i].bytes = 0;
+    }
+}
+
+static Qcow2Extent *qcow2_extent_cache_find(BDRVQcow2State *s,
+                                            uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_EXTENT_CACHE_SIZE; i++) {
+        Qcow2Extent *e = &s->extent_cache[i];
+
+        if (offset >= e->guest_offset &&
+            offset - e->guest_offset < e->bytes) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void qcow2_extent_cache_add(BDRVQcow2State *s, uint64_t guest_offset,
+                                   uint64_t host_offset, uint64_t bytes,
+                                   int type)
+{
+    Qcow2Extent *e = &s->extent_cache[s->extent_cache_next];
+
+    *e = (Qcow2Extent) {
+        .guest_offset   = guest_offset,
+        .host_offset    = host_offset,
+        .bytes          = bytes,
+        .type           = type,
+    };
+    s->extent_cache_next = (s->extent_cache_next + 1) %
+                           QCOW2_EXTENT_CACHE_SIZE;
 }
 
+static void coroutine_fn qcow2_l2_prefetch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_offset, *l2_table;
+
+    /* Only gets the lock once the request that started it has let go, so
+     * the L1 table may have changed in between */
+    qemu_co_mutex_lock(&s->lock);
+    if (s->l2_prefetch_index < s->l1_size) {
+        l2_offset = s->l1_table[s->l2_prefetch_index] & L1E_OFFSET_MASK;
+        if (l2_offset && !offset_into_cluster(s, l2_offset) &&
+            l2_load(bs, l2_offset, &l2_table) == 0) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        }
+    }
+    trace_qcow2_l2_prefetch(bs, s->l2_prefetch_index);
+    s->l2_prefetch_pending = false;
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/*
+ * Once a sequential stream gets to the last eighth of the range covered by
+ * an L2 table, load the next one in the background: it is read while the
+ * data for the current requests is, instead of stalling the first request
+ * that crosses over.
+ */
+static void qcow2_l2_lookahead(BlockDriverState *bs, uint64_t offset,
+                               uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l1_bits = s->l2_bits + s->cluster_bits;
+    uint64_t l1_mask = (1ULL << l1_bits) - 1;
+    uint64_t last = offset + bytes - 1;
+    uint64_t l1_index = (last >> l1_bits) + 1;
+    bool sequential = offset == s->seq_next_offset;
+    Coroutine *co;
+
+    s->seq_next_offset = offset + bytes;
+    if (!sequential || !bytes || s->l2_prefetch_pending ||
+        !qemu_in_coroutine()) {
+        return;
+    }
+    if ((last & l1_mask) < l1_mask - (l1_mask >> 3) ||
+        l1_index >= s->l1_size || l1_index == s->l2_prefetch_index ||
+        !(s->l1_table[l1_index] & L1E_OFFSET_MASK)) {
+        return;
+    }
+
+    s->l2_prefetch_pending = true;
+    s->l2_prefetch_index = l1_index;
+    co = qemu_coroutine_create(qcow2_l2_prefetch_entry, bs);
+    qemu_coroutine_enter(co);
+}
 
 /*
  * get_cluster_offset
@@ -482,9 +592,10 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset, *l2_table;
-    int l1_bits, c;
+    int l1_bits, c, run;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
+    Qcow2Extent *e;
     int ret;
 
     offset_in_cluster = offset_into_cluster(s, offset);
@@ -503,6 +614,18 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     *cluster_offset = 0;
 
+    e = qcow2_extent_cache_find(s, offset);
+    if (e) {
+        uint64_t delta = start_of_cluster(s, offset) - e->guest_offset;
+
+        if (e->type == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset = e->host_offset + delta;
+        }
+        bytes_available = e->bytes - delta;
+        ret = e->type;
+        goto out;
+    }
+
     /* seek to the l2 offset in the l1 table */
 
     l1_index = offset >> l1_bits;
@@ -542,6 +665,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
+    /* Look a bit further than needed, so that the requests that follow in
+     * a sequential stream find the run in the extent cache */
+    run = MIN(s->l2_size - l2_index,
+              MAX(nb_clusters, QCOW2_EXTENT_SCAN_CLUSTERS));
+
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
@@ -557,19 +685,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(run, &l2_table[l2_index],
                                               QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(run, &l2_table[l2_index],
                                               QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
+        c = count_contiguous_clusters(run, s->cluster_size,
                 &l2_table[l2_index], QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
@@ -588,6 +716,10 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
 
     bytes_available = (int64_t)c * s->cluster_size;
+    if (ret != QCOW2_CLUSTER_COMPRESSED) {
+        qcow2_extent_cache_add(s, start_of_cluster(s, offset), *cluster_offset,
+                               bytes_available, ret);
+    }
 
 out:
     if (bytes_available > bytes_needed) {
@@ -600,6 +732,7 @@ out:
     assert(bytes_available - offset_in_cluster <= UINT_MAX);
     *bytes = bytes_available - offset_in_cluster;
 
+    qcow2_l2_lookahead(bs, offset, *bytes);
     return ret;
 
 fail:
@@ -739,31 +872,119 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     return cluster_offset;
 }
 
-static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
+static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    unsigned buffer_size;
+    unsigned data_bytes = end->offset - (start->offset + start->nb_bytes);
+    bool merge_reads;
+    uint8_t *start_buffer, *end_buffer;
+    QEMUIOVector qiov;
     int ret;
 
-    if (r->nb_bytes == 0) {
+    assert(start->nb_bytes <= UINT_MAX - end->nb_bytes);
+    assert(start->offset + start->nb_bytes <= end->offset);
+    assert(!m->data_qiov || m->data_qiov->size == data_bytes);
+
+    if (start->nb_bytes == 0 && end->nb_bytes == 0) {
         return 0;
     }
 
+    /* If both COW regions have to be read and the guest data between them
+     * is small, reading it along with them is cheaper than a second request.
+     */
+    merge_reads = start->nb_bytes && end->nb_bytes &&
+                  data_bytes <= QCOW2_COW_MERGE_READ_MAX;
+    if (merge_reads) {
+        buffer_size = start->nb_bytes + data_bytes + end->nb_bytes;
+    } else {
+        /* Pad the start region so that the end region stays aligned */
+        size_t align = bdrv_opt_mem_align(bs);
+        assert(align > 0 && align <= UINT_MAX);
+        assert(QEMU_ALIGN_UP(start->nb_bytes, align) <=
+               UINT_MAX - end->nb_bytes);
+        buffer_size = QEMU_ALIGN_UP(start->nb_bytes, align) + end->nb_bytes;
+    }
+
+    start_buffer = qemu_try_blockalign(bs, buffer_size);
+    if (start_buffer == NULL) {
+        return -ENOMEM;
+    }
+    end_buffer = start_buffer + buffer_size - end->nb_bytes;
+
+    qemu_iovec_init(&qiov, 2 + (m->data_qiov ? m->data_qiov->niov : 0));
+
     qemu_co_mutex_unlock(&s->lock);
-    ret = do_perform_cow(bs, m->offset, m->alloc_offset, r->offset, r->nb_bytes);
-    qemu_co_mutex_lock(&s->lock);
 
+    if (merge_reads) {
+        qemu_iovec_add(&qiov, start_buffer, buffer_size);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+    } else {
+        qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        ret = do_perform_cow_read(bs, m->offset, end->offset, &qiov);
+    }
     if (ret < 0) {
-        return ret;
+        goto fail;
+    }
+
+    if (!do_perform_cow_encrypt(bs, m->alloc_offset, start->offset,
+                                start_buffer, start->nb_bytes) ||
+        !do_perform_cow_encrypt(bs, m->alloc_offset, end->offset,
+                                end_buffer, end->nb_bytes)) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    if (m->data_qiov) {
+        /* The guest data was handed to us, so the whole allocation goes out
+         * in a single request: COW start, guest data, COW end. */
+        qemu_iovec_reset(&qiov);
+        if (start->nb_bytes) {
+            qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        }
+        qemu_iovec_concat(&qiov, m->data_qiov, 0, data_bytes);
+        if (end->nb_bytes) {
+            qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        }
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+    } else {
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, end->offset, &qiov);
     }
 
+fail:
+    qemu_co_mutex_lock(&s->lock);
+
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    if (ret == 0) {
+        qcow2_cache_depends_on_flush(s->l2_table_cache);
+    }
 
-    return 0;
+    qemu_vfree(start_buffer);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
@@ -783,12 +1004,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
-
-    ret = perform_cow(bs, m, &m->cow_end);
+    ret = perform_cow(bs, m);
     if (ret < 0) {
         goto err;
     }
@@ -24,19 +24,21 @@
 #include "qapi/qmp/qlist.h"
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
-#include "crypto/hash.h"
-
-#define HASH_LENGTH 32
 
 #define QUORUM_OPT_VOTE_THRESHOLD "vote-threshold"
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
 
-/* This union holds a vote hash value */
+/* Weight of a new sample in the read latency average, as a shift */
+#define QUORUM_LATENCY_EWMA_SHIFT 3
+/* A failed read counts as a read taking this long */
+#define QUORUM_LATENCY_ERROR_NS   1000000000LL
+
+/* This union holds a vote value */
 typedef union QuorumVoteValue {
-    uint8_t h[HASH_LENGTH];    /* SHA-256 hash */
-    int64_t l;                 /* simpler 64 bits hash */
+    QEMUIOVector *qiov;        /* contents of a read */
+    int64_t l;                 /* simpler 64 bits value */
 } QuorumVoteValue;
 
 /* A vote item */
@@ -87,6 +89,10 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+
+    int64_t *read_latency; /* moving average of each child's read latency in
+                            * ns, used to order reads by the latency pattern
+                            */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -101,6 +107,7 @@ typedef struct QuorumChildRequest {
     QEMUIOVector qiov;
     uint8_t *buf;
     int ret;
+    int64_t start_ns;
     QuorumAIOCB *parent;
 } QuorumChildRequest;
 
@@ -130,7 +137,9 @@ struct QuorumAIOCB {
 
     bool is_read;
     int vote_ret;
-    int child_iter;             /* which child to read in fifo pattern */
+    int child_iter;             /* which child to read in fifo and latency
+                                 * patterns
+                                 */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -156,6 +165,7 @@ static AIOCBInfo quorum_aiocb_info = {
 
 static void quorum_aio_finalize(QuorumAIOCB *acb)
 {
+    BDRVQuorumState *s = acb->common.bs->opaque;
     int i, ret = 0;
 
     if (acb->vote_ret) {
@@ -165,10 +175,12 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
     acb->common.cb(acb->common.opaque, ret);
 
     if (acb->is_read) {
-        /* on the quorum case acb->child_iter == s->num_children - 1 */
-        for (i = 0; i <= acb->child_iter; i++) {
-            qemu_vfree(acb->qcrs[i].buf);
-            qemu_iovec_destroy(&acb->qcrs[i].qiov);
+        /* only the children that were read have a buffer */
+        for (i = 0; i < s->num_children; i++) {
+            if (acb->qcrs[i].buf) {
+                qemu_vfree(acb->qcrs[i].buf);
+                qemu_iovec_destroy(&acb->qcrs[i].qiov);
+            }
         }
     }
 
@@ -176,9 +188,38 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
     qemu_aio_unref(acb);
 }
 
-static bool quorum_sha256_compare(QuorumVoteValue *a, QuorumVoteValue *b)
+/* qemu_iovec_compare is handy for blkverify mode because it returns the first
+ * differing byte location. Yet it is handcoded to compare vectors one byte
+ * after another so it does not benefit from the libc SIMD optimizations.
+ * quorum_iovec_compare is written for speed and should be used in the non
+ * blkverify mode of quorum.
+ */
+static bool quorum_iovec_compare(QEMUIOVector *a, QEMUIOVector *b)
 {
-    return !memcmp(a->h, b->h, HASH_LENGTH);
+    int i;
+    int result;
+
+    assert(a->niov == b->niov);
+    for (i = 0; i < a->niov; i++) {
+        assert(a->iov[i].iov_len == b->iov[i].iov_len);
+        result = memcmp(a->iov[i].iov_base,
+                        b->iov[i].iov_base,
+                        a->iov[i].iov_len);
+        if (result) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Reads are voted on by comparing their contents directly.  This costs one
+ * memcmp() per distinct version instead of a hash of every read, and unlike
+ * a hash it cannot be fooled by a collision.
+ */
+static bool quorum_qiov_compare(QuorumVoteValue *a, QuorumVoteValue *b)
+{
+    return a->qiov == b->qiov || quorum_iovec_compare(a->qiov, b->qiov);
 }
 
 static bool quorum_64bits_compare(QuorumVoteValue *a, QuorumVoteValue *b)
@@ -205,7 +246,7 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     acb->count = 0;
     acb->success_count = 0;
     acb->rewrite_count = 0;
-    acb->votes.compare = quorum_sha256_compare;
+    acb->votes.compare = quorum_qiov_compare;
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
@@ -269,6 +310,7 @@ static void quorum_rewrite_aio_cb(void *opaque, int ret)
 }
 
 static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb);
+static int quorum_next_read_child(QuorumAIOCB *acb);
 
 static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
 {
@@ -290,6 +332,14 @@ static void quorum_aio_cb(void *opaque, int ret)
     BDRVQuorumState *s = acb->common.bs->opaque;
     bool rewrite = false;
 
+    if (acb->is_read) {
+        int64_t *latency = &s->read_latency[sacb - acb->qcrs];
+        int64_t sample = ret < 0 ? QUORUM_LATENCY_ERROR_NS :
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - sacb->start_ns;
+
+        *latency += (sample - *latency) >> QUORUM_LATENCY_EWMA_SHIFT;
+    }
+
     if (ret == 0) {
         acb->success_count++;
     } else {
@@ -299,12 +349,15 @@ static void quorum_aio_cb(void *opaque, int ret)
                           sacb->aiocb->bs->node_name, ret);
     }
 
-    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
-        /* We try to read next child in FIFO order if we fail to read */
-        if (ret < 0 && (acb->child_iter + 1) < s->num_children) {
-            acb->child_iter++;
-            read_fifo_child(acb);
-            return;
+    if (acb->is_read && s->read_pattern != QUORUM_READ_PATTERN_QUORUM) {
+        /* We try to read the next child if we fail to read */
+        if (ret < 0) {
+            int next = quorum_next_read_child(acb);
+            if (next >= 0) {
+                acb->child_iter = next;
+                read_fifo_child(acb);
+                return;
+            }
         }
 
         if (ret == 0) {
@@ -400,7 +453,7 @@ static void quorum_count_vote(QuorumVotes *votes,
     QuorumVoteVersion *v = NULL, *version = NULL;
     QuorumVoteItem *item;
 
-    /* look if we have something with this hash */
+    /* look if we have something with this value */
     QLIST_FOREACH(v, &votes->vote_list, next) {
         if (votes->compare(&v->value, value)) {
             version = v;
@@ -440,25 +493,6 @@ static void quorum_free_vote_list(QuorumVotes *votes)
     }
 }
 
-static int quorum_compute_hash(QuorumAIOCB *acb, int i, QuorumVoteValue *hash)
-{
-    QEMUIOVector *qiov = &acb->qcrs[i].qiov;
-    size_t len = sizeof(hash->h);
-    uint8_t *data = hash->h;
-
-    /* XXX - would be nice if we could pass in the Error **
-     * and propagate that back, but this quorum code is
-     * restricted to just errno values currently */
-    if (qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256,
-                            qiov->iov, qiov->niov,
-                            &data, &len,
-                            NULL) < 0) {
-        return -EINVAL;
-    }
-
-    return 0;
-}
-
 static QuorumVoteVersion *quorum_get_vote_winner(QuorumVotes *votes)
 {
     int max = 0;
@@ -474,31 +508,6 @@ static QuorumVoteVersion *quorum_get_vote_winner(QuorumVotes *votes)
     return winner;
 }
 
-/* qemu_iovec_compare is handy for blkverify mode because it returns the first
- * differing byte location. Yet it is handcoded to compare vectors one byte
- * after another so it does not benefit from the libc SIMD optimizations.
- * quorum_iovec_compare is written for speed and should be used in the non
- * blkverify mode of quorum.
- */
-static bool quorum_iovec_compare(QEMUIOVector *a, QEMUIOVector *b)
-{
-    int i;
-    int result;
-
-    assert(a->niov == b->niov);
-    for (i = 0; i < a->niov; i++) {
-        assert(a->iov[i].iov_len == b->iov[i].iov_len);
-        result = memcmp(a->iov[i].iov_base,
-                        b->iov[i].iov_base,
-                        a->iov[i].iov_len);
-        if (result) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
 static void GCC_FMT_ATTR(2, 3) quorum_err(QuorumAIOCB *acb,
                                           const char *fmt, ...)
 {
@@ -570,8 +579,8 @@ static bool quorum_vote(QuorumAIOCB *acb)
 {
     bool quorum = true;
     bool rewrite = false;
-    int i, j, ret;
-    QuorumVoteValue hash;
+    int i, j;
+    QuorumVoteValue value;
     BDRVQuorumState *s = acb->common.bs->opaque;
     QuorumVoteVersion *winner;
 
@@ -607,18 +616,13 @@ static bool quorum_vote(QuorumAIOCB *acb)
         return false;
     }
 
-    /* compute hashes for each successful read, also store indexes */
+    /* sort each successful read into a version, also store indexes */
     for (i = 0; i < s->num_children; i++) {
         if (acb->qcrs[i].ret) {
             continue;
         }
-        ret = quorum_compute_hash(acb, i, &hash);
-        /* if ever the hash computation failed */
-        if (ret < 0) {
-            acb->vote_ret = ret;
-            goto free_exit;
-        }
-        quorum_count_vote(&acb->votes, &hash, i);
+        value.qiov = &acb->qcrs[i].qiov;
+        quorum_count_vote(&acb->votes, &value, i);
     }
 
     /* vote to select the most represented version */
@@ -660,6 +664,7 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     }
 
     for (i = 0; i < s->num_children; i++) {
+        acb->qcrs[i].start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         acb->qcrs[i].aiocb = bdrv_aio_readv(s->children[i], acb->sector_num,
                                             &acb->qcrs[i].qiov, acb->nb_sectors,
                                             quorum_aio_cb, &acb->qcrs[i]);
@@ -668,6 +673,33 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     return &acb->common;
 }
 
+/* Pick the child that a fifo or latency pattern read should try next, or
+ * return -1 if every child has been tried.  The latency pattern tries the
+ * children in order of their average read latency; children that have not
+ * been read yet have no samples and are tried first.
+ */
+static int quorum_next_read_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i, best = -1;
+
+    if (s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
+        return acb->child_iter + 1 < s->num_children ? acb->child_iter + 1
+                                                     : -1;
+    }
+
+    for (i = 0; i < s->num_children; i++) {
+        if (acb->qcrs[i].buf) {
+            continue;
+        }
+        if (best < 0 || s->read_latency[i] < s->read_latency[best]) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
 static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
 {
     BDRVQuorumState *s = acb->common.bs->opaque;
@@ -677,6 +709,8 @@ static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
     qemu_iovec_init(&acb->qcrs[acb->child_iter].qiov, acb->qiov->niov);
     qemu_iovec_clone(&acb->qcrs[acb->child_iter].qiov, acb->qiov,
                      acb->qcrs[acb->child_iter].buf);
+    acb->qcrs[acb->child_iter].start_ns =
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     acb->qcrs[acb->child_iter].aiocb =
         bdrv_aio_readv(s->children[acb->child_iter], acb->sector_num,
                        &acb->qcrs[acb->child_iter].qiov, acb->nb_sectors,
@@ -702,7 +736,8 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
         return read_quorum_children(acb);
     }
 
-    acb->child_iter = 0;
+    acb->child_iter = -1;
+    acb->child_iter = quorum_next_read_child(acb);
     return read_fifo_child(acb);
 }
 
@@ -910,7 +945,8 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err,
+                   "Please set read-pattern as fifo, latency or quorum");
         goto exit;
     }
     s->read_pattern = ret;
@@ -937,6 +973,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children array */
     s->children = g_new0(BdrvChild *, s->num_children);
+    s->read_latency = g_new0(int64_t, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -967,6 +1004,7 @@ close_exit:
         bdrv_unref_child(bs, s->children[i]);
     }
     g_free(s->children);
+    g_free(s->read_latency);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -985,6 +1023,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->children);
+    g_free(s->read_latency);
 }
 
 static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
@@ -1015,6 +1054,8 @@ static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
     bdrv_ref(child_bs);
     child = bdrv_attach_child(bs, child_bs, indexstr, &child_format);
     s->children = g_renew(BdrvChild *, s->children, s->num_children + 1);
+    s->read_latency = g_renew(int64_t, s->read_latency, s->num_children + 1);
+    s->read_latency[s->num_children] = 0;
     s->children[s->num_children++] = child;
 
     bdrv_drained_end(bs);
@@ -1047,7 +1088,10 @@ static void quorum_del_child(BlockDriverState *bs, BdrvChild *child,
     /* We can safely remove this child now */
     memmove(&s->children[i], &s->children[i + 1],
             (s->num_children - i - 1) * sizeof(BdrvChild *));
+    memmove(&s->read_latency[i], &s->read_latency[i + 1],
+            (s->num_children - i - 1) * sizeof(int64_t));
     s->children = g_renew(BdrvChild *, s->children, --s->num_children);
+    s->read_latency = g_renew(int64_t, s->read_latency, s->num_children);
     bdrv_unref_child(bs, child);
 
     bdrv_drained_end(bs);
@@ -1113,10 +1157,6 @@ static BlockDriver bdrv_quorum = {
 
 static void bdrv_quorum_init(void)
 {
-    if (!qcrypto_hash_supports(QCRYPTO_HASH_ALG_SHA256)) {
-        /* SHA256 hash support is required for quorum device */
-        return;
-    }
     bdrv_register(&bdrv_quorum);
 }
 
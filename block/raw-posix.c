@@ -144,7 +144,12 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool has_fallocate;
+    bool has_clone_range;
+    bool has_copy_range;
     bool needs_alignment;
+#ifdef CONFIG_LINUX_IO_URING
+    int luring_fixed_index;
+#endif
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -167,6 +172,8 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    int aio_fd2;        /* destination for QEMU_AIO_COPY_RANGE */
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -379,6 +386,39 @@ static bool raw_use_aio(int bdrv_flags)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * With aio=io_uring the fd is registered with the ring of the current
+ * AioContext, so that requests can refer to it as a fixed file.  The
+ * registration has to follow the fd across reopen and AioContext changes.
+ */
+static void raw_luring_register(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    s->luring_fixed_index = -1;
+    if (!(bs->open_flags & BDRV_O_IO_URING) || s->fd < 0) {
+        return;
+    }
+    aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    if (aio) {
+        s->luring_fixed_index = luring_register_fd(aio, s->fd);
+    }
+}
+
+static void raw_luring_unregister(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->luring_fixed_index >= 0) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_unregister_fd(aio, s->luring_fixed_index);
+        s->luring_fixed_index = -1;
+    }
+}
+#endif
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -433,6 +473,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     raw_parse_flags(bdrv_flags, &s->open_flags);
 
     s->fd = -1;
+#ifdef CONFIG_LINUX_IO_URING
+    s->luring_fixed_index = -1;
+#endif
     fd = qemu_open(filename, s->open_flags, 0644);
     if (fd < 0) {
         ret = -errno;
@@ -459,6 +502,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if ((bdrv_flags & BDRV_O_IO_URING) &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(bs))) {
+        error_setg(errp, "aio=io_uring was specified, but io_uring is not "
+                         "available on this host.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -474,6 +534,8 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     if (S_ISREG(st.st_mode)) {
         s->discard_zeroes = true;
         s->has_fallocate = true;
+        s->has_clone_range = true;
+        s->has_copy_range = true;
     }
     if (S_ISBLK(st.st_mode)) {
 #ifdef BLKDISCARDZEROES
@@ -511,6 +573,10 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register(bs);
+#endif
+
     ret = 0;
 fail:
     if (filename && (bdrv_flags & BDRV_O_TEMPORARY)) {
@@ -617,8 +683,14 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(state->bs);
+#endif
     qemu_close(s->fd);
     s->fd = raw_s->fd;
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_register(state->bs);
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -1098,6 +1170,90 @@ static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
     return -ENOTSUP;
 }
 
+/*
+ * Copies aio_nbytes from aio_fildes at aio_offset to aio_fd2 at aio_offset2
+ * inside the kernel: a reflink shares the extents on filesystems that
+ * support it (Btrfs, XFS), copy_file_range() lets the filesystem or NFS
+ * server copy the data without passing it through userspace.  aiocb->bs is
+ * the destination.
+ */
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+#if defined(FICLONERANGE) || defined(CONFIG_COPY_FILE_RANGE)
+    BDRVRawState *s = aiocb->bs->opaque;
+#endif
+    int ret = -ENOTSUP;
+
+#ifdef FICLONERANGE
+    if (s->has_clone_range) {
+        struct file_clone_range range = {
+            .src_fd         = aiocb->aio_fildes,
+            .src_offset     = aiocb->aio_offset,
+            .src_length     = aiocb->aio_nbytes,
+            .dest_offset    = aiocb->aio_offset2,
+        };
+
+        do {
+            if (ioctl(aiocb->aio_fd2, FICLONERANGE, &range) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        /* EINVAL is returned for ranges not aligned to the filesystem block
+         * size, which copy_file_range() may still be able to handle */
+        ret = translate_err(-errno);
+        if (ret == -ENOTSUP || ret == -EXDEV) {
+            s->has_clone_range = false;
+        } else if (ret != -EINVAL) {
+            return ret;
+        }
+    }
+#endif
+
+#ifdef CONFIG_COPY_FILE_RANGE
+    if (s->has_copy_range) {
+        off_t in_off = aiocb->aio_offset;
+        off_t out_off = aiocb->aio_offset2;
+        uint64_t bytes = aiocb->aio_nbytes;
+
+        while (bytes) {
+            ssize_t n = copy_file_range(aiocb->aio_fildes, &in_off,
+                                        aiocb->aio_fd2, &out_off, bytes, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ret = translate_err(-errno);
+                if (ret == -ENOTSUP) {
+                    s->has_copy_range = false;
+                }
+                break;
+            } else if (n == 0) {
+                /* Hit the end of the source; the caller never asks for
+                 * more than the image size, so treat it as an error */
+                ret = -EINVAL;
+                break;
+            }
+            bytes -= n;
+        }
+        if (!bytes) {
+            return 0;
+        }
+        if (bytes != aiocb->aio_nbytes) {
+            /* Part of the range has been copied, can't fall back anymore */
+            return ret;
+        }
+    }
+#endif
+
+    /* Cross-filesystem copies and unsuitable files are left to the bounce
+     * buffer path */
+    if (ret == -EXDEV || ret == -EINVAL || ret == -EBADF) {
+        ret = -ENOTSUP;
+    }
+    return ret;
+}
+
 static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
 {
     int ret = -EOPNOTSUPP;
@@ -1178,6 +1334,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1264,6 +1423,16 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Unlike linux-aio, io_uring does not need O_DIRECT to be asynchronous */
+    if (!(type & QEMU_AIO_MISALIGNED) && (bs->open_flags & BDRV_O_IO_URING)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, s->luring_fixed_index,
+                                offset, qiov, type);
+    }
+#endif
+
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
@@ -1290,6 +1459,12 @@ static void raw_aio_plug(BlockDriverState *bs)
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (bs->open_flags & BDRV_O_IO_URING) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
@@ -1300,8 +1475,27 @@ static void raw_aio_unplug(BlockDriverState *bs)
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (bs->open_flags & BDRV_O_IO_URING) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_io_unplug(bs, aio);
+    }
+#endif
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+    raw_luring_unregister(bs);
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    raw_luring_register(bs);
+}
+#endif
+
 static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockCompletionFunc *cb, void *opaque)
 {
@@ -1317,6 +1511,9 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(bs);
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1812,6 +2009,58 @@ static int coroutine_fn raw_co_pwrite_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               BdrvChild *src,
+                                               uint64_t src_offset,
+                                               BdrvChild *dst,
+                                               uint64_t dst_offset,
+                                               uint64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                 bytes, flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BdrvChild *src,
+                                             uint64_t src_offset,
+                                             BdrvChild *dst,
+                                             uint64_t dst_offset,
+                                             uint64_t bytes,
+                                             BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    assert(dst->bs == bs);
+    if (src->bs->drv != bs->drv) {
+        return -ENOTSUP;
+    }
+    src_s = src->bs->opaque;
+
+    if (!s->has_clone_range && !s->has_copy_range) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0 || fd_open(src->bs) < 0) {
+        return -EIO;
+    }
+
+    acb = g_new(RawPosixAIOData, 1);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_offset;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = dst_offset;
+    acb->aio_nbytes = bytes;
+
+    trace_paio_submit_co(dst_offset, bytes, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1863,9 +2112,15 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_aio_flush = raw_aio_flush,
     .bdrv_aio_pdiscard = raw_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+#endif
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
@@ -2309,6 +2564,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_flush	= raw_aio_flush,
     .bdrv_aio_pdiscard   = hdev_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+#endif
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
@@ -2430,6 +2689,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_aio_flush	= raw_aio_flush,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+#endif
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
@@ -2560,6 +2823,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_aio_flush	= raw_aio_flush,
     .bdrv_refresh_limits = raw_refresh_limits,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+#endif
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
 
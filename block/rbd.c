@@ -53,6 +53,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* librbd.h defines LIBRBD_SUPPORTS_IOVEC for rbd_aio_readv/writev (1.12) */
+#ifdef LIBRBD_SUPPORTS_IOVEC
+#define LIBRBD_USE_IOVEC 1
+#else
+#define LIBRBD_USE_IOVEC 0
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -408,6 +415,17 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
     return ret;
 }
 
+/* Zero the part of a read buffer past offs, which librbd did not fill */
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    if (LIBRBD_USE_IOVEC) {
+        RBDAIOCB *acb = rcb->acb;
+        qemu_iovec_memset(acb->qiov, offs, 0, acb->qiov->size - offs);
+    } else {
+        memset(rcb->buf + offs, 0, rcb->size - offs);
+    }
+}
+
 /*
  * This aio completion is being called from rbd_finish_bh() and runs in qemu
  * BH context.
@@ -428,11 +446,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -443,7 +461,7 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
+    if (!LIBRBD_USE_IOVEC && acb->cmd == RBD_AIO_READ) {
         qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
     }
     qemu_vfree(acb->bounce);
@@ -668,9 +686,9 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cmd = cmd;
     acb->qiov = qiov;
     assert(!qiov || qiov->size == size);
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+    if (!LIBRBD_USE_IOVEC &&
+        (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE)) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
@@ -681,7 +699,7 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->s = s;
     acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (!LIBRBD_USE_IOVEC && cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -699,10 +717,18 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
@@ -0,0 +1,554 @@
+/*
+ * Read-ahead filter block driver
+ *
+ * Sequential readers of high-latency backends (curl, nbd, rbd, gluster, ...)
+ * otherwise pay a full round trip for every request.  This filter detects
+ * sequential streams and prefetches the data following them into a bounded
+ * pool of buffers, from which subsequent reads are served.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/coroutine.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/* Number of sequential streams that are tracked at the same time */
+#define READAHEAD_MAX_STREAMS       8
+
+/* Consecutive sequential reads before a stream starts being prefetched */
+#define READAHEAD_TRIGGER           2
+
+#define READAHEAD_DEFAULT_BUFFER_SIZE   (256 * 1024)
+#define READAHEAD_DEFAULT_BUFFERS       16
+#define READAHEAD_DEFAULT_WINDOW        4
+
+typedef enum ReadaheadBufferState {
+    READAHEAD_BUFFER_FREE,
+    READAHEAD_BUFFER_IN_FLIGHT,
+    READAHEAD_BUFFER_VALID,
+} ReadaheadBufferState;
+
+typedef struct ReadaheadBuffer {
+    ReadaheadBufferState state;
+    /* A write overlapped the prefetch, drop the data when it completes */
+    bool stale;
+    int64_t offset;
+    uint64_t bytes;
+    uint8_t *data;
+    /* For LRU replacement of valid buffers */
+    uint64_t last_use;
+    /* Readers waiting for the prefetch to complete */
+    CoQueue waiters;
+} ReadaheadBuffer;
+
+typedef struct ReadaheadStream {
+    /* Offset at which the next read of the stream is expected */
+    int64_t next_offset;
+    /* End of the range that has been prefetched for the stream */
+    int64_t prefetched;
+    unsigned hits;
+    uint64_t last_use;
+} ReadaheadStream;
+
+typedef struct BDRVReadaheadState {
+    uint64_t buffer_size;
+    int nb_buffers;
+    int window;
+    ReadaheadBuffer *buffers;
+    ReadaheadStream streams[READAHEAD_MAX_STREAMS];
+    uint64_t use_counter;
+} BDRVReadaheadState;
+
+typedef struct ReadaheadPrefetch {
+    BlockDriverState *bs;
+    ReadaheadBuffer *buf;
+} ReadaheadPrefetch;
+
+static QemuOptsList readahead_runtime_opts = {
+    .name = "readahead",
+    .head = QTAILQ_HEAD_INITIALIZER(readahead_runtime_opts.head),
+    .desc = {
+        {
+            .name = "buffer-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a read-ahead buffer (default: 256k)",
+        },
+        {
+            .name = "buffers",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of read-ahead buffers (default: 16)",
+        },
+        {
+            .name = "window",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of buffers prefetched ahead of a sequential "
+                    "stream (default: 4)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int readahead_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t nb_buffers, window;
+    int i, ret;
+
+    opts = qemu_opts_create(&readahead_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->buffer_size = qemu_opt_get_size(opts, "buffer-size",
+                                       READAHEAD_DEFAULT_BUFFER_SIZE);
+    nb_buffers = qemu_opt_get_number(opts, "buffers",
+                                     READAHEAD_DEFAULT_BUFFERS);
+    window = qemu_opt_get_number(opts, "window", READAHEAD_DEFAULT_WINDOW);
+
+    if (s->buffer_size < BDRV_SECTOR_SIZE ||
+        s->buffer_size > BDRV_REQUEST_MAX_SECTORS * BDRV_SECTOR_SIZE ||
+        !is_power_of_2(s->buffer_size)) {
+        error_setg(errp, "buffer-size must be a power of two between 512 "
+                   "and %d", BDRV_REQUEST_MAX_SECTORS * BDRV_SECTOR_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (nb_buffers < 1 || nb_buffers > 1024) {
+        error_setg(errp, "buffers must be between 1 and 1024");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (window < 1 || window > nb_buffers) {
+        error_setg(errp, "window must be between 1 and the number of buffers");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->nb_buffers = nb_buffers;
+    s->window = window;
+
+    s->buffers = g_new0(ReadaheadBuffer, s->nb_buffers);
+    for (i = 0; i < s->nb_buffers; i++) {
+        ReadaheadBuffer *buf = &s->buffers[i];
+
+        buf->data = qemu_try_blockalign(bs->file->bs, s->buffer_size);
+        if (!buf->data) {
+            error_setg(errp, "Could not allocate read-ahead buffers");
+            ret = -ENOMEM;
+            goto out;
+        }
+        qemu_co_queue_init(&buf->waiters);
+    }
+
+    bs->supported_write_flags = BDRV_REQ_FUA &
+        bs->file->bs->supported_write_flags;
+    bs->supported_zero_flags = (BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP) &
+        bs->file->bs->supported_zero_flags;
+
+    ret = 0;
+out:
+    if (ret < 0 && s->buffers) {
+        for (i = 0; i < s->nb_buffers; i++) {
+            qemu_vfree(s->buffers[i].data);
+        }
+        g_free(s->buffers);
+        s->buffers = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void readahead_close(BlockDriverState *bs)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        assert(s->buffers[i].state != READAHEAD_BUFFER_IN_FLIGHT);
+        qemu_vfree(s->buffers[i].data);
+    }
+    g_free(s->buffers);
+}
+
+/* Returns the buffer caching the data at @offset, or NULL */
+static ReadaheadBuffer *readahead_find_buffer(BDRVReadaheadState *s,
+                                              int64_t offset)
+{
+    int64_t start = QEMU_ALIGN_DOWN(offset, s->buffer_size);
+    int i;
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        ReadaheadBuffer *buf = &s->buffers[i];
+
+        if (buf->state != READAHEAD_BUFFER_FREE && !buf->stale &&
+            buf->offset == start && offset < buf->offset + buf->bytes) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+/* Returns a free buffer, evicting the least recently used valid one if
+ * necessary.  Buffers with a prefetch in flight are never evicted. */
+static ReadaheadBuffer *readahead_get_free_buffer(BDRVReadaheadState *s)
+{
+    ReadaheadBuffer *lru = NULL;
+    int i;
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        ReadaheadBuffer *buf = &s->buffers[i];
+
+        if (buf->state == READAHEAD_BUFFER_FREE) {
+            return buf;
+        }
+        if (buf->state == READAHEAD_BUFFER_VALID &&
+            (!lru || buf->last_use < lru->last_use)) {
+            lru = buf;
+        }
+    }
+
+    if (lru) {
+        lru->state = READAHEAD_BUFFER_FREE;
+    }
+    return lru;
+}
+
+static void coroutine_fn readahead_co_prefetch(void *opaque)
+{
+    ReadaheadPrefetch *pf = opaque;
+    BlockDriverState *bs = pf->bs;
+    ReadaheadBuffer *buf = pf->buf;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = buf->data,
+        .iov_len    = buf->bytes,
+    };
+    int ret;
+
+    g_free(pf);
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_preadv(bs->file, buf->offset, buf->bytes, &qiov, 0);
+    trace_readahead_prefetch_done(bs, buf->offset, buf->bytes, ret);
+
+    if (ret < 0 || buf->stale) {
+        buf->state = READAHEAD_BUFFER_FREE;
+        buf->stale = false;
+    } else {
+        buf->state = READAHEAD_BUFFER_VALID;
+    }
+    qemu_co_queue_restart_all(&buf->waiters);
+    bdrv_unref(bs);
+}
+
+/* Starts prefetching the @bytes at @offset into a buffer.  Returns false if
+ * no buffer is available. */
+static bool readahead_start_prefetch(BlockDriverState *bs, int64_t offset,
+                                     uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadBuffer *buf;
+    ReadaheadPrefetch *pf;
+    Coroutine *co;
+
+    buf = readahead_get_free_buffer(s);
+    if (!buf) {
+        return false;
+    }
+
+    buf->state = READAHEAD_BUFFER_IN_FLIGHT;
+    buf->stale = false;
+    buf->offset = offset;
+    buf->bytes = bytes;
+    buf->last_use = ++s->use_counter;
+
+    trace_readahead_prefetch(bs, offset, bytes);
+
+    pf = g_new(ReadaheadPrefetch, 1);
+    *pf = (ReadaheadPrefetch) {
+        .bs     = bs,
+        .buf    = buf,
+    };
+    /* The prefetch may outlive the request that triggered it */
+    bdrv_ref(bs);
+    co = qemu_coroutine_create(readahead_co_prefetch, pf);
+    qemu_coroutine_enter(co);
+    return true;
+}
+
+/* Updates the sequential stream detection with a read request and prefetches
+ * the data following the stream once it looks sequential.
+ */
+static void readahead_update_streams(BlockDriverState *bs, int64_t offset,
+                                     uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadStream *stream = NULL;
+    int64_t length, end, pos;
+    int i;
+
+    for (i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+        ReadaheadStream *st = &s->streams[i];
+
+        /* Allow for some reordering of a stream's concurrent requests */
+        if (st->last_use && offset >= st->next_offset &&
+            offset < st->next_offset + s->buffer_size) {
+            stream = st;
+            break;
+        }
+    }
+
+    if (!stream) {
+        /* Start a new stream in the least recently used slot */
+        stream = &s->streams[0];
+        for (i = 1; i < READAHEAD_MAX_STREAMS; i++) {
+            if (s->streams[i].last_use < stream->last_use) {
+                stream = &s->streams[i];
+            }
+        }
+        *stream = (ReadaheadStream) {
+            .next_offset    = offset + bytes,
+            .prefetched     = offset + bytes,
+        };
+        stream->last_use = ++s->use_counter;
+        return;
+    }
+
+    stream->last_use = ++s->use_counter;
+    stream->next_offset = offset + bytes;
+    if (++stream->hits < READAHEAD_TRIGGER) {
+        return;
+    }
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return;
+    }
+
+    end = MIN(stream->next_offset + s->window * s->buffer_size, length);
+    pos = MAX(stream->prefetched, stream->next_offset);
+    pos = QEMU_ALIGN_DOWN(pos, s->buffer_size);
+
+    while (pos < end) {
+        if (!readahead_find_buffer(s, pos) &&
+            !readahead_start_prefetch(bs, pos,
+                                      MIN(s->buffer_size, length - pos))) {
+            break;
+        }
+        pos += s->buffer_size;
+    }
+    stream->prefetched = MAX(stream->prefetched, MIN(pos, end));
+}
+
+/* Drops cached data overlapping a request that modifies the image */
+static void readahead_invalidate(BlockDriverState *bs, int64_t offset,
+                                 uint64_t bytes)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_buffers; i++) {
+        ReadaheadBuffer *buf = &s->buffers[i];
+
+        if (buf->state == READAHEAD_BUFFER_FREE ||
+            offset >= buf->offset + buf->bytes ||
+            offset + bytes <= buf->offset) {
+            continue;
+        }
+        if (buf->state == READAHEAD_BUFFER_VALID) {
+            buf->state = READAHEAD_BUFFER_FREE;
+        } else {
+            buf->stale = true;
+        }
+    }
+
+    for (i = 0; i < READAHEAD_MAX_STREAMS; i++) {
+        ReadaheadStream *st = &s->streams[i];
+
+        if (st->prefetched > offset) {
+            st->prefetched = MAX(st->next_offset,
+                                 QEMU_ALIGN_DOWN(offset, s->buffer_size));
+        }
+    }
+}
+
+/* Copies a request from the buffers if they cover all of it, waiting for
+ * prefetches in flight.  Returns false if the request must be read from the
+ * image instead. */
+static bool coroutine_fn readahead_co_read_cached(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov)
+{
+    BDRVReadaheadState *s = bs->opaque;
+    ReadaheadBuffer *buf;
+    int64_t pos;
+    size_t done;
+
+retry:
+    for (pos = offset; pos < offset + bytes; pos = buf->offset + buf->bytes) {
+        buf = readahead_find_buffer(s, pos);
+        if (!buf) {
+            return false;
+        }
+        if (buf->state == READAHEAD_BUFFER_IN_FLIGHT) {
+            qemu_co_queue_wait(&buf->waiters);
+            goto retry;
+        }
+    }
+
+    /* All the data is there; nothing below yields, so it stays there */
+    done = 0;
+    for (pos = offset; pos < offset + bytes; pos += done) {
+        uint64_t n;
+
+        buf = readahead_find_buffer(s, pos);
+        n = MIN(buf->offset + buf->bytes - pos, offset + bytes - pos);
+        qemu_iovec_from_buf(qiov, pos - offset, buf->data + pos - buf->offset,
+                            n);
+        buf->last_use = ++s->use_counter;
+        done = n;
+    }
+    return true;
+}
+
+static int coroutine_fn readahead_co_preadv(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
+{
+    bool hit;
+
+    readahead_update_streams(bs, offset, bytes);
+
+    hit = !(flags & BDRV_REQ_COPY_ON_READ) &&
+          readahead_co_read_cached(bs, offset, bytes, qiov);
+    trace_readahead_co_preadv(bs, offset, bytes, hit);
+    if (hit) {
+        return 0;
+    }
+
+    return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn readahead_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    /* Invalidate again once the write is done, a prefetch may have read
+     * the old data in the meantime */
+    readahead_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    readahead_invalidate(bs, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pwrite_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int count,
+                                                   BdrvRequestFlags flags)
+{
+    int ret;
+
+    readahead_invalidate(bs, offset, count);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, count, flags);
+    readahead_invalidate(bs, offset, count);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int count)
+{
+    int ret;
+
+    readahead_invalidate(bs, offset, count);
+    ret = bdrv_co_pdiscard(bs->file->bs, offset, count);
+    readahead_invalidate(bs, offset, count);
+
+    return ret;
+}
+
+static int coroutine_fn readahead_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn
+readahead_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum,
+                              BlockDriverState **file)
+{
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int readahead_truncate(BlockDriverState *bs, int64_t offset)
+{
+    readahead_invalidate(bs, 0, INT64_MAX);
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static int64_t readahead_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int readahead_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    return bdrv_get_info(bs->file->bs, bdi);
+}
+
+static void readahead_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    readahead_invalidate(bs, 0, INT64_MAX);
+}
+
+static bool readahead_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                  BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_readahead = {
+    .format_name            = "readahead",
+    .instance_size          = sizeof(BDRVReadaheadState),
+
+    .bdrv_open              = readahead_open,
+    .bdrv_close             = readahead_close,
+    .bdrv_getlength         = readahead_getlength,
+    .bdrv_truncate          = readahead_truncate,
+    .bdrv_get_info          = readahead_get_info,
+    .bdrv_invalidate_cache  = readahead_invalidate_cache,
+
+    .bdrv_co_preadv         = readahead_co_preadv,
+    .bdrv_co_pwritev        = readahead_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = readahead_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = readahead_co_pdiscard,
+    .bdrv_co_flush          = readahead_co_flush,
+    .bdrv_co_get_block_status = readahead_co_get_block_status,
+
+    .has_variable_length    = true,
+    .is_filter              = true,
+    .bdrv_recurse_is_first_non_filter = readahead_recurse_is_first_non_filter,
+};
+
+static void bdrv_readahead_init(void)
+{
+    bdrv_register(&bdrv_readahead);
+}
+
+block_init(bdrv_readahead_init);
@@ -52,7 +52,21 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * The members of a group share its limits by deficit round robin: the
+ * member holding the token keeps it until it has used up its credit,
+ * which is replenished in proportion to the member's weight each time it
+ * gets the token.  Requests are charged by their size, but never less
+ * than THROTTLE_GROUP_MIN_COST so that members issuing small requests
+ * cannot monopolize an IOPS-limited group.
  */
+
+/* Credit given to a member per unit of weight each time it gets the token */
+#define THROTTLE_GROUP_QUANTUM  1024
+
+/* Minimum amount of credit charged for a request */
+#define THROTTLE_GROUP_MIN_COST 4096
+
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
@@ -168,8 +182,32 @@ static BlockBackend *throttle_group_next_blk(BlockBackend *blk)
     return blk_by_public(next);
 }
 
+/* Hand the token to a BlockBackend, replenishing its credit if it starts a
+ * new turn.  Credit that is left over from a previous turn is not carried
+ * over, but debt is.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:        the ThrottleGroup
+ * @blk:       the BlockBackend that gets the token
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_set_token(ThrottleGroup *tg, BlockBackend *blk,
+                                     bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    int64_t quantum = (int64_t)blkp->throttle_weight * THROTTLE_GROUP_QUANTUM;
+
+    if (tg->tokens[is_write] != blk || blkp->throttle_credit[is_write] <= 0) {
+        blkp->throttle_credit[is_write] =
+            MIN(blkp->throttle_credit[is_write] + quantum, quantum);
+    }
+    tg->tokens[is_write] = blk;
+}
+
 /* Return the next BlockBackend in the round-robin sequence with pending I/O
- * requests.
+ * requests.  The current token holder keeps its turn while it has credit
+ * left.
  *
  * This assumes that tg->lock is held.
  *
@@ -183,12 +221,19 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
     BlockBackend *token, *start;
+    BlockBackendPublic *tokenp;
 
     start = token = tg->tokens[is_write];
 
+    tokenp = blk_get_public(token);
+    if (tokenp->pending_reqs[is_write] &&
+        tokenp->throttle_credit[is_write] > 0) {
+        return token;
+    }
+
     /* get next bs round in round robin style */
     token = throttle_group_next_blk(token);
-    while (token != start && !blkp->pending_reqs[is_write]) {
+    while (token != start && !blk_get_public(token)->pending_reqs[is_write]) {
         token = throttle_group_next_blk(token);
     }
 
@@ -196,7 +241,7 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
      * then decide the token is the current bs because chances are
      * the current bs get the current request queued.
      */
-    if (token == start && !blkp->pending_reqs[is_write]) {
+    if (token == start && !blk_get_public(token)->pending_reqs[is_write]) {
         token = blk;
     }
 
@@ -234,7 +279,7 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
 
     /* If a timer just got armed, set blk as the current token */
     if (must_wait) {
-        tg->tokens[is_write] = blk;
+        throttle_group_set_token(tg, blk, is_write);
         tg->any_timer_armed[is_write] = true;
     }
 
@@ -254,10 +299,12 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
     bool must_wait;
     BlockBackend *token;
+    BlockBackendPublic *tokenp;
 
     /* Check if there's any pending request to schedule next */
     token = next_throttle_token(blk, is_write);
-    if (!blkp->pending_reqs[is_write]) {
+    tokenp = blk_get_public(token);
+    if (!tokenp->pending_reqs[is_write]) {
         return;
     }
 
@@ -266,17 +313,22 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current blk */
+        /* A request of a member running in this thread is woken up as soon
+         * as the current coroutine yields, so that a whole batch of requests
+         * can be dispatched after a single timer fire.  Other threads are
+         * kicked through the member's timer.
+         */
         if (qemu_in_coroutine() &&
-            qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
-            token = blk;
+            blk_get_aio_context(token) == blk_get_aio_context(blk) &&
+            qemu_co_queue_next(&tokenp->throttled_reqs[is_write])) {
+            /* nothing else to do */
         } else {
-            ThrottleTimers *tt = &blkp->throttle_timers;
+            ThrottleTimers *tt = &tokenp->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
             timer_mod(tt->timers[is_write], now + 1);
             tg->any_timer_armed[is_write] = true;
         }
-        tg->tokens[is_write] = token;
+        throttle_group_set_token(tg, token, is_write);
     }
 }
 
@@ -314,6 +366,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    blkp->throttle_credit[is_write] -= MAX(bytes, THROTTLE_GROUP_MIN_COST);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -361,6 +414,36 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_co_enter_next(&blkp->throttled_reqs[1]);
 }
 
+/* Set the share of the group's limits that a member gets when the group is
+ * congested, relative to the weights of the other members.  The weight
+ * belongs to the BlockBackend and is kept if it changes groups.
+ *
+ * @blk:    a BlockBackend
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_MAX_WEIGHT
+ */
+void throttle_group_set_weight(BlockBackend *blk, unsigned weight)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg;
+
+    assert(weight > 0 && weight <= THROTTLE_GROUP_MAX_WEIGHT);
+
+    if (!blkp->throttle_state) {
+        blkp->throttle_weight = weight;
+        return;
+    }
+
+    tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+unsigned throttle_group_get_weight(BlockBackend *blk)
+{
+    return blk_get_public(blk)->throttle_weight;
+}
+
 /* Get the throttle configuration from a particular group. Similar to
  * throttle_get_config(), but guarantees atomicity within the
  * throttling group.
@@ -443,8 +526,9 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     qemu_mutex_lock(&tg->lock);
     /* If the ThrottleGroup is new set this BlockBackend as the token */
     for (i = 0; i < 2; i++) {
+        blkp->throttle_credit[i] = 0;
         if (!tg->tokens[i]) {
-            tg->tokens[i] = blk;
+            throttle_group_set_token(tg, blk, i);
         }
     }
 
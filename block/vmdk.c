@@ -33,6 +33,7 @@
 #include "qemu/bswap.h"
 #include "migration/migration.h"
 #include "qemu/cutils.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -128,6 +129,12 @@ typedef struct BDRVVmdkState {
     VmdkExtent *extents;
     Error *migration_blocker;
     char *create_type;
+
+    /* Compressed writes are compressed concurrently, then written in the
+     * order they were issued, as a stream-optimized image must be laid out */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_queue;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -971,6 +978,7 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
     s->cid = vmdk_read_cid(bs, 0);
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Disable migration when VMDK images are used */
     error_setg(&s->migration_blocker, "The vmdk format used by node '%s' "
@@ -1321,10 +1329,14 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * @grain: for a compressed extent, the data already compressed into a grain
+ *         marker, or NULL to compress it here
+ */
 static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
                             int64_t offset_in_cluster, QEMUIOVector *qiov,
                             uint64_t qiov_offset, uint64_t n_bytes,
-                            uint64_t offset)
+                            uint64_t offset, VmdkGrainMarker *grain)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
@@ -1341,25 +1353,28 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
             ret = -EINVAL;
             goto out;
         }
-        buf_len = (extent->cluster_sectors << 9) * 2;
-        data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
+        if (!grain) {
+            buf_len = (extent->cluster_sectors << 9) * 2;
+            data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
 
-        compressed_data = g_malloc(n_bytes);
-        qemu_iovec_to_buf(qiov, qiov_offset, compressed_data, n_bytes);
-        ret = compress(data->data, &buf_len, compressed_data, n_bytes);
-        g_free(compressed_data);
+            compressed_data = g_malloc(n_bytes);
+            qemu_iovec_to_buf(qiov, qiov_offset, compressed_data, n_bytes);
+            ret = compress(data->data, &buf_len, compressed_data, n_bytes);
+            g_free(compressed_data);
 
-        if (ret != Z_OK || buf_len == 0) {
-            ret = -EINVAL;
-            goto out;
-        }
+            if (ret != Z_OK || buf_len == 0) {
+                ret = -EINVAL;
+                goto out;
+            }
 
-        data->lba = offset >> BDRV_SECTOR_BITS;
-        data->size = buf_len;
+            data->lba = offset >> BDRV_SECTOR_BITS;
+            data->size = buf_len;
+            grain = data;
+        }
 
-        n_bytes = buf_len + sizeof(VmdkGrainMarker);
+        n_bytes = grain->size + sizeof(VmdkGrainMarker);
         iov = (struct iovec) {
-            .iov_base   = data,
+            .iov_base   = grain,
             .iov_len    = n_bytes,
         };
         qemu_iovec_init_external(&local_qiov, &iov, 1);
@@ -1540,7 +1555,7 @@ fail:
  */
 static int vmdk_pwritev(BlockDriverState *bs, uint64_t offset,
                        uint64_t bytes, QEMUIOVector *qiov,
-                       bool zeroed, bool zero_dry_run)
+                       bool zeroed, bool zero_dry_run, VmdkGrainMarker *grain)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
@@ -1603,7 +1618,7 @@ static int vmdk_pwritev(BlockDriverState *bs, uint64_t offset,
             }
         } else {
             ret = vmdk_write_extent(extent, cluster_offset, offset_in_cluster,
-                                    qiov, bytes_done, n_bytes, offset);
+                                    qiov, bytes_done, n_bytes, offset, grain);
             if (ret) {
                 return ret;
             }
@@ -1640,7 +1655,7 @@ vmdk_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     int ret;
     BDRVVmdkState *s = bs->opaque;
     qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_pwritev(bs, offset, bytes, qiov, false, false);
+    ret = vmdk_pwritev(bs, offset, bytes, qiov, false, false, NULL);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1653,12 +1668,40 @@ typedef struct VmdkWriteCompressedCo {
     int ret;
 } VmdkWriteCompressedCo;
 
+typedef struct VmdkCompressData {
+    const uint8_t *buf;
+    uLong bytes;
+    VmdkGrainMarker *grain;
+    uLongf len;
+} VmdkCompressData;
+
+static int vmdk_compress_func(void *opaque)
+{
+    VmdkCompressData *data = opaque;
+    int ret;
+
+    ret = compress(data->grain->data, &data->len, data->buf, data->bytes);
+    if (ret != Z_OK || data->len == 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static void vmdk_co_write_compressed(void *opaque)
 {
     VmdkWriteCompressedCo *co = opaque;
+    BDRVVmdkState *s = co->bs->opaque;
+    VmdkExtent *extent = &s->extents[0];
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(co->bs));
+    VmdkCompressData data = { .grain = NULL };
     QEMUIOVector local_qiov;
     uint64_t offset = co->sector_num * BDRV_SECTOR_SIZE;
     uint64_t bytes = co->nb_sectors * BDRV_SECTOR_SIZE;
+    uint64_t grain_bytes = extent->cluster_sectors * BDRV_SECTOR_SIZE;
+    /* Taken before anything can yield, so that the order of the calls is
+     * the order of the writes */
+    uint64_t seq = s->compress_seq_next++;
+    int ret = 0;
 
     struct iovec iov = (struct iovec) {
         .iov_base   = (uint8_t*) co->buf,
@@ -1666,7 +1709,33 @@ static void vmdk_co_write_compressed(void *opaque)
     };
     qemu_iovec_init_external(&local_qiov, &iov, 1);
 
-    co->ret = vmdk_pwritev(co->bs, offset, bytes, &local_qiov, false, false);
+    /* A write within a single grain is compressed in the thread pool before
+     * its turn comes */
+    if (bytes && extent->has_marker &&
+        vmdk_find_offset_in_cluster(extent, offset) + bytes <= grain_bytes) {
+        data = (VmdkCompressData) {
+            .buf    = co->buf,
+            .bytes  = bytes,
+            .grain  = g_malloc(grain_bytes * 2 + sizeof(VmdkGrainMarker)),
+            .len    = grain_bytes * 2,
+        };
+        ret = thread_pool_submit_co(pool, vmdk_compress_func, &data);
+        data.grain->lba = co->sector_num;
+        data.grain->size = data.len;
+    }
+
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_queue);
+    }
+    if (ret == 0) {
+        ret = vmdk_pwritev(co->bs, offset, bytes, &local_qiov, false, false,
+                           data.grain);
+    }
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_queue);
+
+    g_free(data.grain);
+    co->ret = ret;
 }
 
 static int vmdk_write_compressed(BlockDriverState *bs,
@@ -1686,6 +1755,11 @@ static int vmdk_write_compressed(BlockDriverState *bs,
             .nb_sectors = nb_sectors,
             .ret        = -EINPROGRESS,
         };
+
+        if (qemu_in_coroutine()) {
+            vmdk_co_write_compressed(&data);
+            return data.ret;
+        }
         co = qemu_coroutine_create(vmdk_co_write_compressed, &data);
         qemu_coroutine_enter(co);
         while (data.ret == -EINPROGRESS) {
@@ -1708,9 +1782,9 @@ static int coroutine_fn vmdk_co_pwrite_zeroes(BlockDriverState *bs,
     qemu_co_mutex_lock(&s->lock);
     /* write zeroes could fail if sectors not aligned to cluster, test it with
      * dry_run == true before really updating image */
-    ret = vmdk_pwritev(bs, offset, bytes, NULL, true, true);
+    ret = vmdk_pwritev(bs, offset, bytes, NULL, true, true, NULL);
     if (!ret) {
-        ret = vmdk_pwritev(bs, offset, bytes, NULL, true, false);
+        ret = vmdk_pwritev(bs, offset, bytes, NULL, true, false, NULL);
     }
     qemu_co_mutex_unlock(&s->lock);
     return ret;
@@ -2329,6 +2403,8 @@ static int vmdk_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
         }
     }
     bdi->needs_compressed_writes = s->extents[0].compressed;
+    bdi->pipelined_compressed_writes = s->num_extents == 1 &&
+                                       s->extents[0].compressed;
     if (!s->extents[0].flat) {
         bdi->cluster_size = s->extents[0].cluster_sectors << BDRV_SECTOR_BITS;
     }
@@ -0,0 +1,424 @@
+/*
+ * Write-back cache filter block driver
+ *
+ * Guests issuing many small writes to high-latency backends are bound by the
+ * round trip of every request.  This filter completes small writes from a
+ * bounded in-memory cache, coalescing overlapping and adjacent writes into
+ * larger extents that are written back on flush, on FUA requests and when the
+ * cache runs full.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define WRITE_CACHE_DEFAULT_SIZE        (16 * 1024 * 1024)
+#define WRITE_CACHE_DEFAULT_BYPASS_SIZE (128 * 1024)
+
+typedef struct WriteCacheExtent {
+    int64_t offset;
+    uint64_t bytes;
+    uint8_t *data;
+    /* Being written back, must not be merged with new writes */
+    bool flushing;
+    QTAILQ_ENTRY(WriteCacheExtent) next;
+} WriteCacheExtent;
+
+typedef struct BDRVWriteCacheState {
+    uint64_t size;
+    uint64_t bypass_size;
+
+    /* Dirty extents, oldest first.  Newer extents take precedence where
+     * they overlap older ones, and extents being written back always come
+     * before all others. */
+    QTAILQ_HEAD(, WriteCacheExtent) extents;
+    uint64_t dirty_bytes;
+
+    /* Serialises write back */
+    CoMutex writeback_lock;
+
+    /* Held shared by readers while they read from the image and overlay the
+     * cached data, so that written back extents stay visible to them until
+     * they are done. */
+    CoRwlock lock;
+} BDRVWriteCacheState;
+
+static QemuOptsList write_cache_runtime_opts = {
+    .name = "write-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(write_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of dirty data in the cache "
+                    "(default: 16M)",
+        },
+        {
+            .name = "bypass-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Writes of at least this size bypass the cache "
+                    "(default: 128k)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int write_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int ret;
+
+    opts = qemu_opts_create(&write_cache_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->size = qemu_opt_get_size(opts, "size", WRITE_CACHE_DEFAULT_SIZE);
+    s->bypass_size = qemu_opt_get_size(opts, "bypass-size",
+                                       WRITE_CACHE_DEFAULT_BYPASS_SIZE);
+
+    /* A merged extent must still fit into a single request */
+    if (s->size < BDRV_SECTOR_SIZE ||
+        s->size > BDRV_REQUEST_MAX_SECTORS * BDRV_SECTOR_SIZE) {
+        error_setg(errp, "size must be between 512 and %d",
+                   BDRV_REQUEST_MAX_SECTORS * BDRV_SECTOR_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->bypass_size < 1 || s->bypass_size > s->size) {
+        error_setg(errp, "bypass-size must be between 1 and size");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    QTAILQ_INIT(&s->extents);
+    qemu_co_mutex_init(&s->writeback_lock);
+    qemu_co_rwlock_init(&s->lock);
+
+    bs->supported_write_flags = BDRV_REQ_FUA;
+    bs->supported_zero_flags = BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP;
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void write_cache_free_extent(BDRVWriteCacheState *s,
+                                    WriteCacheExtent *e)
+{
+    QTAILQ_REMOVE(&s->extents, e, next);
+    s->dirty_bytes -= e->bytes;
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+static void write_cache_close(BlockDriverState *bs)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *e, *next;
+
+    /* bdrv_close() has flushed the cache, unless writing it back failed */
+    QTAILQ_FOREACH_SAFE(e, &s->extents, next, next) {
+        write_cache_free_extent(s, e);
+    }
+}
+
+/* Writes all extents that are currently dirty back to the image */
+static int coroutine_fn write_cache_co_writeback(BlockDriverState *bs)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *e;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->writeback_lock);
+
+    QTAILQ_FOREACH(e, &s->extents, next) {
+        e->flushing = true;
+    }
+
+    while ((e = QTAILQ_FIRST(&s->extents)) && e->flushing) {
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base   = e->data,
+            .iov_len    = e->bytes,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_pwritev(bs->file, e->offset, e->bytes, &qiov, 0);
+        trace_write_cache_writeback(bs, e->offset, e->bytes, ret);
+        if (ret < 0) {
+            break;
+        }
+
+        qemu_co_rwlock_wrlock(&s->lock);
+        write_cache_free_extent(s, e);
+        qemu_co_rwlock_unlock(&s->lock);
+    }
+
+    /* Extents that could not be written stay dirty; they are still older
+     * than everything else in the list */
+    QTAILQ_FOREACH(e, &s->extents, next) {
+        e->flushing = false;
+    }
+
+    qemu_co_mutex_unlock(&s->writeback_lock);
+    return ret;
+}
+
+static bool write_cache_overlaps(WriteCacheExtent *e, int64_t offset,
+                                 uint64_t bytes)
+{
+    return offset < e->offset + e->bytes && e->offset < offset + bytes;
+}
+
+/* Adds a write to the cache, merging it with all dirty extents that overlap
+ * or touch it.  Doesn't yield. */
+static void write_cache_insert(BlockDriverState *bs, int64_t offset,
+                               uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *e, *merged, *next;
+    int64_t start = offset;
+    int64_t end = offset + bytes;
+    bool grown;
+
+    /* Older dirty extents may overlap each other after a failed write back,
+     * so extend the range until no unmerged dirty extent touches it */
+    do {
+        grown = false;
+        QTAILQ_FOREACH(e, &s->extents, next) {
+            if (e->flushing || e->offset > end ||
+                e->offset + e->bytes < start) {
+                continue;
+            }
+            if (e->offset < start || e->offset + e->bytes > end) {
+                start = MIN(start, e->offset);
+                end = MAX(end, e->offset + e->bytes);
+                grown = true;
+            }
+        }
+    } while (grown);
+
+    merged = g_new0(WriteCacheExtent, 1);
+    merged->offset = start;
+    merged->bytes = end - start;
+    merged->data = qemu_blockalign(bs->file->bs, merged->bytes);
+
+    /* Apply the old data oldest first, then the new write on top */
+    QTAILQ_FOREACH_SAFE(e, &s->extents, next, next) {
+        if (e->flushing || e->offset > end || e->offset + e->bytes < start) {
+            continue;
+        }
+        memcpy(merged->data + e->offset - start, e->data, e->bytes);
+        write_cache_free_extent(s, e);
+    }
+    qemu_iovec_to_buf(qiov, 0, merged->data + offset - start, bytes);
+
+    QTAILQ_INSERT_TAIL(&s->extents, merged, next);
+    s->dirty_bytes += merged->bytes;
+
+    trace_write_cache_insert(bs, offset, bytes, start, end - start);
+}
+
+static int coroutine_fn write_cache_co_preadv(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *e;
+    bool covered = false;
+    int ret = 0;
+
+    qemu_co_rwlock_rdlock(&s->lock);
+
+    QTAILQ_FOREACH(e, &s->extents, next) {
+        if (e->offset <= offset && e->offset + e->bytes >= offset + bytes) {
+            covered = true;
+            break;
+        }
+    }
+
+    if (!covered || (flags & BDRV_REQ_COPY_ON_READ)) {
+        ret = bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    QTAILQ_FOREACH(e, &s->extents, next) {
+        int64_t start, end;
+
+        if (!write_cache_overlaps(e, offset, bytes)) {
+            continue;
+        }
+        start = MAX(e->offset, offset);
+        end = MIN(e->offset + e->bytes, offset + bytes);
+        qemu_iovec_from_buf(qiov, start - offset, e->data + start - e->offset,
+                            end - start);
+    }
+
+out:
+    qemu_co_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn write_cache_co_pwritev(BlockDriverState *bs,
+                                               uint64_t offset, uint64_t bytes,
+                                               QEMUIOVector *qiov, int flags)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    int ret;
+
+    /* FUA and large writes go to the image directly, after the cached data
+     * they may overwrite */
+    if ((flags & BDRV_REQ_FUA) || bytes >= s->bypass_size) {
+        ret = write_cache_co_writeback(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        return bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    }
+
+    while (s->dirty_bytes + bytes > s->size) {
+        ret = write_cache_co_writeback(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    write_cache_insert(bs, offset, bytes, qiov);
+    return 0;
+}
+
+static int coroutine_fn write_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset, int count,
+                                                     BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = write_cache_co_writeback(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_pwrite_zeroes(bs->file, offset, count, flags);
+}
+
+static int coroutine_fn write_cache_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int count)
+{
+    int ret;
+
+    ret = write_cache_co_writeback(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_co_pdiscard(bs->file->bs, offset, count);
+}
+
+static int coroutine_fn write_cache_co_flush_to_os(BlockDriverState *bs)
+{
+    return write_cache_co_writeback(bs);
+}
+
+static int64_t coroutine_fn
+write_cache_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors, int *pnum,
+                                BlockDriverState **file)
+{
+    BDRVWriteCacheState *s = bs->opaque;
+    WriteCacheExtent *e;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int64_t limit = offset + (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t end = limit;
+    int64_t cached_end = offset;
+
+    /* Cached data isn't in the image yet, so it can't be looked up there */
+    QTAILQ_FOREACH(e, &s->extents, next) {
+        if (write_cache_overlaps(e, offset, BDRV_SECTOR_SIZE)) {
+            cached_end = MAX(cached_end, e->offset + e->bytes);
+        } else if (e->offset > offset) {
+            end = MIN(end, QEMU_ALIGN_DOWN(e->offset, BDRV_SECTOR_SIZE));
+        }
+    }
+
+    if (cached_end > offset) {
+        end = MIN(QEMU_ALIGN_UP(cached_end, BDRV_SECTOR_SIZE), limit);
+        *pnum = (end - offset) >> BDRV_SECTOR_BITS;
+        return BDRV_BLOCK_DATA;
+    }
+
+    *pnum = (end - offset) >> BDRV_SECTOR_BITS;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID | BDRV_BLOCK_DATA |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int write_cache_truncate(BlockDriverState *bs, int64_t offset)
+{
+    int ret;
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static int64_t write_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int write_cache_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    return bdrv_get_info(bs->file->bs, bdi);
+}
+
+static bool write_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                    BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_write_cache = {
+    .format_name            = "write-cache",
+    .instance_size          = sizeof(BDRVWriteCacheState),
+
+    .bdrv_open              = write_cache_open,
+    .bdrv_close             = write_cache_close,
+    .bdrv_getlength         = write_cache_getlength,
+    .bdrv_truncate          = write_cache_truncate,
+    .bdrv_get_info          = write_cache_get_info,
+
+    .bdrv_co_preadv         = write_cache_co_preadv,
+    .bdrv_co_pwritev        = write_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = write_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = write_cache_co_pdiscard,
+    .bdrv_co_flush_to_os    = write_cache_co_flush_to_os,
+    .bdrv_co_get_block_status = write_cache_co_get_block_status,
+
+    .has_variable_length    = true,
+    .is_filter              = true,
+    .bdrv_recurse_is_first_non_filter = write_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_write_cache_init(void)
+{
+    bdrv_register(&bdrv_write_cache);
+}
+
+block_init(bdrv_write_cache_init);
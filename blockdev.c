@@ -210,6 +210,17 @@ QemuOpts *drive_add(BlockInterfaceType type, int index, const char *file,
     return opts;
 }
 
+/*
+ * While drive_new_all() runs, every drive_new() holds drive_init_lock
+ * except while it opens its image, so that the opens overlap and the rest
+ * happens in command line order.  Drives whose image is still being opened
+ * are on drive_init_pending, so that they keep their bus and unit.
+ */
+static bool drive_init_parallel;
+static CoMutex drive_init_lock;
+static QTAILQ_HEAD(, DriveInfo) drive_init_pending =
+    QTAILQ_HEAD_INITIALIZER(drive_init_pending);
+
 DriveInfo *drive_get(BlockInterfaceType type, int bus, int unit)
 {
     BlockBackend *blk;
@@ -223,6 +234,12 @@ DriveInfo *drive_get(BlockInterfaceType type, int bus, int unit)
         }
     }
 
+    QTAILQ_FOREACH(dinfo, &drive_init_pending, next) {
+        if (dinfo->type == type && dinfo->bus == bus && dinfo->unit == unit) {
+            return dinfo;
+        }
+    }
+
     return NULL;
 }
 
@@ -377,6 +394,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -484,6 +503,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -530,6 +550,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.group-weight",
+                                            THROTTLE_GROUP_DEFAULT_WEIGHT);
+    if (throttling_weight < 1 ||
+        throttling_weight > THROTTLE_GROUP_MAX_WEIGHT) {
+        error_setg(errp, "throttling.group-weight must be between 1 and %d",
+                   THROTTLE_GROUP_MAX_WEIGHT);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -594,7 +623,17 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             bdrv_flags |= BDRV_O_INACTIVE;
         }
 
-        blk = blk_new_open(file, NULL, bs_opts, bdrv_flags, errp);
+        if (drive_init_parallel) {
+            Location loc;
+
+            loc_save(&loc);
+            qemu_co_mutex_unlock(&drive_init_lock);
+            blk = blk_new_open(file, NULL, bs_opts, bdrv_flags, errp);
+            qemu_co_mutex_lock(&drive_init_lock);
+            loc_restore(&loc);
+        } else {
+            blk = blk_new_open(file, NULL, bs_opts, bdrv_flags, errp);
+        }
         if (!blk) {
             goto err_no_bs_opts;
         }
@@ -616,6 +655,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     }
 
     /* disk I/O throttling */
+    throttle_group_set_weight(blk, throttling_weight);
     if (throttle_enabled(&cfg)) {
         if (!throttling_group) {
             throttling_group = id;
@@ -870,6 +910,7 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         { "iops_size",      "throttling.iops-size" },
 
         { "group",          "throttling.group" },
+        { "group_weight",   "throttling.group-weight" },
 
         { "readonly",       "read-only" },
     };
@@ -1128,18 +1169,6 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         qdict_put(bs_opts, "rerror", qstring_from_str(rerror));
     }
 
-    /* Actual block device init: Functionality shared with blockdev-add */
-    blk = blockdev_init(filename, bs_opts, &local_err);
-    bs_opts = NULL;
-    if (!blk) {
-        if (local_err) {
-            error_report_err(local_err);
-        }
-        goto fail;
-    } else {
-        assert(!local_err);
-    }
-
     /* Create legacy DriveInfo */
     dinfo = g_malloc0(sizeof(*dinfo));
     dinfo->opts = all_opts;
@@ -1155,8 +1184,6 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     dinfo->devaddr = devaddr;
     dinfo->serial = g_strdup(serial);
 
-    blk_set_legacy_dinfo(blk, dinfo);
-
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -1168,12 +1195,102 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         break;
     }
 
+    /* Actual block device init: Functionality shared with blockdev-add */
+    if (drive_init_parallel) {
+        QTAILQ_INSERT_TAIL(&drive_init_pending, dinfo, next);
+    }
+    blk = blockdev_init(filename, bs_opts, &local_err);
+    bs_opts = NULL;
+    if (drive_init_parallel) {
+        QTAILQ_REMOVE(&drive_init_pending, dinfo, next);
+    }
+    if (!blk) {
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        g_free(dinfo->serial);
+        g_free(dinfo);
+        dinfo = NULL;
+        goto fail;
+    } else {
+        assert(!local_err);
+    }
+
+    blk_set_legacy_dinfo(blk, dinfo);
+
 fail:
     qemu_opts_del(legacy_opts);
     QDECREF(bs_opts);
     return dinfo;
 }
 
+typedef struct DriveInitCo {
+    QemuOpts *opts;
+    BlockInterfaceType block_default_type;
+    bool done;
+    bool ok;
+} DriveInitCo;
+
+static void coroutine_fn drive_new_co(void *opaque)
+{
+    DriveInitCo *d = opaque;
+
+    qemu_co_mutex_lock(&drive_init_lock);
+    qemu_opts_loc_restore(d->opts);
+    d->ok = drive_new(d->opts, d->block_default_type) != NULL;
+    qemu_co_mutex_unlock(&drive_init_lock);
+    d->done = true;
+}
+
+static int drive_init_add(void *opaque, QemuOpts *opts, Error **errp)
+{
+    GArray *drives = opaque;
+    DriveInitCo d = { .opts = opts };
+
+    g_array_append_val(drives, d);
+    return 0;
+}
+
+/*
+ * Create all -drive backends.  Each drive_new() runs in a coroutine, so
+ * that the metadata reads of image formats and backing files on one drive
+ * overlap with those of the others.  Unlike a loop over drive_new(), this
+ * tries every drive before reporting failure.
+ */
+bool drive_new_all(BlockInterfaceType block_default_type)
+{
+    GArray *drives = g_array_new(false, false, sizeof(DriveInitCo));
+    Location loc;
+    bool ok = true;
+    int i;
+
+    qemu_opts_foreach(qemu_find_opts("drive"), drive_init_add, drives, NULL);
+
+    loc_push_none(&loc);
+    qemu_co_mutex_init(&drive_init_lock);
+    drive_init_parallel = true;
+
+    for (i = 0; i < drives->len; i++) {
+        DriveInitCo *d = &g_array_index(drives, DriveInitCo, i);
+
+        d->block_default_type = block_default_type;
+        qemu_coroutine_enter(qemu_coroutine_create(drive_new_co, d));
+    }
+    for (i = 0; i < drives->len; i++) {
+        DriveInitCo *d = &g_array_index(drives, DriveInitCo, i);
+
+        while (!d->done) {
+            aio_poll(qemu_get_aio_context(), true);
+        }
+        ok &= d->ok;
+    }
+
+    drive_init_parallel = false;
+    loc_pop(&loc);
+    g_array_free(drives, true);
+    return ok;
+}
+
 void hmp_commit(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
@@ -2031,6 +2148,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2712,6 +2830,16 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_group_weight) {
+        if (arg->group_weight < 1 ||
+            arg->group_weight > THROTTLE_GROUP_MAX_WEIGHT) {
+            error_setg(errp, "group_weight must be between 1 and %d",
+                       THROTTLE_GROUP_MAX_WEIGHT);
+            goto out;
+        }
+        throttle_group_set_weight(blk, arg->group_weight);
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2732,12 +2860,85 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    int ret = 0;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    if (has_boundaries || has_boundaries_read) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_READ,
+            has_boundaries_read ? boundaries_read : boundaries);
+        if (ret < 0) {
+            error_setg(errp, "Read latency histogram boundaries must be "
+                       "strictly ascending");
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_write) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_WRITE,
+            has_boundaries_write ? boundaries_write : boundaries);
+        if (ret < 0) {
+            error_setg(errp, "Write latency histogram boundaries must be "
+                       "strictly ascending");
+            goto out;
+        }
+    }
+
+    if (has_boundaries || has_boundaries_flush) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_FLUSH,
+            has_boundaries_flush ? boundaries_flush : boundaries);
+        if (ret < 0) {
+            error_setg(errp, "Flush latency histogram boundaries must be "
+                       "strictly ascending");
+            goto out;
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2763,7 +2964,19 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -3140,7 +3353,7 @@ void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
             goto out;
         }
         commit_active_start(has_job_id ? job_id : NULL, bs, base_bs, speed,
-                            on_error, block_job_cb, bs, &local_err);
+                            on_error, block_job_cb, bs, &local_err, false);
     } else {
         commit_start(has_job_id ? job_id : NULL, bs, base_bs, top_bs, speed,
                      on_error, block_job_cb, bs,
@@ -3412,6 +3625,8 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3433,6 +3648,9 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3462,7 +3680,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     mirror_start(job_id, bs, target,
                  has_replaces ? replaces : NULL,
                  speed, granularity, buf_size, sync, backing_mode,
-                 on_source_error, on_target_error, unmap,
+                 on_source_error, on_target_error, unmap, copy_mode,
                  block_job_cb, bs, errp);
 }
 
@@ -3609,6 +3827,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_on_source_error, arg->on_source_error,
                            arg->has_on_target_error, arg->on_target_error,
                            arg->has_unmap, arg->unmap,
+                           arg->has_copy_mode, arg->copy_mode,
                            &local_err);
     bdrv_unref(target_bs);
     error_propagate(errp, local_err);
@@ -3627,6 +3846,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3666,6 +3886,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     error_propagate(errp, local_err);
 
@@ -4146,7 +4367,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
@@ -4247,6 +4468,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.group-weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group's limits (1-1000)",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -4281,7 +4506,7 @@ static QemuOptsList qemu_root_bds_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "read-only",
             .type = QEMU_OPT_BOOL,
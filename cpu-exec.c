@@ -27,8 +27,10 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
 #include "exec/log.h"
+#include "exec/helper-proto.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
 #include "hw/i386/apic.h"
 #endif
@@ -168,6 +170,9 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     last_tb = (TranslationBlock *)(ret & ~TB_EXIT_MASK);
     tb_exit = ret & TB_EXIT_MASK;
     trace_exec_tb_exit(last_tb, tb_exit);
+    if (unlikely(last_tb->cflags & CF_EXEC_COUNT)) {
+        atomic_inc(&last_tb->exit_count);
+    }
 
     if (tb_exit > TB_EXIT_IDX1) {
         /* We didn't start executing this TB (eg because the instruction
@@ -210,6 +215,7 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     old_tb_flushed = cpu->tb_flushed;
     cpu->tb_flushed = false;
     tb = tb_gen_code(cpu, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
@@ -217,11 +223,16 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
                          | (ignore_icount ? CF_IGNORE_ICOUNT : 0));
     tb->orig_tb = cpu->tb_flushed ? NULL : orig_tb;
     cpu->tb_flushed |= old_tb_flushed;
+    tb_unlock();
+
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb);
+
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 #endif
 
@@ -239,6 +250,7 @@ static bool tb_cmp(const void *p, const void *d)
     const struct tb_desc *desc = d;
 
     if (tb->pc == desc->pc &&
+        !atomic_read(&tb->invalid) &&
         tb->page_addr[0] == desc->phys_page1 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags) {
@@ -285,40 +297,85 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
 {
     TranslationBlock *tb;
 
+    /* The hash table can be looked up without tb_lock */
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        goto found;
+    if (!tb) {
+        /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
+         * taken outside tb_lock.
+         */
+        mmap_lock();
+        tb_lock();
+
+        /* There's a chance that our desired tb has been translated
+         * while we were taking the locks, so look again.
+         */
+        tb = tb_find_physical(cpu, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        }
+
+        tb_unlock();
+        mmap_unlock();
     }
 
-#ifdef CONFIG_USER_ONLY
-    /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
-     */
-    tb_unlock();
+    /* we add the TB in the virtual pc hash table */
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    return tb;
+}
+
+/* TB has run TB_HOT_THRESHOLD times: replace it with a superblock, which
+ * the translator lets run on across forward branches.  Jumps into the old
+ * TB are reset by the invalidation and get chained to the new one as
+ * their sources come back through tb_find_fast.
+ */
+static TranslationBlock *tb_find_hot(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint32_t flags = tb->flags;
+
     mmap_lock();
     tb_lock();
+    if (!tb->invalid) {
+        tb_phys_invalidate(tb, -1);
+    }
+    /* Another vCPU may have got here first */
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    if (!tb) {
+        tb = tb_gen_code(cpu, pc, cs_base, flags, CF_SUPERBLOCK);
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
-#ifdef CONFIG_USER_ONLY
+    tb_unlock();
     mmap_unlock();
-#endif
 
-found:
-    /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
+/* Called by TBs ending in goto_ptr to find their successor without going
+ * back to cpu_exec.  Only TBs that are already translated are returned;
+ * otherwise the epilogue is, and the main loop takes it from there.
+ */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    uint32_t flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        tb = tb_find_physical(cpu, pc, cs_base, flags);
+        if (!tb) {
+            return tcg_ctx.code_gen_epilogue;
+        }
+        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    }
+    return tb->tc_ptr;
+}
+
 static inline TranslationBlock *tb_find_fast(CPUState *cpu,
                                              TranslationBlock **last_tb,
                                              int tb_exit)
@@ -332,18 +389,17 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb_lock();
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
     }
-    if (cpu->tb_flushed) {
-        /* Ensure that no TB jump will be modified as the
-         * translation buffer has been flushed.
-         */
-        *last_tb = NULL;
-        cpu->tb_flushed = false;
+    if (unlikely(tb->cflags & CF_HOT_COUNT) &&
+        atomic_read(&tb->exec_count) >= TB_HOT_THRESHOLD) {
+        if (*last_tb == tb) {
+            *last_tb = NULL;
+        }
+        tb = tb_find_hot(cpu, tb);
     }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
@@ -356,12 +412,34 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
 #endif
     /* See if we can patch the calling TB. */
     if (*last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-        tb_add_jump(*last_tb, tb_exit, tb);
+        tb_lock();
+        if (cpu->tb_flushed) {
+            /* Ensure that no TB jump will be modified as the
+             * translation buffer has been flushed.
+             */
+            cpu->tb_flushed = false;
+        } else if (!tb->invalid) {
+            tb_add_jump(*last_tb, tb_exit, tb);
+        }
+        tb_unlock();
     }
-    tb_unlock();
     return tb;
 }
 
+/* With MTTCG the vCPU executes guest code without the BQL, taking it
+ * only where device or global state is involved.  Returns true if the
+ * lock was taken here and must be released by the caller; a longjmp out
+ * of cpu_exec releases it instead.
+ */
+static inline bool cpu_exec_lock_iothread(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
 static inline bool cpu_handle_halt(CPUState *cpu)
 {
     if (cpu->halted) {
@@ -369,8 +447,13 @@ static inline bool cpu_handle_halt(CPUState *cpu)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
             X86CPU *x86_cpu = X86_CPU(cpu);
+            bool locked = cpu_exec_lock_iothread();
+
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            if (locked) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -424,8 +507,13 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
 #else
             if (replay_exception()) {
                 CPUClass *cc = CPU_GET_CLASS(cpu);
+                bool locked = cpu_exec_lock_iothread();
+
                 cc->do_interrupt(cpu);
                 cpu->exception_index = -1;
+                if (locked) {
+                    qemu_mutex_unlock_iothread();
+                }
             } else if (!replay_has_interrupt()) {
                 /* give a chance to iothread in replay mode */
                 *ret = EXCP_INTERRUPT;
@@ -451,9 +539,12 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
                                         TranslationBlock **last_tb)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
-    int interrupt_request = cpu->interrupt_request;
+    int interrupt_request = atomic_read(&cpu->interrupt_request);
 
     if (unlikely(interrupt_request)) {
+        bool locked = cpu_exec_lock_iothread();
+
+        interrupt_request = cpu->interrupt_request;
         if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
             /* Mask out external interrupts for this step. */
             interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -508,6 +599,9 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
                the program flow was changed */
             *last_tb = NULL;
         }
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
     if (unlikely(cpu->exit_request || replay_has_interrupt())) {
         cpu->exit_request = 0;
@@ -642,6 +736,10 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                /* taken by a slow path we have just jumped out of */
+                qemu_mutex_unlock_iothread();
+            }
         }
     } /* for(;;) */
 
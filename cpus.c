@@ -36,6 +36,7 @@
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
 #include "exec/exec-all.h"
+#include "tcg/tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -46,6 +47,8 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "sysemu/numa.h"
+#include "qapi/error.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -75,7 +78,13 @@ int64_t max_advance;
 
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
+/* The highest throttle percentage of any vcpu */
 static unsigned int throttle_percentage;
+/*
+ * Length of a throttle period, each vcpu sleeps its percentage of it.
+ * Protected by the iothread lock.
+ */
+static int64_t throttle_period_ns;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -101,6 +110,20 @@ static bool cpu_thread_is_idle(CPUState *cpu)
     return true;
 }
 
+/* With MTTCG a vCPU also stays out of cpu_exec while exclusive work
+ * queued on another vCPU is pending.
+ */
+static int tcg_pending_safe_work;
+
+static bool qemu_tcg_cpu_thread_is_idle(CPUState *cpu)
+{
+    if (atomic_read(&tcg_pending_safe_work) &&
+        !cpu->stop && !cpu->queued_work_first) {
+        return true;
+    }
+    return cpu_thread_is_idle(cpu);
+}
+
 static bool all_cpu_threads_idle(void)
 {
     CPUState *cpu;
@@ -555,16 +578,19 @@ static void cpu_throttle_thread(void *opaque)
 {
     CPUState *cpu = opaque;
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)atomic_read(&cpu->throttle_percentage) / 100;
+    if (!pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /*
+     * The period lets the most throttled vcpu run for one timeslice,
+     * each vcpu sleeps for its own share of it.
+     */
+    sleeptime_ns = (long)(pct * throttle_period_ns);
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
@@ -581,31 +607,71 @@ static void cpu_throttle_timer_tick(void *opaque)
     if (!cpu_throttle_get_percentage()) {
         return;
     }
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    throttle_period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - pct);
+
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (atomic_read(&cpu->throttle_percentage) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   throttle_period_ns);
+}
+
+/* Ensure throttle percentage is within valid range */
+static int cpu_throttle_clamp(int pct)
+{
+    pct = MIN(pct, CPU_THROTTLE_PCT_MAX);
+    return MAX(pct, CPU_THROTTLE_PCT_MIN);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
 {
-    /* Ensure throttle percentage is within valid range */
-    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
-    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    CPUState *cpu;
+
+    new_throttle_pct = cpu_throttle_clamp(new_throttle_pct);
 
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+    }
     atomic_set(&throttle_percentage, new_throttle_pct);
 
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *vcpu, int new_throttle_pct)
+{
+    CPUState *cpu;
+    int max_pct = 0;
+
+    if (new_throttle_pct) {
+        new_throttle_pct = cpu_throttle_clamp(new_throttle_pct);
+    }
+    atomic_set(&vcpu->throttle_percentage, new_throttle_pct);
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, atomic_read(&cpu->throttle_percentage));
+    }
+    atomic_set(&throttle_percentage, max_pct);
+
+    /* The timer stops by itself once nothing is throttled */
+    if (max_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
     atomic_set(&throttle_percentage, 0);
 }
 
@@ -687,6 +753,40 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    NANOSECONDS_PER_SECOND / 10);
 }
 
+bool mttcg_enabled;
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t) {
+        return;
+    }
+    if (!tcg_enabled()) {
+        error_setg(errp, "The 'thread' option is only supported with TCG");
+        return;
+    }
+    if (strcmp(t, "multi") == 0) {
+        if (TCG_OVERSIZED_GUEST) {
+            error_setg(errp, "No MTTCG when guest word size > host's");
+            return;
+        }
+        if (use_icount) {
+            error_setg(errp, "No MTTCG when icount is enabled");
+            return;
+        }
+#ifndef TARGET_SUPPORTS_MTTCG
+        error_report("Guest not yet converted to MTTCG - "
+                     "you may get unexpected results");
+#endif
+        mttcg_enabled = true;
+    } else if (strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -898,6 +998,10 @@ static QemuCond qemu_cpu_cond;
 /* system init */
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
+/* MTTCG: signalled when the last vCPU leaves cpu_exec */
+static QemuCond qemu_safe_work_cond;
+/* MTTCG: number of vCPUs inside cpu_exec, protected by the BQL */
+static int tcg_running_cpus;
 
 void qemu_init_cpu_loop(void)
 {
@@ -905,12 +1009,27 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_safe_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -923,18 +1042,9 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
+    wi.exclusive = false;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
-
+    queue_work_on_cpu(cpu, &wi);
     qemu_cpu_kick(cpu);
     while (!atomic_mb_read(&wi.done)) {
         CPUState *self_cpu = current_cpu;
@@ -958,18 +1068,35 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->data = data;
     wi->free = true;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
+    queue_work_on_cpu(cpu, wi);
+    qemu_cpu_kick(cpu);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+    CPUState *other_cpu;
+
+    if (!qemu_tcg_mttcg_enabled()) {
+        async_run_on_cpu(cpu, func, data);
+        return;
     }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
 
-    qemu_cpu_kick(cpu);
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+
+    /* Raise the count before queueing, so that no vCPU can enter
+     * cpu_exec once the item is visible; then get everybody out.
+     */
+    atomic_inc(&tcg_pending_safe_work);
+    queue_work_on_cpu(cpu, wi);
+    CPU_FOREACH(other_cpu) {
+        qemu_cpu_kick(other_cpu);
+    }
 }
 
 static void qemu_kvm_destroy_vcpu(CPUState *cpu)
@@ -987,6 +1114,7 @@ static void qemu_tcg_destroy_vcpu(CPUState *cpu)
 static void flush_queued_work(CPUState *cpu)
 {
     struct qemu_work_item *wi;
+    CPUState *other_cpu;
 
     if (cpu->queued_work_first == NULL) {
         return;
@@ -1000,7 +1128,17 @@ static void flush_queued_work(CPUState *cpu)
             cpu->queued_work_last = NULL;
         }
         qemu_mutex_unlock(&cpu->work_mutex);
+        if (wi->exclusive) {
+            while (tcg_running_cpus) {
+                qemu_cond_wait(&qemu_safe_work_cond, &qemu_global_mutex);
+            }
+        }
         wi->func(wi->data);
+        if (wi->exclusive && atomic_fetch_dec(&tcg_pending_safe_work) == 1) {
+            CPU_FOREACH(other_cpu) {
+                qemu_cond_broadcast(other_cpu->halt_cond);
+            }
+        }
         qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
@@ -1023,12 +1161,51 @@ static void qemu_wait_io_event_common(CPUState *cpu)
     cpu->thread_kicked = false;
 }
 
-static void qemu_tcg_wait_io_event(CPUState *cpu)
+/* Start charging a wait for work to @cpu's halt statistics */
+static int64_t cpu_halt_begin(CPUState *cpu)
+{
+    if (!cpu->halted) {
+        return 0;
+    }
+    cpu->halt_count++;
+    return get_clock();
+}
+
+static void cpu_halt_end(CPUState *cpu, int64_t start)
 {
+    if (start) {
+        cpu->halt_ns += get_clock() - start;
+    }
+}
+
+static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
+{
+    CPUState *other;
+    int64_t start = 0;
+
+    if (all_cpu_threads_idle()) {
+        start = get_clock();
+        CPU_FOREACH(other) {
+            if (other->halted) {
+                other->halt_count++;
+            }
+        }
+    }
+
     while (all_cpu_threads_idle()) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
 
+    if (start) {
+        int64_t delta = get_clock() - start;
+
+        CPU_FOREACH(other) {
+            if (other->halted) {
+                other->halt_ns += delta;
+            }
+        }
+    }
+
     while (iothread_requesting_mutex) {
         qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
     }
@@ -1038,11 +1215,32 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+static void qemu_tcg_wait_io_event(CPUState *cpu)
+{
+    int64_t start = 0;
+
+    if (qemu_tcg_cpu_thread_is_idle(cpu)) {
+        start = cpu_halt_begin(cpu);
+    }
+    while (qemu_tcg_cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+    cpu_halt_end(cpu, start);
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
+    int64_t start = 0;
+
+    if (cpu_thread_is_idle(cpu)) {
+        start = cpu_halt_begin(cpu);
+    }
     while (cpu_thread_is_idle(cpu)) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
+    cpu_halt_end(cpu, start);
 
     qemu_kvm_eat_signals(cpu);
     qemu_wait_io_event_common(cpu);
@@ -1051,6 +1249,7 @@ static void qemu_kvm_wait_io_event(CPUState *cpu)
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
+    int64_t exit_start;
     int r;
 
     rcu_register_thread();
@@ -1135,9 +1334,34 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+static int tcg_cpu_exec(CPUState *cpu);
 static void tcg_exec_all(void);
 
-static void *qemu_tcg_cpu_thread_fn(void *arg)
+static const char *const tcg_exit_names[] = {
+    [EXCP_INTERRUPT - EXCP_INTERRUPT] = "interrupt",
+    [EXCP_HLT - EXCP_INTERRUPT] = "hlt",
+    [EXCP_DEBUG - EXCP_INTERRUPT] = "debug",
+    [EXCP_HALTED - EXCP_INTERRUPT] = "halted",
+    [EXCP_YIELD - EXCP_INTERRUPT] = "yield",
+    [EXCP_YIELD - EXCP_INTERRUPT + 1] = "other",
+};
+
+/* Charge the time since cpu_exec() returned @r at @exit_start */
+static void tcg_account_exit(CPUState *cpu, int r, int64_t exit_start)
+{
+    int i = r - EXCP_INTERRUPT;
+
+    if (i < 0 || i >= ARRAY_SIZE(tcg_exit_names)) {
+        i = ARRAY_SIZE(tcg_exit_names) - 1;
+    }
+    cpu->exit_stats[i].count++;
+    cpu->exit_stats[i].ns += get_clock() - exit_start;
+}
+
+/* Single-threaded TCG: one thread runs all vCPUs in round-robin order,
+ * holding the BQL while it executes guest code.
+ */
+static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     CPUState *remove_cpu = NULL;
@@ -1177,7 +1401,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
                 qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
             }
         }
-        qemu_tcg_wait_io_event(QTAILQ_FIRST(&cpus));
+        qemu_tcg_rr_wait_io_event(QTAILQ_FIRST(&cpus));
         CPU_FOREACH(cpu) {
             if (cpu->unplug && !cpu_can_run(cpu)) {
                 remove_cpu = cpu;
@@ -1195,6 +1419,52 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: each vCPU has its own thread, which drops the BQL
+ * while it executes guest code.  Slow paths that need device or global
+ * state take the BQL themselves.
+ */
+static void *qemu_tcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    do {
+        if (cpu_can_run(cpu) && !atomic_read(&tcg_pending_safe_work)) {
+            tcg_running_cpus++;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu);
+            exit_start = get_clock();
+            qemu_mutex_lock_iothread();
+            /* cpu_exec clears current_cpu on the way out */
+            current_cpu = cpu;
+            if (--tcg_running_cpus == 0) {
+                qemu_cond_broadcast(&qemu_safe_work_cond);
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+            tcg_account_exit(cpu, r, exit_start);
+        }
+        qemu_tcg_wait_io_event(cpu);
+    } while (!cpu->unplug || cpu_can_run(cpu));
+
+    qemu_tcg_destroy_vcpu(cpu);
+    cpu->created = false;
+    qemu_cond_signal(&qemu_cpu_cond);
+    qemu_mutex_unlock_iothread();
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1231,7 +1501,11 @@ void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
-        qemu_cpu_kick_no_halt();
+        if (qemu_tcg_mttcg_enabled()) {
+            cpu_exit(cpu);
+        } else {
+            qemu_cpu_kick_no_halt();
+        }
     } else {
         qemu_cpu_kick_thread(cpu);
     }
@@ -1264,10 +1538,10 @@ void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
-     * TCG code execution.
+     * TCG code execution.  MTTCG vCPUs do not hold the BQL while running.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
-        !first_cpu || !first_cpu->created) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() ||
+        qemu_in_vcpu_thread() || !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
     } else {
@@ -1312,7 +1586,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1364,22 +1638,58 @@ void cpu_remove_sync(CPUState *cpu)
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
+/* Run the VCPU thread on the host CPUs of its guest NUMA node, if given */
+static void qemu_vcpu_set_affinity(CPUState *cpu)
+{
+    Error *err = NULL;
+    int node = numa_get_node_for_cpu(cpu->cpu_index);
+
+    if (node == nb_numa_nodes) {
+        return;
+    }
+    numa_set_thread_affinity(cpu->thread, node, &err);
+    if (err) {
+        error_report_err(err);
+    }
+}
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
     static QemuCond *tcg_halt_cond;
     static QemuThread *tcg_cpu_thread;
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    cpu->exit_stats = g_new0(CPUExitStats, ARRAY_SIZE(tcg_exit_names));
+    cpu->exit_stats_names = tcg_exit_names;
+    cpu->exit_stats_nr = ARRAY_SIZE(tcg_exit_names);
+
+    if (qemu_tcg_mttcg_enabled()) {
+        /* one thread per vCPU */
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
-        tcg_halt_cond = cpu->halt_cond;
         snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
                  cpu->cpu_index);
         qemu_thread_create(cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
                            cpu, QEMU_THREAD_JOINABLE);
+        qemu_vcpu_set_affinity(cpu);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    } else if (!tcg_cpu_thread) {
+        /* share a single thread for all cpus with TCG */
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        tcg_halt_cond = cpu->halt_cond;
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_rr_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
 #ifdef _WIN32
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
@@ -1404,6 +1714,7 @@ static void qemu_kvm_start_vcpu(CPUState *cpu)
              cpu->cpu_index);
     qemu_thread_create(cpu->thread, thread_name, qemu_kvm_cpu_thread_fn,
                        cpu, QEMU_THREAD_JOINABLE);
+    qemu_vcpu_set_affinity(cpu);
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
@@ -1516,6 +1827,7 @@ static int64_t tcg_get_icount_limit(void)
 
 static int tcg_cpu_exec(CPUState *cpu)
 {
+    int64_t start;
     int ret;
 #ifdef CONFIG_PROFILER
     int64_t ti;
@@ -1538,7 +1850,9 @@ static int tcg_cpu_exec(CPUState *cpu)
         cpu->icount_decr.u16.low = decr;
         cpu->icount_extra = count;
     }
+    start = get_clock();
     ret = cpu_exec(cpu);
+    cpu->run_ns += get_clock() - start;
 #ifdef CONFIG_PROFILER
     tcg_time += profile_getclock() - ti;
 #endif
@@ -1556,6 +1870,7 @@ static int tcg_cpu_exec(CPUState *cpu)
 
 static void tcg_exec_all(void)
 {
+    int64_t exit_start;
     int r;
 
     /* Account partial waits to QEMU_CLOCK_VIRTUAL.  */
@@ -1572,10 +1887,13 @@ static void tcg_exec_all(void)
 
         if (cpu_can_run(cpu)) {
             r = tcg_cpu_exec(cpu);
+            exit_start = get_clock();
             if (r == EXCP_DEBUG) {
                 cpu_handle_guest_debug(cpu);
+                tcg_account_exit(cpu, r, exit_start);
                 break;
             }
+            tcg_account_exit(cpu, r, exit_start);
         } else if (cpu->stop || cpu->stopped) {
             if (cpu->unplug) {
                 next_cpu = CPU_NEXT(cpu);
@@ -1596,6 +1914,46 @@ void list_cpus(FILE *f, fprintf_function cpu_fprintf, const char *optarg)
 #endif
 }
 
+VcpuStatsList *qmp_query_vcpu_stats(Error **errp)
+{
+    VcpuStatsList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuStatsList *entry = g_new0(VcpuStatsList, 1);
+        VcpuStats *stats = g_new0(VcpuStats, 1);
+        VcpuExitStatsList **exit_tail = &stats->exits;
+        int i;
+
+        stats->cpu_index = cpu->cpu_index;
+        stats->run_time_ns = cpu->run_ns;
+        stats->halts = cpu->halt_count;
+        stats->halt_time_ns = cpu->halt_ns;
+
+        for (i = 0; i < cpu->exit_stats_nr; i++) {
+            CPUExitStats *s = &cpu->exit_stats[i];
+            VcpuExitStatsList *exit;
+
+            if (!s->count) {
+                continue;
+            }
+            exit = g_new0(VcpuExitStatsList, 1);
+            exit->value = g_new0(VcpuExitStats, 1);
+            exit->value->reason = g_strdup(cpu->exit_stats_names[i]);
+            exit->value->count = s->count;
+            exit->value->time_ns = s->ns;
+            *exit_tail = exit;
+            exit_tail = &exit->next;
+        }
+
+        entry->value = stats;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 CpuInfoList *qmp_query_cpus(Error **errp)
 {
     CpuInfoList *head = NULL, *cur_item = NULL;
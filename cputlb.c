@@ -31,7 +31,10 @@
 #include "exec/exec-all.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "exec/log.h"
+#include "exec/helper-proto.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -60,6 +63,249 @@
 
 /* statistics */
 int tlb_flush_count;
+int tlb_flush_elided_count;
+
+#define TLB_FLUSH_ALL_MMUIDX ((1u << NB_MMU_MODES) - 1)
+
+/* With MTTCG a vCPU's TLB may only be modified by its own thread; flushes
+ * requested by anybody else are recorded in the vCPU's tlb_flush_queue
+ * and carried out by a single work item queued on the vCPU.  While that
+ * item is pending further requests are merged into it: flushes already
+ * covered by a pending one are dropped, and once more than
+ * TLB_FLUSH_QUEUE_PAGES different pages are queued the whole TLB is
+ * flushed instead.
+ */
+static bool tlb_flush_must_defer(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static void tlb_flush_queue_run(void *data);
+
+/* Drop tlb_flush_lock, scheduling the queue to be run if needed */
+static void tlb_flush_queue_unlock(CPUState *cpu)
+{
+    TLBFlushQueue *q = &cpu->tlb_flush_queue;
+    bool schedule = !q->queued;
+
+    q->queued = true;
+    qemu_mutex_unlock(&cpu->tlb_flush_lock);
+    if (schedule) {
+        async_run_on_cpu(cpu, tlb_flush_queue_run, cpu);
+    }
+}
+
+/* Queue a flush of the whole TLB, or of the modes in @idxmap */
+static void tlb_queue_flush(CPUState *cpu, bool full, uint32_t idxmap)
+{
+    TLBFlushQueue *q = &cpu->tlb_flush_queue;
+
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
+    if (q->full || (!full && !(idxmap & ~q->idxmap))) {
+        atomic_inc(&tlb_flush_elided_count);
+    } else if (full) {
+        q->full = true;
+        q->nr_pages = 0;
+    } else {
+        q->idxmap |= idxmap;
+    }
+    tlb_flush_queue_unlock(cpu);
+}
+
+/* Queue a flush of page @addr in the modes in @idxmap */
+static void tlb_queue_flush_page(CPUState *cpu, target_ulong addr,
+                                 uint32_t idxmap)
+{
+    TLBFlushQueue *q = &cpu->tlb_flush_queue;
+    int i;
+
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
+    if (q->full || !(idxmap & ~q->idxmap)) {
+        atomic_inc(&tlb_flush_elided_count);
+        goto out;
+    }
+    for (i = 0; i < q->nr_pages; i++) {
+        if (q->pages[i].addr == addr) {
+            q->pages[i].idxmap |= idxmap;
+            atomic_inc(&tlb_flush_elided_count);
+            goto out;
+        }
+    }
+    if (q->nr_pages == TLB_FLUSH_QUEUE_PAGES) {
+        /* Past this point a full flush is cheaper than walking the
+         * TLB for every page.
+         */
+        q->full = true;
+        q->nr_pages = 0;
+        atomic_inc(&tlb_flush_elided_count);
+        goto out;
+    }
+    q->pages[q->nr_pages].addr = addr;
+    q->pages[q->nr_pages].idxmap = idxmap;
+    q->nr_pages++;
+out:
+    tlb_flush_queue_unlock(cpu);
+}
+
+/* Collect the -1 terminated list of MMU indexes into a bitmap */
+static uint32_t tlb_mmuidx_map(va_list argp)
+{
+    uint32_t idxmap = 0;
+
+    QEMU_BUILD_BUG_ON(NB_MMU_MODES > 32);
+    for (;;) {
+        int mmu_idx = va_arg(argp, int);
+
+        if (mmu_idx < 0) {
+            break;
+        }
+        idxmap |= 1u << mmu_idx;
+    }
+    return idxmap;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == (target_ulong)-1 &&
+           te->addr_write == (target_ulong)-1 &&
+           te->addr_code == (target_ulong)-1;
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+
+/* Period over which the peak use of a TLB is tracked before it may shrink */
+#define TLB_DYN_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t now,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = now;
+    desc->window_max_entries = max_entries;
+}
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+    int64_t now = get_clock_realtime();
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        tlb_window_reset(&env->tlb_desc[i], now, 0);
+        env->tlb_desc[i].n_used_entries = 0;
+        env->tlb_mask[i] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+        env->tlb_table[i] = g_new(CPUTLBEntry, n_entries);
+        env->iotlb[i] = g_new(CPUIOTLBEntry, n_entries);
+        memset(env->tlb_table[i], -1, n_entries * sizeof(CPUTLBEntry));
+    }
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        g_free(env->tlb_table[i]);
+        g_free(env->iotlb[i]);
+        env->tlb_table[i] = NULL;
+        env->iotlb[i] = NULL;
+    }
+}
+
+/* Called on every full flush of @mmu_idx to pick the size of its TLB.
+ * The use rate is the peak number of valid entries seen in the current
+ * window, relative to the size of the TLB:
+ *
+ * - above 70%, the TLB is doubled right away: a guest that fills its TLB
+ *   between two flushes is likely to keep doing so;
+ * - below 30%, and only once the window has expired, the TLB is shrunk to
+ *   the smallest power of two that would have kept the rate under 70%.
+ *
+ * Growing eagerly and shrinking lazily keeps the TLB large for guests that
+ * flush often (e.g. on every context switch) without holding on to memory
+ * and flush time for a burst that is over.  The caller holds
+ * tlb_flush_lock.
+ */
+static void tlb_mmu_resize_locked(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t new_size = old_size;
+    size_t rate;
+    int64_t now = get_clock_realtime();
+    bool window_expired = now > desc->window_begin_ns + TLB_DYN_WINDOW_NS;
+
+    desc->window_max_entries = MAX(desc->window_max_entries,
+                                   desc->n_used_entries);
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+
+        if (desc->window_max_entries * 100 > ceil * 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(env->tlb_table[mmu_idx]);
+    g_free(env->iotlb[mmu_idx]);
+
+    tlb_window_reset(desc, now, 0);
+    env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+    env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    /* If the allocation fails, fall back to smaller sizes; a smaller TLB
+     * only costs performance.
+     */
+    while (env->tlb_table[mmu_idx] == NULL || env->iotlb[mmu_idx] == NULL) {
+        if (new_size == (1 << CPU_TLB_DYN_MIN_BITS)) {
+            error_report("%s: cannot allocate the TLB", __func__);
+            abort();
+        }
+        new_size >>= 1;
+        g_free(env->tlb_table[mmu_idx]);
+        g_free(env->iotlb[mmu_idx]);
+        env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+        env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    }
+    env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+}
+
+#else
+
+void tlb_init(CPUState *cpu)
+{
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+}
+
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
+
+/* Flush all entries of @mmu_idx, resizing its TLB first if the backend
+ * allows it.  The caller holds tlb_flush_lock.
+ */
+static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize_locked(env, mmu_idx);
+    env->tlb_desc[mmu_idx].n_used_entries = 0;
+#endif
+    memset(env->tlb_table[mmu_idx], -1,
+           tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -73,40 +319,53 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("(%d)\n", flush_global);
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx_locked(env, mmu_idx);
+    }
+    qemu_mutex_unlock(&cpu->tlb_flush_lock);
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+    atomic_inc(&tlb_flush_count);
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_must_defer(cpu)) {
+        tlb_queue_flush(cpu, true, 0);
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
+}
+
+static void tlb_flush_by_mmuidx_nocheck(CPUState *cpu, uint32_t idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("start\n");
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
         }
 
         tlb_debug("%d\n", mmu_idx);
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx_locked(env, mmu_idx);
     }
+    qemu_mutex_unlock(&cpu->tlb_flush_lock);
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 }
@@ -114,12 +373,21 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    uint32_t idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = tlb_mmuidx_map(argp);
     va_end(argp);
+
+    if (tlb_flush_must_defer(cpu)) {
+        tlb_queue_flush(cpu, false, idxmap);
+    } else {
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+    }
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Returns true if the entry was flushed */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -128,13 +396,25 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+/* Flush @addr from the main TLB of @mmu_idx, keeping the usage count */
+static void tlb_flush_page_one_mmuidx(CPUArchState *env, int mmu_idx,
+                                      target_ulong addr)
+{
+    if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+        env->tlb_desc[mmu_idx].n_used_entries--;
+#endif
+    }
+}
+
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     tlb_debug("page :" TARGET_FMT_lx "\n", addr);
@@ -145,14 +425,13 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu, 1);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_page_one_mmuidx(env, mmu_idx, addr);
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -166,13 +445,20 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     tb_flush_jmp_cache(cpu, addr);
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
+    if (tlb_flush_must_defer(cpu)) {
+        tlb_queue_flush_page(cpu, addr, TLB_FLUSH_ALL_MMUIDX);
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
 
-    va_start(argp, addr);
+static void tlb_flush_page_by_mmuidx_nocheck(CPUState *cpu, target_ulong addr,
+                                             uint32_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int k, mmu_idx;
 
     tlb_debug("addr "TARGET_FMT_lx"\n", addr);
 
@@ -182,35 +468,76 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
         }
 
         tlb_debug("idx %d\n", mmu_idx);
 
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_page_one_mmuidx(env, mmu_idx, addr);
 
         /* check whether there are vltb entries that need to be flushed */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
-    va_end(argp);
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    va_list argp;
+    uint32_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = tlb_mmuidx_map(argp);
+    va_end(argp);
+
+    if (tlb_flush_must_defer(cpu)) {
+        tlb_queue_flush_page(cpu, addr, idxmap);
+    } else {
+        tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+    }
+}
+
+/* Run on the vCPU itself: carry out everything queued so far */
+static void tlb_flush_queue_run(void *data)
+{
+    CPUState *cpu = data;
+    TLBFlushQueue q;
+    int i;
+
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
+    q = cpu->tlb_flush_queue;
+    memset(&cpu->tlb_flush_queue, 0, sizeof(cpu->tlb_flush_queue));
+    qemu_mutex_unlock(&cpu->tlb_flush_lock);
+
+    if (q.full) {
+        tlb_flush_nocheck(cpu, 1);
+        return;
+    }
+    if (q.idxmap) {
+        tlb_flush_by_mmuidx_nocheck(cpu, q.idxmap);
+    }
+    for (i = 0; i < q.nr_pages; i++) {
+        uint32_t idxmap = q.pages[i].idxmap & ~q.idxmap;
+
+        if (idxmap == TLB_FLUSH_ALL_MMUIDX) {
+            tlb_flush_page_nocheck(cpu, q.pages[i].addr);
+        } else if (idxmap) {
+            tlb_flush_page_by_mmuidx_nocheck(cpu, q.pages[i].addr, idxmap);
+        }
+    }
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -239,7 +566,13 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+            /* May race with the owning vCPU under MTTCG */
+#if TCG_OVERSIZED_GUEST
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#else
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
+#endif
         }
     }
 }
@@ -263,10 +596,13 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     int mmu_idx;
 
     env = cpu->env_ptr;
+    /* The TLB may belong to another vCPU, which could be resizing it */
+    qemu_mutex_lock(&cpu->tlb_flush_lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
+        unsigned int n = tlb_n_entries(env, mmu_idx);
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        for (i = 0; i < n; i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
@@ -276,6 +612,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+    qemu_mutex_unlock(&cpu->tlb_flush_lock);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -290,13 +627,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -376,11 +711,16 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     }
 
     code_address = address;
-    iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
-                                            prot, &address);
-
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    te = &env->tlb_table[mmu_idx][index];
+    iotlb = memory_region_section_get_iotlb(cpu, asidx, section, vaddr, paddr,
+                                            xlat, prot, &address);
+
+    index = tlb_index(env, mmu_idx, vaddr);
+    te = tlb_entry(env, mmu_idx, vaddr);
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    if (tlb_entry_is_empty(te)) {
+        env->tlb_desc[mmu_idx].n_used_entries++;
+    }
+#endif
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
@@ -475,8 +815,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
@@ -514,6 +854,11 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             CPUIOTLBEntry tmpio, *io = &env->iotlb[mmu_idx][index];
             CPUIOTLBEntry *vio = &env->iotlb_v[mmu_idx][vidx];
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+            if (tlb_entry_is_empty(tlb)) {
+                env->tlb_desc[mmu_idx].n_used_entries++;
+            }
+#endif
             tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
             tmpio = *io; *io = *vio; *vio = tmpio;
             return true;
@@ -542,6 +887,248 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 #include "softmmu_template.h"
 #undef MMUSUFFIX
 
+/* Atomic read-modify-write helpers for the tcg_gen_atomic_* ops.  */
+
+typedef enum AtomicOp {
+    ATOMIC_CMPXCHG,
+    ATOMIC_XCHG,
+    ATOMIC_ADD,
+    ATOMIC_AND,
+    ATOMIC_OR,
+    ATOMIC_XOR,
+} AtomicOp;
+
+/* Return the host address for an atomic access to ADDR, filling the TLB
+   entry if needed, or NULL if the access has to take the slow path: it
+   is misaligned or too wide for the host, or the page is MMIO, watched,
+   tracked for self-modifying code, or not readable.  */
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    unsigned mmu_idx = get_mmuidx(oi);
+    int index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
+    TCGMemOp mop = get_memop(oi);
+    int a_bits = get_alignment_bits(mop);
+    int size = 1 << (mop & MO_SIZE);
+    target_ulong tlb_addr;
+
+    /* Adjust the given return address.  */
+    retaddr -= GETPC_ADJ;
+
+    if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
+        cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
+                             mmu_idx, retaddr);
+    }
+    if ((addr & (size - 1)) != 0 || size > sizeof(void *)) {
+        return NULL;
+    }
+
+    tlb_addr = tlbe->addr_write;
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            tlb_fill(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx, retaddr);
+        }
+        tlb_addr = tlbe->addr_write;
+    }
+    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK) || tlbe->addr_read != tlb_addr) {
+        return NULL;
+    }
+    return (void *)((uintptr_t)addr + tlbe->addend);
+}
+
+static uint64_t atomic_slow_ld(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        return helper_ret_ldub_mmu(env, addr, oi, retaddr);
+    case MO_LEUW:
+        return helper_le_lduw_mmu(env, addr, oi, retaddr);
+    case MO_LEUL:
+        return helper_le_ldul_mmu(env, addr, oi, retaddr);
+    case MO_LEQ:
+        return helper_le_ldq_mmu(env, addr, oi, retaddr);
+    case MO_BEUW:
+        return helper_be_lduw_mmu(env, addr, oi, retaddr);
+    case MO_BEUL:
+        return helper_be_ldul_mmu(env, addr, oi, retaddr);
+    case MO_BEQ:
+        return helper_be_ldq_mmu(env, addr, oi, retaddr);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void atomic_slow_st(CPUArchState *env, target_ulong addr,
+                           uint64_t val, TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    switch (get_memop(oi) & (MO_BSWAP | MO_SIZE)) {
+    case MO_UB:
+        helper_ret_stb_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUW:
+        helper_le_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEUL:
+        helper_le_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_LEQ:
+        helper_le_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUW:
+        helper_be_stw_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEUL:
+        helper_be_stl_mmu(env, addr, val, oi, retaddr);
+        break;
+    case MO_BEQ:
+        helper_be_stq_mmu(env, addr, val, oi, retaddr);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static uint64_t atomic_apply(AtomicOp op, uint64_t old, uint64_t val)
+{
+    switch (op) {
+    case ATOMIC_ADD:
+        return old + val;
+    case ATOMIC_AND:
+        return old & val;
+    case ATOMIC_OR:
+        return old | val;
+    case ATOMIC_XOR:
+        return old ^ val;
+    default:
+        return val;
+    }
+}
+
+/* Load the host-order contents of HADDR, converted to guest order */
+static uint64_t atomic_host_load(void *haddr, TCGMemOp mop)
+{
+    bool bswap = mop & MO_BSWAP;
+
+    switch (mop & MO_SIZE) {
+    case MO_8:
+        return atomic_read((uint8_t *)haddr);
+    case MO_16:
+        return bswap ? bswap16(atomic_read((uint16_t *)haddr))
+                     : atomic_read((uint16_t *)haddr);
+    case MO_32:
+        return bswap ? bswap32(atomic_read((uint32_t *)haddr))
+                     : atomic_read((uint32_t *)haddr);
+#if HOST_LONG_BITS == 64
+    case MO_64:
+        return bswap ? bswap64(atomic_read((uint64_t *)haddr))
+                     : atomic_read((uint64_t *)haddr);
+#endif
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Store NEWV at HADDR if it still holds the guest-order value OLD */
+static bool atomic_host_cmpxchg(void *haddr, TCGMemOp mop,
+                                uint64_t old, uint64_t newv)
+{
+    bool bswap = mop & MO_BSWAP;
+
+    switch (mop & MO_SIZE) {
+    case MO_8:
+        return atomic_cmpxchg((uint8_t *)haddr, old, newv) == (uint8_t)old;
+    case MO_16:
+        if (bswap) {
+            old = bswap16(old);
+            newv = bswap16(newv);
+        }
+        return atomic_cmpxchg((uint16_t *)haddr, old, newv) == (uint16_t)old;
+    case MO_32:
+        if (bswap) {
+            old = bswap32(old);
+            newv = bswap32(newv);
+        }
+        return atomic_cmpxchg((uint32_t *)haddr, old, newv) == (uint32_t)old;
+#if HOST_LONG_BITS == 64
+    case MO_64:
+        if (bswap) {
+            old = bswap64(old);
+            newv = bswap64(newv);
+        }
+        return atomic_cmpxchg((uint64_t *)haddr, old, newv) == old;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static uint64_t do_atomic_op(CPUArchState *env, target_ulong addr,
+                             uint64_t cmpv, uint64_t val, TCGMemOpIdx oi,
+                             AtomicOp op, uintptr_t retaddr)
+{
+    TCGMemOp mop = get_memop(oi);
+    uint64_t mask = MAKE_64BIT_MASK(0, 8 << (mop & MO_SIZE));
+    void *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);
+    uint64_t old, newv;
+
+    cmpv &= mask;
+    if (!haddr) {
+        /* Not atomic with respect to other vCPUs.  Only MMIO and
+           misaligned accesses get here, which real hardware either
+           does not make atomic or makes very slow too.  */
+        old = atomic_slow_ld(env, addr, oi, retaddr);
+        if (op != ATOMIC_CMPXCHG || old == cmpv) {
+            atomic_slow_st(env, addr, atomic_apply(op, old, val) & mask,
+                           oi, retaddr);
+        }
+        return old;
+    }
+
+    do {
+        old = atomic_host_load(haddr, mop);
+        if (op == ATOMIC_CMPXCHG && old != cmpv) {
+            break;
+        }
+        newv = atomic_apply(op, old, val) & mask;
+    } while (!atomic_host_cmpxchg(haddr, mop, old, newv));
+    return old;
+}
+
+uint32_t HELPER(atomic_cmpxchg_i32)(CPUArchState *env, target_ulong addr,
+                                    uint32_t cmpv, uint32_t newv, uint32_t oi)
+{
+    return do_atomic_op(env, addr, cmpv, newv, oi, ATOMIC_CMPXCHG, GETPC());
+}
+
+uint64_t HELPER(atomic_cmpxchg_i64)(CPUArchState *env, target_ulong addr,
+                                    uint64_t cmpv, uint64_t newv, uint32_t oi)
+{
+    return do_atomic_op(env, addr, cmpv, newv, oi, ATOMIC_CMPXCHG, GETPC());
+}
+
+#define GEN_ATOMIC_HELPERS(NAME, OP)                                        \
+uint32_t HELPER(atomic_##NAME##_i32)(CPUArchState *env, target_ulong addr, \
+                                     uint32_t val, uint32_t oi)            \
+{                                                                           \
+    return do_atomic_op(env, addr, 0, val, oi, OP, GETPC());               \
+}                                                                           \
+uint64_t HELPER(atomic_##NAME##_i64)(CPUArchState *env, target_ulong addr, \
+                                     uint64_t val, uint32_t oi)            \
+{                                                                           \
+    return do_atomic_op(env, addr, 0, val, oi, OP, GETPC());               \
+}
+
+GEN_ATOMIC_HELPERS(xchg, ATOMIC_XCHG)
+GEN_ATOMIC_HELPERS(fetch_add, ATOMIC_ADD)
+GEN_ATOMIC_HELPERS(fetch_and, ATOMIC_AND)
+GEN_ATOMIC_HELPERS(fetch_or, ATOMIC_OR)
+GEN_ATOMIC_HELPERS(fetch_xor, ATOMIC_XOR)
+
+#undef GEN_ATOMIC_HELPERS
+
 #define MMUSUFFIX _cmmu
 #undef GETPC_ADJ
 #define GETPC_ADJ 0
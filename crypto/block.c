@@ -47,28 +47,48 @@ bool qcrypto_block_has_format(QCryptoBlockFormat format,
 }
 
 
+static QCryptoBlock *qcrypto_block_new(QCryptoBlockFormat format)
+{
+    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
+
+    block->format = format;
+    qemu_mutex_init(&block->mutex);
+    qemu_cond_init(&block->cipher_cond);
+
+    return block;
+}
+
+
+static void qcrypto_block_destroy(QCryptoBlock *block)
+{
+    qcrypto_block_free_cipher(block);
+    qemu_cond_destroy(&block->cipher_cond);
+    qemu_mutex_destroy(&block->mutex);
+    g_free(block);
+}
+
+
 QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp)
 {
-    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
-
-    block->format = options->format;
+    QCryptoBlock *block = qcrypto_block_new(options->format);
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %d", options->format);
-        g_free(block);
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
     block->driver = qcrypto_block_drivers[options->format];
 
     if (block->driver->open(block, options,
-                            readfunc, opaque, flags, errp) < 0) {
-        g_free(block);
+                            readfunc, opaque, flags, n_threads, errp) < 0) {
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
@@ -82,14 +102,12 @@ QCryptoBlock *qcrypto_block_create(QCryptoBlockCreateOptions *options,
                                    void *opaque,
                                    Error **errp)
 {
-    QCryptoBlock *block = g_new0(QCryptoBlock, 1);
-
-    block->format = options->format;
+    QCryptoBlock *block = qcrypto_block_new(options->format);
 
     if (options->format >= G_N_ELEMENTS(qcrypto_block_drivers) ||
         !qcrypto_block_drivers[options->format]) {
         error_setg(errp, "Unsupported block driver %d", options->format);
-        g_free(block);
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
@@ -97,7 +115,7 @@ QCryptoBlock *qcrypto_block_create(QCryptoBlockCreateOptions *options,
 
     if (block->driver->create(block, options, initfunc,
                               writefunc, opaque, errp) < 0) {
-        g_free(block);
+        qcrypto_block_destroy(block);
         return NULL;
     }
 
@@ -144,7 +162,7 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
 
 QCryptoCipher *qcrypto_block_get_cipher(QCryptoBlock *block)
 {
-    return block->cipher;
+    return block->n_ciphers ? block->ciphers[0] : NULL;
 }
 
 
@@ -174,20 +192,86 @@ void qcrypto_block_free(QCryptoBlock *block)
 
     block->driver->cleanup(block);
 
-    qcrypto_cipher_free(block->cipher);
     qcrypto_ivgen_free(block->ivgen);
-    g_free(block);
+    qcrypto_block_destroy(block);
 }
 
 
-int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
-                                 size_t niv,
-                                 QCryptoIVGen *ivgen,
-                                 int sectorsize,
-                                 uint64_t startsector,
-                                 uint8_t *buf,
-                                 size_t len,
-                                 Error **errp)
+int qcrypto_block_init_cipher(QCryptoBlock *block,
+                              QCryptoCipherAlgorithm alg,
+                              QCryptoCipherMode mode,
+                              const uint8_t *key, size_t nkey,
+                              size_t n_threads, Error **errp)
+{
+    size_t i;
+
+    assert(n_threads > 0 && !block->ciphers);
+
+    block->ciphers = g_new0(QCryptoCipher *, n_threads);
+    for (i = 0; i < n_threads; i++) {
+        block->ciphers[i] = qcrypto_cipher_new(alg, mode, key, nkey, errp);
+        if (!block->ciphers[i]) {
+            qcrypto_block_free_cipher(block);
+            return -1;
+        }
+        block->n_ciphers++;
+        block->n_free_ciphers++;
+    }
+
+    return 0;
+}
+
+
+void qcrypto_block_free_cipher(QCryptoBlock *block)
+{
+    size_t i;
+
+    assert(block->n_free_ciphers == block->n_ciphers);
+    for (i = 0; i < block->n_ciphers; i++) {
+        qcrypto_cipher_free(block->ciphers[i]);
+    }
+    g_free(block->ciphers);
+    block->ciphers = NULL;
+    block->n_ciphers = block->n_free_ciphers = 0;
+}
+
+
+static QCryptoCipher *qcrypto_block_pop_cipher(QCryptoBlock *block)
+{
+    QCryptoCipher *cipher;
+
+    qemu_mutex_lock(&block->mutex);
+    while (!block->n_free_ciphers) {
+        qemu_cond_wait(&block->cipher_cond, &block->mutex);
+    }
+    cipher = block->ciphers[--block->n_free_ciphers];
+    qemu_mutex_unlock(&block->mutex);
+
+    return cipher;
+}
+
+
+static void qcrypto_block_push_cipher(QCryptoBlock *block,
+                                      QCryptoCipher *cipher)
+{
+    qemu_mutex_lock(&block->mutex);
+    assert(block->n_free_ciphers < block->n_ciphers);
+    block->ciphers[block->n_free_ciphers++] = cipher;
+    qemu_cond_signal(&block->cipher_cond);
+    qemu_mutex_unlock(&block->mutex);
+}
+
+
+static int do_qcrypto_block_cipher_helper(QCryptoCipher *cipher,
+                                          size_t niv,
+                                          QCryptoIVGen *ivgen,
+                                          QemuMutex *ivgen_mutex,
+                                          int sectorsize,
+                                          uint64_t startsector,
+                                          uint8_t *buf,
+                                          size_t len,
+                                          bool encrypt,
+                                          Error **errp)
 {
     uint8_t *iv;
     int ret = -1;
@@ -197,23 +281,37 @@ int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
     while (len > 0) {
         size_t nbytes;
         if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
+            if (ivgen_mutex) {
+                qemu_mutex_lock(ivgen_mutex);
+            }
+            ret = qcrypto_ivgen_calculate(ivgen,
+                                          startsector,
+                                          iv, niv,
+                                          errp);
+            if (ivgen_mutex) {
+                qemu_mutex_unlock(ivgen_mutex);
+            }
+            if (ret < 0) {
+                ret = -1;
                 goto cleanup;
             }
 
             if (qcrypto_cipher_setiv(cipher,
                                      iv, niv,
                                      errp) < 0) {
+                ret = -1;
                 goto cleanup;
             }
         }
 
         nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_decrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
+        if (encrypt) {
+            ret = qcrypto_cipher_encrypt(cipher, buf, buf, nbytes, errp);
+        } else {
+            ret = qcrypto_cipher_decrypt(cipher, buf, buf, nbytes, errp);
+        }
+        if (ret < 0) {
+            ret = -1;
             goto cleanup;
         }
 
@@ -229,6 +327,21 @@ int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
 }
 
 
+int qcrypto_block_decrypt_helper(QCryptoCipher *cipher,
+                                 size_t niv,
+                                 QCryptoIVGen *ivgen,
+                                 int sectorsize,
+                                 uint64_t startsector,
+                                 uint8_t *buf,
+                                 size_t len,
+                                 Error **errp)
+{
+    return do_qcrypto_block_cipher_helper(cipher, niv, ivgen, NULL,
+                                          sectorsize, startsector,
+                                          buf, len, false, errp);
+}
+
+
 int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
                                  size_t niv,
                                  QCryptoIVGen *ivgen,
@@ -238,41 +351,46 @@ int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
                                  size_t len,
                                  Error **errp)
 {
-    uint8_t *iv;
-    int ret = -1;
+    return do_qcrypto_block_cipher_helper(cipher, niv, ivgen, NULL,
+                                          sectorsize, startsector,
+                                          buf, len, true, errp);
+}
 
-    iv = niv ? g_new0(uint8_t, niv) : NULL;
 
-    while (len > 0) {
-        size_t nbytes;
-        if (niv) {
-            if (qcrypto_ivgen_calculate(ivgen,
-                                        startsector,
-                                        iv, niv,
-                                        errp) < 0) {
-                goto cleanup;
-            }
+/* Like the helpers above, with a payload cipher taken from the block's pool */
+int qcrypto_block_decrypt_sectors(QCryptoBlock *block,
+                                  int sectorsize,
+                                  uint64_t startsector,
+                                  uint8_t *buf,
+                                  size_t len,
+                                  Error **errp)
+{
+    QCryptoCipher *cipher = qcrypto_block_pop_cipher(block);
+    int ret;
 
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                goto cleanup;
-            }
-        }
+    ret = do_qcrypto_block_cipher_helper(cipher, block->niv, block->ivgen,
+                                         &block->mutex, sectorsize,
+                                         startsector, buf, len, false, errp);
+    qcrypto_block_push_cipher(block, cipher);
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (qcrypto_cipher_encrypt(cipher, buf, buf,
-                                   nbytes, errp) < 0) {
-            goto cleanup;
-        }
+    return ret;
+}
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
-    }
 
-    ret = 0;
- cleanup:
-    g_free(iv);
+int qcrypto_block_encrypt_sectors(QCryptoBlock *block,
+                                  int sectorsize,
+                                  uint64_t startsector,
+                                  uint8_t *buf,
+                                  size_t len,
+                                  Error **errp)
+{
+    QCryptoCipher *cipher = qcrypto_block_pop_cipher(block);
+    int ret;
+
+    ret = do_qcrypto_block_cipher_helper(cipher, block->niv, block->ivgen,
+                                         &block->mutex, sectorsize,
+                                         startsector, buf, len, true, errp);
+    qcrypto_block_push_cipher(block, cipher);
+
     return ret;
 }
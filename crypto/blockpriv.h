@@ -22,6 +22,7 @@
 #define QCRYPTO_BLOCKPRIV_H
 
 #include "crypto/block.h"
+#include "qemu/thread.h"
 
 typedef struct QCryptoBlockDriver QCryptoBlockDriver;
 
@@ -31,7 +32,14 @@ struct QCryptoBlock {
     const QCryptoBlockDriver *driver;
     void *opaque;
 
-    QCryptoCipher *cipher;
+    /* One payload cipher per thread that may use the block at once;
+     * the first n_free_ciphers entries are the idle ones.
+     */
+    QCryptoCipher **ciphers;
+    size_t n_ciphers;
+    size_t n_free_ciphers;
+    QemuMutex mutex;            /* protects n_free_ciphers and ivgen */
+    QemuCond cipher_cond;
     QCryptoIVGen *ivgen;
     QCryptoHashAlgorithm kdfhash;
     size_t niv;
@@ -44,6 +52,7 @@ struct QCryptoBlockDriver {
                 QCryptoBlockReadFunc readfunc,
                 void *opaque,
                 unsigned int flags,
+                size_t n_threads,
                 Error **errp);
 
     int (*create)(QCryptoBlock *block,
@@ -93,4 +102,26 @@ int qcrypto_block_encrypt_helper(QCryptoCipher *cipher,
                                  size_t len,
                                  Error **errp);
 
+int qcrypto_block_init_cipher(QCryptoBlock *block,
+                              QCryptoCipherAlgorithm alg,
+                              QCryptoCipherMode mode,
+                              const uint8_t *key, size_t nkey,
+                              size_t n_threads, Error **errp);
+
+void qcrypto_block_free_cipher(QCryptoBlock *block);
+
+int qcrypto_block_decrypt_sectors(QCryptoBlock *block,
+                                  int sectorsize,
+                                  uint64_t startsector,
+                                  uint8_t *buf,
+                                  size_t len,
+                                  Error **errp);
+
+int qcrypto_block_encrypt_sectors(QCryptoBlock *block,
+                                  int sectorsize,
+                                  uint64_t startsector,
+                                  uint8_t *buf,
+                                  size_t len,
+                                  Error **errp);
+
 #endif /* QCRYPTO_BLOCKPRIV_H */
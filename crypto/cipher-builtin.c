@@ -22,17 +22,24 @@
 #include "crypto/aes.h"
 #include "crypto/desrfb.h"
 #include "crypto/xts.h"
+#include "qemu/bswap.h"
 
 typedef struct QCryptoCipherBuiltinAESContext QCryptoCipherBuiltinAESContext;
 struct QCryptoCipherBuiltinAESContext {
     AES_KEY enc;
     AES_KEY dec;
+#ifdef CONFIG_AESNI_OPT
+    /* The same round keys in memory byte order, as AES-NI takes them */
+    uint8_t ni_enc[AES_MAXNR + 1][AES_BLOCK_SIZE];
+    uint8_t ni_dec[AES_MAXNR + 1][AES_BLOCK_SIZE];
+#endif
 };
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
     QCryptoCipherBuiltinAESContext key;
     QCryptoCipherBuiltinAESContext key_tweak;
     uint8_t iv[AES_BLOCK_SIZE];
+    bool aesni;
 };
 typedef struct QCryptoCipherBuiltinDESRFB QCryptoCipherBuiltinDESRFB;
 struct QCryptoCipherBuiltinDESRFB {
@@ -149,6 +156,144 @@ static void qcrypto_cipher_aes_xts_decrypt(const void *ctx,
 }
 
 
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/* Blocks in flight at once, to hide the latency of the AES instructions */
+#define XTS_AESNI_LANES 4
+
+static bool aesni_support(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return false;
+    }
+    return c & bit_AES;
+}
+
+static void qcrypto_cipher_aesni_load_key(const AES_KEY *key,
+                                          uint8_t (*rk)[AES_BLOCK_SIZE])
+{
+    int i;
+
+    /* aes.c keeps the round keys as native words, loaded big-endian */
+    for (i = 0; i < 4 * (key->rounds + 1); i++) {
+        stl_be_p(&rk[i / 4][(i % 4) * 4], key->rd_key[i]);
+    }
+}
+
+/*
+ * The decryption schedule from AES_set_decrypt_key() is already reversed,
+ * with InvMixColumns applied to the inner round keys, which is the form
+ * aesdec expects.
+ */
+static inline __m128i qcrypto_cipher_aesni_block(__m128i x, const __m128i *rk,
+                                                 int rounds, bool encrypt)
+{
+    int r;
+
+    x = _mm_xor_si128(x, rk[0]);
+    for (r = 1; r < rounds; r++) {
+        x = encrypt ? _mm_aesenc_si128(x, rk[r]) : _mm_aesdec_si128(x, rk[r]);
+    }
+    return encrypt ? _mm_aesenclast_si128(x, rk[rounds]) :
+                     _mm_aesdeclast_si128(x, rk[rounds]);
+}
+
+static void qcrypto_cipher_aesni_load_rk(__m128i *rk,
+                                         const uint8_t (*key)[AES_BLOCK_SIZE])
+{
+    int r;
+
+    for (r = 0; r <= AES_MAXNR; r++) {
+        rk[r] = _mm_loadu_si128((const __m128i *)key[r]);
+    }
+}
+
+/* Same as xts_mult_x(), on the tweak seen as a little-endian integer */
+static inline void qcrypto_cipher_aesni_xts_mult_x(uint64_t *t)
+{
+    uint64_t carry = t[1] >> 63;
+
+    t[1] = (t[1] << 1) | (t[0] >> 63);
+    t[0] = (t[0] << 1) ^ (0x87 & -carry);
+}
+
+/*
+ * XTS over whole blocks, with XTS_AESNI_LANES blocks interleaved rather
+ * than one call through xts_cipher_func per block.  As in xts_encrypt()
+ * and xts_decrypt(), the IV is left so that the next call carries on.
+ */
+static void qcrypto_cipher_aesni_xts(QCryptoCipherBuiltinAES *aes,
+                                     bool encrypt, size_t length,
+                                     uint8_t *dst, const uint8_t *src)
+{
+    int rounds = aes->key.enc.rounds;
+    __m128i rk[AES_MAXNR + 1], trk[AES_MAXNR + 1];
+    __m128i x[XTS_AESNI_LANES], t[XTS_AESNI_LANES];
+    uint64_t tweak[2];
+    size_t i, j, n, nblocks = length / AES_BLOCK_SIZE;
+
+    qcrypto_cipher_aesni_load_rk(trk, aes->key_tweak.ni_enc);
+    _mm_storeu_si128((__m128i *)tweak,
+                     qcrypto_cipher_aesni_block(
+                         _mm_loadu_si128((const __m128i *)aes->iv),
+                         trk, rounds, true));
+    tweak[0] = le64_to_cpu(tweak[0]);
+    tweak[1] = le64_to_cpu(tweak[1]);
+
+    qcrypto_cipher_aesni_load_rk(rk, encrypt ? aes->key.ni_enc :
+                                 aes->key.ni_dec);
+    for (i = 0; i < nblocks; i += n) {
+        n = MIN(nblocks - i, XTS_AESNI_LANES);
+        for (j = 0; j < n; j++) {
+            t[j] = _mm_set_epi64x(tweak[1], tweak[0]);
+            qcrypto_cipher_aesni_xts_mult_x(tweak);
+            x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), t[j]);
+            src += AES_BLOCK_SIZE;
+        }
+        /* a constant trip count lets the compiler interleave the lanes */
+        if (n == XTS_AESNI_LANES) {
+            for (j = 0; j < XTS_AESNI_LANES; j++) {
+                x[j] = qcrypto_cipher_aesni_block(x[j], rk, rounds, encrypt);
+            }
+        } else {
+            for (j = 0; j < n; j++) {
+                x[j] = qcrypto_cipher_aesni_block(x[j], rk, rounds, encrypt);
+            }
+        }
+        for (j = 0; j < n; j++) {
+            _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(x[j], t[j]));
+            dst += AES_BLOCK_SIZE;
+        }
+    }
+
+    qcrypto_cipher_aesni_load_rk(trk, aes->key_tweak.ni_dec);
+    _mm_storeu_si128((__m128i *)aes->iv,
+                     qcrypto_cipher_aesni_block(
+                         _mm_set_epi64x(tweak[1], tweak[0]),
+                         trk, rounds, false));
+}
+
+static void qcrypto_cipher_aesni_init(QCryptoCipherBuiltinAES *aes)
+{
+    aes->aesni = aesni_support();
+    if (!aes->aesni) {
+        return;
+    }
+    qcrypto_cipher_aesni_load_key(&aes->key.enc, aes->key.ni_enc);
+    qcrypto_cipher_aesni_load_key(&aes->key.dec, aes->key.ni_dec);
+    qcrypto_cipher_aesni_load_key(&aes->key_tweak.enc, aes->key_tweak.ni_enc);
+    qcrypto_cipher_aesni_load_key(&aes->key_tweak.dec, aes->key_tweak.ni_dec);
+}
+#pragma GCC pop_options
+#endif
+
+
 static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                                       const void *in,
                                       void *out,
@@ -168,6 +313,13 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                         ctxt->state.aes.iv, 1);
         break;
     case QCRYPTO_CIPHER_MODE_XTS:
+#ifdef CONFIG_AESNI_OPT
+        /* ciphertext stealing is left to the generic code */
+        if (ctxt->state.aes.aesni && len && !(len % AES_BLOCK_SIZE)) {
+            qcrypto_cipher_aesni_xts(&ctxt->state.aes, true, len, out, in);
+            break;
+        }
+#endif
         xts_encrypt(&ctxt->state.aes.key,
                     &ctxt->state.aes.key_tweak,
                     qcrypto_cipher_aes_xts_encrypt,
@@ -202,6 +354,12 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
                         ctxt->state.aes.iv, 0);
         break;
     case QCRYPTO_CIPHER_MODE_XTS:
+#ifdef CONFIG_AESNI_OPT
+        if (ctxt->state.aes.aesni && len && !(len % AES_BLOCK_SIZE)) {
+            qcrypto_cipher_aesni_xts(&ctxt->state.aes, false, len, out, in);
+            break;
+        }
+#endif
         xts_decrypt(&ctxt->state.aes.key,
                     &ctxt->state.aes.key_tweak,
                     qcrypto_cipher_aes_xts_encrypt,
@@ -272,6 +430,10 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
             error_setg(errp, "Failed to set decryption key");
             goto error;
         }
+
+#ifdef CONFIG_AESNI_OPT
+        qcrypto_cipher_aesni_init(&ctxt->state.aes);
+#endif
     } else {
         if (AES_set_encrypt_key(key, nkey * 8, &ctxt->state.aes.key.enc) != 0) {
             error_setg(errp, "Failed to set encryption key");
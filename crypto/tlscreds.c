@@ -157,6 +157,27 @@ qcrypto_tls_creds_prop_get_verify(Object *obj,
 }
 
 
+static void
+qcrypto_tls_creds_prop_set_ktls(Object *obj,
+                                bool value,
+                                Error **errp G_GNUC_UNUSED)
+{
+    QCryptoTLSCreds *creds = QCRYPTO_TLS_CREDS(obj);
+
+    creds->ktls = value;
+}
+
+
+static bool
+qcrypto_tls_creds_prop_get_ktls(Object *obj,
+                                Error **errp G_GNUC_UNUSED)
+{
+    QCryptoTLSCreds *creds = QCRYPTO_TLS_CREDS(obj);
+
+    return creds->ktls;
+}
+
+
 static void
 qcrypto_tls_creds_prop_set_dir(Object *obj,
                                const char *value,
@@ -241,6 +262,10 @@ qcrypto_tls_creds_class_init(ObjectClass *oc, void *data)
                                   qcrypto_tls_creds_prop_get_priority,
                                   qcrypto_tls_creds_prop_set_priority,
                                   NULL);
+    object_class_property_add_bool(oc, "ktls",
+                                   qcrypto_tls_creds_prop_get_ktls,
+                                   qcrypto_tls_creds_prop_set_ktls,
+                                   NULL);
 }
 
 
@@ -31,6 +31,15 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -467,6 +476,129 @@ qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_KTLS
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+} QCryptoTLSKernelInfo;
+
+/* For TLS 1.2 AES-GCM, the explicit nonce is the record sequence number */
+#define QCRYPTO_TLS_KTLS_FILL(ci, bits, iv, key, seq)                   \
+    do {                                                                \
+        (ci)->info.cipher_type = TLS_CIPHER_AES_GCM_##bits;             \
+        memcpy((ci)->gcm##bits.iv, seq,                                 \
+               TLS_CIPHER_AES_GCM_##bits##_IV_SIZE);                     \
+        memcpy((ci)->gcm##bits.salt, (iv)->data,                        \
+               TLS_CIPHER_AES_GCM_##bits##_SALT_SIZE);                   \
+        memcpy((ci)->gcm##bits.key, (key)->data,                        \
+               TLS_CIPHER_AES_GCM_##bits##_KEY_SIZE);                    \
+        memcpy((ci)->gcm##bits.rec_seq, seq,                            \
+               TLS_CIPHER_AES_GCM_##bits##_REC_SEQ_SIZE);                \
+    } while (0)
+
+static int
+qcrypto_tls_session_offload_dir(QCryptoTLSSession *session,
+                                int fd, bool read)
+{
+    gnutls_datum_t mac, iv, key;
+    unsigned char seq[8];
+    QCryptoTLSKernelInfo ci;
+    socklen_t len;
+    int ret;
+
+    if (gnutls_record_get_state(session->handle, read,
+                                &mac, &iv, &key, seq) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ci, 0, sizeof(ci));
+    ci.info.version = TLS_1_2_VERSION;
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        QCRYPTO_TLS_KTLS_FILL(&ci, 128, &iv, &key, seq);
+        len = sizeof(ci.gcm128);
+        break;
+#ifdef TLS_CIPHER_AES_GCM_256
+    case GNUTLS_CIPHER_AES_256_GCM:
+        QCRYPTO_TLS_KTLS_FILL(&ci, 256, &iv, &key, seq);
+        len = sizeof(ci.gcm256);
+        break;
+#endif
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    ret = setsockopt(fd, SOL_TLS, read ? TLS_RX : TLS_TX, &ci, len);
+    memset(&ci, 0, sizeof(ci));
+    return ret;
+}
+
+
+int
+qcrypto_tls_session_offload(QCryptoTLSSession *session,
+                            int fd,
+                            bool *rx,
+                            Error **errp)
+{
+    gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(session->handle);
+
+    *rx = false;
+    if (!session->handshakeComplete) {
+        error_setg(errp, "TLS handshake is not complete");
+        return -1;
+    }
+    if (gnutls_protocol_get_version(session->handle) != GNUTLS_TLS1_2) {
+        error_setg(errp, "Kernel TLS offload needs a TLS 1.2 session");
+        return -1;
+    }
+    if (cipher != GNUTLS_CIPHER_AES_128_GCM
+#ifdef TLS_CIPHER_AES_GCM_256
+        && cipher != GNUTLS_CIPHER_AES_256_GCM
+#endif
+        ) {
+        error_setg(errp, "Cipher %s cannot be offloaded to the kernel",
+                   gnutls_cipher_get_name(cipher));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS");
+        return -1;
+    }
+    if (qcrypto_tls_session_offload_dir(session, fd, false) < 0) {
+        error_setg_errno(errp, errno, "Cannot offload TLS sending");
+        return -1;
+    }
+
+    /*
+     * Data gnutls has already decrypted must still be read through it,
+     * and older kernels only offload sending.
+     */
+    if (!gnutls_record_check_pending(session->handle) &&
+        qcrypto_tls_session_offload_dir(session, fd, true) == 0) {
+        *rx = true;
+    }
+    return 0;
+}
+#else
+int
+qcrypto_tls_session_offload(QCryptoTLSSession *session G_GNUC_UNUSED,
+                            int fd G_GNUC_UNUSED,
+                            bool *rx,
+                            Error **errp)
+{
+    *rx = false;
+    error_setg(errp, "Kernel TLS offload is not supported on this host");
+    return -1;
+}
+#endif
+
+
 int
 qcrypto_tls_session_get_key_size(QCryptoTLSSession *session,
                                  Error **errp)
@@ -570,6 +702,18 @@ qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *sess)
 }
 
 
+int
+qcrypto_tls_session_offload(QCryptoTLSSession *sess G_GNUC_UNUSED,
+                            int fd G_GNUC_UNUSED,
+                            bool *rx,
+                            Error **errp)
+{
+    *rx = false;
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
+
 int
 qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
                                  Error **errp)
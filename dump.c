@@ -23,6 +23,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/memory_mapping.h"
 #include "sysemu/cpus.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "qemu/main-loop.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
 #include "qapi-event.h"
@@ -75,6 +78,8 @@ static int dump_cleanup(DumpState *s)
 {
     guest_phys_blocks_free(&s->guest_phys_blocks);
     memory_mapping_list_free(&s->list);
+    g_free(s->live_bitmap);
+    s->live_bitmap = NULL;
     close(s->fd);
     if (s->resume) {
         vm_start();
@@ -1052,6 +1057,14 @@ static bool get_next_page(GuestPhysBlock **blockptr, uint64_t *pfnptr,
     return true;
 }
 
+/*
+ * check if the page is all 0
+ */
+static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
+{
+    return buffer_is_zero(buf, page_size);
+}
+
 static void write_dump_bitmap(DumpState *s, Error **errp)
 {
     int ret = 0;
@@ -1059,6 +1072,7 @@ static void write_dump_bitmap(DumpState *s, Error **errp)
     void *dump_bitmap_buf;
     size_t num_dumpable;
     GuestPhysBlock *block_iter = NULL;
+    uint8_t *buf;
     size_t bitmap_bufsize = dump_bitmap_get_bufsize(s);
     size_t bits_per_buf = bitmap_bufsize * CHAR_BIT;
 
@@ -1070,9 +1084,14 @@ static void write_dump_bitmap(DumpState *s, Error **errp)
 
     /*
      * exam memory page by page, and set the bit in dump_bitmap corresponded
-     * to the existing page.
+     * to the existing page. zero pages are left out if requested, like
+     * makedumpfile's dump level 1 does.
      */
-    while (get_next_page(&block_iter, &pfn, NULL, s)) {
+    while (get_next_page(&block_iter, &pfn, &buf, s)) {
+        if (s->exclude_zero && is_zero_page(buf, s->dump_info.page_size)) {
+            continue;
+        }
+
         ret = set_dump_bitmap(last_pfn, pfn, true, dump_bitmap_buf, s);
         if (ret < 0) {
             error_setg(errp, "dump: failed to set dump_bitmap");
@@ -1174,27 +1193,275 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
 }
 
 /*
- * check if the page is all 0
+ * Compress one page into buf_out.  Returns the DUMP_DH_COMPRESSED_* flag
+ * used, or 0 if the page is to be saved in plaintext because compression
+ * failed or did not make it smaller.
  */
-static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
+static uint32_t dump_compress_page(DumpState *s, const uint8_t *buf,
+                                   uint8_t *buf_out, size_t len_buf_out,
+                                   size_t *size_out, void *wrkmem)
 {
-    return buffer_is_zero(buf, page_size);
+    *size_out = len_buf_out;
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)size_out, buf,
+                   s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
+        (*size_out < s->dump_info.page_size)) {
+        return DUMP_DH_COMPRESSED_ZLIB;
+    }
+#ifdef CONFIG_LZO
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
+                          (lzo_uint *)size_out, wrkmem) == LZO_E_OK) &&
+        (*size_out < s->dump_info.page_size)) {
+        return DUMP_DH_COMPRESSED_LZO;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((const char *)buf, s->dump_info.page_size,
+                         (char *)buf_out, size_out) == SNAPPY_OK) &&
+        (*size_out < s->dump_info.page_size)) {
+        return DUMP_DH_COMPRESSED_SNAPPY;
+    }
+#endif
+
+    *size_out = s->dump_info.page_size;
+    return 0;
+}
+
+/*
+ * Pages are compressed in batches by a pool of worker threads.  The dump
+ * thread hands out batches in guest-physical order and writes them back in
+ * the same order, so the layout of the vmcore does not depend on which
+ * worker finishes first.
+ */
+#define DUMP_COMPRESS_BATCH         256
+#define DUMP_COMPRESS_MAX_THREADS   8
+
+/* Marks a page that goes out as the shared zero page */
+#define DUMP_PAGE_ZERO              UINT32_MAX
+
+typedef struct DumpCompressJob {
+    size_t npages;
+    uint8_t *pages[DUMP_COMPRESS_BATCH];
+    uint32_t flags[DUMP_COMPRESS_BATCH];
+    size_t sizes[DUMP_COMPRESS_BATCH];
+    uint8_t *buf_out;                   /* len_buf_out bytes per page */
+    bool done;
+} DumpCompressJob;
+
+typedef struct DumpCompress {
+    DumpState *s;
+    size_t len_buf_out;
+    unsigned int nthreads;
+    QemuThread *threads;
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    unsigned int njobs;
+    DumpCompressJob *jobs;
+    /* Sequence numbers: submitted, picked by a worker, written out */
+    uint64_t head;
+    uint64_t next_work;
+    uint64_t tail;
+    bool quit;
+} DumpCompress;
+
+static void dump_compress_job(DumpCompress *dc, DumpCompressJob *job,
+                              void *wrkmem)
+{
+    DumpState *s = dc->s;
+    size_t i;
+
+    for (i = 0; i < job->npages; i++) {
+        if (is_zero_page(job->pages[i], s->dump_info.page_size)) {
+            job->flags[i] = DUMP_PAGE_ZERO;
+            continue;
+        }
+        job->flags[i] = dump_compress_page(s, job->pages[i],
+                                           job->buf_out + i * dc->len_buf_out,
+                                           dc->len_buf_out, &job->sizes[i],
+                                           wrkmem);
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompress *dc = opaque;
+    DumpCompressJob *job;
+    void *wrkmem = NULL;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&dc->lock);
+    while (true) {
+        while (!dc->quit && dc->next_work == dc->head) {
+            qemu_cond_wait(&dc->work_cond, &dc->lock);
+        }
+        if (dc->quit) {
+            break;
+        }
+        job = &dc->jobs[dc->next_work++ % dc->njobs];
+        qemu_mutex_unlock(&dc->lock);
+
+        dump_compress_job(dc, job, wrkmem);
+
+        qemu_mutex_lock(&dc->lock);
+        job->done = true;
+        qemu_cond_broadcast(&dc->done_cond);
+    }
+    qemu_mutex_unlock(&dc->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static unsigned int dump_compress_nthreads(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, MIN(n, DUMP_COMPRESS_MAX_THREADS));
+}
+
+static void dump_compress_init(DumpCompress *dc, DumpState *s,
+                               size_t len_buf_out)
+{
+    unsigned int i;
+
+    memset(dc, 0, sizeof(*dc));
+    dc->s = s;
+    dc->len_buf_out = len_buf_out;
+    dc->nthreads = dump_compress_nthreads();
+    /* Enough batches to keep every worker busy while one is written out */
+    dc->njobs = dc->nthreads * 2;
+    dc->jobs = g_new0(DumpCompressJob, dc->njobs);
+    for (i = 0; i < dc->njobs; i++) {
+        dc->jobs[i].buf_out = g_malloc(DUMP_COMPRESS_BATCH * len_buf_out);
+    }
+
+    qemu_mutex_init(&dc->lock);
+    qemu_cond_init(&dc->work_cond);
+    qemu_cond_init(&dc->done_cond);
+
+    dc->threads = g_new(QemuThread, dc->nthreads);
+    for (i = 0; i < dc->nthreads; i++) {
+        qemu_thread_create(&dc->threads[i], "dump_compress",
+                           dump_compress_thread, dc, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_cleanup(DumpCompress *dc)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&dc->lock);
+    dc->quit = true;
+    qemu_cond_broadcast(&dc->work_cond);
+    qemu_mutex_unlock(&dc->lock);
+
+    for (i = 0; i < dc->nthreads; i++) {
+        qemu_thread_join(&dc->threads[i]);
+    }
+    g_free(dc->threads);
+
+    qemu_cond_destroy(&dc->done_cond);
+    qemu_cond_destroy(&dc->work_cond);
+    qemu_mutex_destroy(&dc->lock);
+
+    for (i = 0; i < dc->njobs; i++) {
+        g_free(dc->jobs[i].buf_out);
+    }
+    g_free(dc->jobs);
+}
+
+static void dump_compress_submit(DumpCompress *dc)
+{
+    qemu_mutex_lock(&dc->lock);
+    dc->jobs[dc->head % dc->njobs].done = false;
+    dc->head++;
+    qemu_cond_signal(&dc->work_cond);
+    qemu_mutex_unlock(&dc->lock);
+}
+
+/* Wait for the oldest batch and write its pages out */
+static int dump_compress_collect(DumpCompress *dc, DataCache *page_desc,
+                                 DataCache *page_data, off_t *offset_data,
+                                 const PageDescriptor *pd_zero,
+                                 size_t *num_written)
+{
+    DumpState *s = dc->s;
+    DumpCompressJob *job = &dc->jobs[dc->tail % dc->njobs];
+    PageDescriptor pd;
+    size_t i;
+    int ret;
+
+    qemu_mutex_lock(&dc->lock);
+    while (!job->done) {
+        qemu_cond_wait(&dc->done_cond, &dc->lock);
+    }
+    qemu_mutex_unlock(&dc->lock);
+
+    for (i = 0; i < job->npages; i++) {
+        s->written_size += s->dump_info.page_size;
+
+        if (job->flags[i] == DUMP_PAGE_ZERO) {
+            if (s->exclude_zero) {
+                /* already left out of the dump bitmap */
+                continue;
+            }
+            ret = write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                              false);
+            if (ret < 0) {
+                return -1;
+            }
+            (*num_written)++;
+            continue;
+        }
+
+        /* plaintext pages are written straight from guest memory */
+        ret = write_cache(page_data,
+                          job->flags[i] ?
+                          job->buf_out + i * dc->len_buf_out : job->pages[i],
+                          job->sizes[i], false);
+        if (ret < 0) {
+            return -1;
+        }
+
+        pd.flags = cpu_to_dump32(s, job->flags[i]);
+        pd.size = cpu_to_dump32(s, job->sizes[i]);
+        pd.page_flags = cpu_to_dump64(s, 0);
+        pd.offset = cpu_to_dump64(s, *offset_data);
+        *offset_data += job->sizes[i];
+
+        ret = write_cache(page_desc, &pd, sizeof(PageDescriptor), false);
+        if (ret < 0) {
+            return -1;
+        }
+        (*num_written)++;
+    }
+
+    dc->tail++;
+    return 0;
 }
 
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompress dc;
+    DumpCompressJob *job;
+    size_t len_buf_out, num_written = 0;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1207,11 +1474,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_init(&dc, s, len_buf_out);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1232,100 +1495,34 @@ static void write_dump_pages(DumpState *s, Error **errp)
     offset_data += s->dump_info.page_size;
 
     /*
-     * dump memory to vmcore page by page. zero page will all be resided in the
+     * dump memory in batches of pages. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
+    more = get_next_page(&block_iter, &pfn_iter, &buf, s);
+    while (more || dc.tail != dc.head) {
+        if (!more || dc.head - dc.tail == dc.njobs) {
+            ret = dump_compress_collect(&dc, &page_desc, &page_data,
+                                        &offset_data, &pd_zero, &num_written);
             if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
+                error_setg(errp, "dump: failed to write page data");
                 goto out;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            continue;
+        }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
+        job = &dc.jobs[dc.head % dc.njobs];
+        job->npages = 0;
+        while (more && job->npages < DUMP_COMPRESS_BATCH) {
+            job->pages[job->npages++] = buf;
+            more = get_next_page(&block_iter, &pfn_iter, &buf, s);
         }
-        s->written_size += s->dump_info.page_size;
+        dump_compress_submit(&dc);
+    }
+
+    /* the bitmap was computed on the first pass over guest memory */
+    if (num_written != s->num_dumpable) {
+        error_setg(errp, "dump: guest memory changed while dumping");
+        goto out;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1340,14 +1537,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    dump_compress_cleanup(&dc);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1484,7 +1676,8 @@ static int64_t dump_calculate_size(DumpState *s)
 
 static void dump_init(DumpState *s, int fd, bool has_format,
                       DumpGuestMemoryFormat format, bool paging, bool has_filter,
-                      int64_t begin, int64_t length, Error **errp)
+                      int64_t begin, int64_t length, bool exclude_zero,
+                      bool live, Error **errp)
 {
     CPUState *cpu;
     int nr_cpus;
@@ -1500,7 +1693,11 @@ static void dump_init(DumpState *s, int fd, bool has_format,
         assert(!paging && !has_filter);
     }
 
-    if (runstate_is_running()) {
+    s->live = live;
+    if (live) {
+        /* the guest is only stopped at the end, by dump_live_vmcore() */
+        s->resume = false;
+    } else if (runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -1518,6 +1715,7 @@ static void dump_init(DumpState *s, int fd, bool has_format,
 
     s->fd = fd;
     s->has_filter = has_filter;
+    s->exclude_zero = exclude_zero;
     s->begin = begin;
     s->length = length;
 
@@ -1657,13 +1855,166 @@ cleanup:
     dump_cleanup(s);
 }
 
+/*
+ * Live dump: guest memory is written while the guest runs, and the pages it
+ * dirties meanwhile are tracked with the migration dirty bitmap and written
+ * again at their place in the file.  Once few enough are left, the guest is
+ * stopped for a last refresh, and the ELF headers and notes, which record
+ * the CPU state, are written at the start of the file.
+ */
+#define DUMP_LIVE_MAX_PASSES    5
+#define DUMP_LIVE_STOP_PAGES    1024
+
+static ram_addr_t dump_block_offset(GuestPhysBlock *block)
+{
+    return block->host_addr - (uint8_t *)memory_region_get_ram_ptr(block->mr);
+}
+
+/* Called with the iothread lock held */
+static uint64_t dump_live_sync(DumpState *s)
+{
+    GuestPhysBlock *block;
+    uint64_t num_dirty = 0;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    rcu_read_lock();
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        ram_addr_t offset = dump_block_offset(block);
+        ram_addr_t len = block->target_end - block->target_start;
+
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(s->live_bitmap,
+                        memory_region_get_ram_addr(block->mr) + offset, len);
+        memory_region_clear_dirty_bitmap(block->mr, offset, len);
+    }
+    rcu_read_unlock();
+
+    return num_dirty;
+}
+
+/* Write again the pages flagged in live_bitmap, and clear them */
+static void dump_live_refresh(DumpState *s, Error **errp)
+{
+    GuestPhysBlock *block;
+    unsigned long page, end;
+    hwaddr addr, skip, offset, filesz;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        ram_addr_t ram_start = memory_region_get_ram_addr(block->mr) +
+                               dump_block_offset(block);
+
+        page = ram_start >> TARGET_PAGE_BITS;
+        end = (ram_start + block->target_end - block->target_start) >>
+              TARGET_PAGE_BITS;
+        for (page = find_next_bit(s->live_bitmap, end, page); page < end;
+             page = find_next_bit(s->live_bitmap, end, page + 1)) {
+            clear_bit(page, s->live_bitmap);
+
+            addr = block->target_start +
+                   ((ram_addr_t)page << TARGET_PAGE_BITS) - ram_start;
+            skip = 0;
+            if (s->has_filter && addr < s->begin) {
+                /* the filter may start in the middle of this page */
+                skip = s->begin - addr;
+                if (skip >= TARGET_PAGE_SIZE) {
+                    continue;
+                }
+            }
+
+            get_offset_range(addr + skip, TARGET_PAGE_SIZE - skip, s,
+                             &offset, &filesz);
+            if (offset == -1) {
+                continue;
+            }
+            if (lseek(s->fd, offset, SEEK_SET) == (off_t)-1 ||
+                fd_write_vmcore(block->host_addr + (addr + skip -
+                                block->target_start), filesz, s) < 0) {
+                error_setg(errp, "dump: failed to refresh memory");
+                return;
+            }
+        }
+    }
+}
+
+static void dump_live_vmcore(DumpState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t num_dirty;
+    CPUState *cpu;
+    uint32_t nr_cpus = 0;
+    int pass;
+
+    s->live_bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* only what the guest writes from now on must be refreshed */
+    dump_live_sync(s);
+    bitmap_zero(s->live_bitmap, last_ram_offset() >> TARGET_PAGE_BITS);
+    qemu_mutex_unlock_iothread();
+
+    if (lseek(s->fd, s->memory_offset, SEEK_SET) == (off_t)-1) {
+        error_setg_errno(&local_err, errno, "dump: failed to seek");
+    } else {
+        dump_iterate(s, &local_err);
+    }
+
+    for (pass = 0; !local_err && pass < DUMP_LIVE_MAX_PASSES; pass++) {
+        qemu_mutex_lock_iothread();
+        num_dirty = dump_live_sync(s);
+        qemu_mutex_unlock_iothread();
+        if (num_dirty <= DUMP_LIVE_STOP_PAGES) {
+            break;
+        }
+        dump_live_refresh(s, &local_err);
+    }
+
+    qemu_mutex_lock_iothread();
+    if (!local_err) {
+        if (runstate_is_running()) {
+            vm_stop(RUN_STATE_SAVE_VM);
+            s->resume = true;
+        }
+        dump_live_sync(s);
+        cpu_synchronize_all_states();
+        CPU_FOREACH(cpu) {
+            nr_cpus++;
+        }
+        if (nr_cpus != s->nr_cpus) {
+            error_setg(&local_err, "dump: CPUs were hot-plugged during "
+                       "the live dump");
+        }
+    }
+    memory_global_dirty_log_stop();
+    qemu_mutex_unlock_iothread();
+
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* the guest is stopped, nothing is dirtied any more */
+    dump_live_refresh(s, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (lseek(s->fd, 0, SEEK_SET) == (off_t)-1) {
+        error_setg_errno(errp, errno, "dump: failed to seek");
+        return;
+    }
+    dump_begin(s, errp);
+}
+
 /* this operation might be time consuming. */
 static void dump_process(DumpState *s, Error **errp)
 {
     Error *local_err = NULL;
     DumpQueryResult *result = NULL;
 
-    if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+    if (s->live) {
+        dump_live_vmcore(s, &local_err);
+    } else if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
         create_kdump_vmcore(s, &local_err);
     } else {
         create_vmcore(s, &local_err);
@@ -1712,7 +2063,9 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                            bool has_detach, bool detach,
                            bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format,
+                           bool has_exclude_zero, bool exclude_zero,
+                           bool has_live, bool live, Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -1742,6 +2095,33 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                          "filter");
         return;
     }
+    if (has_exclude_zero && exclude_zero &&
+        (!has_format || format == DUMP_GUEST_MEMORY_FORMAT_ELF)) {
+        error_setg(errp, "exclude-zero is only supported by the kdump "
+                         "formats");
+        return;
+    }
+    if (has_live && live) {
+        if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+            /* compressed pages cannot be rewritten in place */
+            error_setg(errp, "live dump is only supported by the elf format");
+            return;
+        }
+        if (paging) {
+            error_setg(errp, "live dump doesn't support paging");
+            return;
+        }
+        if (!has_detach || !detach) {
+            error_setg(errp, "live dump needs detach");
+            return;
+        }
+        if (!migration_is_idle()) {
+            error_setg(errp, QERR_MIGRATION_ACTIVE);
+            return;
+        }
+    } else {
+        live = false;
+    }
     if (has_begin && !has_length) {
         error_setg(errp, QERR_MISSING_PARAMETER, "length");
         return;
@@ -1791,11 +2171,19 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         return;
     }
 
+    /* a live dump writes memory first and patches it up in place */
+    if (live && lseek(fd, 0, SEEK_CUR) == (off_t)-1) {
+        error_setg(errp, "live dump needs a seekable file");
+        close(fd);
+        return;
+    }
+
     s = &dump_state_global;
     dump_state_prepare(s);
 
     dump_init(s, fd, has_format, format, paging, has_begin,
-              begin, length, &local_err);
+              begin, length, has_exclude_zero && exclude_zero, live,
+              &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         atomic_set(&s->status, DUMP_STATUS_FAILED);
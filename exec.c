@@ -62,6 +62,9 @@
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
 #endif
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 
 //#define DEBUG_SUBPAGE
 
@@ -145,7 +148,20 @@ struct AddressSpaceDispatch {
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
+    /* The sections and subpages point to one address space using the
+     * map; any of them will do, since they all see the same topology.
+     */
     AddressSpace *as;
+
+    /* Address spaces whose FlatView is the same object share one
+     * dispatch map, found through dispatch_views.  Protected by the BQL.
+     */
+    struct FlatView *view;
+    GSList *users;
+    unsigned ref;
+    /* the address space whose listener fills in the map, until the map
+       is first committed */
+    AddressSpace *builder;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -164,6 +180,8 @@ typedef struct subpage_t {
 static void io_mem_init(void);
 static void memory_map_init(void);
 static void tcg_commit(MemoryListener *listener);
+static AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as,
+                                                        struct FlatView *view);
 
 static MemoryRegion io_mem_watch;
 
@@ -631,6 +649,9 @@ void cpu_exec_exit(CPUState *cpu)
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_unregister(NULL, &vmstate_cpu_common, cpu);
     }
+#ifndef CONFIG_USER_ONLY
+    tlb_destroy(cpu);
+#endif
 }
 
 void cpu_exec_init(CPUState *cpu, Error **errp)
@@ -657,6 +678,7 @@ void cpu_exec_init(CPUState *cpu, Error **errp)
                              &error_abort);
     cpu->memory = system_memory;
     object_ref(OBJECT(cpu->memory));
+    tlb_init(cpu);
 #endif
 
     cpu_list_lock();
@@ -921,8 +943,10 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 }
 
 #if !defined(CONFIG_USER_ONLY)
-/* Called from RCU critical section */
-static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+/* Called from RCU critical section; returns NULL if no block contains
+ * @addr.
+ */
+RAMBlock *qemu_ram_block_lookup(ram_addr_t addr)
 {
     RAMBlock *block;
 
@@ -935,9 +959,7 @@ static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
             goto found;
         }
     }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
+    return NULL;
 
 found:
     /* It is safe to write mru_block outside the iothread lock.  This
@@ -960,6 +982,18 @@ found:
     return block;
 }
 
+/* Called from RCU critical section */
+static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+{
+    RAMBlock *block = qemu_ram_block_lookup(addr);
+
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
+    }
+    return block;
+}
+
 static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 {
     CPUState *cpu;
@@ -1020,7 +1054,7 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
 }
 
 /* Called from RCU critical section */
-hwaddr memory_region_section_get_iotlb(CPUState *cpu,
+hwaddr memory_region_section_get_iotlb(CPUState *cpu, int asidx,
                                        MemoryRegionSection *section,
                                        target_ulong vaddr,
                                        hwaddr paddr, hwaddr xlat,
@@ -1041,7 +1075,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
     } else {
         AddressSpaceDispatch *d;
 
-        d = atomic_rcu_read(&section->address_space->dispatch);
+        d = cpu->cpu_ases[asidx].memory_dispatch;
         iotlb = section - d->map.sections;
         iotlb += xlat;
     }
@@ -1174,6 +1208,16 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (!d) {
+        /* listener registration replays the current view without
+           memory.c choosing a map first */
+        d = as->next_dispatch = address_space_dispatch_new(as, NULL);
+    }
+    if (d->builder != as) {
+        /* sharing a map that another address space has filled in */
+        return;
+    }
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1314,13 +1358,14 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory, errp);
+        os_mem_prealloc(fd, area, memory, smp_cpus, errp);
         if (errp && *errp) {
             goto error;
         }
     }
 
     block->fd = fd;
+    block->page_size = page_size;
     return area;
 
 error:
@@ -1407,6 +1452,62 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+size_t qemu_ram_pagesize(RAMBlock *rb)
+{
+    return rb->page_size;
+}
+
+/* Largest host page size of any RAMBlock */
+size_t qemu_ram_pagesize_largest(void)
+{
+    RAMBlock *block;
+    size_t largest = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        largest = MAX(largest, qemu_ram_pagesize(block));
+    }
+    rcu_read_unlock();
+
+    return largest;
+}
+
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
+/*
+ * Drop the contents of @length bytes at offset @start in @rb, so that
+ * they read back as zeroes, or fault again with userfault.  The range
+ * must be aligned to the page size of the block.
+ * Returns 0 on success, -errno on failure.
+ */
+int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
+{
+    uint8_t *host = rb->host + start;
+    int ret = -ENOTSUP;
+
+    if (rb->page_size == getpagesize()) {
+        ret = qemu_madvise(host, length, QEMU_MADV_DONTNEED) ? -errno : 0;
+    } else {
+        /*
+         * hugetlbfs can't do MADV_DONTNEED, but punching a hole in the
+         * file it maps has the same effect.
+         */
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        ret = fallocate(rb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        start, length) ? -errno : 0;
+#endif
+    }
+
+    if (ret) {
+        error_report("%s: failed to discard %s:%" PRIx64 "+%zx: %s",
+                     __func__, rb->idstr, start, length, strerror(-ret));
+    }
+    return ret;
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1532,7 +1633,9 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
         }
 
         for (j = old_num_blocks; j < new_num_blocks; j++) {
-            new_blocks->blocks[j] = bitmap_new(DIRTY_MEMORY_BLOCK_SIZE);
+            /* with room for the summary of its chunks */
+            new_blocks->blocks[j] = bitmap_new(DIRTY_MEMORY_BLOCK_SIZE +
+                                               BITS_PER_LONG);
         }
 
         atomic_rcu_set(&ram_list.dirty_memory[i], new_blocks);
@@ -1689,6 +1792,7 @@ RAMBlock *qemu_ram_alloc_internal(ram_addr_t size, ram_addr_t max_size,
     new_block->max_length = max_size;
     assert(max_size >= size);
     new_block->fd = -1;
+    new_block->page_size = getpagesize();
     new_block->host = host;
     if (host) {
         new_block->flags |= RAM_PREALLOC;
@@ -1739,6 +1843,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->page_desc);
     g_free(block);
 }
 
@@ -1748,6 +1853,9 @@ void qemu_ram_free(RAMBlock *block)
         return;
     }
 
+    if (tcg_enabled()) {
+        tb_invalidate_ram_block(block);
+    }
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
@@ -1973,7 +2081,11 @@ ram_addr_t qemu_ram_addr_from_host(void *ptr)
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
+    bool locked = false;
+
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        locked = true;
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
     }
     switch (size) {
@@ -1989,6 +2101,12 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
+
+    /* Keep translators off the page until the store is visible.  */
+    if (locked) {
+        tb_unlock();
+    }
+
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -2049,6 +2167,9 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
                     continue;
                 }
                 cpu->watchpoint_hit = wp;
+
+                /* Released by tb_lock_reset() when we longjmp out below.  */
+                tb_lock();
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2288,9 +2409,11 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+static GHashTable *dispatch_views;
+
+static AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as,
+                                                        struct FlatView *view)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
@@ -2305,7 +2428,37 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
-    as->next_dispatch = d;
+    d->users = g_slist_prepend(NULL, as);
+    d->ref = 1;
+    d->builder = as;
+    if (view) {
+        if (!dispatch_views) {
+            dispatch_views = g_hash_table_new(NULL, NULL);
+        }
+        flatview_ref(view);
+        d->view = view;
+        g_hash_table_insert(dispatch_views, view, d);
+    }
+    return d;
+}
+
+/* Point the sections of @d, and the subpages that dispatch through an
+ * address space, at @as.
+ */
+static void address_space_dispatch_retarget(AddressSpaceDispatch *d,
+                                            AddressSpace *as)
+{
+    MemoryRegionSection *section;
+    unsigned i;
+
+    d->as = as;
+    for (i = 0; i < d->map.sections_nb; i++) {
+        section = &d->map.sections[i];
+        section->address_space = as;
+        if (section->mr->subpage) {
+            atomic_set(&container_of(section->mr, subpage_t, iomem)->as, as);
+        }
+    }
 }
 
 static void address_space_dispatch_free(AddressSpaceDispatch *d)
@@ -2314,17 +2467,81 @@ static void address_space_dispatch_free(AddressSpaceDispatch *d)
     g_free(d);
 }
 
+/* @as stops using @d.  The sections must not keep pointing to it, as it
+ * may be about to go away.
+ */
+static void address_space_dispatch_unref(AddressSpaceDispatch *d,
+                                         AddressSpace *as)
+{
+    d->users = g_slist_remove(d->users, as);
+    if (--d->ref) {
+        if (d->as == as) {
+            address_space_dispatch_retarget(d, d->users->data);
+        }
+        return;
+    }
+    if (d->view) {
+        g_hash_table_remove(dispatch_views, d->view);
+        flatview_unref(d->view);
+    }
+    call_rcu(d, address_space_dispatch_free, rcu);
+}
+
+/* Called by memory.c when @as is about to switch to @view, before the
+ * listeners see the difference.  If another address space already has
+ * a map for the same FlatView, @as simply takes a reference to it and
+ * its listener ignores the update.
+ */
+void address_space_dispatch_prepare(AddressSpace *as, struct FlatView *view)
+{
+    AddressSpaceDispatch *d = NULL;
+
+    if (dispatch_views) {
+        d = g_hash_table_lookup(dispatch_views, view);
+    }
+    if (!d) {
+        as->next_dispatch = address_space_dispatch_new(as, view);
+    } else {
+        d->ref++;
+        d->users = g_slist_prepend(d->users, as);
+        as->next_dispatch = d;
+    }
+}
+
+static void mem_begin(MemoryListener *listener)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    as->next_dispatch = NULL;
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    as->next_dispatch = NULL;
+    if (!next) {
+        if (cur) {
+            /* memory.c skips address spaces whose view is unchanged */
+            return;
+        }
+        next = address_space_dispatch_new(as, NULL);
+    }
+    if (next->builder) {
+        phys_page_compact_all(next, next->map.nodes_nb);
+        next->builder = NULL;
+    }
 
     atomic_rcu_set(&as->dispatch, next);
+    /* Invalidates AddressSpaceMapCaches.  Regions referenced by cur stay
+     * alive until a grace period after this, so a cache user that still
+     * sees the old generation can safely take a reference.
+     */
+    atomic_inc(&as->dispatch_gen);
     if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(cur, as);
     }
 }
 
@@ -2342,6 +2559,10 @@ static void tcg_commit(MemoryListener *listener)
      * may have split the RCU critical section.
      */
     d = atomic_rcu_read(&cpuas->as->dispatch);
+    if (d == cpuas->memory_dispatch) {
+        /* nothing changed in this address space */
+        return;
+    }
     cpuas->memory_dispatch = d;
     tlb_flush(cpuas->cpu, 1);
 }
@@ -2370,7 +2591,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
 
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(d, as);
     }
 }
 
@@ -2457,7 +2678,9 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
             cpu_physical_memory_range_includes_clean(addr, length, dirty_log_mask);
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
+        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -2985,6 +3208,99 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     cpu_notify_map_clients();
 }
 
+/* Called from RCU critical section.  Leaves the cache empty if @addr is
+ * not in RAM that can be mapped without an IOMMU or Xen map cache.
+ */
+static bool address_space_map_cache_fill(AddressSpace *as,
+                                         AddressSpaceMapCache *cache,
+                                         hwaddr addr)
+{
+    AddressSpaceDispatch *d;
+    MemoryRegionSection *section;
+    MemoryRegion *mr;
+    hwaddr xlat, l = 1, len;
+
+    cache->mr = NULL;
+    if (xen_enabled()) {
+        return false;
+    }
+
+    cache->gen = atomic_read(&as->dispatch_gen);
+    smp_rmb(); /* read the generation before the dispatch it describes */
+    d = atomic_rcu_read(&as->dispatch);
+    section = address_space_translate_internal(d, addr, &xlat, &l, true);
+    mr = section->mr;
+    if (mr->iommu_ops || !memory_region_is_ram(mr)) {
+        return false;
+    }
+
+    len = int128_get64(section->size);
+    cache->host = qemu_ram_ptr_length(mr->ram_block,
+                                      section->offset_within_region, &len);
+    cache->addr = section->offset_within_address_space;
+    cache->len = len;
+    cache->xlat = section->offset_within_region;
+    cache->mr = mr;
+    return addr - cache->addr < cache->len;
+}
+
+static inline bool address_space_map_cache_hit(AddressSpace *as,
+                                               AddressSpaceMapCache *cache,
+                                               hwaddr addr)
+{
+    return cache->mr && cache->gen == atomic_read(&as->dispatch_gen) &&
+           addr - cache->addr < cache->len;
+}
+
+void *address_space_map_cached(AddressSpace *as, AddressSpaceMapCache *cache,
+                               hwaddr addr, hwaddr *plen, bool is_write)
+{
+    hwaddr offset;
+    void *ptr;
+
+    if (*plen == 0) {
+        return NULL;
+    }
+
+    rcu_read_lock();
+    if ((!address_space_map_cache_hit(as, cache, addr) &&
+         !address_space_map_cache_fill(as, cache, addr)) ||
+        !memory_access_is_direct(cache->mr, is_write)) {
+        rcu_read_unlock();
+        return address_space_map(as, addr, plen, is_write);
+    }
+
+    offset = addr - cache->addr;
+    *plen = MIN(*plen, cache->len - offset);
+    memory_region_ref(cache->mr);
+    ptr = cache->host + offset;
+    rcu_read_unlock();
+
+    return ptr;
+}
+
+void address_space_unmap_cached(AddressSpace *as, AddressSpaceMapCache *cache,
+                                void *buffer, hwaddr len, int is_write,
+                                hwaddr access_len)
+{
+    uint8_t *ptr = buffer;
+
+    /* With an unchanged generation the cached section is still mapped, so
+     * a buffer inside it belongs to cache->mr.
+     */
+    if (cache->mr && cache->gen == atomic_read(&as->dispatch_gen) &&
+        ptr >= cache->host && ptr - cache->host < cache->len) {
+        if (is_write) {
+            invalidate_and_set_dirty(cache->mr,
+                                     cache->xlat + (ptr - cache->host),
+                                     access_len);
+        }
+        memory_region_unref(cache->mr);
+        return;
+    }
+    address_space_unmap(as, buffer, len, is_write, access_len);
+}
+
 void *cpu_physical_memory_map(hwaddr addr,
                               hwaddr *plen,
                               int is_write)
@@ -302,6 +302,23 @@ STEXI
 @item info opcount
 @findex opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+    {
+        .name       = "tbs",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = hmp_info_tbs,
+    },
+
+STEXI
+@item info tbs [@var{count}]
+@findex tbs
+Show the @var{count} (default 10) translation blocks that executed the
+most guest instructions since @code{tb_profile on}, with their guest
+instruction count, host code size, execution and main loop exit counts,
+and translation time.
 ETEXI
 
     {
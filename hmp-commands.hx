@@ -327,19 +327,25 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l: write RAM while the VM keeps running",
         .mhandler.cmd = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, RAM is written while the VM keeps running, tracking the
+pages it dirties as migration does; the VM is only paused at the end, for
+about the migration downtime limit, to write out the remaining dirty pages
+and the device state.
 ETEXI
 
     {
@@ -386,6 +392,21 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "count executions of each translation block",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb_profile [off]
+@findex tb_profile
+Retranslate all code with per-block execution counters, to be shown by
+@code{info tbs}.  If called with option off, the counters are dropped.
 ETEXI
 
     {
@@ -213,6 +213,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -223,6 +225,43 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         }
     }
 
+    if (info->has_prediction) {
+        MigrationPrediction *pred = info->prediction;
+
+        monitor_printf(mon, "predicted bandwidth: %" PRIu64 " bytes/s\n",
+                       pred->bandwidth);
+        monitor_printf(mon, "predicted dirty rate: %" PRIu64 " bytes/s\n",
+                       pred->dirty_rate);
+        if (pred->has_remaining_time) {
+            monitor_printf(mon, "predicted remaining time: %" PRIu64
+                           " milliseconds\n", pred->remaining_time);
+        } else {
+            monitor_printf(mon, "predicted remaining time: not converging\n");
+        }
+        monitor_printf(mon, "downtime if stopped now: %" PRIu64
+                       " milliseconds\n", pred->stop_downtime);
+    }
+
+    if (info->has_postcopy_faults) {
+        PostcopyFaultStats *faults = info->postcopy_faults;
+        intList *item;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 "\n",
+                       faults->faults);
+        monitor_printf(mon, "postcopy fault latency: average %" PRIu64
+                       " p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64
+                       " max %" PRIu64 " microseconds\n",
+                       faults->average, faults->p50, faults->p90,
+                       faults->p99, faults->max);
+        if (faults->has_vcpu_blocktime) {
+            monitor_printf(mon, "postcopy vcpu blocktime:");
+            for (item = faults->vcpu_blocktime; item; item = item->next) {
+                monitor_printf(mon, " %" PRIu64, item->value);
+            }
+            monitor_printf(mon, " milliseconds\n");
+        }
+    }
+
     if (info->has_disk) {
         monitor_printf(mon, "transferred disk: %" PRIu64 " kbytes\n",
                        info->disk->transferred >> 10);
@@ -245,6 +284,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -252,6 +295,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_throttle_percentage) {
+        intList *pct;
+
+        monitor_printf(mon, "vcpu throttle percentage:");
+        for (pct = info->vcpu_throttle_percentage; pct; pct = pct->next) {
+            monitor_printf(mon, " %" PRId64, pct->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -304,6 +357,38 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES],
+            params->postcopy_prefetch_pages);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_CONVERGENCE_TIME],
+            params->cpu_throttle_convergence_time);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_RDMA_QUEUE_PAIRS],
+            params->rdma_queue_pairs);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_BLOCK_INFLIGHT_DEPTH],
+            params->block_inflight_depth);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_SEND_IOV_DEPTH],
+            params->send_iov_depth);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
+            params->x_checkpoint_delay);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[
+                MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_LIMIT],
+            params->x_checkpoint_dirty_limit);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[
+                MIGRATION_PARAMETER_X_COLO_HEARTBEAT_TIMEOUT],
+            params->x_colo_heartbeat_timeout);
         monitor_printf(mon, "\n");
     }
 
@@ -1260,6 +1345,17 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_compress_method = false;
+    bool has_postcopy_prefetch_pages = false;
+    bool has_cpu_throttle_convergence_time = false;
+    bool has_rdma_queue_pairs = false;
+    bool has_block_inflight_depth = false;
+    bool has_send_iov_depth = false;
+    bool has_x_checkpoint_delay = false;
+    bool has_x_checkpoint_dirty_limit = false;
+    bool has_x_colo_heartbeat_timeout = false;
+    int compress_method = 0;
     bool use_int_value = false;
     int i;
 
@@ -1291,6 +1387,51 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                compress_method = qapi_enum_parse(
+                    MigrationCompressMethod_lookup, valuestr,
+                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+                has_postcopy_prefetch_pages = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_CONVERGENCE_TIME:
+                has_cpu_throttle_convergence_time = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_RDMA_QUEUE_PAIRS:
+                has_rdma_queue_pairs = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_BLOCK_INFLIGHT_DEPTH:
+                has_block_inflight_depth = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_SEND_IOV_DEPTH:
+                has_send_iov_depth = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_CHECKPOINT_DELAY:
+                has_x_checkpoint_delay = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_LIMIT:
+                has_x_checkpoint_dirty_limit = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_COLO_HEARTBEAT_TIMEOUT:
+                has_x_colo_heartbeat_timeout = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1308,6 +1449,17 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_compress_method, compress_method,
+                                       has_postcopy_prefetch_pages, valueint,
+                                       has_cpu_throttle_convergence_time,
+                                       valueint,
+                                       has_rdma_queue_pairs, valueint,
+                                       has_block_inflight_depth, valueint,
+                                       has_send_iov_depth, valueint,
+                                       has_x_checkpoint_delay, valueint,
+                                       has_x_checkpoint_dirty_limit, valueint,
+                                       has_x_colo_heartbeat_timeout, valueint,
                                        &err);
             break;
         }
@@ -1657,7 +1809,8 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
-                          has_length, length, true, dump_format, &err);
+                          has_length, length, true, dump_format,
+                          false, false, false, false, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
@@ -2031,8 +2184,12 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s: thread_id=%" PRId64 " poll-max-ns=%" PRId64
+                       " poll-grow=%" PRId64 " poll-shrink=%" PRId64 "\n",
+                       value->id, value->thread_id, value->poll_max_ns,
+                       value->poll_grow, value->poll_shrink);
     }
 
     qapi_free_IOThreadInfoList(info_list);
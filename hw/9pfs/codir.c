@@ -41,6 +41,110 @@ int v9fs_co_readdir(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent **dent)
     return err;
 }
 
+/* Runs in the worker thread */
+static int do_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, int32_t maxsize, bool dostat)
+{
+    V9fsState *s = pdu->s;
+    V9fsDirEnt **tail = entries;
+    V9fsDirEnt *e;
+    V9fsString name;
+    V9fsPath path;
+    struct dirent *dent;
+    struct stat stbuf;
+    off_t saved_dir_pos;
+    int32_t size = 0;
+    size_t len;
+    int err = 0;
+
+    v9fs_path_init(&path);
+    v9fs_readdir_lock(&fidp->fs.dir);
+
+    saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (saved_dir_pos < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    while (true) {
+        if (v9fs_request_cancelled(pdu)) {
+            err = -EINTR;
+            break;
+        }
+
+        errno = 0;
+        dent = s->ops->readdir(&s->ctx, &fidp->fs);
+        if (!dent) {
+            err = errno ? -errno : 0;
+            break;
+        }
+
+        v9fs_string_init(&name);
+        v9fs_string_sprintf(&name, "%s", dent->d_name);
+        len = v9fs_readdir_data_size(&name);
+        v9fs_string_free(&name);
+        if (size + len > maxsize) {
+            /* leave this entry for the next request */
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            break;
+        }
+
+        if (dostat) {
+            if (s->ops->name_to_path(&s->ctx, &fidp->path, dent->d_name,
+                                     &path) < 0 ||
+                s->ops->lstat(&s->ctx, &path, &stbuf) < 0) {
+                err = -errno;
+                break;
+            }
+        }
+
+        e = g_new0(V9fsDirEnt, 1);
+        e->dent = g_new0(struct dirent, 1);
+        memcpy(e->dent, dent,
+               MIN(sizeof(*dent),
+                   offsetof(struct dirent, d_name) + strlen(dent->d_name) + 1));
+        if (dostat) {
+            e->st = g_memdup(&stbuf, sizeof(stbuf));
+        }
+        *tail = e;
+        tail = &e->next;
+
+        size += len;
+        saved_dir_pos = dent->d_off;
+    }
+
+out:
+    v9fs_readdir_unlock(&fidp->fs.dir);
+    v9fs_path_free(&path);
+    if (err < 0) {
+        v9fs_free_dirents(*entries);
+        *entries = NULL;
+    }
+    return err;
+}
+
+/*
+ * Read as many entries as fit in @maxsize bytes of Treaddir reply in a
+ * single trip to the worker thread, rather than one trip per entry, and
+ * lstat them there too if @dostat.  The stream is left right after the
+ * last entry returned.  The list must be freed with v9fs_free_dirents().
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, int32_t maxsize, bool dostat)
+{
+    int err;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(pdu, fidp, entries, maxsize, dostat);
+        });
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
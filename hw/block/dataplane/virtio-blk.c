@@ -42,6 +42,13 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* IOThreads from the vq-iothreads property.  Virtqueue i is serviced
+     * by vq_ctx[i], which is s->ctx unless vq-iothreads is set.
+     */
+    IOThread **vq_iothreads;
+    unsigned num_vq_iothreads;
+    AioContext **vq_ctx;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -86,9 +93,15 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
 
+    IOThread **vq_iothreads = NULL;
+    unsigned i, num_vq_iothreads = 0;
+
     *dataplane = NULL;
 
     if (!conf->iothread) {
+        if (conf->vq_iothreads) {
+            error_setg(errp, "vq-iothreads requires the iothread property");
+        }
         return;
     }
 
@@ -108,6 +121,14 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    if (conf->vq_iothreads) {
+        vq_iothreads = iothread_parse_list(conf->vq_iothreads,
+                                           &num_vq_iothreads, errp);
+        if (!vq_iothreads) {
+            return;
+        }
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
@@ -118,6 +139,15 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    s->vq_iothreads = vq_iothreads;
+    s->num_vq_iothreads = num_vq_iothreads;
+    s->vq_ctx = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_ctx[i] = num_vq_iothreads ?
+            iothread_get_aio_context(vq_iothreads[i % num_vq_iothreads]) :
+            s->ctx;
+    }
+
     *dataplane = s;
 }
 
@@ -129,6 +159,8 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     }
 
     virtio_blk_data_plane_stop(s);
+    iothread_list_free(s->vq_iothreads, s->num_vq_iothreads);
+    g_free(s->vq_ctx);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     object_unref(OBJECT(s->iothread));
@@ -139,11 +171,21 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    AioContext *ctx;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
+    /* The virtqueue may be serviced by an IOThread other than the one that
+     * owns the BlockBackend.  Requests are submitted, and VirtQueue state
+     * is updated, under the BlockBackend's AioContext lock; completions
+     * run there too.  The lock is recursive, so this is cheap when both
+     * are the same IOThread.
+     */
+    ctx = s->dataplane->ctx;
+    aio_context_acquire(ctx);
     virtio_blk_handle_vq(s, vq);
+    aio_context_release(ctx);
 }
 
 /* Context: QEMU global mutex held */
@@ -186,6 +228,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     vblk->dataplane_started = true;
     trace_virtio_blk_data_plane_start(s);
 
+    virtio_blk_flush_merge_window(vblk);
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
     /* Kick right away to begin processing requests already in vring */
@@ -195,15 +238,18 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         event_notifier_set(virtio_queue_get_host_notifier(vq));
     }
 
-    /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
+    /* Get this show started by hooking up our callbacks.  Each context is
+     * acquired on its own: handlers take s->ctx while holding their own
+     * context, so nesting the two here could deadlock.
+     */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i],
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(s->vq_ctx[i]);
     }
-    aio_context_release(s->ctx);
     return;
 
   fail_guest_notifiers:
@@ -234,16 +280,19 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(s->vq_ctx[i]);
+        virtio_queue_aio_set_host_notifier_handler(vq, s->vq_ctx[i], NULL);
+        aio_context_release(s->vq_ctx[i]);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
+    virtio_blk_flush_merge_window(vblk);
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
@@ -26,9 +26,11 @@
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "qemu/main-loop.h"
 
 #include "nvme.h"
 
@@ -65,7 +67,109 @@ static uint8_t nvme_cq_full(NvmeCQueue *cq)
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == atomic_read(&sq->tail);
+}
+
+/*
+ * Shadow doorbells (Doorbell Buffer Config) mirror the doorbell registers in
+ * guest memory: the SQ y tail lives in slot 2y and the CQ y head in slot
+ * 2y + 1 of the doorbell buffer, with the matching event indexes at the same
+ * offsets of the EventIdx buffer.  The guest only falls back to an MMIO
+ * doorbell write when it moves past the event index, so the controller
+ * publishes how far it has caught up there.  Admin queues keep using MMIO.
+ */
+static uint32_t nvme_dbbuf_read(NvmeCtrl *n, uint64_t addr)
+{
+    uint32_t val;
+
+    pci_dma_read(&n->parent_obj, addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void nvme_dbbuf_write(NvmeCtrl *n, uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    pci_dma_write(&n->parent_obj, addr, &val, sizeof(val));
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail = nvme_dbbuf_read(sq->ctrl, sq->db_addr);
+
+    if (tail < sq->size) {
+        qemu_mutex_lock(&sq->ctrl->db_lock);
+        atomic_set(&sq->tail, tail);
+        qemu_mutex_unlock(&sq->ctrl->db_lock);
+    }
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t head = nvme_dbbuf_read(cq->ctrl, cq->db_addr);
+
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
+static void nvme_process_sq(void *opaque);
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/*
+ * Once the guest uses shadow doorbells the MMIO write carries no
+ * information beyond "look at the shadow tail", so let KVM turn it into
+ * an eventfd and process the queue in the main loop while the vCPU goes
+ * straight back to the guest.  Without KVM ioeventfds the write would
+ * be matched against the eventfd list in the lockless MMIO path, so the
+ * doorbell keeps trapping to nvme_mmio_write() there.
+ */
+static void nvme_init_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!n->ioeventfd || !kvm_eventfds_enabled() || sq->ioeventfd_enabled) {
+        return;
+    }
+    if (event_notifier_init(&sq->notifier, 0) < 0) {
+        return;
+    }
+    event_notifier_set_handler(&sq->notifier, true, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_free_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!sq->ioeventfd_enabled) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    event_notifier_set_handler(&sq->notifier, true, NULL);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd_enabled = false;
+}
+
+static void nvme_init_sq_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_dbbuf_write(n, sq->ei_addr, atomic_read(&sq->tail));
+    nvme_init_sq_ioeventfd(n, sq);
+}
+
+static void nvme_init_cq_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_dbbuf_write(n, cq->ei_addr, cq->head);
 }
 
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
@@ -166,12 +270,27 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
+    if (cq->db_addr) {
+        nvme_update_cq_head(cq);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
         if (nvme_cq_full(cq)) {
-            break;
+            if (!cq->db_addr) {
+                break;
+            }
+            /* Have the guest ring once it frees an entry; it may already
+             * have done so without a doorbell write.
+             */
+            nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+            smp_mb(); /* event index write before re-read */
+            nvme_update_cq_head(cq);
+            if (nvme_cq_full(cq)) {
+                break;
+            }
         }
 
         QTAILQ_REMOVE(&cq->req_list, req, entry);
@@ -287,8 +406,13 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    nvme_free_sq_ioeventfd(n, sq);
+
+    /* a doorbell write can no longer find the queue or re-arm its timer */
+    qemu_mutex_lock(&n->db_lock);
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
+    qemu_mutex_unlock(&n->db_lock);
     timer_free(sq->timer);
     g_free(sq->io_req);
     if (sq->sqid) {
@@ -343,6 +467,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -352,11 +477,16 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
     sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(n, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
+    qemu_mutex_lock(&n->db_lock);
     n->sq[sqid] = sq;
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -430,11 +560,15 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -575,6 +709,31 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr || (dbs_addr | eis_addr) & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -592,6 +751,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -608,6 +769,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -625,6 +790,15 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr && nvme_sq_empty(sq)) {
+            /* Caught up: the guest can skip the doorbell write until it
+             * passes this tail.  Pick up entries that raced with it.
+             */
+            nvme_dbbuf_write(n, sq->ei_addr, atomic_read(&sq->tail));
+            smp_mb(); /* event index write before re-read */
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
@@ -644,6 +818,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     }
 
     blk_flush(n->conf.blk);
+    n->dbbuf_enabled = false;
     n->bar.cc = 0;
 }
 
@@ -737,15 +912,28 @@ static void nvme_write_bar(NvmeCtrl *n, hwaddr offset, uint64_t data,
     }
 }
 
+static bool nvme_lock_iothread(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
 static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     uint8_t *ptr = (uint8_t *)&n->bar;
     uint64_t val = 0;
+    bool unlock = nvme_lock_iothread();
 
     if (addr < sizeof(n->bar)) {
         memcpy(&val, ptr + addr, size);
     }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -785,39 +973,63 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (cq->tail != cq->head) {
             nvme_isr_notify(n, cq);
         }
-    } else {
-        uint16_t new_tail = val & 0xffff;
-        NvmeSQueue *sq;
+    }
+}
 
-        qid = (addr - 0x1000) >> 3;
-        if (nvme_check_sqid(n, qid)) {
-            return;
-        }
+/* Called without the BQL: only publishes the new tail and kicks the
+ * queue's timer, which processes it in the main loop.
+ */
+static void nvme_process_sq_db(NvmeCtrl *n, hwaddr addr, int val)
+{
+    uint16_t new_tail = val & 0xffff;
+    uint32_t qid = (addr - 0x1000) >> 3;
+    NvmeSQueue *sq;
 
+    if (addr & ((1 << 2) - 1)) {
+        return;
+    }
+
+    qemu_mutex_lock(&n->db_lock);
+    if (!nvme_check_sqid(n, qid)) {
         sq = n->sq[qid];
-        if (new_tail >= sq->size) {
-            return;
+        if (new_tail < sq->size) {
+            atomic_set(&sq->tail, new_tail);
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
         }
-
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
     }
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+    bool unlock;
+
+    if (addr >= 0x1000 && !(((addr - 0x1000) >> 2) & 1)) {
+        nvme_process_sq_db(n, addr, data);
+        return;
+    }
+
+    unlock = nvme_lock_iothread();
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
+/* Submission queue doorbells, one per I/O, are handled under db_lock
+ * only so that vCPUs submitting to different queues do not serialize
+ * on the BQL; everything else takes the BQL itself.
+ */
 static const MemoryRegionOps nvme_mmio_ops = {
     .read = nvme_mmio_read,
     .write = nvme_mmio_write,
+    .own_locking = true,
     .endianness = DEVICE_LITTLE_ENDIAN,
     .impl = {
         .min_access_size = 2,
@@ -864,6 +1076,7 @@ static int nvme_init(PCIDevice *pci_dev)
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    qemu_mutex_init(&n->db_lock);
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -881,7 +1094,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -930,12 +1143,14 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    qemu_mutex_destroy(&n->db_lock);
     msix_uninit_exclusive_bar(pci_dev);
 }
 
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -189,16 +189,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
-{
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
-    }
-    return req;
-}
-
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
     int status = VIRTIO_BLK_S_OK;
@@ -578,19 +568,84 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     }
 }
 
+/* Submit the requests held back by the merge window */
+void virtio_blk_flush_merge_window(VirtIOBlock *s)
+{
+    if (!s->merge_timer) {
+        return;
+    }
+
+    timer_del(s->merge_timer);
+    if (s->merge_mrb.num_reqs) {
+        trace_virtio_blk_flush_merge_window(s, s->merge_mrb.num_reqs);
+        blk_io_plug(s->blk);
+        virtio_blk_submit_multireq(s->blk, &s->merge_mrb);
+        blk_io_unplug(s->blk);
+    }
+}
+
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    virtio_blk_flush_merge_window(opaque);
+}
+
+static void virtio_blk_merge_attach_aio_context(AioContext *new_context,
+                                                void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    s->merge_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME, SCALE_US,
+                                   virtio_blk_merge_timer_cb, s);
+    if (s->merge_mrb.num_reqs) {
+        timer_mod(s->merge_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                  s->conf.merge_window_us);
+    }
+}
+
+static void virtio_blk_merge_detach_aio_context(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    /* Anything still pending is resubmitted from the new context */
+    timer_del(s->merge_timer);
+    timer_free(s->merge_timer);
+    s->merge_timer = NULL;
+}
+
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = &local_mrb;
+    unsigned int i, n;
+
+    /* With a merge window, reads and writes from all queues collect in one
+     * buffer that is submitted when it fills up, when the I/O direction
+     * changes, or at the latest merge_window_us after the oldest request
+     * arrived.
+     */
+    if (s->merge_timer) {
+        mrb = &s->merge_mrb;
+    }
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s, vq))) {
-        virtio_blk_handle_request(req, &mrb);
-    }
+    do {
+        n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                                ARRAY_SIZE(reqs));
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            virtio_blk_handle_request(reqs[i], mrb);
+        }
+    } while (n == ARRAY_SIZE(reqs));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (mrb == &local_mrb) {
+        if (mrb->num_reqs) {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
+    } else if (mrb->num_reqs && !timer_pending(s->merge_timer)) {
+        timer_mod(s->merge_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                  s->conf.merge_window_us);
     }
 
     blk_io_unplug(s->blk);
@@ -640,6 +695,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtIOBlock *s = opaque;
 
     if (!running) {
+        AioContext *ctx = blk_get_aio_context(s->conf.conf.blk);
+
+        /* Requests held back by the merge window must reach the block
+         * layer before it is drained.
+         */
+        aio_context_acquire(ctx);
+        virtio_blk_flush_merge_window(s);
+        aio_context_release(ctx);
         return;
     }
 
@@ -658,6 +721,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -822,7 +886,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -856,7 +920,7 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
             }
         }
 
-        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
+        req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
         virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
@@ -896,6 +960,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (conf->merge_window_us && !conf->request_merging) {
+        error_setg(errp, "merge-window-us requires request-merging");
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     blkconf_apply_backend_options(&conf->conf);
@@ -924,6 +992,13 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (conf->merge_window_us) {
+        virtio_blk_merge_attach_aio_context(blk_get_aio_context(s->blk), s);
+        blk_add_aio_context_notifier(s->blk,
+                                     virtio_blk_merge_attach_aio_context,
+                                     virtio_blk_merge_detach_aio_context, s);
+    }
+
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
     blk_set_guest_block_size(s->blk, s->conf.conf.logical_block_size);
@@ -939,6 +1014,14 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
+    if (s->merge_timer) {
+        virtio_blk_flush_merge_window(s);
+        blk_remove_aio_context_notifier(s->blk,
+                                        virtio_blk_merge_attach_aio_context,
+                                        virtio_blk_merge_detach_aio_context,
+                                        s);
+        virtio_blk_merge_detach_aio_context(s);
+    }
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
 }
@@ -970,6 +1053,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us, 0),
+    DEFINE_PROP_STRING("vq-iothreads", VirtIOBlock, conf.vq_iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -19,6 +19,7 @@
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 
 static char *machine_get_accel(Object *obj, Error **errp)
 {
@@ -100,6 +101,37 @@ static void machine_set_kvm_shadow_mem(Object *obj, Visitor *v,
     ms->kvm_shadow_mem = value;
 }
 
+static void machine_get_xen_mapcache_bucket(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint64_t value = ms->xen_mapcache_bucket;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void machine_set_xen_mapcache_bucket(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    uint64_t value;
+
+    visit_type_size(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value && !is_power_of_2(value)) {
+        error_setg(errp, "xen-mapcache-bucket must be a power of two");
+        return;
+    }
+
+    ms->xen_mapcache_bucket = value;
+}
+
 static char *machine_get_kernel(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -476,6 +508,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "igd-passthru",
                                     "Set on/off to enable/disable igd passthrou",
                                     NULL);
+    object_property_add(obj, "xen-mapcache-bucket", "size",
+                        machine_get_xen_mapcache_bucket,
+                        machine_set_xen_mapcache_bucket,
+                        NULL, NULL, NULL);
+    object_property_set_description(obj, "xen-mapcache-bucket",
+                                    "Size of a Xen map cache bucket in bytes",
+                                    NULL);
     object_property_add_str(obj, "firmware",
                             machine_get_firmware,
                             machine_set_firmware, NULL);
@@ -2902,6 +2902,8 @@ static void cirrus_init_common(CirrusVGAState *s, Object *owner,
 
     memory_region_init_io(&s->low_mem, owner, &cirrus_vga_mem_ops, s,
                           "cirrus-low-memory", 0x20000);
+    /* Like vga-lowmem: register changes go through regions that flush */
+    memory_region_set_coalescing(&s->low_mem);
     memory_region_add_subregion(&s->low_mem_container, 0, &s->low_mem);
     for (i = 0; i < 2; ++i) {
         static const char *names[] = { "vga.bank0", "vga.bank1" };
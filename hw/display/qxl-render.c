@@ -130,6 +130,8 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                 (qxl->guest_primary.surface.width,
                  qxl->guest_primary.surface.height);
         }
+        /* updates are the areas spice-server rendered, see qxl_blit() */
+        surface->flags |= QEMU_EXACT_DAMAGE_FLAG;
         dpy_gfx_replace_surface(vga->con, surface);
     }
 
@@ -597,6 +597,8 @@ static void virtio_gpu_set_scanout(VirtIOGPU *g,
             cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
             return;
         }
+        /* the scanout only changes on RESOURCE_FLUSH, for the flushed rect */
+        scanout->ds->flags |= QEMU_EXACT_DAMAGE_FLAG;
         dpy_gfx_replace_surface(g->scanout[ss.scanout_id].con, scanout->ds);
     }
 
@@ -1093,6 +1095,7 @@ static int virtio_gpu_load(QEMUFile *f, void *opaque, size_t size)
         if (!scanout->ds) {
             return -EINVAL;
         }
+        scanout->ds->flags |= QEMU_EXACT_DAMAGE_FLAG;
 
         dpy_gfx_replace_surface(scanout->con, scanout->ds);
         dpy_gfx_update(scanout->con, 0, 0, scanout->width, scanout->height);
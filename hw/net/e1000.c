@@ -1535,18 +1535,15 @@ static const uint16_t e1000_eeprom_template[64] = {
 static void
 e1000_mmio_setup(E1000State *d)
 {
-    int i;
-    const uint32_t excluded_regs[] = {
+    static const hwaddr excluded_regs[] = {
         E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
-        E1000_IMC, E1000_TCTL, E1000_TDT, PNPMMIO_SIZE
+        E1000_IMC, E1000_TCTL, E1000_TDT
     };
 
     memory_region_init_io(&d->mmio, OBJECT(d), &e1000_mmio_ops, d,
                           "e1000-mmio", PNPMMIO_SIZE);
-    memory_region_add_coalescing(&d->mmio, 0, excluded_regs[0]);
-    for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
-        memory_region_add_coalescing(&d->mmio, excluded_regs[i] + 4,
-                                     excluded_regs[i+1] - excluded_regs[i] - 4);
+    memory_region_set_coalescing_except(&d->mmio, excluded_regs,
+                                        ARRAY_SIZE(excluded_regs), 4);
     memory_region_init_io(&d->io, OBJECT(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -88,6 +88,16 @@ typedef struct E1000EState {
 #define E1000E_MSIX_TABLE   (0x0000)
 #define E1000E_MSIX_PBA     (0x2000)
 
+/*
+ * Registers whose writes raise or unmask interrupts or start transmission
+ * trap immediately; everything else (descriptor ring setup, RX tails,
+ * filters, ...) is write-combined by KVM until the next trapping access.
+ */
+static const hwaddr e1000e_uncoalesced_regs[] = {
+    E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
+    E1000_IMC, E1000_TCTL, E1000_TDT, E1000_TDT1
+};
+
 static uint64_t
 e1000e_mmio_read(void *opaque, hwaddr addr, unsigned size)
 {
@@ -430,6 +440,9 @@ static void e1000e_pci_realize(PCIDevice *pci_dev, Error **errp)
     /* Define IO/MMIO regions */
     memory_region_init_io(&s->mmio, OBJECT(s), &mmio_ops, s,
                           "e1000e-mmio", E1000E_MMIO_SIZE);
+    memory_region_set_coalescing_except(&s->mmio, e1000e_uncoalesced_regs,
+                                        ARRAY_SIZE(e1000e_uncoalesced_regs),
+                                        4);
     pci_register_bar(pci_dev, E1000E_MMIO_IDX,
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio);
 
@@ -444,6 +457,8 @@ static void e1000e_pci_realize(PCIDevice *pci_dev, Error **errp)
 
     memory_region_init_io(&s->io, OBJECT(s), &io_ops, s,
                           "e1000e-io", E1000E_IO_SIZE);
+    /* IOADDR/IODATA reach the same registers as the MMIO BAR */
+    memory_region_set_flush_coalesced(&s->io);
     pci_register_bar(pci_dev, E1000E_IO_IDX,
                      PCI_BASE_ADDRESS_SPACE_IO, &s->io);
 
@@ -51,6 +51,7 @@
 #define E1000E_MIN_XITR     (500) /* No more then 7813 interrupts per
                                      second according to spec 10.2.4.2 */
 #define E1000E_MAX_TX_FRAGS (64)
+#define E1000E_TX_DESC_BATCH (16) /* TX descriptors fetched per DMA read */
 
 static void
 e1000e_set_interrupt_cause(E1000ECore *core, uint32_t val);
@@ -155,6 +156,7 @@ e1000e_intrmgr_on_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_interrupts();
         return;
     }
+    timer->core->itr_intr_pending = false;
 
     if (msi_enabled(timer->core->owner)) {
         trace_e1000e_irq_msi_notify_postponed();
@@ -179,6 +181,10 @@ e1000e_intrmgr_on_msix_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_vec(idx);
         return;
     }
+    timer->core->eitr_intr_pending[idx] = false;
+
+    /* The postponed interrupt starts a new throttling interval */
+    e1000e_intrmgr_rearm_timer(timer);
 
     trace_e1000e_irq_msix_notify_postponed_vec(idx);
     msix_notify(timer->core->owner, idx);
@@ -834,6 +840,19 @@ e1000e_ring_advance(E1000ECore *core, const E1000E_RingInfo *r, uint32_t count)
     }
 }
 
+/* Number of descriptors from head up to tail or the end of the ring */
+static inline uint32_t
+e1000e_ring_contig_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
+{
+    uint32_t ring_size = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] <= core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+
+    return core->mac[r->dh] < ring_size ? ring_size - core->mac[r->dh] : 1;
+}
+
 static inline uint32_t
 e1000e_ring_free_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
 {
@@ -911,10 +930,11 @@ static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000E_TX_DESC_BATCH];
     bool ide = false;
     const E1000E_RingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
+    uint32_t i, num;
 
     if (!(core->mac[TCTL] & E1000_TCTL_EN)) {
         trace_e1000e_tx_disabled();
@@ -924,15 +944,22 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
     while (!e1000e_ring_empty(core, txi)) {
         base = e1000e_ring_head_descr(core, txi);
 
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
+        /* Fetch the descriptors up to the tail or the end of the ring at
+         * once, they are owned by the device until written back.
+         */
+        num = MIN(e1000e_ring_contig_descr_num(core, txi), ARRAY_SIZE(desc));
+        pci_dma_read(core->owner, base, desc, num * sizeof(desc[0]));
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
+        for (i = 0; i < num; i++) {
+            trace_e1000e_tx_descr((void *)(intptr_t)desc[i].buffer_addr,
+                                  desc[i].lower.data, desc[i].upper.data);
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+            e1000e_process_tx_desc(core, txr->tx, &desc[i], txi->idx);
+            cause |= e1000e_txdesc_writeback(core, base + i * sizeof(desc[0]),
+                                             &desc[i], &ide, txi->idx);
 
-        e1000e_ring_advance(core, txi, 1);
+            e1000e_ring_advance(core, txi, 1);
+        }
     }
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
@@ -17,6 +17,7 @@
 #include "qemu/osdep.h"
 #include "net/eth.h"
 #include "qemu/iov.h"
+#include "qemu/queue.h"
 #include "qemu/timer.h"
 #include "qmp-commands.h"
 
@@ -34,6 +35,7 @@ static const MACAddr ff_mac =   { .a = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
 typedef struct of_dpa {
     World *world;
     GHashTable *flow_tbl;
+    GHashTable *flow_idx;
     GHashTable *group_tbl;
     unsigned int flow_tbl_max_size;
     unsigned int group_tbl_max_size;
@@ -121,6 +123,26 @@ typedef struct of_dpa_flow_action {
     } apply;
 } OfDpaFlowAction;
 
+/* Flows of one table sharing a mask, hashed on their masked key.  This is
+ * OVS's tuple space search: a packet costs one hash lookup per distinct
+ * mask in the table rather than one comparison per flow.
+ */
+typedef struct of_dpa_flow_subtbl {
+    struct of_dpa_flow_tbl *tbl;
+    OfDpaFlowKey mask;
+    int width;                       /* key width of the flows, in u64s */
+    GHashTable *flows;               /* masked key -> best flow */
+    unsigned int count;
+    uint32_t max_priority;           /* upper bound over the flows */
+    QTAILQ_ENTRY(of_dpa_flow_subtbl) next;
+} OfDpaFlowSubtbl;
+
+typedef struct of_dpa_flow_tbl {
+    uint32_t tbl_id;
+    /* sorted by max_priority, highest first */
+    QTAILQ_HEAD(, of_dpa_flow_subtbl) subtbls;
+} OfDpaFlowTbl;
+
 typedef struct of_dpa_flow {
     uint32_t lpm;
     uint32_t priority;
@@ -130,6 +152,9 @@ typedef struct of_dpa_flow {
     OfDpaFlowKey key;
     OfDpaFlowKey mask;
     OfDpaFlowAction action;
+    OfDpaFlowKey idx_key;            /* key & mask, as hashed in subtbl */
+    OfDpaFlowSubtbl *subtbl;
+    struct of_dpa_flow *idx_next;    /* same idx_key, not better */
     struct {
         uint64_t hits;
         int64_t install_time;
@@ -303,44 +328,207 @@ static void of_dpa_flow_key_dump(OfDpaFlowKey *key, OfDpaFlowKey *mask)
 #define of_dpa_flow_key_dump(k, m)
 #endif
 
-static void _of_dpa_flow_match(void *key, void *value, void *user_data)
+static bool of_dpa_flow_better(OfDpaFlow *flow, OfDpaFlow *than)
+{
+    return !than || flow->priority > than->priority ||
+           (flow->priority == than->priority && flow->lpm > than->lpm);
+}
+
+static void of_dpa_flow_key_mask(OfDpaFlowKey *dst, OfDpaFlowKey *key,
+                                 OfDpaFlowKey *mask, int width)
 {
-    OfDpaFlow *flow = value;
-    OfDpaFlowMatch *match = user_data;
-    uint64_t *k = (uint64_t *)&flow->key;
-    uint64_t *m = (uint64_t *)&flow->mask;
-    uint64_t *v = (uint64_t *)&match->value;
+    uint64_t *d = (uint64_t *)dst;
+    uint64_t *k = (uint64_t *)key;
+    uint64_t *m = (uint64_t *)mask;
     int i;
 
-    if (flow->key.tbl_id == match->value.tbl_id) {
-        of_dpa_flow_key_dump(&flow->key, &flow->mask);
+    for (i = 0; i < width; i++) {
+        d[i] = k[i] & m[i];
     }
+    dst->width = width;
+}
 
-    if (flow->key.width > match->value.width) {
-        return;
+static guint of_dpa_flow_key_hash(gconstpointer v)
+{
+    const OfDpaFlowKey *key = v;
+    const uint64_t *k = v;
+    uint64_t h = key->width;
+    int i;
+
+    for (i = 0; i < key->width; i++) {
+        h = (h ^ k[i]) * 0x100000001b3ULL;
     }
 
-    for (i = 0; i < flow->key.width; i++, k++, m++, v++) {
-        if ((~*k & *m & *v) | (*k & *m & ~*v)) {
+    return h ^ (h >> 32);
+}
+
+static gboolean of_dpa_flow_key_equal(gconstpointer v1, gconstpointer v2)
+{
+    const OfDpaFlowKey *key1 = v1;
+    const OfDpaFlowKey *key2 = v2;
+
+    return key1->width == key2->width &&
+           !memcmp(key1, key2, key1->width * sizeof(uint64_t));
+}
+
+static void of_dpa_flow_tbl_free(gpointer data)
+{
+    OfDpaFlowTbl *tbl = data;
+    OfDpaFlowSubtbl *subtbl, *next;
+
+    QTAILQ_FOREACH_SAFE(subtbl, &tbl->subtbls, next, next) {
+        g_hash_table_destroy(subtbl->flows);
+        g_free(subtbl);
+    }
+    g_free(tbl);
+}
+
+static void of_dpa_flow_subtbl_insert(OfDpaFlowTbl *tbl,
+                                      OfDpaFlowSubtbl *subtbl)
+{
+    OfDpaFlowSubtbl *pos;
+
+    QTAILQ_FOREACH(pos, &tbl->subtbls, next) {
+        if (pos->max_priority < subtbl->max_priority) {
+            QTAILQ_INSERT_BEFORE(pos, subtbl, next);
             return;
         }
     }
+    QTAILQ_INSERT_TAIL(&tbl->subtbls, subtbl, next);
+}
+
+static OfDpaFlowSubtbl *of_dpa_flow_subtbl_get(OfDpa *of_dpa, OfDpaFlow *flow)
+{
+    OfDpaFlowTbl *tbl;
+    OfDpaFlowSubtbl *subtbl;
+    int width = flow->key.width;
+
+    tbl = g_hash_table_lookup(of_dpa->flow_idx, &flow->key.tbl_id);
+    if (!tbl) {
+        tbl = g_new0(OfDpaFlowTbl, 1);
+        tbl->tbl_id = flow->key.tbl_id;
+        QTAILQ_INIT(&tbl->subtbls);
+        g_hash_table_insert(of_dpa->flow_idx, &tbl->tbl_id, tbl);
+    }
+
+    QTAILQ_FOREACH(subtbl, &tbl->subtbls, next) {
+        if (subtbl->width == width &&
+            !memcmp(&subtbl->mask, &flow->mask, width * sizeof(uint64_t))) {
+            if (flow->priority > subtbl->max_priority) {
+                QTAILQ_REMOVE(&tbl->subtbls, subtbl, next);
+                subtbl->max_priority = flow->priority;
+                of_dpa_flow_subtbl_insert(tbl, subtbl);
+            }
+            return subtbl;
+        }
+    }
+
+    subtbl = g_new0(OfDpaFlowSubtbl, 1);
+    subtbl->tbl = tbl;
+    subtbl->mask = flow->mask;
+    subtbl->width = width;
+    subtbl->flows = g_hash_table_new(of_dpa_flow_key_hash,
+                                     of_dpa_flow_key_equal);
+    subtbl->max_priority = flow->priority;
+    of_dpa_flow_subtbl_insert(tbl, subtbl);
+
+    return subtbl;
+}
+
+static void of_dpa_flow_index(OfDpa *of_dpa, OfDpaFlow *flow)
+{
+    OfDpaFlowSubtbl *subtbl = of_dpa_flow_subtbl_get(of_dpa, flow);
+    OfDpaFlow *head, *prev;
+
+    of_dpa_flow_key_mask(&flow->idx_key, &flow->key, &subtbl->mask,
+                         subtbl->width);
+
+    /* Keep each bucket sorted so that its head is the one to match */
+    head = g_hash_table_lookup(subtbl->flows, &flow->idx_key);
+    if (of_dpa_flow_better(flow, head)) {
+        flow->idx_next = head;
+        g_hash_table_replace(subtbl->flows, &flow->idx_key, flow);
+    } else {
+        for (prev = head; prev->idx_next; prev = prev->idx_next) {
+            if (of_dpa_flow_better(flow, prev->idx_next)) {
+                break;
+            }
+        }
+        flow->idx_next = prev->idx_next;
+        prev->idx_next = flow;
+    }
 
-    DPRINTF("match\n");
+    flow->subtbl = subtbl;
+    subtbl->count++;
+}
 
-    if (!match->best ||
-        flow->priority > match->best->priority ||
-        flow->lpm > match->best->lpm) {
-        match->best = flow;
+static void of_dpa_flow_unindex(OfDpaFlow *flow)
+{
+    OfDpaFlowSubtbl *subtbl = flow->subtbl;
+    OfDpaFlow *prev;
+
+    if (!subtbl) {
+        return;
+    }
+
+    prev = g_hash_table_lookup(subtbl->flows, &flow->idx_key);
+    if (prev == flow) {
+        if (flow->idx_next) {
+            g_hash_table_replace(subtbl->flows, &flow->idx_next->idx_key,
+                                 flow->idx_next);
+        } else {
+            g_hash_table_remove(subtbl->flows, &flow->idx_key);
+        }
+    } else {
+        while (prev->idx_next != flow) {
+            prev = prev->idx_next;
+        }
+        prev->idx_next = flow->idx_next;
+    }
+
+    flow->subtbl = NULL;
+    flow->idx_next = NULL;
+
+    /* max_priority is left as is: a stale bound only prunes less */
+    if (--subtbl->count == 0) {
+        QTAILQ_REMOVE(&subtbl->tbl->subtbls, subtbl, next);
+        g_hash_table_destroy(subtbl->flows);
+        g_free(subtbl);
     }
 }
 
 static OfDpaFlow *of_dpa_flow_match(OfDpa *of_dpa, OfDpaFlowMatch *match)
 {
+    OfDpaFlowTbl *tbl;
+    OfDpaFlowSubtbl *subtbl;
+    OfDpaFlowKey key;
+    OfDpaFlow *flow;
+
     DPRINTF("\nnew search\n");
     of_dpa_flow_key_dump(&match->value, NULL);
 
-    g_hash_table_foreach(of_dpa->flow_tbl, _of_dpa_flow_match, match);
+    tbl = g_hash_table_lookup(of_dpa->flow_idx, &match->value.tbl_id);
+    if (!tbl) {
+        return match->best;
+    }
+
+    QTAILQ_FOREACH(subtbl, &tbl->subtbls, next) {
+        if (match->best && subtbl->max_priority < match->best->priority) {
+            break;
+        }
+        if (subtbl->width > match->value.width) {
+            continue;
+        }
+
+        of_dpa_flow_key_mask(&key, &match->value, &subtbl->mask,
+                             subtbl->width);
+        flow = g_hash_table_lookup(subtbl->flows, &key);
+        if (flow && of_dpa_flow_better(flow, match->best)) {
+            of_dpa_flow_key_dump(&flow->key, &flow->mask);
+            DPRINTF("match\n");
+            match->best = flow;
+        }
+    }
 
     return match->best;
 }
@@ -353,12 +541,14 @@ static OfDpaFlow *of_dpa_flow_find(OfDpa *of_dpa, uint64_t cookie)
 static int of_dpa_flow_add(OfDpa *of_dpa, OfDpaFlow *flow)
 {
     g_hash_table_insert(of_dpa->flow_tbl, &flow->cookie, flow);
+    of_dpa_flow_index(of_dpa, flow);
 
     return ROCKER_OK;
 }
 
 static void of_dpa_flow_del(OfDpa *of_dpa, OfDpaFlow *flow)
 {
+    of_dpa_flow_unindex(flow);
     g_hash_table_remove(of_dpa->flow_tbl, &flow->cookie);
 }
 
@@ -1884,12 +2074,18 @@ static int of_dpa_cmd_flow_mod(OfDpa *of_dpa, uint64_t cookie,
                                RockerTlv **flow_tlvs)
 {
     OfDpaFlow *flow = of_dpa_flow_find(of_dpa, cookie);
+    int err;
 
     if (!flow) {
         return -ROCKER_ENOENT;
     }
 
-    return of_dpa_cmd_flow_add_mod(of_dpa, flow, flow_tlvs);
+    /* The key, mask and priority may all change */
+    of_dpa_flow_unindex(flow);
+    err = of_dpa_cmd_flow_add_mod(of_dpa, flow, flow_tlvs);
+    of_dpa_flow_index(of_dpa, flow);
+
+    return err;
 }
 
 static int of_dpa_cmd_flow_del(OfDpa *of_dpa, uint64_t cookie)
@@ -2279,6 +2475,9 @@ static int of_dpa_init(World *world)
         return -ENOMEM;
     }
 
+    of_dpa->flow_idx = g_hash_table_new_full(g_int_hash, g_int_equal,
+                                             NULL, of_dpa_flow_tbl_free);
+
     of_dpa->group_tbl = g_hash_table_new_full(g_int_hash, g_int_equal,
                                               NULL, g_free);
     if (!of_dpa->group_tbl) {
@@ -2292,6 +2491,7 @@ static int of_dpa_init(World *world)
     return 0;
 
 err_group_tbl:
+    g_hash_table_destroy(of_dpa->flow_idx);
     g_hash_table_destroy(of_dpa->flow_tbl);
     return -ENOMEM;
 }
@@ -2301,6 +2501,7 @@ static void of_dpa_uninit(World *world)
     OfDpa *of_dpa = world_private(world);
 
     g_hash_table_destroy(of_dpa->group_tbl);
+    g_hash_table_destroy(of_dpa->flow_idx);
     g_hash_table_destroy(of_dpa->flow_tbl);
 }
 
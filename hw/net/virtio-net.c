@@ -31,6 +31,15 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* previously fixed value */
+#define VIRTIO_NET_QUEUE_DEFAULT_SIZE 256
+
+/* for now, only allow larger queues; with virtio-1, guest can downsize */
+#define VIRTIO_NET_QUEUE_MIN_SIZE VIRTIO_NET_QUEUE_DEFAULT_SIZE
+
+/* Packets handed to a receive_batch capable peer at once */
+#define VIRTIO_NET_TX_BATCH 64
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -1089,7 +1098,14 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Packets up to this size are made contiguous when they arrive scattered */
+#define VIRTIO_NET_RX_LINEAR_MAX 2048
+
+/* Bytes past the vnet header that receive_filter() looks at */
+#define VIRTIO_NET_RX_FILTER_LEN 64
+
+static ssize_t virtio_net_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1098,6 +1114,11 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t linear[VIRTIO_NET_RX_LINEAR_MAX];
+    struct iovec linear_iov;
+    IOVCursor src, dst;
+    uint8_t *buf;
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
@@ -1108,9 +1129,32 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return 0;
     }
 
+    /*
+     * The headers must be contiguous for receive_filter() and
+     * receive_header(); the payload is copied straight from iov.  Small
+     * scattered packets are flattened so that work_around_broken_dhclient()
+     * can fix up their checksum, larger ones are never touched by it.
+     */
+    if (iovcnt == 1) {
+        buf = iov[0].iov_base;
+    } else if (size <= sizeof(linear)) {
+        iov_to_buf(iov, iovcnt, 0, linear, size);
+        linear_iov.iov_base = linear;
+        linear_iov.iov_len = size;
+        iov = &linear_iov;
+        iovcnt = 1;
+        buf = linear;
+    } else {
+        iov_to_buf(iov, iovcnt, 0, linear,
+                   n->host_hdr_len + VIRTIO_NET_RX_FILTER_LEN);
+        buf = linear;
+    }
+
     if (!receive_filter(n, buf, size))
         return size;
 
+    /* The packet is consumed in order across all the guest buffers */
+    iov_cursor_init(&src, iov, iovcnt);
     offset = i = 0;
 
     while (offset < size) {
@@ -1141,15 +1185,28 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
 
         sg = elem->in_sg;
         if (i == 0) {
+            bool single = false;
+
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
-                mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem->in_num,
-                                    offsetof(typeof(mhdr), num_buffers),
-                                    sizeof(mhdr.num_buffers));
+                /* Common case: the whole packet fits into one buffer */
+                single = iov_size(sg, elem->in_num) >=
+                         size + n->guest_hdr_len - n->host_hdr_len;
+                if (!single) {
+                    mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
+                                        sg, elem->in_num,
+                                        offsetof(typeof(mhdr), num_buffers),
+                                        sizeof(mhdr.num_buffers));
+                }
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (single) {
+                virtio_stw_p(vdev, &mhdr.num_buffers, 1);
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(typeof(mhdr), num_buffers),
+                             &mhdr.num_buffers, sizeof(mhdr.num_buffers));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1158,8 +1215,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem->in_num, guest_offset,
-                           buf + offset, size - offset);
+        iov_cursor_init(&dst, sg, elem->in_num);
+        len = iov_cursor_copy(&dst, guest_offset, &src, offset, size - offset);
         total += len;
         offset += len;
         /* If buffers can't be merged, at this point we
@@ -1172,7 +1229,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
         g_free(elem);
     }
 
@@ -1183,12 +1240,47 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
+    if (q->rx_burst) {
+        q->rx_pending += i;
+        return size;
+    }
+
     virtqueue_flush(q->rx_vq, i);
     virtio_notify(vdev, q->rx_vq);
 
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return virtio_net_receive_iov(nc, &iov, 1);
+}
+
+/* Packets received during a burst are flushed and notified at its end */
+static void virtio_net_burst(NetClientState *nc, bool begin)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (begin) {
+        q->rx_burst++;
+        return;
+    }
+
+    assert(q->rx_burst);
+    if (--q->rx_burst == 0 && q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        q->rx_pending = 0;
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1207,6 +1299,157 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtio_net_flush_tx(q);
 }
 
+/* Sends the packet in elem.  Returns -EBUSY if the peer queued it, in
+ * which case elem is owned by q->async_tx until virtio_net_tx_complete().
+ */
+static int virtio_net_tx_elem(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        exit(1);
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                goto drop;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    if (ret == 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        q->async_tx.elem = elem;
+        return -EBUSY;
+    }
+
+drop:
+    virtqueue_push(q->tx_vq, elem, 0);
+    virtio_notify(vdev, q->tx_vq);
+    g_free(elem);
+    return 0;
+}
+
+/* Packets can go to the peer as they sit in guest memory */
+static bool virtio_net_can_batch_tx(VirtIONet *n, NetClientState *nc)
+{
+    return nc->peer && nc->peer->info->receive_batch &&
+           n->host_hdr_len == n->guest_hdr_len &&
+           !(n->has_vnet_hdr && n->needs_vnet_hdr_swap);
+}
+
+/*
+ * Pops up to VIRTIO_NET_TX_BATCH packets at a time and hands them to the
+ * peer in one go.  Whatever the peer does not take is sent the ordinary
+ * way, which also takes care of queueing it.
+ */
+static int32_t virtio_net_flush_tx_batch(VirtIONetQueue *q,
+                                         NetClientState *nc)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    const struct iovec *iovs[VIRTIO_NET_TX_BATCH];
+    int iovcnts[VIRTIO_NET_TX_BATCH];
+    int32_t num_packets = 0;
+    unsigned int i, j, max, count;
+    int sent;
+
+    while (num_packets < n->tx_burst) {
+        max = MIN(ARRAY_SIZE(elems), n->tx_burst - num_packets);
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems, max);
+        if (!count) {
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            VirtQueueElement *elem = elems[i];
+
+            if (elem->out_num < 1) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
+            if (n->has_vnet_hdr &&
+                iov_size(elem->out_sg, elem->out_num) < n->guest_hdr_len) {
+                error_report("virtio-net header incorrect");
+                exit(1);
+            }
+            iovs[i] = elem->out_sg;
+            iovcnts[i] = elem->out_num;
+        }
+
+        sent = qemu_sendv_packet_batch(nc, iovs, iovcnts, count);
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, elems[i], 0, i);
+            g_free(elems[i]);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_notify(vdev, q->tx_vq);
+            num_packets += sent;
+        }
+
+        for (i = sent; i < count; i++) {
+            if (virtio_net_tx_elem(q, elems[i]) == -EBUSY) {
+                /* Give the rest back to the ring until the peer drains */
+                for (j = count; j-- > i + 1; ) {
+                    virtqueue_discard(q->tx_vq, elems[j], 0);
+                    g_free(elems[j]);
+                }
+                return -EBUSY;
+            }
+            num_packets++;
+        }
+
+        if (count < max) {
+            break;
+        }
+    }
+    return num_packets;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
@@ -1215,6 +1458,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtQueueElement *elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1224,74 +1469,20 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    if (virtio_net_can_batch_tx(n, nc)) {
+        return virtio_net_flush_tx_batch(q, nc);
+    }
 
+    for (;;) {
         elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
         if (!elem) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
-
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
-                exit(1);
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+        if (virtio_net_tx_elem(q, elem) == -EBUSY) {
             return -EBUSY;
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
         if (++num_packets >= n->tx_burst) {
             break;
         }
@@ -1412,16 +1603,19 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    n->vqs[index].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
+    n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
+                                           virtio_net_handle_rx);
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
+            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                             virtio_net_handle_tx_timer);
         n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                               virtio_net_tx_timer,
                                               &n->vqs[index]);
     } else {
         n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
+            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                             virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
@@ -1662,6 +1856,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov = virtio_net_receive_iov,
+    .burst = virtio_net_burst,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1720,6 +1916,32 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
+    /*
+     * We set a lower limit on the queue sizes to the old hardcoded value,
+     * so that guests never see less room than they used to.  The upper
+     * limit is what the virtio core supports; it must be a power of 2.
+     */
+    if (n->net_conf.rx_queue_size < VIRTIO_NET_QUEUE_MIN_SIZE ||
+        n->net_conf.rx_queue_size > VIRTQUEUE_MAX_SIZE ||
+        !is_power_of_2(n->net_conf.rx_queue_size)) {
+        error_setg(errp, "Invalid rx_queue_size (= %" PRIu16 "), "
+                   "must be a power of 2 between %d and %d.",
+                   n->net_conf.rx_queue_size, VIRTIO_NET_QUEUE_MIN_SIZE,
+                   VIRTQUEUE_MAX_SIZE);
+        virtio_cleanup(vdev);
+        return;
+    }
+    if (n->net_conf.tx_queue_size < VIRTIO_NET_QUEUE_MIN_SIZE ||
+        n->net_conf.tx_queue_size > VIRTQUEUE_MAX_SIZE ||
+        !is_power_of_2(n->net_conf.tx_queue_size)) {
+        error_setg(errp, "Invalid tx_queue_size (= %" PRIu16 "), "
+                   "must be a power of 2 between %d and %d.",
+                   n->net_conf.tx_queue_size, VIRTIO_NET_QUEUE_MIN_SIZE,
+                   VIRTQUEUE_MAX_SIZE);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
@@ -1880,6 +2102,10 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
+                       VIRTIO_NET_QUEUE_DEFAULT_SIZE),
+    DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
+                       VIRTIO_NET_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -12,6 +12,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
 #include "sysemu/block-backend.h"
@@ -21,21 +22,48 @@
 #include "hw/virtio/virtio-access.h"
 
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    int i;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->ioeventfd_started) {
-        fprintf(stderr, "virtio-scsi: Failed to set iothread "
+        error_setg(errp, "virtio-scsi: Failed to set iothread "
                    "(transport does not support notifiers)");
-        exit(1);
+        return;
     }
+
+    if (vs->conf.vq_iothreads) {
+        s->vq_iothreads = iothread_parse_list(vs->conf.vq_iothreads,
+                                              &s->num_vq_iothreads, errp);
+        if (!s->vq_iothreads) {
+            return;
+        }
+    }
+
+    s->ctx = iothread_get_aio_context(vs->conf.iothread);
+    s->cmd_vq_ctx = g_new(AioContext *, vs->conf.num_queues);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        s->cmd_vq_ctx[i] = s->num_vq_iothreads ?
+            iothread_get_aio_context(s->vq_iothreads[i % s->num_vq_iothreads]) :
+            s->ctx;
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    iothread_list_free(s->vq_iothreads, s->num_vq_iothreads);
+    s->vq_iothreads = NULL;
+    s->num_vq_iothreads = 0;
+    g_free(s->cmd_vq_ctx);
+    s->cmd_vq_ctx = NULL;
 }
 
 static void virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
@@ -43,8 +71,14 @@ static void virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
 
+    /* Request queues may run in an IOThread of their own; the SCSI devices
+     * and the request state are only touched under s->ctx.  The lock is
+     * recursive, so this is cheap when it is that IOThread.
+     */
+    aio_context_acquire(s->ctx);
     assert(s->ctx && s->dataplane_started);
     virtio_scsi_handle_cmd_vq(s, vq);
+    aio_context_release(s->ctx);
 }
 
 static void virtio_scsi_data_plane_handle_ctrl(VirtIODevice *vdev,
@@ -66,6 +100,7 @@ static void virtio_scsi_data_plane_handle_event(VirtIODevice *vdev,
 }
 
 static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
+                                  AioContext *ctx,
                                   void (*fn)(VirtIODevice *vdev, VirtQueue *vq))
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
@@ -80,7 +115,9 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, fn);
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, fn);
+    aio_context_release(ctx);
     return 0;
 }
 
@@ -91,16 +128,25 @@ void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req)
     }
 }
 
-/* assumes s->ctx held */
+/*
+ * Each AioContext is acquired on its own.  Request queue handlers take
+ * s->ctx while holding their own context, so the caller must not hold it.
+ */
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
+    aio_context_acquire(s->ctx);
     virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, NULL);
     virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, NULL);
+    aio_context_release(s->ctx);
     for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, NULL);
+        AioContext *ctx = s->cmd_vq_ctx[i];
+
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], ctx, NULL);
+        aio_context_release(ctx);
     }
 }
 
@@ -130,32 +176,36 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
         goto fail_guest_notifiers;
     }
 
+    /* Handlers may run as soon as they are attached */
     aio_context_acquire(s->ctx);
-    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0,
+    s->dataplane_starting = false;
+    s->dataplane_started = true;
+    aio_context_release(s->ctx);
+
+    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0, s->ctx,
                                 virtio_scsi_data_plane_handle_ctrl);
     if (rc) {
         goto fail_vrings;
     }
-    rc = virtio_scsi_vring_init(s, vs->event_vq, 1,
+    rc = virtio_scsi_vring_init(s, vs->event_vq, 1, s->ctx,
                                 virtio_scsi_data_plane_handle_event);
     if (rc) {
         goto fail_vrings;
     }
     for (i = 0; i < vs->conf.num_queues; i++) {
         rc = virtio_scsi_vring_init(s, vs->cmd_vqs[i], i + 2,
+                                    s->cmd_vq_ctx[i],
                                     virtio_scsi_data_plane_handle_cmd);
         if (rc) {
             goto fail_vrings;
         }
     }
-
-    s->dataplane_starting = false;
-    s->dataplane_started = true;
-    aio_context_release(s->ctx);
     return;
 
 fail_vrings:
     virtio_scsi_clear_aio(s);
+    aio_context_acquire(s->ctx);
+    blk_drain_all(); /* requests may have started on the queues already up */
     aio_context_release(s->ctx);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
@@ -188,10 +238,10 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
-
     virtio_scsi_clear_aio(s);
 
+    aio_context_acquire(s->ctx);
+
     blk_drain_all(); /* ensure there are no in-flight requests */
 
     aio_context_release(s->ctx);
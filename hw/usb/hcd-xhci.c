@@ -137,9 +137,13 @@
 #define IMAN_IP         (1<<0)
 #define IMAN_IE         (1<<1)
 
+#define IMOD_IMODI_MASK 0xffff      /* interval, in 250ns units */
+
 #define ERDP_EHB        (1<<3)
 
 #define TRB_SIZE 16
+/* TRBs fetched by a single DMA read when walking a ring */
+#define TRB_BATCH 8
 typedef struct XHCITRB {
     uint64_t parameter;
     uint32_t status;
@@ -330,6 +334,11 @@ typedef enum EPType {
 typedef struct XHCIRing {
     dma_addr_t dequeue;
     bool ccs;
+
+    /* TRBs prefetched during the current pass, see xhci_ring_read() */
+    dma_addr_t cache_addr;
+    unsigned int cache_len;
+    uint8_t cache[TRB_BATCH * TRB_SIZE];
 } XHCIRing;
 
 typedef struct XHCIPort {
@@ -423,6 +432,7 @@ typedef struct XHCIEvent {
 } XHCIEvent;
 
 typedef struct XHCIInterrupter {
+    XHCIState *xhci;
     uint32_t iman;
     uint32_t imod;
     uint32_t erstsz;
@@ -441,6 +451,10 @@ typedef struct XHCIInterrupter {
     unsigned int ev_buffer_put;
     unsigned int ev_buffer_get;
 
+    /* interrupt moderation */
+    QEMUTimer *imod_timer;
+    int64_t imod_next;
+
 } XHCIInterrupter;
 
 struct XHCIState {
@@ -786,14 +800,10 @@ static void xhci_msix_update(XHCIState *xhci, int v)
     }
 }
 
-static void xhci_intr_raise(XHCIState *xhci, int v)
+static void xhci_intr_notify(XHCIState *xhci, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
 
-    xhci->intr[v].erdp_low |= ERDP_EHB;
-    xhci->intr[v].iman |= IMAN_IP;
-    xhci->usbsts |= USBSTS_EINT;
-
     if (!(xhci->intr[v].iman & IMAN_IE)) {
         return;
     }
@@ -820,6 +830,47 @@ static void xhci_intr_raise(XHCIState *xhci, int v)
     }
 }
 
+static void xhci_intr_raise(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    uint32_t interval = intr->imod & IMOD_IMODI_MASK;
+    int64_t now;
+
+    intr->erdp_low |= ERDP_EHB;
+    intr->iman |= IMAN_IP;
+    xhci->usbsts |= USBSTS_EINT;
+
+    /* Honour IMOD: within the interval, defer the interrupt to its end so
+     * that every event completed meanwhile shares a single one */
+    if (interval) {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        if (now < intr->imod_next) {
+            if (!timer_pending(intr->imod_timer)) {
+                timer_mod(intr->imod_timer, intr->imod_next);
+            }
+            return;
+        }
+        intr->imod_next = now + interval * 250;
+    }
+
+    xhci_intr_notify(xhci, v);
+}
+
+static void xhci_imod_timer(void *opaque)
+{
+    XHCIInterrupter *intr = opaque;
+    XHCIState *xhci = intr->xhci;
+
+    if (!(intr->iman & IMAN_IP)) {
+        /* the driver has already polled the events */
+        return;
+    }
+
+    intr->imod_next = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                      (intr->imod & IMOD_IMODI_MASK) * 250;
+    xhci_intr_notify(xhci, intr - xhci->intr);
+}
+
 static inline int xhci_running(XHCIState *xhci)
 {
     return !(xhci->usbsts & USBSTS_HCH) && !xhci->intr[0].er_full;
@@ -994,21 +1045,52 @@ static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
 {
     ring->dequeue = base;
     ring->ccs = 1;
+    ring->cache_len = 0;
+}
+
+/* Forget prefetched TRBs.  Called whenever a pass over a ring starts: in
+ * between, the driver may rewrite TRBs it has not handed over yet, or
+ * turn cancelled TDs into no-ops after stopping the endpoint. */
+static inline void xhci_ring_flush(XHCIRing *ring)
+{
+    ring->cache_len = 0;
+}
+
+/* Read the TRB at @addr, whose cycle bit should match @ccs, fetching the
+ * TRBs that follow it in the same batch.  A cached TRB which was not yet
+ * owned by the controller when fetched is read again. */
+static void xhci_ring_read(XHCIState *xhci, XHCIRing *ring, dma_addr_t addr,
+                           bool ccs, XHCITRB *trb)
+{
+    dma_addr_t off = addr - ring->cache_addr;
+
+    if (addr >= ring->cache_addr && off < ring->cache_len) {
+        memcpy(trb, ring->cache + off, TRB_SIZE);
+        if ((le32_to_cpu(trb->control) & TRB_C) == ccs) {
+            goto out;
+        }
+    }
+
+    /* Stay within the 4k page: the segment may end right there */
+    ring->cache_addr = addr;
+    ring->cache_len = MIN(sizeof(ring->cache), 0x1000 - (addr & 0xfff));
+    pci_dma_read(PCI_DEVICE(xhci), addr, ring->cache, ring->cache_len);
+    memcpy(trb, ring->cache, TRB_SIZE);
+
+out:
+    le64_to_cpus(&trb->parameter);
+    le32_to_cpus(&trb->status);
+    le32_to_cpus(&trb->control);
 }
 
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
                                dma_addr_t *addr)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
-
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_ring_read(xhci, ring, ring->dequeue, ring->ccs, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
-        le64_to_cpus(&trb->parameter);
-        le32_to_cpus(&trb->status);
-        le32_to_cpus(&trb->control);
 
         trace_usb_xhci_fetch_trb(ring->dequeue, trb_name(trb),
                                  trb->parameter, trb->status, trb->control);
@@ -1034,9 +1116,8 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, XHCIRing *ring)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
     XHCITRB trb;
     int length = 0;
     dma_addr_t dequeue = ring->dequeue;
@@ -1046,10 +1127,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, dequeue, &trb, TRB_SIZE);
-        le64_to_cpus(&trb.parameter);
-        le32_to_cpus(&trb.status);
-        le32_to_cpus(&trb.control);
+        xhci_ring_read(xhci, ring, dequeue, ccs, &trb);
 
         if ((trb.control & TRB_C) != ccs) {
             return -length;
@@ -2176,6 +2254,7 @@ static void xhci_kick_ep(XHCIState *xhci, unsigned int slotid,
         xhci_set_ep_state(xhci, epctx, NULL, EP_RUNNING);
     }
     assert(ring->dequeue != 0);
+    xhci_ring_flush(ring);
 
     while (1) {
         XHCITransfer *xfer = &epctx->transfers[epctx->next_xfer];
@@ -2711,6 +2790,7 @@ static void xhci_process_commands(XHCIState *xhci)
     }
 
     xhci->crcr_low |= CRCR_CRR;
+    xhci_ring_flush(&xhci->cmd_ring);
 
     while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
         event.ptr = addr;
@@ -2949,6 +3029,9 @@ static void xhci_reset(DeviceState *dev)
         xhci->intr[i].er_full = 0;
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
+
+        timer_del(xhci->intr[i].imod_timer);
+        xhci->intr[i].imod_next = 0;
     }
 
     xhci->mfindex_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
@@ -3636,6 +3719,13 @@ static void usb_xhci_realize(struct PCIDevice *dev, Error **errp)
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
 
+    for (i = 0; i < xhci->numintrs; i++) {
+        xhci->intr[i].xhci = xhci;
+        xhci->intr[i].imod_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                xhci_imod_timer,
+                                                &xhci->intr[i]);
+    }
+
     memory_region_init(&xhci->mem, OBJECT(xhci), "xhci", LEN_REGS);
     memory_region_init_io(&xhci->mem_cap, OBJECT(xhci), &xhci_cap_ops, xhci,
                           "capabilities", LEN_CAP);
@@ -3696,6 +3786,14 @@ static void usb_xhci_exit(PCIDevice *dev)
         xhci->mfwrap_timer = NULL;
     }
 
+    for (i = 0; i < xhci->numintrs; i++) {
+        if (xhci->intr[i].imod_timer) {
+            timer_del(xhci->intr[i].imod_timer);
+            timer_free(xhci->intr[i].imod_timer);
+            xhci->intr[i].imod_timer = NULL;
+        }
+    }
+
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_runtime);
@@ -3770,6 +3868,11 @@ static int usb_xhci_post_load(void *opaque, int version_id)
         } else {
             msix_vector_unuse(pci_dev, intr);
         }
+        if (xhci->intr[intr].iman & IMAN_IP) {
+            /* a moderated interrupt may have been pending */
+            timer_mod(xhci->intr[intr].imod_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        }
     }
 
     return 0;
@@ -18,6 +18,7 @@
 #include "hw/virtio/vhost.h"
 #include "hw/hw.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
@@ -58,6 +59,47 @@ bool vhost_has_free_slot(void)
     return slots_limit > used_memslots;
 }
 
+/* A multiple of the block size that buffer_find_nonzero_offset scans at once */
+#define VHOST_LOG_SCAN_BLOCK 256
+
+/* Return the first non-zero word in [from, to), or to if there is none.  Long
+ * clean stretches, the common case, are skipped with the vectorized
+ * buffer_find_nonzero_offset.  The reads need not be atomic: words that get
+ * dirty meanwhile are picked up on the next sync.
+ */
+static vhost_log_chunk_t *vhost_log_find_dirty(vhost_log_chunk_t *from,
+                                               vhost_log_chunk_t *to)
+{
+    while (from < to) {
+        size_t len = QEMU_ALIGN_DOWN((to - from) * sizeof(*from),
+                                     VHOST_LOG_SCAN_BLOCK);
+
+        if (*from) {
+            return from;
+        }
+        if (len && can_use_buffer_find_nonzero_offset(from, len)) {
+            size_t off = buffer_find_nonzero_offset(from, len);
+
+            if (off) {
+                from += off / sizeof(*from);
+                continue;
+            }
+        }
+        from++;
+    }
+    return to;
+}
+
+static void vhost_section_set_dirty(MemoryRegionSection *section,
+                                    hwaddr addr, hwaddr size)
+{
+    hwaddr section_offset = addr - section->offset_within_address_space;
+
+    memory_region_set_dirty(section->mr,
+                            section_offset + section->offset_within_region,
+                            size);
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -67,9 +109,10 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
 
     uint64_t start = MAX(mfirst, rfirst);
     uint64_t end = MIN(mlast, rlast);
-    vhost_log_chunk_t *from = log + start / VHOST_LOG_CHUNK;
-    vhost_log_chunk_t *to = log + end / VHOST_LOG_CHUNK + 1;
-    uint64_t addr = (start / VHOST_LOG_CHUNK) * VHOST_LOG_CHUNK;
+    vhost_log_chunk_t *first = log + start / VHOST_LOG_CHUNK;
+    vhost_log_chunk_t *last = log + end / VHOST_LOG_CHUNK;
+    vhost_log_chunk_t *from = first;
+    hwaddr run_start = 0, run_size = 0;
 
     if (end < start) {
         return;
@@ -77,29 +120,56 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
-        /* We first check with non-atomic: much cheaper,
-         * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
-            continue;
+    for (;;) {
+        vhost_log_chunk_t mask = ~(vhost_log_chunk_t)0;
+        vhost_log_chunk_t bits;
+        uint64_t addr;
+
+        from = vhost_log_find_dirty(from, last + 1);
+        if (from > last) {
+            break;
+        }
+        addr = (from - log) * VHOST_LOG_CHUNK;
+
+        /* Only take the bits of the pages in [start, end]; the other ones
+         * in the first and last word belong to other sections. */
+        if (from == first) {
+            mask &= mask << (start - addr) / VHOST_LOG_PAGE;
+        }
+        if (from == last) {
+            mask &= mask >> (VHOST_LOG_BITS - 1 -
+                             (end - addr) / VHOST_LOG_PAGE);
         }
         /* Data must be read atomically. We don't really need barrier semantics
          * but it's easier to use atomic_* than roll our own. */
-        log = atomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+        if (mask == ~(vhost_log_chunk_t)0) {
+            bits = atomic_xchg(from, 0);
+        } else {
+            bits = atomic_fetch_and(from, ~mask) & mask;
         }
-        addr += VHOST_LOG_CHUNK;
+
+        /* Mark each run of dirty pages at once rather than page by page */
+        while (bits) {
+            int bit = ctzl(bits);
+            int n = ctzl(~(bits >> bit));
+            hwaddr page_addr = addr + bit * VHOST_LOG_PAGE;
+
+            if (run_size && run_start + run_size == page_addr) {
+                run_size += n * VHOST_LOG_PAGE;
+            } else {
+                if (run_size) {
+                    vhost_section_set_dirty(section, run_start, run_size);
+                }
+                run_start = page_addr;
+                run_size = n * VHOST_LOG_PAGE;
+            }
+            bits = bit + n < VHOST_LOG_BITS ? bits & (~0UL << (bit + n)) : 0;
+        }
+        from++;
+    }
+
+    if (run_size) {
+        vhost_section_set_dirty(section, run_start, run_size);
     }
 }
 
@@ -308,6 +378,78 @@ static void vhost_dev_assign_memory(struct vhost_dev *dev,
     dev->mem->nregions = to;
 }
 
+static int vhost_mem_region_cmp(const void *a, const void *b)
+{
+    const struct vhost_memory_region *ra = a, *rb = b;
+
+    if (ra->guest_phys_addr < rb->guest_phys_addr) {
+        return -1;
+    }
+    return ra->guest_phys_addr > rb->guest_phys_addr;
+}
+
+/* Sort dev->mem by guest address and merge the regions that are contiguous
+ * in both guest and host address space.  vhost_dev_assign_memory only
+ * merges a new range with the regions next to it, so a burst of changes
+ * can leave mergeable fragments behind; this keeps the table, and the
+ * backend memory slots it uses, as small as possible.  It also puts the
+ * table in a canonical form that can be compared with backend_mem.
+ */
+static void vhost_dev_compact_memory(struct vhost_dev *dev)
+{
+    struct vhost_memory_region *regs = dev->mem->regions;
+    int i, to, n = dev->mem->nregions;
+
+    if (n < 2) {
+        return;
+    }
+    qsort(regs, n, sizeof *regs, vhost_mem_region_cmp);
+    for (i = 1, to = 0; i < n; ++i) {
+        struct vhost_memory_region *prev = regs + to, *reg = regs + i;
+
+        if (prev->guest_phys_addr + prev->memory_size == reg->guest_phys_addr &&
+            prev->userspace_addr + prev->memory_size == reg->userspace_addr &&
+            (!dev->vhost_ops->vhost_backend_can_merge ||
+             dev->vhost_ops->vhost_backend_can_merge(dev, prev->userspace_addr,
+                                                     prev->memory_size,
+                                                     reg->userspace_addr,
+                                                     reg->memory_size))) {
+            prev->memory_size += reg->memory_size;
+        } else if (++to != i) {
+            regs[to] = *reg;
+        }
+    }
+    dev->mem->nregions = to + 1;
+    used_memslots = dev->mem->nregions;
+}
+
+static size_t vhost_mem_table_size(struct vhost_memory *mem)
+{
+    return offsetof(struct vhost_memory, regions) +
+        mem->nregions * sizeof mem->regions[0];
+}
+
+/* Send dev->mem to the backend, unless it already has the same table */
+static int vhost_dev_set_mem_table(struct vhost_dev *dev)
+{
+    size_t size = vhost_mem_table_size(dev->mem);
+    int r;
+
+    if (dev->backend_mem && !memcmp(dev->backend_mem, dev->mem, size)) {
+        return 0;
+    }
+
+    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    if (r < 0) {
+        g_free(dev->backend_mem);
+        dev->backend_mem = NULL;
+        return r;
+    }
+    dev->backend_mem = g_realloc(dev->backend_mem, size);
+    memcpy(dev->backend_mem, dev->mem, size);
+    return 0;
+}
+
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
 {
     uint64_t log_size = 0;
@@ -500,12 +642,9 @@ static void vhost_set_memory(MemoryListener *listener,
     ram_addr_t size = int128_get64(section->size);
     bool log_dirty =
         memory_region_get_dirty_log_mask(section->mr) & ~(1 << DIRTY_MEMORY_MIGRATION);
-    int s = offsetof(struct vhost_memory, regions) +
-        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
+    int s;
     void *ram;
 
-    dev->mem = g_realloc(dev->mem, s);
-
     if (log_dirty) {
         add = false;
     }
@@ -526,13 +665,16 @@ static void vhost_set_memory(MemoryListener *listener,
         }
     }
 
+    /* Room for the region that a split can add */
+    s = offsetof(struct vhost_memory, regions) +
+        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
+    dev->mem = g_realloc(dev->mem, s);
+
+    /* Remove old mapping for this memory, if any. */
     vhost_dev_unassign_memory(dev, start_addr, size);
     if (add) {
         /* Add given mapping, merging adjacent regions if any */
         vhost_dev_assign_memory(dev, start_addr, size, (uintptr_t)ram);
-    } else {
-        /* Remove old mapping for this memory, if any. */
-        vhost_dev_unassign_memory(dev, start_addr, size);
     }
     dev->mem_changed_start_addr = MIN(dev->mem_changed_start_addr, start_addr);
     dev->mem_changed_end_addr = MAX(dev->mem_changed_end_addr, start_addr + size - 1);
@@ -565,6 +707,7 @@ static void vhost_commit(MemoryListener *listener)
     if (!dev->memory_changed) {
         return;
     }
+    vhost_dev_compact_memory(dev);
     if (!dev->started) {
         return;
     }
@@ -581,7 +724,7 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+        r = vhost_dev_set_mem_table(dev);
         if (r < 0) {
             VHOST_OPS_DEBUG("vhost_set_mem_table failed");
         }
@@ -596,7 +739,7 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    r = vhost_dev_set_mem_table(dev);
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost_set_mem_table failed");
     }
@@ -945,6 +1088,11 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     r = dev->vhost_ops->vhost_get_vring_base(dev, &state);
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost VQ %d ring restore failed: %d", idx, r);
+        /* The backend went away, e.g. a vhost-user process that crashed or
+         * is being upgraded.  Whatever it had popped but not yet returned
+         * must be made available again, so restart from the used index.
+         */
+        virtio_queue_restore_last_avail_idx(vdev, idx);
     } else {
         virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
@@ -1157,6 +1305,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         error_free(hdev->migration_blocker);
     }
     g_free(hdev->mem);
+    g_free(hdev->backend_mem);
     g_free(hdev->mem_sections);
     if (hdev->vhost_ops) {
         hdev->vhost_ops->vhost_backend_cleanup(hdev);
@@ -1301,7 +1450,10 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = hdev->vhost_ops->vhost_set_mem_table(hdev, hdev->mem);
+    /* The backend may have been reset or replaced since it was stopped */
+    g_free(hdev->backend_mem);
+    hdev->backend_mem = NULL;
+    r = vhost_dev_set_mem_table(hdev);
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost_set_mem_table failed");
         r = -errno;
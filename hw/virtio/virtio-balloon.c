@@ -26,6 +26,7 @@
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
+#include "migration/migration.h"
 
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
@@ -301,6 +302,125 @@ out:
     }
 }
 
+static bool virtio_balloon_free_page_support(VirtIOBalloon *s)
+{
+    return virtio_vdev_has_feature(VIRTIO_DEVICE(s),
+                                   VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+/*
+ * Free page hinting: while a migration runs, the guest allocates its free
+ * pages, reports them as in-buffers on free_page_vq and holds on to them
+ * until free_page_report_cmd_id becomes VIRTIO_BALLOON_CMD_ID_DONE.
+ * Reports are bracketed by out-buffers carrying the command id the guest
+ * is answering and VIRTIO_BALLOON_CMD_ID_STOP once it has scanned all of
+ * its memory.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    bool notify = false;
+    unsigned i;
+
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        if (elem->out_num) {
+            uint32_t id;
+
+            if (iov_to_buf(elem->out_sg, elem->out_num, 0, &id, sizeof(id))
+                == sizeof(id)) {
+                id = virtio_ldl_p(vdev, &id);
+                if (id == s->free_page_report_cmd_id &&
+                    s->free_page_report_status ==
+                    FREE_PAGE_REPORT_S_REQUESTED) {
+                    s->free_page_report_status = FREE_PAGE_REPORT_S_START;
+                } else if (id == VIRTIO_BALLOON_CMD_ID_STOP) {
+                    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+                }
+                trace_virtio_balloon_free_page_cmd(id);
+            }
+        }
+
+        if (s->free_page_report_status == FREE_PAGE_REPORT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        /* nothing was written, so do not dirty the hinted pages */
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        notify = true;
+    }
+
+    if (notify) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    if (s->free_page_report_cmd_id == UINT32_MAX ||
+        s->free_page_report_cmd_id <= VIRTIO_BALLOON_CMD_ID_DONE) {
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+    } else {
+        s->free_page_report_cmd_id++;
+    }
+    s->free_page_report_status = FREE_PAGE_REPORT_S_REQUESTED;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_free_page_done(VirtIOBalloon *s)
+{
+    s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+static void virtio_balloon_migration_state_changed(Notifier *notifier,
+                                                   void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon, migration_state);
+    MigrationState *ms = data;
+
+    if (!virtio_balloon_free_page_support(s)) {
+        return;
+    }
+
+    if (migration_in_setup(ms)) {
+        virtio_balloon_free_page_start(s);
+    } else if (migration_has_finished(ms) || migration_has_failed(ms)) {
+        virtio_balloon_free_page_done(s);
+    }
+}
+
+/* On the destination, give the hinted pages back once the guest runs */
+static void virtio_balloon_vm_state_change(void *opaque, int running,
+                                           RunState state)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (running && s->free_page_done_pending) {
+        s->free_page_done_pending = false;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return sizeof(struct virtio_balloon_config);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_report_cmd_id);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
@@ -308,9 +428,10 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    config.free_page_report_cmd_id = cpu_to_le32(dev->free_page_report_cmd_id);
 
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -354,7 +475,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -417,6 +538,13 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
 
+    if (virtio_balloon_free_page_support(s)) {
+        /* the guest may still hold pages it reported on the source */
+        s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+        s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
+        s->free_page_done_pending = true;
+    }
+
     if (balloon_stats_enabled(s)) {
         balloon_stats_change_timer(s, s->stats_poll_interval);
     }
@@ -430,7 +558,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -445,6 +573,17 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (virtio_has_feature(s->host_features,
+                           VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, 128,
+                                           virtio_balloon_handle_free_page_vq);
+        s->migration_state.notify = virtio_balloon_migration_state_changed;
+        add_migration_state_change_notifier(&s->migration_state);
+        s->vmstate_change =
+            qemu_add_vm_change_state_handler(virtio_balloon_vm_state_change,
+                                             s);
+    }
+
     reset_stats(s);
 }
 
@@ -453,6 +592,10 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->free_page_vq) {
+        remove_migration_state_change_notifier(&s->migration_state);
+        qemu_del_vm_change_state_handler(s->vmstate_change);
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
     virtio_cleanup(vdev);
@@ -466,6 +609,8 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
     }
+    s->free_page_report_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+    s->free_page_report_status = FREE_PAGE_REPORT_S_STOP;
 }
 
 static void virtio_balloon_instance_init(Object *obj)
@@ -486,6 +631,8 @@ VMSTATE_VIRTIO_DEVICE(balloon, 1, virtio_balloon_load, virtio_vmstate_save);
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -20,6 +20,7 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -59,6 +60,25 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completion queued by virtqueue_fill() on a packed ring until flush */
+typedef struct VirtQueuePackedUsed {
+    uint32_t id;
+    uint32_t len;
+    uint32_t ndescs;
+} VirtQueuePackedUsed;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -101,6 +121,20 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* Last guest RAM section a buffer of this queue was mapped from */
+    AddressSpaceMapCache map_cache;
+    /* Interrupt moderation; disabled while coalesce_usecs is zero */
+    uint32_t coalesce_usecs;
+    uint32_t coalesce_frames;
+    uint32_t notify_pending;
+    QEMUTimer *notify_timer;
+    /*
+     * Packed ring only: wrap counters belonging to last_avail_idx and
+     * used_idx, and the completions of the batch being filled.
+     */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+    VirtQueuePackedUsed *used_elems;
     QLIST_ENTRY(VirtQueue) node;
 };
 
@@ -119,17 +153,101 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
                               vring->align);
 }
 
+/* A range of guest memory (a descriptor table or the avail ring) that is
+ * translated once and then accessed through a host pointer.  The pointer
+ * is only valid within the RCU critical section where the cache was set up.
+ * If the range is not directly accessible RAM, ptr is NULL and accesses
+ * go through address_space_read.
+ */
+typedef struct VRingCache {
+    hwaddr pa;
+    hwaddr len;
+    void *ptr;
+} VRingCache;
+
+/* Called within rcu_read_lock().  */
+static void vring_cache_init(VRingCache *cache, hwaddr pa, hwaddr len)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    cache->pa = pa;
+    cache->len = len;
+    cache->ptr = NULL;
+
+    if (!len) {
+        return;
+    }
+
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l, false);
+    if (l == len && memory_access_is_direct(mr, false)) {
+        cache->ptr = qemu_map_ram_ptr(mr->ram_block, xlat);
+    }
+}
+
+static inline void vring_cache_read(VRingCache *cache, hwaddr off,
+                                    void *buf, hwaddr len)
+{
+    if (likely(cache->ptr && off + len <= cache->len)) {
+        memcpy(buf, cache->ptr + off, len);
+    } else {
+        address_space_read(&address_space_memory, cache->pa + off,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+static inline void vring_cache_prefetch(VRingCache *cache, hwaddr off)
+{
+    if (cache->ptr && off < cache->len) {
+        __builtin_prefetch(cache->ptr + off);
+    }
+}
+
 static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
-                            hwaddr desc_pa, int i)
+                            VRingCache *desc_cache, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    vring_cache_read(desc_cache, i * sizeof(VRingDesc), desc,
+                     sizeof(VRingDesc));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static inline bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static uint16_t vring_packed_desc_flags(VirtIODevice *vdev,
+                                        VRingCache *desc_cache, int i)
+{
+    uint16_t flags;
+
+    vring_cache_read(desc_cache, i * sizeof(VRingPackedDesc) +
+                     offsetof(VRingPackedDesc, flags), &flags, sizeof(flags));
+    return virtio_tswap16(vdev, flags);
+}
+
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   VRingCache *desc_cache, int i)
+{
+    vring_cache_read(desc_cache, i * sizeof(VRingPackedDesc), desc,
+                     sizeof(VRingPackedDesc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static inline bool vring_packed_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
@@ -209,10 +327,45 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     virtio_stw_phys(vq->vdev, pa, val);
 }
 
+/* The device event suppression area lives where the used ring would be */
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    uint16_t off_wrap;
+
+    off_wrap = vq->last_avail_idx |
+               vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    virtio_stw_phys(vq->vdev, vq->vring.used +
+                    offsetof(VRingPackedDescEvent, off_wrap), off_wrap);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    uint16_t flags;
+
+    if (!vq->vring.used) {
+        return;
+    }
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Expose the offset before the flags that make it meaningful */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    virtio_stw_phys(vq->vdev, vq->vring.used +
+                    offsetof(VRingPackedDescEvent, flags), flags);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -230,10 +383,29 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    hwaddr pa;
+    uint16_t flags;
+
+    if (!vq->vring.desc) {
+        return 1;
+    }
+
+    pa = vq->vring.desc + vq->last_avail_idx * sizeof(VRingPackedDesc) +
+         offsetof(VRingPackedDesc, flags);
+    flags = virtio_lduw_phys(vq->vdev, pa);
+    return !vring_packed_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_queue_packed(vq)) {
+        return virtio_queue_packed_empty(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -251,27 +423,58 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
 
-        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
-                                  elem->in_sg[i].iov_len,
-                                  1, size);
+        address_space_unmap_cached(&address_space_memory, &vq->map_cache,
+                                   elem->in_sg[i].iov_base,
+                                   elem->in_sg[i].iov_len,
+                                   1, size);
 
         offset += size;
     }
 
     for (i = 0; i < elem->out_num; i++)
-        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
-                                  elem->out_sg[i].iov_len,
-                                  0, elem->out_sg[i].iov_len);
+        address_space_unmap_cached(&address_space_memory, &vq->map_cache,
+                                   elem->out_sg[i].iov_base,
+                                   elem->out_sg[i].iov_len,
+                                   0, elem->out_sg[i].iov_len);
 }
 
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
-    vq->inuse--;
+    if (virtio_queue_packed(vq)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    VirtQueuePackedUsed *used;
+
+    if (idx >= vq->vring.num) {
+        error_report("virtio: too many used buffers in one flush");
+        exit(1);
+    }
+
+    if (!vq->used_elems) {
+        vq->used_elems = g_new(VirtQueuePackedUsed, VIRTQUEUE_MAX_SIZE);
+    }
+
+    used = &vq->used_elems[idx];
+    used->id = elem->index;
+    used->len = len;
+    used->ndescs = elem->ndescs;
+}
+
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
 {
@@ -281,6 +484,11 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -288,9 +496,80 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+static void vring_packed_used_write(VirtQueue *vq, uint16_t i,
+                                    const VirtQueuePackedUsed *used)
+{
+    hwaddr pa = vq->vring.desc + i * sizeof(VRingPackedDesc);
+
+    virtio_stl_phys(vq->vdev, pa + offsetof(VRingPackedDesc, len), used->len);
+    virtio_stw_phys(vq->vdev, pa + offsetof(VRingPackedDesc, id), used->id);
+}
+
+static void vring_packed_used_flags_set(VirtQueue *vq, uint16_t i, bool wrap)
+{
+    hwaddr pa = vq->vring.desc + i * sizeof(VRingPackedDesc);
+    uint16_t flags = 0;
+
+    if (wrap) {
+        flags = 1 << VRING_PACKED_DESC_F_AVAIL | 1 << VRING_PACKED_DESC_F_USED;
+    }
+    virtio_stw_phys(vq->vdev, pa + offsetof(VRingPackedDesc, flags), flags);
+}
+
+/* Each completion takes the slot following the previous buffer's chain, as
+ * the driver expects.  The flags of the first slot are written last so the
+ * guest sees the whole batch at once.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t head = vq->used_idx;
+    bool wrap = vq->used_wrap_counter;
+    unsigned int i, ndescs = 0;
+
+    if (!count || !vq->vring.desc) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        const VirtQueuePackedUsed *used = &vq->used_elems[i];
+
+        vring_packed_used_write(vq, head, used);
+        if (i) {
+            /* Ring entry must be written before the flags publish it. */
+            smp_wmb();
+            vring_packed_used_flags_set(vq, head, wrap);
+        }
+
+        ndescs += used->ndescs;
+        head += used->ndescs;
+        if (head >= vq->vring.num) {
+            head -= vq->vring.num;
+            wrap ^= 1;
+        }
+    }
+
+    /* Publish the head of the batch only after all the other entries */
+    smp_wmb();
+    vring_packed_used_flags_set(vq, vq->used_idx, vq->used_wrap_counter);
+
+    vq->inuse -= ndescs;
+    if (wrap != vq->used_wrap_counter) {
+        vq->signalled_used_valid = false;
+    }
+    vq->used_idx = head;
+    vq->used_wrap_counter = wrap;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_queue_packed(vq)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -328,13 +607,26 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
     return num_heads;
 }
 
-static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
+/* Called within rcu_read_lock().  */
+static void virtqueue_init_caches(VirtQueue *vq, VRingCache *desc_cache,
+                                  VRingCache *avail_cache)
 {
-    unsigned int head;
+    vring_cache_init(desc_cache, vq->vring.desc,
+                     vq->vring.num * sizeof(VRingDesc));
+    vring_cache_init(avail_cache, vq->vring.avail + offsetof(VRingAvail, ring),
+                     vq->vring.num * sizeof(uint16_t));
+}
+
+static unsigned int virtqueue_get_head(VirtQueue *vq, VRingCache *avail_cache,
+                                       unsigned int idx)
+{
+    uint16_t head;
 
     /* Grab the next descriptor number they're advertising, and increment
      * the index we've seen. */
-    head = vring_avail_ring(vq, idx % vq->vring.num);
+    vring_cache_read(avail_cache, (idx % vq->vring.num) * sizeof(head),
+                     &head, sizeof(head));
+    virtio_tswap16s(vq->vdev, &head);
 
     /* If their number is silly, that's a fatal mistake. */
     if (head >= vq->vring.num) {
@@ -346,7 +638,8 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 }
 
 static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
-                                         hwaddr desc_pa, unsigned int max)
+                                         VRingCache *desc_cache,
+                                         unsigned int max)
 {
     unsigned int next;
 
@@ -365,32 +658,125 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vdev, desc, desc_cache, next);
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx, slots, in_total, out_total;
+    bool wrap = vq->last_avail_wrap_counter;
+    VRingCache desc_cache;
+
+    idx = vq->last_avail_idx;
+    slots = in_total = out_total = 0;
+
+    rcu_read_lock();
+    vring_cache_init(&desc_cache, vq->vring.desc,
+                     vq->vring.num * sizeof(VRingPackedDesc));
+
+    while (vq->vring.desc && slots < vq->vring.num &&
+           vring_packed_desc_avail(vring_packed_desc_flags(vdev, &desc_cache,
+                                                           idx), wrap)) {
+        VRingCache indirect_cache, *cache = &desc_cache;
+        unsigned int i = idx, max = vq->vring.num, n = 0;
+        bool indirect = false;
+        VRingPackedDesc desc;
+
+        /* Read the descriptor only after its flags said it is available */
+        smp_rmb();
+        vring_packed_desc_read(vdev, &desc, cache, i);
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            vring_cache_init(&indirect_cache, desc.addr, desc.len);
+            cache = &indirect_cache;
+            i = 0;
+            vring_packed_desc_read(vdev, &desc, cache, i);
+        }
+
+        for (;;) {
+            if (++n > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect ? n == max : !(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num && !indirect) {
+                i = 0;
+            }
+            vring_packed_desc_read(vdev, &desc, cache, i);
+        }
+
+        n = indirect ? 1 : n;
+        slots += n;
+        idx += n;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap ^= 1;
+        }
+    }
+done:
+    rcu_read_unlock();
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
 {
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
+    VRingCache vring_desc_cache, avail_cache;
+
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
 
     idx = vq->last_avail_idx;
 
+    rcu_read_lock();
+    virtqueue_init_caches(vq, &vring_desc_cache, &avail_cache);
+
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingCache indirect_cache, *desc_cache;
         VRingDesc desc;
-        hwaddr desc_pa;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
-        i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        i = virtqueue_get_head(vq, &avail_cache, idx++);
+        desc_cache = &vring_desc_cache;
+        vring_desc_read(vdev, &desc, desc_cache, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -407,9 +793,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             /* loop over the indirect descriptor table */
             indirect = 1;
             max = desc.len / sizeof(VRingDesc);
-            desc_pa = desc.addr;
+            vring_cache_init(&indirect_cache, desc.addr, desc.len);
+            desc_cache = &indirect_cache;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vdev, &desc, desc_cache, i);
         }
 
         do {
@@ -427,7 +814,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                               max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -435,6 +823,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             total_bufs++;
     }
 done:
+    rcu_read_unlock();
     if (in_bytes) {
         *in_bytes = in_total;
     }
@@ -452,7 +841,9 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iovec *iov,
+static void virtqueue_map_desc(AddressSpaceMapCache *cache,
+                               unsigned int *p_num_sg, hwaddr *addr,
+                               struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
 {
@@ -472,7 +863,9 @@ static void virtqueue_map_desc(unsigned int *p_num_sg, hwaddr *addr, struct iove
             exit(1);
         }
 
-        iov[num_sg].iov_base = cpu_physical_memory_map(pa, &len, is_write);
+        iov[num_sg].iov_base = address_space_map_cached(&address_space_memory,
+                                                        cache, pa, &len,
+                                                        is_write);
         iov[num_sg].iov_len = len;
         addr[num_sg] = pa;
 
@@ -542,43 +935,78 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     elem->out_addr = (void *)elem + out_addr_ofs;
     elem->in_sg = (void *)elem + in_sg_ofs;
     elem->out_sg = (void *)elem + out_sg_ofs;
+    elem->ndescs = 0;
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+/* Maps one descriptor of a chain; device-writable buffers must come after
+ * all the device-readable ones.
+ */
+static void virtqueue_map_chain_desc(VirtQueue *vq, unsigned *p_out_num,
+                                     unsigned *p_in_num, hwaddr *addr,
+                                     struct iovec *iov, bool is_write,
+                                     hwaddr pa, size_t sz)
+{
+    if (is_write) {
+        virtqueue_map_desc(&vq->map_cache, p_in_num, addr + *p_out_num,
+                           iov + *p_out_num, VIRTQUEUE_MAX_SIZE - *p_out_num,
+                           true, pa, sz);
+    } else {
+        if (*p_in_num) {
+            error_report("Incorrect order for descriptors");
+            exit(1);
+        }
+        virtqueue_map_desc(&vq->map_cache, p_out_num, addr, iov,
+                           VIRTQUEUE_MAX_SIZE, false, pa, sz);
+    }
+}
+
+/* Copies a mapped chain into a freshly allocated element */
+static VirtQueueElement *virtqueue_chain_to_element(size_t sz,
+                                                    unsigned int index,
+                                                    hwaddr *addr,
+                                                    struct iovec *iov,
+                                                    unsigned out_num,
+                                                    unsigned in_num)
+{
+    VirtQueueElement *elem;
+    unsigned int i;
+
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = index;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+    return elem;
+}
+
+/* Walks the descriptor chain starting at head and maps it into a new
+ * element.  Called within rcu_read_lock().
+ */
+static void *virtqueue_map_head(VirtQueue *vq, size_t sz, unsigned int head,
+                                VRingCache *vring_desc_cache)
 {
-    unsigned int i, head, max;
-    hwaddr desc_pa = vq->vring.desc;
+    unsigned int i, max;
     VirtIODevice *vdev = vq->vdev;
+    VRingCache indirect_cache, *desc_cache = vring_desc_cache;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
 
-    if (virtio_queue_empty(vq)) {
-        return NULL;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
 
     max = vq->vring.num;
 
-    if (vq->inuse >= vq->vring.num) {
-        error_report("Virtqueue size exceeded");
-        exit(1);
-    }
-
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    i = head;
+    vring_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -587,50 +1015,230 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
 
         /* loop over the indirect descriptor table */
         max = desc.len / sizeof(VRingDesc);
-        desc_pa = desc.addr;
+        vring_cache_init(&indirect_cache, desc.addr, desc.len);
+        desc_cache = &indirect_cache;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vdev, &desc, desc_cache, i);
     }
 
     /* Collect all the descriptors */
     do {
-        if (desc.flags & VRING_DESC_F_WRITE) {
-            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
-                               VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
-        } else {
-            if (in_num) {
-                error_report("Incorrect order for descriptors");
-                exit(1);
-            }
-            virtqueue_map_desc(&out_num, addr, iov,
-                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
-        }
+        virtqueue_map_chain_desc(vq, &out_num, &in_num, addr, iov,
+                                 desc.flags & VRING_DESC_F_WRITE,
+                                 desc.addr, desc.len);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_cache,
+                                           max)) != max);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
-    elem->index = head;
-    for (i = 0; i < out_num; i++) {
-        elem->out_addr[i] = addr[i];
-        elem->out_sg[i] = iov[i];
+    elem = virtqueue_chain_to_element(sz, head, addr, iov, out_num, in_num);
+    elem->ndescs = 1;
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+/* In a packed ring a chain occupies consecutive ring slots; its buffer id
+ * is carried by the last one.  An indirect table takes a single slot.
+ */
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingCache desc_cache, indirect_cache, *cache;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num, max, i, ndescs;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_packed_empty(vq)) {
+        return NULL;
     }
-    for (i = 0; i < in_num; i++) {
-        elem->in_addr[i] = addr[out_num + i];
-        elem->in_sg[i] = iov[out_num + i];
+    /* Don't read the descriptor before its flags said it is available */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
     }
 
-    vq->inuse++;
+    rcu_read_lock();
+    vring_cache_init(&desc_cache, vq->vring.desc,
+                     vq->vring.num * sizeof(VRingPackedDesc));
+    cache = &desc_cache;
+
+    out_num = in_num = 0;
+    ndescs = 1;
+    max = vq->vring.num;
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vdev, &desc, cache, i);
+    id = desc.id;
+
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        vring_cache_init(&indirect_cache, desc.addr, desc.len);
+        cache = &indirect_cache;
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, cache, i);
+    }
+
+    for (;;) {
+        virtqueue_map_chain_desc(vq, &out_num, &in_num, addr, iov,
+                                 desc.flags & VRING_DESC_F_WRITE,
+                                 desc.addr, desc.len);
+
+        if (indirect) {
+            /* The table length alone delimits an indirect chain */
+            if (++i == max) {
+                break;
+            }
+        } else {
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++ndescs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vdev, &desc, cache, i);
+        if (!indirect) {
+            id = desc.id;
+        }
+    }
+
+    elem = virtqueue_chain_to_element(sz, id, addr, iov, out_num, in_num);
+    elem->ndescs = ndescs;
+
+    vq->inuse += ndescs;
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    if (vq->notification &&
+        virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+    rcu_read_unlock();
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
     return elem;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    VRingCache desc_cache, avail_cache;
+    VirtQueueElement *elem;
+    unsigned int head;
+
+    if (virtio_queue_packed(vq)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
+    }
+
+    rcu_read_lock();
+    virtqueue_init_caches(vq, &desc_cache, &avail_cache);
+
+    head = virtqueue_get_head(vq, &avail_cache, vq->last_avail_idx++);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    elem = virtqueue_map_head(vq, sz, head, &desc_cache);
+    rcu_read_unlock();
+    return elem;
+}
+
+/* Pops up to max elements in one go.  The avail index is read once, the
+ * descriptor table and avail ring are translated once for the whole batch,
+ * and the avail event is only published after the last head.  Returns the
+ * number of elements stored in elems[], each of which is freed with g_free
+ * like the ones returned by virtqueue_pop().
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    VRingCache desc_cache, avail_cache;
+    unsigned int n, i, head, next;
+
+    if (virtio_queue_packed(vq)) {
+        /* There is no avail index to read once for a packed ring */
+        for (n = 0; n < max; n++) {
+            elems[n] = virtqueue_packed_pop(vq, sz);
+            if (!elems[n]) {
+                break;
+            }
+        }
+        return n;
+    }
+
+    n = MIN(virtqueue_num_heads(vq, vq->last_avail_idx), max);
+    if (!n) {
+        return 0;
+    }
+
+    if (vq->inuse + n > vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
+    }
+
+    rcu_read_lock();
+    virtqueue_init_caches(vq, &desc_cache, &avail_cache);
+
+    head = virtqueue_get_head(vq, &avail_cache, vq->last_avail_idx);
+    for (i = 0; i < n; i++) {
+        vq->last_avail_idx++;
+
+        /* Start fetching the next chain while this one is being mapped */
+        next = 0;
+        if (i + 1 < n) {
+            next = virtqueue_get_head(vq, &avail_cache, vq->last_avail_idx);
+            vring_cache_prefetch(&desc_cache, next * sizeof(VRingDesc));
+        }
+
+        elems[i] = virtqueue_map_head(vq, sz, head, &desc_cache);
+        head = next;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    rcu_read_unlock();
+    return n;
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -648,7 +1256,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -679,11 +1287,17 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
         elem->out_sg[i].iov_len = data.out_sg[i].iov_len;
     }
 
+    /* A packed ring needs the chain length to complete the element */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
+
     virtqueue_map(elem);
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -712,6 +1326,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -822,6 +1440,12 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
+        vdev->vq[i].notify_pending = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        if (vdev->vq[i].notify_timer) {
+            timer_del(vdev->vq[i].notify_timer);
+        }
     }
 }
 
@@ -1162,6 +1786,8 @@ static VirtQueue *virtio_add_queue_internal(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
     vdev->vq[i].use_aio = use_aio;
+    virtio_queue_set_irq_coalesce(&vdev->vq[i], vdev->irq_coalesce_usecs,
+                                  vdev->irq_coalesce_frames);
 
     return &vdev->vq[i];
 }
@@ -1191,6 +1817,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_queue_set_irq_coalesce(&vdev->vq[n], 0, 0);
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1200,12 +1829,57 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+/* The driver event suppression area lives where the avail ring would be */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    uint16_t old, new, flags, off_wrap;
+    bool v;
+
+    flags = virtio_lduw_phys(vdev, vq->vring.avail +
+                             offsetof(VRingPackedDescEvent, flags));
+    off_wrap = virtio_lduw_phys(vdev, vq->vring.avail +
+                                offsetof(VRingPackedDescEvent, off_wrap));
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
     /* We need to expose used array entries before checking used event. */
     smp_mb();
+
+    if (virtio_queue_packed(vq)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     /* Always notify when queue is empty (when feature acknowledge) */
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
         !vq->inuse && virtio_queue_empty(vq)) {
@@ -1223,15 +1897,88 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
+static void virtio_notify_deliver(VirtIODevice *vdev, VirtQueue *vq)
+{
+    vq->notify_pending = 0;
+    trace_virtio_notify(vdev, vq);
+    vdev->isr |= 0x01;
+    virtio_notify_vector(vdev, vq->vector);
+}
+
+static void virtio_queue_notify_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    if (vq->notify_pending) {
+        virtio_notify_deliver(vq->vdev, vq);
+    }
+}
+
+/*
+ * Host-side interrupt moderation, in the spirit of NIC interrupt throttling:
+ * once a notification is due it is held for up to @usecs, or until @frames
+ * notifications have accumulated if @frames is non-zero.  Zero @usecs
+ * disables moderation and signals the guest immediately again.
+ */
+void virtio_queue_set_irq_coalesce(VirtQueue *vq, uint32_t usecs,
+                                   uint32_t frames)
+{
+    if (vq->notify_pending) {
+        virtio_notify_deliver(vq->vdev, vq);
+    }
+
+    vq->coalesce_usecs = usecs;
+    vq->coalesce_frames = frames;
+
+    if (usecs && !vq->notify_timer) {
+        vq->notify_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                        virtio_queue_notify_timer, vq);
+    } else if (!usecs && vq->notify_timer) {
+        timer_del(vq->notify_timer);
+        timer_free(vq->notify_timer);
+        vq->notify_timer = NULL;
+    }
+}
+
+static void virtio_flush_coalesced_notify(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (vq->notify_timer) {
+            timer_del(vq->notify_timer);
+        }
+        if (vq->notify_pending) {
+            virtio_notify_deliver(vdev, vq);
+        }
+    }
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!virtio_should_notify(vdev, vq)) {
         return;
     }
 
-    trace_virtio_notify(vdev, vq);
-    vdev->isr |= 0x01;
-    virtio_notify_vector(vdev, vq->vector);
+    if (!vq->coalesce_usecs) {
+        virtio_notify_deliver(vdev, vq);
+        return;
+    }
+
+    vq->notify_pending++;
+    if (vq->coalesce_frames && vq->notify_pending >= vq->coalesce_frames) {
+        timer_del(vq->notify_timer);
+        virtio_notify_deliver(vdev, vq);
+        return;
+    }
+
+    if (!timer_pending(vq->notify_timer)) {
+        trace_virtio_notify_coalesce(vdev, vq, vq->coalesce_usecs);
+        timer_mod(vq->notify_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t)vq->coalesce_usecs * SCALE_US);
+    }
 }
 
 void virtio_notify_config(VirtIODevice *vdev)
@@ -1283,6 +2030,13 @@ static bool virtio_ringsize_needed(void *opaque)
     return false;
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_extra_state_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1338,6 +2092,30 @@ static const VMStateDescription vmstate_virtio_ringsize = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static int get_extra_state(QEMUFile *f, void *pv, size_t size)
 {
     VirtIODevice *vdev = pv;
@@ -1420,6 +2198,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_extra_state,
         NULL
     }
@@ -1635,7 +2414,25 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        if (vdev->vq[i].vring.desc && virtio_queue_packed(&vdev->vq[i])) {
+            VirtQueue *vq = &vdev->vq[i];
+
+            /* used_idx and the wrap counters came with the subsection */
+            vq->shadow_avail_idx = vq->last_avail_idx;
+            vq->inuse = vq->last_avail_idx - vq->used_idx;
+            if (vq->last_avail_wrap_counter != vq->used_wrap_counter) {
+                vq->inuse += vq->vring.num;
+            }
+            if (vq->last_avail_idx >= vq->vring.num ||
+                vq->used_idx >= vq->vring.num ||
+                vq->inuse < 0 || vq->inuse > vq->vring.num) {
+                error_report("VQ %d size 0x%x inconsistent packed ring state: "
+                             "last_avail_idx 0x%x used_idx 0x%x",
+                             i, vq->vring.num, vq->last_avail_idx,
+                             vq->used_idx);
+                return -1;
+            }
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1672,7 +2469,16 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].notify_timer) {
+            timer_del(vdev->vq[i].notify_timer);
+            timer_free(vdev->vq[i].notify_timer);
+        }
+        g_free(vdev->vq[i].used_elems);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1686,6 +2492,11 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     bool backend_run = running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK);
     vdev->vm_running = running;
 
+    if (!running) {
+        /* Don't leave a moderated interrupt behind in the migration stream */
+        virtio_flush_coalesced_notify(vdev);
+    }
+
     if (backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -1733,6 +2544,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         vdev->vq[i].queue_index = i;
     }
 
@@ -1803,6 +2616,17 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].shadow_avail_idx = idx;
 }
 
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+    }
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1855,6 +2679,19 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleOutput handle_output)
 {
@@ -1862,6 +2699,8 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -1959,6 +2798,10 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
 
 static Property virtio_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIODevice, host_features),
+    DEFINE_PROP_UINT32("irq-coalesce-usecs", VirtIODevice,
+                       irq_coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("irq-coalesce-frames", VirtIODevice,
+                       irq_coalesce_frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
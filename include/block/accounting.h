@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,6 +43,18 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+/* A latency histogram with nbins bins, separated by the nbins - 1 ascending
+ * boundaries (in nanoseconds).  Bin 0 counts latencies below boundaries[0],
+ * bin i latencies in [boundaries[i - 1], boundaries[i]) and the last bin
+ * latencies of at least boundaries[nbins - 2].  nbins is 0 when the
+ * histogram is disabled.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries;
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -51,6 +64,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -75,6 +89,10 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
+int block_latency_histogram_set(BlockAcctStats *stats,
+                                enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 
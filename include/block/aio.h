@@ -44,11 +44,26 @@ void qemu_aio_unref(void *p);
 void qemu_aio_ref(void *p);
 
 typedef struct AioHandler AioHandler;
+typedef QSLIST_HEAD(, QEMUBH) BHList;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
 
+/* Returns true if progress was made, e.g. because the handler found and
+ * processed new events.  Called repeatedly while aio_poll() busy-waits, so
+ * it must be cheap when there is nothing to do.
+ */
+typedef bool AioPollFn(void *opaque);
+
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+
+/* BHs that an aio_bh_poll() call took off AioContext::bh_list */
+typedef struct BHListSlice BHListSlice;
+struct BHListSlice {
+    BHList bh_list;
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
 
 struct AioContext {
     GSource source;
@@ -90,16 +105,15 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* lock to protect between bh's adders and deleter */
-    QemuMutex bh_lock;
-
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
-
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Bottom Halves of the context that are scheduled or deleted, and not
+     * yet processed by aio_bh_poll().  Any thread can push to the list
+     * without a lock; an unscheduled BH is not on any list, so the cost of
+     * aio_bh_poll() only depends on how many BHs were scheduled.
      */
-    int walking_bh;
+    BHList bh_list;
+
+    /* Lists taken from bh_list by aio_bh_poll(), one per nesting level */
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
 
     /* Used by aio_notify.
      *
@@ -128,6 +142,12 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
@@ -138,6 +158,27 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Number of AioHandlers without .io_poll(); polling is only useful if
+     * every source of events can be polled.
+     */
+    int poll_disable_cnt;
+
+    /* Busy-polling time before blocking, adjusted to the observed event
+     * rate between 0 and poll_max_ns (0 disables polling).  Nonzero
+     * poll_grow and poll_shrink override the default growth factor and
+     * the reset to 0 on shrinking.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Number of worker threads that the thread pool keeps waiting for work,
+     * and the most it may run at once.
+     */
+    int thread_pool_min;
+    int thread_pool_max;
 };
 
 /**
@@ -337,6 +378,20 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Install a poll function for a file descriptor that already has handlers
+ * from aio_set_fd_handler(), or remove it with a NULL @io_poll.  @io_poll is
+ * called with the opaque of the fd handler.  aio_set_fd_handler() drops the
+ * poll function, so it has to be set again after changing the handlers.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Same as aio_set_fd_poll(), for an event notifier registered with
+ * aio_set_event_notifier(); @io_poll is passed the notifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -348,6 +403,11 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Return the LuringState bound to this AioContext, or NULL if the
+ * io_uring instance could not be created.
+ */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -454,4 +514,28 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds (0 disables polling)
+ * @grow: polling time growth factor (0 selects the default)
+ * @shrink: polling time shrink factor (0 resets the polling time)
+ * @errp: pointer to error object
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of idle worker threads kept alive
+ * @max: maximum number of worker threads
+ * @errp: pointer to error object
+ *
+ * Applies to the thread pool of @ctx, including an existing one.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
 #endif
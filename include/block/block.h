@@ -44,6 +44,12 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a compressed write from a coroutine may be issued before the
+     * previous one has completed: the data is compressed concurrently, but
+     * the writes land in the image in the order they were issued
+     */
+    bool pipelined_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -97,6 +103,7 @@ typedef struct HDGeometry {
                                       select an appropriate protocol driver,
                                       ignoring the format layer */
 #define BDRV_O_NO_IO       0x10000 /* don't initialize for I/O */
+#define BDRV_O_IO_URING    0x20000 /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_NO_FLUSH)
 
@@ -251,6 +258,15 @@ int coroutine_fn bdrv_co_writev(BdrvChild *child, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int count, BdrvRequestFlags flags);
+/*
+ * Copy @bytes from @src at @src_offset to @dst at @dst_offset without
+ * bouncing the data through QEMU.  Returns -ENOTSUP if the drivers involved
+ * can't offload the copy; the caller must then fall back to a read and a
+ * write.  The request must fit in a regular I/O request.
+ */
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -340,6 +356,8 @@ void bdrv_close_all(void);
 void bdrv_drain(BlockDriverState *bs);
 void coroutine_fn bdrv_co_drain(BlockDriverState *bs);
 void bdrv_drain_all(void);
+void bdrv_drain_all_begin(void);
+void bdrv_drain_all_end(void);
 
 int bdrv_pdiscard(BlockDriverState *bs, int64_t offset, int count);
 int bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -0,0 +1,42 @@
+/*
+ * QEMU backup job, as used by other block drivers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef BLOCK_BACKUP_H
+#define BLOCK_BACKUP_H
+
+#include "block/block_int.h"
+
+typedef struct CowRequest {
+    int64_t start;
+    int64_t end;
+    QLIST_ENTRY(CowRequest) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} CowRequest;
+
+/*
+ * Wait for the copy-before-write requests of @job that overlap
+ * [@sector_num, @sector_num + @nb_sectors) to complete.
+ */
+void coroutine_fn backup_wait_for_overlapping_requests(BlockJob *job,
+                                                       int64_t sector_num,
+                                                       int nb_sectors);
+/*
+ * Make copy-before-write requests of @job that overlap the range wait for
+ * @req, until backup_cow_request_end().
+ */
+void backup_cow_request_begin(CowRequest *req, BlockJob *job,
+                              int64_t sector_num, int nb_sectors);
+void backup_cow_request_end(CowRequest *req);
+
+/*
+ * Forget which clusters a sync=none backup job already copied, so that
+ * the next write to each one copies it to the target again.
+ */
+void backup_do_checkpoint(BlockJob *job, Error **errp);
+
+#endif
@@ -82,6 +82,13 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* Data of a write request, NULL for zero writes and discards; valid
+     * while the before and after write notifiers run */
+    int64_t write_offset;
+    QEMUIOVector *write_qiov;
+    /* Result of the request, valid while the after write notifiers run */
+    int write_ret;
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -167,6 +174,24 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy a range of data between two nodes without passing it through
+     * QEMU, for example with a reflink or copy_file_range().  The request
+     * is first handed down the source side with bdrv_co_copy_range_from;
+     * once the source reaches the node that holds the data, it calls
+     * bdrv_co_copy_range_to to resolve the destination the same way.
+     * Either callback may be NULL or return -ENOTSUP, in which case the
+     * caller falls back to a regular read and write.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -177,6 +202,16 @@ struct BlockDriver {
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /*
+     * Checks whether a persistent dirty bitmap with the given name and
+     * granularity could be stored in the image.  Drivers that can't store
+     * persistent bitmaps leave this NULL.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     /*
      * Flushes all data for all layers by calling bdrv_co_flush for underlying
      * layers, if needed. This function is needed for deterministic
@@ -471,6 +506,9 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request has completed */
+    NotifierList after_write_notifiers;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
@@ -577,6 +615,14 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -592,6 +638,16 @@ BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked after write requests have completed
+ * and the dirty bitmaps have been updated.  The callback receives the
+ * BdrvTrackedRequest of the write, with its result in @write_ret.  It runs
+ * even if a before write notifier failed the request.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -702,13 +758,15 @@ void commit_start(const char *job_id, BlockDriverState *bs,
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
+ * @auto_complete: Auto complete the job once in sync, instead of waiting
+ * for block-job-complete.
  *
  */
 void commit_active_start(const char *job_id, BlockDriverState *bs,
                          BlockDriverState *base, int64_t speed,
                          BlockdevOnError on_error,
                          BlockCompletionFunc *cb,
-                         void *opaque, Error **errp);
+                         void *opaque, Error **errp, bool auto_complete);
 /*
  * mirror_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -725,6 +783,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: When to write data to the target.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -740,7 +799,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
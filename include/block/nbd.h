@@ -38,6 +38,10 @@ struct nbd_request {
 struct nbd_reply {
     uint64_t handle;
     uint32_t error;
+    bool structured;        /* structured reply chunk, fields below valid */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;        /* length of the chunk payload */
 };
 
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
@@ -61,6 +65,16 @@ struct nbd_reply {
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 #define NBD_REP_ERR_TLS_REQD    ((UINT32_C(1) << 31) | 5) /* TLS required */
 
+/* Structured reply flags. */
+#define NBD_REPLY_FLAG_DONE     (1 << 0)        /* Final chunk of a reply */
+
+/* Structured reply chunk types. */
+#define NBD_REPLY_TYPE_NONE             0
+#define NBD_REPLY_TYPE_OFFSET_DATA      1
+#define NBD_REPLY_TYPE_OFFSET_HOLE      2
+#define NBD_REPLY_TYPE_ERROR            ((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET     ((1 << 15) | 2)
+
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -92,11 +106,13 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
                      bool do_read);
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
+                          QIOChannel **outioc, bool *structured_reply,
                           off_t *size, Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint16_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply);
+ssize_t nbd_receive_reply_chunk(QIOChannel *ioc, struct nbd_reply *reply,
+                                uint64_t from, QEMUIOVector *qiov);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -33,8 +33,14 @@ const char *throttle_group_get_name(BlockBackend *blk);
 ThrottleState *throttle_group_incref(const char *name);
 void throttle_group_unref(ThrottleState *ts);
 
+/* Weights of the members of a throttling group */
+#define THROTTLE_GROUP_DEFAULT_WEIGHT 100
+#define THROTTLE_GROUP_MAX_WEIGHT     1000
+
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
+void throttle_group_set_weight(BlockBackend *blk, unsigned weight);
+unsigned throttle_group_get_weight(BlockBackend *blk);
 
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
@@ -289,6 +289,30 @@ typedef enum {
 QCryptoTLSSessionHandshakeStatus
 qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_offload:
+ * @sess: the TLS session object
+ * @fd: the socket the session runs over
+ * @rx: set to whether receiving was offloaded too
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Once the handshake has completed, hand the session keys
+ * to the kernel TLS support of socket @fd. On success the
+ * session must no longer be used to send data: plain text
+ * written to @fd is encrypted by the kernel. If @rx is set,
+ * the same holds for reading; otherwise received records
+ * must still go through qcrypto_tls_session_read().
+ *
+ * Only TLS 1.2 sessions with an AES-GCM cipher can be
+ * offloaded, and only on Linux.
+ *
+ * Returns: 0 if sending was offloaded, -1 on error
+ */
+int qcrypto_tls_session_offload(QCryptoTLSSession *sess,
+                                int fd,
+                                bool *rx,
+                                Error **errp);
+
 /**
  * qcrypto_tls_session_get_key_size:
  * @sess: the TLS session object
@@ -94,6 +94,19 @@ void cpu_reloading_memory_map(void);
  */
 void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB of the specified CPU, if the TCG backend sizes it
+ * at runtime.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -169,6 +182,7 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
+void tb_invalidate_ram_block(RAMBlock *block);
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr);
 #else
@@ -224,6 +238,26 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_HOT_COUNT   0x80000 /* Count executions in exec_count */
+#define CF_SUPERBLOCK  0x100000 /* Translate across forward branches */
+#define CF_EXEC_COUNT  0x200000 /* Count executions for "info tbs" */
+
+    /* set under tb_lock when the TB is unlinked; lock-free lookups may
+       still find it for a moment but must not chain to it */
+    bool invalid;
+
+    /* Number of times the TB was entered, bumped by the TB itself when
+       CF_HOT_COUNT is set.  Once it reaches TB_HOT_THRESHOLD the TB exits
+       before its first instruction and is retranslated as a superblock.  */
+    uint32_t exec_count;
+#define TB_HOT_THRESHOLD 1000
+
+    /* Profiling data for "info tbs", only kept when tb_profile_enabled:
+       returns to the main loop through this TB, host code size and
+       translation time in nanoseconds.  */
+    uint32_t exit_count;
+    uint32_t tc_size;
+    uint32_t gen_time;
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
@@ -266,6 +300,8 @@ struct TranslationBlock {
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
+extern bool tb_profile_enabled;
+void tb_profile_set(CPUState *cpu, bool enable);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -402,7 +438,7 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
 MemoryRegionSection *
 address_space_translate_for_iotlb(CPUState *cpu, int asidx, hwaddr addr,
                                   hwaddr *xlat, hwaddr *plen);
-hwaddr memory_region_section_get_iotlb(CPUState *cpu,
+hwaddr memory_region_section_get_iotlb(CPUState *cpu, int asidx,
                                        MemoryRegionSection *section,
                                        target_ulong vaddr,
                                        hwaddr paddr, hwaddr xlat,
@@ -20,6 +20,21 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & (CF_HOT_COUNT | CF_EXEC_COUNT)) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+        TCGv_i32 n = tcg_temp_new_i32();
+
+        tcg_gen_ld_i32(n, ptr, 0);
+        tcg_gen_addi_i32(n, n, 1);
+        tcg_gen_st_i32(n, ptr, 0);
+        if (tb->cflags & CF_HOT_COUNT) {
+            tcg_gen_brcondi_i32(TCG_COND_GEU, n, TB_HOT_THRESHOLD,
+                                exitreq_label);
+        }
+        tcg_temp_free_i32(n);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
@@ -25,6 +25,10 @@ typedef struct AddressSpaceDispatch AddressSpaceDispatch;
 void address_space_init_dispatch(AddressSpace *as);
 void address_space_unregister(AddressSpace *as);
 void address_space_destroy_dispatch(AddressSpace *as);
+void address_space_dispatch_prepare(AddressSpace *as, struct FlatView *view);
+
+void flatview_ref(struct FlatView *view);
+void flatview_unref(struct FlatView *view);
 
 extern const MemoryRegionOps unassigned_mem_ops;
 
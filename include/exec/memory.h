@@ -140,6 +140,14 @@ struct MemoryRegionOps {
         bool unaligned;
     } impl;
 
+    /* If true, the callbacks do their own locking and are called without
+     * the global lock, as if memory_region_clear_global_locking() had
+     * been called on every region initialized with these ops.  Such a
+     * region may only have ioeventfds while kvm_eventfds_enabled(): the
+     * emulated eventfd list is updated under the BQL.
+     */
+    bool own_locking;
+
     /* If .read and .write are not present, old_mmio may be used for
      * backwards compatibility with old mmio registration
      */
@@ -221,6 +229,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -255,6 +264,8 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
+    /* Bumped whenever @dispatch is replaced; see AddressSpaceMapCache.  */
+    unsigned dispatch_gen;
     MemoryListener dispatch_listener;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
@@ -827,6 +838,21 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty logging of a range in
+ *                                   any external TLBs (e.g. kvm)
+ *
+ * Accelerators that leave the pages they report as dirty writable, until
+ * told otherwise, start tracking writes to them again.  Only what was
+ * reported by memory_region_sync_dirty_bitmap() so far is affected.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the range (relative to the start of the region).
+ * @len: the size of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -893,6 +919,28 @@ void memory_region_add_coalescing(MemoryRegion *mr,
                                   hwaddr offset,
                                   uint64_t size);
 
+/**
+ * memory_region_set_coalescing_except: Enable memory coalescing for a
+ *                                      register file except for some
+ *                                      registers.
+ *
+ * Coalesces the whole region except for the registers at @regs, whose
+ * writes have side effects the guest synchronizes with (interrupt mask
+ * and cause registers, doorbells, ...) and so must trap right away.
+ * Any access to the region flushes queued writes first, so reads and
+ * trapping writes still observe all earlier writes in order.
+ *
+ * @mr: the memory region to be updated.
+ * @regs: offsets of the registers that must not be coalesced, in
+ *        ascending order.
+ * @nb_regs: number of entries in @regs.
+ * @reg_size: size of each excluded register.
+ */
+void memory_region_set_coalescing_except(MemoryRegion *mr,
+                                         const hwaddr *regs,
+                                         unsigned nb_regs,
+                                         unsigned reg_size);
+
 /**
  * memory_region_clear_coalescing: Disable MMIO coalescing for the region.
  *
@@ -1418,6 +1466,46 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/**
+ * AddressSpaceMapCache: remembers the last RAM section mapped through
+ * address_space_map_cached(), so that further mappings inside it skip
+ * address_space_translate() and the RAMBlock lookups.
+ *
+ * The cache holds no references; it is revalidated against the address
+ * space's dispatch generation, which changes on every topology update.
+ * Sections behind an IOMMU are never cached.  Users must serialize
+ * accesses to a cache, and zero-initialize it or call
+ * address_space_map_cache_reset() before first use.
+ */
+typedef struct AddressSpaceMapCache {
+    unsigned gen;
+    hwaddr addr;
+    hwaddr len;
+    hwaddr xlat;
+    uint8_t *host;
+    MemoryRegion *mr;
+} AddressSpaceMapCache;
+
+static inline void address_space_map_cache_reset(AddressSpaceMapCache *cache)
+{
+    cache->mr = NULL;
+}
+
+/* address_space_map_cached: like address_space_map(), but look up @cache
+ * first and refill it on a miss.  The mapping may be shorter than the one
+ * address_space_map() would return, since it stops at the end of the
+ * cached section.
+ */
+void *address_space_map_cached(AddressSpace *as, AddressSpaceMapCache *cache,
+                               hwaddr addr, hwaddr *plen, bool is_write);
+
+/* address_space_unmap_cached: unmaps a buffer returned by
+ * address_space_map_cached() or address_space_map().
+ */
+void address_space_unmap_cached(AddressSpace *as, AddressSpaceMapCache *cache,
+                                void *buffer, hwaddr len, int is_write,
+                                hwaddr access_len);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
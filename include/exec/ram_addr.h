@@ -36,6 +36,15 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    size_t page_size;
+    /* Pages the migration found dirty since it last measured the rate */
+    unsigned long sync_dirty_pages;
+    /* The last checkpoint received by a COLO secondary */
+    uint8_t *colo_cache;
+    /* Where migration with x-fixed-ram stores the block in its file */
+    int64_t fixed_ram_offset;
+    /* Per-page TB lists, allocated by translate-all.c on first use */
+    struct PageDesc *page_desc;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -73,13 +82,51 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
  * memory is being grown.  When no threads are using the old DirtyMemoryBlocks
  * anymore it is freed by RCU (but the underlying blocks stay because they are
  * pointed to from the new DirtyMemoryBlocks).
+ *
+ * Each block is followed by one more word, a summary of its bitmap with
+ * one bit per DIRTY_MEMORY_CHUNK_SIZE pages.  It is only kept for
+ * DIRTY_MEMORY_MIGRATION: setting a dirty bit also sets the bit of its
+ * chunk, so that syncing the migration bitmap can skip the chunks that
+ * weren't written since the previous sync.
  */
 #define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+#define DIRTY_MEMORY_CHUNK_SIZE (DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG)
 typedef struct {
     struct rcu_head rcu;
     unsigned long *blocks[];
 } DirtyMemoryBlocks;
 
+static inline unsigned long *dirty_memory_chunks(unsigned long *block)
+{
+    return &block[BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)];
+}
+
+/* Flag the chunks in @mask of @block as written, after their pages. */
+static inline void dirty_memory_set_chunks(unsigned long *block,
+                                           unsigned long mask)
+{
+    unsigned long *chunks = dirty_memory_chunks(block);
+
+    /* Pairs with the atomic_fetch_and in
+     * cpu_physical_memory_sync_dirty_bitmap: either it sees the dirty
+     * bits, or we see the cleared summary and set it again.
+     */
+    smp_mb();
+    if ((atomic_read(chunks) & mask) != mask) {
+        atomic_or(chunks, mask);
+    }
+}
+
+/* The summary bits for pages [@offset, @offset + @nr) of a block. */
+static inline unsigned long dirty_memory_chunk_mask(unsigned long offset,
+                                                    unsigned long nr)
+{
+    unsigned long first = offset / DIRTY_MEMORY_CHUNK_SIZE;
+    unsigned long last = (offset + nr - 1) / DIRTY_MEMORY_CHUNK_SIZE;
+
+    return BITMAP_LAST_WORD_MASK(last + 1) & ~(BIT(first) - 1);
+}
+
 typedef struct RAMList {
     QemuMutex mutex;
     RAMBlock *mru_block;
@@ -93,6 +140,7 @@ extern RAMList ram_list;
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
+RAMBlock *qemu_ram_block_lookup(ram_addr_t addr);
 
 RAMBlock *qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
                                    bool share, const char *mem_path,
@@ -247,6 +295,10 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
     blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
 
     set_bit_atomic(offset, blocks->blocks[idx]);
+    if (client == DIRTY_MEMORY_MIGRATION) {
+        dirty_memory_set_chunks(blocks->blocks[idx],
+                                dirty_memory_chunk_mask(offset, 1));
+    }
 
     rcu_read_unlock();
 }
@@ -282,6 +334,9 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
         if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
                               offset, next - page);
+            dirty_memory_set_chunks(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
+                                    dirty_memory_chunk_mask(offset,
+                                                            next - page));
         }
         if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
@@ -322,6 +377,7 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
         unsigned long **blocks[DIRTY_MEMORY_NUM];
         unsigned long idx;
         unsigned long offset;
+        unsigned long chunks = 0;
         long k;
         long nr = BITS_TO_LONGS(pages);
 
@@ -344,13 +400,24 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                 if (tcg_enabled()) {
                     atomic_or(&blocks[DIRTY_MEMORY_CODE][idx][offset], temp);
                 }
+                chunks |= BIT(offset * BITS_PER_LONG /
+                              DIRTY_MEMORY_CHUNK_SIZE);
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+                if (chunks) {
+                    dirty_memory_set_chunks(
+                        blocks[DIRTY_MEMORY_MIGRATION][idx], chunks);
+                    chunks = 0;
+                }
                 offset = 0;
                 idx++;
             }
         }
+        if (chunks) {
+            dirty_memory_set_chunks(blocks[DIRTY_MEMORY_MIGRATION][idx],
+                                    chunks);
+        }
 
         rcu_read_unlock();
 
@@ -403,8 +470,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long k, end;
+        unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        unsigned long chunk_words = BITS_TO_LONGS(DIRTY_MEMORY_CHUNK_SIZE);
         unsigned long * const *src;
         unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
@@ -415,20 +483,41 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
         src = atomic_rcu_read(
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = atomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
+        for (k = page; k < page + nr; k = end) {
+            unsigned long chunk, *chunks;
+            bool written;
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
                 offset = 0;
                 idx++;
             }
+            chunk = BIT(offset / chunk_words);
+            chunks = dirty_memory_chunks(src[idx]);
+            end = MIN(page + nr, k + chunk_words - offset % chunk_words);
+
+            /* Skip the chunks nothing was written to.  The summary can
+             * only be cleared when the whole chunk is synced here.
+             */
+            if (end - k == chunk_words) {
+                written = atomic_fetch_and(chunks, ~chunk) & chunk;
+            } else {
+                written = atomic_read(chunks) & chunk;
+            }
+            if (!written) {
+                offset += end - k;
+                continue;
+            }
+
+            for (; k < end; k++, offset++) {
+                if (src[idx][offset]) {
+                    unsigned long bits = atomic_xchg(&src[idx][offset], 0);
+                    unsigned long new_dirty;
+                    new_dirty = ~dest[k];
+                    dest[k] |= bits;
+                    new_dirty &= bits;
+                    num_dirty += ctpopl(new_dirty);
+                }
+            }
         }
 
         rcu_read_unlock();
@@ -26,19 +26,41 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+/* The code buffer is split in this many regions, filled one after the
+ * other.  Once the last one is full, the oldest region is evicted and
+ * reused instead of flushing the whole buffer.
+ */
+#define TB_REGION_COUNT          8
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
+typedef struct TBRegion TBRegion;
+
+struct TBRegion {
+    void *start;
+    void *end;
+    /* end of the generated code, unless this is the current region */
+    void *ptr;
+    /* this region's share of tbs[], in the order the code was generated */
+    TranslationBlock *tbs;
+    int nb_tbs;
+};
 
 struct TBContext {
 
     TranslationBlock *tbs;
     struct qht htable;
     int nb_tbs;
+    TBRegion regions[TB_REGION_COUNT];
+    int max_region_tbs;
+    int cur_region;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_region_evict_count;
+    int tb_superblock_count;
     int tb_phys_invalidate_count;
 };
 
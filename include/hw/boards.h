@@ -156,6 +156,7 @@ struct MachineState {
     bool usb;
     bool usb_disabled;
     bool igd_gfx_passthru;
+    uint64_t xen_mapcache_bucket;
     char *firmware;
     bool iommu;
     bool suppress_vmdesc;
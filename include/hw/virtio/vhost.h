@@ -39,6 +39,8 @@ struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
     struct vhost_memory *mem;
+    /* The table as last sent to the backend, NULL if unknown */
+    struct vhost_memory *backend_mem;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
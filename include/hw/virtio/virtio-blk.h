@@ -34,16 +34,30 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *vq_iothreads;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t request_merging;
+    uint32_t merge_window_us;
     uint16_t num_queues;
 };
 
 struct VirtIOBlockDataPlane;
 
-struct VirtIOBlockReq;
+typedef struct VirtIOBlockReq VirtIOBlockReq;
+
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
+/* Number of requests taken off the virtqueue at a time */
+#define VIRTIO_BLK_POP_BATCH 16
+
+typedef struct MultiReqBuffer {
+    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int num_reqs;
+    bool is_write;
+} MultiReqBuffer;
+
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -56,9 +70,12 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    /* Reads/writes held back for the merge window, shared by all queues */
+    MultiReqBuffer merge_mrb;
+    QEMUTimer *merge_timer;
 } VirtIOBlock;
 
-typedef struct VirtIOBlockReq {
+struct VirtIOBlockReq {
     VirtQueueElement elem;
     int64_t sector_num;
     VirtIOBlock *dev;
@@ -70,15 +87,7 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
-} VirtIOBlockReq;
-
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
-
-typedef struct MultiReqBuffer {
-    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
-    unsigned int num_reqs;
-    bool is_write;
-} MultiReqBuffer;
+};
 
 void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
                              VirtIOBlockReq *req);
@@ -90,4 +99,6 @@ void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb);
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 
+void virtio_blk_flush_merge_window(VirtIOBlock *s);
+
 #endif
@@ -35,6 +35,8 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint16_t rx_queue_size;
+    uint16_t tx_queue_size;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -49,6 +51,9 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* rx buffers filled during a backend burst but not yet flushed */
+    unsigned rx_burst;
+    unsigned rx_pending;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -53,6 +53,7 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *vq_iothreads;
 };
 
 struct VirtIOSCSI;
@@ -76,7 +77,12 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* iothread of the SCSI devices and control queues */
+
+    /* Request queue i is serviced by cmd_vq_ctx[i], see vq-iothreads */
+    IOThread **vq_iothreads;
+    unsigned num_vq_iothreads;
+    AioContext **cmd_vq_ctx;
 
     bool dataplane_started;
     bool dataplane_starting;
@@ -134,7 +140,9 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
 void virtio_scsi_dataplane_notify(VirtIODevice *vdev, VirtIOSCSIReq *req);
@@ -48,6 +48,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    bool zerocopy;
+    /* MSG_ZEROCOPY writes made and known to be sent, modulo 2^32 */
+    uint32_t zerocopy_queued;
+    uint32_t zerocopy_done;
 };
 
 
@@ -248,4 +252,47 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_set_zerocopy:
+ * @ioc: the socket channel object
+ * @enabled: whether writes should copy the data or not
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Have the kernel send the data of qio_channel_writev() straight
+ * from the memory of the caller, with MSG_ZEROCOPY.  This is only
+ * available with TCP on Linux.  The data must then stay valid until
+ * qio_channel_socket_zerocopy_wait() says it has been sent; if it
+ * changes in the meantime, either version may go out.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_set_zerocopy(QIOChannelSocket *ioc,
+                                    bool enabled,
+                                    Error **errp);
+
+/**
+ * qio_channel_socket_zerocopy_mark:
+ * @ioc: the socket channel object
+ *
+ * Returns: a mark to give qio_channel_socket_zerocopy_wait() to
+ * wait for the writes made so far
+ */
+uint32_t qio_channel_socket_zerocopy_mark(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_zerocopy_wait:
+ * @ioc: the socket channel object
+ * @mark: the value qio_channel_socket_zerocopy_mark() returned
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Block until the kernel is done with the data of every write
+ * made before @mark was taken.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_zerocopy_wait(QIOChannelSocket *ioc,
+                                     uint32_t mark,
+                                     Error **errp);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
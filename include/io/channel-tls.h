@@ -48,6 +48,9 @@ struct QIOChannelTLS {
     QIOChannel parent;
     QIOChannel *master;
     QCryptoTLSSession *session;
+    bool ktls;      /* the credentials ask for kernel TLS offload */
+    bool ktls_tx;   /* the kernel encrypts what is written to master */
+    bool ktls_rx;   /* the kernel decrypts what is read from master */
 };
 
 /**
@@ -0,0 +1,41 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * checkpoints of the guest state
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COLO_H
+#define QEMU_MIGRATION_COLO_H
+
+#include "migration/migration.h"
+
+/*
+ * Once the migration has completed with the x-colo capability, the
+ * primary keeps taking checkpoints: it stops, sends what changed since
+ * the last one and waits for the secondary to load it.  Only the RAM
+ * dirtied since the previous checkpoint goes over the wire; the
+ * secondary keeps it in a cache until the checkpoint is complete, so
+ * that it is never left with half of one.  While the VM runs, the
+ * primary already streams the pages it dirties into that cache, and
+ * the checkpoint only sends those dirtied after the last round.
+ */
+
+/*
+ * Run the checkpoints on the primary, from the migration thread, until
+ * the secondary goes away or the migration is cancelled.  The state
+ * is MIGRATION_STATUS_COLO while it runs and the VM is left running.
+ */
+void colo_process_checkpoint(MigrationState *s);
+
+/*
+ * Start loading checkpoints on the secondary, once the incoming
+ * coroutine has loaded the migration stream.  The coroutine must yield
+ * until the thread wakes it up again, when the checkpoints stop, unless
+ * this fails.
+ */
+int colo_incoming_start(MigrationIncomingState *mis);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Compression codecs for the RAM pages of live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/*
+ * A MigrationCodec holds the state one thread needs to (de)compress
+ * pages with one method; it must not be used by two threads at once.
+ */
+
+/* Whether @method has been built in. */
+bool migration_codec_supported(MigrationCompressMethod method);
+
+/*
+ * Create a codec for @method.  @level is the compress-level parameter,
+ * between 0 and 9, and is only used to compress.
+ */
+MigrationCodec *migration_codec_new(MigrationCompressMethod method, int level,
+                                    Error **errp);
+void migration_codec_free(MigrationCodec *codec);
+
+/* Largest size @len bytes can take once compressed. */
+size_t migration_codec_bound(MigrationCodec *codec, size_t len);
+
+/*
+ * Compress @len bytes from @src into the @dst_len bytes at @dst, or
+ * decompress them.  Both return the size of the output, or -1 if it
+ * failed or doesn't fit.
+ */
+ssize_t migration_codec_compress(MigrationCodec *codec, uint8_t *dst,
+                                 size_t dst_len, const uint8_t *src,
+                                 size_t len);
+ssize_t migration_codec_decompress(MigrationCodec *codec, uint8_t *dst,
+                                   size_t dst_len, const uint8_t *src,
+                                   size_t len);
+
+#endif
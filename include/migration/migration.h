@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/coroutine.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
@@ -103,12 +104,21 @@ struct MigrationIncomingState {
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
+    size_t    postcopy_tmp_page_size;
+    void     *postcopy_tmp_zero_page;
+    size_t    postcopy_tmp_zero_page_size;
 
     QEMUBH *bh;
 
     int state;
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
+
+    /* The source asked for COLO checkpoints once the stream is loaded */
+    bool colo_enabled;
+    QemuThread colo_incoming_thread;
+    /* The coroutine to wake up when the checkpoints stop */
+    Coroutine *migration_incoming_co;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -156,10 +166,15 @@ struct MigrationState
     int64_t expected_downtime;
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
+    /* Smoothed rates for query-migrate's prediction, in bytes per ms */
+    double bandwidth_avg;
+    double dirty_rate_avg;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Time spent synchronizing the dirty bitmap, in microseconds */
+    int64_t dirty_sync_time;
     /* Count of requests incoming from destination */
     int64_t postcopy_requests;
 
@@ -182,6 +197,7 @@ struct MigrationState
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
+void migration_sample_dirty_rate(MigrationState *s);
 
 void migration_fd_process_incoming(QEMUFile *f);
 
@@ -217,6 +233,9 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+/* Open one more connection to the destination of the socket migration */
+QIOChannel *socket_send_channel_create(Error **errp);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
@@ -238,6 +257,7 @@ bool migration_is_blocked(Error **errp);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_is_idle(void);
 /* True if outgoing migration has entered postcopy phase */
 bool migration_in_postcopy(MigrationState *);
 /* ...and after the device transmission */
@@ -248,10 +268,23 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_send_shutdown(void);
+void multifd_recv_new_channel(QIOChannel *ioc);
+bool multifd_recv_all_channels_created(void);
+void multifd_recv_threads_join(void);
+void postcopy_preempt_send_shutdown(void);
+void postcopy_preempt_new_channel(QIOChannel *ioc);
+bool postcopy_preempt_channel_created(void);
+void postcopy_preempt_recv_join(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 void free_xbzrle_decoded_buf(void);
+/* Called by devices the guest reported [addr, addr + len) of its RAM as
+ * unused to, while it promises not to touch it until migration is over.
+ * The pages are not sent unless they are dirtied again.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
 
@@ -266,6 +299,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_cache_evictions(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -275,6 +310,12 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+/* For the COLO secondary, see migration/colo.c */
+int colo_init_ram_cache(void);
+void colo_flush_ram_cache(void);
+void colo_release_ram_cache(void);
+
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -291,6 +332,10 @@ void migrate_add_blocker(Error *reason);
 void migrate_del_blocker(Error *reason);
 
 bool migrate_postcopy_ram(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_rdma_queue_pairs(void);
+int migrate_block_inflight_depth(void);
+int migrate_send_iov_depth(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
@@ -306,9 +351,21 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+bool migrate_parallel_device_state(void);
+bool migrate_zero_copy_send(void);
+bool migrate_colo_enabled(void);
+bool migrate_use_fixed_ram(void);
+bool migrate_postcopy_preempt(void);
+int64_t migrate_checkpoint_delay(void);
+int64_t migrate_checkpoint_dirty_limit(void);
+int64_t migrate_colo_heartbeat_timeout(void);
+void migrate_tune_send_file(QEMUFile *f);
+int migrate_multifd_channels(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
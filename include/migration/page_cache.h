@@ -60,9 +60,11 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten,
+ * if the page isn't cached yet it may evict another one
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted for it and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
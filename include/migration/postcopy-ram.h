@@ -35,11 +35,11 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages);
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
 
 /*
- * Discard the contents of 'length' bytes from 'start'
+ * Discard the contents of 'length' bytes from offset 'start' in 'rb'
  * We can assume that if we've been called postcopy_ram_hosttest returned true
  */
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length);
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length);
 
 /*
  * Userfault requires us to mark RAM as NOHUGEPAGE prior to discard
@@ -76,24 +76,33 @@ void postcopy_discard_send_finish(MigrationState *ms,
                                   PostcopyDiscardState *pds);
 
 /*
- * Place a page (from) at (host) efficiently
+ * Place (size) bytes of pages (from) at (host) efficiently
  *    There are restrictions on how 'from' must be mapped, in general best
  *    to use other postcopy_ routines to allocate.
+ *    (size) is a multiple of the host page size of the RAMBlock.
  * returns 0 on success
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t size);
 
 /*
- * Place a zero page at (host) atomically
+ * Place a zero page of (size) bytes at (host) atomically
  * returns 0 on success
  */
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t size);
 
 /*
- * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
- * Returns: Pointer to allocated page
+ * Allocate memory that can be mapped at a later point in time
+ * using postcopy_place_page, mis->postcopy_tmp_page_size bytes long
+ * Returns: Pointer to allocated memory
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Latencies of the faults serviced since the last incoming postcopy
+ * started, or NULL if there hasn't been one.
+ */
+PostcopyFaultStats *postcopy_get_fault_stats(void);
+
 #endif
@@ -61,6 +61,25 @@ typedef int (QEMUFileSetBlocking)(void *opaque, bool enabled);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Have writev_buffer leave the data where it is and let the kernel send
+ * it from there.  The data must then stay valid until wait_writes is
+ * done with the mark write_mark returned after writing it.
+ */
+typedef int (QEMUFileSetZeroCopy)(void *opaque, bool enabled, Error **errp);
+typedef uint32_t (QEMUFileWriteMark)(void *opaque);
+typedef int (QEMUFileWaitWrites)(void *opaque, uint32_t mark);
+
+/*
+ * Random access to an output file, for formats that place data at fixed
+ * offsets.  write_at writes all of @buf at @offset without moving the
+ * position of the stream, seek moves it like lseek().  Both return
+ * a negative errno on failure.
+ */
+typedef ssize_t (QEMUFileWriteAtFunc)(void *opaque, const uint8_t *buf,
+                                      size_t size, int64_t offset);
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -109,6 +128,11 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSetZeroCopy *set_zerocopy;
+    QEMUFileWriteMark *write_mark;
+    QEMUFileWaitWrites *wait_writes;
+    QEMUFileWriteAtFunc *write_at;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -150,8 +174,9 @@ void qemu_put_be64(QEMUFile *f, uint64_t v);
 size_t qemu_peek_buffer(QEMUFile *f, uint8_t **buf, size_t size, size_t offset);
 size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
+size_t qemu_file_buffered(QEMUFile *f);
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level);
+                                  MigrationCodec *codec);
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
@@ -163,6 +188,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -185,6 +211,11 @@ int qemu_file_shutdown(QEMUFile *f);
 QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 void qemu_file_set_blocking(QEMUFile *f, bool block);
+void qemu_file_set_iov_depth(QEMUFile *f, unsigned int depth);
+int qemu_file_set_zerocopy(QEMUFile *f, bool enabled, Error **errp);
+int64_t qemu_file_seek(QEMUFile *f, int64_t offset, int whence);
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t offset);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
 {
@@ -27,6 +27,15 @@ uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length);
 
+/**
+ * net_checksum_update32: incremental checksum update (RFC 1624)
+ *
+ * Returns the value of checksum @csum after a 32-bit field it covers
+ * changed from @old to @new.  All three are taken as stored in the
+ * packet, the result can be stored back without byte swapping.
+ */
+uint16_t net_checksum_update32(uint16_t csum, uint32_t old, uint32_t new);
+
 static inline uint32_t
 net_checksum_add(int len, uint8_t *buf)
 {
@@ -27,7 +27,11 @@ typedef void (FilterCleanup) (NetFilterState *nf);
  * Return:
  *   0: finished handling the packet, we should continue
  *   size: filter stolen this packet, we stop pass this packet further
+ *   NETFILTER_PACKET_QUEUED: filter stolen this packet and kept sent_cb,
+ *         the sender must not send more packets until sent_cb is called
  */
+#define NETFILTER_PACKET_QUEUED (-EAGAIN)
+
 typedef ssize_t (FilterReceiveIOV)(NetFilterState *nc,
                                    NetClientState *sender,
                                    unsigned flags,
@@ -36,6 +40,11 @@ typedef ssize_t (FilterReceiveIOV)(NetFilterState *nc,
                                    NetPacketSent *sent_cb);
 
 typedef void (FilterStatusChanged) (NetFilterState *nf, Error **errp);
+/*
+ * Called when a receiver that packets leaving this filter may be
+ * delivered to has drained its incoming queue.
+ */
+typedef void (FilterReceiverReady) (NetFilterState *nf);
 
 typedef struct NetFilterClass {
     ObjectClass parent_class;
@@ -44,6 +53,7 @@ typedef struct NetFilterClass {
     FilterSetup *setup;
     FilterCleanup *cleanup;
     FilterStatusChanged *status_changed;
+    FilterReceiverReady *receiver_ready;
     /* mandatory */
     FilterReceiveIOV *receive_iov;
 } NetFilterClass;
@@ -76,4 +86,28 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
                                     int iovcnt,
                                     void *opaque);
 
+/*
+ * Like qemu_netfilter_pass_to_next(), but returns 0 without taking the
+ * packet if the receiver can't accept it right now, so that it stays in
+ * the filter's queue.  The filter's receiver_ready callback is invoked
+ * when it is worth trying again.
+ */
+ssize_t qemu_netfilter_try_pass_to_next(NetClientState *sender,
+                                        unsigned flags,
+                                        const struct iovec *iov,
+                                        int iovcnt,
+                                        void *opaque);
+
+/* @nc has drained its incoming queue, let the filters feeding it know */
+void qemu_netfilter_receiver_ready(NetClientState *nc);
+
+/*
+ * Called with the iothread lock held when a COLO secondary takes over:
+ * every filter-redirector is switched off, so that its packets go
+ * straight between the netdev and the guest instead of the primary.
+ * filter-rewriter stays on, the connections opened before still need
+ * their sequence numbers fixed up.
+ */
+void netfilter_colo_failover(void);
+
 #endif /* QEMU_NET_FILTER_H */
@@ -47,9 +47,12 @@ typedef struct NICConf {
 /* Net clients */
 
 typedef void (NetPoll)(NetClientState *, bool enable);
+typedef void (NetBurst)(NetClientState *, bool begin);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec **,
+                              const int *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -64,6 +67,7 @@ typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
+typedef uint8_t *(SocketReadStateAlloc)(SocketReadState *rs, uint32_t len);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -71,11 +75,23 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /*
+     * Takes several packets at once.  Returns how many of them were
+     * consumed, stopping at the first one the backend cannot take right
+     * now.  Packets that fail for other reasons are dropped and count as
+     * consumed.
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     QueryRxFilter *query_rx_filter;
     NetPoll *poll;
+    /*
+     * Brackets a burst of packets delivered from the peer's event handler,
+     * so that a NIC can complete them to the guest all at once.
+     */
+    NetBurst *burst;
     HasUfo *has_ufo;
     HasVnetHdr *has_vnet_hdr;
     HasVnetHdrLen *has_vnet_hdr_len;
@@ -115,6 +131,13 @@ struct SocketReadState {
     uint32_t index;
     uint32_t packet_len;
     uint8_t buf[NET_BUFSIZE];
+    /* where the packet is reassembled: buf, or the result of alloc */
+    uint8_t *data;
+    /*
+     * Optional; returns the buffer that the next packet is reassembled
+     * into.  The buffer then belongs to finalize.
+     */
+    SocketReadStateAlloc *alloc;
     SocketReadStateFinalize *finalize;
 };
 
@@ -147,6 +170,9 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch(NetClientState *nc, const struct iovec **iovs,
+                            const int *iovcnts, int count);
+void qemu_net_burst(NetClientState *nc, bool begin);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
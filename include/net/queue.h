@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 
 typedef struct NetPacket NetPacket;
+typedef struct NetPacketBuf NetPacketBuf;
 typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
@@ -70,7 +71,34 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+/*
+ * Packets without a sent callback are dropped once the queue holds
+ * @maxlen packets; packets with one are always queued.
+ */
+void qemu_net_queue_set_maxlen(NetQueue *queue, uint32_t maxlen);
+bool qemu_net_queue_full(NetQueue *queue);
+bool qemu_net_queue_empty(NetQueue *queue);
+bool qemu_net_queue_idle(NetQueue *queue);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
+/*
+ * Between qemu_net_fanout_begin() and qemu_net_fanout_end(), every queue
+ * that has to keep a packet whose iovec is @iov (the very same array, as
+ * passed down unchanged by the net layer and the filters) shares one
+ * refcounted copy of it instead of copying it again.  The copy is only
+ * made once the first queue needs it.  Fan-outs may nest.
+ */
+typedef struct NetFanout {
+    const struct iovec *iov;
+    int iovcnt;
+    NetPacketBuf *buf;
+    struct NetFanout *prev;
+} NetFanout;
+
+void qemu_net_fanout_begin(NetFanout *fanout,
+                           const struct iovec *iov, int iovcnt);
+void qemu_net_fanout_end(NetFanout *fanout);
+
 #endif /* QEMU_NET_QUEUE_H */
@@ -16,10 +16,13 @@
 
 #include "qapi/qmp/json-lexer.h"
 
+typedef struct JSONTokenChunk JSONTokenChunk;
+
 typedef struct JSONToken {
     int type;
     int x;
     int y;
+    JSONTokenChunk *chunk;
     char str[];
 } JSONToken;
 
@@ -31,6 +34,7 @@ typedef struct JSONMessageParser
     int bracket_count;
     GQueue *tokens;
     uint64_t token_size;
+    JSONTokenChunk *chunk;
 } JSONMessageParser;
 
 void json_message_parser_init(JSONMessageParser *parser,
@@ -43,4 +47,6 @@ int json_message_parser_flush(JSONMessageParser *parser);
 
 void json_message_parser_destroy(JSONMessageParser *parser);
 
+void json_token_free(JSONToken *token);
+
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Timing of event loop callbacks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_CALLBACK_PROFILE_H
+#define QEMU_CALLBACK_PROFILE_H
+
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+
+/*
+ * When enabled, every fd handler, bottom half and timer callback run by an
+ * event loop is timed.  Durations go into a log2 histogram per kind, and
+ * callbacks slower than the threshold are counted by function and logged
+ * whenever one of them beats its own worst time.
+ */
+
+typedef enum CallbackProfileKind {
+    CALLBACK_PROFILE_FD,
+    CALLBACK_PROFILE_BH,
+    CALLBACK_PROFILE_TIMER,
+    CALLBACK_PROFILE_KIND_MAX,
+} CallbackProfileKind;
+
+/* Bucket i counts callbacks shorter than 2^i microseconds; the last one
+ * counts everything longer. */
+#define CALLBACK_PROFILE_BUCKETS 21
+
+typedef struct CallbackProfileStall {
+    CallbackProfileKind kind;
+    void *fn;
+    uint64_t count;
+    int64_t max_ns;
+    int64_t total_ns;
+} CallbackProfileStall;
+
+extern bool callback_profile_enabled;
+
+void callback_profile_record(CallbackProfileKind kind, void *fn, int64_t ns);
+
+static inline int64_t callback_profile_start(void)
+{
+    return atomic_read(&callback_profile_enabled) ? get_clock() : 0;
+}
+
+static inline void callback_profile_end(CallbackProfileKind kind, void *fn,
+                                        int64_t start)
+{
+    if (start) {
+        callback_profile_record(kind, fn, get_clock() - start);
+    }
+}
+
+/* Enable with the given threshold, or disable if @threshold_ns is 0.
+ * @reset clears the histograms and the stall counts. */
+void callback_profile_set(int64_t threshold_ns, bool reset);
+int64_t callback_profile_get_threshold(void);
+
+/* Copy the histogram of @kind into @buckets */
+void callback_profile_get_histogram(CallbackProfileKind kind,
+                                    uint64_t *buckets);
+
+/* Call @fn for each function that exceeded the threshold */
+void callback_profile_foreach_stall(void (*fn)(CallbackProfileStall *stall,
+                                               void *opaque),
+                                    void *opaque);
+
+/* A printable name for a callback, to be freed with g_free() */
+char *callback_profile_symbol(void *fn);
+
+#endif
@@ -92,6 +92,20 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+typedef struct CoroutinePoolStats {
+    uint64_t hits;              /* creations served from a pool */
+    uint64_t stack_allocs;      /* creations that allocated a new stack */
+    uint64_t stack_frees;       /* terminations that freed the stack */
+} CoroutinePoolStats;
+
+/**
+ * Get coroutine pool statistics
+ *
+ * Each thread folds its counters into the totals once per sizing window
+ * and when it exits, so recent activity may not be visible yet.
+ */
+void qemu_coroutine_pool_get_stats(CoroutinePoolStats *stats);
+
 
 
 /**
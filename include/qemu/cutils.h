@@ -171,6 +171,8 @@ int64_t qemu_strtosz_suffix_unit(const char *nptr, char **end,
 bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len);
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 bool buffer_is_zero(const void *buf, size_t len);
+bool buffer_is_equal(const void *a, const void *b, size_t len);
+bool buffer_copy_if_changed(void *dst, const void *src, size_t len);
 
 /*
  * Implementation of ULEB128 (http://en.wikipedia.org/wiki/LEB128)
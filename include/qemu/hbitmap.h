@@ -145,6 +145,32 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @count: Number of bits to look at.
+ *
+ * Return the first bit in the range [@start, @start + @count) that is not
+ * set, or -1 if the whole range is set.  The search goes one word at a time,
+ * so runs of set bits are skipped BITS_PER_LONG granules per step.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: In: first bit to look at.  Out: first bit of the area found.
+ * @count: In: number of bits to look at.  Out: length of the area found.
+ *
+ * Find the first run of set bits in the range [*@start, *@start + *@count)
+ * and return it through @start and @count, clipped to the range and to the
+ * size of the bitmap rounded up to the granularity.  Return
+ * false, leaving @start and @count unchanged, if no bit in the range is set.
+ */
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
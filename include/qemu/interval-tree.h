@@ -0,0 +1,96 @@
+/*
+ * Interval map backed by a balanced search tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/**
+ * struct IntervalTreeRange - A maximal run of addresses with the same value
+ * @start: first address of the run
+ * @last: last address of the run, inclusive
+ * @value: the value of every address in the run, never 0
+ */
+typedef struct IntervalTreeRange {
+    uint64_t start;
+    uint64_t last;
+    int value;
+} IntervalTreeRange;
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+/**
+ * struct IntervalTree - Map from addresses to int values
+ *
+ * Every address maps to 0 unless set otherwise.  The tree holds the
+ * non-zero ranges, which never overlap; adjacent ranges with the same
+ * value are merged.  Lookups and updates take O(log n) time in the number
+ * of ranges, plus O(log n) for each range an update overwrites.
+ *
+ * There is no internal locking; callers must serialize updates against
+ * each other and against lookups.
+ */
+typedef struct IntervalTree {
+    IntervalTreeNode *root;
+} IntervalTree;
+
+/**
+ * interval_tree_init - Initialize an empty tree
+ * @tree: the tree
+ */
+void interval_tree_init(IntervalTree *tree);
+
+/**
+ * interval_tree_destroy - Free all the ranges of @tree
+ * @tree: the tree
+ *
+ * @tree is left empty and can be used again.
+ */
+void interval_tree_destroy(IntervalTree *tree);
+
+/**
+ * interval_tree_set - Map a range of addresses to a value
+ * @tree: the tree
+ * @start: first address
+ * @last: last address, inclusive; must not be below @start
+ * @value: new value of every address in [@start, @last]; 0 removes them
+ */
+void interval_tree_set(IntervalTree *tree, uint64_t start, uint64_t last,
+                       int value);
+
+/**
+ * interval_tree_get - Look up the value of an address
+ * @tree: the tree
+ * @addr: the address
+ *
+ * Returns the value of @addr, or 0 if it is not in any range.
+ */
+int interval_tree_get(IntervalTree *tree, uint64_t addr);
+
+/**
+ * interval_tree_find_next - Find the range at or after an address
+ * @tree: the tree
+ * @addr: the address
+ * @range: filled with the range containing @addr if there is one, else
+ *         with the first range above @addr
+ *
+ * Returns false, leaving @range alone, if there is no such range.
+ */
+bool interval_tree_find_next(IntervalTree *tree, uint64_t addr,
+                             IntervalTreeRange *range);
+
+/**
+ * interval_tree_find_prev - Find the range at or before an address
+ * @tree: the tree
+ * @addr: the address
+ * @range: filled with the range containing @addr if there is one, else
+ *         with the last range below @addr
+ *
+ * Returns false, leaving @range alone, if there is no such range.
+ */
+bool interval_tree_find_prev(IntervalTree *tree, uint64_t addr,
+                             IntervalTreeRange *range);
+
+#endif
@@ -68,6 +68,34 @@ iov_to_buf(const struct iovec *iov, const unsigned int iov_cnt,
     }
 }
 
+/*
+ * A cursor remembers which element of an iovec the last access ended in,
+ * so that a series of accesses at increasing offsets walks the vector
+ * only once instead of from the start each time.  Offsets are still
+ * relative to the start of the vector, and accesses at a lower offset
+ * than the previous one are allowed but rewind the cursor.
+ *
+ * The functions behave like iov_from_buf(), iov_to_buf() and, for
+ * iov_cursor_copy(), like an iov_to_buf() from `src' into an
+ * iov_from_buf() to `dst'.  The vector must not change while a
+ * cursor is in use.
+ */
+typedef struct IOVCursor {
+    const struct iovec *iov;
+    unsigned int iov_cnt;
+    unsigned int idx;           /* element of the last access */
+    size_t base;                /* offset of iov[idx] in the vector */
+} IOVCursor;
+
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt);
+size_t iov_cursor_from_buf(IOVCursor *cur, size_t offset,
+                           const void *buf, size_t bytes);
+size_t iov_cursor_to_buf(IOVCursor *cur, size_t offset,
+                         void *buf, size_t bytes);
+size_t iov_cursor_copy(IOVCursor *dst, size_t dst_offset,
+                       IOVCursor *src, size_t src_offset, size_t bytes);
+
 /**
  * Set data bytes pointed out by iovec `iov' of size `iov_cnt' elements,
  * starting at byte offset `start', to value `fillc', repeating it
@@ -13,8 +13,10 @@
 
 struct qht {
     struct qht_map *map;
-    QemuMutex lock; /* serializes setters of ht->map */
+    QemuMutex lock; /* serializes setters of ht->map and resize steps */
     unsigned int mode;
+    size_t n_lookup_retries;
+    size_t n_lock_contentions;
 };
 
 /**
@@ -26,10 +28,20 @@ struct qht {
  *         chain, excluding empty chains.
  * @occupancy: frequency distribution representing chain occupancy rate.
  *             Valid range: from 0.0 (empty) to 1.0 (full occupancy).
+ * @resize_pending: number of head buckets that an ongoing resize has yet to
+ *                  migrate; 0 if no resize is in progress.
+ * @lookup_retries: number of lookups that had to be retried because they
+ *                  raced with a write to the same bucket.
+ * @lock_contentions: number of bucket lock acquisitions that had to wait for
+ *                    another writer.
  *
  * An entry is a pointer-hash pair.
  * Each bucket can host several entries.
  * Chains are chains of buckets, whose first link is always a head bucket.
+ *
+ * While a resize is in progress, the head buckets that have not been
+ * migrated yet and those of the new map are accounted for together.
+ * @lookup_retries and @lock_contentions count from qht_init().
  */
 struct qht_stats {
     size_t head_buckets;
@@ -37,6 +49,9 @@ struct qht_stats {
     size_t entries;
     struct qdist chain;
     struct qdist occupancy;
+    size_t resize_pending;
+    size_t lookup_retries;
+    size_t lock_contentions;
 };
 
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
@@ -146,6 +161,10 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * Entries are migrated one head bucket at a time, so that concurrent readers
+ * and writers are only held up by the migration of their own bucket. Any
+ * auto-resize in progress is completed first.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
@@ -160,6 +179,8 @@ bool qht_resize(struct qht *ht, size_t n_elems);
  *
  * Each time it is called, user-provided @func is passed a pointer-hash pair,
  * plus @userp.
+ *
+ * Writers are held up while iterating, and @func must not modify @ht.
  */
 void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
 
@@ -170,6 +191,7 @@ void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
  *
  * Does NOT need to be called under an RCU read-critical section,
  * since it does not dereference any pointers stored in the hash table.
+ * It does hold up resizes while it runs, though.
  *
  * When done with @stats, pass the struct to qht_statistics_destroy().
  * Failing to do this will leak memory.
@@ -55,6 +55,8 @@ extern unsigned long rcu_gp_ctr;
 
 extern QemuEvent rcu_gp_event;
 
+struct rcu_head;
+
 struct rcu_reader_data {
     /* Data used by both reader and synchronize_rcu() */
     unsigned long ctr;
@@ -63,6 +65,14 @@ struct rcu_reader_data {
     /* Data used by reader only */
     unsigned depth;
 
+    /* Callbacks queued by call_rcu1() and not yet handed over to the
+     * call_rcu thread, newest first.  Pushed by the reader, taken by
+     * either the reader or the call_rcu thread.
+     */
+    struct rcu_head *batch;
+    unsigned batch_count;
+    bool registered;
+
     /* Data used for registry, protected by rcu_registry_lock */
     QLIST_ENTRY(rcu_reader_data) node;
 };
@@ -117,6 +127,16 @@ struct rcu_head {
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 
+typedef struct RCUStats {
+    uint64_t grace_periods;     /* completed synchronize_rcu() calls */
+    uint64_t gp_total_ns;       /* time spent in them */
+    uint64_t gp_max_ns;         /* longest of them */
+    uint64_t callbacks;         /* callbacks run by the call_rcu thread */
+    uint64_t backlog_max;       /* most callbacks ever waiting to be run */
+} RCUStats;
+
+extern void rcu_get_stats(RCUStats *stats);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
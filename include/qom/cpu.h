@@ -228,6 +228,16 @@ struct CPUWatchpoint {
 struct KVMState;
 struct kvm_run;
 
+/**
+ * CPUExitStats:
+ * @count: Number of exits.
+ * @ns: Time spent in QEMU handling them, until guest code ran again.
+ */
+typedef struct CPUExitStats {
+    uint64_t count;
+    uint64_t ns;
+} CPUExitStats;
+
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
@@ -238,8 +248,23 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool exclusive;
 };
 
+/* TLB flushes requested by other threads, run later by the vCPU itself */
+#define TLB_FLUSH_QUEUE_PAGES 16
+
+typedef struct TLBFlushQueue {
+    bool queued;        /* a work item to run the queue is pending */
+    bool full;          /* flush the whole TLB */
+    uint32_t idxmap;    /* MMU modes to flush entirely */
+    int nr_pages;
+    struct {
+        vaddr addr;
+        uint32_t idxmap;
+    } pages[TLB_FLUSH_QUEUE_PAGES];
+} TLBFlushQueue;
+
 /**
  * CPUState:
  * @cpu_index: CPU index (informative).
@@ -280,8 +305,17 @@ struct qemu_work_item {
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @exit_stats: Exits to QEMU by reason, set up by the accelerator.
+ * @exit_stats_names: Name of each @exit_stats entry.
+ * @exit_stats_nr: Number of @exit_stats entries.
+ * @run_ns: Time spent running guest code.
+ * @halt_count: Number of waits for work while halted.
+ * @halt_ns: Time spent in those waits.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
+ * @tlb_flush_lock: Lock protecting @tlb_flush_queue, and the TLB tables
+ *   against being reallocated while another thread walks them.
+ * @tlb_flush_queue: Coalesced TLB flushes requested by other threads.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
  *
  * State of one CPU core or thread.
@@ -319,6 +353,9 @@ struct CPUState {
     QemuMutex work_mutex;
     struct qemu_work_item *queued_work_first, *queued_work_last;
 
+    QemuMutex tlb_flush_lock;
+    TLBFlushQueue tlb_flush_queue;
+
     CPUAddressSpace *cpu_ases;
     int num_ases;
     AddressSpace *as;
@@ -350,6 +387,14 @@ struct CPUState {
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
 
+    /* Written by the vCPU thread only; readers take plain snapshots */
+    CPUExitStats *exit_stats;
+    const char *const *exit_stats_names;
+    int exit_stats_nr;
+    uint64_t run_ns;
+    uint64_t halt_count;
+    uint64_t halt_ns;
+
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate, TRACE_VCPU_EVENT_COUNT);
 
@@ -367,6 +412,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Percentage of time this vcpu is throttled, see cpu_throttle_set */
+    int throttle_percentage;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -387,6 +434,20 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether TCG runs each vCPU in its own thread (MTTCG) rather
+ * than round-robin on a single thread.
+ *
+ * Returns: %true if we are in MTTCG mode, %false otherwise.
+ */
+#ifdef CONFIG_USER_ONLY
+#define qemu_tcg_mttcg_enabled() false
+#else
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+#endif
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -635,6 +696,20 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * while no other vCPU is executing guest code.  With MTTCG every vCPU is
+ * kicked out of its execution loop and held there until @func has run; in
+ * all other modes this is the same as async_run_on_cpu().
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -669,10 +744,21 @@ bool cpu_exists(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time, 0 or 1 to 99.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  0 stops throttling @cpu,
+ * leaving the other vcpus alone.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set or
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -687,6 +773,7 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * If vcpus are throttled differently, this is the highest percentage.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
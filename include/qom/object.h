@@ -375,9 +375,19 @@ struct ObjectClass
     const char *object_cast_cache[OBJECT_CLASS_CAST_CACHE];
     const char *class_cast_cache[OBJECT_CLASS_CAST_CACHE];
 
+    /* Types this class does and does not cast to, see
+     * object_class_dynamic_cast()
+     */
+    Type cast_is_a_cache[OBJECT_CLASS_CAST_CACHE];
+    Type cast_is_not_cache[OBJECT_CLASS_CAST_CACHE];
+
     ObjectUnparent *unparent;
 
     GHashTable *properties;
+
+    /* Lookups through the class hierarchy, see object_class_property_find() */
+    GHashTable *property_cache;
+    unsigned int property_cache_gen;
 };
 
 /**
@@ -59,6 +59,7 @@ QemuOpts *drive_def(const char *optstr);
 QemuOpts *drive_add(BlockInterfaceType type, int index, const char *file,
                     const char *optstr);
 DriveInfo *drive_new(QemuOpts *arg, BlockInterfaceType block_default_type);
+bool drive_new_all(BlockInterfaceType block_default_type);
 
 /* device-hotplug */
 
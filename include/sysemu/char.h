@@ -62,6 +62,9 @@ struct CharDriverState {
     QemuMutex chr_write_lock;
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    /* optional, may write only part of the data like chr_write */
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     int (*chr_sync_read)(struct CharDriverState *s,
                          const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(struct CharDriverState *s, GIOCondition cond);
@@ -281,6 +284,23 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
  */
 int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev_all:
+ *
+ * Write the data described by an I/O vector to a character backend, like
+ * @qemu_chr_fe_write_all.  Back ends with a vectored write path, such as
+ * socket chardevs, get the whole vector at once; the data is not copied
+ * and no other writer can interleave with it.  This function is
+ * thread-safe.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev_all(CharDriverState *s, const struct iovec *iov,
+                           int iovcnt);
+
 /**
  * @qemu_chr_fe_read_all:
  *
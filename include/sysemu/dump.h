@@ -177,6 +177,9 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+    bool exclude_zero;          /* leave zero pages out of kdump output */
+    bool live;                  /* dump while the guest keeps running */
+    unsigned long *live_bitmap; /* pages dirtied since they were written */
     DumpStatus status;          /* current dump status */
 
     bool has_format;              /* whether format is provided */
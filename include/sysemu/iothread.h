@@ -28,6 +28,22 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* AioContext thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* Guest NUMA node whose host CPUs the thread runs on, -1 if unbound */
+    int64_t numa_node;
+
+    /* Runs the AioContext once something needs glib sources, see below */
+    GOnce once;
+    GMainContext *worker_context;
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -36,4 +52,20 @@ typedef struct {
 char *iothread_get_id(IOThread *iothread);
 AioContext *iothread_get_aio_context(IOThread *iothread);
 
+/*
+ * Resolve a colon-separated list of IOThread ids, as used by the
+ * vq-iothreads device properties.  Each IOThread in the returned array
+ * holds a reference; release them with iothread_list_free().
+ */
+IOThread **iothread_parse_list(const char *list, unsigned *num, Error **errp);
+void iothread_list_free(IOThread **iothreads, unsigned num);
+
+/*
+ * Return a GMainContext that the IOThread runs, for code that relies on
+ * glib sources such as chardev handlers.  The AioContext of the thread
+ * is one of its sources, so both keep being served; callbacks of either
+ * are called with the AioContext acquired.
+ */
+GMainContext *iothread_get_g_main_context(IOThread *iothread);
+
 #endif /* IOTHREAD_H */
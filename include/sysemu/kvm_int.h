@@ -20,6 +20,8 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Last KVM_GET_DIRTY_LOG, with manual dirty log protection */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
@@ -3,12 +3,15 @@
 
 #include "qemu/bitmap.h"
 #include "qemu/option.h"
+#include "qemu/thread.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/hostmem.h"
 #include "hw/boards.h"
 
 extern int nb_numa_nodes;   /* Number of NUMA nodes */
 
+#define MAX_HOST_CPUS 1024
+
 struct numa_addr_range {
     ram_addr_t mem_start;
     ram_addr_t mem_end;
@@ -20,6 +23,8 @@ typedef struct node_info {
     DECLARE_BITMAP(node_cpu, MAX_CPUMASK_BITS);
     struct HostMemoryBackend *node_memdev;
     bool present;
+    bool has_host_cpus;
+    DECLARE_BITMAP(host_cpus, MAX_HOST_CPUS);
     QLIST_HEAD(, numa_addr_range) addr; /* List to store address ranges */
 } NodeInfo;
 
@@ -31,5 +36,7 @@ extern QemuOptsList qemu_numa_opts;
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
+int numa_get_node_for_cpu(int idx);
+void numa_set_thread_affinity(QemuThread *thread, int nodeid, Error **errp);
 
 #endif
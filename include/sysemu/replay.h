@@ -51,6 +51,9 @@ void replay_start(void);
 void replay_finish(void);
 /*! Adds replay blocker with the specified error description */
 void replay_add_blocker(Error *reason);
+/*! Returns the name of the snapshot to start replaying from, as requested
+    with rrseek, or NULL.  The caller frees it. */
+char *replay_get_seek_snapshot(void);
 
 /* Processing the instructions */
 
@@ -121,6 +121,9 @@ struct QemuConsoleClass {
 };
 
 #define QEMU_ALLOCATED_FLAG     0x01
+/* dpy_gfx_update() rectangles cover exactly what changed in the surface,
+ * so listeners need not compare the contents to find the changes.  */
+#define QEMU_EXACT_DAMAGE_FLAG  0x02
 
 struct PixelFormat {
     uint8_t bits_per_pixel;
@@ -140,6 +143,7 @@ struct DisplaySurface {
     GLenum glformat;
     GLenum gltype;
     GLuint texture;
+    pixman_region32_t gldirty;  /* not yet uploaded to texture */
 #endif
 };
 
@@ -262,6 +266,11 @@ static inline int is_buffer_shared(DisplaySurface *surface)
     return !(surface->flags & QEMU_ALLOCATED_FLAG);
 }
 
+static inline bool surface_has_exact_damage(DisplaySurface *surface)
+{
+    return surface->flags & QEMU_EXACT_DAMAGE_FLAG;
+}
+
 void register_displaychangelistener(DisplayChangeListener *dcl);
 void update_displaychangelistener(DisplayChangeListener *dcl,
                                   uint64_t interval);
@@ -25,6 +25,12 @@
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#if defined(CONFIG_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <poll.h>
+#include <linux/errqueue.h>
+#define QIO_CHANNEL_SOCKET_ZEROCOPY
+#endif
+
 #define SOCKET_MAX_FDS 16
 
 SocketAddress *
@@ -392,6 +398,125 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     return NULL;
 }
 
+#ifdef QIO_CHANNEL_SOCKET_ZEROCOPY
+int qio_channel_socket_set_zerocopy(QIOChannelSocket *ioc,
+                                    bool enabled,
+                                    Error **errp)
+{
+    int v = enabled;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Unable to set zero copy writes");
+        return -1;
+    }
+    ioc->zerocopy = enabled;
+    return 0;
+}
+
+uint32_t qio_channel_socket_zerocopy_mark(QIOChannelSocket *ioc)
+{
+    return ioc->zerocopy_queued;
+}
+
+/*
+ * Read one completion from the error queue.  TCP completes writes in
+ * order, so the end of its range tells how far the kernel got.
+ * Returns 1 if there was one, 0 if not, -1 on error.
+ */
+static int qio_channel_socket_zerocopy_reap(QIOChannelSocket *ioc,
+                                            Error **errp)
+{
+    struct msghdr msg = { NULL, };
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+ retry:
+    if (recvmsg(ioc->fd, &msg, MSG_ERRQUEUE) < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            goto retry;
+        }
+        error_setg_errno(errp, errno, "Unable to read socket error queue");
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg ||
+        !((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == SOL_IPV6 &&
+           cmsg->cmsg_type == IPV6_RECVERR))) {
+        error_setg(errp, "Unexpected message in socket error queue");
+        return -1;
+    }
+    serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+        error_setg_errno(errp, serr->ee_errno, "Zero copy write failed");
+        return -1;
+    }
+    if ((int32_t)(serr->ee_data + 1 - ioc->zerocopy_done) > 0) {
+        ioc->zerocopy_done = serr->ee_data + 1;
+    }
+    return 1;
+}
+
+int qio_channel_socket_zerocopy_wait(QIOChannelSocket *ioc,
+                                     uint32_t mark,
+                                     Error **errp)
+{
+    struct pollfd pfd = { .fd = ioc->fd };
+    int ret;
+
+    while ((int32_t)(mark - ioc->zerocopy_done) > 0) {
+        ret = qio_channel_socket_zerocopy_reap(ioc, errp);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret) {
+            continue;
+        }
+        /* completions raise POLLERR, whatever is asked for */
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            error_setg_errno(errp, errno, "Unable to poll socket");
+            return -1;
+        }
+        if ((pfd.revents & POLLHUP) && !(pfd.revents & POLLERR)) {
+            error_setg(errp, "Socket closed with zero copy writes pending");
+            return -1;
+        }
+    }
+    return 0;
+}
+#else /* QIO_CHANNEL_SOCKET_ZEROCOPY */
+int qio_channel_socket_set_zerocopy(QIOChannelSocket *ioc,
+                                    bool enabled,
+                                    Error **errp)
+{
+    if (enabled) {
+        error_setg(errp, "Zero copy writes are not supported on this host");
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t qio_channel_socket_zerocopy_mark(QIOChannelSocket *ioc)
+{
+    return 0;
+}
+
+int qio_channel_socket_zerocopy_wait(QIOChannelSocket *ioc,
+                                     uint32_t mark,
+                                     Error **errp)
+{
+    return 0;
+}
+#endif /* QIO_CHANNEL_SOCKET_ZEROCOPY */
+
 static void qio_channel_socket_init(Object *obj)
 {
     QIOChannelSocket *ioc = QIO_CHANNEL_SOCKET(obj);
@@ -529,6 +654,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
+    int sflags = 0;
 
     memset(control, 0, CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS));
 
@@ -553,8 +679,14 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         memcpy(CMSG_DATA(cmsg), fds, fdsize);
     }
 
+#ifdef QIO_CHANNEL_SOCKET_ZEROCOPY
+    if (sioc->zerocopy) {
+        sflags |= MSG_ZEROCOPY;
+    }
+#endif
+
  retry:
-    ret = sendmsg(sioc->fd, &msg, 0);
+    ret = sendmsg(sioc->fd, &msg, sflags);
     if (ret <= 0) {
         if (errno == EAGAIN) {
             return QIO_CHANNEL_ERR_BLOCK;
@@ -562,10 +694,21 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         if (errno == EINTR) {
             goto retry;
         }
+        if (errno == ENOBUFS && sioc->zerocopy) {
+            /* too much data pinned, let the kernel release some */
+            if (qio_channel_socket_zerocopy_wait(sioc, sioc->zerocopy_queued,
+                                                 errp) < 0) {
+                return -1;
+            }
+            goto retry;
+        }
         error_setg_errno(errp, errno,
                          "Unable to write to socket");
         return -1;
     }
+    if (sioc->zerocopy) {
+        sioc->zerocopy_queued++;
+    }
     return ret;
 }
 #else /* WIN32 */
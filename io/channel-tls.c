@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 
 
@@ -72,6 +73,7 @@ qio_channel_tls_new_server(QIOChannel *master,
     ioc = QIO_CHANNEL_TLS(object_new(TYPE_QIO_CHANNEL_TLS));
 
     ioc->master = master;
+    ioc->ktls = creds->ktls;
     object_ref(OBJECT(master));
 
     ioc->session = qcrypto_tls_session_new(
@@ -111,6 +113,7 @@ qio_channel_tls_new_client(QIOChannel *master,
     ioc = QIO_CHANNEL(tioc);
 
     tioc->master = master;
+    tioc->ktls = creds->ktls;
     if (master->features & (1 << QIO_CHANNEL_FEATURE_SHUTDOWN)) {
         ioc->features |= (1 << QIO_CHANNEL_FEATURE_SHUTDOWN);
     }
@@ -145,6 +148,35 @@ static gboolean qio_channel_tls_handshake_io(QIOChannel *ioc,
                                              GIOCondition condition,
                                              gpointer user_data);
 
+/*
+ * Offloading is best effort: if the kernel, the negotiated cipher
+ * or the underlying channel does not allow it, the session simply
+ * keeps doing the record encryption in user space.
+ */
+static void qio_channel_tls_offload(QIOChannelTLS *ioc)
+{
+    Error *err = NULL;
+    bool rx;
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        trace_qio_channel_tls_offload_fail(ioc, "not a socket");
+        return;
+    }
+
+    if (qcrypto_tls_session_offload(ioc->session,
+                                    QIO_CHANNEL_SOCKET(ioc->master)->fd,
+                                    &rx, &err) < 0) {
+        trace_qio_channel_tls_offload_fail(ioc, error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    trace_qio_channel_tls_offload(ioc, rx);
+    ioc->ktls_tx = true;
+    ioc->ktls_rx = rx;
+}
+
+
 static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
                                            QIOTask *task)
 {
@@ -167,6 +199,9 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             goto cleanup;
         }
         trace_qio_channel_tls_credentials_allow(ioc);
+        if (ioc->ktls) {
+            qio_channel_tls_offload(ioc);
+        }
         qio_task_complete(task);
     } else {
         GIOCondition condition;
@@ -245,6 +280,10 @@ static ssize_t qio_channel_tls_readv(QIOChannel *ioc,
     size_t i;
     ssize_t got = 0;
 
+    if (tioc->ktls_rx) {
+        return qio_channel_readv(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_read(tioc->session,
                                                iov[i].iov_base,
@@ -282,6 +321,10 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->ktls_tx) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
@@ -20,6 +20,10 @@
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "block/thread-pool.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "sysemu/numa.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -28,6 +32,12 @@ typedef ObjectClass IOThreadClass;
 #define IOTHREAD_CLASS(klass) \
    OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
 
+/* Benchmark results from 2016 on NVMe SSD drives show max polling times around
+ * 16-32 microseconds yield IOPS improvements for both iodepth=1 and iodepth=32
+ * workloads.
+ */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -42,10 +52,17 @@ static void *iothread_run(void *opaque)
 
     while (!iothread->stopping) {
         aio_context_acquire(iothread->ctx);
-        blocking = true;
-        while (!iothread->stopping && aio_poll(iothread->ctx, blocking)) {
-            /* Progress was made, keep going */
-            blocking = false;
+        if (atomic_mb_read(&iothread->worker_context)) {
+            /* Contention on the AioContext wakes this up like aio_poll */
+            g_main_context_iteration(iothread->worker_context, TRUE);
+        } else {
+            blocking = true;
+            while (!iothread->stopping &&
+                   !atomic_read(&iothread->worker_context) &&
+                   aio_poll(iothread->ctx, blocking)) {
+                /* Progress was made, keep going */
+                blocking = false;
+            }
         }
         aio_context_release(iothread->ctx);
     }
@@ -54,6 +71,16 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_min = 0;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    iothread->numa_node = -1;
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -66,9 +93,38 @@ static void iothread_instance_finalize(Object *obj)
     qemu_thread_join(&iothread->thread);
     qemu_cond_destroy(&iothread->init_done_cond);
     qemu_mutex_destroy(&iothread->init_done_lock);
+    if (iothread->worker_context) {
+        g_main_context_unref(iothread->worker_context);
+    }
     aio_context_unref(iothread->ctx);
 }
 
+static void iothread_set_aio_context_poll_params(IOThread *iothread,
+                                                  Error **errp)
+{
+    aio_context_set_poll_params(iothread->ctx,
+                                iothread->poll_max_ns,
+                                iothread->poll_grow,
+                                iothread->poll_shrink,
+                                errp);
+}
+
+static void iothread_set_aio_context_thread_pool_params(IOThread *iothread,
+                                                        Error **errp)
+{
+    aio_context_set_thread_pool_params(iothread->ctx,
+                                       iothread->thread_pool_min,
+                                       iothread->thread_pool_max,
+                                       errp);
+}
+
+static void iothread_set_numa_affinity(IOThread *iothread, Error **errp)
+{
+    if (iothread->numa_node >= 0) {
+        numa_set_thread_affinity(&iothread->thread, iothread->numa_node, errp);
+    }
+}
+
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     Error *local_error = NULL;
@@ -83,6 +139,17 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    iothread_set_aio_context_poll_params(iothread, &local_error);
+    if (!local_error) {
+        iothread_set_aio_context_thread_pool_params(iothread, &local_error);
+    }
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
@@ -103,12 +170,111 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    iothread_set_numa_affinity(iothread, errp);
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    /* pushes the new value to the AioContext */
+    void (*apply)(IOThread *iothread, Error **errp);
+} IOThreadParamInfo;
+
+static IOThreadParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+    iothread_set_aio_context_poll_params,
+};
+static IOThreadParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+    iothread_set_aio_context_poll_params,
+};
+static IOThreadParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+    iothread_set_aio_context_poll_params,
+};
+static IOThreadParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+    iothread_set_aio_context_thread_pool_params,
+};
+static IOThreadParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+    iothread_set_aio_context_thread_pool_params,
+};
+static IOThreadParamInfo numa_node_info = {
+    "numa-node", offsetof(IOThread, numa_node),
+    iothread_set_numa_affinity,
+};
+
+static void iothread_get_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, name, field, errp);
+}
+
+static void iothread_set_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0) {
+        error_setg(&local_err, "%s value must be in range [0, %"PRId64"]",
+                   info->name, INT64_MAX);
+        goto out;
+    }
+
+    *field = value;
+
+    if (iothread->ctx) {
+        info->apply(iothread, &local_err);
+    }
+
+out:
+    error_propagate(errp, local_err);
 }
 
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
     ucc->complete = iothread_complete;
+
+    object_class_property_add(klass, "poll-max-ns", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &poll_max_ns_info, &error_abort);
+    object_class_property_add(klass, "poll-grow", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &poll_grow_info, &error_abort);
+    object_class_property_add(klass, "poll-shrink", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_param,
+                              iothread_set_param,
+                              NULL, &numa_node_info, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -116,6 +282,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -140,6 +307,69 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+IOThread **iothread_parse_list(const char *list, unsigned *num, Error **errp)
+{
+    gchar **ids = g_strsplit(list, ":", -1);
+    IOThread **iothreads;
+    unsigned i, n = g_strv_length(ids);
+
+    if (n == 0) {
+        error_setg(errp, "the list of iothreads is empty");
+        g_strfreev(ids);
+        return NULL;
+    }
+
+    iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "'%s' is not an iothread", ids[i]);
+            iothread_list_free(iothreads, i);
+            g_strfreev(ids);
+            return NULL;
+        }
+        iothreads[i] = IOTHREAD(obj);
+        object_ref(obj);
+    }
+
+    g_strfreev(ids);
+    *num = n;
+    return iothreads;
+}
+
+void iothread_list_free(IOThread **iothreads, unsigned num)
+{
+    unsigned i;
+
+    for (i = 0; i < num; i++) {
+        object_unref(OBJECT(iothreads[i]));
+    }
+    g_free(iothreads);
+}
+
+static gpointer iothread_g_main_context_init(gpointer opaque)
+{
+    IOThread *iothread = opaque;
+    GMainContext *context = g_main_context_new();
+    GSource *source = aio_get_g_source(iothread->ctx);
+
+    g_source_attach(source, context);
+    g_source_unref(source);
+
+    /* Get the thread out of aio_poll, it runs the context from now on */
+    atomic_mb_set(&iothread->worker_context, context);
+    aio_notify(iothread->ctx);
+    return NULL;
+}
+
+GMainContext *iothread_get_g_main_context(IOThread *iothread)
+{
+    g_once(&iothread->once, iothread_g_main_context_init, iothread);
+    return iothread->worker_context;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
@@ -155,6 +385,9 @@ static int query_one_iothread(Object *object, void *opaque)
     info = g_new0(IOThreadInfo, 1);
     info->id = iothread_get_id(iothread);
     info->thread_id = iothread->thread_id;
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_grow = iothread->poll_grow;
+    info->poll_shrink = iothread->poll_shrink;
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -34,6 +34,7 @@
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "hw/irq.h"
 
@@ -86,6 +87,7 @@ struct KVMState
 #endif
     int many_ioeventfds;
     int intx_set_mask;
+    bool manual_dirty_log_protect;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -272,6 +274,10 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    g_free(cpu->exit_stats);
+    cpu->exit_stats = NULL;
+    cpu->exit_stats_nr = 0;
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
@@ -280,6 +286,49 @@ err:
     return ret;
 }
 
+#define KVM_EXIT_STATS_OTHER (KVM_EXIT_HYPERV + 1)
+
+static const char *const kvm_exit_reason_names[] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic-eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    /* exit reasons this QEMU has no name for share the last counter */
+    [KVM_EXIT_STATS_OTHER] = "other",
+};
+
+static inline int kvm_count_exit(CPUState *cpu, uint32_t reason)
+{
+    int i = MIN(reason, KVM_EXIT_STATS_OTHER);
+
+    cpu->exit_stats[i].count++;
+    return i;
+}
+
 static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 {
     struct KVMParkedVcpu *cpu;
@@ -315,6 +364,9 @@ int kvm_init_vcpu(CPUState *cpu)
     cpu->kvm_fd = ret;
     cpu->kvm_state = s;
     cpu->kvm_vcpu_dirty = true;
+    cpu->exit_stats = g_new0(CPUExitStats, KVM_EXIT_STATS_OTHER + 1);
+    cpu->exit_stats_names = kvm_exit_reason_names;
+    cpu->exit_stats_nr = KVM_EXIT_STATS_OTHER + 1;
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -372,6 +424,12 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
         return 0;
     }
 
+    /* KVM forgets the dirty log when it stops, and so do we */
+    if (!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
+    }
+
     return kvm_set_user_memory_region(kml, mem);
 }
 
@@ -437,6 +495,52 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/*
+ * Write protect again the pages [@start, @end) of @mem, counted from the
+ * start of the slot, that the last KVM_GET_DIRTY_LOG returned as dirty.
+ * Pages dirtied since then are left alone: QEMU hasn't seen them yet.
+ */
+static int kvm_slot_log_clear(KVMMemoryListener *kml, KVMSlot *mem,
+                              uint64_t start, uint64_t end)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t slot_pages = mem->memory_size >> TARGET_PAGE_BITS;
+    uint64_t first, last;
+    unsigned long *bitmap;
+    int ret = 0;
+
+    if (!mem->dirty_bmap || !(mem->flags & KVM_MEM_LOG_DIRTY_PAGES) ||
+        start >= end) {
+        return 0;
+    }
+
+    /* KVM wants the range aligned to 64 pages, except at the end */
+    first = QEMU_ALIGN_DOWN(start, 64);
+    last = MIN(QEMU_ALIGN_UP(end, 64), slot_pages);
+
+    bitmap = bitmap_new(last - first);
+    bitmap_copy(bitmap, mem->dirty_bmap + BIT_WORD(first), last - first);
+    bitmap_clear(bitmap, 0, start - first);
+    bitmap_clear(bitmap, end - first, last - end);
+
+    if (!bitmap_empty(bitmap, last - first)) {
+        d.slot = mem->slot | (kml->as_id << 16);
+        d.first_page = first;
+        d.num_pages = last - first;
+        d.dirty_bitmap = bitmap;
+        if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) < 0) {
+            DPRINTF("ioctl failed %d\n", errno);
+            ret = -1;
+        } else {
+            bitmap_clear(mem->dirty_bmap, start, end - start);
+        }
+    }
+    g_free(bitmap);
+
+    return ret;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
@@ -451,13 +555,15 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
 {
     KVMState *s = kvm_state;
     unsigned long size, allocated_size = 0;
+    unsigned long *bitmap = NULL;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    bool migrating = memory_region_get_dirty_log_mask(section->mr) &
+                     (1 << DIRTY_MEMORY_MIGRATION);
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -478,13 +584,22 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            /* kvm_slot_log_clear() needs it later */
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!bitmap) {
+                bitmap = g_malloc(size);
+            } else if (size > allocated_size) {
+                bitmap = g_realloc(bitmap, size);
+            }
+            allocated_size = size;
+            memset(bitmap, 0, allocated_size);
+            d.dirty_bitmap = bitmap;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -494,13 +609,58 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+
+        /* With manual protection the pages stay writable until cleared.
+         * Migration clears them a chunk at a time, right before sending
+         * them; without it, do what KVM_GET_DIRTY_LOG used to do.
+         */
+        if (s->manual_dirty_log_protect && !migrating) {
+            ret = kvm_slot_log_clear(kml, mem, 0,
+                                     mem->memory_size >> TARGET_PAGE_BITS);
+            if (ret < 0) {
+                break;
+            }
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(bitmap);
 
     return ret;
 }
 
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section)
+{
+    KVMSlot *mem;
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+    hwaddr slot_end;
+    int ret;
+
+    while (start_addr < end_addr) {
+        mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
+        if (mem == NULL) {
+            break;
+        }
+
+        /* round outwards: clearing a page QEMU already knows is dirty is
+         * harmless, keeping one that migration sends isn't
+         */
+        slot_end = mem->start_addr + mem->memory_size;
+        start_addr = MAX(start_addr, mem->start_addr);
+        ret = kvm_slot_log_clear(kml, mem,
+            (start_addr - mem->start_addr) >> TARGET_PAGE_BITS,
+            DIV_ROUND_UP(MIN(end_addr, slot_end) - mem->start_addr,
+                         TARGET_PAGE_SIZE));
+        if (ret < 0) {
+            return ret;
+        }
+        start_addr = slot_end;
+    }
+
+    return 0;
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -752,6 +912,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -880,6 +1042,18 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    int r;
+
+    r = kvm_physical_log_clear(kml, section);
+    if (r < 0) {
+        abort();
+    }
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -966,6 +1140,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    if (s->manual_dirty_log_protect) {
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1734,6 +1911,17 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    /* Have KVM_GET_DIRTY_LOG leave the pages writable, so that migration
+     * can write protect them again a bit at a time instead of the whole
+     * slot on every sync.
+     */
+    if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) &
+        KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) {
+        s->manual_dirty_log_protect =
+            !kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                               KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1833,9 +2021,10 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
     if (s->coalesced_mmio_ring) {
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
+        while (ring->first != atomic_read(&ring->last)) {
             struct kvm_coalesced_mmio *ent;
 
+            smp_rmb(); /* entry was written before ring->last */
             ent = &ring->coalesced_mmio[ring->first];
 
             cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
@@ -1894,6 +2083,8 @@ int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
     int ret, run_ret;
+    int64_t run_start, exit_start = 0;
+    int exit_stat = -1;
 
     DPRINTF("kvm_cpu_exec()\n");
 
@@ -1923,13 +2114,23 @@ int kvm_cpu_exec(CPUState *cpu)
             qemu_cpu_kick_self();
         }
 
+        run_start = get_clock();
+        if (exit_stat >= 0) {
+            cpu->exit_stats[exit_stat].ns += run_start - exit_start;
+            exit_stat = -1;
+        }
+
         run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
 
+        exit_start = get_clock();
+        cpu->run_ns += exit_start - run_start;
+
         attrs = kvm_arch_post_run(cpu, run);
 
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
+                exit_stat = kvm_count_exit(cpu, KVM_EXIT_INTR);
                 ret = EXCP_INTERRUPT;
                 break;
             }
@@ -1948,6 +2149,7 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        exit_stat = kvm_count_exit(cpu, run->exit_reason);
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -2017,6 +2219,11 @@ int kvm_cpu_exec(CPUState *cpu)
 
     qemu_mutex_lock_iothread();
 
+    /* The last exit is handled once the BQL is back; include the wait */
+    if (exit_stat >= 0) {
+        cpu->exit_stats[exit_stat].ns += get_clock() - exit_start;
+    }
+
     if (ret < 0) {
         cpu_dump_state(cpu, stderr, fprintf, CPU_DUMP_CODE);
         vm_stop(RUN_STATE_INTERNAL_ERROR);
@@ -2158,6 +2365,11 @@ int kvm_has_vcpu_events(void)
     return kvm_state->vcpu_events;
 }
 
+int kvm_has_manual_dirty_log_protect(void)
+{
+    return kvm_state->manual_dirty_log_protect;
+}
+
 int kvm_has_robust_singlestep(void)
 {
     return kvm_state->robust_singlestep;
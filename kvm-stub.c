@@ -73,6 +73,11 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+int kvm_has_manual_dirty_log_protect(void)
+{
+    return 0;
+}
+
 void kvm_setup_guest_memory(void *start, size_t size)
 {
 }
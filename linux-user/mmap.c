@@ -49,10 +49,12 @@ void mmap_fork_start(void)
     if (mmap_lock_count)
         abort();
     pthread_mutex_lock(&mmap_mutex);
+    page_fork_start();
 }
 
 void mmap_fork_end(int child)
 {
+    page_fork_end(child);
     if (child)
         pthread_mutex_init(&mmap_mutex, NULL);
     else
@@ -206,7 +208,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
-    int prot;
+    target_ulong map_start, map_last;
     int looped = 0;
 
     if (size > reserved_va) {
@@ -218,26 +220,23 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
     if (end_addr > reserved_va) {
         end_addr = reserved_va;
     }
-    addr = end_addr - qemu_host_page_size;
 
+    /* Search downwards, jumping below each mapping in the way */
     while (1) {
-        if (addr > end_addr) {
+        if (end_addr < size) {
             if (looped) {
                 return (abi_ulong)-1;
             }
             end_addr = reserved_va;
-            addr = end_addr - qemu_host_page_size;
             looped = 1;
             continue;
         }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr + size == end_addr) {
+        addr = (end_addr - size) & qemu_host_page_mask;
+        if (!page_find_next_range(addr, &map_start, &map_last) ||
+            map_start >= (target_ulong)addr + size) {
             break;
         }
-        addr -= qemu_host_page_size;
+        end_addr = map_start & qemu_host_page_mask;
     }
 
     if (start == mmap_next_start) {
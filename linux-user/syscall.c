@@ -7301,6 +7301,89 @@ static target_timer_t get_timer_id(abi_long arg)
     return timerid;
 }
 
+/* When the guest has the host's syscall ABI (same architecture, word size
+ * and endianness), syscalls whose arguments need no conversion are handed
+ * to the host directly, without going through their case in do_syscall().
+ */
+#if (defined(TARGET_X86_64) && defined(HOST_X86_64)) || \
+    (defined(TARGET_AARCH64) && defined(HOST_AARCH64) && \
+     defined(TARGET_WORDS_BIGENDIAN) == defined(HOST_WORDS_BIGENDIAN))
+#define TARGET_ABI_IS_HOST_ABI
+
+/* Argument indexes below are 1-based; 0 means none.  */
+typedef struct PassthroughSyscall {
+    bool valid;
+    uint8_t fd;         /* fd argument: no passthrough if it is translated */
+    uint8_t buf;        /* guest buffer argument, checked and mapped to host */
+    uint8_t len;        /* length of @buf */
+    uint8_t access;     /* VERIFY_READ or VERIFY_WRITE for @buf */
+    bool direct;        /* embeds guest pointers: only if guest_base is 0 */
+    bool blocking;      /* may block: must go through safe_syscall() */
+} PassthroughSyscall;
+
+#define PASSTHROUGH(name, ...) \
+    [TARGET_NR_##name] = { .valid = true, __VA_ARGS__ }
+
+static const PassthroughSyscall passthrough_syscalls[] = {
+    PASSTHROUGH(read, .fd = 1, .buf = 2, .len = 3, .access = VERIFY_WRITE,
+                .blocking = true),
+    PASSTHROUGH(write, .fd = 1, .buf = 2, .len = 3, .access = VERIFY_READ,
+                .blocking = true),
+    PASSTHROUGH(pread64, .fd = 1, .buf = 2, .len = 3,
+                .access = VERIFY_WRITE, .blocking = true),
+    PASSTHROUGH(pwrite64, .fd = 1, .buf = 2, .len = 3,
+                .access = VERIFY_READ, .blocking = true),
+    PASSTHROUGH(readv, .fd = 1, .direct = true, .blocking = true),
+    PASSTHROUGH(writev, .fd = 1, .direct = true, .blocking = true),
+    PASSTHROUGH(preadv, .fd = 1, .direct = true, .blocking = true),
+    PASSTHROUGH(pwritev, .fd = 1, .direct = true, .blocking = true),
+    PASSTHROUGH(lseek, .fd = 1),
+    PASSTHROUGH(fsync, .fd = 1),
+    PASSTHROUGH(fdatasync, .fd = 1),
+    PASSTHROUGH(ftruncate, .fd = 1),
+    PASSTHROUGH(getppid),
+    PASSTHROUGH(gettid),
+    PASSTHROUGH(sched_yield),
+};
+
+/* Returns false if @num must take the slow path; with the same ABI, the
+ * guest syscall number is also the host one.  */
+static bool do_syscall_passthrough(int num, abi_long *args, abi_long *ret)
+{
+    const PassthroughSyscall *pt;
+
+    if (num < 0 || num >= ARRAY_SIZE(passthrough_syscalls)) {
+        return false;
+    }
+    pt = &passthrough_syscalls[num];
+    if (!pt->valid || (pt->direct && guest_base)) {
+        return false;
+    }
+    if (pt->fd && (fd_trans_target_to_host_data(args[pt->fd - 1]) ||
+                   fd_trans_host_to_target_data(args[pt->fd - 1]))) {
+        return false;
+    }
+    if (pt->buf) {
+        abi_ulong addr = args[pt->buf - 1];
+
+        if (!access_ok(pt->access, addr, args[pt->len - 1])) {
+            *ret = -TARGET_EFAULT;
+            return true;
+        }
+        args[pt->buf - 1] = (abi_long)(uintptr_t)g2h(addr);
+    }
+
+    if (pt->blocking) {
+        *ret = get_errno(safe_syscall(num, args[0], args[1], args[2],
+                                      args[3], args[4], args[5]));
+    } else {
+        *ret = get_errno(syscall(num, args[0], args[1], args[2],
+                                 args[3], args[4], args[5]));
+    }
+    return true;
+}
+#endif
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -7337,6 +7420,16 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
 
+#ifdef TARGET_ABI_IS_HOST_ABI
+    {
+        abi_long args[6] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+
+        if (do_syscall_passthrough(num, args, &ret)) {
+            goto fail;
+        }
+    }
+#endif
+
     switch(num) {
     case TARGET_NR_exit:
         /* In old applications this may be used to implement _exit(2).
@@ -254,6 +254,22 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -290,12 +306,12 @@ static void flatview_destroy(FlatView *view)
     g_free(view);
 }
 
-static void flatview_ref(FlatView *view)
+void flatview_ref(FlatView *view)
 {
     atomic_inc(&view->ref);
 }
 
-static void flatview_unref(FlatView *view)
+void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
         flatview_destroy(view);
@@ -697,6 +713,54 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Find the region whose rendering equals that of @mr, by looking through
+ * aliases and containers that map a single region in its entirety at
+ * offset 0; returns NULL if @mr renders nothing.  PCI bus master address
+ * spaces, for example, have a per-device alias of the bus address space
+ * as their root, and this lets them share a FlatView.
+ */
+static MemoryRegion *memory_region_unalias_entire(MemoryRegion *mr)
+{
+    MemoryRegion *child, *next;
+    unsigned found;
+
+    while (mr && mr->enabled) {
+        if (mr->addr || mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (mr->alias_offset || mr->alias->addr ||
+                int128_lt(mr->size, mr->alias->size)) {
+                return mr;
+            }
+            mr = mr->alias;
+            continue;
+        }
+        if (mr->terminates) {
+            return mr;
+        }
+
+        found = 0;
+        next = NULL;
+        QTAILQ_FOREACH(child, &mr->subregions, subregions_link) {
+            if (child->enabled) {
+                if (++found > 1) {
+                    return mr;
+                }
+                next = child;
+            }
+        }
+        if (!found) {
+            return NULL;
+        }
+        if (next->addr || int128_lt(mr->size, next->size)) {
+            return mr;
+        }
+        mr = next;
+    }
+    return NULL;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -876,13 +940,33 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* Install @new_view in @as.  If it renders the same ranges as the view
+ * already there, listeners get no callbacks at all: an address space
+ * whose part of the tree did not change costs one comparison, and its
+ * dispatch tree and the TLBs of the CPUs using it are left alone.
+ * Otherwise exec.c gets to pick a dispatch map, possibly shared with
+ * another address space already on @new_view, before the listeners run.
+ */
+static void address_space_update_topology(AddressSpace *as,
+                                          FlatView *new_view)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    if (old_view == new_view) {
+        flatview_unref(old_view);
+        address_space_update_ioeventfds(as);
+        return;
+    }
+    if (!flatview_equal(old_view, new_view)) {
+        address_space_dispatch_prepare(as, new_view);
+        address_space_update_topology_pass(as, old_view, new_view, false);
+        address_space_update_topology_pass(as, old_view, new_view, true);
+    }
+
+    /* Equal views are swapped anyway, so that every address space with
+     * the same topology ends up on the same object.
+     */
+    flatview_ref(new_view);
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
@@ -911,21 +995,60 @@ static void memory_region_clear_pending(void)
     ioeventfd_update_pending = false;
 }
 
+/* The FlatView last rendered for each distinct root, after looking
+ * through memory_region_unalias_entire().  Kept across transactions so
+ * that an unchanged topology keeps its FlatView object, and with it the
+ * dispatch map exec.c built for it.
+ */
+static GHashTable *flat_views;
+
+static FlatView *flatview_for_root(GHashTable *views, MemoryRegion *root)
+{
+    MemoryRegion *key = memory_region_unalias_entire(root);
+    FlatView *view, *old;
+
+    view = g_hash_table_lookup(views, key);
+    if (view) {
+        return view;
+    }
+    view = generate_memory_topology(key);
+    old = flat_views ? g_hash_table_lookup(flat_views, key) : NULL;
+    if (old && flatview_equal(old, view)) {
+        flatview_unref(view);
+        flatview_ref(old);
+        view = old;
+    }
+    g_hash_table_insert(views, key, view);
+    return view;
+}
+
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    GHashTable *views;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            /* Address spaces with the same topology share one
+             * rendering of it.
+             */
+            views = g_hash_table_new_full(NULL, NULL, NULL,
+                                          (GDestroyNotify)flatview_unref);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as,
+                                              flatview_for_root(views,
+                                                                as->root));
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            if (flat_views) {
+                g_hash_table_destroy(flat_views);
+            }
+            flat_views = views;
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1289,6 +1412,9 @@ void memory_region_init_io(MemoryRegion *mr,
     mr->ops = ops ? ops : &unassigned_mem_ops;
     mr->opaque = opaque;
     mr->terminates = true;
+    if (mr->ops->own_locking) {
+        mr->global_locking = false;
+    }
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1628,6 +1754,41 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection section;
+    AddressSpace *as;
+    FlatRange *fr;
+    hwaddr sec_start, sec_end;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        FlatView *view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr != mr || !fr->dirty_log_mask) {
+                continue;
+            }
+            sec_start = MAX(fr->offset_in_region, start);
+            sec_end = MIN(fr->offset_in_region + int128_get64(fr->addr.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+            section = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = sec_start,
+                .size = int128_make64(sec_end - sec_start),
+                .offset_within_address_space = int128_get64(fr->addr.start) +
+                                               sec_start - fr->offset_in_region,
+                .readonly = fr->readonly,
+            };
+            MEMORY_LISTENER_CALL(log_clear, Forward, &section);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1785,6 +1946,27 @@ void memory_region_add_coalescing(MemoryRegion *mr,
     memory_region_set_flush_coalesced(mr);
 }
 
+void memory_region_set_coalescing_except(MemoryRegion *mr,
+                                         const hwaddr *regs,
+                                         unsigned nb_regs,
+                                         unsigned reg_size)
+{
+    uint64_t size = int128_get64(mr->size);
+    hwaddr start = 0;
+    unsigned i;
+
+    memory_region_clear_coalescing(mr);
+    for (i = 0; i <= nb_regs; i++) {
+        hwaddr end = i < nb_regs ? regs[i] : size;
+
+        assert(end >= start && end <= size);
+        if (end > start) {
+            memory_region_add_coalescing(mr, start, end - start);
+        }
+        start = end + reg_size;
+    }
+}
+
 void memory_region_clear_coalescing(MemoryRegion *mr)
 {
     CoalescedMemoryRange *cmr;
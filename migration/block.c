@@ -71,6 +71,7 @@ typedef struct BlkMigDevState {
 
     /* Protected by block migration lock.  */
     int64_t completed_sectors;
+    int inflight;
 
     /* During migration this is protected by iothread lock / AioContext.
      * Allocation and free happen during setup and cleanup respectively.
@@ -100,6 +101,7 @@ typedef struct BlkMigState {
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     int64_t total_sector_sum;
     bool zero_blocks;
+    int inflight_depth;
 
     /* Protected by lock.  */
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
@@ -110,6 +112,7 @@ typedef struct BlkMigState {
     int transferred;
     int prev_progress;
     int bulk_completed;
+    BlkMigDevState *dirty_cursor;
 
     /* Lock must be taken _inside_ the iothread lock and any AioContexts.  */
     QemuMutex lock;
@@ -136,8 +139,9 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
+    /* blocks known to be zero without reading them have no buffer */
     if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        (!blk->buf || buffer_is_zero(blk->buf, BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -257,12 +261,34 @@ static void blk_mig_read_cb(void *opaque, int ret)
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
+    blk->bmds->inflight--;
     block_mig_state.submitted--;
     block_mig_state.read_done++;
     assert(block_mig_state.submitted >= 0);
     blk_mig_unlock();
 }
 
+/* Called with iothread lock and AioContext taken.  */
+
+static bool bmds_range_is_zero(BlkMigDevState *bmds, int64_t sector,
+                               int nr_sectors)
+{
+    BlockDriverState *file;
+    int64_t ret;
+    int pnum;
+
+    while (nr_sectors > 0) {
+        ret = bdrv_get_block_status(blk_bs(bmds->blk), sector, nr_sectors,
+                                    &pnum, &file);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || !pnum) {
+            return false;
+        }
+        sector += pnum;
+        nr_sectors -= pnum;
+    }
+    return true;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -302,17 +328,13 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     }
 
     blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
     blk_mig_lock();
     block_mig_state.submitted++;
+    bmds->inflight++;
     blk_mig_unlock();
 
     /* We do not know if bs is under the main thread (and thus does
@@ -325,8 +347,20 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
      */
     qemu_mutex_lock_iothread();
     aio_context_acquire(blk_get_aio_context(bmds->blk));
-    blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE, &blk->qiov,
-                                0, blk_mig_read_cb, blk);
+    if (bmds_range_is_zero(bmds, cur_sector, nr_sectors)) {
+        /* Nothing to read, the block is ready to be sent right away */
+        blk->buf = block_mig_state.zero_blocks ? NULL : g_malloc0(BLOCK_SIZE);
+        blk->aiocb = NULL;
+        blk_mig_read_cb(blk, 0);
+    } else {
+        blk->buf = g_malloc(BLOCK_SIZE);
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE,
+                                    &blk->qiov, 0, blk_mig_read_cb, blk);
+    }
 
     bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector, nr_sectors);
     aio_context_release(blk_get_aio_context(bmds->blk));
@@ -398,6 +432,8 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.prev_progress = -1;
     block_mig_state.bulk_completed = 0;
     block_mig_state.zero_blocks = migrate_zero_blocks();
+    block_mig_state.inflight_depth = migrate_block_inflight_depth();
+    block_mig_state.dirty_cursor = NULL;
 
     for (bs = bdrv_first(&it); bs; bs = bdrv_next(&it)) {
         num_bs++;
@@ -420,6 +456,7 @@ static void init_blk_migration(QEMUFile *f)
         bmds->bulk_completed = 0;
         bmds->total_sectors = sectors;
         bmds->completed_sectors = 0;
+        bmds->inflight = 0;
         bmds->shared_base = block_mig_state.shared_base;
 
         assert(i < num_bs);
@@ -457,27 +494,48 @@ out:
     g_free(bmds_bs);
 }
 
-/* Called with no lock taken.  */
+/* Called with migration lock held.  */
+
+static bool bmds_window_full(BlkMigDevState *bmds)
+{
+    return bmds->inflight >= block_mig_state.inflight_depth;
+}
 
+/* Called with no lock taken.
+ *
+ * Submit a read on every device whose bulk phase isn't over, so that
+ * they are all copied at the same time.
+ *
+ * return value:
+ * 0: the bulk phase is over on all devices
+ * 1: some devices have bulk left
+ * 2: same, but every one of them already has inflight_depth reads
+ */
 static int blk_mig_save_bulked_block(QEMUFile *f)
 {
     int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
     int progress;
+    bool full;
     int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
-                /* completed bulk section for this device */
-                bmds->bulk_completed = 1;
+            blk_mig_lock();
+            full = bmds_window_full(bmds);
+            blk_mig_unlock();
+
+            if (!full) {
+                if (mig_save_device_bulk(f, bmds) == 1) {
+                    /* completed bulk section for this device */
+                    bmds->bulk_completed = 1;
+                }
+                ret = 1;
+            } else if (ret == 0) {
+                ret = 2;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -503,6 +561,7 @@ static void blk_mig_reset_dirty_cursor(void)
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         bmds->cur_dirty = 0;
     }
+    block_mig_state.dirty_cursor = NULL;
 }
 
 /* Called with iothread lock and AioContext taken.  */
@@ -550,6 +609,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
 
                 blk_mig_lock();
                 block_mig_state.submitted++;
+                bmds->inflight++;
                 bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
                 blk_mig_unlock();
             } else {
@@ -581,26 +641,51 @@ error:
 }
 
 /* Called with iothread lock taken.
+ *
+ * Devices take turns, starting after the one that sent the last block.
  *
  * return value:
  * 0: too much data for max_downtime
  * 1: few enough data for max_downtime
+ * 2: the devices with dirty blocks left already have inflight_depth reads
 */
 static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
 {
-    BlkMigDevState *bmds;
+    BlkMigDevState *bmds, *start;
+    bool full, skipped = false;
     int ret = 1;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        aio_context_acquire(blk_get_aio_context(bmds->blk));
-        ret = mig_save_device_dirty(f, bmds, is_async);
-        aio_context_release(blk_get_aio_context(bmds->blk));
+    start = block_mig_state.dirty_cursor ?:
+            QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
+    if (!start) {
+        return 1;
+    }
+
+    bmds = start;
+    do {
+        blk_mig_lock();
+        full = is_async && bmds->cur_dirty < bmds->total_sectors &&
+               bmds_window_full(bmds);
+        blk_mig_unlock();
+
+        if (full) {
+            skipped = true;
+            ret = 1;
+        } else {
+            aio_context_acquire(blk_get_aio_context(bmds->blk));
+            ret = mig_save_device_dirty(f, bmds, is_async);
+            aio_context_release(blk_get_aio_context(bmds->blk));
+        }
+
+        bmds = QSIMPLEQ_NEXT(bmds, entry) ?:
+               QSIMPLEQ_FIRST(&block_mig_state.bmds_list);
         if (ret <= 0) {
-            break;
+            block_mig_state.dirty_cursor = bmds;
+            return ret;
         }
-    }
+    } while (bmds != start);
 
-    return ret;
+    return skipped ? 2 : 1;
 }
 
 /* Called with no locks taken.  */
@@ -687,6 +772,7 @@ static void block_migration_cleanup(void *opaque)
         g_free(bmds->aio_bitmap);
         g_free(bmds);
     }
+    block_mig_state.dirty_cursor = NULL;
 
     blk_mig_lock();
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
@@ -750,11 +836,13 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f);
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
             }
-            ret = 0;
+            /* stop submitting while every device has a full window */
+            ret = ret == 2;
         } else {
             /* Always called with iothread lock taken for
              * simplicity, block_save_complete also calls it.
@@ -768,7 +856,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
         }
         blk_mig_lock();
         if (ret != 0) {
-            /* no more dirty blocks */
+            /* no more dirty blocks, or no room for them */
             break;
         }
     }
@@ -0,0 +1,840 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * checkpoints of the guest state
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "sysemu/sysemu.h"
+#include "block/block.h"
+#include "migration/colo.h"
+#include "migration/qemu-file.h"
+#include "io/channel-buffer.h"
+#include "net/colo-compare.h"
+#include "net/filter.h"
+#include "replication.h"
+#include "trace.h"
+
+/* Starting size of the buffer the device state goes through */
+#define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
+
+/*
+ * While the VM runs, the primary streams dirty RAM within max-bandwidth
+ * per this many milliseconds, and looks for new dirty pages this often
+ * once all were sent.
+ */
+#define COLO_STREAM_PERIOD 100
+
+/*
+ * The messages of a checkpoint, in the order they are exchanged; the
+ * primary sends them on the migration stream, the secondary answers on
+ * the return path.
+ */
+typedef enum COLOMessage {
+    COLO_MESSAGE_CHECKPOINT_READY,    /* secondary: loaded, waiting */
+    COLO_MESSAGE_CHECKPOINT_REQUEST,  /* primary: time for a checkpoint */
+    COLO_MESSAGE_CHECKPOINT_REPLY,    /* secondary: stopped */
+    COLO_MESSAGE_VMSTATE_SEND,        /* primary: dirty RAM follows */
+    COLO_MESSAGE_VMSTATE_SIZE,        /* primary: device state follows */
+    COLO_MESSAGE_VMSTATE_RECEIVED,    /* secondary: got everything */
+    COLO_MESSAGE_VMSTATE_LOADED,      /* secondary: checkpoint committed */
+    COLO_MESSAGE_RAM_STREAM,          /* primary: dirty RAM, VM running */
+    COLO_MESSAGE_HEARTBEAT,           /* primary: still there */
+    COLO_MESSAGE__MAX
+} COLOMessage;
+
+static const char *const colo_message_lookup[] = {
+    [COLO_MESSAGE_CHECKPOINT_READY] = "checkpoint-ready",
+    [COLO_MESSAGE_CHECKPOINT_REQUEST] = "checkpoint-request",
+    [COLO_MESSAGE_CHECKPOINT_REPLY] = "checkpoint-reply",
+    [COLO_MESSAGE_VMSTATE_SEND] = "vmstate-send",
+    [COLO_MESSAGE_VMSTATE_SIZE] = "vmstate-size",
+    [COLO_MESSAGE_VMSTATE_RECEIVED] = "vmstate-received",
+    [COLO_MESSAGE_VMSTATE_LOADED] = "vmstate-loaded",
+    [COLO_MESSAGE_RAM_STREAM] = "ram-stream",
+    [COLO_MESSAGE_HEARTBEAT] = "heartbeat",
+};
+
+/* Posted by colo-compare when the outputs of the two VMs differ */
+static QemuSemaphore colo_checkpoint_sem;
+/* Set with it if one of the requests was for a miscompare */
+static bool colo_checkpoint_miscompare;
+
+/* Protected by the iothread lock */
+static COLOStatus colo_status;
+static int64_t colo_total_interval;
+static int64_t colo_total_downtime;
+
+/*
+ * The primary sends a heartbeat whenever it sent nothing else for
+ * COLO_HEARTBEAT_PERIOD ms, and each side notes when its COLO thread
+ * starts waiting for the other.  The watchdog, a timer in the main
+ * loop, fails over once a wait exceeds x-colo-heartbeat-timeout: it
+ * shuts the connection down, which wakes the thread up as if the peer
+ * had closed it, and the thread carries on alone right away.
+ */
+#define COLO_HEARTBEAT_PERIOD COLO_STREAM_PERIOD
+
+/* Protected by the iothread lock */
+static QEMUTimer *colo_watchdog_timer;
+static bool colo_watchdog_primary;
+static bool colo_failover_started;
+/* QEMU_CLOCK_REALTIME ms since the COLO thread waits, 0 if it doesn't */
+static int64_t colo_wait_start;
+
+static void colo_send_message(QEMUFile *f, COLOMessage msg, Error **errp)
+{
+    int ret;
+
+    qemu_put_be32(f, msg);
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't send COLO message");
+        return;
+    }
+    trace_colo_send_message(colo_message_lookup[msg]);
+}
+
+static void colo_send_message_value(QEMUFile *f, COLOMessage msg,
+                                    uint64_t value, Error **errp)
+{
+    Error *local_err = NULL;
+    int ret;
+
+    colo_send_message(f, msg, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    qemu_put_be64(f, value);
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to send value for message %s",
+                         colo_message_lookup[msg]);
+    }
+}
+
+static uint32_t colo_receive_message(QEMUFile *f, Error **errp)
+{
+    uint32_t msg;
+    int ret;
+
+    msg = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't receive COLO message");
+        return COLO_MESSAGE__MAX;
+    }
+    if (msg >= COLO_MESSAGE__MAX) {
+        error_setg(errp, "Invalid COLO message %u", msg);
+        return COLO_MESSAGE__MAX;
+    }
+    trace_colo_receive_message(colo_message_lookup[msg]);
+    return msg;
+}
+
+static void colo_receive_check_message(QEMUFile *f, COLOMessage expect,
+                                       Error **errp)
+{
+    Error *local_err = NULL;
+    uint32_t msg;
+
+    msg = colo_receive_message(f, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (msg != expect) {
+        error_setg(errp, "Unexpected COLO message %s, expected %s",
+                   colo_message_lookup[msg], colo_message_lookup[expect]);
+    }
+}
+
+static uint64_t colo_receive_message_value(QEMUFile *f, COLOMessage expect,
+                                           Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t value;
+    int ret;
+
+    colo_receive_check_message(f, expect, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return 0;
+    }
+
+    value = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to get value for COLO message %s",
+                         colo_message_lookup[expect]);
+    }
+    return value;
+}
+
+static void colo_wait_peer(bool waiting)
+{
+    atomic_set(&colo_wait_start,
+               waiting ? qemu_clock_get_ms(QEMU_CLOCK_REALTIME) : 0);
+}
+
+/* Called with the iothread lock held */
+static void colo_failover(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    MigrationState *s = migrate_get_current();
+
+    if (colo_failover_started) {
+        return;
+    }
+    colo_failover_started = true;
+    trace_colo_failover(colo_watchdog_primary ? "primary" : "secondary");
+    if (colo_watchdog_primary) {
+        qemu_file_shutdown(s->to_dst_file);
+        qemu_file_shutdown(s->rp_state.from_dst_file);
+    } else {
+        qemu_file_shutdown(mis->from_src_file);
+        qemu_file_shutdown(mis->to_src_file);
+    }
+}
+
+static void colo_watchdog_check(void *opaque)
+{
+    int64_t timeout = migrate_colo_heartbeat_timeout();
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t start = atomic_read(&colo_wait_start);
+
+    if (timeout && start && now - start > timeout) {
+        error_report("COLO: no news from the %s for %" PRId64 " ms, "
+                     "failing over", colo_watchdog_primary ? "secondary" :
+                     "primary", now - start);
+        colo_failover();
+        return;
+    }
+    timer_mod(colo_watchdog_timer,
+              now + (timeout ? MAX(timeout / 4, 1) : COLO_HEARTBEAT_PERIOD));
+}
+
+/*
+ * Called with the iothread lock held, before the COLO thread gets to use
+ * its files and after it is done with them respectively.
+ */
+static void colo_watchdog_start(bool primary)
+{
+    colo_watchdog_primary = primary;
+    colo_failover_started = false;
+    colo_wait_peer(false);
+    colo_watchdog_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                       colo_watchdog_check, NULL);
+    colo_watchdog_check(NULL);
+}
+
+static void colo_watchdog_stop(void)
+{
+    if (colo_watchdog_timer) {
+        timer_del(colo_watchdog_timer);
+        timer_free(colo_watchdog_timer);
+        colo_watchdog_timer = NULL;
+    }
+}
+
+void qmp_x_colo_lost_heartbeat(Error **errp)
+{
+    if (!colo_watchdog_timer) {
+        error_setg(errp, "COLO is not running");
+        return;
+    }
+    colo_failover();
+}
+
+static void colo_compare_notify_checkpoint(Notifier *notifier, void *data)
+{
+    COLOCompareRequest *req = data;
+
+    if (req->miscompare) {
+        atomic_mb_set(&colo_checkpoint_miscompare, true);
+    }
+    qemu_sem_post(&colo_checkpoint_sem);
+}
+
+static Notifier colo_compare_notifier = {
+    .notify = colo_compare_notify_checkpoint,
+};
+
+/*
+ * Until @deadline, or until colo-compare asks for a checkpoint, send the
+ * RAM the guest dirties to the cache of the secondary.  The checkpoint
+ * then only has to send what was dirtied since the last round, while
+ * the VM is stopped; so it is taken early, too, when the guest dirties
+ * RAM faster than it is sent and more than x-checkpoint-dirty-limit is
+ * waiting.  @reason tells which of them ended the wait.
+ */
+static int colo_stream_ram(MigrationState *s, int64_t deadline,
+                           COLOCheckpointReason *reason)
+{
+    QEMUFile *f = s->to_dst_file;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t period_start = now;
+    uint64_t dirty_limit = (uint64_t)migrate_checkpoint_dirty_limit() << 20;
+    uint64_t pend_nonpost, pend_post;
+    Error *local_err = NULL;
+    int64_t last_sent = now;
+    int64_t wait;
+    int ret;
+
+    *reason = COLO_CHECKPOINT_REASON_INTERVAL;
+    qemu_file_set_rate_limit(f, s->bandwidth_limit * COLO_STREAM_PERIOD /
+                                1000);
+    while (s->state == MIGRATION_STATUS_COLO && now < deadline) {
+        if (now >= period_start + COLO_STREAM_PERIOD) {
+            qemu_file_reset_rate_limit(f);
+            period_start = now;
+        }
+
+        wait = MIN(deadline, period_start + COLO_STREAM_PERIOD) - now;
+        if (!qemu_file_rate_limit(f)) {
+            /* Syncs the dirty bitmap once everything in it was sent */
+            qemu_savevm_state_pending(f, 1, &pend_nonpost, &pend_post);
+            if (dirty_limit && pend_nonpost + pend_post >= dirty_limit) {
+                *reason = COLO_CHECKPOINT_REASON_DIRTY_LIMIT;
+                break;
+            }
+            if (pend_nonpost + pend_post) {
+                /* the writes block if the secondary went away */
+                colo_wait_peer(true);
+                colo_send_message(f, COLO_MESSAGE_RAM_STREAM, &local_err);
+                if (local_err) {
+                    error_report_err(local_err);
+                    return -1;
+                }
+                qemu_savevm_state_iterate(f, false);
+                qemu_put_byte(f, QEMU_VM_EOF);
+                qemu_fflush(f);
+                colo_wait_peer(false);
+                ret = qemu_file_get_error(f);
+                if (ret < 0) {
+                    error_report("Can't stream RAM to the secondary: %s",
+                                 strerror(-ret));
+                    return ret;
+                }
+                now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                last_sent = now;
+                continue;
+            }
+        }
+
+        if (now - last_sent >= COLO_HEARTBEAT_PERIOD) {
+            colo_wait_peer(true);
+            colo_send_message(f, COLO_MESSAGE_HEARTBEAT, &local_err);
+            colo_wait_peer(false);
+            if (local_err) {
+                error_report_err(local_err);
+                return -1;
+            }
+            last_sent = now;
+        }
+
+        if (!qemu_sem_timedwait(&colo_checkpoint_sem, wait)) {
+            *reason = atomic_xchg(&colo_checkpoint_miscompare, false) ?
+                      COLO_CHECKPOINT_REASON_MISCOMPARE :
+                      COLO_CHECKPOINT_REASON_OUTPUT_LATENCY;
+            break;
+        }
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    }
+
+    qemu_file_set_rate_limit(f, INT64_MAX);
+    return 0;
+}
+
+/* Called with the iothread lock held, once the VM runs again */
+static void colo_update_status(COLOCheckpointReason reason, int64_t start,
+                               int64_t end, int64_t size)
+{
+    static int64_t last_start;
+
+    colo_status.checkpoints++;
+    switch (reason) {
+    case COLO_CHECKPOINT_REASON_INTERVAL:
+        colo_status.interval_checkpoints++;
+        break;
+    case COLO_CHECKPOINT_REASON_MISCOMPARE:
+        colo_status.miscompare_checkpoints++;
+        break;
+    case COLO_CHECKPOINT_REASON_OUTPUT_LATENCY:
+        colo_status.output_latency_checkpoints++;
+        break;
+    case COLO_CHECKPOINT_REASON_DIRTY_LIMIT:
+        colo_status.dirty_limit_checkpoints++;
+        break;
+    default:
+        abort();
+    }
+    colo_status.has_last_reason = true;
+    colo_status.last_reason = reason;
+
+    if (colo_status.checkpoints > 1) {
+        colo_status.last_interval = start - last_start;
+        colo_total_interval += colo_status.last_interval;
+        colo_status.average_interval = colo_total_interval /
+                                       (colo_status.checkpoints - 1);
+    }
+    last_start = start;
+
+    colo_status.last_downtime = end - start;
+    colo_total_downtime += colo_status.last_downtime;
+    colo_status.average_downtime = colo_total_downtime /
+                                   colo_status.checkpoints;
+    colo_status.last_size = size;
+}
+
+static int colo_do_checkpoint_transaction(MigrationState *s,
+                                          QIOChannelBuffer *bioc,
+                                          QEMUFile *fb,
+                                          COLOCheckpointReason reason)
+{
+    QEMUFile *rp = s->rp_state.from_dst_file;
+    Error *local_err = NULL;
+    int64_t start, size;
+    int ret = -1;
+
+    trace_colo_checkpoint(COLOCheckpointReason_lookup[reason]);
+    /* A whole checkpoint has to fit in x-colo-heartbeat-timeout */
+    colo_wait_peer(true);
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
+                      &local_err);
+    if (local_err) {
+        goto out;
+    }
+    colo_receive_check_message(rp, COLO_MESSAGE_CHECKPOINT_REPLY, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* The buffer only holds the device state of this checkpoint */
+    bioc->usage = 0;
+    bioc->offset = 0;
+
+    qemu_mutex_lock_iothread();
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    vm_stop_force_state(RUN_STATE_COLO);
+    /* The writes forwarded to the secondary's disk are complete now */
+    replication_get_error_all(&local_err);
+    if (!local_err) {
+        replication_do_checkpoint_all(&local_err);
+    }
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("run", "stop");
+    if (local_err) {
+        goto out;
+    }
+
+    size = qemu_ftell(s->to_dst_file);
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    qemu_mutex_lock_iothread();
+    /*
+     * The iterable sections only send what was dirtied since they last
+     * completed, which is what keeps the checkpoints incremental.  The
+     * devices go to the buffer, the secondary needs all of them before
+     * it can reset its own.
+     */
+    qemu_savevm_state_complete_precopy(s->to_dst_file, true);
+    qemu_put_byte(s->to_dst_file, QEMU_VM_EOF);
+    ret = qemu_save_device_state(fb);
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        error_setg_errno(&local_err, -ret, "Can't save the device state");
+        goto out;
+    }
+    qemu_fflush(fb);
+
+    colo_send_message_value(s->to_dst_file, COLO_MESSAGE_VMSTATE_SIZE,
+                            bioc->usage, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+    ret = qemu_file_get_error(s->to_dst_file);
+    if (ret < 0) {
+        error_setg_errno(&local_err, -ret, "Can't send the checkpoint");
+        goto out;
+    }
+    size = qemu_ftell(s->to_dst_file) - size;
+
+    colo_receive_check_message(rp, COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    colo_receive_check_message(rp, COLO_MESSAGE_VMSTATE_LOADED, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    colo_wait_peer(false);
+    ret = 0;
+    qemu_mutex_lock_iothread();
+    vm_start();
+    colo_update_status(reason, start, qemu_clock_get_ms(QEMU_CLOCK_REALTIME),
+                       size);
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("stop", "run");
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+        ret = -1;
+    }
+    return ret;
+}
+
+void colo_process_checkpoint(MigrationState *s)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb = NULL;
+    Error *local_err = NULL;
+    COLOCheckpointReason reason;
+    bool replicating = false;
+
+    s->rp_state.from_dst_file = qemu_file_get_return_path(s->to_dst_file);
+    if (!s->rp_state.from_dst_file) {
+        error_report("Can't open the COLO return path");
+        goto out;
+    }
+
+    /* Get back the images migration_completion() inactivated */
+    qemu_mutex_lock_iothread();
+    bdrv_invalidate_cache_all(&local_err);
+    if (!local_err) {
+        /* Forward the disk writes to the secondary from now on */
+        replication_start_all(REPLICATION_MODE_PRIMARY, &local_err);
+        replicating = !local_err;
+    }
+    qemu_mutex_unlock_iothread();
+    if (local_err) {
+        error_report_err(local_err);
+        goto out;
+    }
+
+    colo_receive_check_message(s->rp_state.from_dst_file,
+                               COLO_MESSAGE_CHECKPOINT_READY, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+        goto out;
+    }
+
+    bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    qemu_sem_init(&colo_checkpoint_sem, 0);
+    qemu_mutex_lock_iothread();
+    memset(&colo_status, 0, sizeof(colo_status));
+    colo_total_interval = 0;
+    colo_total_downtime = 0;
+    colo_status.active = true;
+    colo_compare_register_notifier(&colo_compare_notifier);
+    colo_watchdog_start(true);
+    vm_start();
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("stop", "run");
+
+    while (s->state == MIGRATION_STATUS_COLO) {
+        if (colo_stream_ram(s, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                               migrate_checkpoint_delay(), &reason) < 0) {
+            break;
+        }
+        if (s->state != MIGRATION_STATUS_COLO) {
+            break;
+        }
+        if (colo_do_checkpoint_transaction(s, bioc, fb, reason) < 0) {
+            break;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    colo_watchdog_stop();
+    colo_status.active = false;
+    colo_compare_unregister_notifier(&colo_compare_notifier);
+    qemu_mutex_unlock_iothread();
+    qemu_sem_destroy(&colo_checkpoint_sem);
+
+out:
+    /*
+     * The primary carries on alone, migration_thread() restarts it if
+     * it was stopped; removing its colo-compare is up to the management.
+     */
+    if (replicating) {
+        qemu_mutex_lock_iothread();
+        replication_stop_all(true, &local_err);
+        qemu_mutex_unlock_iothread();
+        if (local_err) {
+            error_report_err(local_err);
+        }
+    }
+    migrate_set_state(&s->state, MIGRATION_STATUS_COLO,
+                      MIGRATION_STATUS_FAILED);
+    if (fb) {
+        qemu_fclose(fb);
+    }
+    if (s->rp_state.from_dst_file) {
+        qemu_fclose(s->rp_state.from_dst_file);
+        s->rp_state.from_dst_file = NULL;
+    }
+}
+
+static void colo_incoming_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    qemu_bh_delete(mis->bh);
+    mis->bh = NULL;
+    qemu_coroutine_enter(mis->migration_incoming_co);
+}
+
+static void *colo_process_incoming_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = mis->from_src_file;
+    QIOChannelBuffer *bioc = NULL;
+    QEMUFile *fb = NULL;
+    Error *local_err = NULL;
+    uint64_t value;
+    uint32_t msg;
+    size_t size;
+    bool replicating = false;
+    int ret;
+
+    rcu_register_thread();
+    migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COLO);
+
+    mis->to_src_file = qemu_file_get_return_path(f);
+    if (!mis->to_src_file) {
+        error_report("Can't open the COLO return path");
+        goto out;
+    }
+    /* Nothing else reads the stream while the coroutine is parked */
+    qemu_file_set_blocking(f, true);
+
+    qemu_mutex_lock_iothread();
+    ret = colo_init_ram_cache();
+    if (ret == 0) {
+        /* Buffer the secondary's own disk writes from now on */
+        replication_start_all(REPLICATION_MODE_SECONDARY, &local_err);
+        replicating = !local_err;
+    }
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        error_report("Can't allocate the COLO RAM cache");
+        goto out;
+    }
+    if (local_err) {
+        goto out;
+    }
+
+    bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
+    fb = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_READY,
+                      &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    qemu_mutex_lock_iothread();
+    colo_watchdog_start(false);
+    vm_start();
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("stop", "run");
+
+    while (mis->state == MIGRATION_STATUS_COLO) {
+        colo_wait_peer(true);
+        msg = colo_receive_message(f, &local_err);
+        if (local_err) {
+            goto out;
+        }
+        if (msg == COLO_MESSAGE_HEARTBEAT) {
+            continue;
+        }
+        if (msg == COLO_MESSAGE_RAM_STREAM) {
+            /* Only the cache is written, the VM keeps running */
+            ret = qemu_loadvm_state_main(f, mis);
+            if (ret < 0) {
+                error_report("Load of the streamed COLO RAM failed");
+                goto out;
+            }
+            continue;
+        }
+        if (msg != COLO_MESSAGE_CHECKPOINT_REQUEST) {
+            error_report("Unexpected COLO message %s",
+                         colo_message_lookup[msg]);
+            goto out;
+        }
+
+        qemu_mutex_lock_iothread();
+        vm_stop_force_state(RUN_STATE_COLO);
+        qemu_mutex_unlock_iothread();
+        trace_colo_vm_state_change("run", "stop");
+
+        colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_REPLY,
+                          &local_err);
+        if (local_err) {
+            goto out;
+        }
+        colo_receive_check_message(f, COLO_MESSAGE_VMSTATE_SEND, &local_err);
+        if (local_err) {
+            goto out;
+        }
+
+        /* The RAM goes to the cache, see host_from_ram_block_offset() */
+        ret = qemu_loadvm_state_main(f, mis);
+        if (ret < 0) {
+            error_report("Load of the COLO checkpoint RAM failed");
+            goto out;
+        }
+
+        value = colo_receive_message_value(f, COLO_MESSAGE_VMSTATE_SIZE,
+                                           &local_err);
+        if (local_err) {
+            goto out;
+        }
+        if (value > bioc->capacity) {
+            bioc->capacity = value;
+            bioc->data = g_realloc(bioc->data, bioc->capacity);
+        }
+        size = qemu_get_buffer(f, bioc->data, value);
+        if (size != value) {
+            error_report("Got %zu bytes of device state instead of %" PRIu64,
+                         size, value);
+            goto out;
+        }
+        bioc->usage = size;
+        bioc->offset = 0;
+
+        colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_RECEIVED,
+                          &local_err);
+        if (local_err) {
+            goto out;
+        }
+        colo_wait_peer(false);
+
+        /*
+         * Everything has arrived, commit the checkpoint in one go: until
+         * now the secondary could still have carried on from its own
+         * state.
+         */
+        qemu_mutex_lock_iothread();
+        /* The disks go back to the primary's state as well */
+        replication_get_error_all(&local_err);
+        if (!local_err) {
+            replication_do_checkpoint_all(&local_err);
+        }
+        if (local_err) {
+            qemu_mutex_unlock_iothread();
+            goto out;
+        }
+        qemu_system_reset(VMRESET_SILENT);
+        colo_flush_ram_cache();
+        ret = qemu_load_device_state(fb);
+        qemu_mutex_unlock_iothread();
+        if (ret < 0) {
+            error_report("Load of the COLO checkpoint devices failed");
+            goto out;
+        }
+
+        colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_LOADED,
+                          &local_err);
+        if (local_err) {
+            goto out;
+        }
+
+        qemu_mutex_lock_iothread();
+        vm_start();
+        qemu_mutex_unlock_iothread();
+        trace_colo_vm_state_change("stop", "run");
+    }
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+        local_err = NULL;
+    }
+    qemu_mutex_lock_iothread();
+    colo_watchdog_stop();
+    colo_release_ram_cache();
+    if (replicating) {
+        /* Keep the secondary's own writes, it carries on from them */
+        replication_stop_all(true, &local_err);
+    }
+    /* and talk to the network itself rather than through the primary */
+    netfilter_colo_failover();
+    qemu_mutex_unlock_iothread();
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    if (fb) {
+        qemu_fclose(fb);
+    }
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+
+    /*
+     * The incoming migration then finishes as usual and the secondary
+     * carries on from its own state, whose outputs matched the primary's
+     * so far; process_incoming_migration_bh() restarts it if it was
+     * stopped in the middle of a checkpoint.
+     */
+    migrate_set_state(&mis->state, MIGRATION_STATUS_COLO,
+                      MIGRATION_STATUS_ACTIVE);
+    mis->bh = qemu_bh_new(colo_incoming_bh, mis);
+    qemu_bh_schedule(mis->bh);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int colo_incoming_start(MigrationIncomingState *mis)
+{
+    Error *local_err = NULL;
+
+    /* The secondary runs between checkpoints, it needs its images */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
+        error_report_err(local_err);
+        return -1;
+    }
+
+    mis->migration_incoming_co = qemu_coroutine_self();
+    qemu_thread_create(&mis->colo_incoming_thread, "colo incoming",
+                       colo_process_incoming_thread, mis,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+COLOStatus *qmp_query_colo_status(Error **errp)
+{
+    COLOStatus *info = g_new0(COLOStatus, 1);
+
+    *info = colo_status;
+    return info;
+}
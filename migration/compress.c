@@ -0,0 +1,175 @@
+/*
+ * Compression codecs for the RAM pages of live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "migration/compress.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+struct MigrationCodec {
+    MigrationCompressMethod method;
+    int level;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+bool migration_codec_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+MigrationCodec *migration_codec_new(MigrationCompressMethod method, int level,
+                                    Error **errp)
+{
+    MigrationCodec *codec;
+
+    if (!migration_codec_supported(method)) {
+        error_setg(errp, "compression method '%s' is not supported by this"
+                   " build", MigrationCompressMethod_lookup[method]);
+        return NULL;
+    }
+
+    codec = g_new0(MigrationCodec, 1);
+    codec->method = method;
+    codec->level = level;
+#ifdef CONFIG_ZSTD
+    /* zstd allocates its working memory in contexts, keep them around
+     * instead of paying for it on every page.
+     */
+    if (method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        codec->zstd_cctx = ZSTD_createCCtx();
+        codec->zstd_dctx = ZSTD_createDCtx();
+        if (!codec->zstd_cctx || !codec->zstd_dctx) {
+            error_setg(errp, "failed to create zstd context");
+            migration_codec_free(codec);
+            return NULL;
+        }
+    }
+#endif
+    return codec;
+}
+
+void migration_codec_free(MigrationCodec *codec)
+{
+    if (!codec) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(codec->zstd_cctx);
+    ZSTD_freeDCtx(codec->zstd_dctx);
+#endif
+    g_free(codec);
+}
+
+size_t migration_codec_bound(MigrationCodec *codec, size_t len)
+{
+    switch (codec->method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_compressBound(len);
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return compressBound(len);
+    }
+}
+
+ssize_t migration_codec_compress(MigrationCodec *codec, uint8_t *dst,
+                                 size_t dst_len, const uint8_t *src,
+                                 size_t len)
+{
+    uLongf zlen = dst_len;
+#ifdef CONFIG_LZ4
+    int lz4len;
+#endif
+#ifdef CONFIG_ZSTD
+    size_t zstdlen;
+#endif
+
+    switch (codec->method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        /* lz4 has no levels, but trades ratio for speed with its
+         * acceleration factor: level 9 maps to the default of 1, lower
+         * levels go faster.
+         */
+        lz4len = LZ4_compress_fast((const char *)src, (char *)dst, len,
+                                   dst_len, 10 - codec->level);
+        return lz4len > 0 ? lz4len : -1;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        /* zstd levels go from 1 to 19, 0 picking zstd's own default */
+        zstdlen = ZSTD_compressCCtx(codec->zstd_cctx, dst, dst_len, src, len,
+                                    codec->level);
+        return ZSTD_isError(zstdlen) ? -1 : zstdlen;
+#endif
+    default:
+        if (compress2(dst, &zlen, src, len, codec->level) != Z_OK) {
+            return -1;
+        }
+        return zlen;
+    }
+}
+
+ssize_t migration_codec_decompress(MigrationCodec *codec, uint8_t *dst,
+                                   size_t dst_len, const uint8_t *src,
+                                   size_t len)
+{
+    uLongf zlen = dst_len;
+#ifdef CONFIG_LZ4
+    int lz4len;
+#endif
+#ifdef CONFIG_ZSTD
+    size_t zstdlen;
+#endif
+
+    switch (codec->method) {
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        lz4len = LZ4_decompress_safe((const char *)src, (char *)dst, len,
+                                     dst_len);
+        return lz4len >= 0 ? lz4len : -1;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        zstdlen = ZSTD_decompressDCtx(codec->zstd_dctx, dst, dst_len, src,
+                                      len);
+        return ZSTD_isError(zstdlen) ? -1 : zstdlen;
+#endif
+    default:
+        if (uncompress(dst, &zlen, src, len) != Z_OK) {
+            return -1;
+        }
+        return zlen;
+    }
+}
@@ -0,0 +1,216 @@
+/*
+ * Estimation of the guest dirty rate by sampling its RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/crc32c.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+
+#define DIRTY_RATE_DEFAULT_SAMPLE_PAGES 512
+#define DIRTY_RATE_MAX_SAMPLE_PAGES     16384
+#define DIRTY_RATE_MAX_CALC_TIME        60
+
+/* The pages sampled in one RAM block */
+typedef struct DirtyRateSample {
+    char idstr[256];
+    ram_addr_t used_length;
+    int nr;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+    int dirty;
+} DirtyRateSample;
+
+/* Protected by the iothread lock */
+static DirtyRateStatus dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static int64_t dirty_rate_start_time;
+static int64_t dirty_rate_calc_time;
+static int64_t dirty_rate_sample_pages;
+static int64_t dirty_rate_total;
+static DirtyRateBlockList *dirty_rate_blocks;
+
+static uint32_t dirty_rate_hash(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32c(0xffffffff, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+/* Called within an RCU critical section */
+static void dirty_rate_sample_block(DirtyRateSample *s, RAMBlock *block,
+                                    int64_t sample_pages)
+{
+    int64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    int i;
+
+    pstrcpy(s->idstr, sizeof(s->idstr), block->idstr);
+    s->used_length = block->used_length;
+    if (!block->host) {
+        return;
+    }
+    s->nr = MIN(pages, MAX(1, (block->used_length * sample_pages) >> 30));
+    s->offsets = g_new(ram_addr_t, s->nr);
+    s->hashes = g_new(uint32_t, s->nr);
+
+    for (i = 0; i < s->nr; i++) {
+        s->offsets[i] = (ram_addr_t)g_random_int_range(0, pages)
+                        << TARGET_PAGE_BITS;
+        s->hashes[i] = dirty_rate_hash(block, s->offsets[i]);
+    }
+}
+
+/* Called within an RCU critical section */
+static void dirty_rate_check_block(DirtyRateSample *s)
+{
+    RAMBlock *block = qemu_ram_block_by_name(s->idstr);
+    int i;
+
+    if (!s->nr) {
+        return;
+    }
+    if (!block || block->used_length != s->used_length) {
+        /* Unplugged or resized meanwhile, the samples are meaningless */
+        s->nr = 0;
+        return;
+    }
+    for (i = 0; i < s->nr; i++) {
+        if (dirty_rate_hash(block, s->offsets[i]) != s->hashes[i]) {
+            s->dirty++;
+        }
+    }
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    GArray *samples = g_array_new(false, true, sizeof(DirtyRateSample));
+    DirtyRateBlockList **prev;
+    RAMBlock *block;
+    int64_t start, elapsed, calc_time, sample_pages, total = 0;
+    int i;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    calc_time = dirty_rate_calc_time;
+    sample_pages = dirty_rate_sample_pages;
+    qemu_mutex_unlock_iothread();
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_array_set_size(samples, samples->len + 1);
+        dirty_rate_sample_block(&g_array_index(samples, DirtyRateSample,
+                                               samples->len - 1),
+                                block, sample_pages);
+    }
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    rcu_read_unlock();
+
+    /* Not within the RCU critical section, RAM may be unplugged */
+    g_usleep(calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    for (i = 0; i < samples->len; i++) {
+        dirty_rate_check_block(&g_array_index(samples, DirtyRateSample, i));
+    }
+    elapsed = MAX(1, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+    rcu_read_unlock();
+
+    qemu_mutex_lock_iothread();
+    prev = &dirty_rate_blocks;
+    for (i = 0; i < samples->len; i++) {
+        DirtyRateSample *s = &g_array_index(samples, DirtyRateSample, i);
+        DirtyRateBlockList *entry;
+
+        if (s->nr) {
+            entry = g_new0(DirtyRateBlockList, 1);
+            entry->value = g_new0(DirtyRateBlock, 1);
+            entry->value->id = g_strdup(s->idstr);
+            entry->value->sample_pages = s->nr;
+            /* MB of the block times the fraction of samples that changed */
+            entry->value->dirty_rate = (double)s->used_length * s->dirty /
+                                       s->nr / (1 << 20) * 1000 / elapsed;
+            total += entry->value->dirty_rate;
+            *prev = entry;
+            prev = &entry->next;
+        }
+        g_free(s->offsets);
+        g_free(s->hashes);
+    }
+    dirty_rate_total = total;
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    g_array_free(samples, true);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, "calc-time must be between 1 and %d seconds",
+                   DIRTY_RATE_MAX_CALC_TIME);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTY_RATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 ||
+               sample_pages > DIRTY_RATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between 1 and %d",
+                   DIRTY_RATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already running");
+        return;
+    }
+
+    qapi_free_DirtyRateBlockList(dirty_rate_blocks);
+    dirty_rate_blocks = NULL;
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate_start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate_calc_time = calc_time;
+    dirty_rate_sample_pages = sample_pages;
+
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateBlockList *b, **prev = &info->blocks;
+
+    info->status = dirty_rate_status;
+    info->start_time = dirty_rate_start_time;
+    info->calc_time = dirty_rate_calc_time;
+    info->sample_pages = dirty_rate_sample_pages;
+
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirty_rate_total;
+        info->has_blocks = true;
+        for (b = dirty_rate_blocks; b; b = b->next) {
+            DirtyRateBlockList *entry = g_new0(DirtyRateBlockList, 1);
+
+            entry->value = g_new0(DirtyRateBlock, 1);
+            *entry->value = *b->value;
+            entry->value->id = g_strdup(b->value->id);
+            *prev = entry;
+            prev = &entry->next;
+        }
+    }
+    return info;
+}
@@ -27,6 +27,8 @@
 #include "qemu/rcu.h"
 #include "migration/block.h"
 #include "migration/postcopy-ram.h"
+#include "migration/compress.h"
+#include "migration/colo.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -54,6 +56,12 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of additional connections for RAM pages */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_RDMA_QUEUE_PAIRS 1
+#define DEFAULT_MIGRATE_BLOCK_INFLIGHT_DEPTH 512
+#define DEFAULT_MIGRATE_SEND_IOV_DEPTH 64
+#define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -85,10 +93,20 @@ MigrationState *migrate_get_current(void)
         .mbps = -1,
         .parameters = {
             .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
             .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .postcopy_prefetch_pages = 0,
+            .cpu_throttle_convergence_time = 0,
+            .rdma_queue_pairs = DEFAULT_MIGRATE_RDMA_QUEUE_PAIRS,
+            .block_inflight_depth = DEFAULT_MIGRATE_BLOCK_INFLIGHT_DEPTH,
+            .send_iov_depth = DEFAULT_MIGRATE_SEND_IOV_DEPTH,
+            .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .x_checkpoint_dirty_limit = 0,
+            .x_colo_heartbeat_timeout = 0,
         },
     };
 
@@ -301,6 +319,16 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     const char *p;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
+    if (migrate_use_multifd() && strcmp(uri, "defer")) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Multifd needs a tcp or unix migration");
+            return;
+        }
+        if (migrate_get_current()->parameters.tls_creds) {
+            error_setg(errp, "Multifd is not compatible with TLS");
+            return;
+        }
+    }
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
     } else if (strstart(uri, "tcp:", &p)) {
@@ -401,6 +429,12 @@ static void process_incoming_migration_co(void *opaque)
         /* Else if something went wrong then just fall out of the normal exit */
     }
 
+    if (ret >= 0 && mis->colo_enabled && !colo_incoming_start(mis)) {
+        /* Woken up by the COLO thread once the checkpoints stop */
+        qemu_coroutine_yield();
+        qemu_thread_join(&mis->colo_incoming_thread);
+    }
+
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
 
@@ -411,6 +445,8 @@ static void process_incoming_migration_co(void *opaque)
         migrate_decompress_threads_join();
         exit(EXIT_FAILURE);
     }
+    multifd_recv_threads_join();
+    postcopy_preempt_recv_join();
 
     mis->bh = qemu_bh_new(process_incoming_migration_bh, mis);
     qemu_bh_schedule(mis->bh);
@@ -566,6 +602,17 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->compress_method = s->parameters.compress_method;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
+    params->cpu_throttle_convergence_time =
+        s->parameters.cpu_throttle_convergence_time;
+    params->rdma_queue_pairs = s->parameters.rdma_queue_pairs;
+    params->block_inflight_depth = s->parameters.block_inflight_depth;
+    params->send_iov_depth = s->parameters.send_iov_depth;
+    params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->x_checkpoint_dirty_limit = s->parameters.x_checkpoint_dirty_limit;
+    params->x_colo_heartbeat_timeout = s->parameters.x_colo_heartbeat_timeout;
 
     return params;
 }
@@ -580,6 +627,7 @@ static bool migration_is_setup_or_active(int state)
     case MIGRATION_STATUS_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_SETUP:
+    case MIGRATION_STATUS_COLO:
         return true;
 
     default:
@@ -599,7 +647,89 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_eviction = xbzrle_mig_cache_evictions();
+    }
+}
+
+static void populate_vcpu_throttle_info(MigrationInfo *info)
+{
+    intList **tail = &info->vcpu_throttle_percentage;
+    CPUState *cpu;
+
+    info->has_vcpu_throttle_percentage = true;
+    CPU_FOREACH(cpu) {
+        *tail = g_new0(intList, 1);
+        (*tail)->value = atomic_read(&cpu->throttle_percentage);
+        tail = &(*tail)->next;
+    }
+}
+
+/*
+ * Each bandwidth sample covers BUFFER_DELAY and each dirty rate sample
+ * one second or more, hence the heavier weight of the latter.
+ */
+#define PREDICTION_BANDWIDTH_WEIGHT 0.1
+#define PREDICTION_DIRTY_RATE_WEIGHT 0.3
+
+static void migration_sample_bandwidth(MigrationState *s, double bandwidth)
+{
+    if (!s->bandwidth_avg) {
+        s->bandwidth_avg = bandwidth;
+    } else {
+        s->bandwidth_avg += PREDICTION_BANDWIDTH_WEIGHT *
+                            (bandwidth - s->bandwidth_avg);
+    }
+}
+
+/* Called from migration_bitmap_sync() whenever dirty_bytes_rate changes */
+void migration_sample_dirty_rate(MigrationState *s)
+{
+    double rate = s->dirty_bytes_rate / 1000.0;
+
+    if (!s->dirty_rate_avg) {
+        s->dirty_rate_avg = rate;
+    } else {
+        s->dirty_rate_avg += PREDICTION_DIRTY_RATE_WEIGHT *
+                             (rate - s->dirty_rate_avg);
+    }
+}
+
+/*
+ * Every millisecond sends bandwidth_avg bytes and dirties dirty_rate_avg
+ * more, so what remains shrinks by their difference until it can be sent
+ * within the downtime limit.
+ */
+static void populate_prediction(MigrationInfo *info, MigrationState *s)
+{
+    MigrationPrediction *pred;
+    double bandwidth = s->bandwidth_avg;
+    double dirty_rate = s->dirty_rate_avg;
+    double threshold = bandwidth * migrate_max_downtime() / 1000000;
+    uint64_t remaining;
+
+    if (bandwidth <= 0) {
+        return;
+    }
+    remaining = ram_bytes_remaining();
+    if (blk_mig_active()) {
+        remaining += blk_mig_bytes_remaining();
+    }
+
+    pred = g_new0(MigrationPrediction, 1);
+    pred->bandwidth = bandwidth * 1000;
+    pred->dirty_rate = dirty_rate * 1000;
+    pred->remaining = remaining;
+    pred->converging = dirty_rate < bandwidth;
+    if (pred->converging) {
+        pred->has_remaining_time = true;
+        pred->remaining_time = remaining > threshold ?
+            (remaining - threshold) / (bandwidth - dirty_rate) : 0;
     }
+    pred->stop_downtime = remaining / bandwidth;
+
+    info->has_prediction = true;
+    info->prediction = pred;
 }
 
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
@@ -614,6 +744,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->normal_bytes = norm_mig_bytes_transferred();
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = s->dirty_sync_count;
+    info->ram->dirty_sync_time = s->dirty_sync_time;
     info->ram->postcopy_requests = s->postcopy_requests;
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -647,6 +778,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->setup_time = s->setup_time;
 
         populate_ram_info(info, s);
+        populate_prediction(info, s);
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -659,6 +791,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         if (cpu_throttle_active()) {
             info->has_cpu_throttle_percentage = true;
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+            if (s->parameters.cpu_throttle_convergence_time) {
+                populate_vcpu_throttle_info(info);
+            }
         }
 
         get_xbzrle_cache_stats(info);
@@ -707,11 +842,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
         break;
     case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_COLO:
         info->has_status = true;
         break;
     }
     info->status = s->state;
 
+    info->postcopy_faults = postcopy_get_fault_stats();
+    info->has_postcopy_faults = info->postcopy_faults != NULL;
+
     return info;
 }
 
@@ -757,6 +896,50 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        error_report("Postcopy preemption needs postcopy");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT] =
+            false;
+    }
+
+    if (migrate_use_multifd()) {
+        /*
+         * Postcopy sends pages out of order and compression has its
+         * own threads, neither knows about the multifd channels.
+         */
+        if (migrate_postcopy_ram() || migrate_use_compression()) {
+            error_report("Multifd is not currently compatible with "
+                         "postcopy or compression");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_zero_copy_send() && migrate_use_xbzrle()) {
+        /* A page changing while it is being sent would no longer match
+         * the copy XBZRLE keeps of it.
+         */
+        error_report("Zero copy sending is not compatible with xbzrle");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND] = false;
+    }
+
+    if (migrate_colo_enabled() &&
+        (migrate_postcopy_ram() || migrate_use_multifd())) {
+        /* Checkpoints go through the main stream only, and never end */
+        error_report("COLO is not currently compatible with postcopy or "
+                     "multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_COLO] = false;
+    }
+
+    if (migrate_use_fixed_ram() &&
+        (migrate_use_xbzrle() || migrate_use_compression() ||
+         migrate_postcopy_ram() || migrate_use_multifd() ||
+         migrate_colo_enabled())) {
+        /* Only plain pages have a place of their own in the file */
+        error_report("Fixed RAM offsets are not compatible with xbzrle, "
+                     "compression, postcopy, multifd or COLO");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_FIXED_RAM] = false;
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +956,26 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_postcopy_prefetch_pages,
+                                int64_t postcopy_prefetch_pages,
+                                bool has_cpu_throttle_convergence_time,
+                                int64_t cpu_throttle_convergence_time,
+                                bool has_rdma_queue_pairs,
+                                int64_t rdma_queue_pairs,
+                                bool has_block_inflight_depth,
+                                int64_t block_inflight_depth,
+                                bool has_send_iov_depth,
+                                int64_t send_iov_depth,
+                                bool has_x_checkpoint_delay,
+                                int64_t x_checkpoint_delay,
+                                bool has_x_checkpoint_dirty_limit,
+                                int64_t x_checkpoint_dirty_limit,
+                                bool has_x_colo_heartbeat_timeout,
+                                int64_t x_colo_heartbeat_timeout,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +1011,77 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_compress_method && !migration_codec_supported(compress_method)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "a compression method supported by this build");
+        return;
+    }
+    if (has_postcopy_prefetch_pages &&
+            (postcopy_prefetch_pages < 0 || postcopy_prefetch_pages > 1024)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 1024");
+        return;
+    }
+    if (has_cpu_throttle_convergence_time &&
+            (cpu_throttle_convergence_time < 0 ||
+             cpu_throttle_convergence_time > 600000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "cpu_throttle_convergence_time",
+                   "is invalid, it should be in the range of 0 to 600000");
+        return;
+    }
+    if (has_rdma_queue_pairs &&
+            (rdma_queue_pairs < 1 || rdma_queue_pairs > 8)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "rdma_queue_pairs",
+                   "is invalid, it should be in the range of 1 to 8");
+        return;
+    }
+    if (has_block_inflight_depth &&
+            (block_inflight_depth < 1 || block_inflight_depth > 512)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "block_inflight_depth",
+                   "is invalid, it should be in the range of 1 to 512");
+        return;
+    }
+    if (has_send_iov_depth &&
+            (send_iov_depth < 2 || send_iov_depth > 1024)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "send_iov_depth",
+                   "is invalid, it should be in the range of 2 to 1024");
+        return;
+    }
+    if (has_x_checkpoint_delay &&
+            (x_checkpoint_delay < 1 || x_checkpoint_delay > 60000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_checkpoint_delay",
+                   "is invalid, it should be in the range of 1 to 60000");
+        return;
+    }
+    if (has_x_checkpoint_dirty_limit &&
+            (x_checkpoint_dirty_limit < 0 ||
+             x_checkpoint_dirty_limit > 1048576)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_checkpoint_dirty_limit",
+                   "is invalid, it should be in the range of 0 to 1048576");
+        return;
+    }
+    if (has_x_colo_heartbeat_timeout &&
+            (x_colo_heartbeat_timeout < 0 ||
+             x_colo_heartbeat_timeout > 60000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_colo_heartbeat_timeout",
+                   "is invalid, it should be in the range of 0 to 60000");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +1106,37 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters.compress_method = compress_method;
+    }
+    if (has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages = postcopy_prefetch_pages;
+    }
+    if (has_cpu_throttle_convergence_time) {
+        s->parameters.cpu_throttle_convergence_time =
+            cpu_throttle_convergence_time;
+    }
+    if (has_rdma_queue_pairs) {
+        s->parameters.rdma_queue_pairs = rdma_queue_pairs;
+    }
+    if (has_block_inflight_depth) {
+        s->parameters.block_inflight_depth = block_inflight_depth;
+    }
+    if (has_send_iov_depth) {
+        s->parameters.send_iov_depth = send_iov_depth;
+    }
+    if (has_x_checkpoint_delay) {
+        s->parameters.x_checkpoint_delay = x_checkpoint_delay;
+    }
+    if (has_x_checkpoint_dirty_limit) {
+        s->parameters.x_checkpoint_dirty_limit = x_checkpoint_dirty_limit;
+    }
+    if (has_x_colo_heartbeat_timeout) {
+        s->parameters.x_colo_heartbeat_timeout = x_colo_heartbeat_timeout;
+    }
 }
 
 
@@ -942,6 +1247,10 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING) {
+        multifd_send_shutdown();
+        postcopy_preempt_send_shutdown();
+    }
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -970,6 +1279,15 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIGRATION_STATUS_FAILED);
 }
 
+/* Return true if no outgoing migration is in flight */
+bool migration_is_idle(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return !migration_is_setup_or_active(s->state) &&
+           s->state != MIGRATION_STATUS_CANCELLING;
+}
+
 bool migration_in_postcopy(MigrationState *s)
 {
     return (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -1002,8 +1320,11 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->expected_downtime = 0;
     s->dirty_pages_rate = 0;
     s->dirty_bytes_rate = 0;
+    s->bandwidth_avg = 0;
+    s->dirty_rate_avg = 0;
     s->setup_time = 0;
     s->dirty_sync_count = 0;
+    s->dirty_sync_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->postcopy_requests = 0;
@@ -1095,6 +1416,28 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* A live dump relies on the same dirty bitmap */
+    if (dump_in_progress()) {
+        error_setg(errp, "There is a dump in process, please wait.");
+        return;
+    }
+
+    if (migrate_colo_enabled() && (params.blk || params.shared)) {
+        error_setg(errp, "COLO is not compatible with block migration");
+        return;
+    }
+
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Multifd needs a tcp or unix migration");
+            return;
+        }
+        if (s->parameters.tls_creds) {
+            error_setg(errp, "Multifd is not compatible with TLS");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1234,6 +1577,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1261,6 +1613,144 @@ bool migrate_use_events(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_colo_enabled(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_COLO];
+}
+
+bool migrate_use_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_FIXED_RAM];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT];
+}
+
+/* Apply send-iov-depth and zero-copy-send to a stream we send on */
+void migrate_tune_send_file(QEMUFile *f)
+{
+    Error *local_err = NULL;
+
+    qemu_file_set_iov_depth(f, migrate_send_iov_depth());
+    if (migrate_zero_copy_send() &&
+        qemu_file_set_zerocopy(f, true, &local_err) < 0) {
+        error_reportf_err(local_err, "Sending with copies: ");
+    }
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
+int migrate_rdma_queue_pairs(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.rdma_queue_pairs;
+}
+
+int migrate_block_inflight_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.block_inflight_depth;
+}
+
+int migrate_send_iov_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.send_iov_depth;
+}
+
+int64_t migrate_checkpoint_delay(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_checkpoint_delay;
+}
+
+int64_t migrate_checkpoint_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_checkpoint_dirty_limit;
+}
+
+int64_t migrate_colo_heartbeat_timeout(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_colo_heartbeat_timeout;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1345,6 +1835,8 @@ static void *source_return_path_thread(void *opaque)
     size_t  len = 0, expected_len;
     int res;
 
+    /* page requests are looked up, and maybe sent, under RCU */
+    rcu_register_thread();
     trace_source_return_path_thread_entry();
     while (!ms->rp_state.error && !qemu_file_get_error(rp) &&
            migration_is_setup_or_active(ms->state)) {
@@ -1441,6 +1933,7 @@ static void *source_return_path_thread(void *opaque)
 out:
     ms->rp_state.from_dst_file = NULL;
     qemu_fclose(rp);
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -1675,7 +2168,8 @@ static void migration_completion(MigrationState *s, int current_active_state,
     }
 
     migrate_set_state(&s->state, current_active_state,
-                      MIGRATION_STATUS_COMPLETED);
+                      migrate_colo_enabled() ? MIGRATION_STATUS_COLO :
+                                               MIGRATION_STATUS_COMPLETED);
     return;
 
 fail_invalidate:
@@ -1734,6 +2228,11 @@ static void *migration_thread(void *opaque)
         qemu_savevm_send_postcopy_advise(s->to_dst_file);
     }
 
+    if (migrate_colo_enabled()) {
+        /* Tell the dest to stay for the checkpoints once it's loaded */
+        qemu_savevm_send_colo_enable(s->to_dst_file);
+    }
+
     qemu_savevm_state_begin(s->to_dst_file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
@@ -1797,6 +2296,7 @@ static void *migration_thread(void *opaque)
 
             s->mbps = (((double) transferred_bytes * 8.0) /
                     ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
+            migration_sample_bandwidth(s, bandwidth);
 
             trace_migrate_transferred(transferred_bytes, time_spent,
                                       bandwidth, max_size);
@@ -1819,6 +2319,10 @@ static void *migration_thread(void *opaque)
     trace_migration_thread_after_loop();
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
+    if (s->state == MIGRATION_STATUS_COLO) {
+        /* The RAM state is needed until the checkpoints stop */
+        colo_process_checkpoint(s);
+    }
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock_iothread();
@@ -1859,6 +2363,7 @@ void migrate_fd_connect(MigrationState *s)
     qemu_file_set_blocking(s->to_dst_file, true);
     qemu_file_set_rate_limit(s->to_dst_file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
+    migrate_tune_send_file(s->to_dst_file);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
@@ -24,6 +24,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qom/cpu.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -31,6 +34,9 @@
  */
 #define MAX_DISCARDS_PER_COMMAND 12
 
+/* Number of small host pages ram_load_postcopy() can place at once */
+#define POSTCOPY_BATCH_PAGES 32
+
 struct PostcopyDiscardState {
     const char *ramblock_name;
     uint64_t offset; /* Bitmap entry for the 1st bit of this RAMBlock */
@@ -60,13 +66,36 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
-static bool ufd_version_check(int ufd)
+/* Userfault features the kernel supports */
+static uint64_t ufd_supported_features(void)
 {
     struct uffdio_api api_struct;
-    uint64_t ioctl_mask;
+    uint64_t features = 0;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        return 0;
+    }
 
     api_struct.api = UFFD_API;
     api_struct.features = 0;
+    if (!ioctl(ufd, UFFDIO_API, &api_struct)) {
+        features = api_struct.features;
+    }
+    close(ufd);
+
+    return features;
+}
+
+/* Check the API of @ufd, asking for the optional @features */
+static bool ufd_version_check(int ufd, uint64_t features)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = features;
     if (ioctl(ufd, UFFDIO_API, &api_struct)) {
         error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
                      strerror(errno));
@@ -81,6 +110,12 @@ static bool ufd_version_check(int ufd)
         return false;
     }
 
+    if (qemu_ram_pagesize_largest() > getpagesize() &&
+        !(api_struct.features & UFFD_FEATURE_MISSING_HUGETLBFS)) {
+        error_report("Host lacks userfault support for huge pages");
+        return false;
+    }
+
     return true;
 }
 
@@ -112,7 +147,7 @@ bool postcopy_ram_supported_by_host(void)
     }
 
     /* Version and features check */
-    if (!ufd_version_check(ufd)) {
+    if (!ufd_version_check(ufd, 0)) {
         goto out;
     }
 
@@ -181,20 +216,18 @@ out:
  * We can assume that if we've been called postcopy_ram_hosttest returned true.
  *
  * @mis: Current incoming migration state.
- * @start, @length: range of memory to discard.
+ * @rb: RAMBlock the range is in.
+ * @start, @length: range of memory to discard, as offsets in @rb; they
+ *   must be aligned to the page size of @rb.
  *
  * returns: 0 on success.
  */
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length)
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length)
 {
-    trace_postcopy_ram_discard_range(start, length);
-    if (madvise(start, length, MADV_DONTNEED)) {
-        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
-        return -1;
-    }
+    trace_postcopy_ram_discard_range(qemu_ram_get_idstr(rb), start, length);
 
-    return 0;
+    return ram_block_discard_range(rb, start, length) ? -1 : 0;
 }
 
 /*
@@ -206,6 +239,7 @@ static int init_range(const char *block_name, void *host_addr,
                       ram_addr_t offset, ram_addr_t length, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    RAMBlock *rb = qemu_ram_block_by_name(block_name);
 
     trace_postcopy_init_range(block_name, host_addr, offset, length);
 
@@ -215,7 +249,7 @@ static int init_range(const char *block_name, void *host_addr,
      * - we're going to get the copy from the source anyway.
      * (Precopy will just overwrite this data, so doesn't need the discard)
      */
-    if (postcopy_ram_discard_range(mis, host_addr, length)) {
+    if (postcopy_ram_discard_range(mis, rb, 0, length)) {
         return -1;
     }
 
@@ -277,6 +311,8 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    postcopy_preempt_recv_join();
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -318,9 +354,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     migrate_send_rp_shut(mis, qemu_file_get_error(mis->from_src_file) != 0);
 
     if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, getpagesize());
+        munmap(mis->postcopy_tmp_page, mis->postcopy_tmp_page_size);
         mis->postcopy_tmp_page = NULL;
     }
+    if (mis->postcopy_tmp_zero_page) {
+        munmap(mis->postcopy_tmp_zero_page, mis->postcopy_tmp_zero_page_size);
+        mis->postcopy_tmp_zero_page = NULL;
+    }
     trace_postcopy_ram_incoming_cleanup_exit();
     return 0;
 }
@@ -333,6 +373,12 @@ static int nhp_range(const char *block_name, void *host_addr,
 {
     trace_postcopy_nhp_range(block_name, host_addr, offset, length);
 
+    if (qemu_ram_pagesize(qemu_ram_block_by_name(block_name)) >
+        getpagesize()) {
+        /* hugetlbfs pages can't be split anyway */
+        return 0;
+    }
+
     /*
      * Before we do discards we need to ensure those discards really
      * do delete areas of the page, even if THP thinks a hugepage would
@@ -388,6 +434,208 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
     return 0;
 }
 
+/*
+ * Faults are timed from the fault thread reading them to the placement of
+ * the page they wait for.  A vCPU can only wait for one page at a time,
+ * other threads (device emulation, vhost) may fault too.
+ */
+#define POSTCOPY_FAULTS_MAX 64
+/* Bucket n counts latencies below 2^n microseconds */
+#define POSTCOPY_LATENCY_BUCKETS 32
+
+typedef struct PostcopyFault {
+    uint64_t addr;
+    int64_t start;  /* ns */
+    int cpu;        /* index of the faulting vCPU, or -1 if unknown */
+} PostcopyFault;
+
+static struct {
+    bool valid;
+    bool have_cpu;
+    QemuMutex lock;
+    /* Faults whose page hasn't been placed yet */
+    int nr_pending;
+    PostcopyFault pending[POSTCOPY_FAULTS_MAX];
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t histogram[POSTCOPY_LATENCY_BUCKETS];
+    /* Per vCPU, indexed by cpu_index */
+    uint64_t *vcpu_blocktime_us;
+} postcopy_faults;
+
+/* Called from the main thread before the fault thread starts */
+static void postcopy_fault_stats_reset(bool have_cpu)
+{
+    if (!postcopy_faults.valid) {
+        qemu_mutex_init(&postcopy_faults.lock);
+    }
+
+    qemu_mutex_lock(&postcopy_faults.lock);
+    g_free(postcopy_faults.vcpu_blocktime_us);
+    memset(postcopy_faults.histogram, 0, sizeof(postcopy_faults.histogram));
+    postcopy_faults.count = 0;
+    postcopy_faults.total_us = 0;
+    postcopy_faults.max_us = 0;
+    atomic_set(&postcopy_faults.nr_pending, 0);
+    postcopy_faults.have_cpu = have_cpu;
+    postcopy_faults.vcpu_blocktime_us = g_new0(uint64_t, max_cpus);
+    qemu_mutex_unlock(&postcopy_faults.lock);
+
+    atomic_mb_set(&postcopy_faults.valid, true);
+}
+
+static int postcopy_fault_cpu_index(uint32_t ptid)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->thread_id == ptid) {
+            return cpu->cpu_index;
+        }
+    }
+    return -1;
+}
+
+/* Called by the fault thread */
+static void postcopy_fault_begin(uint64_t addr, int cpu, int64_t start)
+{
+    PostcopyFault *f = NULL, *oldest = NULL;
+    int i;
+
+    qemu_mutex_lock(&postcopy_faults.lock);
+    /*
+     * The page may have been placed between the fault and now, leaving
+     * an entry that never completes; let new faults take the place of
+     * such stale ones.
+     */
+    for (i = 0; i < postcopy_faults.nr_pending; i++) {
+        PostcopyFault *p = &postcopy_faults.pending[i];
+
+        if (cpu != -1 && p->cpu == cpu) {
+            f = p;
+            break;
+        }
+        if (!oldest || p->start < oldest->start) {
+            oldest = p;
+        }
+    }
+    if (!f) {
+        if (postcopy_faults.nr_pending < POSTCOPY_FAULTS_MAX) {
+            f = &postcopy_faults.pending[postcopy_faults.nr_pending];
+            atomic_inc(&postcopy_faults.nr_pending);
+        } else {
+            f = oldest;
+        }
+    }
+    f->addr = addr;
+    f->cpu = cpu;
+    f->start = start;
+    qemu_mutex_unlock(&postcopy_faults.lock);
+}
+
+/* Called once [host, host + size) has been placed */
+static void postcopy_fault_end(void *host, size_t size)
+{
+    int64_t now;
+    uint64_t us;
+    int i;
+
+    if (!atomic_read(&postcopy_faults.nr_pending)) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_mutex_lock(&postcopy_faults.lock);
+    for (i = 0; i < postcopy_faults.nr_pending; ) {
+        PostcopyFault *f = &postcopy_faults.pending[i];
+
+        if (f->addr - (uintptr_t)host >= size) {
+            i++;
+            continue;
+        }
+
+        us = (now - f->start) / SCALE_US;
+        postcopy_faults.count++;
+        postcopy_faults.total_us += us;
+        postcopy_faults.max_us = MAX(postcopy_faults.max_us, us);
+        postcopy_faults.histogram[MIN(us ? 64 - clz64(us) : 0,
+                                      POSTCOPY_LATENCY_BUCKETS - 1)]++;
+        if (f->cpu >= 0 && f->cpu < max_cpus) {
+            postcopy_faults.vcpu_blocktime_us[f->cpu] += us;
+        }
+
+        atomic_dec(&postcopy_faults.nr_pending);
+        *f = postcopy_faults.pending[postcopy_faults.nr_pending];
+    }
+    qemu_mutex_unlock(&postcopy_faults.lock);
+}
+
+/* Upper bound of the bucket holding the fault below which @pct% are */
+static uint64_t postcopy_fault_percentile(int pct)
+{
+    uint64_t target = (postcopy_faults.count * pct + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        seen += postcopy_faults.histogram[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return MIN(1ULL << i, postcopy_faults.max_us);
+}
+
+PostcopyFaultStats *postcopy_get_fault_stats(void)
+{
+    PostcopyFaultStats *stats;
+    CPUState *cpu;
+    intList **tail;
+    int i, last;
+
+    if (!atomic_mb_read(&postcopy_faults.valid)) {
+        return NULL;
+    }
+
+    stats = g_new0(PostcopyFaultStats, 1);
+    qemu_mutex_lock(&postcopy_faults.lock);
+    stats->faults = postcopy_faults.count;
+    if (postcopy_faults.count) {
+        stats->average = postcopy_faults.total_us / postcopy_faults.count;
+        stats->p50 = postcopy_fault_percentile(50);
+        stats->p90 = postcopy_fault_percentile(90);
+        stats->p99 = postcopy_fault_percentile(99);
+    }
+    stats->max = postcopy_faults.max_us;
+
+    for (last = POSTCOPY_LATENCY_BUCKETS - 1; last >= 0; last--) {
+        if (postcopy_faults.histogram[last]) {
+            break;
+        }
+    }
+    tail = &stats->histogram;
+    for (i = 0; i <= last; i++) {
+        *tail = g_new0(intList, 1);
+        (*tail)->value = postcopy_faults.histogram[i];
+        tail = &(*tail)->next;
+    }
+
+    if (postcopy_faults.have_cpu) {
+        stats->has_vcpu_blocktime = true;
+        tail = &stats->vcpu_blocktime;
+        CPU_FOREACH(cpu) {
+            *tail = g_new0(intList, 1);
+            (*tail)->value =
+                postcopy_faults.vcpu_blocktime_us[cpu->cpu_index] / 1000;
+            tail = &(*tail)->next;
+        }
+    }
+    qemu_mutex_unlock(&postcopy_faults.lock);
+
+    return stats;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -396,7 +644,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
     MigrationIncomingState *mis = opaque;
     struct uffd_msg msg;
     int ret;
-    size_t hostpagesize = getpagesize();
+    size_t pagesize;
+    uint64_t len;
+    int64_t start;
+    int cpu;
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
 
@@ -430,6 +681,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
         }
 
         ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         if (ret != sizeof(msg)) {
             if (errno == EAGAIN) {
                 /*
@@ -463,23 +715,36 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        rb_offset &= ~(hostpagesize - 1);
-        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset);
+        cpu = -1;
+        if (postcopy_faults.have_cpu) {
+            cpu = postcopy_fault_cpu_index(msg.arg.pagefault.feat.ptid);
+        }
+        postcopy_fault_begin(msg.arg.pagefault.address, cpu, start);
+
+        pagesize = qemu_ram_pagesize(rb);
+        rb_offset &= ~(pagesize - 1);
 
         /*
          * Send the request to the source - we want to request one
-         * of our host page sizes (which is >= TPS)
+         * of the block's host page sizes (which is >= TPS), plus the
+         * prefetch window behind it: guests tend to touch neighbouring
+         * pages next, and asking for them now saves a round trip each.
          */
+        len = (uint64_t)pagesize * (1 + migrate_postcopy_prefetch_pages());
+        len = MIN(len, qemu_ram_get_used_length(rb) - rb_offset);
+        /* The request only has 32 bits for the length */
+        len = MIN(len, UINT32_MAX & ~(uint64_t)(pagesize - 1));
+        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                                qemu_ram_get_idstr(rb),
+                                                rb_offset, len);
         if (rb != last_rb) {
             last_rb = rb;
             migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
+                                     rb_offset, len);
         } else {
             /* Save some space */
             migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
+                                     rb_offset, len);
         }
     }
     trace_postcopy_ram_fault_thread_exit();
@@ -488,6 +753,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
+    uint64_t features;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -500,9 +767,11 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      * Although the host check already tested the API, we need to
      * do the check again as an ABI handshake on the new fd.
      */
-    if (!ufd_version_check(mis->userfault_fd)) {
+    features = ufd_supported_features() & UFFD_FEATURE_THREAD_ID;
+    if (!ufd_version_check(mis->userfault_fd, features)) {
         return -1;
     }
+    postcopy_fault_stats_reset(features & UFFD_FEATURE_THREAD_ID);
 
     /* Now an eventfd we use to tell the fault-thread to quit */
     mis->userfault_quit_fd = eventfd(0, EFD_CLOEXEC);
@@ -537,48 +806,96 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 }
 
 /*
- * Place a host page (from) at (host) atomically
+ * Place (size) bytes of host pages (from) at (host) atomically
  * returns 0 on success
+ *
+ * With postcopy preemption a page can come on both channels; the pages
+ * that were already placed are skipped.
  */
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t size)
 {
     struct uffdio_copy copy_struct;
+    size_t done = 0;
+    ram_addr_t offset;
+    RAMBlock *rb;
+
+    while (done < size) {
+        copy_struct.dst = (uint64_t)(uintptr_t)host + done;
+        copy_struct.src = (uint64_t)(uintptr_t)from + done;
+        copy_struct.len = size - done;
+        copy_struct.mode = 0;
+        copy_struct.copy = 0;
+
+        /* copy also acks to the kernel waking the stalled thread up
+         * TODO: We can inhibit that ack and only do it if it was requested
+         * which would be slightly cheaper, but we'd have to be careful
+         * of the order of updating our page state.
+         */
+        if (!ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+            break;
+        }
+        if (errno != EEXIST) {
+            int e = errno;
+            error_report("%s: %s copy host: %p from: %p",
+                         __func__, strerror(e), host, from);
 
-    copy_struct.dst = (uint64_t)(uintptr_t)host;
-    copy_struct.src = (uint64_t)(uintptr_t)from;
-    copy_struct.len = getpagesize();
-    copy_struct.mode = 0;
-
-    /* copy also acks to the kernel waking the stalled thread up
-     * TODO: We can inhibit that ack and only do it if it was requested
-     * which would be slightly cheaper, but we'd have to be careful
-     * of the order of updating our page state.
-     */
-    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
-        int e = errno;
-        error_report("%s: %s copy host: %p from: %p",
-                     __func__, strerror(e), host, from);
-
-        return -e;
+            return -e;
+        }
+        /* copy is negative if nothing was copied before the existing page */
+        if (copy_struct.copy > 0) {
+            done += copy_struct.copy;
+        }
+        rb = qemu_ram_block_from_host((uint8_t *)host + done, false, &offset);
+        done += rb ? rb->page_size : getpagesize();
+        trace_postcopy_place_page_exists(host, done);
     }
 
-    trace_postcopy_place_page(host);
+    trace_postcopy_place_page(host, size);
+    postcopy_fault_end(host, size);
     return 0;
 }
 
 /*
- * Place a zero page at (host) atomically
+ * Place a zero page of (size) bytes at (host) atomically
  * returns 0 on success
  */
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t size)
 {
     struct uffdio_zeropage zero_struct;
 
+    trace_postcopy_place_page_zero(host, size);
+
+    if (size > getpagesize()) {
+        /*
+         * UFFDIO_ZEROPAGE doesn't work on hugetlbfs, copy from a zeroed
+         * area instead; it isn't written to so never gets populated.
+         */
+        if (!mis->postcopy_tmp_zero_page) {
+            mis->postcopy_tmp_zero_page_size = qemu_ram_pagesize_largest();
+            mis->postcopy_tmp_zero_page = mmap(NULL,
+                                 mis->postcopy_tmp_zero_page_size,
+                                 PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                                 -1, 0);
+            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+                int e = errno;
+                mis->postcopy_tmp_zero_page = NULL;
+                error_report("%s: %s mapping zero page", __func__,
+                             strerror(e));
+                return -e;
+            }
+        }
+        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
+                                   size);
+    }
+
     zero_struct.range.start = (uint64_t)(uintptr_t)host;
-    zero_struct.range.len = getpagesize();
+    zero_struct.range.len = size;
     zero_struct.mode = 0;
 
-    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct) &&
+        errno != EEXIST) {
         int e = errno;
         error_report("%s: %s zero host: %p",
                      __func__, strerror(e), host);
@@ -586,22 +903,27 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
         return -e;
     }
 
-    trace_postcopy_place_page_zero(host);
+    postcopy_fault_end(host, size);
     return 0;
 }
 
 /*
- * Returns a target page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * Returns an area of memory that can be mapped at a later point in time
+ * using postcopy_place_page; it holds at least one of the largest host
+ * pages of any RAMBlock, or a batch of small ones.
  * The same address is used repeatedly, postcopy_place_page just takes the
- * backing page away.
- * Returns: Pointer to allocated page
+ * backing pages away.
+ * Returns: Pointer to allocated area, its size is stored in
+ *          mis->postcopy_tmp_page_size
  *
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis)
 {
     if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
+        mis->postcopy_tmp_page_size = MAX(qemu_ram_pagesize_largest(),
+                                          POSTCOPY_BATCH_PAGES *
+                                          getpagesize());
+        mis->postcopy_tmp_page = mmap(NULL, mis->postcopy_tmp_page_size,
                              PROT_READ | PROT_WRITE, MAP_PRIVATE |
                              MAP_ANONYMOUS, -1, 0);
         if (mis->postcopy_tmp_page == MAP_FAILED) {
@@ -634,8 +956,8 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     return -1;
 }
 
-int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
-                               size_t length)
+int postcopy_ram_discard_range(MigrationIncomingState *mis, RAMBlock *rb,
+                               uint64_t start, size_t length)
 {
     assert(0);
     return -1;
@@ -653,13 +975,15 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     return -1;
 }
 
-int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
+                        size_t size)
 {
     assert(0);
     return -1;
 }
 
-int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
+                             size_t size)
 {
     assert(0);
     return -1;
@@ -671,6 +995,11 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+PostcopyFaultStats *postcopy_get_fault_stats(void)
+{
+    return NULL;
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -23,7 +23,9 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "migration/qemu-file.h"
+#include "io/channel-file.h"
 #include "io/channel-socket.h"
 #include "qemu/iov.h"
 
@@ -149,6 +151,81 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
     return qemu_fopen_channel_input(ioc);
 }
 
+static int channel_set_zerocopy(void *opaque, bool enabled, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET)) {
+        error_setg(errp, "Zero copy writes need a socket");
+        return -1;
+    }
+    return qio_channel_socket_set_zerocopy(QIO_CHANNEL_SOCKET(ioc), enabled,
+                                           errp);
+}
+
+static uint32_t channel_write_mark(void *opaque)
+{
+    return qio_channel_socket_zerocopy_mark(QIO_CHANNEL_SOCKET(opaque));
+}
+
+static int channel_wait_writes(void *opaque, uint32_t mark)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(opaque);
+    Error *local_err = NULL;
+
+    if (qio_channel_socket_zerocopy_wait(sioc, mark, &local_err) < 0) {
+        /* XXX handle Error * object */
+        error_free(local_err);
+        return -EIO;
+    }
+    return 0;
+}
+
+static ssize_t channel_write_at(void *opaque, const uint8_t *buf,
+                                size_t size, int64_t offset)
+{
+#ifndef _WIN32
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    size_t done = 0;
+    int fd;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return -ESPIPE;
+    }
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    while (done < size) {
+        ssize_t len = pwrite(fd, buf + done, size - done, offset + done);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += len;
+    }
+    return done;
+#else
+    return -ESPIPE;
+#endif
+}
+
+static int64_t channel_seek(void *opaque, int64_t offset, int whence)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    Error *local_err = NULL;
+    off_t ret;
+
+    ret = qio_channel_io_seek(ioc, offset, whence, &local_err);
+    if (ret < 0) {
+        /* XXX handle Error * object */
+        error_free(local_err);
+        return -ESPIPE;
+    }
+    return ret;
+}
+
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
     .close = channel_close,
@@ -164,6 +241,11 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .set_zerocopy = channel_set_zerocopy,
+    .write_mark = channel_write_mark,
+    .wait_writes = channel_wait_writes,
+    .write_at = channel_write_at,
+    .seek = channel_seek,
 };
 
 
@@ -22,14 +22,15 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
+#include "qapi/error.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/compress.h"
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
@@ -47,9 +48,20 @@ struct QEMUFile {
                     when reading */
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    uint8_t *buf;
+    uint8_t buf_space[IO_BUF_SIZE];
 
-    struct iovec iov[MAX_IOV_SIZE];
+    /*
+     * With zero copy writes, the kernel may still be sending the buffer
+     * that was just flushed, so buf flips between buf_space and zc_buf,
+     * each one waiting for the writes that last flushed it.
+     */
+    bool zerocopy;
+    uint8_t *zc_buf;
+    uint32_t zc_mark[2];
+
+    struct iovec *iov;
+    unsigned int iov_max;
     unsigned int iovcnt;
 
     int last_error;
@@ -99,6 +111,9 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->buf = f->buf_space;
+    f->iov_max = MAX_IOV_SIZE;
+    f->iov = g_new(struct iovec, f->iov_max);
     return f;
 }
 
@@ -164,6 +179,17 @@ void qemu_fflush(QEMUFile *f)
     }
     f->buf_index = 0;
     f->iovcnt = 0;
+
+    if (f->zerocopy) {
+        int bank = f->buf == f->zc_buf;
+
+        f->zc_mark[bank] = f->ops->write_mark(f->opaque);
+        bank = !bank;
+        f->buf = bank ? f->zc_buf : f->buf_space;
+        if (f->ops->wait_writes(f->opaque, f->zc_mark[bank]) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+    }
 }
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
@@ -273,6 +299,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for @len bytes sent on another channel on behalf of @f, so
+ * that they count for its rate limit and position.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->pos += len;
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -285,6 +321,10 @@ int qemu_fclose(QEMUFile *f)
 {
     int ret;
     qemu_fflush(f);
+    if (f->zerocopy &&
+        f->ops->wait_writes(f->opaque, f->ops->write_mark(f->opaque)) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     ret = qemu_file_get_error(f);
 
     if (f->ops->close) {
@@ -299,6 +339,8 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    g_free(f->zc_buf);
+    g_free(f->iov);
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -315,7 +357,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size)
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
     }
 }
@@ -495,6 +537,17 @@ size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size)
     return qemu_get_buffer(f, *buf, size);
 }
 
+/*
+ * Number of bytes that have already been read into the internal buffer,
+ * and can be got without waiting for more data to arrive.
+ */
+size_t qemu_file_buffered(QEMUFile *f)
+{
+    assert(!qemu_file_is_writable(f));
+
+    return f->buf_size - f->buf_index;
+}
+
 /*
  * Peeks a single byte from the buffer; this isn't guaranteed to work if
  * offset leaves a gap after the previous read/peeked data.
@@ -615,8 +668,8 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* Compress size bytes of data start at p with codec and store the
+ * compressed data to the buffer of f.
  *
  * When f is not writable, return -1 if f has no space to save the
  * compressed data.
@@ -626,22 +679,24 @@ uint64_t qemu_get_be64(QEMUFile *f)
  */
 
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+                                  MigrationCodec *codec)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    size_t bound = migration_codec_bound(codec, size);
 
-    if (blen < compressBound(size)) {
+    if (blen < bound) {
         if (!qemu_file_is_writable(f)) {
             return -1;
         }
         qemu_fflush(f);
         blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
+        if (blen < bound) {
             return -1;
         }
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = migration_codec_compress(codec, f->buf + f->buf_index +
+                                    sizeof(int32_t), blen, p, size);
+    if (blen < 0) {
         error_report("Compress Failed!");
         return 0;
     }
@@ -702,3 +757,87 @@ void qemu_file_set_blocking(QEMUFile *f, bool block)
         f->ops->set_blocking(f->opaque, block);
     }
 }
+
+/*
+ * Let up to @depth pieces of data pile up before they are written, so
+ * that each page sent with qemu_put_buffer_async() doesn't cost a
+ * fraction of a writev of its own.
+ */
+void qemu_file_set_iov_depth(QEMUFile *f, unsigned int depth)
+{
+    qemu_fflush(f);
+    f->iov_max = MAX(MIN(depth, IOV_MAX), 2);
+    f->iov = g_renew(struct iovec, f->iov, f->iov_max);
+}
+
+/*
+ * Write the pages given to qemu_put_buffer_async() without copying
+ * them.  The rest of the data goes through the buffer of @f, which has
+ * to be doubled for that.
+ */
+int qemu_file_set_zerocopy(QEMUFile *f, bool enabled, Error **errp)
+{
+    if (!f->ops->set_zerocopy) {
+        error_setg(errp, "This migration transport can't write without "
+                   "copying");
+        return -1;
+    }
+
+    qemu_fflush(f);
+    if (!enabled && f->zerocopy &&
+        f->ops->wait_writes(f->opaque, f->ops->write_mark(f->opaque)) < 0) {
+        error_setg(errp, "Failed waiting for zero copy writes");
+        return -1;
+    }
+    if (f->ops->set_zerocopy(f->opaque, enabled, errp) < 0) {
+        return -1;
+    }
+    f->zerocopy = enabled;
+    if (enabled && !f->zc_buf) {
+        f->zc_buf = g_malloc(IO_BUF_SIZE);
+    }
+    f->buf = f->buf_space;
+    memset(f->zc_mark, 0, sizeof(f->zc_mark));
+    return 0;
+}
+
+/*
+ * Move the position of an output file after flushing it.  Returns the
+ * new position, or a negative errno if the transport is not seekable.
+ */
+int64_t qemu_file_seek(QEMUFile *f, int64_t offset, int whence)
+{
+    int ret;
+
+    if (!f->ops->seek) {
+        return -ESPIPE;
+    }
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    return f->ops->seek(f->opaque, offset, whence);
+}
+
+/*
+ * Write @buf at @offset of an output file, bypassing the stream.
+ * Failures are recorded as the error of @f.
+ */
+int qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                       int64_t offset)
+{
+    ssize_t ret;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    ret = f->ops->write_at ? f->ops->write_at(f->opaque, buf, size, offset)
+                           : -ESPIPE;
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return 0;
+}
@@ -28,21 +28,26 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
+#include "sysemu/kvm.h"
+#include "sysemu/numa.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
+#include "migration/compress.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "io/channel.h"
+#include "qemu/coroutine.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -68,6 +73,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* wait until the multifd channels delivered every page sent before */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -83,8 +90,14 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /* Cache for XBZRLE, only used by the migration thread once set up.
+     * Creating and freeing it is protected by lock.
+     */
     PageCache *cache;
+    /* new cache size requested while the cache is in use, in pages,
+     * 0 if none.  Protected by lock.
+     */
+    int64_t resize_pages;
     QemuMutex lock;
 } XBZRLE;
 
@@ -107,13 +120,12 @@ static void XBZRLE_cache_unlock(void)
  * called from qmp_migrate_set_cache_size in main thread, possibly while
  * a migration is in progress.
  * A running migration maybe using the cache and might finish during this
- * call, hence changes to the cache are protected by XBZRLE.lock().
+ * call, hence checking for the cache is protected by XBZRLE.lock().  The
+ * cache itself is resized by the migration thread, so that it doesn't
+ * need to take the lock for every page.
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
-    int64_t ret;
-
     if (new_size < TARGET_PAGE_SIZE) {
         return -1;
     }
@@ -121,26 +133,33 @@ int64_t xbzrle_cache_resize(int64_t new_size)
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
-            goto out_new_size;
-        }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
-            ret = -1;
-            goto out;
-        }
+        XBZRLE.resize_pages = new_size / TARGET_PAGE_SIZE;
+    }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+    XBZRLE_cache_unlock();
+    return pow2floor(new_size);
+}
+
+/*
+ * Called by the migration thread between two pages: apply the size
+ * asked by xbzrle_cache_resize(), keeping the cached pages that fit.
+ */
+static void xbzrle_cache_apply_resize(void)
+{
+    int64_t pages;
+
+    if (!migrate_use_xbzrle()) {
+        return;
     }
 
-out_new_size:
-    ret = pow2floor(new_size);
-out:
+    XBZRLE_cache_lock();
+    pages = XBZRLE.resize_pages;
+    XBZRLE.resize_pages = 0;
     XBZRLE_cache_unlock();
-    return ret;
+
+    if (pages && cache_resize(XBZRLE.cache, pages) < 0) {
+        error_report("Error resizing cache");
+    }
 }
 
 /* accounting for migration statistics */
@@ -154,6 +173,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -218,6 +239,16 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -228,6 +259,8 @@ static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* ram_list.version when the x-fixed-ram file layout was decided */
+static uint32_t fixed_ram_version;
 
 /* used by the search for pages to send */
 struct PageSearchStatus {
@@ -240,6 +273,20 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
+/*
+ * Ranges of guest RAM the guest reported as free, through the balloon's
+ * free page hinting.  They are queued by the main loop and applied by the
+ * migration thread, which is the only one clearing bits in bmap outside
+ * of a bitmap sync.
+ */
+typedef struct FreePageHint {
+    ram_addr_t start;
+    ram_addr_t npages;
+} FreePageHint;
+
+static QemuMutex free_page_hint_lock;
+static GArray *free_page_hints;
+
 static struct BitmapRcu {
     struct rcu_head rcu;
     /* Main migration bitmap */
@@ -250,22 +297,56 @@ static struct BitmapRcu {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* one bit per DIRTY_MEMORY_CHUNK_SIZE pages whose dirty log was
+     * synced but not re-armed yet; only used when the accelerator
+     * leaves that to us
+     */
+    unsigned long *clearmap;
 } *migration_bitmap_rcu;
 
-struct CompressParam {
-    bool done;
-    bool quit;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+/*
+ * Each compression thread is fed through a ring of COMPRESS_RING_SIZE
+ * slots with a single producer, the migration thread, and a single
+ * consumer, the compression thread, so handing a page over takes no
+ * lock.  A slot goes through three states, tracked by free running
+ * counters:
+ *
+ *   [drained, done)  compressed, waiting to be put on the stream
+ *   [done, queued)   waiting to be compressed
+ *
+ * Only the migration thread writes queued and drained, only the
+ * compression thread writes done.  Every slot has its own output
+ * buffer, so compressed pages can be drained while the thread goes on
+ * with the next ones.
+ */
+#define COMPRESS_RING_SIZE 4
+
+struct CompressSlot {
     RAMBlock *block;
     ram_addr_t offset;
+    /* dummy file, only used as a buffer for the compressed page */
+    QEMUFile *file;
+    /* set by the compression thread if it found the page to be zero */
+    bool zero;
+};
+typedef struct CompressSlot CompressSlot;
+
+struct CompressParam {
+    bool quit;
+    MigrationCodec *codec;
+    /* set by the migration thread when it queues a page or quits */
+    QemuEvent work_ev;
+    unsigned queued;
+    unsigned done;
+    unsigned drained;
+    CompressSlot slots[COMPRESS_RING_SIZE];
 };
 typedef struct CompressParam CompressParam;
 
 struct DecompressParam {
     bool done;
     bool quit;
+    MigrationCodec *codec;
     QemuMutex mutex;
     QemuCond cond;
     void *des;
@@ -276,13 +357,15 @@ typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
+/* next thread compress_page_with_multi_thread() tries to queue to */
+static int comp_next;
+/* comp_done_event is set by a compression thread when it has finished
+ * a page, the migration thread waits on it when all rings are full.
  */
-static QemuMutex comp_done_lock;
-static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
+static QemuEvent comp_done_event;
+/* used by the migration thread for the first page of each block */
+static MigrationCodec *comp_codec;
+/* The empty QEMUFileOps will be used by file in CompressSlot */
 static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
@@ -290,37 +373,36 @@ static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+/* largest compressed page the destination accepts */
+static size_t decomp_bound;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(CompressSlot *slot, MigrationCodec *codec);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
-
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
+    CompressSlot *slot;
+    unsigned done = param->done;
 
-            do_compress_ram_page(param->file, block, offset);
+    while (!atomic_mb_read(&param->quit)) {
+        if (done == atomic_mb_read(&param->queued)) {
+            /* Reset before checking again, so that a page queued in
+             * between sets the event and the wait returns at once.
+             */
+            qemu_event_reset(&param->work_ev);
+            if (done == atomic_mb_read(&param->queued) &&
+                !atomic_mb_read(&param->quit)) {
+                qemu_event_wait(&param->work_ev);
+            }
+            continue;
+        }
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+        slot = &param->slots[done % COMPRESS_RING_SIZE];
+        do_compress_ram_page(slot, param->codec);
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
+        atomic_mb_set(&param->done, ++done);
+        qemu_event_set(&comp_done_event);
     }
-    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
@@ -331,16 +413,15 @@ static inline void terminate_compression_threads(void)
 
     thread_count = migrate_compress_threads();
     for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        atomic_mb_set(&comp_param[idx].quit, true);
+        qemu_event_set(&comp_param[idx].work_ev);
     }
+    qemu_event_set(&comp_done_event);
 }
 
 void migrate_compress_threads_join(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     if (!migrate_use_compression()) {
         return;
@@ -349,12 +430,15 @@ void migrate_compress_threads_join(void)
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            qemu_fclose(comp_param[i].slots[j].file);
+        }
+        qemu_event_destroy(&comp_param[i].work_ev);
+        migration_codec_free(comp_param[i].codec);
     }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
+    qemu_event_destroy(&comp_done_event);
+    migration_codec_free(comp_codec);
+    comp_codec = NULL;
     g_free(compress_threads);
     g_free(comp_param);
     compress_threads = NULL;
@@ -363,7 +447,7 @@ void migrate_compress_threads_join(void)
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     if (!migrate_use_compression()) {
         return;
@@ -372,17 +456,21 @@ void migrate_compress_threads_create(void)
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
+    comp_next = 0;
+    qemu_event_init(&comp_done_event, false);
+    comp_codec = migration_codec_new(migrate_compress_method(),
+                                     migrate_compress_level(), &error_abort);
     for (i = 0; i < thread_count; i++) {
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
+        /* The slot files are just used as dummy buffers to save data,
+         * set their ops to empty.
          */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            comp_param[i].slots[j].file = qemu_fopen_ops(NULL, &empty_ops);
+        }
+        qemu_event_init(&comp_param[i].work_ev, false);
+        comp_param[i].codec = migration_codec_new(migrate_compress_method(),
+                                                  migrate_compress_level(),
+                                                  &error_abort);
         qemu_thread_create(compress_threads + i, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -417,6 +505,416 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
+/* Multiple channels support */
+
+/*
+ * With x-multifd, normal pages go over additional connections instead
+ * of the main stream, each one fed by its own thread.  A channel stream
+ * starts with MULTIFD_MAGIC, MULTIFD_VERSION and the channel number,
+ * then carries RAM_SAVE_FLAG_PAGE and RAM_SAVE_FLAG_COMPRESS records
+ * laid out like the main ones, RAM_SAVE_FLAG_MULTIFD_SYNC markers and a
+ * final RAM_SAVE_FLAG_EOS.  The channel threads, not the migration
+ * thread, tell zero pages apart.
+ *
+ * A page is sent at most once between two dirty bitmap syncs, but could
+ * be sent again, maybe as a zero or XBZRLE page on the main stream, in
+ * the next round.  So every ram_save_iterate() and ram_save_complete()
+ * ends with a RAM_SAVE_FLAG_MULTIFD_SYNC on all streams: the destination
+ * doesn't go past the one on the main stream before each channel read
+ * its own.
+ */
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 2
+/* pages queued on a channel before the migration thread waits for it */
+#define MULTIFD_PAGES_MAX 128
+/* RAM goes to the channels in chunks of this size, round robin */
+#define MULTIFD_CHUNK_BITS 21
+
+typedef struct MultiFDPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+} MultiFDPage;
+
+typedef struct MultiFDSendParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *f;
+    QemuMutex mutex;
+    /* signalled when pages are queued, sent or synced */
+    QemuCond cond;
+    /* protected by mutex */
+    MultiFDPage pages[MULTIFD_PAGES_MAX];
+    int num_pages;
+    uint64_t sync_requested;
+    uint64_t sync_done;
+    /* pages sent as zero pages, until the migration thread counts them */
+    uint64_t zero_pages;
+    bool quit;
+    bool error;
+    /* only used by the channel thread */
+    RAMBlock *last_block;
+} MultiFDSendParams;
+
+typedef struct MultiFDSendState {
+    MultiFDSendParams *params;
+    int count;
+} MultiFDSendState;
+
+static MultiFDSendState *multifd_send_state;
+
+/* Returns whether the page was sent as a zero page */
+static bool multifd_send_one(MultiFDSendParams *p, MultiFDPage *page)
+{
+    uint8_t *host = page->block->host + page->offset;
+    ram_addr_t offset = page->offset;
+    bool zero = is_zero_range(host, TARGET_PAGE_SIZE);
+
+    offset |= zero ? RAM_SAVE_FLAG_COMPRESS : RAM_SAVE_FLAG_PAGE;
+    if (page->block == p->last_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    p->last_block = page->block;
+    save_page_header(p->f, page->block, offset);
+    if (zero) {
+        qemu_put_byte(p->f, 0);
+    } else {
+        qemu_put_buffer_async(p->f, host, TARGET_PAGE_SIZE);
+    }
+    return zero;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDPage pages[MULTIFD_PAGES_MAX];
+    uint64_t sync, zero_pages;
+    bool quit;
+    int num, i;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&p->mutex);
+    while (true) {
+        while (!p->num_pages && p->sync_done == p->sync_requested &&
+               !p->quit) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        num = p->num_pages;
+        memcpy(pages, p->pages, num * sizeof(pages[0]));
+        p->num_pages = 0;
+        sync = p->sync_requested;
+        quit = p->quit;
+        qemu_cond_broadcast(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+
+        /* the migration thread holds the RAMBlocks for us until synced */
+        rcu_read_lock();
+        zero_pages = 0;
+        for (i = 0; i < num; i++) {
+            zero_pages += multifd_send_one(p, &pages[i]);
+        }
+        if (sync != p->sync_done) {
+            qemu_put_be64(p->f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+        }
+        if (quit) {
+            qemu_put_be64(p->f, RAM_SAVE_FLAG_EOS);
+        }
+        qemu_fflush(p->f);
+        rcu_read_unlock();
+
+        qemu_mutex_lock(&p->mutex);
+        p->error = qemu_file_get_error(p->f) != 0;
+        p->sync_done = sync;
+        p->zero_pages += zero_pages;
+        qemu_cond_broadcast(&p->cond);
+        if (quit) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void multifd_send_params_destroy(MultiFDSendParams *p)
+{
+    qemu_mutex_lock(&p->mutex);
+    p->quit = true;
+    qemu_cond_broadcast(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    /* unblock the thread if it is stuck writing to a dead connection */
+    qemu_file_shutdown(p->f);
+    qemu_thread_join(&p->thread);
+    qemu_fclose(p->f);
+    qemu_mutex_destroy(&p->mutex);
+    qemu_cond_destroy(&p->cond);
+}
+
+static void multifd_send_cleanup(void)
+{
+    MultiFDSendState *s = multifd_send_state;
+    int i;
+
+    if (!s) {
+        return;
+    }
+    atomic_mb_set(&multifd_send_state, NULL);
+    for (i = 0; i < s->count; i++) {
+        multifd_send_params_destroy(&s->params[i]);
+    }
+    g_free(s->params);
+    g_free(s);
+}
+
+/* Called from the migration thread */
+static int multifd_send_setup(void)
+{
+    MultiFDSendState *s;
+    int n = migrate_multifd_channels();
+    Error *local_err = NULL;
+    QIOChannel *ioc;
+    int i;
+
+    s = g_new0(MultiFDSendState, 1);
+    s->params = g_new0(MultiFDSendParams, n);
+    for (i = 0; i < n; i++) {
+        MultiFDSendParams *p = &s->params[i];
+
+        ioc = socket_send_channel_create(&local_err);
+        if (!ioc) {
+            error_report_err(local_err);
+            goto fail;
+        }
+        p->id = i;
+        p->f = qemu_fopen_channel_output(ioc);
+        object_unref(OBJECT(ioc));
+        migrate_tune_send_file(p->f);
+
+        qemu_put_be32(p->f, MULTIFD_MAGIC);
+        qemu_put_be32(p->f, MULTIFD_VERSION);
+        qemu_put_be32(p->f, i);
+        qemu_fflush(p->f);
+        if (qemu_file_get_error(p->f)) {
+            error_report("Failed to set up multifd channel %d", i);
+            qemu_fclose(p->f);
+            goto fail;
+        }
+
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        s->count++;
+    }
+    trace_multifd_send_setup(n);
+
+    /* the main thread may look at it to cancel the migration */
+    atomic_mb_set(&multifd_send_state, s);
+    return 0;
+
+fail:
+    for (i = 0; i < s->count; i++) {
+        multifd_send_params_destroy(&s->params[i]);
+    }
+    g_free(s->params);
+    g_free(s);
+    return -1;
+}
+
+static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDSendState *s = multifd_send_state;
+    MultiFDSendParams *p;
+    int n;
+
+    n = ((block->offset + offset) >> MULTIFD_CHUNK_BITS) % s->count;
+    p = &s->params[n];
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->num_pages == MULTIFD_PAGES_MAX && !p->error) {
+        qemu_cond_wait(&p->cond, &p->mutex);
+    }
+    if (!p->error) {
+        p->pages[p->num_pages].block = block;
+        p->pages[p->num_pages].offset = offset;
+        p->num_pages++;
+        qemu_cond_broadcast(&p->cond);
+    }
+    qemu_mutex_unlock(&p->mutex);
+}
+
+/*
+ * Have every channel send the pages queued so far followed by a sync
+ * marker, and the final EOS if @last; then put the matching sync marker
+ * on the main stream.  Waits for the channels, so that the pages don't
+ * outlive the RCU critical section of the caller.
+ */
+static void multifd_send_sync_main(QEMUFile *f, bool last)
+{
+    MultiFDSendState *s = multifd_send_state;
+    bool error = false;
+    int i;
+
+    for (i = 0; i < s->count; i++) {
+        MultiFDSendParams *p = &s->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync_requested++;
+        p->quit |= last;
+        qemu_cond_broadcast(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+    for (i = 0; i < s->count; i++) {
+        MultiFDSendParams *p = &s->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        while (p->sync_done != p->sync_requested && !p->error) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        error |= p->error;
+        /* they were counted as normal pages when queued */
+        acct_info.norm_pages -= p->zero_pages;
+        acct_info.dup_pages += p->zero_pages;
+        p->zero_pages = 0;
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    if (error) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+}
+
+/* Called from the main thread to cancel the migration */
+void multifd_send_shutdown(void)
+{
+    MultiFDSendState *s = atomic_mb_read(&multifd_send_state);
+    int i;
+
+    if (!s) {
+        return;
+    }
+    for (i = 0; i < s->count; i++) {
+        qemu_file_shutdown(s->params[i].f);
+    }
+}
+
+/*
+ * With x-postcopy-preempt, the pages the destination faults on during
+ * postcopy are sent by the return path thread over an additional
+ * connection, so that they don't wait behind the background pages
+ * already queued on the main stream.  The stream starts with
+ * POSTCOPY_PREEMPT_MAGIC and POSTCOPY_PREEMPT_VERSION, then carries
+ * RAM_SAVE_FLAG_PAGE records of whole host pages and a final
+ * RAM_SAVE_FLAG_EOS.
+ *
+ * The source is stopped during postcopy, so the page sent here is the
+ * same that the background sending still sends on the main stream
+ * later; the destination places whichever comes first and skips the
+ * other.  If the connection fails, the requests go back to the queue
+ * of the main stream.
+ */
+#define POSTCOPY_PREEMPT_MAGIC 0x55667788U
+#define POSTCOPY_PREEMPT_VERSION 1
+
+static QEMUFile *preempt_send_file;
+/* Serializes the return path thread and the cleanup */
+static QemuMutex preempt_send_lock;
+
+/* Called from the migration thread */
+static int postcopy_preempt_send_setup(void)
+{
+    Error *local_err = NULL;
+    QIOChannel *ioc;
+    QEMUFile *f;
+
+    ioc = socket_send_channel_create(&local_err);
+    if (!ioc) {
+        error_report_err(local_err);
+        return -1;
+    }
+    f = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+
+    qemu_put_be32(f, POSTCOPY_PREEMPT_MAGIC);
+    qemu_put_be32(f, POSTCOPY_PREEMPT_VERSION);
+    qemu_fflush(f);
+    if (qemu_file_get_error(f)) {
+        error_report("Failed to set up the postcopy preempt channel");
+        qemu_fclose(f);
+        return -1;
+    }
+
+    qemu_mutex_init(&preempt_send_lock);
+    /* the main thread may look at it to cancel the migration */
+    atomic_mb_set(&preempt_send_file, f);
+    return 0;
+}
+
+static void postcopy_preempt_send_cleanup(void)
+{
+    QEMUFile *f = preempt_send_file;
+
+    if (!f) {
+        return;
+    }
+    qemu_mutex_lock(&preempt_send_lock);
+    atomic_mb_set(&preempt_send_file, NULL);
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fclose(f);
+    qemu_mutex_unlock(&preempt_send_lock);
+    qemu_mutex_destroy(&preempt_send_lock);
+}
+
+/*
+ * Send the host pages covering @start..@start+@len of @block over the
+ * preempt channel; returns 0 on success.
+ * Called from the return path thread within an RCU critical section.
+ */
+static int postcopy_preempt_send(RAMBlock *block, ram_addr_t start,
+                                 ram_addr_t len)
+{
+    ram_addr_t offset, flags = 0;
+    QEMUFile *f;
+    int ret = -1;
+
+    if (!atomic_mb_read(&preempt_send_file)) {
+        return -1;
+    }
+    qemu_mutex_lock(&preempt_send_lock);
+    f = preempt_send_file;
+    if (f && !qemu_file_get_error(f)) {
+        offset = QEMU_ALIGN_DOWN(start, block->page_size);
+        for (; offset < start + len; offset += block->page_size) {
+            save_page_header(f, block, offset | RAM_SAVE_FLAG_PAGE | flags);
+            qemu_put_buffer_async(f, block->host + offset, block->page_size);
+            flags = RAM_SAVE_FLAG_CONTINUE;
+        }
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            error_report("Postcopy preempt channel failed, queueing the "
+                         "requested pages on the main stream");
+        }
+    }
+    qemu_mutex_unlock(&preempt_send_lock);
+    trace_postcopy_preempt_send(block->idstr, start, len, ret);
+    return ret;
+}
+
+/* Called from the main thread to cancel the migration */
+void postcopy_preempt_send_shutdown(void)
+{
+    QEMUFile *f = atomic_mb_read(&preempt_send_file);
+
+    if (f) {
+        qemu_file_shutdown(f);
+    }
+}
+
 /* Reduce amount of guest cpu execution to hopefully slow down memory writes.
  * If guest dirty memory rate is reduced below the rate at which we can
  * transfer pages to the destination then we should be able to complete
@@ -438,6 +936,143 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/*
+ * With cpu-throttle-convergence-time set, auto-converge throttles each
+ * vcpu by how fast the memory it uses gets dirtied, instead of all of
+ * them in steps of cpu-throttle-increment.  The dirty rate is measured
+ * per RAMBlock: when NUMA nodes have memory backends, the rate of a
+ * node's memory is charged to the node's vcpus, otherwise all of RAM is
+ * charged to all vcpus.
+ */
+typedef struct ThrottleGroup {
+    double rate;    /* bytes/s the group would dirty if not throttled */
+    int pct;        /* current throttle of the group's vcpus */
+} ThrottleGroup;
+
+static ThrottleGroup throttle_groups[MAX_NODES];
+
+static bool dirty_throttle_per_node(void)
+{
+    /* NUMA nodes have a memdev either all or none of them */
+    return nb_numa_nodes && numa_info[0].node_memdev;
+}
+
+static int dirty_throttle_groups(void)
+{
+    return dirty_throttle_per_node() ? nb_numa_nodes : 1;
+}
+
+/* Group that dirtying @block is charged to, -1 for none */
+static int ram_block_throttle_group(RAMBlock *block)
+{
+    MemoryRegion *mr;
+    int i;
+
+    if (!dirty_throttle_per_node()) {
+        return 0;
+    }
+    for (i = 0; i < nb_numa_nodes; i++) {
+        mr = host_memory_backend_get_memory(numa_info[i].node_memdev,
+                                            &error_abort);
+        if (mr->ram_block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int vcpu_throttle_group(CPUState *cpu)
+{
+    int i;
+
+    if (!dirty_throttle_per_node()) {
+        return 0;
+    }
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(cpu->cpu_index, numa_info[i].node_cpu)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int throttle_group_cmp(const void *a, const void *b)
+{
+    const ThrottleGroup *ga = *(ThrottleGroup * const *)a;
+    const ThrottleGroup *gb = *(ThrottleGroup * const *)b;
+
+    return ga->rate < gb->rate ? -1 : ga->rate > gb->rate;
+}
+
+/*
+ * Called at the end of every dirty rate period of @period_ms, during
+ * which @bytes_xfer were sent, within an RCU critical section.
+ *
+ * Sending the remaining RAM within the convergence time leaves some of
+ * the bandwidth for pages that get dirtied meanwhile.  The dirty rates
+ * of the groups are capped at the level that fits in there, which only
+ * throttles the groups dirtying faster than that level.
+ */
+static void mig_throttle_dirty_rate(int64_t period_ms, uint64_t bytes_xfer)
+{
+    MigrationState *s = migrate_get_current();
+    ThrottleGroup *sorted[MAX_NODES];
+    int ngroups = dirty_throttle_groups();
+    double remaining = (double)migration_dirty_pages * TARGET_PAGE_SIZE;
+    double budget, level = -1;
+    RAMBlock *block;
+    CPUState *cpu;
+    int i, group;
+
+    for (i = 0; i < ngroups; i++) {
+        throttle_groups[i].rate = 0;
+        sorted[i] = &throttle_groups[i];
+    }
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long dirty = atomic_xchg(&block->sync_dirty_pages, 0);
+
+        group = ram_block_throttle_group(block);
+        if (group >= 0) {
+            throttle_groups[group].rate += dirty;
+        }
+    }
+    for (i = 0; i < ngroups; i++) {
+        ThrottleGroup *tg = &throttle_groups[i];
+
+        /* The vcpus only ran for what the throttle left them */
+        tg->rate = tg->rate * TARGET_PAGE_SIZE * 1000 / period_ms /
+                   (1 - tg->pct / 100.0);
+    }
+
+    budget = (double)bytes_xfer * 1000 / period_ms -
+             remaining * 1000 / s->parameters.cpu_throttle_convergence_time;
+    budget = MAX(budget, 0);
+    qsort(sorted, ngroups, sizeof(sorted[0]), throttle_group_cmp);
+    for (i = 0; i < ngroups; i++) {
+        if (sorted[i]->rate * (ngroups - i) <= budget) {
+            budget -= sorted[i]->rate;
+        } else {
+            level = budget / (ngroups - i);
+            break;
+        }
+    }
+
+    for (i = 0; i < ngroups; i++) {
+        ThrottleGroup *tg = &throttle_groups[i];
+
+        tg->pct = 0;
+        if (level >= 0 && tg->rate > level) {
+            /* The vcpus must keep running some, see cpu_throttle_set */
+            tg->pct = MIN(100 - (int)(100 * level / tg->rate), 99);
+        }
+        trace_migration_throttle_dirty_rate(i, tg->rate, tg->pct);
+    }
+    CPU_FOREACH(cpu) {
+        group = vcpu_throttle_group(cpu);
+        cpu_throttle_set_vcpu(cpu, group >= 0 ? throttle_groups[group].pct : 0);
+    }
+}
+
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
  * by the new data.
@@ -452,8 +1087,10 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
+                     bitmap_sync_count) == 1) {
+        acct_info.xbzrle_cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -478,16 +1115,20 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                             ram_addr_t offset, bool last_stage,
                             uint64_t *bytes_transferred)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               bitmap_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    acct_info.xbzrle_cache_evictions++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -496,6 +1137,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    acct_info.xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -569,6 +1211,51 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+static inline unsigned long migration_bitmap_chunks(ram_addr_t pages)
+{
+    return DIV_ROUND_UP(pages, DIRTY_MEMORY_CHUNK_SIZE);
+}
+
+/*
+ * Re-arm dirty logging for the chunk holding @addr, if that wasn't done
+ * since the last sync.  Must come before sending any of its pages, so
+ * that writes to them after they were read are caught.
+ */
+static void migration_bitmap_clear_log(ram_addr_t addr)
+{
+    unsigned long *clearmap = atomic_rcu_read(&migration_bitmap_rcu)->clearmap;
+    unsigned long chunk = (addr >> TARGET_PAGE_BITS) / DIRTY_MEMORY_CHUNK_SIZE;
+    ram_addr_t start = (ram_addr_t)chunk * DIRTY_MEMORY_CHUNK_SIZE
+                       << TARGET_PAGE_BITS;
+    ram_addr_t end = start + (DIRTY_MEMORY_CHUNK_SIZE << TARGET_PAGE_BITS);
+    bool unlock = false;
+    RAMBlock *block;
+
+    if (!clearmap || !test_and_clear_bit(chunk, clearmap)) {
+        return;
+    }
+
+    /* once per chunk, so taking the lock here is cheap enough */
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        unlock = true;
+    }
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t block_start = MAX(start, block->offset);
+        ram_addr_t block_end = MIN(end, block->offset + block->used_length);
+
+        if (block_start < block_end) {
+            memory_region_clear_dirty_bitmap(block->mr,
+                                             block_start - block->offset,
+                                             block_end - block_start);
+        }
+    }
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    trace_migration_bitmap_clear_log(start, end - start);
+}
+
 static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 {
     bool ret;
@@ -583,16 +1270,208 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    RAMBlock *block;
+    ram_addr_t offset, end;
+    FreePageHint hint;
+
+    rcu_read_lock();
+    block = qemu_ram_block_from_host(addr, false, &offset);
+    if (!block || offset >= block->used_length) {
+        rcu_read_unlock();
+        return;
+    }
+
+    end = MIN(offset + len, block->used_length) & TARGET_PAGE_MASK;
+    offset = ROUND_UP(offset, TARGET_PAGE_SIZE);
+    if (offset < end) {
+        hint.start = block->offset + offset;
+        hint.npages = (end - offset) >> TARGET_PAGE_BITS;
+        qemu_mutex_lock(&free_page_hint_lock);
+        g_array_append_val(free_page_hints, hint);
+        qemu_mutex_unlock(&free_page_hint_lock);
+        trace_qemu_guest_free_page_hint(hint.start, hint.npages);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Drop the pages the guest reported as free from the migration bitmap;
+ * the guest does not reuse them before the balloon tells it migration
+ * is over.  Called by the migration thread, within an RCU critical
+ * section.
+ */
+static void migration_bitmap_apply_free_page_hints(void)
 {
     unsigned long *bitmap;
+    uint64_t cleared = 0;
+    unsigned i;
+
+    if (!atomic_read(&free_page_hints->len)) {
+        return;
+    }
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    qemu_mutex_lock(&free_page_hint_lock);
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    for (i = 0; i < free_page_hints->len; i++) {
+        FreePageHint *hint = &g_array_index(free_page_hints, FreePageHint, i);
+        unsigned long nr = hint->start >> TARGET_PAGE_BITS;
+        unsigned long end = nr + hint->npages;
+
+        for (nr = find_next_bit(bitmap, end, nr); nr < end;
+             nr = find_next_bit(bitmap, end, nr + 1)) {
+            clear_bit(nr, bitmap);
+            cleared++;
+        }
+    }
+    g_array_set_size(free_page_hints, 0);
+    qemu_mutex_unlock(&free_page_hint_lock);
+    migration_dirty_pages -= cleared;
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+
+    trace_migration_bitmap_apply_free_page_hints(cleared);
+}
+
+/*
+ * Moving the dirty log of a big guest into the migration bitmap is
+ * shared by the migration thread and bitmap_sync_threads helpers, each
+ * taking every n-th chunk of DIRTY_MEMORY_CHUNK_SIZE pages.  Chunks
+ * start on a word of the bitmap, so no two threads write the same word.
+ */
+#define BITMAP_SYNC_RAM_PER_THREAD (64ULL << 30)
+#define BITMAP_SYNC_MAX_THREADS 8
+
+typedef struct BitmapSyncParam {
+    QemuThread thread;
+    QemuSemaphore sem;
+    int id;
+    bool quit;
+    uint64_t num_dirty;
+} BitmapSyncParam;
+
+static BitmapSyncParam *bitmap_sync_param;
+static int bitmap_sync_threads;
+static QemuSemaphore bitmap_sync_done_sem;
+
+/*
+ * Sync the chunks of thread @id out of @n and return how many pages
+ * became dirty.  Called within an RCU critical section, while the
+ * migration thread holds migration_bitmap_mutex.
+ */
+static uint64_t migration_bitmap_sync_chunks(int id, int n)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    uint64_t num_dirty = 0;
+    RAMBlock *block;
+    ram_addr_t start, end, chunk_end;
+    uint64_t chunk;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        end = block->offset + block->used_length;
+        for (start = block->offset; start < end; start = chunk_end) {
+            chunk = (start >> TARGET_PAGE_BITS) / DIRTY_MEMORY_CHUNK_SIZE;
+            chunk_end = MIN(end, ((chunk + 1) * DIRTY_MEMORY_CHUNK_SIZE)
+                                 << TARGET_PAGE_BITS);
+            if (chunk % n == id) {
+                unsigned long dirty;
+
+                dirty = cpu_physical_memory_sync_dirty_bitmap(bitmap, start,
+                                                              chunk_end -
+                                                              start);
+                if (dirty) {
+                    atomic_add(&block->sync_dirty_pages, dirty);
+                }
+                num_dirty += dirty;
+            }
+        }
+    }
+    return num_dirty;
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncParam *param = opaque;
+    int n = bitmap_sync_threads + 1;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&param->quit)) {
+            break;
+        }
+        rcu_read_lock();
+        param->num_dirty = migration_bitmap_sync_chunks(param->id + 1, n);
+        rcu_read_unlock();
+        qemu_sem_post(&bitmap_sync_done_sem);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void bitmap_sync_setup(void)
+{
+    int i;
+
+    bitmap_sync_threads = MIN(ram_bytes_total() / BITMAP_SYNC_RAM_PER_THREAD,
+                              BITMAP_SYNC_MAX_THREADS);
+    if (!bitmap_sync_threads) {
+        return;
+    }
+    qemu_sem_init(&bitmap_sync_done_sem, 0);
+    bitmap_sync_param = g_new0(BitmapSyncParam, bitmap_sync_threads);
+    for (i = 0; i < bitmap_sync_threads; i++) {
+        bitmap_sync_param[i].id = i;
+        qemu_sem_init(&bitmap_sync_param[i].sem, 0);
+        qemu_thread_create(&bitmap_sync_param[i].thread, "bitmap_sync",
+                           bitmap_sync_thread, &bitmap_sync_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_bitmap_sync_setup(bitmap_sync_threads);
+}
+
+static void bitmap_sync_cleanup(void)
+{
+    int i;
+
+    if (!bitmap_sync_param) {
+        return;
+    }
+    for (i = 0; i < bitmap_sync_threads; i++) {
+        atomic_set(&bitmap_sync_param[i].quit, true);
+        qemu_sem_post(&bitmap_sync_param[i].sem);
+        qemu_thread_join(&bitmap_sync_param[i].thread);
+        qemu_sem_destroy(&bitmap_sync_param[i].sem);
+    }
+    qemu_sem_destroy(&bitmap_sync_done_sem);
+    g_free(bitmap_sync_param);
+    bitmap_sync_param = NULL;
+    bitmap_sync_threads = 0;
+}
+
+/* Called within an RCU critical section */
+static void migration_bitmap_sync_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < bitmap_sync_threads; i++) {
+        qemu_sem_post(&bitmap_sync_param[i].sem);
+    }
     migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+        migration_bitmap_sync_chunks(0, bitmap_sync_threads + 1);
+    for (i = 0; i < bitmap_sync_threads; i++) {
+        qemu_sem_wait(&bitmap_sync_done_sem);
+    }
+    for (i = 0; i < bitmap_sync_threads; i++) {
+        migration_dirty_pages += bitmap_sync_param[i].num_dirty;
+    }
 }
 
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
+static int64_t sync_start_us;
 static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
@@ -607,13 +1486,15 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-static void migration_bitmap_sync(void)
+/*
+ * A sync of the migration bitmap has two halves: migration_bitmap_sync_log
+ * needs the iothread lock to collect the dirty log from the accelerator
+ * and the memory listeners, migration_bitmap_sync_finish doesn't and
+ * moves the log into the migration bitmap.
+ */
+static void migration_bitmap_sync_log(void)
 {
-    RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    int64_t end_time;
-    int64_t bytes_xfer_now;
+    unsigned long *clearmap;
 
     bitmap_sync_count++;
 
@@ -625,14 +1506,27 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
+    sync_start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
+    clearmap = migration_bitmap_rcu->clearmap;
+    if (clearmap) {
+        bitmap_set(clearmap, 0, migration_bitmap_chunks(last_ram_offset() >>
+                                                        TARGET_PAGE_BITS));
+    }
+}
+
+static void migration_bitmap_sync_finish(void)
+{
+    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    MigrationState *s = migrate_get_current();
+    int64_t end_time;
+    int64_t bytes_xfer_now;
+
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
-    }
+    migration_bitmap_sync_blocks();
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
@@ -651,7 +1545,12 @@ static void migration_bitmap_sync(void)
                throttling */
             bytes_xfer_now = ram_bytes_transferred();
 
-            if (s->dirty_pages_rate &&
+            if (s->parameters.cpu_throttle_convergence_time) {
+                rcu_read_lock();
+                mig_throttle_dirty_rate(end_time - start_time,
+                                        bytes_xfer_now - bytes_xfer_prev);
+                rcu_read_unlock();
+            } else if (s->dirty_pages_rate &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
                (dirty_rate_high_cnt++ >= 2)) {
@@ -675,15 +1574,25 @@ static void migration_bitmap_sync(void)
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        migration_sample_dirty_rate(s);
         start_time = end_time;
         num_dirty_pages_period = 0;
     }
     s->dirty_sync_count = bitmap_sync_count;
+    s->dirty_sync_time += qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                          sync_start_us;
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
 }
 
+/* Called with the iothread lock held */
+static void migration_bitmap_sync(void)
+{
+    migration_bitmap_sync_log();
+    migration_bitmap_sync_finish();
+}
+
 /**
  * save_zero_page: Send the zero page to the stream
  *
@@ -737,6 +1646,9 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     bool send_async = true;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
+    /* pages that are going to a multifd channel, unless they're zero */
+    bool multifd_zero = multifd_send_state &&
+                        (ram_bulk_stage || !migrate_use_xbzrle());
 
     p = block->host + offset;
 
@@ -749,8 +1661,6 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (block == last_sent_block) {
@@ -764,7 +1674,7 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
                 acct_info.dup_pages++;
             }
         }
-    } else {
+    } else if (!multifd_zero) {
         pages = save_zero_page(f, block, offset, p, bytes_transferred);
         if (pages > 0) {
             /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -783,6 +1693,18 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    /*
+     * Normal pages can go through the multifd channels, but not the
+     * cached copies of XBZRLE pages that miss or overflow.
+     */
+    if (pages == -1 && send_async && multifd_send_state) {
+        multifd_queue_page(block, pss->offset);
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -797,21 +1719,105 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         acct_info.norm_pages++;
     }
 
-    XBZRLE_cache_unlock();
-
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+/*
+ * With x-fixed-ram, the block list of the setup stage is followed by
+ * a be32 padding length, that much padding, and the contents of the
+ * blocks in the order of the list, starting at a FIXED_RAM_ALIGN
+ * boundary of the file.  The source reserves that space by seeking past
+ * it, and writes every page it sends at its place there, so the last
+ * version of each page is the one that ends up in the file.  The rest
+ * of the stream, device state included, follows the blocks.
+ */
+#define FIXED_RAM_ALIGN 4096
+
+/* Called within an RCU critical section */
+static int ram_save_fixed_layout(QEMUFile *f)
+{
+    RAMBlock *block;
+    int64_t pos;
+    uint32_t pad;
+
+    pos = qemu_file_seek(f, 0, SEEK_CUR);
+    if (pos < 0) {
+        error_report("x-fixed-ram needs to migrate to a regular file: %s",
+                     strerror(-pos));
+        return -1;
+    }
+    pos += sizeof(pad);
+    pad = ROUND_UP(pos, FIXED_RAM_ALIGN) - pos;
+    qemu_put_be32(f, pad);
+    for (pos += pad; pad; pad--) {
+        qemu_put_byte(f, 0);
+    }
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->fixed_ram_offset = pos;
+        pos += block->used_length;
+    }
+    fixed_ram_version = ram_list.version;
+
+    pos = qemu_file_seek(f, pos, SEEK_SET);
+    if (pos < 0) {
+        error_report("x-fixed-ram: seeking past the RAM failed: %s",
+                     strerror(-pos));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * ram_save_fixed_page: Write the given page at its place in the file
+ *
+ * Returns: Number of pages written, < 0 on error
+ */
+static int ram_save_fixed_page(QEMUFile *f, PageSearchStatus *pss,
+                               uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    int ret;
+
+    if (ram_list.version != fixed_ram_version) {
+        error_report("x-fixed-ram: RAM blocks changed during migration");
+        return -EINVAL;
+    }
+
+    ret = qemu_put_buffer_at(f, block->host + pss->offset, TARGET_PAGE_SIZE,
+                             block->fixed_ram_offset + pss->offset);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
+/*
+ * Compress the page of @slot into its file.  Zero pages are looked for
+ * here rather than in the migration thread, and sent the usual way.
+ */
+static int do_compress_ram_page(CompressSlot *slot, MigrationCodec *codec)
 {
+    QEMUFile *f = slot->file;
+    RAMBlock *block = slot->block;
+    ram_addr_t offset = slot->offset;
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
 
+    slot->zero = is_zero_range(p, TARGET_PAGE_SIZE);
+    if (slot->zero) {
+        bytes_sent = save_page_header(f, block,
+                                      offset | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        return bytes_sent + 1;
+    }
+
     bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE, codec);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -825,72 +1831,101 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 
 static uint64_t bytes_transferred;
 
+/*
+ * Put the pages @param has finished compressing on the stream, in the
+ * order they were queued.  Returns the number of bytes written.
+ */
+static uint64_t drain_compressed_data(QEMUFile *f, CompressParam *param)
+{
+    unsigned done = atomic_mb_read(&param->done);
+    uint64_t len = 0;
+
+    CompressSlot *slot;
+
+    while (param->drained != done) {
+        slot = &param->slots[param->drained % COMPRESS_RING_SIZE];
+        len += qemu_put_qemu_file(f, slot->file);
+        if (slot->zero) {
+            acct_info.dup_pages++;
+        } else {
+            acct_info.norm_pages++;
+        }
+        param->drained++;
+    }
+    return len;
+}
+
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    int idx, thread_count;
+    CompressParam *param;
 
     if (!migrate_use_compression()) {
         return;
     }
     thread_count = migrate_compress_threads();
 
-    qemu_mutex_lock(&comp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
-    }
-    qemu_mutex_unlock(&comp_done_lock);
-
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+        param = &comp_param[idx];
+        while (!atomic_mb_read(&param->quit)) {
+            bytes_transferred += drain_compressed_data(f, param);
+            if (param->drained == param->queued) {
+                break;
+            }
+            qemu_event_reset(&comp_done_event);
+            if (atomic_mb_read(&param->done) == param->drained) {
+                qemu_event_wait(&comp_done_event);
+            }
         }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    int idx, i, thread_count;
+    CompressParam *param;
+    CompressSlot *slot;
 
     thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
     while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
+        /* Start from the thread after the last one used, so that the
+         * work is spread over all of them, and drain what they have
+         * done on the way.
+         */
+        for (i = 0; i < thread_count; i++) {
+            idx = (comp_next + i) % thread_count;
+            param = &comp_param[idx];
+            *bytes_transferred += drain_compressed_data(f, param);
+            if (param->queued - param->drained < COMPRESS_RING_SIZE) {
+                slot = &param->slots[param->queued % COMPRESS_RING_SIZE];
+                slot->block = block;
+                slot->offset = offset;
+                atomic_mb_set(&param->queued, param->queued + 1);
+                qemu_event_set(&param->work_ev);
+                comp_next = (idx + 1) % thread_count;
+                return 1;
+            }
+        }
+
+        /* All the rings are full: wait for any thread to finish a page,
+         * checking again after the reset so the wake up isn't missed.
+         */
+        qemu_event_reset(&comp_done_event);
+        for (i = 0; i < thread_count; i++) {
+            if (atomic_mb_read(&comp_param[i].done) !=
+                comp_param[i].drained) {
                 break;
             }
         }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        if (i == thread_count) {
+            if (atomic_mb_read(&comp_param[0].quit)) {
+                return -1;
+            }
+            qemu_event_wait(&comp_done_event);
         }
     }
-    qemu_mutex_unlock(&comp_done_lock);
-
-    return pages;
 }
 
 /**
@@ -946,7 +1981,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                 bytes_xmit = save_page_header(f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
                 blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
+                                                 comp_codec);
                 if (blen > 0) {
                     *bytes_transferred += bytes_xmit + blen;
                     acct_info.norm_pages++;
@@ -958,11 +1993,9 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             }
         } else {
             offset |= RAM_SAVE_FLAG_CONTINUE;
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            }
+            /* the compression threads look for zero pages themselves */
+            pages = compress_page_with_multi_thread(f, block, offset,
+                                                    bytes_transferred);
         }
     }
 
@@ -1192,6 +2225,11 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
         goto err;
     }
 
+    if (!postcopy_preempt_send(ramblock, start, len)) {
+        rcu_read_unlock();
+        return 0;
+    }
+
     struct MigrationSrcPageRequest *new_entry =
         g_malloc0(sizeof(struct MigrationSrcPageRequest));
     new_entry->rb = ramblock;
@@ -1235,7 +2273,11 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+
+        migration_bitmap_clear_log(dirty_ram_abs);
+        if (migrate_use_fixed_ram()) {
+            res = ram_save_fixed_page(f, pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
@@ -1269,6 +2311,8 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
  *                     offset to point into the middle of a host page
  *                     in which case the remainder of the hostpage is sent.
  *                     Only dirty target pages are sent.
+ *                     With postcopy the host page is the one of the block,
+ *                     which may be a huge page.
  *
  * Returns: Number of pages written.
  *
@@ -1287,6 +2331,9 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
                               ram_addr_t dirty_ram_abs)
 {
     int tmppages, pages = 0;
+    size_t pagesize = migrate_postcopy_ram() ? pss->block->page_size :
+                                               qemu_host_page_size;
+
     do {
         tmppages = ram_save_target_page(ms, f, pss, last_stage,
                                         bytes_transferred, dirty_ram_abs);
@@ -1297,7 +2344,7 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
         pages += tmppages;
         pss->offset += TARGET_PAGE_SIZE;
         dirty_ram_abs += TARGET_PAGE_SIZE;
-    } while (pss->offset & (qemu_host_page_size - 1));
+    } while (pss->offset & (pagesize - 1));
 
     /* The offset we leave with is the last one we looked at */
     pss->offset -= TARGET_PAGE_SIZE;
@@ -1409,6 +2456,7 @@ static void migration_bitmap_free(struct BitmapRcu *bmap)
 {
     g_free(bmap->bmap);
     g_free(bmap->unsentmap);
+    g_free(bmap->clearmap);
     g_free(bmap);
 }
 
@@ -1430,10 +2478,19 @@ static void ram_migration_cleanup(void *opaque)
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
         XBZRLE.cache = NULL;
+        XBZRLE.resize_pages = 0;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    multifd_send_cleanup();
+    postcopy_preempt_send_cleanup();
+    bitmap_sync_cleanup();
+
+    qemu_mutex_lock(&free_page_hint_lock);
+    g_array_set_size(free_page_hints, 0);
+    qemu_mutex_unlock(&free_page_hint_lock);
 }
 
 static void reset_ram_globals(void)
@@ -1458,7 +2515,7 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         bitmap->bmap = bitmap_new(new);
 
         /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
+         * by migration_bitmap_sync_blocks() at the same time.
          * it is safe to migration if migration_bitmap is cleared bit
          * at the same time.
          */
@@ -1472,6 +2529,16 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
          */
         bitmap->unsentmap = NULL;
 
+        bitmap->clearmap = NULL;
+        if (old_bitmap->clearmap) {
+            bitmap->clearmap = bitmap_new(migration_bitmap_chunks(new));
+            bitmap_copy(bitmap->clearmap, old_bitmap->clearmap,
+                        migration_bitmap_chunks(old));
+            bitmap_set(bitmap->clearmap, migration_bitmap_chunks(old),
+                       migration_bitmap_chunks(new) -
+                       migration_bitmap_chunks(old));
+        }
+
         atomic_rcu_set(&migration_bitmap_rcu, bitmap);
         qemu_mutex_unlock(&migration_bitmap_mutex);
         migration_dirty_pages += new - old;
@@ -1614,7 +2681,7 @@ static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
 {
     unsigned long *bitmap;
     unsigned long *unsentmap;
-    unsigned int host_ratio = qemu_host_page_size / TARGET_PAGE_SIZE;
+    unsigned int host_ratio = block->page_size / TARGET_PAGE_SIZE;
     unsigned long first = block->offset >> TARGET_PAGE_BITS;
     unsigned long len = block->used_length >> TARGET_PAGE_BITS;
     unsigned long last = first + (len - 1);
@@ -1731,11 +2798,6 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
 {
     struct RAMBlock *block;
 
-    if (qemu_host_page_size == TARGET_PAGE_SIZE) {
-        /* Easy case - TPS==HPS - nothing to be done */
-        return 0;
-    }
-
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     last_seen_block = NULL;
     last_sent_block = NULL;
@@ -1743,9 +2805,14 @@ static int postcopy_chunk_hostpages(MigrationState *ms)
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        PostcopyDiscardState *pds;
+
+        if (block->page_size == TARGET_PAGE_SIZE) {
+            /* Easy case - TPS==HPS - nothing to be done */
+            continue;
+        }
 
-        PostcopyDiscardState *pds =
-                         postcopy_discard_send_init(ms, first, block->idstr);
+        pds = postcopy_discard_send_init(ms, first, block->idstr);
 
         /* First pass: Discard all partially sent host pages */
         postcopy_chunk_hostpages_pass(ms, true, block, pds);
@@ -1842,7 +2909,7 @@ int ram_discard_range(MigrationIncomingState *mis,
 
     uint8_t *host_startaddr = rb->host + start;
 
-    if ((uintptr_t)host_startaddr & (qemu_host_page_size - 1)) {
+    if ((uintptr_t)host_startaddr & (rb->page_size - 1)) {
         error_report("ram_discard_range: Unaligned start address: %p",
                      host_startaddr);
         goto err;
@@ -1850,12 +2917,12 @@ int ram_discard_range(MigrationIncomingState *mis,
 
     if ((start + length) <= rb->used_length) {
         uint8_t *host_endaddr = host_startaddr + length;
-        if ((uintptr_t)host_endaddr & (qemu_host_page_size - 1)) {
+        if ((uintptr_t)host_endaddr & (rb->page_size - 1)) {
             error_report("ram_discard_range: Unaligned end address: %p",
                          host_endaddr);
             goto err;
         }
-        ret = postcopy_ram_discard_range(mis, host_startaddr, length);
+        ret = postcopy_ram_discard_range(mis, rb, start, length);
     } else {
         error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
                      "/%zx/" RAM_ADDR_FMT")",
@@ -1881,6 +2948,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
     dirty_rate_high_cnt = 0;
+    memset(throttle_groups, 0, sizeof(throttle_groups));
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
@@ -1915,6 +2983,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_multifd() && multifd_send_setup() < 0) {
+        return -1;
+    }
+    if (migrate_postcopy_preempt() && postcopy_preempt_send_setup() < 0) {
+        return -1;
+    }
+    bitmap_sync_setup();
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
@@ -1933,6 +3009,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
     }
 
+    if (kvm_enabled() && kvm_has_manual_dirty_log_protect()) {
+        migration_bitmap_rcu->clearmap =
+            bitmap_new(migration_bitmap_chunks(ram_bitmap_pages));
+    }
+
     /*
      * Count the total number of pages used by ram blocks not including any
      * gaps due to alignment or unplugs.
@@ -1950,6 +3031,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        /* Postcopy places whole host pages, they have to match */
+        if (migrate_postcopy_ram() &&
+            block->page_size != qemu_host_page_size) {
+            qemu_put_be64(f, block->page_size);
+        }
+    }
+
+    if (migrate_use_fixed_ram() && ram_save_fixed_layout(f) < 0) {
+        rcu_read_unlock();
+        return -1;
     }
 
     rcu_read_unlock();
@@ -1978,12 +3069,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     smp_rmb();
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    xbzrle_cache_apply_resize();
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int pages;
 
+        if ((i & 63) == 0) {
+            migration_bitmap_apply_free_page_hints();
+        }
         pages = ram_find_and_save_block(f, false, &bytes_transferred);
         /* no more pages to sent */
         if (pages == 0) {
@@ -2008,6 +3103,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (multifd_send_state) {
+        multifd_send_sync_main(f, false);
+    }
     rcu_read_unlock();
 
     /*
@@ -2052,6 +3150,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (multifd_send_state) {
+        multifd_send_sync_main(f, true);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2071,11 +3172,15 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
+        /* only the dirty log needs the lock, keep the main loop going
+         * while it is moved into the migration bitmap
+         */
         qemu_mutex_lock_iothread();
+        migration_bitmap_sync_log();
+        qemu_mutex_unlock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync();
+        migration_bitmap_sync_finish();
         rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
 
@@ -2157,6 +3262,12 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
     return block;
 }
 
+/*
+ * Pages of the COLO cache written since the last checkpoint was flushed,
+ * indexed like the migration bitmap.  Only used by the incoming thread.
+ */
+static unsigned long *colo_dirty_bmap;
+
 static inline void *host_from_ram_block_offset(RAMBlock *block,
                                                ram_addr_t offset)
 {
@@ -2164,9 +3275,427 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
         return NULL;
     }
 
+    if (block->colo_cache) {
+        /* Keep the running secondary away from a half received checkpoint */
+        set_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                colo_dirty_bmap);
+        return block->colo_cache + offset;
+    }
     return block->host + offset;
 }
 
+/*
+ * Start redirecting incoming pages to a copy of the guest RAM, and the
+ * dirty logging that tells which pages the secondary changes itself.
+ * Called with the iothread lock held, while the VM is stopped.
+ */
+int colo_init_ram_cache(void)
+{
+    RAMBlock *block;
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->colo_cache = qemu_anon_ram_alloc(block->used_length, NULL);
+        if (!block->colo_cache) {
+            error_report("%s: Can't alloc memory for COLO cache of block %s,"
+                         " size 0x" RAM_ADDR_FMT, __func__, block->idstr,
+                         block->used_length);
+            rcu_read_unlock();
+            colo_release_ram_cache();
+            return -errno;
+        }
+        memcpy(block->colo_cache, block->host, block->used_length);
+    }
+    rcu_read_unlock();
+
+    colo_dirty_bmap = bitmap_new(ram_pages);
+    memory_global_dirty_log_start();
+    /* Forget whatever was logged before the copy */
+    colo_flush_ram_cache();
+    return 0;
+}
+
+/*
+ * Commit a checkpoint: copy the pages received since the last one, and
+ * those the secondary dirtied meanwhile, from the cache into the guest.
+ * Called with the iothread lock held, while the VM is stopped.
+ */
+void colo_flush_ram_cache(void)
+{
+    RAMBlock *block;
+    unsigned long page, end;
+    uint64_t pages = 0;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        cpu_physical_memory_sync_dirty_bitmap(colo_dirty_bmap, block->offset,
+                                              block->used_length);
+        /* Accelerators that need it must log writes to these pages again */
+        memory_region_clear_dirty_bitmap(block->mr, 0, block->used_length);
+
+        page = block->offset >> TARGET_PAGE_BITS;
+        end = (block->offset + block->used_length) >> TARGET_PAGE_BITS;
+        for (page = find_next_bit(colo_dirty_bmap, end, page); page < end;
+             page = find_next_bit(colo_dirty_bmap, end, page + 1)) {
+            ram_addr_t offset = (page << TARGET_PAGE_BITS) - block->offset;
+
+            clear_bit(page, colo_dirty_bmap);
+            memcpy(block->host + offset, block->colo_cache + offset,
+                   TARGET_PAGE_SIZE);
+            pages++;
+        }
+    }
+    rcu_read_unlock();
+    trace_colo_flush_ram_cache(pages);
+}
+
+void colo_release_ram_cache(void)
+{
+    RAMBlock *block;
+
+    if (colo_dirty_bmap) {
+        memory_global_dirty_log_stop();
+    }
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+    }
+    rcu_read_unlock();
+    g_free(colo_dirty_bmap);
+    colo_dirty_bmap = NULL;
+}
+
+typedef struct MultiFDRecvParams {
+    int id;
+    QemuThread thread;
+    QEMUFile *f;
+    /* posted for each sync marker, and when the thread fails */
+    QemuSemaphore sem_sync;
+    bool error;
+} MultiFDRecvParams;
+
+typedef struct MultiFDRecvState {
+    MultiFDRecvParams *params;
+    int count;
+    int connected;
+    /* ram_load() waiting for the channels to connect */
+    Coroutine *co;
+} MultiFDRecvState;
+
+static MultiFDRecvState *multifd_recv_state;
+
+static MultiFDRecvState *multifd_recv_state_get(void)
+{
+    MultiFDRecvState *s = multifd_recv_state;
+    int i;
+
+    if (!s) {
+        s = g_new0(MultiFDRecvState, 1);
+        s->count = migrate_multifd_channels();
+        s->params = g_new0(MultiFDRecvParams, s->count);
+        for (i = 0; i < s->count; i++) {
+            qemu_sem_init(&s->params[i].sem_sync, 0);
+        }
+        multifd_recv_state = s;
+    }
+    return s;
+}
+
+static RAMBlock *multifd_block_from_stream(QEMUFile *f, int flags,
+                                           RAMBlock *block)
+{
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        return block;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    rcu_read_unlock();
+    if (!block) {
+        error_report("Can't find block %s", id);
+    }
+    return block;
+}
+
+static int multifd_recv_header(MultiFDRecvParams *p)
+{
+    uint32_t magic, version, id;
+
+    magic = qemu_get_be32(p->f);
+    version = qemu_get_be32(p->f);
+    id = qemu_get_be32(p->f);
+    if (qemu_file_get_error(p->f)) {
+        return -EIO;
+    }
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd channel %d: bad magic %#x or version %u",
+                     p->id, magic, version);
+        return -EINVAL;
+    }
+    if (id >= multifd_recv_state->count) {
+        error_report("multifd channel %d: invalid channel number %u",
+                     p->id, id);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    void *host;
+    int flags;
+    int ret;
+
+    rcu_register_thread();
+
+    /*
+     * No RAMBlock goes away during an incoming migration, it is safe to
+     * keep using one after the lookup.
+     */
+    ret = multifd_recv_header(p);
+    while (!ret) {
+        addr = qemu_get_be64(p->f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_PAGE:
+            block = multifd_block_from_stream(p->f, flags, block);
+            host = block ? host_from_ram_block_offset(block, addr) : NULL;
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(p->f, host, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_COMPRESS:
+            block = multifd_block_from_stream(p->f, flags, block);
+            host = block ? host_from_ram_block_offset(block, addr) : NULL;
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            ram_handle_compressed(host, qemu_get_byte(p->f),
+                                  TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            qemu_sem_post(&p->sem_sync);
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            goto out;
+        default:
+            error_report("Unknown combination of multifd flags: %#x", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(p->f);
+        }
+    }
+
+    atomic_mb_set(&p->error, true);
+    qemu_sem_post(&p->sem_sync);
+out:
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called from the main loop for each connection after the main one */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvState *s = multifd_recv_state_get();
+    MultiFDRecvParams *p;
+    Coroutine *co;
+
+    if (s->connected == s->count) {
+        error_report("Unexpected multifd channel, only %d configured",
+                     s->count);
+        return;
+    }
+
+    p = &s->params[s->connected];
+    p->id = s->connected++;
+    qio_channel_set_blocking(ioc, true, NULL);
+    p->f = qemu_fopen_channel_input(ioc);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    trace_multifd_recv_new_channel(p->id);
+
+    if (s->connected == s->count && s->co) {
+        co = s->co;
+        s->co = NULL;
+        qemu_coroutine_enter(co);
+    }
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    MultiFDRecvState *s = multifd_recv_state;
+
+    return s && s->connected == s->count;
+}
+
+/* Called from ram_load() for a RAM_SAVE_FLAG_MULTIFD_SYNC */
+static int multifd_recv_sync_main(void)
+{
+    MultiFDRecvState *s = multifd_recv_state_get();
+    int ret = 0;
+    int i;
+
+    /* the channels are accepted by the main loop, let it run */
+    if (s->connected < s->count) {
+        s->co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    for (i = 0; i < s->count; i++) {
+        MultiFDRecvParams *p = &s->params[i];
+
+        qemu_sem_wait(&p->sem_sync);
+        if (atomic_mb_read(&p->error)) {
+            error_report("multifd channel %d failed", p->id);
+            ret = -EIO;
+        }
+    }
+    return ret;
+}
+
+/* Called once the incoming migration is done */
+void multifd_recv_threads_join(void)
+{
+    MultiFDRecvState *s = multifd_recv_state;
+    int i;
+
+    if (!s) {
+        return;
+    }
+    for (i = 0; i < s->connected; i++) {
+        MultiFDRecvParams *p = &s->params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->f);
+    }
+    for (i = 0; i < s->count; i++) {
+        qemu_sem_destroy(&s->params[i].sem_sync);
+    }
+    g_free(s->params);
+    g_free(s);
+    multifd_recv_state = NULL;
+}
+
+static struct {
+    QemuThread thread;
+    QEMUFile *f;
+} postcopy_preempt_recv;
+
+static void *postcopy_preempt_recv_thread(void *opaque)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QEMUFile *f = postcopy_preempt_recv.f;
+    size_t buf_size = qemu_ram_pagesize_largest();
+    uint8_t *buf = g_malloc(buf_size);
+    RAMBlock *block = NULL;
+    uint32_t magic, version;
+    ram_addr_t addr;
+    int flags, ret;
+
+    rcu_register_thread();
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (!ret && (magic != POSTCOPY_PREEMPT_MAGIC ||
+                 version != POSTCOPY_PREEMPT_VERSION)) {
+        error_report("postcopy preempt channel: bad magic %#x or version %u",
+                     magic, version);
+        ret = -EINVAL;
+    }
+
+    /* Same as the multifd channels, no RAMBlock goes away meanwhile */
+    while (!ret) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+        if (qemu_file_get_error(f) || flags == RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if ((flags & ~RAM_SAVE_FLAG_CONTINUE) != RAM_SAVE_FLAG_PAGE) {
+            error_report("Unknown combination of postcopy preempt flags: %#x",
+                         flags);
+            break;
+        }
+        block = multifd_block_from_stream(f, flags, block);
+        if (!block || !offset_in_ramblock(block, addr) ||
+            addr & (block->page_size - 1)) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+            break;
+        }
+        qemu_get_buffer(f, buf, block->page_size);
+        ret = qemu_file_get_error(f);
+        if (!ret) {
+            trace_postcopy_preempt_recv_page(block->idstr, addr);
+            ret = postcopy_place_page(mis, block->host + addr, buf,
+                                      block->page_size);
+        }
+    }
+
+    /* Whatever was not placed here still comes on the main stream */
+    g_free(buf);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called from the main loop for the connection after the main one */
+void postcopy_preempt_new_channel(QIOChannel *ioc)
+{
+    if (postcopy_preempt_recv.f) {
+        error_report("Unexpected connection, the postcopy preempt channel "
+                     "is already open");
+        return;
+    }
+    qio_channel_set_blocking(ioc, true, NULL);
+    postcopy_preempt_recv.f = qemu_fopen_channel_input(ioc);
+    qemu_thread_create(&postcopy_preempt_recv.thread, "postcopy/preempt",
+                       postcopy_preempt_recv_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+bool postcopy_preempt_channel_created(void)
+{
+    return postcopy_preempt_recv.f != NULL;
+}
+
+/* Called once no page is placed any more */
+void postcopy_preempt_recv_join(void)
+{
+    QEMUFile *f = postcopy_preempt_recv.f;
+
+    if (!f) {
+        return;
+    }
+    /* the source only closes it once the destination is done */
+    qemu_file_shutdown(f);
+    qemu_thread_join(&postcopy_preempt_recv.thread);
+    qemu_fclose(f);
+    postcopy_preempt_recv.f = NULL;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -2181,7 +3710,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2193,14 +3721,13 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+            /* Decompression will fail in some case, especially when
+             * the page is dirtied when doing the compression, it's not
+             * a problem because the dirty page will be retransferred
+             * and the codecs won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            migration_codec_decompress(param->codec, des, TARGET_PAGE_SIZE,
+                                       param->compbuf, len);
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2247,7 +3774,12 @@ void migrate_decompress_threads_create(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].codec = migration_codec_new(migrate_compress_method(),
+                                                    migrate_compress_level(),
+                                                    &error_abort);
+        decomp_bound = migration_codec_bound(decomp_param[i].codec,
+                                             TARGET_PAGE_SIZE);
+        decomp_param[i].compbuf = g_malloc0(decomp_bound);
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2272,6 +3804,7 @@ void migrate_decompress_threads_join(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+        migration_codec_free(decomp_param[i].codec);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
@@ -2319,26 +3852,48 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
     return postcopy_ram_incoming_init(mis, ram_pages);
 }
 
+/*
+ * Worst case size of a page record in the stream: the header, the block
+ * name and the page itself.
+ */
+#define POSTCOPY_PAGE_RECORD_MAX (8 + 1 + 255 + TARGET_PAGE_SIZE)
+
 /*
  * Called in postcopy mode by ram_load().
  * rcu_read_lock is taken prior to this being called.
+ *
+ * Contiguous host pages are gathered in the temporary area and placed
+ * with a single UFFDIO_COPY, which wakes all the vCPUs waiting on any of
+ * them at once.  They are only held back while the next record has
+ * already arrived: once reading on would wait for the source, whatever
+ * is gathered gets placed since a vCPU is probably stalled on it.
  */
 static int ram_load_postcopy(QEMUFile *f)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
-    bool matching_page_sizes = qemu_host_page_size == TARGET_PAGE_SIZE;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Temporary page that is later 'placed' */
+    /* Temporary area that is later 'placed' */
     void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
+    /* Host pages gathered at the start of postcopy_host_page */
+    RAMBlock *batch_block = NULL;
+    void *batch_host = NULL;
+    size_t batch_len = 0;
+
+    if (!postcopy_host_page) {
+        return -ENOMEM;
+    }
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
+        RAMBlock *block = NULL;
         void *host = NULL;
         void *page_buffer = NULL;
         void *place_source = NULL;
+        size_t pagesize = 0;
+        size_t host_offset;
         uint8_t ch;
 
         addr = qemu_get_be64(f);
@@ -2348,7 +3903,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2364,10 +3919,22 @@ static int ram_load_postcopy(QEMUFile *f)
              * however the source ensures it always sends all the components
              * of a host page in order.
              */
-            page_buffer = postcopy_host_page +
-                          ((uintptr_t)host & ~qemu_host_page_mask);
-            /* If all TP are zero then we can optimise the place */
-            if (!((uintptr_t)host & ~qemu_host_page_mask)) {
+            pagesize = block->page_size;
+            host_offset = (uintptr_t)host & (pagesize - 1);
+            if (!host_offset) {
+                /* Place what we have unless this page extends it */
+                if (batch_len &&
+                    (block != batch_block ||
+                     host != batch_host + batch_len ||
+                     batch_len + pagesize > mis->postcopy_tmp_page_size)) {
+                    ret = postcopy_place_page(mis, batch_host,
+                                              postcopy_host_page, batch_len);
+                    batch_len = 0;
+                    if (ret) {
+                        break;
+                    }
+                }
+                /* If all TP are zero then we can optimise the place */
                 all_zero = true;
             } else {
                 /* not the 1st TP within the HP */
@@ -2378,14 +3945,13 @@ static int ram_load_postcopy(QEMUFile *f)
                     break;
                 }
             }
-
+            page_buffer = postcopy_host_page + batch_len + host_offset;
 
             /*
              * If it's the last part of a host page then we place the host
              * page
              */
-            place_needed = (((uintptr_t)host + TARGET_PAGE_SIZE) &
-                                     ~qemu_host_page_mask) == 0;
+            place_needed = host_offset + TARGET_PAGE_SIZE == pagesize;
             place_source = postcopy_host_page;
         }
         last_host = host;
@@ -2401,12 +3967,15 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_PAGE:
             all_zero = false;
-            if (!place_needed || !matching_page_sizes) {
+            if (!place_needed || pagesize != TARGET_PAGE_SIZE || batch_len ||
+                qemu_file_buffered(f) >= TARGET_PAGE_SIZE +
+                                         POSTCOPY_PAGE_RECORD_MAX) {
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /* Avoids the qemu_file copy during postcopy, which is
                  * going to do a copy later; can only do it when we
-                 * do this read in one go (matching page sizes)
+                 * do this read in one go (matching page sizes) and the
+                 * page is going to be placed on its own
                  */
                 qemu_get_buffer_in_place(f, (uint8_t **)&place_source,
                                          TARGET_PAGE_SIZE);
@@ -2421,16 +3990,27 @@ static int ram_load_postcopy(QEMUFile *f)
             ret = -EINVAL;
         }
 
-        if (place_needed) {
+        if (place_needed && !ret) {
             /* This gets called at the last target page in the host page */
-            if (all_zero) {
-                ret = postcopy_place_page_zero(mis,
-                                               host + TARGET_PAGE_SIZE -
-                                               qemu_host_page_size);
+            void *place_dest = host + TARGET_PAGE_SIZE - pagesize;
+
+            if (place_source != postcopy_host_page) {
+                ret = postcopy_place_page(mis, place_dest, place_source,
+                                          pagesize);
+            } else if (all_zero && !batch_len) {
+                ret = postcopy_place_page_zero(mis, place_dest, pagesize);
             } else {
-                ret = postcopy_place_page(mis, host + TARGET_PAGE_SIZE -
-                                               qemu_host_page_size,
-                                               place_source);
+                if (!batch_len) {
+                    batch_block = block;
+                    batch_host = place_dest;
+                }
+                batch_len += pagesize;
+                if (batch_len + pagesize > mis->postcopy_tmp_page_size ||
+                    qemu_file_buffered(f) < POSTCOPY_PAGE_RECORD_MAX) {
+                    ret = postcopy_place_page(mis, batch_host,
+                                              postcopy_host_page, batch_len);
+                    batch_len = 0;
+                }
             }
         }
         if (!ret) {
@@ -2438,11 +4018,44 @@ static int ram_load_postcopy(QEMUFile *f)
         }
     }
 
+    if (!ret && batch_len) {
+        ret = postcopy_place_page(mis, batch_host, postcopy_host_page,
+                                  batch_len);
+    }
+
     return ret;
 }
 
+/* Read the blocks that follow the block list with x-fixed-ram */
+static int ram_load_fixed(QEMUFile *f, GPtrArray *blocks)
+{
+    uint32_t pad = qemu_get_be32(f);
+    int i;
+
+    if (pad >= FIXED_RAM_ALIGN) {
+        error_report("Invalid fixed RAM padding %" PRIu32, pad);
+        return -EINVAL;
+    }
+    while (pad--) {
+        qemu_get_byte(f);
+    }
+
+    for (i = 0; i < blocks->len; i++) {
+        RAMBlock *block = g_ptr_array_index(blocks, i);
+
+        if (qemu_get_buffer(f, block->host, block->used_length) !=
+            block->used_length) {
+            error_report("Truncated fixed RAM for block %s", block->idstr);
+            return qemu_file_get_error(f) < 0 ? qemu_file_get_error(f)
+                                              : -EINVAL;
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    GPtrArray *fixed_blocks = NULL;
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
@@ -2451,6 +4064,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * be atomic
      */
     bool postcopy_running = postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING;
+    /* ADVISE is earlier, it shows the source is willing to do postcopy */
+    bool postcopy_advised = postcopy_state_get() >= POSTCOPY_INCOMING_ADVISE;
 
     seq_iter++;
 
@@ -2494,6 +4109,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            if (migrate_use_fixed_ram()) {
+                fixed_blocks = g_ptr_array_new();
+            }
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -2515,8 +4133,23 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             error_report_err(local_err);
                         }
                     }
+                    if (postcopy_advised &&
+                        block->page_size != qemu_host_page_size) {
+                        uint64_t remote_page_size = qemu_get_be64(f);
+
+                        if (remote_page_size != block->page_size) {
+                            error_report("Mismatched RAM page size %s "
+                                         "(local) %zd != %" PRId64,
+                                         id, block->page_size,
+                                         remote_page_size);
+                            ret = -EINVAL;
+                        }
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (fixed_blocks) {
+                        g_ptr_array_add(fixed_blocks, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2525,6 +4158,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (fixed_blocks) {
+                if (!ret) {
+                    ret = ram_load_fixed(f, fixed_blocks);
+                }
+                g_ptr_array_free(fixed_blocks, true);
+                fixed_blocks = NULL;
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2538,7 +4178,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decomp_bound) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2554,6 +4194,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2591,5 +4234,7 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&free_page_hint_lock);
+    free_page_hints = g_array_new(false, false, sizeof(FreePageHint));
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
@@ -25,6 +25,7 @@
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -50,6 +51,15 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * With dynamic registration, ask the destination to register up to this
+ * many chunks following the one about to be written too.
+ */
+#define RDMA_REG_AHEAD_CHUNKS 16
+
+/* Queue pairs RAM can be written with, the connection's one included */
+#define RDMA_MAX_QPS 8
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -69,12 +79,14 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_MULTI_QP 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_MULTI_QP;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -209,6 +221,42 @@ static void network_to_caps(RDMACapabilities *cap)
     cap->flags = ntohl(cap->flags);
 }
 
+/*
+ * Private data of the connection request and of its reply.
+ *
+ * With RDMA_CAPABILITY_MULTI_QP, each side lists the queue pairs it
+ * created besides the one of the connection: the source asks for
+ * @nb_qps in total and the destination either accepts as many or drops
+ * the capability.  Older versions only look at @cap.
+ */
+typedef struct QEMU_PACKED {
+    RDMACapabilities cap;
+    uint32_t nb_qps;
+    uint32_t qp_num[RDMA_MAX_QPS - 1];
+} RDMAConnectData;
+
+static void connect_data_to_network(RDMAConnectData *data)
+{
+    int i;
+
+    caps_to_network(&data->cap);
+    for (i = 0; i < RDMA_MAX_QPS - 1; i++) {
+        data->qp_num[i] = htonl(data->qp_num[i]);
+    }
+    data->nb_qps = htonl(data->nb_qps);
+}
+
+static void network_to_connect_data(RDMAConnectData *data)
+{
+    int i;
+
+    network_to_caps(&data->cap);
+    data->nb_qps = ntohl(data->nb_qps);
+    for (i = 0; i < RDMA_MAX_QPS - 1; i++) {
+        data->qp_num[i] = ntohl(data->qp_num[i]);
+    }
+}
+
 /*
  * Representation of a RAMBlock from an RDMA perspective.
  * This is not transmitted, only local.
@@ -339,6 +387,9 @@ typedef struct RDMAContext {
     struct ibv_context          *verbs;
     struct rdma_event_channel   *channel;
     struct ibv_qp *qp;                      /* queue pair */
+    /* RAM writes are striped over these and qp, by chunk */
+    struct ibv_qp *extra_qp[RDMA_MAX_QPS - 1];
+    int nb_qps;
     struct ibv_comp_channel *comp_channel;  /* completion channel */
     struct ibv_pd *pd;                      /* protection domain */
     struct ibv_cq *cq;                      /* completion queue */
@@ -374,6 +425,11 @@ typedef struct RDMAContext {
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
     GHashTable *blockmap;
+
+    /* Registers the source's chunks ahead of the writes */
+    QemuThread prereg_thread;
+    bool prereg_running;
+    bool prereg_quit;
 } RDMAContext;
 
 #define TYPE_QIO_CHANNEL_RDMA "qio-channel-rdma"
@@ -1035,9 +1091,11 @@ static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 
     /*
      * Completion queue can be filled by both read and write work requests,
-     * so must reflect the sum of both possible queue sizes.
+     * so must reflect the sum of both possible queue sizes, for every
+     * queue pair.
      */
-    rdma->cq = ibv_create_cq(rdma->verbs, (RDMA_SIGNALED_SEND_MAX * 3),
+    rdma->cq = ibv_create_cq(rdma->verbs,
+            (RDMA_SIGNALED_SEND_MAX * (rdma->nb_qps + 2)),
             NULL, rdma->comp_channel, 0);
     if (!rdma->cq) {
         error_report("failed to allocate completion queue");
@@ -1084,6 +1142,95 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     return 0;
 }
 
+/*
+ * Create the queue pairs besides the connection's one.  The connection
+ * manager doesn't know about them, qemu_rdma_connect_extra_qps() brings
+ * them up once the connection is established.
+ */
+static int qemu_rdma_alloc_extra_qps(RDMAContext *rdma)
+{
+    struct ibv_qp_init_attr attr = { 0 };
+    int i;
+
+    attr.cap.max_send_wr = RDMA_SIGNALED_SEND_MAX;
+    attr.cap.max_recv_wr = 1;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+    attr.send_cq = rdma->cq;
+    attr.recv_cq = rdma->cq;
+    attr.qp_type = IBV_QPT_RC;
+
+    for (i = 0; i < rdma->nb_qps - 1; i++) {
+        rdma->extra_qp[i] = ibv_create_qp(rdma->pd, &attr);
+        if (!rdma->extra_qp[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void qemu_rdma_free_extra_qps(RDMAContext *rdma)
+{
+    int i;
+
+    for (i = 0; i < RDMA_MAX_QPS - 1; i++) {
+        if (rdma->extra_qp[i]) {
+            ibv_destroy_qp(rdma->extra_qp[i]);
+            rdma->extra_qp[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Connect the extra queue pairs to the peer's @remote_qp_num ones, with
+ * the same path and sequence numbers as the connection's queue pair.
+ *
+ * The destination does it before it answers the RAM blocks request and
+ * the source only writes RAM after that, so the destination's queue
+ * pairs are always ready to receive by then.
+ */
+static int qemu_rdma_connect_extra_qps(RDMAContext *rdma,
+                                       const uint32_t *remote_qp_num)
+{
+    static const enum ibv_qp_state states[] = {
+        IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS,
+    };
+    struct ibv_qp_attr attr;
+    int i, j, mask;
+
+    for (i = 0; i < rdma->nb_qps - 1; i++) {
+        for (j = 0; j < ARRAY_SIZE(states); j++) {
+            memset(&attr, 0, sizeof(attr));
+            attr.qp_state = states[j];
+            if (rdma_init_qp_attr(rdma->cm_id, &attr, &mask)) {
+                perror("rdma_init_qp_attr");
+                return -1;
+            }
+            if (states[j] == IBV_QPS_RTR) {
+                attr.dest_qp_num = remote_qp_num[i];
+            }
+            if (ibv_modify_qp(rdma->extra_qp[i], &attr, mask)) {
+                perror("ibv_modify_qp");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Consecutive chunks go to different queue pairs.  Writes to the same
+ * chunk don't overlap in any case, qemu_rdma_write_one() waits for the
+ * previous one to complete.
+ */
+static struct ibv_qp *qemu_rdma_write_qp(RDMAContext *rdma, uint64_t index,
+                                         uint64_t chunk)
+{
+    int n = (index + chunk) % rdma->nb_qps;
+
+    return n ? rdma->extra_qp[n - 1] : rdma->qp;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
@@ -1179,17 +1326,18 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
      *
      * If 'lkey', then we're the source VM, so grant access only to ourselves.
      */
-    if (!block->pmr[chunk]) {
+    if (!atomic_read(&block->pmr[chunk])) {
         uint64_t len = chunk_end - chunk_start;
+        struct ibv_mr *mr;
 
         trace_qemu_rdma_register_and_get_keys(len, chunk_start);
 
-        block->pmr[chunk] = ibv_reg_mr(rdma->pd,
+        mr = ibv_reg_mr(rdma->pd,
                 chunk_start, len,
                 (rkey ? (IBV_ACCESS_LOCAL_WRITE |
                         IBV_ACCESS_REMOTE_WRITE) : 0));
 
-        if (!block->pmr[chunk]) {
+        if (!mr) {
             perror("Failed to register chunk!");
             fprintf(stderr, "Chunk details: block: %d chunk index %d"
                             " start %" PRIuPTR " end %" PRIuPTR
@@ -1201,7 +1349,13 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
                             rdma->total_registrations);
             return -1;
         }
-        rdma->total_registrations++;
+
+        /* The source's registration thread may have been faster */
+        if (atomic_cmpxchg(&block->pmr[chunk], NULL, mr)) {
+            ibv_dereg_mr(mr);
+        } else {
+            atomic_inc(&rdma->total_registrations);
+        }
     }
 
     if (lkey) {
@@ -1319,15 +1473,14 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 
         trace_qemu_rdma_unregister_waiting_send(chunk);
 
-        ret = ibv_dereg_mr(block->pmr[chunk]);
-        block->pmr[chunk] = NULL;
+        ret = ibv_dereg_mr(atomic_xchg(&block->pmr[chunk], NULL));
         block->remote_keys[chunk] = 0;
 
         if (ret != 0) {
             perror("unregistration chunk failed");
             return -ret;
         }
-        rdma->total_registrations--;
+        atomic_dec(&rdma->total_registrations);
 
         reg.key.chunk = chunk;
         register_to_network(rdma, &reg);
@@ -1606,7 +1759,8 @@ static int qemu_rdma_post_send_control(RDMAContext *rdma, uint8_t *buf,
     }
 
 
-    ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
+    ret = ibv_post_send(qemu_rdma_write_qp(rdma, current_index, chunk),
+                        &send_wr, &bad_wr);
 
     if (ret > 0) {
         error_report("Failed to use post IB SEND for control");
@@ -1850,6 +2004,34 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+static bool qemu_rdma_buffer_is_zero(uint8_t *buf, uint64_t length)
+{
+    return can_use_buffer_find_nonzero_offset(buf, length) &&
+           buffer_find_nonzero_offset(buf, length) == length;
+}
+
+/*
+ * Number of chunks from @chunk on that can be registered on the
+ * destination along with the one before: they have to be contiguous,
+ * not registered yet, and not all zero, those are sent as
+ * RDMA_CONTROL_COMPRESS without ever being registered.
+ */
+static uint64_t qemu_rdma_reg_ahead(RDMALocalBlock *block, uint64_t chunk)
+{
+    uint64_t n;
+
+    for (n = 0; n < RDMA_REG_AHEAD_CHUNKS - 1; n++) {
+        uint8_t *start = ram_chunk_start(block, chunk + n);
+
+        if (chunk + n >= block->nb_chunks || block->remote_keys[chunk + n] ||
+            qemu_rdma_buffer_is_zero(start,
+                                     ram_chunk_end(block, chunk + n) - start)) {
+            break;
+        }
+    }
+    return n;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1864,7 +2046,7 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
     int reg_result_idx, ret, count = 0;
-    uint64_t chunk, chunks;
+    uint64_t chunk, chunks, reg_chunks, i;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
     RDMARegister reg;
@@ -1934,10 +2116,8 @@ retry:
              * memset() + madvise() the entire chunk without RDMA.
              */
 
-            if (can_use_buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                   length)
-                   && buffer_find_nonzero_offset((void *)(uintptr_t)sge.addr,
-                                                    length) == length) {
+            if (qemu_rdma_buffer_is_zero((void *)(uintptr_t)sge.addr,
+                                         length)) {
                 RDMACompress comp = {
                                         .offset = current_addr,
                                         .value = 0,
@@ -1965,15 +2145,22 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register, along with the
+             * chunks that are likely to be written next: one round trip
+             * and one larger registration instead of several.
              */
+            reg_chunks = chunks;
             reg.current_index = current_index;
             if (block->is_ram_block) {
                 reg.key.current_addr = current_addr;
+#ifndef RDMA_UNREGISTRATION_EXAMPLE
+                /* unregistering would drop the whole range with the chunk */
+                reg_chunks += qemu_rdma_reg_ahead(block, chunk + chunks + 1);
+#endif
             } else {
                 reg.key.chunk = chunk;
             }
-            reg.chunks = chunks;
+            reg.chunks = reg_chunks;
 
             trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
                                               current_addr);
@@ -2001,7 +2188,9 @@ retry:
             trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
                                                  reg_result->rkey, chunk);
 
-            block->remote_keys[chunk] = reg_result->rkey;
+            for (i = chunk; i <= chunk + reg_chunks; i++) {
+                block->remote_keys[i] = reg_result->rkey;
+            }
             block->remote_host_addr = reg_result->host_addr;
         } else {
             /* already registered before */
@@ -2199,6 +2388,82 @@ static int qemu_rdma_write(QEMUFile *f, RDMAContext *rdma,
     return 0;
 }
 
+/*
+ * With dynamic registration, the source's chunks are registered with the
+ * HCA by this thread ahead of the writes, so that the migration thread
+ * mostly finds their lkey ready instead of pinning memory itself.
+ * Chunks that are all zero are left alone.
+ */
+static void *qemu_rdma_prereg_thread(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    uint8_t *chunk_start, *chunk_end;
+    struct ibv_mr *mr;
+    int i, chunk;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        for (chunk = 0; chunk < block->nb_chunks; chunk++) {
+            if (atomic_read(&rdma->prereg_quit)) {
+                return NULL;
+            }
+
+            chunk_start = ram_chunk_start(block, chunk);
+            chunk_end = ram_chunk_end(block, chunk);
+            if (atomic_read(&block->pmr[chunk]) ||
+                qemu_rdma_buffer_is_zero(chunk_start,
+                                         chunk_end - chunk_start)) {
+                continue;
+            }
+
+            mr = ibv_reg_mr(rdma->pd, chunk_start, chunk_end - chunk_start,
+                            0);
+            if (!mr) {
+                /* Leave it to the migration thread, which reports errors */
+                error_report("rdma: background registration stopped at "
+                             "block %d chunk %d", i, chunk);
+                return NULL;
+            }
+            if (atomic_cmpxchg(&block->pmr[chunk], NULL, mr)) {
+                ibv_dereg_mr(mr);
+            } else {
+                atomic_inc(&rdma->total_registrations);
+                trace_qemu_rdma_prereg_chunk(i, chunk);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void qemu_rdma_prereg_start(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        if (!local->block[i].pmr) {
+            local->block[i].pmr = g_new0(struct ibv_mr *,
+                                         local->block[i].nb_chunks);
+        }
+    }
+
+    rdma->prereg_quit = false;
+    rdma->prereg_running = true;
+    qemu_thread_create(&rdma->prereg_thread, "rdma_prereg",
+                       qemu_rdma_prereg_thread, rdma, QEMU_THREAD_JOINABLE);
+}
+
+static void qemu_rdma_prereg_stop(RDMAContext *rdma)
+{
+    if (rdma->prereg_running) {
+        atomic_set(&rdma->prereg_quit, true);
+        qemu_thread_join(&rdma->prereg_thread);
+        rdma->prereg_running = false;
+    }
+}
+
 static void qemu_rdma_cleanup(RDMAContext *rdma)
 {
     struct rdma_cm_event *cm_event;
@@ -2226,6 +2491,8 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->connected = false;
     }
 
+    qemu_rdma_prereg_stop(rdma);
+
     g_free(rdma->dest_blocks);
     rdma->dest_blocks = NULL;
 
@@ -2243,6 +2510,7 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         }
     }
 
+    qemu_rdma_free_extra_qps(rdma);
     if (rdma->qp) {
         rdma_destroy_qp(rdma->cm_id);
         rdma->qp = NULL;
@@ -2292,6 +2560,18 @@ static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
         goto err_rdma_source_init;
     }
 
+    /*
+     * Also validated against the destination, but queue pairs can only
+     * be connected outside of the connection manager with InfiniBand.
+     */
+    rdma->nb_qps = migrate_rdma_queue_pairs();
+    if (rdma->nb_qps > 1 &&
+        rdma->verbs->device->transport_type != IBV_TRANSPORT_IB) {
+        error_report("rdma migration: multiple queue pairs need InfiniBand"
+                     " or RoCE, using one");
+        rdma->nb_qps = 1;
+    }
+
     ret = qemu_rdma_alloc_pd_cq(rdma);
     if (ret) {
         ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
@@ -2306,6 +2586,13 @@ static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
         goto err_rdma_source_init;
     }
 
+    ret = qemu_rdma_alloc_extra_qps(rdma);
+    if (ret) {
+        ERROR(temp, "rdma migration: error allocating %d queue pairs!",
+                    rdma->nb_qps);
+        goto err_rdma_source_init;
+    }
+
     ret = qemu_rdma_init_ram_blocks(rdma);
     if (ret) {
         ERROR(temp, "rdma migration: error initializing ram blocks!");
@@ -2339,17 +2626,18 @@ err_rdma_source_init:
 
 static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 {
-    RDMACapabilities cap = {
-                                .version = RDMA_CONTROL_VERSION_CURRENT,
-                                .flags = 0,
+    RDMAConnectData data = {
+                                .cap.version = RDMA_CONTROL_VERSION_CURRENT,
+                                .cap.flags = 0,
                            };
+    RDMACapabilities *cap = &data.cap;
     struct rdma_conn_param conn_param = { .initiator_depth = 2,
                                           .retry_count = 5,
-                                          .private_data = &cap,
-                                          .private_data_len = sizeof(cap),
+                                          .private_data = &data,
+                                          .private_data_len = sizeof(data),
                                         };
     struct rdma_cm_event *cm_event;
-    int ret;
+    int ret, i;
 
     /*
      * Only negotiate the capability with destination if the user
@@ -2357,10 +2645,17 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
      */
     if (rdma->pin_all) {
         trace_qemu_rdma_connect_pin_all_requested();
-        cap.flags |= RDMA_CAPABILITY_PIN_ALL;
+        cap->flags |= RDMA_CAPABILITY_PIN_ALL;
+    }
+    if (rdma->nb_qps > 1) {
+        cap->flags |= RDMA_CAPABILITY_MULTI_QP;
+        data.nb_qps = rdma->nb_qps;
+        for (i = 0; i < rdma->nb_qps - 1; i++) {
+            data.qp_num[i] = rdma->extra_qp[i]->qp_num;
+        }
     }
 
-    caps_to_network(&cap);
+    connect_data_to_network(&data);
 
     ret = rdma_connect(rdma->cm_id, &conn_param);
     if (ret) {
@@ -2385,14 +2680,17 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
     }
     rdma->connected = true;
 
-    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
-    network_to_caps(&cap);
+    /* Older destinations only reply with the capabilities */
+    memset(&data, 0, sizeof(data));
+    memcpy(&data, cm_event->param.conn.private_data,
+           MIN(sizeof(data), cm_event->param.conn.private_data_len));
+    network_to_connect_data(&data);
 
     /*
      * Verify that the *requested* capabilities are supported by the destination
      * and disable them otherwise.
      */
-    if (rdma->pin_all && !(cap.flags & RDMA_CAPABILITY_PIN_ALL)) {
+    if (rdma->pin_all && !(cap->flags & RDMA_CAPABILITY_PIN_ALL)) {
         ERROR(errp, "Server cannot support pinning all memory. "
                         "Will register memory dynamically.");
         rdma->pin_all = false;
@@ -2402,6 +2700,22 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     rdma_ack_cm_event(cm_event);
 
+    if (rdma->nb_qps > 1) {
+        if ((cap->flags & RDMA_CAPABILITY_MULTI_QP) &&
+            data.nb_qps == rdma->nb_qps) {
+            if (qemu_rdma_connect_extra_qps(rdma, data.qp_num)) {
+                ERROR(errp, "connecting %d queue pairs!", rdma->nb_qps);
+                goto err_rdma_source_connect;
+            }
+        } else {
+            error_report("rdma migration: destination cannot use multiple "
+                         "queue pairs, using one");
+            qemu_rdma_free_extra_qps(rdma);
+            rdma->nb_qps = 1;
+        }
+    }
+    trace_qemu_rdma_connect_queue_pairs(rdma->nb_qps);
+
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
     if (ret) {
         ERROR(errp, "posting second control recv!");
@@ -2504,6 +2818,7 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         rdma = g_new0(RDMAContext, 1);
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        rdma->nb_qps = 1;
 
         addr = inet_parse(host_port, NULL);
         if (addr != NULL) {
@@ -2947,11 +3262,13 @@ err:
 
 static int qemu_rdma_accept(RDMAContext *rdma)
 {
-    RDMACapabilities cap;
+    RDMAConnectData data = { };
+    RDMACapabilities *cap = &data.cap;
+    uint32_t remote_qp_num[RDMA_MAX_QPS - 1];
     struct rdma_conn_param conn_param = {
                                             .responder_resources = 2,
-                                            .private_data = &cap,
-                                            .private_data_len = sizeof(cap),
+                                            .private_data = &data,
+                                            .private_data_len = sizeof(data),
                                          };
     struct rdma_cm_event *cm_event;
     struct ibv_context *verbs;
@@ -2968,13 +3285,15 @@ static int qemu_rdma_accept(RDMAContext *rdma)
         goto err_rdma_dest_wait;
     }
 
-    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    /* Older sources only send the capabilities */
+    memcpy(&data, cm_event->param.conn.private_data,
+           MIN(sizeof(data), cm_event->param.conn.private_data_len));
 
-    network_to_caps(&cap);
+    network_to_connect_data(&data);
 
-    if (cap.version < 1 || cap.version > RDMA_CONTROL_VERSION_CURRENT) {
+    if (cap->version < 1 || cap->version > RDMA_CONTROL_VERSION_CURRENT) {
             error_report("Unknown source RDMA version: %d, bailing...",
-                            cap.version);
+                            cap->version);
             rdma_ack_cm_event(cm_event);
             goto err_rdma_dest_wait;
     }
@@ -2982,24 +3301,33 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     /*
      * Respond with only the capabilities this version of QEMU knows about.
      */
-    cap.flags &= known_capabilities;
+    cap->flags &= known_capabilities;
 
     /*
      * Enable the ones that we do know about.
      * Add other checks here as new ones are introduced.
      */
-    if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
+    if (cap->flags & RDMA_CAPABILITY_PIN_ALL) {
         rdma->pin_all = true;
     }
 
     rdma->cm_id = cm_event->id;
     verbs = cm_event->id->verbs;
 
+    if (cap->flags & RDMA_CAPABILITY_MULTI_QP) {
+        if (data.nb_qps > 1 && data.nb_qps <= RDMA_MAX_QPS &&
+            verbs->device->transport_type == IBV_TRANSPORT_IB) {
+            rdma->nb_qps = data.nb_qps;
+            memcpy(remote_qp_num, data.qp_num, sizeof(remote_qp_num));
+        } else {
+            cap->flags &= ~RDMA_CAPABILITY_MULTI_QP;
+        }
+    }
+
     rdma_ack_cm_event(cm_event);
 
     trace_qemu_rdma_accept_pin_state(rdma->pin_all);
-
-    caps_to_network(&cap);
+    trace_qemu_rdma_accept_queue_pairs(rdma->nb_qps);
 
     trace_qemu_rdma_accept_pin_verbsc(verbs);
 
@@ -3025,6 +3353,18 @@ static int qemu_rdma_accept(RDMAContext *rdma)
         goto err_rdma_dest_wait;
     }
 
+    ret = qemu_rdma_alloc_extra_qps(rdma);
+    if (ret) {
+        error_report("rdma migration: error allocating %d queue pairs!",
+                     rdma->nb_qps);
+        goto err_rdma_dest_wait;
+    }
+    for (idx = 0; idx < rdma->nb_qps - 1; idx++) {
+        data.qp_num[idx] = rdma->extra_qp[idx]->qp_num;
+    }
+
+    connect_data_to_network(&data);
+
     ret = qemu_rdma_init_ram_blocks(rdma);
     if (ret) {
         error_report("rdma migration: error initializing ram blocks!");
@@ -3062,6 +3402,13 @@ static int qemu_rdma_accept(RDMAContext *rdma)
     rdma_ack_cm_event(cm_event);
     rdma->connected = true;
 
+    ret = qemu_rdma_connect_extra_qps(rdma, remote_qp_num);
+    if (ret) {
+        error_report("rdma migration: error connecting %d queue pairs",
+                     rdma->nb_qps);
+        goto err_rdma_dest_wait;
+    }
+
     ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
     if (ret) {
         error_report("rdma migration: error posting second control recv");
@@ -3508,6 +3855,10 @@ static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
                     rdma->dest_blocks[i].remote_host_addr;
             local->block[i].remote_rkey = rdma->dest_blocks[i].remote_rkey;
         }
+
+        if (!rdma->pin_all) {
+            qemu_rdma_prereg_start(rdma);
+        }
     }
 
     trace_qemu_rdma_registration_stop(flags);
@@ -79,6 +79,7 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
                                    .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_ENABLE_COLO]      = { .len =  0, .name = "ENABLE_COLO" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -746,6 +747,13 @@ void qemu_savevm_send_open_return_path(QEMUFile *f)
     qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
 }
 
+/* Ask the destination to keep loading COLO checkpoints after this stream */
+void qemu_savevm_send_colo_enable(QEMUFile *f)
+{
+    trace_savevm_send_colo_enable();
+    qemu_savevm_command_send(f, MIG_CMD_ENABLE_COLO, 0, NULL);
+}
+
 /* We have a buffer of data to send; we don't want that all to be loaded
  * by the command itself, so the command contains just the length of the
  * extra buffer that we then send straight after it.
@@ -1014,11 +1022,151 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * With the parallel-device-state capability, the sections whose VMState
+ * is only plain fields are saved by worker threads into buffers of their
+ * own, while the migration thread saves the other ones straight into the
+ * stream; each buffer is copied in when its turn comes, so the stream
+ * stays the same.  Saving plain fields runs no device code, and the
+ * iothread lock, held by the caller all along, keeps the devices still.
+ */
+#define SAVEVM_PARALLEL_THREADS 4
+
+typedef struct SaveParallelJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    QJSON *vmdesc;
+    bool done;
+} SaveParallelJob;
+
+typedef struct SaveParallelState {
+    SaveParallelJob *jobs;
+    int nb_jobs;
+    int next_job;
+    QemuThread *threads;
+    int nb_threads;
+    QemuMutex lock;
+    QemuCond done_cond;
+} SaveParallelState;
+
+static void *savevm_parallel_thread(void *opaque)
+{
+    SaveParallelState *ps = opaque;
+    SaveParallelJob *job;
+    int i;
+
+    while ((i = atomic_fetch_inc(&ps->next_job)) < ps->nb_jobs) {
+        job = &ps->jobs[i];
+
+        trace_savevm_section_start(job->se->idstr, job->se->section_id);
+        json_prop_str(job->vmdesc, "name", job->se->idstr);
+        json_prop_int(job->vmdesc, "instance_id", job->se->instance_id);
+
+        save_section_header(job->fb, job->se, QEMU_VM_SECTION_FULL);
+        vmstate_save(job->fb, job->se, job->vmdesc);
+        trace_savevm_section_end(job->se->idstr, job->se->section_id, 0);
+        save_section_footer(job->fb, job->se);
+        qemu_fflush(job->fb);
+        qjson_finish(job->vmdesc);
+
+        qemu_mutex_lock(&ps->lock);
+        job->done = true;
+        qemu_cond_broadcast(&ps->done_cond);
+        qemu_mutex_unlock(&ps->lock);
+    }
+    return NULL;
+}
+
+static bool savevm_section_is_parallel(SaveStateEntry *se)
+{
+    return se->vmsd && vmstate_save_is_pure(se->vmsd) &&
+           vmstate_save_needed(se->vmsd, se->opaque);
+}
+
+static SaveParallelState *savevm_parallel_start(void)
+{
+    SaveParallelState *ps;
+    SaveParallelJob *job;
+    SaveStateEntry *se;
+    int i;
+
+    ps = g_new0(SaveParallelState, 1);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (savevm_section_is_parallel(se)) {
+            ps->nb_jobs++;
+        }
+    }
+    if (!ps->nb_jobs) {
+        g_free(ps);
+        return NULL;
+    }
+
+    /* The buffers are objects, create them before there's any thread */
+    ps->jobs = g_new0(SaveParallelJob, ps->nb_jobs);
+    job = ps->jobs;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (savevm_section_is_parallel(se)) {
+            job->se = se;
+            job->bioc = qio_channel_buffer_new(4096);
+            job->fb = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+            job->vmdesc = qjson_new();
+            job++;
+        }
+    }
+
+    qemu_mutex_init(&ps->lock);
+    qemu_cond_init(&ps->done_cond);
+    ps->nb_threads = MIN(ps->nb_jobs, SAVEVM_PARALLEL_THREADS);
+    ps->threads = g_new0(QemuThread, ps->nb_threads);
+    trace_savevm_parallel_start(ps->nb_jobs, ps->nb_threads);
+    for (i = 0; i < ps->nb_threads; i++) {
+        qemu_thread_create(&ps->threads[i], "savevm",
+                           savevm_parallel_thread, ps, QEMU_THREAD_JOINABLE);
+    }
+    return ps;
+}
+
+/* Wait for the section of @job and copy it to @f */
+static void savevm_parallel_put(QEMUFile *f, QJSON *vmdesc,
+                                SaveParallelState *ps, SaveParallelJob *job)
+{
+    qemu_mutex_lock(&ps->lock);
+    while (!job->done) {
+        qemu_cond_wait(&ps->done_cond, &ps->lock);
+    }
+    qemu_mutex_unlock(&ps->lock);
+
+    qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+    json_prop_json(vmdesc, NULL, job->vmdesc);
+}
+
+static void savevm_parallel_finish(SaveParallelState *ps)
+{
+    int i;
+
+    for (i = 0; i < ps->nb_threads; i++) {
+        qemu_thread_join(&ps->threads[i]);
+    }
+    for (i = 0; i < ps->nb_jobs; i++) {
+        qemu_fclose(ps->jobs[i].fb);
+        object_unref(OBJECT(ps->jobs[i].bioc));
+        qjson_destroy(ps->jobs[i].vmdesc);
+    }
+    qemu_cond_destroy(&ps->done_cond);
+    qemu_mutex_destroy(&ps->lock);
+    g_free(ps->threads);
+    g_free(ps->jobs);
+    g_free(ps);
+}
+
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    SaveParallelState *ps = NULL;
+    SaveParallelJob *job = NULL;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
@@ -1056,6 +1204,11 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
+    if (migrate_parallel_device_state()) {
+        ps = savevm_parallel_start();
+        job = ps ? ps->jobs : NULL;
+    }
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1064,6 +1217,11 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
+        if (job && job < ps->jobs + ps->nb_jobs && job->se == se) {
+            savevm_parallel_put(f, vmdesc, ps, job);
+            job++;
+            continue;
+        }
         if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
             trace_savevm_section_skip(se->idstr, se->section_id);
             continue;
@@ -1083,6 +1241,10 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         json_end_object(vmdesc);
     }
 
+    if (ps) {
+        savevm_parallel_finish(ps);
+    }
+
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
         qemu_put_byte(f, QEMU_VM_EOF);
@@ -1142,7 +1304,48 @@ void qemu_savevm_state_cleanup(void)
     }
 }
 
-static int qemu_savevm_state(QEMUFile *f, Error **errp)
+/*
+ * Write RAM out with the VM running, precopy style, until what is still
+ * dirty can be written in about max-downtime.  Gives up converging once
+ * twice the size of RAM has been written, leaving the rest to the final
+ * pause as for a plain savevm.
+ */
+static void qemu_savevm_state_live(QEMUFile *f)
+{
+    uint64_t pend_nonpost, pend_post, threshold = 0;
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t base = qemu_ftell_fast(f), written, elapsed;
+
+    while (qemu_file_get_error(f) == 0) {
+        pend_nonpost = pend_post = 0;
+        /* Syncing the dirty log takes the iothread lock by itself */
+        qemu_mutex_unlock_iothread();
+        qemu_savevm_state_pending(f, threshold, &pend_nonpost, &pend_post);
+        qemu_mutex_lock_iothread();
+
+        written = qemu_ftell_fast(f) - base;
+        if (pend_nonpost + pend_post <= threshold ||
+            written > 2 * ram_bytes_total()) {
+            break;
+        }
+        if (qemu_savevm_state_iterate(f, false) > 0) {
+            break;
+        }
+
+        /* Complete the guest's own disk requests, the main loop is not
+         * running while this command is */
+        aio_poll(qemu_get_aio_context(), false);
+
+        elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+        if (elapsed > 0) {
+            threshold = (qemu_ftell_fast(f) - base) / elapsed *
+                        migrate_max_downtime() / 1000000;
+        }
+    }
+    trace_savevm_state_live(qemu_ftell_fast(f) - base, threshold);
+}
+
+static int qemu_savevm_state(QEMUFile *f, bool live, Error **errp)
 {
     int ret;
     MigrationParams params = {
@@ -1158,11 +1361,22 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         goto done;
     }
 
+    if (migrate_use_multifd()) {
+        error_setg(errp, "x-multifd is not supported by savevm");
+        ret = -EINVAL;
+        goto done;
+    }
+
     qemu_mutex_unlock_iothread();
     qemu_savevm_state_header(f);
     qemu_savevm_state_begin(f, &params);
     qemu_mutex_lock_iothread();
 
+    if (live) {
+        qemu_savevm_state_live(f);
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
+
     while (qemu_file_get_error(f) == 0) {
         if (qemu_savevm_state_iterate(f, false) > 0) {
             break;
@@ -1189,7 +1403,7 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
 
@@ -1246,8 +1460,6 @@ enum LoadVMExitCodes {
     LOADVM_QUIT     =  1,
 };
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
-
 /* ------ incoming postcopy messages ------ */
 /* 'advise' arrives before any transfers just to tell us that a postcopy
  * *might* happen - it might be skipped if precopy transferred everything
@@ -1672,6 +1884,10 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_POSTCOPY_RAM_DISCARD:
         return loadvm_postcopy_ram_handle_discard(mis, len);
+
+    case MIG_CMD_ENABLE_COLO:
+        mis->colo_enabled = true;
+        break;
     }
 
     return 0;
@@ -1825,7 +2041,7 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
-static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
     uint8_t section_type;
     int ret;
@@ -1958,7 +2174,31 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
-void hmp_savevm(Monitor *mon, const QDict *qdict)
+/*
+ * Load a stream written by qemu_save_device_state(); the caller holds
+ * the iothread lock.
+ */
+int qemu_load_device_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret;
+
+    if (qemu_get_be32(f) != QEMU_VM_FILE_MAGIC ||
+        qemu_get_be32(f) != QEMU_VM_FILE_VERSION) {
+        error_report("Not a device state stream");
+        return -EINVAL;
+    }
+
+    ret = qemu_loadvm_state_main(f, mis);
+    if (ret < 0) {
+        return ret;
+    }
+
+    cpu_synchronize_all_post_init();
+    return qemu_file_get_error(f);
+}
+
+int save_vmstate(const char *name, bool live, Error **errp)
 {
     BlockDriverState *bs, *bs1;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
@@ -1968,39 +2208,41 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     uint64_t vm_state_size;
     qemu_timeval tv;
     struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
     Error *local_err = NULL;
     AioContext *aio_context;
 
     if (!bdrv_all_can_snapshot(&bs)) {
-        monitor_printf(mon, "Device '%s' is writable but does not "
-                       "support snapshots.\n", bdrv_get_device_name(bs));
-        return;
+        error_setg(errp, "Device '%s' is writable but does not "
+                   "support snapshots", bdrv_get_device_name(bs));
+        return -ENOTSUP;
     }
 
     /* Delete old snapshots of the same name */
     if (name && bdrv_all_delete_snapshot(name, &bs1, &local_err) < 0) {
-        error_reportf_err(local_err,
-                          "Error while deleting snapshot on device '%s': ",
-                          bdrv_get_device_name(bs1));
-        return;
+        error_propagate(errp, local_err);
+        error_prepend(errp, "Error while deleting snapshot on device '%s': ",
+                      bdrv_get_device_name(bs1));
+        return -EINVAL;
     }
 
     bs = bdrv_all_find_vmstate_bs();
     if (bs == NULL) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        error_setg(errp, "No block device can accept snapshots");
+        return -ENOTSUP;
     }
     aio_context = bdrv_get_aio_context(bs);
 
     saved_vm_running = runstate_is_running();
+    live = live && saved_vm_running;
 
     ret = global_state_store();
     if (ret) {
-        monitor_printf(mon, "Error saving global state\n");
-        return;
+        error_setg(errp, "Error saving global state");
+        return ret;
+    }
+    if (!live) {
+        vm_stop(RUN_STATE_SAVE_VM);
     }
-    vm_stop(RUN_STATE_SAVE_VM);
 
     aio_context_acquire(aio_context);
 
@@ -2010,7 +2252,6 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     qemu_gettimeofday(&tv);
     sn->date_sec = tv.tv_sec;
     sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -2029,21 +2270,24 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
     if (!f) {
-        monitor_printf(mon, "Could not open VM state file\n");
+        error_setg(errp, "Could not open VM state file");
+        ret = -EIO;
         goto the_end;
     }
-    ret = qemu_savevm_state(f, &local_err);
+    ret = qemu_savevm_state(f, live, errp);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
     if (ret < 0) {
-        error_report_err(local_err);
         goto the_end;
     }
 
+    /* The VM is stopped by now, also in live mode */
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
     ret = bdrv_all_create_snapshot(sn, bs, vm_state_size, &bs);
     if (ret < 0) {
-        monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                       bdrv_get_device_name(bs));
+        error_setg(errp, "Error while creating snapshot on '%s'",
+                   bdrv_get_device_name(bs));
     }
 
  the_end:
@@ -2051,6 +2295,17 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     if (saved_vm_running) {
         vm_start();
     }
+    return ret;
+}
+
+void hmp_savevm(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    if (save_vmstate(qdict_get_try_str(qdict, "name"),
+                     qdict_get_try_bool(qdict, "live", false), &err) < 0) {
+        error_report_err(err);
+    }
 }
 
 void qmp_xen_save_devices_state(const char *filename, Error **errp)
@@ -55,6 +55,28 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Where the multifd channels of the current outgoing migration connect */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "Additional migration connections need a tcp or "
+                   "unix migration");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -105,7 +127,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -142,10 +165,24 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
-    migration_channel_process_incoming(migrate_get_current(),
-                                       QIO_CHANNEL(sioc));
+    /* With multifd or postcopy preemption, the main connection comes first */
+    if (migrate_use_multifd() && migration_incoming_get_current()) {
+        multifd_recv_new_channel(QIO_CHANNEL(sioc));
+    } else if (migrate_postcopy_preempt() && migration_incoming_get_current()) {
+        postcopy_preempt_new_channel(QIO_CHANNEL(sioc));
+    } else {
+        migration_channel_process_incoming(migrate_get_current(),
+                                           QIO_CHANNEL(sioc));
+    }
     object_unref(OBJECT(sioc));
 
+    if (migrate_use_multifd() && !multifd_recv_all_channels_created()) {
+        return TRUE; /* wait for the other channels */
+    }
+    if (migrate_postcopy_preempt() && !postcopy_preempt_channel_created()) {
+        return TRUE; /* wait for the preempt channel */
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
@@ -4,6 +4,7 @@
 #include "migration/qemu-file.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 
@@ -291,11 +292,143 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
     return true;
 }
 
+static bool vmstate_info_is_pure(const VMStateInfo *info)
+{
+    return info == &vmstate_info_bool ||
+           info == &vmstate_info_int8 || info == &vmstate_info_int16 ||
+           info == &vmstate_info_int32 || info == &vmstate_info_int64 ||
+           info == &vmstate_info_uint8_equal ||
+           info == &vmstate_info_uint16_equal ||
+           info == &vmstate_info_int32_equal ||
+           info == &vmstate_info_uint32_equal ||
+           info == &vmstate_info_uint64_equal ||
+           info == &vmstate_info_int32_le ||
+           info == &vmstate_info_uint8 || info == &vmstate_info_uint16 ||
+           info == &vmstate_info_uint32 || info == &vmstate_info_uint64 ||
+           info == &vmstate_info_float64 || info == &vmstate_info_cpudouble ||
+           info == &vmstate_info_buffer ||
+           info == &vmstate_info_unused_buffer ||
+           info == &vmstate_info_bitmap;
+}
+
+/* Saving @vmsd only copies plain fields out of the device: there is no
+ * pre_save hook and no field with a put method of its own, down to the
+ * last nested struct and subsection.
+ */
+bool vmstate_save_is_pure(const VMStateDescription *vmsd)
+{
+    const VMStateDescription **sub = vmsd->subsections;
+    VMStateField *field;
+
+    if (vmsd->pre_save) {
+        return false;
+    }
+    for (field = vmsd->fields; field->name; field++) {
+        if (field->flags & VMS_STRUCT) {
+            if (!vmstate_save_is_pure(field->vmsd)) {
+                return false;
+            }
+        } else if (!vmstate_info_is_pure(field->info)) {
+            return false;
+        }
+    }
+    while (sub && *sub) {
+        if (!vmstate_save_is_pure(*sub)) {
+            return false;
+        }
+        sub++;
+    }
+    return true;
+}
+
+/*
+ * Integer fields are the bulk of most device states.  Instead of going
+ * through their put method one element at a time, vmstate_save_state()
+ * byteswaps them into a small buffer, which goes to the QEMUFile in a
+ * single qemu_put_buffer(); the stream is the same.
+ */
+#define VMSTATE_STAGE_SIZE 512
+
+typedef struct VMStateStage {
+    uint8_t buf[VMSTATE_STAGE_SIZE];
+    size_t len;
+} VMStateStage;
+
+static void vmstate_stage_flush(QEMUFile *f, VMStateStage *stage)
+{
+    if (stage->len) {
+        qemu_put_buffer(f, stage->buf, stage->len);
+        stage->len = 0;
+    }
+}
+
+/* Size of the big endian integers @field is made of, or 0 */
+static int vmstate_scalar_width(VMStateField *field, int size)
+{
+    const VMStateInfo *info = field->info;
+    int width = 0;
+
+    if (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER)) {
+        return 0;
+    }
+    if (info == &vmstate_info_bool || info == &vmstate_info_int8 ||
+        info == &vmstate_info_uint8 || info == &vmstate_info_uint8_equal) {
+        width = 1;
+    } else if (info == &vmstate_info_int16 || info == &vmstate_info_uint16 ||
+               info == &vmstate_info_uint16_equal) {
+        width = 2;
+    } else if (info == &vmstate_info_int32 || info == &vmstate_info_uint32 ||
+               info == &vmstate_info_int32_equal ||
+               info == &vmstate_info_uint32_equal ||
+               info == &vmstate_info_int32_le) {
+        width = 4;
+    } else if (info == &vmstate_info_int64 || info == &vmstate_info_uint64 ||
+               info == &vmstate_info_uint64_equal) {
+        width = 8;
+    }
+    return width == size ? width : 0;
+}
+
+static void vmstate_stage_put(QEMUFile *f, VMStateStage *stage,
+                              const uint8_t *addr, int n_elems, int width)
+{
+    int i;
+
+    if (width == 1 && n_elems > VMSTATE_STAGE_SIZE) {
+        vmstate_stage_flush(f, stage);
+        qemu_put_buffer(f, addr, n_elems);
+        return;
+    }
+
+    for (i = 0; i < n_elems; i++, addr += width) {
+        if (stage->len + width > VMSTATE_STAGE_SIZE) {
+            vmstate_stage_flush(f, stage);
+        }
+        switch (width) {
+        case 1:
+            stage->buf[stage->len] = *addr;
+            break;
+        case 2:
+            stw_be_p(stage->buf + stage->len, *(const uint16_t *)addr);
+            break;
+        case 4:
+            stl_be_p(stage->buf + stage->len, *(const uint32_t *)addr);
+            break;
+        default:
+            stq_be_p(stage->buf + stage->len, *(const uint64_t *)addr);
+            break;
+        }
+        stage->len += width;
+    }
+}
 
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
     VMStateField *field = vmsd->fields;
+    VMStateStage stage;
+
+    stage.len = 0;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
@@ -313,9 +446,23 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
             void *base_addr = vmstate_base_addr(opaque, field, false);
             int i, n_elems = vmstate_n_elems(opaque, field);
             int size = vmstate_size(opaque, field);
+            int width = vmstate_scalar_width(field, size);
             int64_t old_offset, written_bytes;
             QJSON *vmdesc_loop = vmdesc;
 
+            if (width && (!vmdesc || vmsd_can_compress(field))) {
+                /* Only the first element gets a description */
+                if (n_elems) {
+                    vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+                    vmstate_stage_put(f, &stage, base_addr, n_elems, width);
+                    vmsd_desc_field_end(vmsd, vmdesc, field, width, 0);
+                }
+                n_elems = 0;
+            }
+
+            if (n_elems) {
+                vmstate_stage_flush(f, &stage);
+            }
             for (i = 0; i < n_elems; i++) {
                 void *addr = base_addr + size * i;
 
@@ -348,6 +495,7 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
         }
         field++;
     }
+    vmstate_stage_flush(f, &stage);
 
     if (vmdesc) {
         json_end_array(vmdesc);
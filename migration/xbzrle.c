@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,13 +25,133 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoder only needs two scans: the end of a run of unchanged bytes
+ * and the end of a run of changed bytes.  Both return the index of the
+ * first byte at or after @i that ends the run, or @slen.
+ */
+typedef int XbzrleScanFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/*
+ * 16 bytes at a time, the first one that ends the run is found from the
+ * byte compare mask; buffers are only sizeof(long) aligned so use
+ * unaligned loads.
+ */
+static int xbzrle_skip_equal_sse2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    while (i + (int)sizeof(__m128i) <= slen) {
+        __m128i eq = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(old_buf + i)),
+            _mm_loadu_si128((const __m128i *)(new_buf + i)));
+        uint32_t diff = _mm_movemask_epi8(eq) ^ 0xFFFF;
+
+        if (diff) {
+            return i + ctz32(diff);
+        }
+        i += sizeof(__m128i);
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_skip_diff_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i + (int)sizeof(__m128i) <= slen) {
+        __m128i eq = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(old_buf + i)),
+            _mm_loadu_si128((const __m128i *)(new_buf + i)));
+        uint32_t same = _mm_movemask_epi8(eq);
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += sizeof(__m128i);
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#define xbzrle_skip_equal_default xbzrle_skip_equal_sse2
+#define xbzrle_skip_diff_default  xbzrle_skip_diff_sse2
+#else
+static int xbzrle_skip_equal_inner(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int i, int slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    /* not aligned to sizeof(long) */
+    while ((slen - i) % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    if ((slen - i) % sizeof(long)) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_skip_diff_inner(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    while ((slen - i) % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    if ((slen - i) % sizeof(long)) {
+        return i;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+#define xbzrle_skip_equal_default xbzrle_skip_equal_inner
+#define xbzrle_skip_diff_default  xbzrle_skip_diff_inner
+#endif
+
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                XbzrleScanFunc *skip_equal,
+                                XbzrleScanFunc *skip_diff)
+{
+    uint32_t zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint8_t *nzrun_start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +162,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = skip_equal(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +177,15 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = skip_diff(old_buf, new_buf, i, slen) - i;
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,12 +194,98 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static int xbzrle_encode_buffer_inner(uint8_t *old_buf, uint8_t *new_buf,
+                                      int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_skip_equal_default, xbzrle_skip_diff_default);
+}
+
+#if defined CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int xbzrle_skip_equal_avx2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    while (i + (int)sizeof(__m256i) <= slen) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(old_buf + i)),
+            _mm256_loadu_si256((const __m256i *)(new_buf + i)));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(eq);
+
+        if (diff) {
+            return i + ctz32(diff);
+        }
+        i += sizeof(__m256i);
+    }
+    return xbzrle_skip_equal_default(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_skip_diff_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i + (int)sizeof(__m256i) <= slen) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(old_buf + i)),
+            _mm256_loadu_si256((const __m256i *)(new_buf + i)));
+        uint32_t same = _mm256_movemask_epi8(eq);
+
+        if (same) {
+            return i + ctz32(same);
+        }
+        i += sizeof(__m256i);
+    }
+    return xbzrle_skip_diff_default(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_skip_equal_avx2, xbzrle_skip_diff_avx2);
+}
+
+static bool avx2_support(void)
+{
+    int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+
+    return b & bit_AVX2;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen) \
+         __attribute__ ((ifunc("xbzrle_encode_buffer_ifunc")));
+
+static void *xbzrle_encode_buffer_ifunc(void)
+{
+    typeof(xbzrle_encode_buffer) *func = (avx2_support()) ?
+        xbzrle_encode_buffer_avx2 : xbzrle_encode_buffer_inner;
+
+    return func;
+}
+#pragma GCC pop_options
+#else
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_inner(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
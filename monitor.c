@@ -139,6 +139,8 @@ typedef struct mon_cmd_t {
      */
     struct mon_cmd_t *sub_table;
     void (*command_completion)(ReadLineState *rs, int nb_args, const char *str);
+    /* QMP only: read-only query that may be answered out of band */
+    bool oob;
 } mon_cmd_t;
 
 /* file descriptors passed via SCM_RIGHTS */
@@ -168,7 +170,6 @@ struct MonFdset {
 };
 
 typedef struct {
-    QObject *id;
     JSONMessageParser parser;
     /*
      * When a client connects, we're in capabilities negotiation mode.
@@ -216,8 +217,48 @@ struct Monitor {
     mon_cmd_t *cmd_table;
     QLIST_HEAD(,mon_fd_t) fds;
     QLIST_ENTRY(Monitor) entry;
+
+    /*
+     * With oob=on, QMP input is read and parsed in a thread of its own.
+     * Commands are queued for the main loop, except "exec-oob" ones.
+     */
+    QemuThread oob_thread;
+    GMainContext *oob_context;
+    GMainLoop *oob_loop;
+    QemuMutex qmp_queue_lock;
+    GQueue *qmp_requests;
+    QEMUBH *qmp_bh;
+    QEMUBH *qmp_closed_bh;
 };
 
+typedef struct QMPRequest {
+    const mon_cmd_t *cmd;
+    QDict *args;
+    QObject *id;
+} QMPRequest;
+
+/*
+ * Out-of-band queries are answered from a snapshot, so that they never
+ * wait for the BQL.  Each request returns the result of the previous run
+ * of the same query and schedules a new run in the main loop.  Results
+ * are kept as JSON because QObject reference counts are not thread-safe.
+ */
+typedef struct QMPSnapshot {
+    const mon_cmd_t *cmd;
+    QDict *args;
+    char *json;
+    Error *err;
+    bool valid;
+    bool pending;
+} QMPSnapshot;
+
+/* Protects qmp_snapshots and qmp_snapshot_refresh.  */
+static QemuMutex qmp_snapshot_lock;
+static QemuCond qmp_snapshot_cond;
+static GHashTable *qmp_snapshots;
+static GQueue qmp_snapshot_refresh = G_QUEUE_INIT;
+static QEMUBH *qmp_snapshot_bh;
+
 /* QMP checker flags */
 #define QMP_ACCEPT_UNKNOWNS 1
 
@@ -414,8 +455,9 @@ static QDict *build_qmp_error_dict(Error *err)
     return qobject_to_qdict(obj);
 }
 
+/* Takes ownership of @id.  */
 static void monitor_protocol_emitter(Monitor *mon, QObject *data,
-                                     Error *err)
+                                     Error *err, QObject *id)
 {
     QDict *qmp;
 
@@ -436,9 +478,8 @@ static void monitor_protocol_emitter(Monitor *mon, QObject *data,
         qmp = build_qmp_error_dict(err);
     }
 
-    if (mon->qmp.id) {
-        qdict_put_obj(qmp, "id", mon->qmp.id);
-        mon->qmp.id = NULL;
+    if (id) {
+        qdict_put_obj(qmp, "id", id);
     }
 
     monitor_json_emitter(mon, QOBJECT(qmp));
@@ -1055,6 +1096,13 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_tbs(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 10);
+
+    dump_tb_profile((FILE *)mon, monitor_fprintf, count);
+}
+
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -1176,6 +1224,18 @@ static void hmp_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+    if (!option || !strcmp(option, "on")) {
+        tb_profile_set(mon_get_cpu(), true);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_set(mon_get_cpu(), false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 static void hmp_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -3893,10 +3953,14 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
         const char *arg_name = qdict_entry_key(ent);
         const QObject *arg_obj = qdict_entry_value(ent);
 
-        if (!strcmp(arg_name, "execute")) {
+        if (!strcmp(arg_name, "execute") || !strcmp(arg_name, "exec-oob")) {
             if (qobject_type(arg_obj) != QTYPE_QSTRING) {
                 error_setg(errp, QERR_QMP_BAD_INPUT_OBJECT_MEMBER,
-                           "execute", "string");
+                           arg_name, "string");
+                return NULL;
+            }
+            if (has_exec_key) {
+                error_setg(errp, QERR_QMP_EXTRA_MEMBER, arg_name);
                 return NULL;
             }
             has_exec_key = 1;
@@ -3922,17 +3986,205 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
     return input_dict;
 }
 
+static void qmp_snapshot_bh_cb(void *opaque)
+{
+    QMPSnapshot *snap;
+
+    qemu_mutex_lock(&qmp_snapshot_lock);
+    while ((snap = g_queue_pop_head(&qmp_snapshot_refresh))) {
+        QObject *data = NULL;
+        Error *err = NULL;
+        QString *json = NULL;
+
+        qemu_mutex_unlock(&qmp_snapshot_lock);
+        snap->cmd->mhandler.cmd_new(snap->args, &data, &err);
+        if (data) {
+            json = qobject_to_json(data);
+            qobject_decref(data);
+        }
+        qemu_mutex_lock(&qmp_snapshot_lock);
+
+        g_free(snap->json);
+        error_free(snap->err);
+        snap->json = json ? g_strdup(qstring_get_str(json)) : NULL;
+        snap->err = err;
+        snap->valid = true;
+        snap->pending = false;
+        QDECREF(json);
+    }
+    qemu_cond_broadcast(&qmp_snapshot_cond);
+    qemu_mutex_unlock(&qmp_snapshot_lock);
+}
+
+/* Normally called from a monitor thread.  Only the first request for a
+ * given query waits for the main loop.
+ */
+static void qmp_snapshot_get(const mon_cmd_t *cmd, QDict *args,
+                             QObject **ret_data, Error **errp)
+{
+    QString *json = qobject_to_json(QOBJECT(args));
+    char *key = g_strdup_printf("%s %s", cmd->name, qstring_get_str(json));
+    QMPSnapshot *snap;
+
+    QDECREF(json);
+
+    if (qemu_mutex_iothread_locked()) {
+        /* The chardev could not move to the monitor thread */
+        g_free(key);
+        cmd->mhandler.cmd_new(args, ret_data, errp);
+        return;
+    }
+
+    qemu_mutex_lock(&qmp_snapshot_lock);
+    snap = g_hash_table_lookup(qmp_snapshots, key);
+    if (!snap) {
+        snap = g_new0(QMPSnapshot, 1);
+        snap->cmd = cmd;
+        snap->args = args;
+        QINCREF(args);
+        g_hash_table_insert(qmp_snapshots, key, snap);
+        key = NULL;
+    }
+    g_free(key);
+
+    if (!snap->pending) {
+        snap->pending = true;
+        g_queue_push_tail(&qmp_snapshot_refresh, snap);
+        qemu_bh_schedule(qmp_snapshot_bh);
+    }
+    while (!snap->valid) {
+        qemu_cond_wait(&qmp_snapshot_cond, &qmp_snapshot_lock);
+    }
+
+    if (snap->err) {
+        error_propagate(errp, error_copy(snap->err));
+    } else if (snap->json) {
+        *ret_data = qobject_from_json(snap->json);
+    }
+    qemu_mutex_unlock(&qmp_snapshot_lock);
+}
+
+/* Runs the commands under a single memory_region_transaction_begin/commit
+ * and bdrv_drain_all_begin/end pair, so that each of them does not pay for
+ * its own flat view rebuild and drain.
+ */
+BatchResultList *qmp_batch(BatchCommandList *commands, Error **errp)
+{
+    BatchResultList *head = NULL, **tail = &head;
+    BatchCommandList *l;
+    Error *local_err = NULL;
+    int i = 0;
+
+    bdrv_drain_all_begin();
+    memory_region_transaction_begin();
+
+    for (l = commands; l; l = l->next, i++) {
+        BatchCommand *bc = l->value;
+        const mon_cmd_t *cmd = qmp_find_cmd(bc->execute);
+        QObject *data = NULL;
+        BatchResultList *entry;
+        QDict *args;
+
+        if (!cmd) {
+            error_set(&local_err, ERROR_CLASS_COMMAND_NOT_FOUND,
+                      "The command %s has not been found", bc->execute);
+            break;
+        }
+        if (invalid_qmp_mode(cur_mon, cmd, &local_err)) {
+            break;
+        }
+
+        if (!bc->has_arguments) {
+            args = qdict_new();
+        } else {
+            args = qobject_to_qdict(bc->arguments);
+            if (!args) {
+                error_setg(&local_err, QERR_QMP_BAD_INPUT_OBJECT_MEMBER,
+                           "arguments", "object");
+                break;
+            }
+            QINCREF(args);
+        }
+
+        qmp_check_client_args(cmd, args, &local_err);
+        if (!local_err) {
+            cmd->mhandler.cmd_new(args, &data, &local_err);
+        }
+        QDECREF(args);
+        if (local_err) {
+            qobject_decref(data);
+            break;
+        }
+
+        entry = g_new0(BatchResultList, 1);
+        entry->value = g_new0(BatchResult, 1);
+        entry->value->q_return = data ? data : QOBJECT(qdict_new());
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    memory_region_transaction_commit();
+    bdrv_drain_all_end();
+
+    if (local_err) {
+        error_prepend(&local_err, "Command %d (%s): ", i, l->value->execute);
+        error_propagate(errp, local_err);
+        qapi_free_BatchResultList(head);
+        return NULL;
+    }
+    return head;
+}
+
+/* Takes ownership of @id.  */
+static void monitor_qmp_dispatch(Monitor *mon, const mon_cmd_t *cmd,
+                                 QDict *args, QObject *id)
+{
+    Error *local_err = NULL;
+    QObject *data = NULL;
+
+    if (!invalid_qmp_mode(mon, cmd, &local_err)) {
+        cmd->mhandler.cmd_new(args, &data, &local_err);
+    }
+
+    monitor_protocol_emitter(mon, data, local_err, id);
+    qobject_decref(data);
+    error_free(local_err);
+}
+
+/* Runs the requests an oob=on monitor queued, in order, under the BQL.  */
+static void monitor_qmp_bh(void *opaque)
+{
+    Monitor *old_mon = cur_mon;
+    Monitor *mon = opaque;
+    QMPRequest *req;
+
+    cur_mon = mon;
+    while (true) {
+        qemu_mutex_lock(&mon->qmp_queue_lock);
+        req = g_queue_pop_head(mon->qmp_requests);
+        qemu_mutex_unlock(&mon->qmp_queue_lock);
+        if (!req) {
+            break;
+        }
+
+        monitor_qmp_dispatch(mon, req->cmd, req->args, req->id);
+        QDECREF(req->args);
+        g_free(req);
+    }
+    cur_mon = old_mon;
+}
+
 static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
     Error *local_err = NULL;
-    QObject *obj, *data;
+    QObject *obj, *id = NULL, *data = NULL;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
+    Monitor *mon = container_of(parser, Monitor, qmp.parser);
+    bool oob;
 
     args = input = NULL;
-    data = NULL;
 
     obj = json_parser_parse(tokens, NULL);
     if (!obj) {
@@ -3947,10 +4199,11 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
         goto err_out;
     }
 
-    mon->qmp.id = qdict_get(input, "id");
-    qobject_incref(mon->qmp.id);
+    id = qdict_get(input, "id");
+    qobject_incref(id);
 
-    cmd_name = qdict_get_str(input, "execute");
+    oob = qdict_haskey(input, "exec-oob");
+    cmd_name = qdict_get_str(input, oob ? "exec-oob" : "execute");
     trace_handle_qmp_command(mon, cmd_name);
     cmd = qmp_find_cmd(cmd_name);
     if (!cmd) {
@@ -3958,9 +4211,6 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
                   "The command %s has not been found", cmd_name);
         goto err_out;
     }
-    if (invalid_qmp_mode(mon, cmd, &local_err)) {
-        goto err_out;
-    }
 
     obj = qdict_get(input, "arguments");
     if (!obj) {
@@ -3975,10 +4225,37 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
         goto err_out;
     }
 
-    cmd->mhandler.cmd_new(args, &data, &local_err);
+    if (oob) {
+        if (!(mon->flags & MONITOR_USE_OOB)) {
+            error_setg(&local_err, "Out-of-band execution needs a monitor "
+                       "with oob=on");
+        } else if (!cmd->oob) {
+            error_setg(&local_err, "The command %s cannot be executed out "
+                       "of band", cmd_name);
+        } else if (!invalid_qmp_mode(mon, cmd, &local_err)) {
+            qmp_snapshot_get(cmd, args, &data, &local_err);
+        }
+    } else if (mon->flags & MONITOR_USE_OOB) {
+        QMPRequest *req = g_new(QMPRequest, 1);
+
+        req->cmd = cmd;
+        req->args = args;
+        req->id = id;
+        qemu_mutex_lock(&mon->qmp_queue_lock);
+        g_queue_push_tail(mon->qmp_requests, req);
+        qemu_mutex_unlock(&mon->qmp_queue_lock);
+        qemu_bh_schedule(mon->qmp_bh);
+        QDECREF(input);
+        return;
+    } else {
+        monitor_qmp_dispatch(mon, cmd, args, id);
+        QDECREF(input);
+        QDECREF(args);
+        return;
+    }
 
 err_out:
-    monitor_protocol_emitter(mon, data, local_err);
+    monitor_protocol_emitter(mon, data, local_err, id);
     qobject_decref(data);
     error_free(local_err);
     QDECREF(input);
@@ -3988,6 +4265,13 @@ err_out:
 static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
 {
     Monitor *old_mon = cur_mon;
+    Monitor *mon = opaque;
+
+    if (mon->flags & MONITOR_USE_OOB) {
+        /* In the monitor thread, which must not touch cur_mon */
+        json_message_parser_feed(&mon->qmp.parser, (const char *) buf, size);
+        return;
+    }
 
     cur_mon = opaque;
 
@@ -4061,17 +4345,71 @@ static void monitor_qmp_event(void *opaque, int event)
         data = get_qmp_greeting();
         monitor_json_emitter(mon, data);
         qobject_decref(data);
-        mon_refcount++;
+        atomic_inc(&mon_refcount);
         break;
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
-        mon_refcount--;
-        monitor_fdsets_cleanup();
+        atomic_dec(&mon_refcount);
+        if (mon->flags & MONITOR_USE_OOB) {
+            /* Maybe in the monitor thread; fd sets need the BQL */
+            qemu_bh_schedule(mon->qmp_closed_bh);
+        } else {
+            monitor_fdsets_cleanup();
+        }
         break;
     }
 }
 
+static void monitor_qmp_closed_bh(void *opaque)
+{
+    monitor_fdsets_cleanup();
+}
+
+static void *monitor_oob_thread(void *opaque)
+{
+    Monitor *mon = opaque;
+
+    g_main_loop_run(mon->oob_loop);
+    return NULL;
+}
+
+static void monitor_oob_init(Monitor *mon)
+{
+    if (!qmp_snapshot_bh) {
+        qmp_snapshots = g_hash_table_new(g_str_hash, g_str_equal);
+        qmp_snapshot_bh = qemu_bh_new(qmp_snapshot_bh_cb, NULL);
+    }
+
+    qemu_mutex_init(&mon->qmp_queue_lock);
+    mon->qmp_requests = g_queue_new();
+    mon->qmp_bh = qemu_bh_new(monitor_qmp_bh, mon);
+    mon->qmp_closed_bh = qemu_bh_new(monitor_qmp_closed_bh, mon);
+    mon->oob_context = g_main_context_new();
+    mon->oob_loop = g_main_loop_new(mon->oob_context, FALSE);
+}
+
+static void monitor_oob_cleanup(Monitor *mon)
+{
+    QMPRequest *req;
+
+    g_main_loop_quit(mon->oob_loop);
+    qemu_thread_join(&mon->oob_thread);
+    qemu_chr_add_handlers(mon->chr, NULL, NULL, NULL, NULL);
+    g_main_loop_unref(mon->oob_loop);
+    g_main_context_unref(mon->oob_context);
+
+    while ((req = g_queue_pop_head(mon->qmp_requests))) {
+        QDECREF(req->args);
+        qobject_decref(req->id);
+        g_free(req);
+    }
+    g_queue_free(mon->qmp_requests);
+    qemu_bh_delete(mon->qmp_bh);
+    qemu_bh_delete(mon->qmp_closed_bh);
+    qemu_mutex_destroy(&mon->qmp_queue_lock);
+}
+
 static void monitor_event(void *opaque, int event)
 {
     Monitor *mon = opaque;
@@ -4113,11 +4451,11 @@ static void monitor_event(void *opaque, int event)
             readline_show_prompt(mon->rs);
         }
         mon->reset_seen = 1;
-        mon_refcount++;
+        atomic_inc(&mon_refcount);
         break;
 
     case CHR_EVENT_CLOSED:
-        mon_refcount--;
+        atomic_dec(&mon_refcount);
         monitor_fdsets_cleanup();
         break;
     }
@@ -4162,6 +4500,8 @@ static void monitor_readline_flush(void *opaque)
 static void __attribute__((constructor)) monitor_lock_init(void)
 {
     qemu_mutex_init(&monitor_lock);
+    qemu_mutex_init(&qmp_snapshot_lock);
+    qemu_cond_init(&qmp_snapshot_cond);
 }
 
 void monitor_init(CharDriverState *chr, int flags)
@@ -4188,7 +4528,15 @@ void monitor_init(CharDriverState *chr, int flags)
         monitor_read_command(mon, 0);
     }
 
-    if (monitor_is_qmp(mon)) {
+    if (monitor_is_qmp(mon) && (flags & MONITOR_USE_OOB)) {
+        monitor_oob_init(mon);
+        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        qemu_chr_fe_set_echo(chr, true);
+        qemu_chr_add_handlers_full(chr, monitor_can_read, monitor_qmp_read,
+                                   monitor_qmp_event, mon, mon->oob_context);
+        qemu_thread_create(&mon->oob_thread, "mon_oob", monitor_oob_thread,
+                           mon, QEMU_THREAD_JOINABLE);
+    } else if (monitor_is_qmp(mon)) {
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_qmp_read,
                               monitor_qmp_event, mon);
         qemu_chr_fe_set_echo(chr, true);
@@ -4210,6 +4558,9 @@ void monitor_cleanup(void)
     qemu_mutex_lock(&monitor_lock);
     QLIST_FOREACH_SAFE(mon, &mon_list, entry, next) {
         QLIST_REMOVE(mon, entry);
+        if (mon->flags & MONITOR_USE_OOB) {
+            monitor_oob_cleanup(mon);
+        }
         monitor_data_destroy(mon);
         g_free(mon);
     }
@@ -4301,6 +4652,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "oob",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -407,10 +407,80 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
     return QIO_CHANNEL(tioc);
 }
 
+/* Ask the server to use structured replies.  Return 1 if it agreed, 0 if
+ * it does not support them, or -1 with errp set on failure.
+ */
+static int nbd_receive_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t opt = cpu_to_be32(NBD_OPT_STRUCTURED_REPLY);
+    uint32_t length = 0;
+    uint32_t type;
+    int error;
+
+    TRACE("Requesting structured replies from server");
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -1;
+    }
+
+    if (write_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -1;
+    }
+
+    if (write_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "Failed to send option length");
+        return -1;
+    }
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "failed to read option magic");
+        return -1;
+    }
+    magic = be64_to_cpu(magic);
+    if (magic != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "failed to read option");
+        return -1;
+    }
+    opt = be32_to_cpu(opt);
+    if (opt != NBD_OPT_STRUCTURED_REPLY) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                   opt, NBD_OPT_STRUCTURED_REPLY);
+        return -1;
+    }
+
+    if (read_sync(ioc, &type, sizeof(type)) != sizeof(type)) {
+        error_setg(errp, "failed to read option type");
+        return -1;
+    }
+    type = be32_to_cpu(type);
+    error = nbd_handle_reply_err(ioc, NBD_OPT_STRUCTURED_REPLY, type, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (read_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    length = be32_to_cpu(length);
+    if (type != NBD_REP_ACK || length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " for structured "
+                   "replies", type);
+        return -1;
+    }
+
+    return 1;
+}
 
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
+                          QIOChannel **outioc, bool *structured_reply,
                           off_t *size, Error **errp)
 {
     char buf[256];
@@ -425,6 +495,9 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (structured_reply) {
+        *structured_reply = false;
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -515,6 +588,13 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (structured_reply) {
+                int ret = nbd_receive_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                *structured_reply = ret;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -736,27 +816,61 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The rest of the header may not have arrived yet, but we are
+         * committed to this reply now.
+         */
+        while ((ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                                sizeof(buf) - NBD_REPLY_SIZE)) == -EAGAIN) {
+            qio_channel_wait(ioc, G_IO_IN);
+        }
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got chunk: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+    reply->structured = false;
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
@@ -773,3 +887,121 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
     return 0;
 }
 
+static ssize_t drop_sync(QIOChannel *ioc, size_t size)
+{
+    uint8_t buffer[512];
+    ssize_t ret, dropped = size;
+
+    while (size > 0) {
+        ret = read_sync(ioc, buffer, MIN(sizeof(buffer), size));
+        if (ret <= 0) {
+            return ret < 0 ? ret : -EIO;
+        }
+        size -= ret;
+    }
+    return dropped;
+}
+
+/* Receive the payload of the structured reply chunk whose header is in
+ * @reply.  @from is the offset of the request and @qiov its read buffer, or
+ * NULL for requests that do not read data.  An error reported by the server
+ * is stored in reply->error.  Returns a negative errno if the chunk is not
+ * valid, in which case the connection is out of sync and must be dropped.
+ */
+ssize_t nbd_receive_reply_chunk(QIOChannel *ioc, struct nbd_reply *reply,
+                                uint64_t from, QEMUIOVector *qiov)
+{
+    uint8_t buf[8 + 4];
+    uint64_t offset;
+    uint32_t len, error;
+    uint16_t msglen;
+    QEMUIOVector sub_qiov;
+    ssize_t ret;
+
+    assert(reply->structured);
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (reply->length != 0 || !(reply->flags & NBD_REPLY_FLAG_DONE)) {
+            LOG("invalid NBD_REPLY_TYPE_NONE chunk");
+            return -EINVAL;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* [ 0 ..  7]    offset, followed by the data */
+        if (!qiov || reply->length < sizeof(offset)) {
+            LOG("unexpected NBD_REPLY_TYPE_OFFSET_DATA chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, sizeof(offset)) != sizeof(offset)) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = reply->length - sizeof(offset);
+        if (offset < from || len > qiov->size ||
+            offset - from > qiov->size - len) {
+            LOG("data chunk out of bounds");
+            return -EINVAL;
+        }
+
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - from, len);
+        ret = nbd_wr_syncv(ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* [ 0 ..  7]    offset
+           [ 8 .. 11]    size of the hole
+         */
+        if (!qiov || reply->length != 8 + 4) {
+            LOG("unexpected NBD_REPLY_TYPE_OFFSET_HOLE chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 8 + 4) != 8 + 4) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (offset < from || len > qiov->size ||
+            offset - from > qiov->size - len) {
+            LOG("hole chunk out of bounds");
+            return -EINVAL;
+        }
+
+        qemu_iovec_memset(qiov, offset - from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_ERROR:
+    case NBD_REPLY_TYPE_ERROR_OFFSET:
+        /* [ 0 ..  3]    error
+           [ 4 ..  5]    message length, followed by the message and, for
+                         NBD_REPLY_TYPE_ERROR_OFFSET, the offset
+         */
+        if (reply->length < 4 + 2) {
+            LOG("invalid error chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 4 + 2) != 4 + 2) {
+            return -EIO;
+        }
+        error = ldl_be_p(buf);
+        msglen = lduw_be_p(buf + 4);
+        if (msglen > reply->length - (4 + 2)) {
+            LOG("invalid error chunk");
+            return -EINVAL;
+        }
+        if (drop_sync(ioc, reply->length - (4 + 2)) < 0) {
+            return -EIO;
+        }
+
+        reply->error = error ? nbd_errno_to_system_errno(error) : EIO;
+        TRACE("Got error chunk: %" PRIu32, reply->error);
+        return 0;
+
+    default:
+        LOG("unknown chunk type %" PRIu16, reply->type);
+        return -EINVAL;
+    }
+}
@@ -90,6 +90,7 @@ struct NBDClient {
     Coroutine *send_coroutine;
 
     bool can_read;
+    bool structured_reply;
 
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
@@ -486,6 +487,26 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                if (length) {
+                    if (nbd_negotiate_drop_sync(client->ioc, length) !=
+                        length) {
+                        return -EIO;
+                    }
+                    ret = nbd_negotiate_send_rep(client->ioc,
+                                                 NBD_REP_ERR_INVALID,
+                                                 clientflags);
+                } else {
+                    TRACE("Using structured replies");
+                    client->structured_reply = true;
+                    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                                 clientflags);
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -970,6 +991,141 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send one chunk of a structured reply.  The chunk payload is @payload
+ * followed by @len bytes of @data.  Chunks of different requests may be
+ * interleaved, so the send lock is only held for a single chunk.
+ */
+static ssize_t nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, size_t payload_len,
+                                 void *data, size_t len)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    ssize_t rc;
+
+    TRACE("Sending chunk to client: { .flags = %" PRIx16 ", .type = %" PRIu16
+          ", handle = %" PRIu64 ", .length = %zu }",
+          flags, type, handle, payload_len + len);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, payload_len + len);
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    qio_channel_set_cork(client->ioc, true);
+    rc = write_sync(client->ioc, buf, sizeof(buf));
+    if (rc == sizeof(buf) && payload_len) {
+        rc = write_sync(client->ioc, payload, payload_len);
+        rc = rc == payload_len ? sizeof(buf) : -EIO;
+    }
+    if (rc == sizeof(buf) && len) {
+        rc = write_sync(client->ioc, data, len);
+        rc = rc == len ? sizeof(buf) : -EIO;
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc == sizeof(buf) ? 0 : -EIO;
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDClient *client, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* [ 0 ..  3]    error
+       [ 4 ..  5]    message length (no message)
+     */
+    stl_be_p(payload, system_errno_to_nbd_errno(error));
+    stw_be_p(payload + 4, 0);
+
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Answer a read with a structured reply.  Areas that read as zero are sent
+ * as holes, so they do not cross the wire; the rest is read into req->data
+ * and sent as data chunks.  Read errors are reported to the client; a
+ * negative return value means that the connection must be dropped.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint32_t done = 0;
+    ssize_t ret;
+
+    while (done < request->len) {
+        uint32_t len = request->len - done;
+        bool zero = false;
+        uint16_t flags;
+        uint8_t payload[8 + 4];
+
+        /* Block status is only available with sector granularity */
+        if (bs && QEMU_IS_ALIGNED(offset + done, BDRV_SECTOR_SIZE) &&
+            QEMU_IS_ALIGNED(len, BDRV_SECTOR_SIZE)) {
+            BlockDriverState *file;
+            int64_t status;
+            int pnum;
+
+            status = bdrv_get_block_status_above(bs, NULL,
+                                                 (offset + done) >>
+                                                 BDRV_SECTOR_BITS,
+                                                 len >> BDRV_SECTOR_BITS,
+                                                 &pnum, &file);
+            if (status >= 0 && pnum > 0) {
+                zero = status & BDRV_BLOCK_ZERO;
+                len = pnum << BDRV_SECTOR_BITS;
+            }
+        }
+
+        flags = done + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+        stq_be_p(payload, request->from + done);
+
+        if (zero) {
+            stl_be_p(payload + 8, len);
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, 8 + 4, NULL, 0);
+        } else {
+            ret = blk_pread(exp->blk, offset + done, req->data + done, len);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(client, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(client, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, req->data + done, len);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        done += len;
+    }
+
+    TRACE("Read %" PRIu32" byte(s)", request->len);
+    return 0;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1095,12 +1251,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (client->closing) {
         /*
@@ -1123,6 +1279,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1195,10 +1358,18 @@ static void nbd_trip(void *opaque)
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        /* Reads must be answered with a structured reply if the client
+         * asked for them.
+         */
+        if (client->structured_reply && command == NBD_CMD_READ) {
+            ret = nbd_co_send_error_chunk(client, reply.handle, reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -42,6 +42,17 @@ uint16_t net_checksum_finish(uint32_t sum)
     return ~sum;
 }
 
+uint16_t net_checksum_update32(uint16_t csum, uint32_t old, uint32_t new)
+{
+    /* HC' = ~(~HC + ~m + m'), one 16-bit word of the field at a time */
+    uint32_t sum = (uint16_t)~csum;
+
+    sum += (uint16_t)~old + (uint16_t)~(old >> 16);
+    sum += (new & 0xffff) + (new >> 16);
+
+    return net_checksum_finish(sum);
+}
+
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf)
 {
@@ -22,13 +22,21 @@
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
 #include "qemu/iov.h"
+#include "qemu/cutils.h"
 #include "qom/object.h"
 #include "qemu/typedefs.h"
 #include "net/queue.h"
 #include "sysemu/char.h"
 #include "qemu/sockets.h"
 #include "qapi-visit.h"
+#include "qemu/timed-average.h"
+#include "qemu/qdist.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/iothread.h"
+#include "qemu/main-loop.h"
 #include "net/colo.h"
+#include "net/colo-compare.h"
+#include "net/colo-ring.h"
 
 #define TYPE_COLO_COMPARE "colo-compare"
 #define COLO_COMPARE(obj) \
@@ -36,9 +44,26 @@
 
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
+#define MAX_COMPARE_WORKERS 64
+/* default number of bytes batched for outdev before writing them out */
+#define COMPARE_FLUSH_THRESHOLD_DEFAULT 65536
 
-/* TODO: Should be configurable */
+/* default for both the "compare_timeout" and "check_interval" properties */
 #define REGULAR_PACKET_CHECK_MS 3000
+/*
+ * With adaptive_timeout, a primary packet is old once it waited
+ * COMPARE_ADAPTIVE_FACTOR times longer than the slowest recent match,
+ * but never less than COMPARE_ADAPTIVE_MIN_MS or more than
+ * compare_timeout.
+ */
+#define COMPARE_ADAPTIVE_FACTOR 2
+#define COMPARE_ADAPTIVE_MIN_MS 10
+/* window over which the match latency is tracked */
+#define COMPARE_LATENCY_PERIOD (10 * NANOSECONDS_PER_SECOND)
+/* number of bins of the "stats_latency_histogram" property */
+#define COMPARE_LATENCY_HISTOGRAM_BINS 10
+/* default for the "checkpoint_min_interval" property */
+#define COMPARE_CHECKPOINT_MIN_INTERVAL_DEFAULT 100
 
 /*
   + CompareState ++
@@ -62,7 +87,69 @@
                     |packet  |  |packet  +    |packet  | |packet  +
                     +--------+  +--------+    +--------+ +--------+
 */
-typedef struct CompareState {
+typedef struct CompareState CompareState;
+
+/*
+ * Connections are sharded across workers by connection_key_hash(), so
+ * all packets of one connection are always compared by the same worker
+ * and keep their order.  Worker 0 runs in the compare thread that also
+ * reads the chardevs; the others run in their own thread and get their
+ * packets handed over through the pending queues.
+ */
+/*
+ * Statistics of one compare worker.  The worker updates them with
+ * stats_lock held, so that the property getters can read them from
+ * the main thread.
+ */
+typedef struct CompareStats {
+    /* primary packets released because the secondary sent the same */
+    uint64_t matched;
+    /* comparisons that found the primary and the secondary different */
+    uint64_t miscompared;
+    /* packets dropped because their connection's queue was full */
+    uint64_t dropped;
+    /* checkpoints asked for, coalesced or not */
+    uint64_t checkpoint_requests;
+    /* longest primary queue seen on a connection */
+    uint32_t max_queue_depth;
+    /* ms that released primary packets waited for the secondary */
+    struct qdist latency;
+} CompareStats;
+
+typedef struct CompareWorker {
+    CompareState *s;
+    int index;
+    QemuThread thread;
+    GMainContext *worker_context;
+    /* NULL for the worker running in the iothread */
+    GMainLoop *compare_loop;
+    /* the next scan for old packets */
+    GSource *check_source;
+
+    /* connection list: the connections sharded to this worker could be
+     * found in this list, linked through Connection::conn_link.
+     * element type: Connection
+     */
+    GQueue conn_list;
+    /* table to save connection */
+    ConnectionTable connection_track_table;
+    /* time in ms that matched primary packets waited for the secondary */
+    TimedAverage match_latency;
+
+    QemuMutex stats_lock;
+    CompareStats stats;
+
+    /* packets waiting for this worker, element type: Packet */
+    QemuMutex pending_lock;
+    GQueue pri_pending;
+    GQueue sec_pending;
+    bool pending_scheduled;
+
+    /* released primary packets waiting to be written to outdev */
+    GByteArray *out_batch;
+} CompareWorker;
+
+struct CompareState {
     Object parent;
 
     char *pri_indev;
@@ -73,20 +160,57 @@ typedef struct CompareState {
     CharDriverState *chr_out;
     SocketReadState pri_rs;
     SocketReadState sec_rs;
+    /* colo-ring ids used instead of the chardevs */
+    char *pri_inring;
+    char *sec_inring;
+    char *outring;
+    ColoRing *ring_pri_in;
+    ColoRing *ring_sec_in;
+    ColoRing *ring_out;
+    GSource *pri_ring_source;
+    GSource *sec_ring_source;
+
+    /* number of compare workers, set by the "workers" property */
+    uint32_t worker_count;
+    CompareWorker *workers;
+    /* runs worker 0, the one reading the inputs, instead of its thread */
+    IOThread *iothread;
+    /* our own reference, the link's is dropped before finalize */
+    IOThread *worker_iothread;
+    /* serializes packets written to chr_out by the workers */
+    QemuMutex out_lock;
+    /* batched output is written once it reaches this many bytes */
+    uint32_t flush_threshold;
+    /* ms after which a primary packet not matched yet is old */
+    uint32_t compare_timeout;
+    /* ms between two scans for old packets */
+    uint32_t check_interval;
+    /* connections tracked at most, shared among the workers */
+    uint32_t max_connections;
+    /* ms without packets after which a connection is forgotten, 0 for never */
+    uint32_t idle_timeout;
+    /* derive the timeout from the observed match latency */
+    bool adaptive_timeout;
+    /* compare TCP payload as a byte stream */
+    bool tcp_stream;
+
+    /* ms that must pass between two checkpoint notifications */
+    uint32_t checkpoint_min_interval;
+    /* set while a checkpoint request waits for checkpoint_bh */
+    bool checkpoint_pending;
+    /* requests coalesced into the pending one */
+    unsigned checkpoint_coalesced;
+    /* one of them was for a miscompare */
+    bool checkpoint_miscompare;
+    /* QEMU_CLOCK_REALTIME ms of the last checkpoint notification */
+    int64_t last_checkpoint_ms;
+    QEMUBH *checkpoint_bh;
+    /* delays a rate limited notification */
+    QEMUTimer *checkpoint_timer;
+};
 
-    /* connection list: the connections belonged to this NIC could be found
-     * in this list.
-     * element type: Connection
-     */
-    GQueue conn_list;
-    /* hashtable to save connection */
-    GHashTable *connection_track_table;
-    /* compare thread, a thread for each NIC */
-    QemuThread thread;
-    /* Timer used on the primary to find packets that are never matched */
-    QEMUTimer *timer;
-    QemuMutex timer_check_lock;
-} CompareState;
+static NotifierList colo_compare_notifiers =
+    NOTIFIER_LIST_INITIALIZER(colo_compare_notifiers);
 
 typedef struct CompareClass {
     ObjectClass parent_class;
@@ -101,67 +225,224 @@ enum {
     SECONDARY_IN,
 };
 
-static int compare_chr_send(CharDriverState *out,
+/* Maximum number of fields skipped by colo_packet_compare_masked() */
+#define COMPARE_MAX_SKIP 4
+
+/* A field allowed to differ, as offset and length into the packet */
+typedef struct CompareSkip {
+    int offset;
+    int len;
+} CompareSkip;
+
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size);
+static void compare_chr_queue(CompareWorker *w,
+                              const uint8_t *buf,
+                              uint32_t size);
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Locate the payload of a TCP segment for the byte stream compare.
+ * Return the payload size; 0 if the segment has none or is an IP
+ * fragment, which are compared packet by packet.
  */
-static int packet_enqueue(CompareState *s, int mode)
+static int packet_parse_tcp_payload(Packet *pkt)
 {
-    ConnectionKey key = {{0},};
-    Packet *pkt = NULL;
-    Connection *conn;
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint8_t *end = (uint8_t *)pkt->data + pkt->size;
+    uint8_t *ip_end = pkt->network_header + ntohs(pkt->ip->ip_len);
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf, s->pri_rs.packet_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf, s->sec_rs.packet_len);
+    if (ntohs(pkt->ip->ip_off) & (IP_MF | IP_OFFMASK)) {
+        return 0;
+    }
+    if (pkt->transport_header + sizeof(*tcp) > end) {
+        return 0;
+    }
+    /* leave out the ethernet padding */
+    if (ip_end < end) {
+        end = ip_end;
+    }
+    if (pkt->transport_header + tcp->th_off * 4 >= end) {
+        return 0;
     }
 
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
+    pkt->payload = pkt->transport_header + tcp->th_off * 4;
+    pkt->payload_size = end - pkt->payload;
+    pkt->seq = ntohl(tcp->th_seq);
+
+    return pkt->payload_size;
+}
+
+/* Called from the compare worker thread, like the stats helpers below */
+static void compare_stats_queue_depth(CompareWorker *w, uint32_t depth)
+{
+    /* only this worker writes the field, no need to lock for reading */
+    if (depth > w->stats.max_queue_depth) {
+        qemu_mutex_lock(&w->stats_lock);
+        w->stats.max_queue_depth = depth;
+        qemu_mutex_unlock(&w->stats_lock);
     }
-    fill_connection_key(pkt, &key);
+}
+
+static void compare_stats_dropped(CompareWorker *w)
+{
+    qemu_mutex_lock(&w->stats_lock);
+    w->stats.dropped++;
+    qemu_mutex_unlock(&w->stats_lock);
+}
+
+/*
+ * Account a primary packet released because the secondary agreed with
+ * it, just before it is destroyed.
+ */
+static void compare_stats_matched(CompareWorker *w, Packet *pkt)
+{
+    int64_t latency = qemu_clock_get_ms(QEMU_CLOCK_HOST) - pkt->creation_ms;
+
+    if (w->s->adaptive_timeout) {
+        timed_average_account(&w->match_latency, latency);
+    }
+
+    qemu_mutex_lock(&w->stats_lock);
+    w->stats.matched++;
+    qdist_inc(&w->stats.latency, latency);
+    qemu_mutex_unlock(&w->stats_lock);
+}
+
+/*
+ * Called from the worker owning the packet's connection.
+ * Queue the packet on its connection.
+ */
+static void packet_enqueue_conn(CompareWorker *w, Packet *pkt,
+                                ConnectionKey *key, int mode)
+{
+    Connection *conn;
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
+    conn = connection_get(&w->connection_track_table,
+                          key,
+                          &w->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail_link(&w->conn_list, &conn->conn_link);
         conn->processing = true;
     }
 
+    if (conn->ip_proto == IPPROTO_TCP) {
+        connection_track_tcp_flags(conn, pkt);
+    }
+
+    if (w->s->tcp_stream && conn->ip_proto == IPPROTO_TCP &&
+        packet_parse_tcp_payload(pkt)) {
+        GQueue *stream = mode == PRIMARY_IN ? &conn->primary_stream
+                                            : &conn->secondary_stream;
+
+        if (g_queue_get_length(stream) <= MAX_QUEUE_SIZE) {
+            packet_queue_insert_by_seq(stream, pkt);
+            if (mode == PRIMARY_IN) {
+                compare_stats_queue_depth(w, g_queue_get_length(stream));
+            }
+        } else {
+            error_report("colo compare %s stream too big, drop packet",
+                         mode == PRIMARY_IN ? "primary" : "secondary");
+            compare_stats_dropped(w);
+            packet_destroy(pkt, NULL);
+        }
+        return;
+    }
+
     if (mode == PRIMARY_IN) {
         if (g_queue_get_length(&conn->primary_list) <=
                                MAX_QUEUE_SIZE) {
             g_queue_push_tail(&conn->primary_list, pkt);
+            compare_stats_queue_depth(w,
+                                      g_queue_get_length(&conn->primary_list));
         } else {
             error_report("colo compare primary queue size too big,"
                          "drop packet");
+            compare_stats_dropped(w);
+            packet_destroy(pkt, NULL);
         }
     } else {
         if (g_queue_get_length(&conn->secondary_list) <=
                                MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->secondary_list, pkt);
+            connection_secondary_push(conn, pkt);
         } else {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
+            compare_stats_dropped(w);
+            packet_destroy(pkt, NULL);
         }
     }
+}
 
-    return 0;
+void colo_compare_register_notifier(Notifier *notify)
+{
+    notifier_list_add(&colo_compare_notifiers, notify);
+}
+
+void colo_compare_unregister_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+/*
+ * Called from the main loop, through checkpoint_bh or checkpoint_timer.
+ */
+static void colo_compare_checkpoint_notify(void *opaque)
+{
+    CompareState *s = opaque;
+    COLOCompareRequest req = { .compare = OBJECT(s) };
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t next = s->last_checkpoint_ms + s->checkpoint_min_interval;
+
+    if (s->last_checkpoint_ms && now < next) {
+        timer_mod(s->checkpoint_timer, next);
+        return;
+    }
+
+    /* requests made from now on need another checkpoint */
+    atomic_mb_set(&s->checkpoint_pending, false);
+    req.miscompare = atomic_xchg(&s->checkpoint_miscompare, false);
+    trace_colo_compare_checkpoint_notify(
+        atomic_xchg(&s->checkpoint_coalesced, 0));
+    s->last_checkpoint_ms = now;
+    notifier_list_notify(&colo_compare_notifiers, &req);
+}
+
+/*
+ * Called from any compare worker.
+ * Ask the notifiers for a checkpoint; cheap enough to be called for
+ * every miscompare since requests are coalesced until the main loop
+ * gets to them.
+ */
+static void colo_compare_request_checkpoint(CompareWorker *w,
+                                            bool miscompare)
+{
+    CompareState *s = w->s;
+
+    qemu_mutex_lock(&w->stats_lock);
+    w->stats.checkpoint_requests++;
+    if (miscompare) {
+        w->stats.miscompared++;
+    }
+    qemu_mutex_unlock(&w->stats_lock);
+
+    if (miscompare) {
+        /* before checkpoint_pending, so the pending request carries it */
+        atomic_mb_set(&s->checkpoint_miscompare, true);
+    }
+    if (atomic_xchg(&s->checkpoint_pending, true)) {
+        atomic_inc(&s->checkpoint_coalesced);
+        return;
+    }
+    qemu_bh_schedule(s->checkpoint_bh);
 }
 
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
- * TODO support ip fragment, Out-Of-Order
+ * TODO support ip fragment; out-of-order TCP is handled by
+ * colo_compare_tcp_stream()
  * return:    0  means packet same
  *            > 0 || < 0 means packet different
  */
@@ -179,6 +460,75 @@ static int colo_packet_compare(Packet *ppkt, Packet *spkt)
     }
 }
 
+/*
+ * Compare the packets from @offset to the end, ignoring the fields in
+ * @skip, which must be sorted by offset and not overlap.  Neither
+ * packet is modified.
+ * return:    0  means packet same
+ *            -1 means packet different
+ */
+static int colo_packet_compare_masked(Packet *ppkt, Packet *spkt, int offset,
+                                      const CompareSkip *skip, int nskip)
+{
+    const uint8_t *pdata = ppkt->data;
+    const uint8_t *sdata = spkt->data;
+    int i;
+
+    if (ppkt->size != spkt->size) {
+        return -1;
+    }
+
+    for (i = 0; i < nskip; i++) {
+        if (!buffer_is_equal(pdata + offset, sdata + offset,
+                             skip[i].offset - offset)) {
+            return -1;
+        }
+        offset = skip[i].offset + skip[i].len;
+    }
+
+    return buffer_is_equal(pdata + offset, sdata + offset,
+                           spkt->size - offset) ? 0 : -1;
+}
+
+/*
+ * Return the offset in the packet of the TCP timestamps option value,
+ * or -1 if there is none
+ */
+static int tcp_timestamp_offset(Packet *pkt)
+{
+    uint8_t *data = pkt->data;
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+    uint8_t *opt = pkt->transport_header + sizeof(struct tcphdr);
+    uint8_t *end;
+
+    if (opt > data + pkt->size) {
+        return -1;
+    }
+    end = pkt->transport_header + tcp->th_off * 4;
+    if (end > data + pkt->size) {
+        return -1;
+    }
+
+    while (opt < end) {
+        if (opt[0] == TCPOPT_EOL) {
+            break;
+        }
+        if (opt[0] == TCPOPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+            break;
+        }
+        if (opt[0] == TCPOPT_TIMESTAMP && opt[1] == TCPOLEN_TIMESTAMP) {
+            return opt + 2 - data;
+        }
+        opt += opt[1];
+    }
+
+    return -1;
+}
+
 /*
  * Called from the compare thread on the primary
  * for compare tcp packet
@@ -187,8 +537,12 @@ static int colo_packet_compare(Packet *ppkt, Packet *spkt)
 static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
 {
     struct tcphdr *ptcp, *stcp;
+    CompareSkip skip[COMPARE_MAX_SKIP];
+    int nskip = 0;
+    int ts_offset;
     int res;
     char *sdebug, *ddebug;
+    uint8_t *pdata = ppkt->data;
 
     trace_colo_compare_main("compare tcp");
     if (ppkt->size != spkt->size) {
@@ -198,6 +552,10 @@ static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
         return -1;
     }
 
+    if (ppkt->transport_header + sizeof(struct tcphdr) > pdata + ppkt->size) {
+        return colo_packet_compare(ppkt, spkt);
+    }
+
     ptcp = (struct tcphdr *)ppkt->transport_header;
     stcp = (struct tcphdr *)spkt->transport_header;
 
@@ -210,13 +568,26 @@ static int colo_packet_compare_tcp(Packet *spkt, Packet *ppkt)
      * somehow; but that would need some sync traffic to sync the state
      */
     if (ntohs(ppkt->ip->ip_off) & IP_DF) {
-        spkt->ip->ip_id = ppkt->ip->ip_id;
+        skip[nskip].offset = (uint8_t *)&ppkt->ip->ip_id - pdata;
+        skip[nskip++].len = sizeof(ppkt->ip->ip_id);
         /* and the sum will be different if the IDs were different */
-        spkt->ip->ip_sum = ppkt->ip->ip_sum;
+        skip[nskip].offset = (uint8_t *)&ppkt->ip->ip_sum - pdata;
+        skip[nskip++].len = sizeof(ppkt->ip->ip_sum);
     }
 
-    res = memcmp(ppkt->data + ETH_HLEN, spkt->data + ETH_HLEN,
-                (spkt->size - ETH_HLEN));
+    /*
+     * TCP timestamps come from each guest's own clock, so they differ
+     * too; the TCP checksum covers them and has to be ignored with them.
+     */
+    ts_offset = tcp_timestamp_offset(ppkt);
+    if (ts_offset >= 0 && ts_offset == tcp_timestamp_offset(spkt)) {
+        skip[nskip].offset = (uint8_t *)&ptcp->th_sum - pdata;
+        skip[nskip++].len = sizeof(ptcp->th_sum);
+        skip[nskip].offset = ts_offset;
+        skip[nskip++].len = TCPOLEN_TIMESTAMP - 2;
+    }
+
+    res = colo_packet_compare_masked(ppkt, spkt, ETH_HLEN, skip, nskip);
 
     if (res != 0 && trace_event_get_state(TRACE_COLO_COMPARE_MISCOMPARE)) {
         sdebug = strdup(inet_ntoa(ppkt->ip->ip_src));
@@ -319,21 +690,40 @@ static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
     }
 }
 
-static void colo_old_packet_check_one_conn(void *opaque,
-                                           void *user_data)
+/*
+ * Called from the compare worker thread.
+ * Return the age in ms after which an unmatched primary packet is old.
+ */
+static int64_t compare_worker_timeout(CompareWorker *w)
+{
+    CompareState *s = w->s;
+    int64_t timeout;
+
+    if (!s->adaptive_timeout) {
+        return s->compare_timeout;
+    }
+
+    timeout = timed_average_max(&w->match_latency) * COMPARE_ADAPTIVE_FACTOR;
+    timeout = MAX(timeout, COMPARE_ADAPTIVE_MIN_MS);
+    return MIN(timeout, s->compare_timeout);
+}
+
+/* Return true if @conn holds a primary packet older than @check_time */
+static bool colo_old_packet_check_one_conn(Connection *conn,
+                                           int64_t check_time)
 {
-    Connection *conn = opaque;
     GList *result = NULL;
-    int64_t check_time = REGULAR_PACKET_CHECK_MS;
 
     result = g_queue_find_custom(&conn->primary_list,
                                  &check_time,
                                  (GCompareFunc)colo_old_packet_check_one);
-
-    if (result) {
-        /* do checkpoint will flush old packet */
-        /* TODO: colo_notify_checkpoint();*/
+    if (!result) {
+        result = g_queue_find_custom(&conn->primary_stream,
+                                     &check_time,
+                                     (GCompareFunc)colo_old_packet_check_one);
     }
+
+    return result != NULL;
 }
 
 /*
@@ -343,54 +733,160 @@ static void colo_old_packet_check_one_conn(void *opaque,
  */
 static void colo_old_packet_check(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareWorker *w = opaque;
+    int64_t check_time = compare_worker_timeout(w);
+    GList *link;
+
+    for (link = w->conn_list.head; link; link = link->next) {
+        if (colo_old_packet_check_one_conn(link->data, check_time)) {
+            /* do checkpoint will flush old packet */
+            colo_compare_request_checkpoint(w, false);
+            break;
+        }
+    }
+}
+
+static void compare_worker_schedule_check(CompareWorker *w);
+
+/*
+ * Called from the compare worker thread.
+ * Check old packet regularly so it can watch for any packets
+ * that the secondary hasn't produced equivalents of.
+ */
+static gboolean check_old_packet_regular(gpointer opaque)
+{
+    CompareWorker *w = opaque;
+
+    /* Only when guest runs */
+    if (runstate_is_running()) {
+        /* if have old packet we will notify checkpoint */
+        colo_old_packet_check(w);
+    }
 
-    g_queue_foreach(&s->conn_list, colo_old_packet_check_one_conn, NULL);
+    g_source_unref(w->check_source);
+    compare_worker_schedule_check(w);
+    return G_SOURCE_REMOVE;
 }
 
 /*
- * Called from the compare thread on the primary
- * for compare connection
+ * Arm the next scan for old packets in the worker's context; with
+ * adaptive_timeout the scans happen as often as the timeout allows.
+ */
+static void compare_worker_schedule_check(CompareWorker *w)
+{
+    CompareState *s = w->s;
+    GSource *source;
+    int64_t interval;
+
+    if (s->adaptive_timeout) {
+        interval = compare_worker_timeout(w);
+    } else {
+        interval = s->check_interval;
+    }
+
+    source = g_timeout_source_new(interval);
+    g_source_set_callback(source, check_old_packet_regular, w, NULL);
+    g_source_attach(source, w->worker_context);
+    /* keep a reference, a worker in the iothread must destroy it */
+    w->check_source = source;
+}
+
+/*
+ * Called from the compare worker owning the connection.
+ * Compare the TCP payload of primary and secondary as a byte stream,
+ * independently of how each side segmented it.  A primary segment is
+ * released once all its bytes compared equal; segments that lie
+ * entirely before stream_seq are retransmissions and need no compare.
+ */
+static void colo_compare_tcp_stream(CompareWorker *w, Connection *conn)
+{
+    Packet *ppkt, *spkt;
+    tcp_seq pend, send;
+    int len;
+
+    if (!conn->stream_started) {
+        ppkt = g_queue_peek_head(&conn->primary_stream);
+        spkt = g_queue_peek_head(&conn->secondary_stream);
+        conn->stream_seq = SEQ_LT(ppkt->seq, spkt->seq) ? ppkt->seq
+                                                         : spkt->seq;
+        conn->stream_started = true;
+    }
+
+    while (!g_queue_is_empty(&conn->primary_stream) &&
+           !g_queue_is_empty(&conn->secondary_stream)) {
+        ppkt = g_queue_peek_head(&conn->primary_stream);
+        spkt = g_queue_peek_head(&conn->secondary_stream);
+        pend = ppkt->seq + ppkt->payload_size;
+        send = spkt->seq + spkt->payload_size;
+
+        if (SEQ_LEQ(send, conn->stream_seq)) {
+            g_queue_pop_head(&conn->secondary_stream);
+            packet_destroy(spkt, NULL);
+            continue;
+        }
+        if (SEQ_LEQ(pend, conn->stream_seq)) {
+            g_queue_pop_head(&conn->primary_stream);
+            compare_stats_matched(w, ppkt);
+            compare_chr_queue(w, ppkt->data, ppkt->size);
+            packet_destroy(ppkt, NULL);
+            continue;
+        }
+        if (SEQ_GT(ppkt->seq, conn->stream_seq) ||
+            SEQ_GT(spkt->seq, conn->stream_seq)) {
+            /* a segment is still missing on one side */
+            break;
+        }
+
+        len = (SEQ_LT(pend, send) ? pend : send) - conn->stream_seq;
+        if (!buffer_is_equal(ppkt->payload + (conn->stream_seq - ppkt->seq),
+                             spkt->payload + (conn->stream_seq - spkt->seq),
+                             len)) {
+            trace_colo_compare_main("tcp stream different");
+            colo_compare_request_checkpoint(w, true);
+            break;
+        }
+        conn->stream_seq += len;
+    }
+}
+
+/*
+ * Called from the compare worker owning the connection
+ * on the primary for compare connection
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareWorker *w = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
-    GList *result = NULL;
-    int ret;
+    Packet *result = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
-        qemu_mutex_lock(&s->timer_check_lock);
         pkt = g_queue_pop_tail(&conn->primary_list);
-        qemu_mutex_unlock(&s->timer_check_lock);
         switch (conn->ip_proto) {
         case IPPROTO_TCP:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_tcp);
+            result = connection_secondary_find(conn, pkt,
+                     (GCompareFunc)colo_packet_compare_tcp);
             break;
         case IPPROTO_UDP:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_udp);
+            result = connection_secondary_find(conn, pkt,
+                     (GCompareFunc)colo_packet_compare_udp);
             break;
         case IPPROTO_ICMP:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_icmp);
+            result = connection_secondary_find(conn, pkt,
+                     (GCompareFunc)colo_packet_compare_icmp);
             break;
         default:
-            result = g_queue_find_custom(&conn->secondary_list,
-                     pkt, (GCompareFunc)colo_packet_compare_other);
+            result = connection_secondary_find(conn, pkt,
+                     (GCompareFunc)colo_packet_compare_other);
             break;
         }
 
         if (result) {
-            ret = compare_chr_send(s->chr_out, pkt->data, pkt->size);
-            if (ret < 0) {
-                error_report("colo_send_primary_packet failed");
-            }
+            compare_stats_matched(w, pkt);
+            compare_chr_queue(w, pkt->data, pkt->size);
             trace_colo_compare_main("packet same and release packet");
-            g_queue_remove(&conn->secondary_list, result->data);
+            packet_destroy(result, NULL);
             packet_destroy(pkt, NULL);
         } else {
             /*
@@ -399,119 +895,368 @@ static void colo_compare_connection(void *opaque, void *user_data)
              * until next comparison.
              */
             trace_colo_compare_main("packet different");
-            qemu_mutex_lock(&s->timer_check_lock);
             g_queue_push_tail(&conn->primary_list, pkt);
-            qemu_mutex_unlock(&s->timer_check_lock);
-            /* TODO: colo_notify_checkpoint();*/
+            colo_compare_request_checkpoint(w, true);
             break;
         }
     }
+
+    if (!g_queue_is_empty(&conn->primary_stream) &&
+        !g_queue_is_empty(&conn->secondary_stream)) {
+        colo_compare_tcp_stream(w, conn);
+    }
 }
 
-static int compare_chr_send(CharDriverState *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size)
 {
     int ret = 0;
     uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = (void *)buf, .iov_len = size },
+    };
 
     if (!size) {
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
+    if (s->ring_out) {
+        qemu_mutex_lock(&s->out_lock);
+        ret = colo_ring_write(s->ring_out, buf, size);
+        qemu_mutex_unlock(&s->out_lock);
+        return ret;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)buf, size);
-    if (ret != size) {
-        goto err;
+    /* the length header and the payload must not interleave */
+    qemu_mutex_lock(&s->out_lock);
+    ret = qemu_chr_fe_writev_all(s->chr_out, iov, ARRAY_SIZE(iov));
+    qemu_mutex_unlock(&s->out_lock);
+    if (ret != sizeof(len) + size) {
+        return ret < 0 ? ret : -EIO;
     }
 
     return 0;
-
-err:
-    return ret < 0 ? ret : -EIO;
-}
-
-static int compare_chr_can_read(void *opaque)
-{
-    return COMPARE_READ_LEN_MAX;
 }
 
 /*
- * Called from the main thread on the primary for packets
- * arriving over the socket from the primary.
+ * Write the packets of @batch to the outdev ring one by one, taking
+ * out_lock only once.
  */
-static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
+static int compare_ring_flush(CompareState *s, GByteArray *batch)
 {
-    CompareState *s = COLO_COMPARE(opaque);
-    int ret;
+    uint32_t off = 0, len;
+    int ret = 0;
 
-    ret = net_fill_rstate(&s->pri_rs, buf, size);
-    if (ret == -1) {
-        qemu_chr_add_handlers(s->chr_pri_in, NULL, NULL, NULL, NULL);
-        error_report("colo-compare primary_in error");
+    qemu_mutex_lock(&s->out_lock);
+    while (off < batch->len) {
+        len = ldl_be_p(batch->data + off);
+        off += sizeof(len);
+        if (colo_ring_write(s->ring_out, batch->data + off, len) < 0) {
+            ret = -ENOBUFS;
+        }
+        off += len;
     }
+    qemu_mutex_unlock(&s->out_lock);
+
+    return ret;
 }
 
 /*
- * Called from the main thread on the primary for packets
- * arriving over the socket from the secondary.
+ * Write all packets batched by the worker to outdev at once.
  */
-static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
+static int compare_chr_flush(CompareWorker *w)
 {
-    CompareState *s = COLO_COMPARE(opaque);
+    CompareState *s = w->s;
     int ret;
 
-    ret = net_fill_rstate(&s->sec_rs, buf, size);
-    if (ret == -1) {
-        qemu_chr_add_handlers(s->chr_sec_in, NULL, NULL, NULL, NULL);
-        error_report("colo-compare secondary_in error");
+    if (!w->out_batch->len) {
+        return 0;
     }
-}
 
-static void *colo_compare_thread(void *opaque)
-{
-    GMainContext *worker_context;
-    GMainLoop *compare_loop;
-    CompareState *s = opaque;
-
-    worker_context = g_main_context_new();
-
-    qemu_chr_add_handlers_full(s->chr_pri_in, compare_chr_can_read,
-                          compare_pri_chr_in, NULL, s, worker_context);
-    qemu_chr_add_handlers_full(s->chr_sec_in, compare_chr_can_read,
-                          compare_sec_chr_in, NULL, s, worker_context);
+    if (s->ring_out) {
+        ret = compare_ring_flush(s, w->out_batch);
+        g_byte_array_set_size(w->out_batch, 0);
+        return ret;
+    }
 
-    compare_loop = g_main_loop_new(worker_context, FALSE);
+    qemu_mutex_lock(&s->out_lock);
+    ret = qemu_chr_fe_write_all(s->chr_out, w->out_batch->data,
+                                w->out_batch->len);
+    qemu_mutex_unlock(&s->out_lock);
 
-    g_main_loop_run(compare_loop);
+    if (ret != w->out_batch->len) {
+        ret = ret < 0 ? ret : -EIO;
+    } else {
+        ret = 0;
+    }
+    g_byte_array_set_size(w->out_batch, 0);
 
-    g_main_loop_unref(compare_loop);
-    g_main_context_unref(worker_context);
-    return NULL;
+    return ret;
 }
 
-static char *compare_get_pri_indev(Object *obj, Error **errp)
+/*
+ * Batch a released packet for outdev, in the same format as
+ * compare_chr_send().  The batch is written when it crosses
+ * flush_threshold, or at the latest by colo_compare_all().
+ */
+static void compare_chr_queue(CompareWorker *w,
+                              const uint8_t *buf,
+                              uint32_t size)
 {
-    CompareState *s = COLO_COMPARE(obj);
+    uint32_t len = htonl(size);
 
-    return g_strdup(s->pri_indev);
-}
+    if (!size) {
+        return;
+    }
 
-static void compare_set_pri_indev(Object *obj, const char *value, Error **errp)
-{
-    CompareState *s = COLO_COMPARE(obj);
+    g_byte_array_append(w->out_batch, (uint8_t *)&len, sizeof(len));
+    g_byte_array_append(w->out_batch, buf, size);
 
-    g_free(s->pri_indev);
-    s->pri_indev = g_strdup(value);
+    if (w->out_batch->len >= w->s->flush_threshold &&
+        compare_chr_flush(w) < 0) {
+        error_report("colo_send_primary_packet failed");
+    }
 }
 
-static char *compare_get_sec_indev(Object *obj, Error **errp)
+/*
+ * Compare all connections of the worker and write out the packets
+ * released by this pass.
+ */
+static void colo_compare_all(CompareWorker *w)
 {
-    CompareState *s = COLO_COMPARE(obj);
+    /* compare connection */
+    g_queue_foreach(&w->conn_list, colo_compare_connection, w);
+
+    if (compare_chr_flush(w) < 0) {
+        error_report("colo_send_primary_packet failed");
+    }
+}
+
+/*
+ * Called from a compare worker thread for the packets that the
+ * compare thread handed over with compare_worker_push().
+ */
+static gboolean compare_worker_drain(gpointer opaque)
+{
+    CompareWorker *w = opaque;
+    ConnectionKey key;
+    GQueue pri, sec;
+    Packet *pkt;
+
+    qemu_mutex_lock(&w->pending_lock);
+    pri = w->pri_pending;
+    sec = w->sec_pending;
+    g_queue_init(&w->pri_pending);
+    g_queue_init(&w->sec_pending);
+    w->pending_scheduled = false;
+    qemu_mutex_unlock(&w->pending_lock);
+
+    while ((pkt = g_queue_pop_head(&pri))) {
+        memset(&key, 0, sizeof(key));
+        fill_connection_key(pkt, &key);
+        packet_enqueue_conn(w, pkt, &key, PRIMARY_IN);
+    }
+    while ((pkt = g_queue_pop_head(&sec))) {
+        memset(&key, 0, sizeof(key));
+        fill_connection_key(pkt, &key);
+        packet_enqueue_conn(w, pkt, &key, SECONDARY_IN);
+    }
+
+    colo_compare_all(w);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Called from the compare thread on the primary.
+ * Hand a packet over to a worker running in another thread; the worker
+ * is only woken up once for all packets queued before it runs.
+ */
+static void compare_worker_push(CompareWorker *w, Packet *pkt, int mode)
+{
+    GSource *source;
+    bool kick;
+
+    qemu_mutex_lock(&w->pending_lock);
+    if (mode == PRIMARY_IN) {
+        g_queue_push_tail(&w->pri_pending, pkt);
+    } else {
+        g_queue_push_tail(&w->sec_pending, pkt);
+    }
+    kick = !w->pending_scheduled;
+    w->pending_scheduled = true;
+    qemu_mutex_unlock(&w->pending_lock);
+
+    if (kick) {
+        source = g_idle_source_new();
+        g_source_set_callback(source, compare_worker_drain, w, NULL);
+        g_source_attach(source, w->worker_context);
+        g_source_unref(source);
+    }
+}
+
+/*
+ * Called from the compare thread on the primary.
+ * Return 0 on success, if return -1 means the pkt
+ * is unsupported(arp and ipv6) and will be sent later;
+ * the caller still owns the pkt in that case.
+ */
+static int packet_enqueue(CompareState *s, Packet *pkt, int mode)
+{
+    ConnectionKey key = {{0},};
+    CompareWorker *w;
+
+    if (parse_packet_early(pkt)) {
+        return -1;
+    }
+    fill_connection_key(pkt, &key);
+    pkt->match_hash = packet_match_hash(pkt);
+
+    w = &s->workers[connection_key_hash(&key) % s->worker_count];
+    if (w->index == 0) {
+        packet_enqueue_conn(w, pkt, &key, mode);
+        colo_compare_all(w);
+    } else {
+        compare_worker_push(w, pkt, mode);
+    }
+
+    return 0;
+}
+
+static int compare_chr_can_read(void *opaque)
+{
+    return COMPARE_READ_LEN_MAX;
+}
+
+/*
+ * Called from the main thread on the primary for packets
+ * arriving over the socket from the primary.
+ */
+static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
+{
+    CompareState *s = COLO_COMPARE(opaque);
+    int ret;
+
+    ret = net_fill_rstate(&s->pri_rs, buf, size);
+    if (ret == -1) {
+        qemu_chr_add_handlers(s->chr_pri_in, NULL, NULL, NULL, NULL);
+        error_report("colo-compare primary_in error");
+    }
+}
+
+/*
+ * Called from the main thread on the primary for packets
+ * arriving over the socket from the secondary.
+ */
+static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
+{
+    CompareState *s = COLO_COMPARE(opaque);
+    int ret;
+
+    ret = net_fill_rstate(&s->sec_rs, buf, size);
+    if (ret == -1) {
+        qemu_chr_add_handlers(s->chr_sec_in, NULL, NULL, NULL, NULL);
+        error_report("colo-compare secondary_in error");
+    }
+}
+
+/*
+ * Attach the sources of worker @w to its context; called from the
+ * worker's thread, or from the main thread for a worker in the iothread.
+ */
+static void compare_worker_start(CompareWorker *w)
+{
+    CompareState *s = w->s;
+
+    /* worker 0 also reads the packets for all the other workers */
+    if (w->index == 0 && s->chr_pri_in) {
+        qemu_chr_add_handlers_full(s->chr_pri_in, compare_chr_can_read,
+                                   compare_pri_chr_in, NULL, s,
+                                   w->worker_context);
+    }
+    if (w->index == 0 && s->chr_sec_in) {
+        qemu_chr_add_handlers_full(s->chr_sec_in, compare_chr_can_read,
+                                   compare_sec_chr_in, NULL, s,
+                                   w->worker_context);
+    }
+    if (w->index == 0 && s->ring_pri_in) {
+        s->pri_ring_source = colo_ring_source_new(s->ring_pri_in,
+                                                  compare_pri_ring_read, s);
+        g_source_attach(s->pri_ring_source, w->worker_context);
+    }
+    if (w->index == 0 && s->ring_sec_in) {
+        s->sec_ring_source = colo_ring_source_new(s->ring_sec_in,
+                                                  compare_sec_ring_read, s);
+        g_source_attach(s->sec_ring_source, w->worker_context);
+    }
+
+    /* A regular scan to kick any packets that the secondary doesn't match */
+    compare_worker_schedule_check(w);
+}
+
+static void *colo_compare_thread(void *opaque)
+{
+    CompareWorker *w = opaque;
+
+    compare_worker_start(w);
+    g_main_loop_run(w->compare_loop);
+
+    return NULL;
+}
+
+/*
+ * Called from the main thread.  Detach the sources of the worker running
+ * in the iothread; holding its AioContext keeps their callbacks from
+ * running meanwhile.
+ */
+static void compare_iothread_stop(CompareState *s)
+{
+    AioContext *ctx = iothread_get_aio_context(s->worker_iothread);
+    CompareWorker *w = &s->workers[0];
+
+    aio_context_acquire(ctx);
+    if (s->chr_pri_in) {
+        qemu_chr_add_handlers(s->chr_pri_in, NULL, NULL, NULL, NULL);
+    }
+    if (s->chr_sec_in) {
+        qemu_chr_add_handlers(s->chr_sec_in, NULL, NULL, NULL, NULL);
+    }
+    if (s->pri_ring_source) {
+        g_source_destroy(s->pri_ring_source);
+        g_source_unref(s->pri_ring_source);
+        s->pri_ring_source = NULL;
+    }
+    if (s->sec_ring_source) {
+        g_source_destroy(s->sec_ring_source);
+        g_source_unref(s->sec_ring_source);
+        s->sec_ring_source = NULL;
+    }
+    g_source_destroy(w->check_source);
+    g_source_unref(w->check_source);
+    w->check_source = NULL;
+    aio_context_release(ctx);
+}
+
+static char *compare_get_pri_indev(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return g_strdup(s->pri_indev);
+}
+
+static void compare_set_pri_indev(Object *obj, const char *value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    g_free(s->pri_indev);
+    s->pri_indev = g_strdup(value);
+}
+
+static char *compare_get_sec_indev(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
 
     return g_strdup(s->sec_indev);
 }
@@ -539,29 +1284,107 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
     s->outdev = g_strdup(value);
 }
 
-static void compare_pri_rs_finalize(SocketReadState *pri_rs)
+static char *compare_get_pri_inring(Object *obj, Error **errp)
 {
-    CompareState *s = container_of(pri_rs, CompareState, pri_rs);
+    CompareState *s = COLO_COMPARE(obj);
+
+    return g_strdup(s->pri_inring);
+}
+
+static void compare_set_pri_inring(Object *obj, const char *value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    g_free(s->pri_inring);
+    s->pri_inring = g_strdup(value);
+}
 
-    if (packet_enqueue(s, PRIMARY_IN)) {
+static char *compare_get_sec_inring(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return g_strdup(s->sec_inring);
+}
+
+static void compare_set_sec_inring(Object *obj, const char *value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    g_free(s->sec_inring);
+    s->sec_inring = g_strdup(value);
+}
+
+static char *compare_get_outring(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return g_strdup(s->outring);
+}
+
+static void compare_set_outring(Object *obj, const char *value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    g_free(s->outring);
+    s->outring = g_strdup(value);
+}
+
+/*
+ * Packets are reassembled straight into packet buffers, which are then
+ * handed over to the Packet without copying.
+ */
+static uint8_t *compare_rs_alloc(SocketReadState *rs, uint32_t len)
+{
+    return packet_buf_alloc(len);
+}
+
+static void compare_pri_packet_in(CompareState *s, Packet *pkt)
+{
+    if (packet_enqueue(s, pkt, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(s->chr_out, pri_rs->buf, pri_rs->packet_len);
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        compare_chr_send(s, pkt->data, pkt->size);
+        packet_destroy(pkt, NULL);
     }
 }
 
+static void compare_sec_packet_in(CompareState *s, Packet *pkt)
+{
+    if (packet_enqueue(s, pkt, SECONDARY_IN)) {
+        trace_colo_compare_main("secondary: unsupported packet in");
+        packet_destroy(pkt, NULL);
+    }
+}
+
+static void compare_pri_rs_finalize(SocketReadState *pri_rs)
+{
+    CompareState *s = container_of(pri_rs, CompareState, pri_rs);
+
+    compare_pri_packet_in(s, packet_new_nocopy(pri_rs->data,
+                                               pri_rs->packet_len));
+}
+
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
 
-    if (packet_enqueue(s, SECONDARY_IN)) {
-        trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
-    }
+    compare_sec_packet_in(s, packet_new_nocopy(sec_rs->data,
+                                               sec_rs->packet_len));
+}
+
+/*
+ * Called from the compare thread.  Frames may wait a long time for
+ * their counterpart, so they are copied out of the ring right away.
+ */
+static void compare_pri_ring_read(void *opaque, const uint8_t *buf,
+                                  uint32_t size)
+{
+    compare_pri_packet_in(opaque, packet_new(buf, size));
+}
+
+static void compare_sec_ring_read(void *opaque, const uint8_t *buf,
+                                  uint32_t size)
+{
+    compare_sec_packet_in(opaque, packet_new(buf, size));
 }
 
 static int compare_chardev_opts(void *opaque,
@@ -618,88 +1441,178 @@ static int find_and_check_chardev(CharDriverState **chr,
     return 0;
 }
 
+static void compare_worker_init(CompareState *s, CompareWorker *w, int index)
+{
+    w->s = s;
+    w->index = index;
+    g_queue_init(&w->conn_list);
+    /* each worker tracks its share of the connections */
+    connection_table_init(&w->connection_track_table,
+                          DIV_ROUND_UP(s->max_connections, s->worker_count),
+                          s->idle_timeout);
+    timed_average_init(&w->match_latency, QEMU_CLOCK_REALTIME,
+                       COMPARE_LATENCY_PERIOD);
+    qemu_mutex_init(&w->stats_lock);
+    memset(&w->stats, 0, sizeof(w->stats));
+    qdist_init(&w->stats.latency);
+    qemu_mutex_init(&w->pending_lock);
+    g_queue_init(&w->pri_pending);
+    g_queue_init(&w->sec_pending);
+    w->pending_scheduled = false;
+    w->out_batch = g_byte_array_new();
+    if (index == 0 && s->worker_iothread) {
+        w->worker_context = iothread_get_g_main_context(s->worker_iothread);
+        g_main_context_ref(w->worker_context);
+    } else {
+        w->worker_context = g_main_context_new();
+        w->compare_loop = g_main_loop_new(w->worker_context, FALSE);
+    }
+}
+
 /*
- * Check old packet regularly so it can watch for any packets
- * that the secondary hasn't produced equivalents of.
+ * Called from the main thread once the worker's thread has exited.
  */
-static void check_old_packet_regular(void *opaque)
+static void compare_worker_cleanup(CompareWorker *w)
 {
-    CompareState *s = opaque;
-
-    timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
-              REGULAR_PACKET_CHECK_MS);
-    /* if have old packet we will notify checkpoint */
-    /*
-     * TODO: Make timer handler run in compare thread
-     * like qemu_chr_add_handlers_full.
-     */
-    qemu_mutex_lock(&s->timer_check_lock);
-    colo_old_packet_check(s);
-    qemu_mutex_unlock(&s->timer_check_lock);
+    g_queue_foreach(&w->pri_pending, packet_destroy, NULL);
+    g_queue_clear(&w->pri_pending);
+    g_queue_foreach(&w->sec_pending, packet_destroy, NULL);
+    g_queue_clear(&w->sec_pending);
+    connection_table_destroy(&w->connection_track_table);
+    g_queue_init(&w->conn_list);
+    g_byte_array_free(w->out_batch, TRUE);
+    if (w->check_source) {
+        g_source_destroy(w->check_source);
+        g_source_unref(w->check_source);
+    }
+    if (w->compare_loop) {
+        g_main_loop_unref(w->compare_loop);
+    }
+    g_main_context_unref(w->worker_context);
+    qemu_mutex_destroy(&w->pending_lock);
+    qdist_destroy(&w->stats.latency);
+    qemu_mutex_destroy(&w->stats_lock);
 }
 
 /*
  * Called from the main thread on the primary
  * to setup colo-compare.
  */
+static bool compare_same_name(const char *a, const char *b)
+{
+    return a && b && !strcmp(a, b);
+}
+
 static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     char thread_name[64];
     static int compare_id;
+    int i;
 
-    if (!s->pri_indev || !s->sec_indev || !s->outdev) {
+    if (!s->pri_indev == !s->pri_inring ||
+        !s->sec_indev == !s->sec_inring ||
+        !s->outdev == !s->outring) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
-                   "'secondary_in','outdev' property set");
+                   "'secondary_in','outdev' property set, or the "
+                   "matching colo-ring properties instead");
         return;
-    } else if (!strcmp(s->pri_indev, s->outdev) ||
-               !strcmp(s->sec_indev, s->outdev) ||
-               !strcmp(s->pri_indev, s->sec_indev)) {
+    } else if (compare_same_name(s->pri_indev, s->outdev) ||
+               compare_same_name(s->sec_indev, s->outdev) ||
+               compare_same_name(s->pri_indev, s->sec_indev) ||
+               compare_same_name(s->pri_inring, s->outring) ||
+               compare_same_name(s->sec_inring, s->outring) ||
+               compare_same_name(s->pri_inring, s->sec_inring)) {
         error_setg(errp, "'indev' and 'outdev' could not be same "
                    "for compare module");
         return;
     }
 
-    if (find_and_check_chardev(&s->chr_pri_in, s->pri_indev, errp)) {
+    if (s->pri_indev &&
+        find_and_check_chardev(&s->chr_pri_in, s->pri_indev, errp)) {
         return;
     }
 
-    if (find_and_check_chardev(&s->chr_sec_in, s->sec_indev, errp)) {
+    if (s->sec_indev &&
+        find_and_check_chardev(&s->chr_sec_in, s->sec_indev, errp)) {
         return;
     }
 
-    if (find_and_check_chardev(&s->chr_out, s->outdev, errp)) {
+    if (s->outdev &&
+        find_and_check_chardev(&s->chr_out, s->outdev, errp)) {
         return;
     }
 
-    qemu_chr_fe_claim_no_fail(s->chr_pri_in);
-
-    qemu_chr_fe_claim_no_fail(s->chr_sec_in);
+    /* rings claimed before a failure are released by finalize */
+    if (s->pri_inring) {
+        s->ring_pri_in = colo_ring_claim(s->pri_inring, false, errp);
+        if (!s->ring_pri_in) {
+            return;
+        }
+    }
+    if (s->sec_inring) {
+        s->ring_sec_in = colo_ring_claim(s->sec_inring, false, errp);
+        if (!s->ring_sec_in) {
+            return;
+        }
+    }
+    if (s->outring) {
+        s->ring_out = colo_ring_claim(s->outring, true, errp);
+        if (!s->ring_out) {
+            return;
+        }
+    }
 
-    qemu_chr_fe_claim_no_fail(s->chr_out);
+    if (s->chr_pri_in) {
+        qemu_chr_fe_claim_no_fail(s->chr_pri_in);
+    }
+    if (s->chr_sec_in) {
+        qemu_chr_fe_claim_no_fail(s->chr_sec_in);
+    }
+    if (s->chr_out) {
+        qemu_chr_fe_claim_no_fail(s->chr_out);
+    }
 
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize);
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize);
+    s->pri_rs.alloc = compare_rs_alloc;
+    s->sec_rs.alloc = compare_rs_alloc;
 
-    g_queue_init(&s->conn_list);
-    qemu_mutex_init(&s->timer_check_lock);
+    qemu_mutex_init(&s->out_lock);
+    s->checkpoint_bh = qemu_bh_new(colo_compare_checkpoint_notify, s);
+    s->checkpoint_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                       colo_compare_checkpoint_notify, s);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    if (s->iothread) {
+        s->worker_iothread = s->iothread;
+        object_ref(OBJECT(s->worker_iothread));
+    }
+    s->workers = g_new0(CompareWorker, s->worker_count);
+    for (i = 0; i < s->worker_count; i++) {
+        compare_worker_init(s, &s->workers[i], i);
+    }
 
-    sprintf(thread_name, "colo-compare %d", compare_id);
-    qemu_thread_create(&s->thread, thread_name,
-                       colo_compare_thread, s,
-                       QEMU_THREAD_JOINABLE);
-    compare_id++;
+    for (i = 0; i < s->worker_count; i++) {
+        if (i == 0 && s->worker_iothread) {
+            AioContext *ctx = iothread_get_aio_context(s->worker_iothread);
 
-    /* A regular timer to kick any packets that the secondary doesn't match */
-    s->timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, /* Only when guest runs */
-                            check_old_packet_regular, s);
-    timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
-                        REGULAR_PACKET_CHECK_MS);
+            aio_context_acquire(ctx);
+            compare_worker_start(&s->workers[0]);
+            aio_context_release(ctx);
+            continue;
+        }
+        if (i == 0) {
+            snprintf(thread_name, sizeof(thread_name),
+                     "colo-compare %d", compare_id);
+        } else {
+            snprintf(thread_name, sizeof(thread_name),
+                     "colo-compare %d/%d", compare_id, i);
+        }
+        qemu_thread_create(&s->workers[i].thread, thread_name,
+                           colo_compare_thread, &s->workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    compare_id++;
 
     return;
 }
@@ -711,8 +1624,339 @@ static void colo_compare_class_init(ObjectClass *oc, void *data)
     ucc->complete = colo_compare_complete;
 }
 
+static void compare_get_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->worker_count;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->workers) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    if (!value || value > MAX_COMPARE_WORKERS) {
+        error_setg(&local_err, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_WORKERS);
+        goto out;
+    }
+    s->worker_count = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void compare_get_flush_threshold(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->flush_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_flush_threshold(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    s->flush_threshold = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+/* getter/setter for the millisecond properties, opaque is the field */
+static void compare_get_ms(Object *obj, Visitor *v,
+                           const char *name, void *opaque,
+                           Error **errp)
+{
+    uint32_t value = *(uint32_t *)opaque;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_ms(Object *obj, Visitor *v,
+                           const char *name, void *opaque,
+                           Error **errp)
+{
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    *(uint32_t *)opaque = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void compare_get_max_connections(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->max_connections;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_max_connections(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->workers) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    s->max_connections = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void compare_get_idle_timeout(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->idle_timeout;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_idle_timeout(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->workers) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    s->idle_timeout = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+/*
+ * Getter for the connection counters, summed over the workers;
+ * opaque is the offset of the counter in ConnectionTable.  The
+ * workers update the counters without locking, so the value is
+ * only a snapshot.
+ */
+static void compare_get_conn_counter(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    size_t offset = (uintptr_t)opaque;
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; s->workers && i < s->worker_count; i++) {
+        ConnectionTable *t = &s->workers[i].connection_track_table;
+
+        value += *(uint64_t *)((uint8_t *)t + offset);
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+/* Getter for the CompareStats counters; opaque is the counter's offset */
+static void compare_get_stats_counter(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    size_t offset = (uintptr_t)opaque;
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; s->workers && i < s->worker_count; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->stats_lock);
+        value += *(uint64_t *)((uint8_t *)&w->stats + offset);
+        qemu_mutex_unlock(&w->stats_lock);
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void compare_get_max_queue_depth(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = 0;
+    int i;
+
+    for (i = 0; s->workers && i < s->worker_count; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->stats_lock);
+        value = MAX(value, w->stats.max_queue_depth);
+        qemu_mutex_unlock(&w->stats_lock);
+    }
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+/* Merge the release latencies of all workers into @dist */
+static void compare_stats_latency(CompareState *s, struct qdist *dist)
+{
+    size_t j;
+    int i;
+
+    qdist_init(dist);
+    for (i = 0; s->workers && i < s->worker_count; i++) {
+        CompareWorker *w = &s->workers[i];
+
+        qemu_mutex_lock(&w->stats_lock);
+        for (j = 0; j < w->stats.latency.n; j++) {
+            qdist_add(dist, w->stats.latency.entries[j].x,
+                      w->stats.latency.entries[j].count);
+        }
+        qemu_mutex_unlock(&w->stats_lock);
+    }
+}
+
+static void compare_get_latency_avg(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    struct qdist dist;
+    double value;
+
+    compare_stats_latency(COLO_COMPARE(obj), &dist);
+    value = qdist_sample_count(&dist) ? qdist_avg(&dist) : 0;
+    qdist_destroy(&dist);
+
+    visit_type_number(v, name, &value, errp);
+}
+
+static void compare_get_latency_max(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    struct qdist dist;
+    uint64_t value;
+
+    compare_stats_latency(COLO_COMPARE(obj), &dist);
+    value = qdist_sample_count(&dist) ? qdist_xmax(&dist) : 0;
+    qdist_destroy(&dist);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static char *compare_get_latency_histogram(Object *obj, Error **errp)
+{
+    struct qdist dist;
+    char *str;
+
+    compare_stats_latency(COLO_COMPARE(obj), &dist);
+    str = qdist_pr(&dist, COMPARE_LATENCY_HISTOGRAM_BINS,
+                   QDIST_PR_LABELS | QDIST_PR_NODECIMAL);
+    qdist_destroy(&dist);
+
+    return str;
+}
+
+static bool compare_get_adaptive_timeout(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return s->adaptive_timeout;
+}
+
+static void compare_set_adaptive_timeout(Object *obj, bool value,
+                                         Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->adaptive_timeout = value;
+}
+
+static bool compare_get_tcp_stream(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return s->tcp_stream;
+}
+
+static void compare_set_tcp_stream(Object *obj, bool value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->tcp_stream = value;
+}
+
 static void colo_compare_init(Object *obj)
 {
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->worker_count = 1;
+    s->flush_threshold = COMPARE_FLUSH_THRESHOLD_DEFAULT;
+    s->compare_timeout = REGULAR_PACKET_CHECK_MS;
+    s->check_interval = REGULAR_PACKET_CHECK_MS;
+    s->max_connections = HASHTABLE_MAX_SIZE;
+    s->checkpoint_min_interval = COMPARE_CHECKPOINT_MIN_INTERVAL_DEFAULT;
+
     object_property_add_str(obj, "primary_in",
                             compare_get_pri_indev, compare_set_pri_indev,
                             NULL);
@@ -722,12 +1966,83 @@ static void colo_compare_init(Object *obj)
     object_property_add_str(obj, "outdev",
                             compare_get_outdev, compare_set_outdev,
                             NULL);
+    object_property_add_str(obj, "primary_in_ring",
+                            compare_get_pri_inring, compare_set_pri_inring,
+                            NULL);
+    object_property_add_str(obj, "secondary_in_ring",
+                            compare_get_sec_inring, compare_set_sec_inring,
+                            NULL);
+    object_property_add_str(obj, "outdev_ring",
+                            compare_get_outring, compare_set_outring,
+                            NULL);
+    object_property_add(obj, "workers", "uint32",
+                        compare_get_workers,
+                        compare_set_workers, NULL, NULL, NULL);
+    object_property_add(obj, "flush_threshold", "uint32",
+                        compare_get_flush_threshold,
+                        compare_set_flush_threshold, NULL, NULL, NULL);
+    object_property_add(obj, "compare_timeout", "uint32",
+                        compare_get_ms, compare_set_ms, NULL,
+                        &s->compare_timeout, NULL);
+    object_property_add(obj, "check_interval", "uint32",
+                        compare_get_ms, compare_set_ms, NULL,
+                        &s->check_interval, NULL);
+    object_property_add(obj, "checkpoint_min_interval", "uint32",
+                        compare_get_ms, compare_set_ms, NULL,
+                        &s->checkpoint_min_interval, NULL);
+    object_property_add(obj, "max_connections", "uint32",
+                        compare_get_max_connections,
+                        compare_set_max_connections, NULL, NULL, NULL);
+    object_property_add(obj, "idle_timeout", "uint32",
+                        compare_get_idle_timeout,
+                        compare_set_idle_timeout, NULL, NULL, NULL);
+    object_property_add(obj, "expired_connections", "uint64",
+                        compare_get_conn_counter, NULL, NULL,
+                        (void *)offsetof(ConnectionTable, expired), NULL);
+    object_property_add(obj, "evicted_connections", "uint64",
+                        compare_get_conn_counter, NULL, NULL,
+                        (void *)offsetof(ConnectionTable, evicted), NULL);
+    object_property_add(obj, "stats_matched", "uint64",
+                        compare_get_stats_counter, NULL, NULL,
+                        (void *)offsetof(CompareStats, matched), NULL);
+    object_property_add(obj, "stats_miscompared", "uint64",
+                        compare_get_stats_counter, NULL, NULL,
+                        (void *)offsetof(CompareStats, miscompared), NULL);
+    object_property_add(obj, "stats_dropped", "uint64",
+                        compare_get_stats_counter, NULL, NULL,
+                        (void *)offsetof(CompareStats, dropped), NULL);
+    object_property_add(obj, "stats_checkpoint_requests", "uint64",
+                        compare_get_stats_counter, NULL, NULL,
+                        (void *)offsetof(CompareStats, checkpoint_requests),
+                        NULL);
+    object_property_add(obj, "stats_max_queue_depth", "uint32",
+                        compare_get_max_queue_depth, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "stats_latency_avg", "number",
+                        compare_get_latency_avg, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "stats_latency_max", "uint64",
+                        compare_get_latency_max, NULL, NULL, NULL, NULL);
+    object_property_add_str(obj, "stats_latency_histogram",
+                            compare_get_latency_histogram, NULL, NULL);
+    object_property_add_bool(obj, "adaptive_timeout",
+                             compare_get_adaptive_timeout,
+                             compare_set_adaptive_timeout, NULL);
+    object_property_add_bool(obj, "tcp_stream",
+                             compare_get_tcp_stream,
+                             compare_set_tcp_stream, NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             object_property_allow_set_link,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
+    int i;
 
+    if (s->workers && s->worker_iothread) {
+        compare_iothread_stop(s);
+    }
     if (s->chr_pri_in) {
         qemu_chr_add_handlers(s->chr_pri_in, NULL, NULL, NULL, NULL);
         qemu_chr_fe_release(s->chr_pri_in);
@@ -736,27 +2051,65 @@ static void colo_compare_finalize(Object *obj)
         qemu_chr_add_handlers(s->chr_sec_in, NULL, NULL, NULL, NULL);
         qemu_chr_fe_release(s->chr_sec_in);
     }
+    if (s->workers) {
+        for (i = 0; i < s->worker_count; i++) {
+            if (!s->workers[i].compare_loop) {
+                continue;
+            }
+            g_main_loop_quit(s->workers[i].compare_loop);
+            qemu_thread_join(&s->workers[i].thread);
+        }
+        /* before their context goes away with worker 0 */
+        if (s->pri_ring_source) {
+            g_source_destroy(s->pri_ring_source);
+            g_source_unref(s->pri_ring_source);
+        }
+        if (s->sec_ring_source) {
+            g_source_destroy(s->sec_ring_source);
+            g_source_unref(s->sec_ring_source);
+        }
+        for (i = 0; i < s->worker_count; i++) {
+            compare_worker_cleanup(&s->workers[i]);
+        }
+        g_free(s->workers);
+        qemu_mutex_destroy(&s->out_lock);
+        qemu_bh_delete(s->checkpoint_bh);
+        timer_del(s->checkpoint_timer);
+        timer_free(s->checkpoint_timer);
+
+        /* drop a packet whose reassembly was still in progress */
+        if (s->pri_rs.state == 1) {
+            packet_buf_free(s->pri_rs.data, s->pri_rs.packet_len);
+        }
+        if (s->sec_rs.state == 1) {
+            packet_buf_free(s->sec_rs.data, s->sec_rs.packet_len);
+        }
+    }
+
     if (s->chr_out) {
         qemu_chr_fe_release(s->chr_out);
     }
 
-    g_queue_free(&s->conn_list);
-
-    if (qemu_thread_is_self(&s->thread)) {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
-        qemu_thread_join(&s->thread);
+    if (s->ring_pri_in) {
+        colo_ring_release(s->ring_pri_in, false);
     }
-
-    if (s->timer) {
-        timer_del(s->timer);
+    if (s->ring_sec_in) {
+        colo_ring_release(s->ring_sec_in, false);
+    }
+    if (s->ring_out) {
+        colo_ring_release(s->ring_out, true);
     }
 
-    qemu_mutex_destroy(&s->timer_check_lock);
+    if (s->worker_iothread) {
+        object_unref(OBJECT(s->worker_iothread));
+    }
 
     g_free(s->pri_indev);
     g_free(s->sec_indev);
     g_free(s->outdev);
+    g_free(s->pri_inring);
+    g_free(s->sec_inring);
+    g_free(s->outring);
 }
 
 static const TypeInfo colo_compare_info = {
@@ -0,0 +1,35 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * Copyright (c) 2016 HUAWEI TECHNOLOGIES CO., LTD.
+ * Copyright (c) 2016 FUJITSU LIMITED
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_COLO_COMPARE_H
+#define QEMU_COLO_COMPARE_H
+
+#include "qemu/notify.h"
+
+typedef struct COLOCompareRequest {
+    Object *compare;
+    /* false if the request only flushes packets held for too long */
+    bool miscompare;
+} COLOCompareRequest;
+
+/*
+ * Ask for a checkpoint because the primary and the secondary diverged.
+ * The notifiers are called from the main loop with the iothread lock
+ * held, and @data points to a COLOCompareRequest for the colo-compare
+ * object asking for it.
+ * Requests made while one is pending are coalesced into it, and a
+ * colo-compare object notifies at most once per checkpoint_min_interval.
+ */
+void colo_compare_register_notifier(Notifier *notify);
+void colo_compare_unregister_notifier(Notifier *notify);
+
+#endif /* QEMU_COLO_COMPARE_H */
@@ -0,0 +1,420 @@
+/*
+ * Shared memory frame ring for the COLO proxy
+ *
+ * Copyright (c) 2016 HUAWEI TECHNOLOGIES CO., LTD.
+ * Copyright (c) 2016 FUJITSU LIMITED
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi-visit.h"
+#include "qom/object_interfaces.h"
+#include "qemu/atomic.h"
+#include "qemu/event_notifier.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/memfd.h"
+#include "trace.h"
+#include "net/colo-ring.h"
+
+#define COLO_RING_DEFAULT_SIZE (4 * 1024 * 1024)
+#define COLO_RING_MIN_SIZE 65536
+/* frames read by one dispatch of the consumer source */
+#define COLO_RING_READ_BATCH 256
+/* frame length that tells the consumer to go back to offset 0 */
+#define COLO_RING_WRAP UINT32_MAX
+
+/*
+ * Start of the shared mapping.  head and tail count the bytes ever
+ * written and read; they are on different cache lines since the
+ * producer and the consumer run in different threads.  Each frame is a
+ * host endian uint32_t length followed by the frame, padded to 4 bytes,
+ * and never wraps around the end of the data area.
+ */
+typedef struct ColoRingHdr {
+    uint32_t head;
+    uint8_t pad1[60];
+    uint32_t tail;
+    uint8_t pad2[60];
+} ColoRingHdr;
+
+struct ColoRing {
+    Object parent;
+
+    /* size of the data area, a power of 2 */
+    uint64_t size;
+    ColoRingHdr *hdr;
+    uint8_t *data;
+    size_t map_size;
+    int fd;
+    /* set by the producer when the consumer may be waiting */
+    EventNotifier notifier;
+    /* consumer private: tail past the frame returned by colo_ring_peek() */
+    uint32_t next_tail;
+
+    bool has_producer;
+    bool has_consumer;
+    /* frames the producer dropped because the ring was full */
+    uint64_t dropped;
+};
+
+typedef struct ColoRingSource {
+    GSource source;
+    GPollFD pfd;
+    ColoRing *ring;
+    ColoRingReadFunc *func;
+    void *opaque;
+} ColoRingSource;
+
+static uint32_t colo_ring_frame_len(uint32_t size)
+{
+    return QEMU_ALIGN_UP(size + sizeof(uint32_t), sizeof(uint32_t));
+}
+
+int colo_ring_write_iov(ColoRing *ring, const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t start = ring->hdr->head;
+    uint32_t head = start;
+    uint32_t tail = atomic_read(&ring->hdr->tail);
+    uint32_t off = head & (ring->size - 1);
+    uint32_t len, pad = 0;
+
+    /* with at most half of the ring per frame, an empty ring has room */
+    if (size > ring->size / 2 - sizeof(uint32_t)) {
+        return -EMSGSIZE;
+    }
+    len = colo_ring_frame_len(size);
+    if (off + len > ring->size) {
+        pad = ring->size - off;
+    }
+    if (head + pad + len - tail > ring->size) {
+        ring->dropped++;
+        trace_colo_ring_full(ring, size);
+        return -ENOBUFS;
+    }
+    /* do not overwrite data before the consumer is done with it */
+    smp_mb();
+
+    if (pad) {
+        *(uint32_t *)(ring->data + off) = COLO_RING_WRAP;
+        head += pad;
+        off = 0;
+    }
+    *(uint32_t *)(ring->data + off) = size;
+    iov_to_buf(iov, iovcnt, 0, ring->data + off + sizeof(uint32_t), size);
+
+    /* publish the frame, pairs with smp_rmb() in colo_ring_peek() */
+    atomic_mb_set(&ring->hdr->head, head + len);
+
+    /*
+     * Pairs with the barrier in colo_ring_consume(): either the consumer
+     * sees the new head, or we see that it emptied the ring.
+     */
+    if (atomic_read(&ring->hdr->tail) == start) {
+        event_notifier_set(&ring->notifier);
+    }
+
+    return 0;
+}
+
+int colo_ring_write(ColoRing *ring, const uint8_t *buf, uint32_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return colo_ring_write_iov(ring, &iov, 1);
+}
+
+static const uint8_t *colo_ring_peek(ColoRing *ring, uint32_t *size)
+{
+    uint32_t tail = ring->hdr->tail;
+    uint32_t head = atomic_read(&ring->hdr->head);
+    uint32_t off = tail & (ring->size - 1);
+    uint32_t len;
+
+    if (head == tail) {
+        return NULL;
+    }
+    /* read the frame only after its head update */
+    smp_rmb();
+
+    len = *(uint32_t *)(ring->data + off);
+    if (len == COLO_RING_WRAP) {
+        /* the producer wrote the frame after it with the same head */
+        tail += ring->size - off;
+        off = 0;
+        len = *(uint32_t *)ring->data;
+    }
+
+    ring->next_tail = tail + colo_ring_frame_len(len);
+    *size = len;
+    return ring->data + off + sizeof(uint32_t);
+}
+
+static void colo_ring_consume(ColoRing *ring)
+{
+    atomic_mb_set(&ring->hdr->tail, ring->next_tail);
+}
+
+static bool colo_ring_is_empty(ColoRing *ring)
+{
+    return atomic_read(&ring->hdr->head) == ring->hdr->tail;
+}
+
+static gboolean colo_ring_source_prepare(GSource *source, gint *timeout)
+{
+    ColoRingSource *src = (ColoRingSource *)source;
+
+    *timeout = -1;
+    return !colo_ring_is_empty(src->ring);
+}
+
+static gboolean colo_ring_source_check(GSource *source)
+{
+    ColoRingSource *src = (ColoRingSource *)source;
+
+    return (src->pfd.revents & G_IO_IN) || !colo_ring_is_empty(src->ring);
+}
+
+static gboolean colo_ring_source_dispatch(GSource *source,
+                                          GSourceFunc callback,
+                                          gpointer user_data)
+{
+    ColoRingSource *src = (ColoRingSource *)source;
+    ColoRing *ring = src->ring;
+    const uint8_t *buf;
+    uint32_t size;
+    int i;
+
+    event_notifier_test_and_clear(&ring->notifier);
+
+    /* frames left over make prepare() dispatch us again right away */
+    for (i = 0; i < COLO_RING_READ_BATCH; i++) {
+        buf = colo_ring_peek(ring, &size);
+        if (!buf) {
+            break;
+        }
+        src->func(src->opaque, buf, size);
+        colo_ring_consume(ring);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs colo_ring_source_funcs = {
+    .prepare = colo_ring_source_prepare,
+    .check = colo_ring_source_check,
+    .dispatch = colo_ring_source_dispatch,
+};
+
+GSource *colo_ring_source_new(ColoRing *ring, ColoRingReadFunc *func,
+                              void *opaque)
+{
+    ColoRingSource *src;
+
+    src = (ColoRingSource *)g_source_new(&colo_ring_source_funcs,
+                                         sizeof(ColoRingSource));
+    src->ring = ring;
+    src->func = func;
+    src->opaque = opaque;
+#ifdef _WIN32
+    src->pfd.fd = (gintptr)event_notifier_get_handle(&ring->notifier);
+#else
+    src->pfd.fd = event_notifier_get_fd(&ring->notifier);
+#endif
+    src->pfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+    g_source_add_poll(&src->source, &src->pfd);
+
+    return &src->source;
+}
+
+ColoRing *colo_ring_claim(const char *id, bool producer, Error **errp)
+{
+    Object *obj;
+    ColoRing *ring;
+    bool *claimed;
+
+    obj = object_resolve_path_component(object_get_objects_root(), id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_COLO_RING)) {
+        error_setg(errp, "colo-ring '%s' not found", id);
+        return NULL;
+    }
+    ring = COLO_RING(obj);
+    if (!ring->hdr) {
+        error_setg(errp, "colo-ring '%s' is not ready", id);
+        return NULL;
+    }
+
+    claimed = producer ? &ring->has_producer : &ring->has_consumer;
+    if (*claimed) {
+        error_setg(errp, "colo-ring '%s' already has a %s", id,
+                   producer ? "producer" : "consumer");
+        return NULL;
+    }
+    *claimed = true;
+    object_ref(obj);
+
+    return ring;
+}
+
+void colo_ring_release(ColoRing *ring, bool producer)
+{
+    if (producer) {
+        ring->has_producer = false;
+    } else {
+        ring->has_consumer = false;
+    }
+    object_unref(OBJECT(ring));
+}
+
+static void colo_ring_complete(UserCreatable *uc, Error **errp)
+{
+    ColoRing *ring = COLO_RING(uc);
+    void *ptr;
+    int ret;
+
+    if (ring->size < COLO_RING_MIN_SIZE || ring->size > UINT32_MAX / 2) {
+        error_setg(errp, "colo-ring size must be between %d and %u",
+                   COLO_RING_MIN_SIZE, UINT32_MAX / 2);
+        return;
+    }
+    ring->size = pow2ceil(ring->size);
+    ring->map_size = sizeof(ColoRingHdr) + ring->size;
+
+    ret = event_notifier_init(&ring->notifier, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to create colo-ring notifier");
+        return;
+    }
+
+#ifdef CONFIG_POSIX
+    /* backed by a memfd so that the ring can be mapped by another process */
+    ptr = qemu_memfd_alloc("colo-ring", ring->map_size, 0, &ring->fd);
+#else
+    ptr = qemu_try_memalign(64, ring->map_size);
+#endif
+    if (!ptr) {
+        error_setg(errp, "failed to allocate colo-ring");
+        event_notifier_cleanup(&ring->notifier);
+        return;
+    }
+    memset(ptr, 0, sizeof(ColoRingHdr));
+    ring->data = (uint8_t *)ptr + sizeof(ColoRingHdr);
+    ring->hdr = ptr;
+}
+
+static bool colo_ring_can_be_deleted(UserCreatable *uc, Error **errp)
+{
+    ColoRing *ring = COLO_RING(uc);
+
+    if (ring->has_producer || ring->has_consumer) {
+        error_setg(errp, "colo-ring is in use");
+        return false;
+    }
+    return true;
+}
+
+static void colo_ring_get_size(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    ColoRing *ring = COLO_RING(obj);
+    uint64_t value = ring->size;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void colo_ring_set_size(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    ColoRing *ring = COLO_RING(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    if (ring->hdr) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    visit_type_size(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    ring->size = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void colo_ring_get_dropped(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    ColoRing *ring = COLO_RING(obj);
+    uint64_t value = ring->dropped;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void colo_ring_init(Object *obj)
+{
+    ColoRing *ring = COLO_RING(obj);
+
+    ring->size = COLO_RING_DEFAULT_SIZE;
+    ring->fd = -1;
+
+    object_property_add(obj, "size", "size",
+                        colo_ring_get_size, colo_ring_set_size,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "dropped", "uint64",
+                        colo_ring_get_dropped, NULL,
+                        NULL, NULL, NULL);
+}
+
+static void colo_ring_finalize(Object *obj)
+{
+    ColoRing *ring = COLO_RING(obj);
+
+    if (!ring->hdr) {
+        return;
+    }
+#ifdef CONFIG_POSIX
+    qemu_memfd_free(ring->hdr, ring->map_size, ring->fd);
+#else
+    qemu_vfree(ring->hdr);
+#endif
+    event_notifier_cleanup(&ring->notifier);
+}
+
+static void colo_ring_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = colo_ring_complete;
+    ucc->can_be_deleted = colo_ring_can_be_deleted;
+}
+
+static const TypeInfo colo_ring_info = {
+    .name = TYPE_COLO_RING,
+    .parent = TYPE_OBJECT,
+    .class_init = colo_ring_class_init,
+    .instance_init = colo_ring_init,
+    .instance_finalize = colo_ring_finalize,
+    .instance_size = sizeof(ColoRing),
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void register_types(void)
+{
+    type_register_static(&colo_ring_info);
+}
+
+type_init(register_types);
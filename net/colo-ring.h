@@ -0,0 +1,56 @@
+/*
+ * Shared memory frame ring for the COLO proxy
+ *
+ * Copyright (c) 2016 HUAWEI TECHNOLOGIES CO., LTD.
+ * Copyright (c) 2016 FUJITSU LIMITED
+ * Copyright (c) 2016 Intel Corporation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_COLO_RING_H
+#define QEMU_COLO_RING_H
+
+#include "qom/object.h"
+
+#define TYPE_COLO_RING "colo-ring"
+#define COLO_RING(obj) \
+    OBJECT_CHECK(ColoRing, (obj), TYPE_COLO_RING)
+
+typedef struct ColoRing ColoRing;
+
+/*
+ * Called for every frame read from the ring.  @buf points into the
+ * ring and is only valid until the callback returns.
+ */
+typedef void ColoRingReadFunc(void *opaque, const uint8_t *buf,
+                              uint32_t size);
+
+/*
+ * A colo-ring carries whole ethernet frames from one producer to one
+ * consumer, which can both be any of filter-mirror, filter-redirector
+ * and colo-compare, without going through a chardev socket.
+ *
+ * colo_ring_claim() looks up the ring with id @id and reserves its
+ * producer or consumer end; colo_ring_release() gives it back.
+ */
+ColoRing *colo_ring_claim(const char *id, bool producer, Error **errp);
+void colo_ring_release(ColoRing *ring, bool producer);
+
+/*
+ * Producer side.  Copy one frame into the ring; returns 0 on success,
+ * -ENOBUFS if the ring is full and -EMSGSIZE if the frame can never fit.
+ * The consumer is woken up only if it could be waiting for the frame.
+ */
+int colo_ring_write_iov(ColoRing *ring, const struct iovec *iov, int iovcnt);
+int colo_ring_write(ColoRing *ring, const uint8_t *buf, uint32_t size);
+
+/*
+ * Consumer side.  The returned source calls @func for each frame in the
+ * ring; attach it to the GMainContext of the consumer thread.
+ */
+GSource *colo_ring_source_new(ColoRing *ring, ColoRingReadFunc *func,
+                              void *opaque);
+
+#endif /* QEMU_COLO_RING_H */
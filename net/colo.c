@@ -14,8 +14,101 @@
 
 #include "qemu/osdep.h"
 #include "trace.h"
+#include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
 #include "net/colo.h"
 
+enum {
+    /* Buffers up to this size (a standard ethernet frame) are recycled */
+    PACKET_POOL_BUF_SIZE = 2048,
+    PACKET_POOL_BATCH_SIZE = 64,
+};
+
+typedef struct PacketBuf {
+    QSLIST_ENTRY(PacketBuf) pool_next;
+} PacketBuf;
+
+/*
+ * Free list of packet data buffers, organized like the coroutine pool:
+ * any thread can release a buffer to release_pool, and the allocating
+ * thread moves release_pool to its own alloc_pool in batches.
+ */
+static QSLIST_HEAD(, PacketBuf) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+static unsigned int release_pool_size;
+static __thread QSLIST_HEAD(, PacketBuf) alloc_pool =
+    QSLIST_HEAD_INITIALIZER(pool);
+static __thread unsigned int alloc_pool_size;
+static __thread Notifier packet_pool_cleanup_notifier;
+
+static void packet_pool_cleanup(Notifier *n, void *value)
+{
+    PacketBuf *buf;
+    PacketBuf *tmp;
+
+    QSLIST_FOREACH_SAFE(buf, &alloc_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        g_free(buf);
+    }
+}
+
+/*
+ * Allocate a buffer for @size bytes of packet data.  It must be released
+ * with packet_buf_free() passing the same @size, or handed over to a
+ * Packet with packet_new_nocopy().
+ */
+void *packet_buf_alloc(int size)
+{
+    PacketBuf *buf;
+
+    if (size > PACKET_POOL_BUF_SIZE) {
+        return g_malloc(size);
+    }
+
+    buf = QSLIST_FIRST(&alloc_pool);
+    if (!buf && release_pool_size > PACKET_POOL_BATCH_SIZE) {
+        /* Slow path; a good place to register the destructor, too.  */
+        if (!packet_pool_cleanup_notifier.notify) {
+            packet_pool_cleanup_notifier.notify = packet_pool_cleanup;
+            qemu_thread_atexit_add(&packet_pool_cleanup_notifier);
+        }
+
+        /* Not exact, see qemu_coroutine_create() */
+        alloc_pool_size = atomic_xchg(&release_pool_size, 0);
+        QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
+        buf = QSLIST_FIRST(&alloc_pool);
+    }
+    if (buf) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        alloc_pool_size--;
+        return buf;
+    }
+
+    return g_malloc(PACKET_POOL_BUF_SIZE);
+}
+
+void packet_buf_free(void *data, int size)
+{
+    PacketBuf *buf = data;
+
+    if (size <= PACKET_POOL_BUF_SIZE) {
+        if (release_pool_size < PACKET_POOL_BATCH_SIZE * 16) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, buf, pool_next);
+            atomic_inc(&release_pool_size);
+            return;
+        }
+        if (alloc_pool_size < PACKET_POOL_BATCH_SIZE) {
+            QSLIST_INSERT_HEAD(&alloc_pool, buf, pool_next);
+            alloc_pool_size++;
+            return;
+        }
+    }
+
+    g_free(data);
+}
+
 uint32_t connection_key_hash(const void *opaque)
 {
     const ConnectionKey *key = opaque;
@@ -129,16 +222,34 @@ void reverse_connection_key(ConnectionKey *key)
     key->dst_port = tmp_port;
 }
 
+static void connection_index_bucket_free(gpointer data)
+{
+    g_queue_free(data);
+}
+
 Connection *connection_new(ConnectionKey *key)
 {
     Connection *conn = g_slice_new(Connection);
 
+    conn->key = *key;
+    conn->lru_link = (GList) { .data = conn };
+    conn->conn_link = (GList) { .data = conn };
+    conn->last_active_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    conn->closed = false;
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
     conn->offset = 0;
     conn->syn_flag = 0;
     g_queue_init(&conn->primary_list);
     g_queue_init(&conn->secondary_list);
+    g_queue_init(&conn->primary_stream);
+    g_queue_init(&conn->secondary_stream);
+    conn->stream_seq = 0;
+    conn->stream_started = false;
+    conn->secondary_index = g_hash_table_new_full(g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL,
+                                                  connection_index_bucket_free);
 
     return conn;
 }
@@ -147,66 +258,288 @@ void connection_destroy(void *opaque)
 {
     Connection *conn = opaque;
 
+    g_hash_table_destroy(conn->secondary_index);
     g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
-    g_queue_free(&conn->primary_list);
+    g_queue_clear(&conn->primary_list);
     g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
-    g_queue_free(&conn->secondary_list);
+    g_queue_clear(&conn->secondary_list);
+    g_queue_foreach(&conn->primary_stream, packet_destroy, NULL);
+    g_queue_clear(&conn->primary_stream);
+    g_queue_foreach(&conn->secondary_stream, packet_destroy, NULL);
+    g_queue_clear(&conn->secondary_stream);
     g_slice_free(Connection, conn);
 }
 
-Packet *packet_new(const void *data, int size)
+/*
+ * Create a packet that takes ownership of @data, which must have been
+ * allocated with packet_buf_alloc(@size).
+ */
+Packet *packet_new_nocopy(void *data, int size)
 {
     Packet *pkt = g_slice_new(Packet);
 
-    pkt->data = g_memdup(data, size);
+    pkt->data = data;
     pkt->size = size;
     pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
 
     return pkt;
 }
 
+Packet *packet_new(const void *data, int size)
+{
+    void *buf = packet_buf_alloc(size);
+
+    memcpy(buf, data, size);
+    return packet_new_nocopy(buf, size);
+}
+
 void packet_destroy(void *opaque, void *user_data)
 {
     Packet *pkt = opaque;
 
-    g_free(pkt->data);
+    packet_buf_free(pkt->data, pkt->size);
     g_slice_free(Packet, pkt);
 }
 
 /*
- * Clear hashtable, stop this hash growing really huge
+ * Hash the part of the packet that has to be identical on primary and
+ * secondary for them to compare equal.  The IP header is left out since
+ * colo-compare tolerates differences in ip_id and ip_sum there.
  */
-void connection_hashtable_reset(GHashTable *connection_track_table)
+uint32_t packet_match_hash(Packet *pkt)
 {
-    g_hash_table_remove_all(connection_track_table);
+    const uint8_t *p = pkt->transport_header;
+    int len = pkt->size - (pkt->transport_header - (uint8_t *)pkt->data);
+    uint8_t tail[12] = { 0 };
+    uint32_t a, b, c;
+
+    len = MIN(len, COLO_MATCH_HASH_LEN);
+
+    /* Jenkins hash */
+    a = b = c = JHASH_INITVAL + pkt->size;
+    while (len > 12) {
+        a += ldl_he_p(p);
+        b += ldl_he_p(p + 4);
+        c += ldl_he_p(p + 8);
+        __jhash_mix(a, b, c);
+        p += 12;
+        len -= 12;
+    }
+
+    memcpy(tail, p, len);
+    a += ldl_he_p(tail);
+    b += ldl_he_p(tail + 4);
+    c += ldl_he_p(tail + 8);
+    __jhash_final(a, b, c);
+
+    return c;
 }
 
-/* if not found, create a new connection and add to hash table */
-Connection *connection_get(GHashTable *connection_track_table,
-                           ConnectionKey *key,
-                           GQueue *conn_list)
+/*
+ * Queue a secondary packet and index it by its match hash.
+ * pkt->match_hash must already be set.
+ */
+void connection_secondary_push(Connection *conn, Packet *pkt)
 {
-    Connection *conn = g_hash_table_lookup(connection_track_table, key);
+    gpointer key = GUINT_TO_POINTER(pkt->match_hash);
+    GQueue *bucket = g_hash_table_lookup(conn->secondary_index, key);
 
-    if (conn == NULL) {
-        ConnectionKey *new_key = g_memdup(key, sizeof(*key));
+    if (!bucket) {
+        bucket = g_queue_new();
+        g_hash_table_insert(conn->secondary_index, key, bucket);
+    }
 
-        conn = connection_new(key);
+    g_queue_push_tail(&conn->secondary_list, pkt);
+    g_queue_push_tail(bucket, conn->secondary_list.tail);
+}
+
+/*
+ * Find the oldest secondary packet that has the same match hash as
+ * ppkt and for which func(spkt, ppkt) returns 0.  The packet found is
+ * unlinked from the secondary list and returned; the caller owns it.
+ */
+Packet *connection_secondary_find(Connection *conn, Packet *ppkt,
+                                  GCompareFunc func)
+{
+    gpointer key = GUINT_TO_POINTER(ppkt->match_hash);
+    GQueue *bucket = g_hash_table_lookup(conn->secondary_index, key);
+    GList *iter, *link;
+    Packet *spkt;
 
-        if (g_hash_table_size(connection_track_table) > HASHTABLE_MAX_SIZE) {
-            trace_colo_proxy_main("colo proxy connection hashtable full,"
-                                  " clear it");
-            connection_hashtable_reset(connection_track_table);
-            /*
-             * clear the conn_list
-             */
-            while (!g_queue_is_empty(conn_list)) {
-                connection_destroy(g_queue_pop_head(conn_list));
+    if (!bucket) {
+        return NULL;
+    }
+
+    for (iter = bucket->head; iter; iter = iter->next) {
+        link = iter->data;
+        spkt = link->data;
+        if (func(spkt, ppkt) == 0) {
+            g_queue_delete_link(bucket, iter);
+            if (g_queue_is_empty(bucket)) {
+                g_hash_table_remove(conn->secondary_index, key);
             }
+            g_queue_delete_link(&conn->secondary_list, link);
+            return spkt;
         }
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert pkt into a queue sorted by TCP sequence number.  Segments
+ * mostly arrive in order, so search from the tail.
+ */
+void packet_queue_insert_by_seq(GQueue *queue, Packet *pkt)
+{
+    GList *link = queue->tail;
+
+    while (link && SEQ_GT(((Packet *)link->data)->seq, pkt->seq)) {
+        link = link->prev;
+    }
 
-        g_hash_table_insert(connection_track_table, new_key, conn);
+    if (link) {
+        g_queue_insert_after(queue, link, pkt);
+    } else {
+        g_queue_push_head(queue, pkt);
     }
+}
+
+void connection_table_init(ConnectionTable *t, uint32_t max_size,
+                           uint32_t idle_timeout)
+{
+    /* the keys are embedded in the connections */
+    t->table = g_hash_table_new_full(connection_key_hash,
+                                     connection_key_equal,
+                                     NULL,
+                                     connection_destroy);
+    g_queue_init(&t->lru);
+    t->max_size = max_size;
+    t->idle_timeout = idle_timeout;
+    t->expired = 0;
+    t->evicted = 0;
+}
+
+/*
+ * The embedded links of the destroyed connections are not freed: any
+ * conn_list passed to connection_get() must be reinitialized as well.
+ */
+void connection_table_destroy(ConnectionTable *t)
+{
+    g_hash_table_destroy(t->table);
+    t->table = NULL;
+    g_queue_init(&t->lru);
+}
+
+static bool connection_has_packets(Connection *conn)
+{
+    return !g_queue_is_empty(&conn->primary_list) ||
+           !g_queue_is_empty(&conn->secondary_list) ||
+           !g_queue_is_empty(&conn->primary_stream) ||
+           !g_queue_is_empty(&conn->secondary_stream);
+}
+
+static void connection_evict(ConnectionTable *t, Connection *conn,
+                             GQueue *conn_list)
+{
+    g_queue_unlink(&t->lru, &conn->lru_link);
+    if (conn_list && conn->processing) {
+        g_queue_unlink(conn_list, &conn->conn_link);
+    }
+    g_hash_table_remove(t->table, &conn->key);
+}
+
+/*
+ * Evict the idle and closed connections at the least recently used end
+ * of @t.  Connections still holding packets are left alone; they get
+ * another chance once their packets are gone.
+ */
+static void connection_table_expire(ConnectionTable *t, int64_t now,
+                                    GQueue *conn_list)
+{
+    Connection *conn;
+    int64_t idle;
+
+    while ((conn = g_queue_peek_head(&t->lru))) {
+        idle = now - conn->last_active_ms;
+        if (!(conn->closed && idle >= CONNECTION_CLOSED_TIMEOUT) &&
+            !(t->idle_timeout && idle >= t->idle_timeout)) {
+            /* the rest of the list was active more recently */
+            break;
+        }
+        if (connection_has_packets(conn)) {
+            break;
+        }
+        connection_evict(t, conn, conn_list);
+        t->expired++;
+    }
+}
+
+/*
+ * Make room for one more connection by evicting the least recently
+ * used one, preferring a connection without queued packets among the
+ * first few candidates.
+ */
+static void connection_table_make_room(ConnectionTable *t, GQueue *conn_list)
+{
+    GList *link = t->lru.head;
+    Connection *victim = link->data;
+    int i;
+
+    for (i = 0; link && i < 16; link = link->next, i++) {
+        if (!connection_has_packets(link->data)) {
+            victim = link->data;
+            break;
+        }
+    }
+
+    trace_colo_proxy_conn_evict(g_hash_table_size(t->table),
+                                connection_has_packets(victim));
+    connection_evict(t, victim, conn_list);
+    t->evicted++;
+}
+
+/*
+ * If not found, create a new connection and add it to @t.  The returned
+ * connection becomes the most recently used one.  Connections evicted
+ * from @t are removed from @conn_list too, if they were linked into it
+ * through their conn_link.
+ */
+Connection *connection_get(ConnectionTable *t,
+                           ConnectionKey *key,
+                           GQueue *conn_list)
+{
+    Connection *conn = g_hash_table_lookup(t->table, key);
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+
+    if (conn == NULL) {
+        connection_table_expire(t, now, conn_list);
+        if (t->lru.length >= t->max_size) {
+            connection_table_make_room(t, conn_list);
+        }
+
+        conn = connection_new(key);
+        g_hash_table_insert(t->table, &conn->key, conn);
+    } else {
+        g_queue_unlink(&t->lru, &conn->lru_link);
+        connection_table_expire(t, now, conn_list);
+    }
+
+    conn->last_active_ms = now;
+    g_queue_push_tail_link(&t->lru, &conn->lru_link);
 
     return conn;
 }
+
+/* Remember when a TCP connection is being torn down */
+void connection_track_tcp_flags(Connection *conn, Packet *pkt)
+{
+    struct tcphdr *tcp = (struct tcphdr *)pkt->transport_header;
+
+    if (tcp->th_flags & (TH_FIN | TH_RST)) {
+        conn->closed = true;
+    } else if (tcp->th_flags & TH_SYN) {
+        /* the 4-tuple is reused by a new connection */
+        conn->closed = false;
+    }
+}
@@ -21,6 +21,19 @@
 
 #define HASHTABLE_MAX_SIZE 16384
 
+/*
+ * A closed TCP connection is forgotten once it has seen no packet
+ * for this many ms.
+ */
+#define CONNECTION_CLOSED_TIMEOUT 10000
+
+/*
+ * Number of bytes past the IP header that are folded into
+ * Packet::match_hash; enough to cover the TCP header and the
+ * start of the payload.
+ */
+#define COLO_MATCH_HASH_LEN 64
+
 #ifndef IPPROTO_DCCP
 #define IPPROTO_DCCP 33
 #endif
@@ -43,6 +56,15 @@ typedef struct Packet {
     int size;
     /* Time of packet creation, in wall clock ms */
     int64_t creation_ms;
+    /*
+     * Hash of the transport header and payload prefix; two packets
+     * can only compare equal if their match_hash is the same.
+     */
+    uint32_t match_hash;
+    /* TCP payload and its sequence number, for the byte stream compare */
+    uint8_t *payload;
+    int payload_size;
+    tcp_seq seq;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -55,10 +77,34 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
+    /* the key this connection is stored under in its ConnectionTable */
+    ConnectionKey key;
+    /* link in ConnectionTable::lru */
+    GList lru_link;
+    /* link in the conn_list passed to connection_get() */
+    GList conn_link;
+    /* host clock ms of the last packet */
+    int64_t last_active_ms;
+    /* a FIN or RST was seen, element is evicted when idle for a while */
+    bool closed;
     /* connection primary send queue: element type: Packet */
     GQueue primary_list;
     /* connection secondary send queue: element type: Packet */
     GQueue secondary_list;
+    /*
+     * index of secondary_list, keyed by Packet::match_hash.
+     * element type: GQueue of GList links into secondary_list
+     */
+    GHashTable *secondary_index;
+    /*
+     * TCP segments with payload, compared as a byte stream rather than
+     * packet by packet; sorted by sequence number.  element type: Packet
+     */
+    GQueue primary_stream;
+    GQueue secondary_stream;
+    /* the stream bytes before stream_seq compared equal */
+    tcp_seq stream_seq;
+    bool stream_started;
     /* flag to enqueue unprocessed_connections */
     bool processing;
     uint8_t ip_proto;
@@ -71,6 +117,21 @@ typedef struct Connection {
     int syn_flag;
 } Connection;
 
+typedef struct ConnectionTable {
+    /* key: ConnectionKey, value: Connection */
+    GHashTable *table;
+    /* element type: Connection, least recently used first */
+    GQueue lru;
+    /* connections kept at most */
+    uint32_t max_size;
+    /* ms without packets after which a connection is evicted, 0 for never */
+    uint32_t idle_timeout;
+    /* connections evicted because they were idle or closed */
+    uint64_t expired;
+    /* connections evicted to make room for a new one */
+    uint64_t evicted;
+} ConnectionTable;
+
 uint32_t connection_key_hash(const void *opaque);
 int connection_key_equal(const void *opaque1, const void *opaque2);
 int parse_packet_early(Packet *pkt);
@@ -78,11 +139,22 @@ void fill_connection_key(Packet *pkt, ConnectionKey *key);
 void reverse_connection_key(ConnectionKey *key);
 Connection *connection_new(ConnectionKey *key);
 void connection_destroy(void *opaque);
-Connection *connection_get(GHashTable *connection_track_table,
+void connection_table_init(ConnectionTable *t, uint32_t max_size,
+                           uint32_t idle_timeout);
+void connection_table_destroy(ConnectionTable *t);
+Connection *connection_get(ConnectionTable *t,
                            ConnectionKey *key,
                            GQueue *conn_list);
-void connection_hashtable_reset(GHashTable *connection_track_table);
+void connection_track_tcp_flags(Connection *conn, Packet *pkt);
+void *packet_buf_alloc(int size);
+void packet_buf_free(void *data, int size);
+Packet *packet_new_nocopy(void *data, int size);
 Packet *packet_new(const void *data, int size);
 void packet_destroy(void *opaque, void *user_data);
+uint32_t packet_match_hash(Packet *pkt);
+void connection_secondary_push(Connection *conn, Packet *pkt);
+Packet *connection_secondary_find(Connection *conn, Packet *ppkt,
+                                  GCompareFunc func);
+void packet_queue_insert_by_seq(GQueue *queue, Packet *pkt);
 
 #endif /* QEMU_COLO_PROXY_H */
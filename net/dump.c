@@ -30,13 +30,30 @@
 #include "qemu/iov.h"
 #include "qemu/log.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
 #include "qapi/visitor.h"
 #include "net/filter.h"
 
+/* Records are queued in a ring and written out by a separate thread, so
+ * that a slow disk never stalls the datapath: when the ring is full, the
+ * packet is counted as dropped instead.  Must be a power of two. */
+#define DUMP_RING_SIZE (4 * 1024 * 1024)
+
 typedef struct DumpState {
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    uint8_t *ring;
+    /* Total bytes queued and written; protected by lock */
+    uint64_t head;
+    uint64_t tail;
+    bool stopping;
+    bool write_error;
+    uint64_t dropped;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -60,44 +77,124 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+static void *dump_writer_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    uint64_t off;
+    size_t len;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->head == s->tail && !s->stopping) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->head == s->tail) {
+            break;
+        }
+
+        /* Everything queued so far goes out in one write */
+        off = s->tail & (DUMP_RING_SIZE - 1);
+        len = MIN(s->head - s->tail, DUMP_RING_SIZE - off);
+        qemu_mutex_unlock(&s->lock);
+
+        if (qemu_write_full(s->fd, s->ring + off, len) != len) {
+            qemu_mutex_lock(&s->lock);
+            s->write_error = true;
+            break;
+        }
+
+        qemu_mutex_lock(&s->lock);
+        s->tail += len;
+    }
+    qemu_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void dump_stop(DumpState *s)
+{
+    /* Whatever is still queued is written before the thread exits */
+    qemu_mutex_lock(&s->lock);
+    s->stopping = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+
+    if (s->write_error) {
+        error_report("network dump write error - stopping dump");
+    }
+    if (s->dropped) {
+        error_report("network dump: %" PRIu64 " packets dropped, the file "
+                     "could not keep up", s->dropped);
+    }
+    close(s->fd);
+    s->fd = -1;
+    qemu_mutex_destroy(&s->lock);
+    qemu_cond_destroy(&s->cond);
+    g_free(s->ring);
+    s->ring = NULL;
+}
+
+/* Called with s->lock held, there must be room for len bytes at pos */
+static void dump_ring_copy(DumpState *s, uint64_t pos,
+                           const struct iovec *iov, int cnt, size_t len)
+{
+    size_t off = pos & (DUMP_RING_SIZE - 1);
+    size_t first = MIN(len, DUMP_RING_SIZE - off);
+
+    iov_to_buf(iov, cnt, 0, s->ring + off, first);
+    iov_to_buf(iov, cnt, first, s->ring, len - first);
+}
+
 static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
 {
     struct pcap_sf_pkthdr hdr;
+    struct iovec hdr_iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(hdr),
+    };
     int64_t ts;
-    int caplen;
+    size_t caplen;
     size_t size = iov_size(iov, cnt);
-    struct iovec dumpiov[cnt + 1];
 
     /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    if (!s->ring) {
         return size;
     }
 
     ts = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
-    caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    /* Only the part that is captured gets copied */
+    caplen = MIN(size, MIN(s->pcap_caplen, DUMP_RING_SIZE - sizeof(hdr)));
 
     hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
     hdr.ts.tv_usec = ts % 1000000;
     hdr.caplen = caplen;
     hdr.len = size;
 
-    dumpiov[0].iov_base = &hdr;
-    dumpiov[0].iov_len = sizeof(hdr);
-    cnt = iov_copy(&dumpiov[1], cnt, iov, cnt, 0, caplen);
-
-    if (writev(s->fd, dumpiov, cnt + 1) != sizeof(hdr) + caplen) {
-        error_report("network dump write error - stopping dump");
-        close(s->fd);
-        s->fd = -1;
+    qemu_mutex_lock(&s->lock);
+    if (s->write_error) {
+        qemu_mutex_unlock(&s->lock);
+        dump_stop(s);
+        return size;
     }
+    if (DUMP_RING_SIZE - (s->head - s->tail) < sizeof(hdr) + caplen) {
+        s->dropped++;
+        qemu_mutex_unlock(&s->lock);
+        return size;
+    }
+    dump_ring_copy(s, s->head, &hdr_iov, 1, sizeof(hdr));
+    dump_ring_copy(s, s->head + sizeof(hdr), iov, cnt, caplen);
+    s->head += sizeof(hdr) + caplen;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
 
     return size;
 }
 
 static void dump_cleanup(DumpState *s)
 {
-    close(s->fd);
-    s->fd = -1;
+    if (s->ring) {
+        dump_stop(s);
+    }
 }
 
 static int net_dump_state_init(DumpState *s, const char *filename,
@@ -133,6 +230,15 @@ static int net_dump_state_init(DumpState *s, const char *filename,
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
 
+    s->ring = g_malloc(DUMP_RING_SIZE);
+    s->head = s->tail = 0;
+    s->stopping = s->write_error = false;
+    s->dropped = 0;
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    qemu_thread_create(&s->thread, "dump", dump_writer_thread, s,
+                       QEMU_THREAD_JOINABLE);
+
     return 0;
 }
 
@@ -304,6 +410,22 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void filter_dump_get_dropped(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint64_t value;
+
+    if (nfds->ds.ring) {
+        qemu_mutex_lock(&nfds->ds.lock);
+        value = nfds->ds.dropped;
+        qemu_mutex_unlock(&nfds->ds.lock);
+    } else {
+        value = nfds->ds.dropped;
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static char *file_dump_get_filename(Object *obj, Error **errp)
 {
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
@@ -327,6 +449,8 @@ static void filter_dump_instance_init(Object *obj)
 
     object_property_add(obj, "maxlen", "int", filter_dump_get_maxlen,
                         filter_dump_set_maxlen, NULL, NULL, NULL);
+    object_property_add(obj, "dropped", "uint64", filter_dump_get_dropped,
+                        NULL, NULL, NULL, NULL);
     object_property_add_str(obj, "file", file_dump_get_filename,
                             file_dump_set_filename, NULL);
 }
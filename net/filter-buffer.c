@@ -9,6 +9,7 @@
 #include "qemu/osdep.h"
 #include "net/filter.h"
 #include "net/queue.h"
+#include "net/filter-buffer.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "qemu/timer.h"
@@ -22,21 +23,128 @@
 #define FILTER_BUFFER(obj) \
     OBJECT_CHECK(FilterBufferState, (obj), TYPE_FILTER_BUFFER)
 
+#define FILTER_BUFFER_MAX_PACKETS 10000
+
+/* The packets that arrived during one checkpoint epoch */
+typedef struct FilterBufferEpoch {
+    uint64_t epoch;
+    NetQueue *queue;
+} FilterBufferEpoch;
+
 typedef struct FilterBufferState {
     NetFilterState parent_obj;
 
+    /* where new packets go, the queue of the open epoch in checkpoint mode */
     NetQueue *incoming_queue;
     uint32_t interval;
+    uint32_t max_packets;
     QEMUTimer release_timer;
+    /* release on filter_buffer_release_epoch() instead of a timer */
+    bool checkpoint;
+    /* FilterBufferEpoch, oldest first; the tail is the open epoch */
+    GQueue epochs;
+    uint64_t released_epoch;
+    /* the receiver refused a packet, wait for it to drain its queue */
+    bool blocked;
+    /* packets that found the queue full, and those of them we dropped */
+    uint64_t overflows;
+    uint64_t dropped;
 } FilterBufferState;
 
+/* checkpoint mode filter-buffers, and the epoch they are buffering */
+static GList *checkpoint_buffers;
+static uint64_t current_epoch = 1;
+
+static void filter_buffer_open_epoch(FilterBufferState *s, uint64_t epoch)
+{
+    FilterBufferEpoch *e = g_new(FilterBufferEpoch, 1);
+
+    e->epoch = epoch;
+    e->queue = qemu_new_net_queue(qemu_netfilter_try_pass_to_next,
+                                  NETFILTER(s));
+    qemu_net_queue_set_maxlen(e->queue, s->max_packets);
+    g_queue_push_tail(&s->epochs, e);
+    s->incoming_queue = e->queue;
+}
+
+/*
+ * Release the epochs up to @epoch in order, returns false if the
+ * receiver held up the release.  The open epoch is flushed, but stays.
+ */
+static bool filter_buffer_release_epochs(FilterBufferState *s, uint64_t epoch)
+{
+    FilterBufferEpoch *e;
+
+    while ((e = g_queue_peek_head(&s->epochs)) && e->epoch <= epoch) {
+        if (!qemu_net_queue_flush(e->queue)) {
+            return false;
+        }
+        if (e->queue == s->incoming_queue) {
+            break;
+        }
+        g_queue_pop_head(&s->epochs);
+        qemu_del_net_queue(e->queue);
+        g_free(e);
+    }
+    return true;
+}
+
 static void filter_buffer_flush(NetFilterState *nf)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
 
-    if (!qemu_net_queue_flush(s->incoming_queue)) {
-        /* Unable to empty the queue, purge remaining packets */
-        qemu_net_queue_purge(s->incoming_queue, nf->netdev);
+    /*
+     * Packets the receiver can't take yet stay queued, we are called
+     * again from filter_buffer_receiver_ready() once it drained its
+     * own queue.
+     */
+    if (s->checkpoint) {
+        s->blocked = !filter_buffer_release_epochs(s, s->released_epoch);
+    } else {
+        s->blocked = !qemu_net_queue_flush(s->incoming_queue);
+    }
+}
+
+/* Release everything, including the packets of the open epoch */
+static void filter_buffer_flush_all(NetFilterState *nf)
+{
+    FilterBufferState *s = FILTER_BUFFER(nf);
+
+    if (s->checkpoint) {
+        s->blocked = !filter_buffer_release_epochs(s, UINT64_MAX);
+    } else {
+        filter_buffer_flush(nf);
+    }
+}
+
+uint64_t filter_buffer_new_epoch(void)
+{
+    FilterBufferState *s;
+    FilterBufferEpoch *e;
+    GList *l;
+
+    for (l = checkpoint_buffers; l; l = l->next) {
+        s = l->data;
+        e = g_queue_peek_tail(&s->epochs);
+        if (qemu_net_queue_empty(e->queue)) {
+            /* nothing to wait for, let the epoch start over */
+            e->epoch = current_epoch + 1;
+        } else {
+            filter_buffer_open_epoch(s, current_epoch + 1);
+        }
+    }
+    return current_epoch++;
+}
+
+void filter_buffer_release_epoch(uint64_t epoch)
+{
+    FilterBufferState *s;
+    GList *l;
+
+    for (l = checkpoint_buffers; l; l = l->next) {
+        s = l->data;
+        s->released_epoch = MAX(s->released_epoch, epoch);
+        filter_buffer_flush(NETFILTER(s));
     }
 }
 
@@ -45,12 +153,6 @@ static void filter_buffer_release_timer(void *opaque)
     NetFilterState *nf = opaque;
     FilterBufferState *s = FILTER_BUFFER(nf);
 
-    /*
-     * Note: filter_buffer_flush() drops packets that can't be sent
-     * TODO: We should leave them queued.  But currently there's no way
-     * for the next filter or receiver to notify us that it can receive
-     * more packets.
-     */
     filter_buffer_flush(nf);
     /* Timer rearmed to fire again in s->interval microseconds. */
     timer_mod(&s->release_timer,
@@ -67,25 +169,55 @@ static ssize_t filter_buffer_receive_iov(NetFilterState *nf,
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
 
+    /*
+     * Once the queue is full, keep the packet together with sent_cb so
+     * that the sender stops sending until we released it, like it would
+     * do for a receiver that can't receive.  Senders that can't be held
+     * back lose the packet.
+     */
+    if (qemu_net_queue_full(s->incoming_queue)) {
+        s->overflows++;
+        if (sent_cb) {
+            qemu_net_queue_append_iov(s->incoming_queue, sender, flags,
+                                      iov, iovcnt, sent_cb);
+            return NETFILTER_PACKET_QUEUED;
+        }
+        s->dropped++;
+        return iov_size(iov, iovcnt);
+    }
+
     /*
      * We return size when buffer a packet, the sender will take it as
      * a already sent packet, so sent_cb should not be called later.
-     *
-     * FIXME: Even if the guest can't receive packets for some reasons,
-     * the filter can still accept packets until its internal queue is full.
-     * For example:
-     *   For some reason, receiver could not receive more packets
-     * (.can_receive() returns zero). Without a filter, at most one packet
-     * will be queued in incoming queue and sender's poll will be disabled
-     * unit its sent_cb() was called. With a filter, it will keep receiving
-     * the packets without caring about the receiver. This is suboptimal.
-     * May need more thoughts (e.g keeping sent_cb).
      */
     qemu_net_queue_append_iov(s->incoming_queue, sender, flags,
                               iov, iovcnt, NULL);
     return iov_size(iov, iovcnt);
 }
 
+static void filter_buffer_receiver_ready(NetFilterState *nf)
+{
+    FilterBufferState *s = FILTER_BUFFER(nf);
+
+    /*
+     * In timer mode this can release packets before the end of their
+     * interval, it only happens after a release was held up by the
+     * receiver.
+     */
+    if (s->incoming_queue && s->blocked) {
+        filter_buffer_flush(nf);
+    }
+}
+
+static void filter_buffer_purge(NetFilterState *nf, NetQueue *queue)
+{
+    qemu_net_queue_purge(queue, nf->netdev);
+    if (nf->netdev->peer) {
+        qemu_net_queue_purge(queue, nf->netdev->peer);
+    }
+    qemu_del_net_queue(queue);
+}
+
 static void filter_buffer_cleanup(NetFilterState *nf)
 {
     FilterBufferState *s = FILTER_BUFFER(nf);
@@ -94,10 +226,22 @@ static void filter_buffer_cleanup(NetFilterState *nf)
         timer_del(&s->release_timer);
     }
 
-    /* flush packets */
-    if (s->incoming_queue) {
-        filter_buffer_flush(nf);
-        g_free(s->incoming_queue);
+    if (!s->incoming_queue) {
+        return;
+    }
+
+    /* flush packets, drop what the receiver can't take */
+    filter_buffer_flush_all(nf);
+    if (s->checkpoint) {
+        FilterBufferEpoch *e;
+
+        checkpoint_buffers = g_list_remove(checkpoint_buffers, s);
+        while ((e = g_queue_pop_head(&s->epochs))) {
+            filter_buffer_purge(nf, e->queue);
+            g_free(e);
+        }
+    } else {
+        filter_buffer_purge(nf, s->incoming_queue);
     }
 }
 
@@ -119,16 +263,30 @@ static void filter_buffer_setup(NetFilterState *nf, Error **errp)
     FilterBufferState *s = FILTER_BUFFER(nf);
 
     /*
-     * We may want to accept zero interval when VM FT solutions like MC
-     * or COLO use this filter to release packets on demand.
+     * VM FT solutions like MC or COLO release packets on demand, once
+     * the checkpoint that produced them is acknowledged.
      */
+    if (s->checkpoint) {
+        if (s->interval) {
+            error_setg(errp, "'interval' can't be used with 'checkpoint'");
+            return;
+        }
+        g_queue_init(&s->epochs);
+        s->released_epoch = current_epoch - 1;
+        filter_buffer_open_epoch(s, current_epoch);
+        checkpoint_buffers = g_list_append(checkpoint_buffers, s);
+        return;
+    }
+
     if (!s->interval) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
                    "a non-zero interval");
         return;
     }
 
-    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
+    s->incoming_queue = qemu_new_net_queue(qemu_netfilter_try_pass_to_next,
+                                           nf);
+    qemu_net_queue_set_maxlen(s->incoming_queue, s->max_packets);
     filter_buffer_setup_timer(nf);
 }
 
@@ -140,7 +298,7 @@ static void filter_buffer_status_changed(NetFilterState *nf, Error **errp)
         if (s->interval) {
             timer_del(&s->release_timer);
         }
-        filter_buffer_flush(nf);
+        filter_buffer_flush_all(nf);
     } else {
         filter_buffer_setup_timer(nf);
     }
@@ -154,6 +312,7 @@ static void filter_buffer_class_init(ObjectClass *oc, void *data)
     nfc->cleanup = filter_buffer_cleanup;
     nfc->receive_iov = filter_buffer_receive_iov;
     nfc->status_changed = filter_buffer_status_changed;
+    nfc->receiver_ready = filter_buffer_receiver_ready;
 }
 
 static void filter_buffer_get_interval(Object *obj, Visitor *v,
@@ -189,11 +348,92 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void filter_buffer_get_max_packets(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+    uint32_t value = s->max_packets;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_buffer_set_max_packets(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    s->max_packets = value;
+    if (s->incoming_queue) {
+        qemu_net_queue_set_maxlen(s->incoming_queue, value);
+    }
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static bool filter_buffer_get_checkpoint(Object *obj, Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+
+    return s->checkpoint;
+}
+
+static void filter_buffer_set_checkpoint(Object *obj, bool value,
+                                         Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+
+    if (s->incoming_queue) {
+        error_setg(errp, "Property '%s.checkpoint' can't be changed once "
+                   "the object is created", object_get_typename(obj));
+        return;
+    }
+    s->checkpoint = value;
+}
+
+static void filter_buffer_get_counter(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void filter_buffer_init(Object *obj)
 {
+    FilterBufferState *s = FILTER_BUFFER(obj);
+
+    s->max_packets = FILTER_BUFFER_MAX_PACKETS;
+
     object_property_add(obj, "interval", "int",
                         filter_buffer_get_interval,
                         filter_buffer_set_interval, NULL, NULL, NULL);
+    object_property_add_bool(obj, "checkpoint",
+                             filter_buffer_get_checkpoint,
+                             filter_buffer_set_checkpoint, NULL);
+    object_property_add(obj, "max_packets", "uint32",
+                        filter_buffer_get_max_packets,
+                        filter_buffer_set_max_packets, NULL, NULL, NULL);
+    object_property_add(obj, "overflows", "uint64",
+                        filter_buffer_get_counter, NULL, NULL,
+                        &s->overflows, NULL);
+    object_property_add(obj, "dropped", "uint64",
+                        filter_buffer_get_counter, NULL, NULL,
+                        &s->dropped, NULL);
 }
 
 static const TypeInfo filter_buffer_info = {
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2015 FUJITSU LIMITED
+ * Author: Yang Hongyang <yanghy@cn.fujitsu.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_FILTER_BUFFER_H
+#define QEMU_FILTER_BUFFER_H
+
+/*
+ * Output commit for filter-buffers created with checkpoint=on.
+ *
+ * filter_buffer_new_epoch() is called when a checkpoint is taken: it
+ * closes the epoch whose packets the checkpoint covers, returns its
+ * number, and starts buffering the next one.  Once the checkpoint is
+ * acknowledged, filter_buffer_release_epoch() releases the packets of
+ * that epoch and of all earlier ones.
+ *
+ * Both must be called with the iothread lock held.
+ */
+uint64_t filter_buffer_new_epoch(void);
+void filter_buffer_release_epoch(uint64_t epoch);
+
+#endif /* QEMU_FILTER_BUFFER_H */
@@ -23,6 +23,7 @@
 #include "sysemu/char.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
+#include "net/colo-ring.h"
 
 #define FILTER_MIRROR(obj) \
     OBJECT_CHECK(MirrorState, (obj), TYPE_FILTER_MIRROR)
@@ -33,6 +34,8 @@
 #define TYPE_FILTER_MIRROR "filter-mirror"
 #define TYPE_FILTER_REDIRECTOR "filter-redirector"
 #define REDIRECTOR_MAX_LEN NET_BUFSIZE
+/* packets with more fragments than this need an allocated iovec */
+#define MIRROR_SEND_IOV_MAX 64
 
 typedef struct MirrorState {
     NetFilterState parent_obj;
@@ -41,33 +44,43 @@ typedef struct MirrorState {
     CharDriverState *chr_in;
     CharDriverState *chr_out;
     SocketReadState rs;
+    /* colo-ring ids used instead of indev and outdev */
+    char *inring;
+    char *outring;
+    ColoRing *ring_in;
+    ColoRing *ring_out;
+    GSource *ring_source;
 } MirrorState;
 
 static int filter_mirror_send(CharDriverState *chr_out,
                               const struct iovec *iov,
                               int iovcnt)
 {
+    struct iovec stack_iov[MIRROR_SEND_IOV_MAX + 1];
+    struct iovec *send_iov = stack_iov;
     int ret = 0;
     ssize_t size = 0;
     uint32_t len =  0;
-    char *buf;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
         return 0;
     }
 
-    len = htonl(size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
+    /* send the length header and the packet with a single writev */
+    if (iovcnt > MIRROR_SEND_IOV_MAX) {
+        send_iov = g_new(struct iovec, iovcnt + 1);
     }
+    len = htonl(size);
+    send_iov[0].iov_base = &len;
+    send_iov[0].iov_len = sizeof(len);
+    memcpy(send_iov + 1, iov, iovcnt * sizeof(*iov));
 
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)buf, size);
-    g_free(buf);
-    if (ret != size) {
+    ret = qemu_chr_fe_writev_all(chr_out, send_iov, iovcnt + 1);
+    if (send_iov != stack_iov) {
+        g_free(send_iov);
+    }
+    if (ret != size + sizeof(len)) {
         goto err;
     }
 
@@ -77,6 +90,14 @@ err:
     return ret < 0 ? ret : -EIO;
 }
 
+static int mirror_send(MirrorState *s, const struct iovec *iov, int iovcnt)
+{
+    if (s->ring_out) {
+        return colo_ring_write_iov(s->ring_out, iov, iovcnt);
+    }
+    return filter_mirror_send(s->chr_out, iov, iovcnt);
+}
+
 static void
 redirector_to_filter(NetFilterState *nf, const uint8_t *buf, int len)
 {
@@ -138,7 +159,7 @@ static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
     MirrorState *s = FILTER_MIRROR(nf);
     int ret;
 
-    ret = filter_mirror_send(s->chr_out, iov, iovcnt);
+    ret = mirror_send(s, iov, iovcnt);
     if (ret) {
         error_report("filter_mirror_send failed(%s)", strerror(-ret));
     }
@@ -160,8 +181,8 @@ static ssize_t filter_redirector_receive_iov(NetFilterState *nf,
     MirrorState *s = FILTER_REDIRECTOR(nf);
     int ret;
 
-    if (s->chr_out) {
-        ret = filter_mirror_send(s->chr_out, iov, iovcnt);
+    if (s->chr_out || s->ring_out) {
+        ret = mirror_send(s, iov, iovcnt);
         if (ret) {
             error_report("filter_mirror_send failed(%s)", strerror(-ret));
         }
@@ -178,6 +199,9 @@ static void filter_mirror_cleanup(NetFilterState *nf)
     if (s->chr_out) {
         qemu_chr_fe_release(s->chr_out);
     }
+    if (s->ring_out) {
+        colo_ring_release(s->ring_out, true);
+    }
 }
 
 static void filter_redirector_cleanup(NetFilterState *nf)
@@ -191,15 +215,30 @@ static void filter_redirector_cleanup(NetFilterState *nf)
     if (s->chr_out) {
         qemu_chr_fe_release(s->chr_out);
     }
+    if (s->ring_source) {
+        g_source_destroy(s->ring_source);
+        g_source_unref(s->ring_source);
+    }
+    if (s->ring_in) {
+        colo_ring_release(s->ring_in, false);
+    }
+    if (s->ring_out) {
+        colo_ring_release(s->ring_out, true);
+    }
 }
 
 static void filter_mirror_setup(NetFilterState *nf, Error **errp)
 {
     MirrorState *s = FILTER_MIRROR(nf);
 
-    if (!s->outdev) {
-        error_setg(errp, "filter filter mirror needs 'outdev' "
-                   "property set");
+    if (!s->outdev == !s->outring) {
+        error_setg(errp, "filter filter mirror needs either 'outdev' "
+                   "or 'outring' property set");
+        return;
+    }
+
+    if (s->outring) {
+        s->ring_out = colo_ring_claim(s->outring, true, errp);
         return;
     }
 
@@ -224,20 +263,34 @@ static void redirector_rs_finalize(SocketReadState *rs)
     redirector_to_filter(nf, rs->buf, rs->packet_len);
 }
 
+static void redirector_ring_read(void *opaque, const uint8_t *buf,
+                                 uint32_t size)
+{
+    redirector_to_filter(opaque, buf, size);
+}
+
 static void filter_redirector_setup(NetFilterState *nf, Error **errp)
 {
     MirrorState *s = FILTER_REDIRECTOR(nf);
 
-    if (!s->indev && !s->outdev) {
+    if (!s->indev && !s->outdev && !s->inring && !s->outring) {
         error_setg(errp, "filter redirector needs 'indev' or "
                    "'outdev' at least one property set");
         return;
+    } else if ((s->indev && s->inring) || (s->outdev && s->outring)) {
+        error_setg(errp, "filter redirector can't use a chardev and "
+                   "a colo-ring in the same direction");
+        return;
     } else if (s->indev && s->outdev) {
         if (!strcmp(s->indev, s->outdev)) {
             error_setg(errp, "'indev' and 'outdev' could not be same "
                        "for filter redirector");
             return;
         }
+    } else if (s->inring && s->outring && !strcmp(s->inring, s->outring)) {
+        error_setg(errp, "'inring' and 'outring' could not be same "
+                   "for filter redirector");
+        return;
     }
 
     net_socket_rs_init(&s->rs, redirector_rs_finalize);
@@ -264,6 +317,21 @@ static void filter_redirector_setup(NetFilterState *nf, Error **errp)
         }
         qemu_chr_fe_claim_no_fail(s->chr_out);
     }
+
+    if (s->inring) {
+        s->ring_in = colo_ring_claim(s->inring, false, errp);
+        if (!s->ring_in) {
+            return;
+        }
+        /* frames are passed on by reference, straight from the ring */
+        s->ring_source = colo_ring_source_new(s->ring_in,
+                                              redirector_ring_read, nf);
+        g_source_attach(s->ring_source, NULL);
+    }
+
+    if (s->outring) {
+        s->ring_out = colo_ring_claim(s->outring, true, errp);
+    }
 }
 
 static void filter_mirror_class_init(ObjectClass *oc, void *data)
@@ -337,10 +405,60 @@ filter_redirector_set_outdev(Object *obj, const char *value, Error **errp)
     s->outdev = g_strdup(value);
 }
 
+static char *filter_redirector_get_inring(Object *obj, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    return g_strdup(s->inring);
+}
+
+static void
+filter_redirector_set_inring(Object *obj, const char *value, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    g_free(s->inring);
+    s->inring = g_strdup(value);
+}
+
+static char *filter_mirror_get_outring(Object *obj, Error **errp)
+{
+    MirrorState *s = FILTER_MIRROR(obj);
+
+    return g_strdup(s->outring);
+}
+
+static void
+filter_mirror_set_outring(Object *obj, const char *value, Error **errp)
+{
+    MirrorState *s = FILTER_MIRROR(obj);
+
+    g_free(s->outring);
+    s->outring = g_strdup(value);
+}
+
+static char *filter_redirector_get_outring(Object *obj, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    return g_strdup(s->outring);
+}
+
+static void
+filter_redirector_set_outring(Object *obj, const char *value, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    g_free(s->outring);
+    s->outring = g_strdup(value);
+}
+
 static void filter_mirror_init(Object *obj)
 {
     object_property_add_str(obj, "outdev", filter_mirror_get_outdev,
                             filter_mirror_set_outdev, NULL);
+    object_property_add_str(obj, "outring", filter_mirror_get_outring,
+                            filter_mirror_set_outring, NULL);
 }
 
 static void filter_redirector_init(Object *obj)
@@ -349,6 +467,10 @@ static void filter_redirector_init(Object *obj)
                             filter_redirector_set_indev, NULL);
     object_property_add_str(obj, "outdev", filter_redirector_get_outdev,
                             filter_redirector_set_outdev, NULL);
+    object_property_add_str(obj, "inring", filter_redirector_get_inring,
+                            filter_redirector_set_inring, NULL);
+    object_property_add_str(obj, "outring", filter_redirector_get_outring,
+                            filter_redirector_set_outring, NULL);
 }
 
 static void filter_mirror_fini(Object *obj)
@@ -356,6 +478,7 @@ static void filter_mirror_fini(Object *obj)
     MirrorState *s = FILTER_MIRROR(obj);
 
     g_free(s->outdev);
+    g_free(s->outring);
 }
 
 static void filter_redirector_fini(Object *obj)
@@ -364,6 +487,33 @@ static void filter_redirector_fini(Object *obj)
 
     g_free(s->indev);
     g_free(s->outdev);
+    g_free(s->inring);
+    g_free(s->outring);
+}
+
+static int filter_redirector_failover_one(Object *obj, void *opaque)
+{
+    Error *local_err = NULL;
+    char *id;
+
+    if (!object_dynamic_cast(obj, TYPE_FILTER_REDIRECTOR)) {
+        return 0;
+    }
+    id = object_get_canonical_path_component(obj);
+    trace_filter_redirector_failover(id);
+    g_free(id);
+
+    object_property_set_str(obj, "off", "status", &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    return 0;
+}
+
+void netfilter_colo_failover(void)
+{
+    object_child_foreach(object_get_objects_root(),
+                         filter_redirector_failover_one, NULL);
 }
 
 static const TypeInfo filter_redirector_info = {
@@ -28,11 +28,20 @@
 
 #define TYPE_FILTER_REWRITER "filter-rewriter"
 
+/* Enough for ethernet, IP and TCP headers including their options */
+#define REWRITER_HDR_LEN (ETH_HLEN + 60 + 60)
+/* packets with more fragments than this need an allocated iovec */
+#define REWRITER_IOV_MAX 64
+
 typedef struct RewriterState {
     NetFilterState parent_obj;
     NetQueue *incoming_queue;
-    /* hashtable to save connection */
-    GHashTable *connection_track_table;
+    /* table to save connection */
+    ConnectionTable connection_track_table;
+    /* connections tracked at most */
+    uint32_t max_connections;
+    /* ms without packets after which a connection is forgotten, 0 for never */
+    uint32_t idle_timeout;
 } RewriterState;
 
 static void filter_rewriter_flush(NetFilterState *nf)
@@ -59,12 +68,54 @@ static int is_tcp_packet(Packet *pkt)
     }
 }
 
+/*
+ * Return true if the handle_*_tcp_pkt functions will modify the
+ * packet, rather than only update the connection state.
+ */
+static bool tcp_packet_needs_rewrite(Packet *pkt)
+{
+    struct tcphdr *tcp_pkt = (struct tcphdr *)pkt->transport_header;
+
+    return (tcp_pkt->th_flags & (TH_ACK | TH_SYN)) == TH_ACK;
+}
+
+/*
+ * Send a packet whose headers were rewritten in @hdr: the headers come
+ * from @hdr and the rest from the original @iov, without copying it.
+ */
+static void rewriter_send_rewritten(RewriterState *s,
+                                    NetClientState *sender,
+                                    Packet *hdr,
+                                    const struct iovec *iov,
+                                    int iovcnt,
+                                    size_t size)
+{
+    struct iovec stack_iov[REWRITER_IOV_MAX + 1];
+    struct iovec *send_iov = stack_iov;
+    int cnt;
+
+    if (iovcnt > REWRITER_IOV_MAX) {
+        send_iov = g_new(struct iovec, iovcnt + 1);
+    }
+    send_iov[0].iov_base = hdr->data;
+    send_iov[0].iov_len = hdr->size;
+    cnt = 1 + iov_copy(send_iov + 1, iovcnt, iov, iovcnt, hdr->size,
+                       size - hdr->size);
+
+    qemu_net_queue_send_iov(s->incoming_queue, sender, 0,
+                            send_iov, cnt, NULL);
+    if (send_iov != stack_iov) {
+        g_free(send_iov);
+    }
+}
+
 /* handle tcp packet from primary guest */
 static int handle_primary_tcp_pkt(NetFilterState *nf,
                                   Connection *conn,
                                   Packet *pkt)
 {
     struct tcphdr *tcp_pkt;
+    uint32_t old;
 
     tcp_pkt = (struct tcphdr *)pkt->transport_header;
     if (trace_event_get_state(TRACE_COLO_FILTER_REWRITER_DEBUG)) {
@@ -98,9 +149,10 @@ static int handle_primary_tcp_pkt(NetFilterState *nf,
             conn->syn_flag = 0;
         }
         /* handle packets to the secondary from the primary */
+        old = tcp_pkt->th_ack;
         tcp_pkt->th_ack = htonl(ntohl(tcp_pkt->th_ack) + conn->offset);
-
-        net_checksum_calculate((uint8_t *)pkt->data, pkt->size);
+        tcp_pkt->th_sum = net_checksum_update32(tcp_pkt->th_sum, old,
+                                                tcp_pkt->th_ack);
     }
 
     return 0;
@@ -112,6 +164,7 @@ static int handle_secondary_tcp_pkt(NetFilterState *nf,
                                     Packet *pkt)
 {
     struct tcphdr *tcp_pkt;
+    uint32_t old;
 
     tcp_pkt = (struct tcphdr *)pkt->transport_header;
 
@@ -138,9 +191,10 @@ static int handle_secondary_tcp_pkt(NetFilterState *nf,
 
     if ((tcp_pkt->th_flags & (TH_ACK | TH_SYN)) == TH_ACK) {
         /* handle packets to the primary from the secondary*/
+        old = tcp_pkt->th_seq;
         tcp_pkt->th_seq = htonl(ntohl(tcp_pkt->th_seq) - conn->offset);
-
-        net_checksum_calculate((uint8_t *)pkt->data, pkt->size);
+        tcp_pkt->th_sum = net_checksum_update32(tcp_pkt->th_sum, old,
+                                                tcp_pkt->th_seq);
     }
 
     return 0;
@@ -156,21 +210,27 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
     RewriterState *s = FILTER_COLO_REWRITER(nf);
     Connection *conn;
     ConnectionKey key = {{0},};
-    Packet *pkt;
     ssize_t size = iov_size(iov, iovcnt);
-    char *buf = g_malloc0(size);
+    uint8_t hdr_buf[REWRITER_HDR_LEN];
+    Packet hdr = {
+        .data = hdr_buf,
+    };
 
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    pkt = packet_new(buf, size);
+    /*
+     * Only the headers are needed to classify, track and rewrite the
+     * packet, its payload is never copied.
+     */
+    hdr.size = iov_to_buf(iov, iovcnt, 0, hdr_buf, sizeof(hdr_buf));
 
     /*
      * if we get tcp packet
      * we will rewrite it to make secondary guest's
      * connection established successfully
      */
-    if (pkt && is_tcp_packet(pkt)) {
+    if (is_tcp_packet(&hdr) &&
+        hdr.transport_header + sizeof(struct tcphdr) <= hdr.data + hdr.size) {
 
-        fill_connection_key(pkt, &key);
+        fill_connection_key(&hdr, &key);
 
         if (sender == nf->netdev) {
             /*
@@ -179,41 +239,30 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
              */
             reverse_connection_key(&key);
         }
-        conn = connection_get(s->connection_track_table,
+        conn = connection_get(&s->connection_track_table,
                               &key,
                               NULL);
+        connection_track_tcp_flags(conn, &hdr);
 
         if (sender == nf->netdev) {
             /* NET_FILTER_DIRECTION_TX */
-            if (!handle_primary_tcp_pkt(nf, conn, pkt)) {
-                qemu_net_queue_send(s->incoming_queue, sender, 0,
-                (const uint8_t *)pkt->data, pkt->size, NULL);
-                packet_destroy(pkt, NULL);
-                pkt = NULL;
-                /*
-                 * We block the packet here,after rewrite pkt
-                 * and will send it
-                 */
-                return 1;
-            }
+            handle_primary_tcp_pkt(nf, conn, &hdr);
         } else {
             /* NET_FILTER_DIRECTION_RX */
-            if (!handle_secondary_tcp_pkt(nf, conn, pkt)) {
-                qemu_net_queue_send(s->incoming_queue, sender, 0,
-                (const uint8_t *)pkt->data, pkt->size, NULL);
-                packet_destroy(pkt, NULL);
-                pkt = NULL;
-                /*
-                 * We block the packet here,after rewrite pkt
-                 * and will send it
-                 */
-                return 1;
-            }
+            handle_secondary_tcp_pkt(nf, conn, &hdr);
+        }
+
+        if (tcp_packet_needs_rewrite(&hdr)) {
+            rewriter_send_rewritten(s, sender, &hdr, iov, iovcnt, size);
+        } else {
+            /* only the connection state changed, send the original iov */
+            qemu_net_queue_send_iov(s->incoming_queue, sender, 0,
+                                    iov, iovcnt, NULL);
         }
+        /* We block the packet here and will send it */
+        return 1;
     }
 
-    packet_destroy(pkt, NULL);
-    pkt = NULL;
     return 0;
 }
 
@@ -226,19 +275,85 @@ static void colo_rewriter_cleanup(NetFilterState *nf)
         filter_rewriter_flush(nf);
         g_free(s->incoming_queue);
     }
+    if (s->connection_track_table.table) {
+        connection_table_destroy(&s->connection_track_table);
+    }
 }
 
 static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
 {
     RewriterState *s = FILTER_COLO_REWRITER(nf);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    connection_table_init(&s->connection_track_table, s->max_connections,
+                          s->idle_timeout);
     s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
 }
 
+static void rewriter_get_limit(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    uint32_t value = *(uint32_t *)opaque;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+/* setter for max_connections and idle_timeout, opaque is the field */
+static void rewriter_set_limit(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    RewriterState *s = FILTER_COLO_REWRITER(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->connection_track_table.table) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed once "
+                   "the object is created", object_get_typename(obj), name);
+        goto out;
+    }
+    if (!value && opaque == &s->max_connections) {
+        error_setg(&local_err, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    *(uint32_t *)opaque = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+/* getter for the connection counters, opaque is the counter */
+static void rewriter_get_counter(Object *obj, Visitor *v, const char *name,
+                                 void *opaque, Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void colo_rewriter_init(Object *obj)
+{
+    RewriterState *s = FILTER_COLO_REWRITER(obj);
+
+    s->max_connections = HASHTABLE_MAX_SIZE;
+
+    object_property_add(obj, "max_connections", "uint32",
+                        rewriter_get_limit, rewriter_set_limit, NULL,
+                        &s->max_connections, NULL);
+    object_property_add(obj, "idle_timeout", "uint32",
+                        rewriter_get_limit, rewriter_set_limit, NULL,
+                        &s->idle_timeout, NULL);
+    object_property_add(obj, "expired_connections", "uint64",
+                        rewriter_get_counter, NULL, NULL,
+                        &s->connection_track_table.expired, NULL);
+    object_property_add(obj, "evicted_connections", "uint64",
+                        rewriter_get_counter, NULL, NULL,
+                        &s->connection_track_table.evicted, NULL);
+}
+
 static void colo_rewriter_class_init(ObjectClass *oc, void *data)
 {
     NetFilterClass *nfc = NETFILTER_CLASS(oc);
@@ -252,6 +367,7 @@ static const TypeInfo colo_rewriter_info = {
     .name = TYPE_FILTER_REWRITER,
     .parent = TYPE_NETFILTER,
     .class_init = colo_rewriter_class_init,
+    .instance_init = colo_rewriter_init,
     .instance_size = sizeof(RewriterState),
 };
 
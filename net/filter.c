@@ -59,16 +59,17 @@ static NetFilterState *netfilter_next(NetFilterState *nf,
     return next;
 }
 
-ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
-                                    unsigned flags,
-                                    const struct iovec *iov,
-                                    int iovcnt,
-                                    void *opaque)
+static ssize_t netfilter_pass_to_next(NetClientState *sender,
+                                      unsigned flags,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetFilterState *nf,
+                                      bool can_defer)
 {
-    int ret = 0;
+    ssize_t ret = 0;
     int direction;
-    NetFilterState *nf = opaque;
     NetFilterState *next = NULL;
+    NetQueue *queue;
 
     if (!sender || !sender->peer) {
         /* no receiver, or sender been deleted, no need to pass it further */
@@ -108,8 +109,20 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
      * deleted while we go through filters.
      */
     if (sender && sender->peer) {
-        qemu_net_queue_send_iov(sender->peer->incoming_queue,
-                                sender, flags, iov, iovcnt, NULL);
+        queue = sender->peer->incoming_queue;
+        if (can_defer &&
+            (!qemu_can_send_packet(sender) || !qemu_net_queue_empty(queue))) {
+            /*
+             * Keep the packet rather than have it dropped once the
+             * receiver's queue is full; qemu_flush_queued_packets()
+             * on the receiver tells us when to try again.
+             */
+            return 0;
+        }
+        ret = qemu_net_queue_send_iov(queue, sender, flags, iov, iovcnt, NULL);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
 out:
@@ -117,6 +130,49 @@ out:
     return iov_size(iov, iovcnt);
 }
 
+ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
+                                    unsigned flags,
+                                    const struct iovec *iov,
+                                    int iovcnt,
+                                    void *opaque)
+{
+    return netfilter_pass_to_next(sender, flags, iov, iovcnt, opaque, false);
+}
+
+ssize_t qemu_netfilter_try_pass_to_next(NetClientState *sender,
+                                        unsigned flags,
+                                        const struct iovec *iov,
+                                        int iovcnt,
+                                        void *opaque)
+{
+    return netfilter_pass_to_next(sender, flags, iov, iovcnt, opaque, true);
+}
+
+static void netfilter_notify_ready(NetClientState *nc)
+{
+    NetFilterState *nf, *next;
+    NetFilterClass *nfc;
+
+    QTAILQ_FOREACH_SAFE(nf, &nc->filters, next, next) {
+        nfc = NETFILTER_GET_CLASS(OBJECT(nf));
+        if (nfc->receiver_ready) {
+            nfc->receiver_ready(nf);
+        }
+    }
+}
+
+void qemu_netfilter_receiver_ready(NetClientState *nc)
+{
+    /*
+     * Packets for @nc go through the rx filters of @nc itself and the
+     * tx filters of its peer, filters are only attached to netdevs.
+     */
+    netfilter_notify_ready(nc);
+    if (nc->peer) {
+        netfilter_notify_ready(nc->peer);
+    }
+}
+
 static char *netfilter_get_netdev_id(Object *obj, Error **errp)
 {
     NetFilterState *nf = NETFILTER(obj);
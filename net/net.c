@@ -613,6 +613,7 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
          * the file descriptor (for tap, for example).
          */
         qemu_notify_event();
+        qemu_netfilter_receiver_ready(nc);
     } else if (purge) {
         /* Unable to empty the queue, purge remaining packets */
         qemu_net_queue_purge(nc->incoming_queue, nc);
@@ -645,13 +646,13 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
                          sender, flags, buf, size, sent_cb);
     if (ret) {
-        return ret;
+        return ret == NETFILTER_PACKET_QUEUED ? 0 : ret;
     }
 
     ret = filter_receive(sender->peer, NET_FILTER_DIRECTION_RX,
                          sender, flags, buf, size, sent_cb);
     if (ret) {
-        return ret;
+        return ret == NETFILTER_PACKET_QUEUED ? 0 : ret;
     }
 
     queue = sender->peer->incoming_queue;
@@ -750,13 +751,13 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
                              QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
     if (ret) {
-        return ret;
+        return ret == NETFILTER_PACKET_QUEUED ? 0 : ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
                              QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
     if (ret) {
-        return ret;
+        return ret == NETFILTER_PACKET_QUEUED ? 0 : ret;
     }
 
     queue = sender->peer->incoming_queue;
@@ -766,6 +767,45 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/*
+ * Hand several packets to the peer's receive_batch handler at once.
+ * Returns the number of packets that were consumed; the caller sends the
+ * rest with qemu_sendv_packet_async().  Only packets that would have been
+ * delivered right away are batched: nothing is sent through filters or
+ * past packets that are already queued for the peer.
+ */
+int qemu_sendv_packet_batch(NetClientState *sender, const struct iovec **iovs,
+                            const int *iovcnts, int count)
+{
+    NetClientState *peer = sender->peer;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (!peer->info->receive_batch || peer->link_down ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        !qemu_net_queue_idle(peer->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    return peer->info->receive_batch(peer, iovs, iovcnts, count);
+}
+
+/*
+ * Called by a backend around a run of qemu_send_packet*() calls for nc.
+ * Packets that are queued instead of delivered are not part of the burst.
+ */
+void qemu_net_burst(NetClientState *nc, bool begin)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->burst) {
+        peer->info->burst(peer, begin);
+    }
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1597,6 +1637,8 @@ void net_socket_rs_init(SocketReadState *rs,
     rs->index = 0;
     rs->packet_len = 0;
     memset(rs->buf, 0, sizeof(rs->buf));
+    rs->data = rs->buf;
+    rs->alloc = NULL;
     rs->finalize = finalize;
 }
 
@@ -1625,6 +1667,12 @@ int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
                 /* got length */
                 rs->packet_len = ntohl(*(uint32_t *)rs->buf);
                 rs->index = 0;
+                if (rs->packet_len > sizeof(rs->buf)) {
+                    fprintf(stderr, "serious error: oversized packet received,"
+                        "connection terminated.\n");
+                    return -1;
+                }
+                rs->data = rs->alloc ? rs->alloc(rs, rs->packet_len) : rs->buf;
                 rs->state = 1;
             }
             break;
@@ -1633,14 +1681,7 @@ int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
             if (l > size) {
                 l = size;
             }
-            if (rs->index + l <= sizeof(rs->buf)) {
-                memcpy(rs->buf + rs->index, buf, l);
-            } else {
-                fprintf(stderr, "serious error: oversized packet received,"
-                    "connection terminated.\n");
-                rs->index = rs->state = 0;
-                return -1;
-            }
+            memcpy(rs->data + rs->index, buf, l);
 
             rs->index += l;
             buf += l;
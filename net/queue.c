@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,12 +41,18 @@
  * unbounded queueing.
  */
 
+struct NetPacketBuf {
+    int refcnt;
+    uint8_t data[0];
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    NetPacketBuf *shared;   /* if set, holds the data instead of data[] */
     uint8_t data[0];
 };
 
@@ -60,6 +67,43 @@ struct NetQueue {
     unsigned delivering : 1;
 };
 
+static __thread NetFanout *current_fanout;
+
+void qemu_net_fanout_begin(NetFanout *fanout,
+                           const struct iovec *iov, int iovcnt)
+{
+    fanout->iov = iov;
+    fanout->iovcnt = iovcnt;
+    fanout->buf = NULL;
+    fanout->prev = current_fanout;
+    current_fanout = fanout;
+}
+
+static void net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (buf && --buf->refcnt == 0) {
+        g_free(buf);
+    }
+}
+
+void qemu_net_fanout_end(NetFanout *fanout)
+{
+    assert(current_fanout == fanout);
+    current_fanout = fanout->prev;
+    net_packet_buf_unref(fanout->buf);
+}
+
+static const uint8_t *qemu_net_packet_data(NetPacket *packet)
+{
+    return packet->shared ? packet->shared->data : packet->data;
+}
+
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    net_packet_buf_unref(packet->shared);
+    g_free(packet);
+}
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
@@ -84,7 +128,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
 
     g_free(queue);
@@ -107,6 +151,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->shared = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -120,6 +165,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                int iovcnt,
                                NetPacketSent *sent_cb)
 {
+    NetFanout *fanout = current_fanout;
     NetPacket *packet;
     size_t max_len = 0;
     int i;
@@ -131,11 +177,31 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
+    if (fanout && fanout->iov == iov && fanout->iovcnt == iovcnt) {
+        if (!fanout->buf) {
+            fanout->buf = g_malloc(sizeof(NetPacketBuf) + max_len);
+            fanout->buf->refcnt = 1;
+            iov_to_buf(iov, iovcnt, 0, fanout->buf->data, max_len);
+        }
+        packet = g_new(NetPacket, 1);
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = max_len;
+        packet->shared = fanout->buf;
+        fanout->buf->refcnt++;
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     packet = g_malloc(sizeof(NetPacket) + max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->shared = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -232,6 +298,27 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+void qemu_net_queue_set_maxlen(NetQueue *queue, uint32_t maxlen)
+{
+    queue->nq_maxlen = maxlen;
+}
+
+bool qemu_net_queue_full(NetQueue *queue)
+{
+    return queue->nq_count >= queue->nq_maxlen;
+}
+
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return QTAILQ_EMPTY(&queue->packets);
+}
+
+/* True if a packet sent now would not be reordered with queued ones */
+bool qemu_net_queue_idle(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -243,7 +330,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 }
@@ -261,7 +348,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     qemu_net_packet_data(packet),
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
@@ -273,7 +360,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
@@ -44,8 +44,14 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_RECVMMSG
+    uint8_t *dgram_bufs;          /* recvmmsg() buffers (SOCK_DGRAM) */
+#endif
 } NetSocketState;
 
+/* Datagrams read by one recvmmsg() call */
+#define NET_SOCKET_RX_BATCH 8
+
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
@@ -131,6 +137,39 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_batch_dgram(NetClientState *nc,
+                                          const struct iovec **iovs,
+                                          const int *iovcnts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[count];
+    int i, ret;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+        msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = iovcnts[i];
+    }
+
+    do {
+        ret = sendmmsg(s->fd, msgs, count, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return 0;
+        }
+        /* Drop the packet that failed, like net_socket_receive_dgram() */
+        return 1;
+    }
+    return ret;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -189,6 +228,51 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_RECVMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_RX_BATCH];
+    struct iovec iov[NET_SOCKET_RX_BATCH];
+    bool queued = false;
+    int i, count;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_RX_BATCH; i++) {
+        iov[i].iov_base = s->dgram_bufs + i * NET_BUFSIZE;
+        iov[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        count = recvmmsg(s->fd, msgs, NET_SOCKET_RX_BATCH, 0, NULL);
+    } while (count == -1 && errno == EINTR);
+    if (count < 0) {
+        return;
+    }
+
+    qemu_net_burst(&s->nc, true);
+    for (i = 0; i < count; i++) {
+        if (msgs[i].msg_len == 0) {
+            /* end of connection */
+            net_socket_read_poll(s, false);
+            net_socket_write_poll(s, false);
+            break;
+        }
+        /* Datagrams already read are queued rather than lost */
+        if (qemu_send_packet_async(&s->nc, iov[i].iov_base, msgs[i].msg_len,
+                                   net_socket_send_completed) == 0) {
+            queued = true;
+        }
+    }
+    qemu_net_burst(&s->nc, false);
+
+    if (queued) {
+        net_socket_read_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -208,6 +292,7 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -308,12 +393,19 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_RECVMMSG
+    g_free(s->dgram_bufs);
+    s->dgram_bufs = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_batch_dgram,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -366,6 +458,9 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_RECVMMSG
+    s->dgram_bufs = g_malloc(NET_SOCKET_RX_BATCH * NET_BUFSIZE);
+#endif
     net_socket_rs_init(&s->rs, net_socket_rs_finalize);
     net_socket_read_poll(s, true);
 
@@ -25,6 +25,7 @@ typedef struct VhostUserState {
     guint watch;
     uint64_t acked_features;
     bool started;
+    bool keep_link_up;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -197,6 +198,24 @@ static gboolean net_vhost_user_watch(GIOChannel *chan, GIOCondition cond,
     return FALSE;
 }
 
+/* Stop or restart the vhost rings without changing the link status the guest
+ * sees: virtio-net runs vhost only while the backend side of the link is up.
+ */
+static void net_vhost_user_set_backend_link(int queues, NetClientState *ncs[],
+                                            bool up)
+{
+    NetClientState *peer = ncs[0]->peer;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
+    }
+
+    if (peer && peer->info->link_status_changed) {
+        peer->info->link_status_changed(peer);
+    }
+}
+
 static void net_vhost_user_event(void *opaque, int event)
 {
     const char *name = opaque;
@@ -220,11 +239,19 @@ static void net_vhost_user_event(void *opaque, int event)
             qemu_chr_disconnect(s->chr);
             return;
         }
-        qmp_set_link(name, true, &err);
+        if (s->keep_link_up) {
+            net_vhost_user_set_backend_link(queues, ncs, true);
+        } else {
+            qmp_set_link(name, true, &err);
+        }
         s->started = true;
         break;
     case CHR_EVENT_CLOSED:
-        qmp_set_link(name, false, &err);
+        if (s->keep_link_up) {
+            net_vhost_user_set_backend_link(queues, ncs, false);
+        } else {
+            qmp_set_link(name, false, &err);
+        }
         vhost_user_stop(queues, ncs);
         g_source_remove(s->watch);
         s->watch = 0;
@@ -238,7 +265,7 @@ static void net_vhost_user_event(void *opaque, int event)
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, CharDriverState *chr,
-                               int queues)
+                               int queues, bool keep_link_up)
 {
     NetClientState *nc, *nc0 = NULL;
     VhostUserState *s;
@@ -260,6 +287,7 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
 
         s = DO_UPCAST(VhostUserState, nc, nc);
         s->chr = chr;
+        s->keep_link_up = keep_link_up;
     }
 
     s = DO_UPCAST(VhostUserState, nc, nc0);
@@ -376,5 +404,7 @@ int net_init_vhost_user(const Netdev *netdev, const char *name,
         return -1;
     }
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
+    return net_vhost_user_init(peer, "vhost_user", name, chr, queues,
+                               vhost_user_opts->has_keep_link_up &&
+                               vhost_user_opts->keep_link_up);
 }
@@ -37,6 +37,9 @@
 #include "hw/mem/pc-dimm.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "qemu/thread.h"
+#include "sysemu/iothread.h"
+#include "qapi/error.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -50,6 +53,7 @@ static int max_numa_nodeid; /* Highest specified NUMA node ID, plus one.
                              * For all nodes, nodeid < max_numa_nodeid
                              */
 int nb_numa_nodes;
+static bool numa_parsed;        /* -numa options have been parsed */
 NodeInfo numa_info[MAX_NODES];
 
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node)
@@ -172,6 +176,18 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         bitmap_set(numa_info[nodenr].node_cpu, cpus->value, 1);
     }
 
+    for (cpus = node->host_cpus; cpus; cpus = cpus->next) {
+        if (cpus->value >= MAX_HOST_CPUS) {
+            error_setg(errp,
+                       "Host CPU index (%" PRIu16 ")"
+                       " should be smaller than %d",
+                       cpus->value, MAX_HOST_CPUS);
+            return;
+        }
+        bitmap_set(numa_info[nodenr].host_cpus, cpus->value, 1);
+        numa_info[nodenr].has_host_cpus = true;
+    }
+
     if (node->has_mem && node->has_memdev) {
         error_setg(errp, "qemu: cannot specify both mem= and memdev=");
         return;
@@ -388,6 +404,67 @@ void parse_numa_opts(MachineClass *mc)
     } else {
         numa_set_mem_node_id(0, ram_size, 0);
     }
+    numa_parsed = true;
+}
+
+int numa_get_node_for_cpu(int idx)
+{
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(idx, numa_info[i].node_cpu)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Run @thread on the host CPUs given for guest node @nodeid, so that it
+ * stays close to the memory the node's memdev is bound to.  Before
+ * -numa options are parsed this does nothing; IOThreads created that
+ * early are bound by numa_post_machine_init().
+ */
+void numa_set_thread_affinity(QemuThread *thread, int nodeid, Error **errp)
+{
+    int ret;
+
+    if (!numa_parsed) {
+        return;
+    }
+    if (nodeid < 0 || nodeid >= nb_numa_nodes) {
+        error_setg(errp, "NUMA node %d does not exist", nodeid);
+        return;
+    }
+    if (!numa_info[nodeid].has_host_cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(thread, numa_info[nodeid].host_cpus,
+                                   MAX_HOST_CPUS);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Cannot bind thread to the host CPUs of NUMA node %d",
+                         nodeid);
+    }
+}
+
+static int numa_bind_iothread(Object *obj, void *opaque)
+{
+    IOThread *iothread;
+    Error *err = NULL;
+
+    if (!object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+        return 0;
+    }
+    iothread = IOTHREAD(obj);
+    if (iothread->numa_node >= 0 && iothread->ctx) {
+        numa_set_thread_affinity(&iothread->thread, iothread->numa_node, &err);
+        if (err) {
+            error_report_err(err);
+        }
+    }
+    return 0;
 }
 
 void numa_post_machine_init(void)
@@ -395,6 +472,8 @@ void numa_post_machine_init(void)
     CPUState *cpu;
     int i;
 
+    object_child_foreach(object_get_objects_root(), numa_bind_iothread, NULL);
+
     CPU_FOREACH(cpu) {
         for (i = 0; i < nb_numa_nodes; i++) {
             if (test_bit(cpu->cpu_index, numa_info[i].node_cpu)) {
@@ -26,8 +26,15 @@
     do { } while (0)
 #endif
 
-/* the page in cache will not be replaced in two cycles */
-#define CACHED_PAGE_LIFETIME 2
+/*
+ * The cache is set associative: a page can only be cached in one set of
+ * PAGE_CACHE_WAYS items, picked from its address, and replaces one of
+ * them with the CLOCK algorithm.  Each item has a referenced bit, set
+ * when it is hit.  The hand of the set skips and clears the referenced
+ * items and stops on the first one that isn't, so pages that keep being
+ * hit stay while pages only seen once make room for each other.
+ */
+#define PAGE_CACHE_WAYS 8
 
 typedef struct CacheItem CacheItem;
 
@@ -35,13 +42,17 @@ struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    bool it_referenced;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    /* CLOCK hand of each set */
+    unsigned int *hands;
     unsigned int page_size;
+    unsigned int ways;
     int64_t max_num_items;
-    uint64_t max_item_age;
+    int64_t num_sets;
     int64_t num_items;
 };
 
@@ -69,16 +80,21 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->hands = g_try_malloc0(cache->num_sets * sizeof(*cache->hands));
+    if (!cache->page_cache || !cache->hands) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->hands);
         g_free(cache);
         return NULL;
     }
@@ -87,6 +103,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_referenced = false;
     }
 
     return cache;
@@ -104,32 +121,39 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->ways];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,28 +163,58 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_referenced = true;
         return true;
     }
     return false;
 }
 
+/* Pick the item of @addr's set that a new page goes to. */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr)
+{
+    size_t set_idx = cache_get_set(cache, addr);
+    CacheItem *set = &cache->page_cache[set_idx * cache->ways];
+    unsigned int *hand = &cache->hands[set_idx];
+    CacheItem *it;
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+    }
+
+    /* at most one turn clearing the referenced bits, and one more item */
+    while (true) {
+        it = &set[*hand];
+        *hand = (*hand + 1) % cache->ways;
+        if (!it->it_referenced) {
+            return it;
+        }
+        it->it_referenced = false;
+    }
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            DPRINTF("Evicting %" PRIx64 " for %" PRIx64 "\n",
+                    it->it_addr, addr);
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -176,7 +230,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     it->it_age = current_age;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -207,9 +261,9 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
+        if (old_it->it_data) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -218,16 +272,18 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                     new_cache->num_items++;
                 }
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+                *new_it = *old_it;
             }
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = new_cache->page_cache;
+    cache->hands = new_cache->hands;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
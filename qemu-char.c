@@ -35,6 +35,7 @@
 #include "qapi/clone-visitor.h"
 #include "qapi-visit.h"
 #include "qemu/base64.h"
+#include "qemu/iov.h"
 #include "io/channel-socket.h"
 #include "io/channel-file.h"
 #include "io/channel-tls.h"
@@ -237,12 +238,14 @@ static void qemu_chr_fe_write_log(CharDriverState *s,
     }
 }
 
-static int qemu_chr_fe_write_buffer(CharDriverState *s, const uint8_t *buf, int len, int *offset)
+/* Called with chr_write_lock held.  */
+static int qemu_chr_fe_write_buffer_locked(CharDriverState *s,
+                                           const uint8_t *buf, int len,
+                                           int *offset)
 {
     int res = 0;
     *offset = 0;
 
-    qemu_mutex_lock(&s->chr_write_lock);
     while (*offset < len) {
     retry:
         res = s->chr_write(s, buf + *offset, len - *offset);
@@ -260,6 +263,17 @@ static int qemu_chr_fe_write_buffer(CharDriverState *s, const uint8_t *buf, int
     if (*offset > 0) {
         qemu_chr_fe_write_log(s, buf, *offset);
     }
+
+    return res;
+}
+
+static int qemu_chr_fe_write_buffer(CharDriverState *s,
+                                    const uint8_t *buf, int len, int *offset)
+{
+    int res;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    res = qemu_chr_fe_write_buffer_locked(s, buf, len, offset);
     qemu_mutex_unlock(&s->chr_write_lock);
 
     return res;
@@ -317,6 +331,89 @@ int qemu_chr_fe_write_all(CharDriverState *s, const uint8_t *buf, int len)
     return offset;
 }
 
+/* Called with chr_write_lock held.  */
+static int qemu_chr_fe_writev_locked(CharDriverState *s,
+                                     const struct iovec *iov, int iovcnt,
+                                     size_t *offset)
+{
+    size_t size = iov_size(iov, iovcnt);
+    const struct iovec *cur = iov;
+    struct iovec *rest = NULL;
+    int cnt = iovcnt;
+    int res = 0;
+
+    *offset = 0;
+    while (*offset < size) {
+        if (*offset) {
+            /* partial write, only the rest of the vector is sent again */
+            if (!rest) {
+                rest = g_new(struct iovec, iovcnt);
+            }
+            cnt = iov_copy(rest, iovcnt, iov, iovcnt, *offset, size - *offset);
+            cur = rest;
+        }
+    retry:
+        res = s->chr_writev(s, cur, cnt);
+        if (res < 0 && errno == EAGAIN) {
+            g_usleep(100);
+            goto retry;
+        }
+
+        if (res <= 0) {
+            break;
+        }
+
+        *offset += res;
+    }
+    g_free(rest);
+
+    return res;
+}
+
+int qemu_chr_fe_writev_all(CharDriverState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    size_t offset = 0, done, len;
+    int res = 0;
+    int i, written;
+
+    if (s->replay) {
+        /* the replay log records whole buffers */
+        size_t size = iov_size(iov, iovcnt);
+        uint8_t *buf = g_malloc(size);
+
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+        res = qemu_chr_fe_write_all(s, buf, size);
+        g_free(buf);
+        return res;
+    }
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->chr_writev) {
+        res = qemu_chr_fe_writev_locked(s, iov, iovcnt, &offset);
+        for (i = 0, done = 0; i < iovcnt && done < offset; i++) {
+            len = MIN(iov[i].iov_len, offset - done);
+            qemu_chr_fe_write_log(s, iov[i].iov_base, len);
+            done += len;
+        }
+    } else {
+        for (i = 0; i < iovcnt; i++) {
+            res = qemu_chr_fe_write_buffer_locked(s, iov[i].iov_base,
+                                                  iov[i].iov_len, &written);
+            offset += written;
+            if (written < iov[i].iov_len) {
+                break;
+            }
+        }
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+
+    if (res < 0) {
+        return res;
+    }
+    return offset;
+}
+
 int qemu_chr_fe_read_all(CharDriverState *s, uint8_t *buf, int len)
 {
     int offset = 0, counter = 10;
@@ -1011,6 +1108,26 @@ static int io_channel_send_full(QIOChannel *ioc,
 }
 
 
+/* Send at most one partial write of @iov, like a single write(2) */
+static int io_channel_sendv_full(QIOChannel *ioc,
+                                 const struct iovec *iov, size_t niov,
+                                 int *fds, size_t nfds)
+{
+    ssize_t ret;
+
+    ret = qio_channel_writev_full(ioc, iov, niov, fds, nfds, NULL);
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        errno = EAGAIN;
+        return -1;
+    } else if (ret < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ret;
+}
+
+
 #ifndef _WIN32
 static int io_channel_send(QIOChannel *ioc, const void *buf, size_t len)
 {
@@ -2653,8 +2770,21 @@ typedef struct {
     guint reconnect_timer;
     int64_t reconnect_time;
     bool connect_err_reported;
+
+    /* Output ring, protected by chr_write_lock; and batched reads */
+    uint8_t *ring;
+    size_t ring_size;
+    size_t ring_head;
+    size_t ring_len;
+    GSource *ring_source;
+    GMainContext *context;
+    uint8_t *rbuf;
 } TCPCharDriver;
 
+#define TCP_CHR_RING_MAX (1 << 30)
+#define TCP_CHR_RBUF_LEN 65536
+#define TCP_CHR_READ_BATCH 16
+
 static gboolean socket_reconnect_timeout(gpointer opaque);
 
 static void qemu_chr_socket_restart_timer(CharDriverState *chr)
@@ -2682,10 +2812,156 @@ static gboolean tcp_chr_accept(QIOChannel *chan,
                                GIOCondition cond,
                                void *opaque);
 
+/* Send as much of the output ring as the socket takes without blocking.
+ * Called with chr_write_lock held.
+ */
+static int tcp_chr_ring_flush(TCPCharDriver *s)
+{
+    while (s->ring_len) {
+        struct iovec iov[2];
+        ssize_t ret;
+
+        iov[0].iov_base = s->ring + s->ring_head;
+        iov[0].iov_len = MIN(s->ring_len, s->ring_size - s->ring_head);
+        iov[1].iov_base = s->ring;
+        iov[1].iov_len = s->ring_len - iov[0].iov_len;
+
+        ret = qio_channel_writev(s->ioc, iov, iov[1].iov_len ? 2 : 1, NULL);
+        if (ret == QIO_CHANNEL_ERR_BLOCK) {
+            break;
+        } else if (ret < 0) {
+            /* The read side notices the broken connection */
+            s->ring_head = s->ring_len = 0;
+            errno = EINVAL;
+            return -1;
+        }
+
+        s->ring_head = (s->ring_head + ret) % s->ring_size;
+        s->ring_len -= ret;
+    }
+    return 0;
+}
+
+static gboolean tcp_chr_ring_io(QIOChannel *ioc G_GNUC_UNUSED,
+                                GIOCondition cond G_GNUC_UNUSED,
+                                void *opaque)
+{
+    CharDriverState *chr = opaque;
+    TCPCharDriver *s = chr->opaque;
+    gboolean again;
+
+    qemu_mutex_lock(&chr->chr_write_lock);
+    again = tcp_chr_ring_flush(s) == 0 && s->ring_len;
+    if (!again) {
+        g_source_unref(s->ring_source);
+        s->ring_source = NULL;
+    }
+    qemu_mutex_unlock(&chr->chr_write_lock);
+
+    return again;
+}
+
+/* Called with chr_write_lock held.  */
+static void tcp_chr_ring_watch(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->ring_source) {
+        return;
+    }
+    s->ring_source = qio_channel_create_watch(s->ioc, G_IO_OUT);
+    g_source_set_callback(s->ring_source, (GSourceFunc)tcp_chr_ring_io,
+                          chr, NULL);
+    g_source_attach(s->ring_source, s->context);
+}
+
+/* Called with chr_write_lock held.  */
+static void tcp_chr_ring_reset(TCPCharDriver *s)
+{
+    if (s->ring_source) {
+        g_source_destroy(s->ring_source);
+        g_source_unref(s->ring_source);
+        s->ring_source = NULL;
+    }
+    s->ring_head = s->ring_len = 0;
+}
+
+/* Write what the socket takes right away, and queue as much of the rest
+ * as fits in the ring; the ring is flushed from the frontend's context.
+ * Called with chr_write_lock held.
+ */
+static int tcp_chr_ring_writev(CharDriverState *chr, const struct iovec *iov,
+                               int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    size_t len = iov_size(iov, iovcnt);
+    size_t done = 0;
+
+    if (tcp_chr_ring_flush(s) < 0) {
+        return -1;
+    }
+
+    if (!s->ring_len) {
+        ssize_t ret = qio_channel_writev(s->ioc, iov, iovcnt, NULL);
+        if (ret == QIO_CHANNEL_ERR_BLOCK) {
+            ret = 0;
+        } else if (ret < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        done = ret;
+    }
+
+    while (done < len && s->ring_len < s->ring_size) {
+        size_t tail = (s->ring_head + s->ring_len) % s->ring_size;
+        size_t n = MIN(len - done, s->ring_size - s->ring_len);
+
+        n = MIN(n, s->ring_size - tail);
+        iov_to_buf(iov, iovcnt, done, s->ring + tail, n);
+        s->ring_len += n;
+        done += n;
+    }
+
+    if (s->ring_len) {
+        tcp_chr_ring_watch(chr);
+    }
+    if (!done) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+/* File descriptors cannot be queued: send them only after the ring drained.
+ * Called with chr_write_lock held.
+ */
+static int tcp_chr_ring_drain(TCPCharDriver *s)
+{
+    if (tcp_chr_ring_flush(s) < 0) {
+        return -1;
+    }
+    if (s->ring_len) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
 /* Called with chr_write_lock held.  */
 static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     TCPCharDriver *s = chr->opaque;
+
+    if (s->connected && s->ring) {
+        if (!s->write_msgfds_num) {
+            struct iovec iov = { .iov_base = (uint8_t *)buf, .iov_len = len };
+            return tcp_chr_ring_writev(chr, &iov, 1);
+        }
+        if (tcp_chr_ring_drain(s) < 0) {
+            return -1;
+        }
+    }
+
     if (s->connected) {
         int ret =  io_channel_send_full(s->ioc, buf, len,
                                         s->write_msgfds,
@@ -2705,6 +2981,40 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->connected && s->ring) {
+        if (!s->write_msgfds_num) {
+            return tcp_chr_ring_writev(chr, iov, iovcnt);
+        }
+        if (tcp_chr_ring_drain(s) < 0) {
+            return -1;
+        }
+    }
+
+    if (s->connected) {
+        int ret = io_channel_sendv_full(s->ioc, iov, iovcnt,
+                                        s->write_msgfds,
+                                        s->write_msgfds_num);
+
+        /* free the written msgfds, no matter what */
+        if (s->write_msgfds_num) {
+            g_free(s->write_msgfds);
+            s->write_msgfds = 0;
+            s->write_msgfds_num = 0;
+        }
+
+        return ret;
+    } else {
+        /* XXX: indicate an error ? */
+        return iov_size(iov, iovcnt);
+    }
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2898,6 +3208,9 @@ static void tcp_chr_free_connection(CharDriverState *chr)
 
     tcp_set_msgfds(chr, NULL, 0);
     remove_fd_in_watch(chr);
+    qemu_mutex_lock(&chr->chr_write_lock);
+    tcp_chr_ring_reset(s);
+    qemu_mutex_unlock(&chr->chr_write_lock);
     object_unref(OBJECT(s->sioc));
     s->sioc = NULL;
     object_unref(OBJECT(s->ioc));
@@ -2929,6 +3242,42 @@ static void tcp_chr_disconnect(CharDriverState *chr)
     }
 }
 
+/* Keep reading while the frontend has room, rather than waiting for
+ * another wakeup after every READ_BUF_LEN bytes.
+ */
+static void tcp_chr_read_batch(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+    int i, len, size;
+
+    for (i = 0; i < TCP_CHR_READ_BATCH && s->max_size > 0; i++) {
+        len = MIN(s->max_size, TCP_CHR_RBUF_LEN);
+        size = tcp_chr_recv(chr, (void *)s->rbuf, len);
+        if (size < 0 && errno == EAGAIN) {
+            break;
+        } else if (size <= 0) {
+            /* connection closed */
+            tcp_chr_disconnect(chr);
+            break;
+        }
+
+        if (s->do_telnetopt) {
+            int n = size;
+            tcp_chr_process_IAC_bytes(chr, s, s->rbuf, &n);
+            if (n > 0) {
+                qemu_chr_be_write(chr, s->rbuf, n);
+            }
+        } else {
+            qemu_chr_be_write(chr, s->rbuf, size);
+        }
+
+        if (!s->connected || size < len) {
+            break;
+        }
+        s->max_size = qemu_chr_be_can_write(chr);
+    }
+}
+
 static gboolean tcp_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2939,6 +3288,10 @@ static gboolean tcp_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
     if (!s->connected || s->max_size <= 0) {
         return TRUE;
     }
+    if (s->rbuf) {
+        tcp_chr_read_batch(chr);
+        return TRUE;
+    }
     len = sizeof(buf);
     if (len > s->max_size)
         len = s->max_size;
@@ -3000,6 +3353,7 @@ static void tcp_chr_update_read_handler(CharDriverState *chr,
 {
     TCPCharDriver *s = chr->opaque;
 
+    s->context = context;
     if (!s->connected) {
         return;
     }
@@ -3258,6 +3612,8 @@ static void tcp_chr_close(CharDriverState *chr)
     if (s->tls_creds) {
         object_unref(OBJECT(s->tls_creds));
     }
+    g_free(s->ring);
+    g_free(s->rbuf);
     g_free(s);
     qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
 }
@@ -3750,6 +4106,7 @@ static void qemu_chr_parse_socket(QemuOpts *opts, ChardevBackend *backend,
     bool is_telnet      = qemu_opt_get_bool(opts, "telnet", false);
     bool do_nodelay     = !qemu_opt_get_bool(opts, "delay", true);
     int64_t reconnect   = qemu_opt_get_number(opts, "reconnect", 0);
+    uint64_t ring_size  = qemu_opt_get_size(opts, "ring-size", 0);
     const char *path = qemu_opt_get(opts, "path");
     const char *host = qemu_opt_get(opts, "host");
     const char *port = qemu_opt_get(opts, "port");
@@ -3787,6 +4144,8 @@ static void qemu_chr_parse_socket(QemuOpts *opts, ChardevBackend *backend,
     sock->has_reconnect = true;
     sock->reconnect = reconnect;
     sock->tls_creds = g_strdup(tls_creds);
+    sock->has_ring_size = ring_size != 0;
+    sock->ring_size = ring_size;
 
     addr = g_new0(SocketAddress, 1);
     if (path) {
@@ -4225,6 +4584,9 @@ QemuOptsList qemu_chardev_opts = {
         },{
             .name = "reconnect",
             .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "ring-size",
+            .type = QEMU_OPT_SIZE,
         },{
             .name = "telnet",
             .type = QEMU_OPT_BOOL,
@@ -4488,11 +4850,22 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
         }
     }
 
+    if (sock->has_ring_size && sock->ring_size) {
+        if (sock->ring_size > TCP_CHR_RING_MAX) {
+            error_setg(errp, "ring-size must be at most %d", TCP_CHR_RING_MAX);
+            goto error;
+        }
+        s->ring_size = sock->ring_size;
+        s->ring = g_malloc(s->ring_size);
+        s->rbuf = g_malloc(TCP_CHR_RBUF_LEN);
+    }
+
     s->addr = QAPI_CLONE(SocketAddress, sock->addr);
 
     chr->opaque = s;
     chr->chr_wait_connected = tcp_chr_wait_connected;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
     chr->chr_sync_read = tcp_chr_sync_read;
     chr->chr_close = tcp_chr_close;
     chr->chr_disconnect = tcp_chr_disconnect;
@@ -4550,6 +4923,8 @@ static CharDriverState *qmp_chardev_open_socket(const char *id,
     if (s->tls_creds) {
         object_unref(OBJECT(s->tls_creds));
     }
+    g_free(s->ring);
+    g_free(s->rbuf);
     g_free(s);
     qemu_chr_free_common(chr);
     return NULL;
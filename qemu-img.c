@@ -32,6 +32,7 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/sysemu.h"
@@ -59,6 +60,9 @@ enum {
     OPTION_PATTERN = 260,
     OPTION_FLUSH_INTERVAL = 261,
     OPTION_NO_DRAIN = 262,
+    OPTION_RANDOM = 263,
+    OPTION_WRITE_PERCENT = 264,
+    OPTION_TIME = 265,
 };
 
 typedef enum OutputFormat {
@@ -149,6 +153,11 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow out of order writes during convert (only recommended for\n"
+           "       preallocated targets such as raw block devices)\n"
+           "  '-C' offload the copy to the host kernel when supported (e.g. reflinks,\n"
+           "       copy_file_range); cannot be combined with '-c' or '-S'\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -921,7 +930,7 @@ static int img_commit(int argc, char **argv)
     };
 
     commit_active_start("commit", bs, base_bs, 0, BLOCKDEV_ON_ERROR_REPORT,
-                        common_block_job_cb, &cbi, &local_err);
+                        common_block_job_cb, &cbi, &local_err, false);
     if (local_err) {
         goto done;
     }
@@ -1431,6 +1440,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1447,15 +1458,29 @@ typedef struct ImgConvertState {
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+    bool wr_in_order;
+    bool copy_range;
+    bool pipelined_compressed;
+    QEMUBH *wake_bh;
+    int64_t sector_num;
+    int64_t wr_offs;
+    int64_t allocated_done;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    assert(sector_num >= *src_cur_offset);
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1464,7 +1489,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1527,9 +1552,11 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
+    int src_cur = 0;
+    int64_t src_cur_offset = 0;
     int n;
     int ret;
 
@@ -1537,18 +1564,24 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     while (nb_sectors > 0) {
         BlockBackend *blk;
         int64_t bs_sectors;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_pread(blk,
-                        (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
-                        buf, n << BDRV_SECTOR_BITS);
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(blk,
+                            (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                            n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1561,15 +1594,56 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+/*
+ * Copies data sectors from the source to the target without reading them
+ * into a buffer.  Returns -ENOTSUP if the block drivers can't offload it.
+ */
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    int src_cur = 0;
+    int64_t src_cur_offset = 0;
+    int n;
+    int ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int64_t bs_sectors, src_offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        src_offset = (sector_num - src_cur_offset) << BDRV_SECTOR_BITS;
+
+        ret = blk_co_copy_range(blk, src_offset,
+                                s->target, sector_num << BDRV_SECTOR_BITS,
+                                n << BDRV_SECTOR_BITS, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1603,8 +1677,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                 buf, n << BDRV_SECTOR_BITS, 0);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1616,8 +1694,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, 0);
+            ret = blk_co_pwrite_zeroes(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       n << BDRV_SECTOR_BITS, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1632,11 +1711,172 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/* Enter the coroutine waiting to write the chunk at s->wr_offs, if any */
+static void convert_wake_writer(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+            qemu_coroutine_enter(s->co[i]);
+            break;
+        }
+    }
+}
+
+static void convert_wake_writer_bh(void *opaque)
+{
+    convert_wake_writer(opaque);
+}
+
+/*
+ * Each copy coroutine takes the next chunk of the image, reads it into its
+ * own buffer and writes it out.  Reads always overlap; writes are issued in
+ * image order only if s->wr_in_order is set, otherwise as soon as the data
+ * is there.  With s->copy_range, data chunks are copied by the block layer
+ * in a single step that is ordered like a write.
+ *
+ * With s->pipelined_compressed, the target keeps compressed writes in the
+ * order they were issued, so the next chunk may be issued as soon as this
+ * one has been: the clusters are then compressed in parallel.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+        bool copy_range;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto out;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            goto out;
+        }
+        /* The block status is shared, keep a copy for this chunk */
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && s->status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        /* Let the other coroutines move on to the next chunk */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA && !copy_range) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            status = BLK_DATA;
+            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (s->wr_in_order) {
+            /* Wait until all preceding chunks have been written */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+
+            if (s->pipelined_compressed) {
+                /* The wakeup only runs once our write has been issued and
+                 * yields */
+                s->wr_offs = sector_num + n;
+                qemu_bh_schedule(s->wake_bh);
+            }
+        }
+
+        if (copy_range) {
+            ret = convert_co_copy_range(s, sector_num, n);
+            if (ret == -ENOTSUP) {
+                /* Bounce this and all further chunks through the buffer */
+                s->copy_range = copy_range = false;
+                ret = convert_co_read(s, sector_num, n, buf);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 ": %s", sector_num, strerror(-ret));
+                    s->ret = ret;
+                    goto out;
+                }
+            } else if (ret < 0) {
+                error_report("error while copying sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        }
+
+        if (!copy_range) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        }
+
+        if (s->wr_in_order && !s->pipelined_compressed) {
+            /* Wake up the coroutine holding the next chunk, if it is done
+             * reading.  It cannot be us: our wait_sector_num is -1.
+             */
+            s->wr_offs = sector_num + n;
+            convert_wake_writer(s);
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1663,7 +1903,12 @@ static int convert_do_copy(ImgConvertState *s)
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    /* Only compressed writes may overlap, which leaves out the zero writes
+     * needed without zero initialisation */
+    s->pipelined_compressed = s->pipelined_compressed && s->compressed &&
+                              s->wr_in_order && s->has_zero_init;
+    s->wake_bh = qemu_bh_new(convert_wake_writer_bh, s);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1685,44 +1930,25 @@ static int convert_do_copy(ImgConvertState *s)
     s->src_cur = 0;
     s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
 
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    while (s->ret == -EINPROGRESS) {
+        main_loop_wait(false);
+    }
 
-        sector_num += n;
+    ret = s->ret;
+    if (ret < 0) {
+        goto fail;
     }
 
     if (s->compressed) {
@@ -1735,7 +1961,9 @@ static int convert_do_copy(ImgConvertState *s)
 
     ret = 0;
 fail:
-    qemu_vfree(buf);
+    if (s->wake_bh) {
+        qemu_bh_delete(s->wake_bh);
+    }
     return ret;
 }
 
@@ -1764,6 +1992,11 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    bool copy_range = false;
+    bool pipelined_compressed = false;
+    bool explicit_min_sparse = false;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1779,7 +2012,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:WC",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1854,6 +2087,7 @@ static int img_convert(int argc, char **argv)
             }
 
             min_sparse = sval / BDRV_SECTOR_SIZE;
+            explicit_min_sparse = true;
             break;
         }
         case 'p':
@@ -1871,6 +2105,21 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
+        case 'C':
+            copy_range = true;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -2117,6 +2366,20 @@ static int img_convert(int argc, char **argv)
     } else {
         compress = compress || bdi.needs_compressed_writes;
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        pipelined_compressed = bdi.pipelined_compressed_writes;
+    }
+
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
+    if (copy_range && (compress || explicit_min_sparse)) {
+        error_report("Copy offloading cannot be combined with compression "
+                     "or sparse detection");
+        ret = -1;
+        goto out;
     }
 
     state = (ImgConvertState) {
@@ -2130,6 +2393,10 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .copy_range         = copy_range,
+        .pipelined_compressed = pipelined_compressed,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3469,23 +3736,115 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Request latencies are binned with 16 linear sub-buckets for each power
+ * of two nanoseconds, which keeps the reported percentiles within 1/16
+ * of the real value.
+ */
+#define BENCH_LAT_SUB_BITS  4
+#define BENCH_LAT_BUCKETS   (64 << BENCH_LAT_SUB_BITS)
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchReq {
+    BenchData *b;
+    QEMUIOVector *qiov;
+    int64_t start;
+    bool write;
+    struct BenchReq *next;
+} BenchReq;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int write_percent;
+    bool random;
     int bufsize;
     int step;
     int nrreq;
     int n;
     int flush_interval;
     bool drain_on_flush;
+    int64_t deadline;
     uint8_t *buf;
     QEMUIOVector *qiov;
+    BenchReq *reqs;
+    BenchReq *free_reqs;
 
     int in_flight;
     bool in_flush;
+    uint64_t start_offset;
+    uint64_t nr_blocks;
     uint64_t offset;
-} BenchData;
+
+    uint64_t nr_reads;
+    uint64_t nr_writes;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t lat_total;
+    uint64_t *lat_hist;
+};
+
+static int bench_lat_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << BENCH_LAT_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return ((msb - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS) |
+           ((ns >> (msb - BENCH_LAT_SUB_BITS)) &
+            ((1 << BENCH_LAT_SUB_BITS) - 1));
+}
+
+/* Smallest latency that falls into @bucket */
+static uint64_t bench_lat_bucket_start(int bucket)
+{
+    int hi = bucket >> BENCH_LAT_SUB_BITS;
+    int lo = bucket & ((1 << BENCH_LAT_SUB_BITS) - 1);
+
+    if (!hi) {
+        return lo;
+    }
+    return (uint64_t)((1 << BENCH_LAT_SUB_BITS) | lo) << (hi - 1);
+}
+
+static uint64_t bench_lat_percentile(BenchData *b, double pct)
+{
+    uint64_t n = b->nr_reads + b->nr_writes;
+    double exact = n * pct / 100;
+    uint64_t target = exact;
+    uint64_t sum = 0;
+    int i;
+
+    if (target < exact || !target) {
+        target++;
+    }
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        sum += b->lat_hist[i];
+        if (sum >= target) {
+            return MIN(MAX(bench_lat_bucket_start(i), b->lat_min),
+                       b->lat_max);
+        }
+    }
+    return b->lat_max;
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset = b->offset;
+
+    if (b->random) {
+        uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+        return b->start_offset + (r % b->nr_blocks) * b->bufsize;
+    }
+
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3495,6 +3854,31 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static void bench_cb(void *opaque, int ret);
+
+static void bench_req_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchData *b = req->b;
+    uint64_t lat = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - req->start;
+
+    if (ret >= 0) {
+        if (req->write) {
+            b->nr_writes++;
+        } else {
+            b->nr_reads++;
+        }
+        b->lat_min = MIN(b->lat_min, lat);
+        b->lat_max = MAX(b->lat_max, lat);
+        b->lat_total += lat;
+        b->lat_hist[bench_lat_bucket(lat)]++;
+    }
+
+    req->next = b->free_reqs;
+    b->free_reqs = req;
+    bench_cb(b, ret);
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -3539,21 +3923,33 @@ static void bench_cb(void *opaque, int ret)
         }
     }
 
+    if (b->deadline && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= b->deadline) {
+        /* Out of time: only wait for the requests in flight */
+        b->n = b->in_flight;
+        b->deadline = 0;
+    }
+
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, b->offset, b->qiov, 0,
-                                  bench_cb, b);
+        BenchReq *req = b->free_reqs;
+        uint64_t offset = bench_next_offset(b);
+
+        b->free_reqs = req->next;
+        req->write = b->write_percent == 100 ||
+                     (b->write_percent &&
+                      g_random_int_range(0, 100) < b->write_percent);
+        req->start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, req->qiov, 0,
+                                  bench_req_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, b->offset, b->qiov, 0,
-                                 bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, req->qiov, 0,
+                                 bench_req_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
             exit(EXIT_FAILURE);
         }
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
     }
 }
 
@@ -3564,6 +3960,9 @@ static int img_bench(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool is_write = false;
+    int write_percent = -1;
+    bool random = false;
+    int runtime = 0;
     int count = 75000;
     int depth = 64;
     int64_t offset = 0;
@@ -3578,6 +3977,9 @@ static int img_bench(int argc, char **argv)
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
+    const char *kind;
+    double secs;
+    uint64_t nr_done;
     int i;
 
     for (;;) {
@@ -3587,6 +3989,9 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"time", required_argument, 0, OPTION_TIME},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
@@ -3680,7 +4085,6 @@ static int img_bench(int argc, char **argv)
             }
             break;
         case 'w':
-            flags |= BDRV_O_RDWR;
             is_write = true;
             break;
         case OPTION_PATTERN:
@@ -3708,6 +4112,31 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
+        case OPTION_WRITE_PERCENT:
+        {
+            unsigned long val;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) < 0 || val > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = val;
+            break;
+        }
+        case OPTION_TIME:
+        {
+            unsigned long val;
+
+            if (qemu_strtoul(optarg, NULL, 0, &val) < 0 || val > INT_MAX) {
+                error_report("Invalid run time specified");
+                return 1;
+            }
+            runtime = val;
+            break;
+        }
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -3719,7 +4148,18 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (write_percent < 0) {
+        write_percent = is_write ? 100 : 0;
+    }
+    if (write_percent) {
+        flags |= BDRV_O_RDWR;
+    }
+    if (runtime) {
+        /* Bounded by time, not by request count */
+        count = INT_MAX;
+    }
+
+    if (!write_percent && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -3742,6 +4182,12 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
+    if (random && image_size - offset < (int64_t)bufsize) {
+        error_report("Image too small for random requests");
+        ret = -1;
+        goto out;
+    }
+
     data = (BenchData) {
         .blk            = blk,
         .image_size     = image_size,
@@ -3749,15 +4195,34 @@ static int img_bench(int argc, char **argv)
         .step           = step ?: bufsize,
         .nrreq          = depth,
         .n              = count,
+        .start_offset   = offset,
+        .nr_blocks      = (image_size - offset) / bufsize,
         .offset         = offset,
-        .write          = is_write,
+        .write_percent  = write_percent,
+        .random         = random,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .lat_min        = UINT64_MAX,
+        .lat_hist       = g_new0(uint64_t, BENCH_LAT_BUCKETS),
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+    kind = write_percent == 100 ? "write" : write_percent ? "mixed" : "read";
+    if (runtime) {
+        printf("Sending %s requests for %d seconds", kind, runtime);
+    } else {
+        printf("Sending %d %s requests", data.n, kind);
+    }
+    if (random) {
+        printf(", %d bytes each, %d in parallel "
+               "(random offsets from %" PRId64 ")\n",
+               data.bufsize, data.nrreq, offset);
+    } else {
+        printf(", %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.bufsize, data.nrreq, offset, data.step);
+    }
+    if (write_percent && write_percent < 100) {
+        printf("%d%% of the requests are writes\n", write_percent);
+    }
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
@@ -3766,12 +4231,23 @@ static int img_bench(int argc, char **argv)
     memset(data.buf, pattern, data.nrreq * data.bufsize);
 
     data.qiov = g_new(QEMUIOVector, data.nrreq);
+    data.reqs = g_new0(BenchReq, data.nrreq);
     for (i = 0; i < data.nrreq; i++) {
         qemu_iovec_init(&data.qiov[i], 1);
         qemu_iovec_add(&data.qiov[i],
                        data.buf + i * data.bufsize, data.bufsize);
+        data.reqs[i] = (BenchReq) {
+            .b      = &data,
+            .qiov   = &data.qiov[i],
+            .next   = data.free_reqs,
+        };
+        data.free_reqs = &data.reqs[i];
     }
 
+    if (runtime) {
+        data.deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                        runtime * NANOSECONDS_PER_SECOND;
+    }
     gettimeofday(&t1, NULL);
     bench_cb(&data, 0);
 
@@ -3780,12 +4256,34 @@ static int img_bench(int argc, char **argv)
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    secs = (t2.tv_sec - t1.tv_sec)
+           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    printf("Run completed in %3.3f seconds.\n", secs);
+
+    nr_done = data.nr_reads + data.nr_writes;
+    if (nr_done) {
+        printf("%" PRIu64 " reads, %" PRIu64 " writes: "
+               "%.0f IOPS, %.2f MiB/s\n",
+               data.nr_reads, data.nr_writes, nr_done / secs,
+               nr_done * data.bufsize / secs / (1024 * 1024));
+        printf("Latency (us): min %.1f, avg %.1f, p50 %.1f, p90 %.1f, "
+               "p99 %.1f, p99.9 %.1f, max %.1f\n",
+               data.lat_min / 1000.0, data.lat_total / 1000.0 / nr_done,
+               bench_lat_percentile(&data, 50) / 1000.0,
+               bench_lat_percentile(&data, 90) / 1000.0,
+               bench_lat_percentile(&data, 99) / 1000.0,
+               bench_lat_percentile(&data, 99.9) / 1000.0,
+               data.lat_max / 1000.0);
+    }
 
 out:
     qemu_vfree(data.buf);
+    for (i = 0; data.qiov && i < data.nrreq; i++) {
+        qemu_iovec_destroy(&data.qiov[i]);
+    }
+    g_free(data.qiov);
+    g_free(data.reqs);
+    g_free(data.lat_hist);
     blk_unref(blk);
 
     if (ret) {
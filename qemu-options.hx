@@ -39,6 +39,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
+    "                xen-mapcache-bucket=size sets the Xen map cache bucket size\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
     "                dea-key-wrap=on|off controls support for DEA key wrapping (default=on)\n"
     "                suppress-vmdesc=on|off disables self-describing migration (default=off)\n"
@@ -53,9 +54,9 @@ available machines. Supported machine properties are:
 @table @option
 @item accel=@var{accels1}[:@var{accels2}[:...]]
 This is used to enable an accelerator. Depending on the target architecture,
-kvm, xen, or tcg can be available. By default, tcg is used. If there is more
-than one accelerator specified, the next one is used if the previous one fails
-to initialize.
+kvm, xen, or tcg can be available. By default, tcg is used. This is
+equivalent to @option{-machine accel=@var{name}}, plus the accelerator
+properties below.
 @item kernel_irqchip=on|off
 Controls in-kernel irqchip support for the chosen accelerator when available.
 @item gfx_passthru=on|off
@@ -72,6 +73,10 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item xen-mapcache-bucket=@var{size}
+Sets the granularity at which the Xen map cache maps guest memory; it must
+be a power of two.  Larger buckets mean fewer remaps for guests doing a lot
+of device I/O.  The default is 1M on 64-bit hosts and 64K on 32-bit hosts.
 @item aes-key-wrap=on|off
 Enables or disables AES key wrapping support on s390-ccw hosts. This feature
 controls whether AES wrapping keys will be created to allow
@@ -88,6 +93,28 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "                select accelerator ('-accel help' for list)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used. If there is more
+than one accelerator specified, the next one is used if the previous one fails
+to initialize.
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads. When TCG is multi-threaded there will be
+one thread per vCPU, allowing guest code to run on several host cores at
+once. Only targets whose translators emit the memory barriers and atomic
+operations this needs support it reliably; others print a warning. The
+default is a single thread, which is also required by @option{-icount}.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -119,11 +146,11 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
+@itemx -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -135,6 +162,12 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-cpus} restricts the VCPU threads of the node, and the iothreads
+assigned to it with their @option{numa-node} property, to the given host
+CPUs.  Together with a @samp{memdev} whose @option{host-nodes} is the
+matching host node, this keeps the guest node's CPUs and memory local on
+the host.  With TCG, only multi-threaded TCG binds VCPU threads.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -518,15 +551,15 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring][,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
-    "       [[,group=g]]\n"
+    "       [[,group=g][,group_weight=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -561,7 +594,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike "native", "io_uring" does not require @option{cache.direct=on}.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -1582,7 +1615,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "         [,ipv6[=on|off]][,ipv6-net=addr[/int]][,ipv6-host=addr]\n"
     "         [,restrict=on|off][,hostname=host][,dhcpstart=addr]\n"
     "         [,dns=addr][,ipv6-dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]\n"
+    "         [,tcp-sndbuf=size][,tcp-rcvbuf=size]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1672,7 +1706,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,keep-link-up=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
     "-netdev hubport,id=str,hubid=n\n"
     "                configure a hub port on QEMU VLAN 'n'\n", QEMU_ARCH_ALL)
@@ -1788,6 +1822,14 @@ Example:
 qemu -net user,dnssearch=mgmt.example.org,dnssearch=example.org [...]
 @end example
 
+@item tcp-sndbuf=@var{size}
+@itemx tcp-rcvbuf=@var{size}
+Set the size of the buffers each emulated TCP connection uses for data sent
+to the guest (@option{tcp-sndbuf}) and received from the guest
+(@option{tcp-rcvbuf}). The default is 8k for both; larger buffers, up to 16M,
+let a single connection go much faster at the cost of more memory per
+connection. Buffers above 64k are negotiated with TCP window scaling.
+
 @item tftp=@var{dir}
 When using the user mode network stack, activate a built-in TFTP
 server. The files in @var{dir} will be exposed as the root of a TFTP server.
@@ -2105,7 +2147,7 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n][,keep-link-up=on|off]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
@@ -2114,6 +2156,12 @@ end of the socket. On non-MSIX guests, the feature can be forced with
 @var{vhostforce}. Use 'queues=@var{n}' to specify the number of queues to
 be created for multiqueue vhost-user.
 
+When the backend disconnects, the guest normally sees the link go down until
+it reconnects.  With @option{keep-link-up=on} the link stays up and only the
+vhost rings are stopped; they resume from the last used index once the
+backend is back, which keeps a backend restart from looking like a cable
+pull to the guest.
+
 Example:
 @example
 qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,share=on \
@@ -2151,9 +2199,9 @@ DEF("chardev", HAS_ARG, QEMU_OPTION_chardev,
     "-chardev null,id=id[,mux=on|off][,logfile=PATH][,logappend=on|off]\n"
     "-chardev socket,id=id[,host=host],port=port[,to=to][,ipv4][,ipv6][,nodelay][,reconnect=seconds]\n"
     "         [,server][,nowait][,telnet][,reconnect=seconds][,mux=on|off]\n"
-    "         [,logfile=PATH][,logappend=on|off][,tls-creds=ID] (tcp)\n"
+    "         [,logfile=PATH][,logappend=on|off][,tls-creds=ID][,ring-size=size] (tcp)\n"
     "-chardev socket,id=id,path=path[,server][,nowait][,telnet][,reconnect=seconds]\n"
-    "         [,mux=on|off][,logfile=PATH][,logappend=on|off] (unix)\n"
+    "         [,mux=on|off][,logfile=PATH][,logappend=on|off][,ring-size=size] (unix)\n"
     "-chardev udp,id=id[,host=host],port=port[,localaddr=localaddr]\n"
     "         [,localport=localport][,ipv4][,ipv6][,mux=on|off]\n"
     "         [,logfile=PATH][,logappend=on|off]\n"
@@ -2272,7 +2320,7 @@ Further options to each backend are described below.
 A void device. This device will not emit any data, and will drop any data it
 receives. The null backend does not take any options.
 
-@item -chardev socket ,id=@var{id} [@var{TCP options} or @var{unix options}] [,server] [,nowait] [,telnet] [,reconnect=@var{seconds}] [,tls-creds=@var{id}]
+@item -chardev socket ,id=@var{id} [@var{TCP options} or @var{unix options}] [,server] [,nowait] [,telnet] [,reconnect=@var{seconds}] [,tls-creds=@var{id}] [,ring-size=@var{size}]
 
 Create a two-way stream socket, which can be either a TCP or a unix socket. A
 unix socket will be created if @option{path} is specified. Behaviour is
@@ -2295,6 +2343,12 @@ and specifies the id of the TLS credentials to use for the handshake. The
 credentials must be previously created with the @option{-object tls-creds}
 argument.
 
+@option{ring-size} sets up a buffer of the given size for output that the
+socket does not accept right away. Writers then only wait when the buffer is
+full, and the buffer is sent in the background. Input is also read in larger
+batches. This helps packet streams such as those of the network filters keep
+up with high rates.
+
 TCP and unix socket options are given below:
 
 @table @option
@@ -2496,6 +2550,12 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+A LUN can be accessed over several sessions with @option{sessions=n}, up to
+16.  Reads and writes go to the session with the fewest requests in flight,
+which lets a single LUN use more than one connection's worth of bandwidth.
+@option{queue-depth=n} limits the requests in flight on each session; the
+default of 0 means no limit.
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2522,7 +2582,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
-    "       [,timeout=timeout]\n"
+    "       [,timeout=timeout][,sessions=n][,queue-depth=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -3103,11 +3163,14 @@ Like -qmp but uses pretty JSON formatting.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control][,default]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,default][,oob=on|off]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control][,default]
+@item -mon [chardev=]name[,mode=readline|control][,default][,oob=on|off]
 @findex -mon
-Setup monitor on chardev @var{name}.
+Setup monitor on chardev @var{name}. With @code{oob=on}, a QMP monitor
+reads commands in a thread of its own, and read-only queries issued with
+@code{exec-oob} are answered without waiting for the main loop.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -3360,12 +3423,12 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrcompress=on|off,rrsnapshot-period=<sec>,rrseek=<step>]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename}]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename},rrcompress=on|off,rrsnapshot-period=@var{sec},rrseek=@var{step}]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3397,7 +3460,12 @@ when the shift value is high (how high depends on the host machine).
 
 When @option{rr} option is specified deterministic record/replay is enabled.
 Replay log is written into @var{filename} file in record mode and
-read from this file in replay mode.
+read from this file in replay mode.  With @option{rrcompress=on}, the log
+is deflated as it is recorded; replay detects compressed logs by itself.
+@option{rrsnapshot-period} takes an internal snapshot of the VM every
+@var{sec} seconds while recording, and lists them in @var{filename}.idx.
+@option{rrseek} starts the replay from the last of those snapshots taken
+at or before instruction @var{step}, instead of from the beginning.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3777,6 +3845,11 @@ The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
 
+Memory backends also accept @option{prealloc=on} to allocate all of
+their memory at startup.  The @option{prealloc-threads} option sets how
+many threads share that work; it defaults to the number of guest CPUs
+and is capped by the number of host CPUs.
+
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
 Creates a random number generator backend which obtains entropy from
@@ -3794,7 +3867,7 @@ the @option{virtio-rng} device. The @option{chardev} parameter is
 the unique ID of a character device backend that provides the connection
 to the RNG daemon.
 
-@item -object tls-creds-anon,id=@var{id},endpoint=@var{endpoint},dir=@var{/path/to/cred/dir},verify-peer=@var{on|off}
+@item -object tls-creds-anon,id=@var{id},endpoint=@var{endpoint},dir=@var{/path/to/cred/dir},verify-peer=@var{on|off}[,ktls=@var{on|off}]
 
 Creates a TLS anonymous credentials object, which can be used to provide
 TLS support on network backends. The @option{id} parameter is a unique
@@ -3814,7 +3887,7 @@ expensive operation that consumes random pool entropy, so it is
 recommended that a persistent set of parameters be generated
 upfront and saved.
 
-@item -object tls-creds-x509,id=@var{id},endpoint=@var{endpoint},dir=@var{/path/to/cred/dir},verify-peer=@var{on|off},passwordid=@var{id}
+@item -object tls-creds-x509,id=@var{id},endpoint=@var{endpoint},dir=@var{/path/to/cred/dir},verify-peer=@var{on|off},passwordid=@var{id}[,ktls=@var{on|off}]
 
 Creates a TLS anonymous credentials object, which can be used to provide
 TLS support on network backends. The @option{id} parameter is a unique
@@ -3841,17 +3914,35 @@ in PEM format, in filenames @var{ca-cert.pem}, @var{ca-crl.pem} (optional),
 @var{server-cert.pem} (only servers), @var{server-key.pem} (only servers),
 @var{client-cert.pem} (only clients), and @var{client-key.pem} (only clients).
 
+If @option{ktls} is enabled (default off) for either kind of credentials,
+then once the handshake of a TLS session over a socket has completed, the
+record encryption is handed to the Linux kernel TLS support. This avoids
+an extra copy of all migration and NBD data through the TLS library. It
+is only possible for TLS 1.2 sessions using an AES-GCM cipher; in all
+other cases the session silently keeps encrypting in QEMU.
+
 For the @var{server-key.pem} and @var{client-key.pem} files which
 contain sensitive private keys, it is possible to use an encrypted
 version by providing the @var{passwordid} parameter. This provides
 the ID of a previously created @code{secret} object containing the
 password for decryption.
 
-@item -object filter-buffer,id=@var{id},netdev=@var{netdevid},interval=@var{t}[,queue=@var{all|rx|tx}][,status=@var{on|off}]
+@item -object filter-buffer,id=@var{id},netdev=@var{netdevid},interval=@var{t}|checkpoint=on[,max_packets=@var{n}][,queue=@var{all|rx|tx}][,status=@var{on|off}]
 
 Interval @var{t} can't be 0, this filter batches the packet delivery: all
 packets arriving in a given interval on netdev @var{netdevid} are delayed
 until the end of the interval. Interval is in microseconds.
+Packets the receiver can't accept at the end of the interval stay
+buffered until it is ready again. @option{max_packets} bounds the number
+of buffered packets (default 10000); beyond that the sender is held back
+if it supports it, otherwise the packet is dropped. The read-only
+@option{overflows} and @option{dropped} properties count the packets that
+found the buffer full and those of them that were dropped.
+
+With @option{checkpoint=on} instead of an interval, the packets are
+buffered per checkpoint epoch and released as soon as the checkpoint of
+their epoch is acknowledged, for VM FT solutions like COLO or MC;
+@option{max_packets} then applies to each epoch.
 @option{status} is optional that indicate whether the netfilter is
 on (enabled) or off (disabled), the default status for netfilter will be 'on'.
 
@@ -3869,7 +3960,9 @@ queue @var{all|rx|tx} is an option that can be applied to any netfilter.
 @item -object filter-mirror,id=@var{id},netdev=@var{netdevid},outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
 
 filter-mirror on netdev @var{netdevid},mirror net packet to chardev
-@var{chardevid}
+@var{chardevid}.
+outring=@var{ringid} can be used instead of outdev to mirror the packets
+to a colo-ring.
 
 @item -object filter-redirector,id=@var{id},netdev=@var{netdevid},indev=@var{chardevid},
 outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
@@ -3879,13 +3972,32 @@ filter-redirector on netdev @var{netdevid},redirect filter's net packet to chard
 Create a filter-redirector we need to differ outdev id from indev id, id can not
 be the same. we can just use indev or outdev, but at least one of indev or outdev
 need to be specified.
+inring=@var{ringid} and outring=@var{ringid} can be used instead of indev and
+outdev to exchange the packets through colo-ring objects.
+
+@item -object colo-ring,id=@var{id}[,size=@var{bytes}]
+
+A colo-ring passes packets from one filter-mirror, filter-redirector or
+colo-compare object to another one in the same QEMU process through a
+shared memory ring of @var{bytes} (default 4M), instead of a pair of
+connected socket chardevs.  Packets that do not fit in a full ring are
+dropped and counted by the read-only dropped property.  The ring must be
+created before the objects that use it.
 
 @item -object filter-rewriter,id=@var{id},netdev=@var{netdevid},rewriter-mode=@var{mode}[,queue=@var{all|rx|tx}]
+[,max_connections=@var{n}][,idle_timeout=@var{ms}]
 
 Filter-rewriter is a part of COLO project.It will rewrite tcp packet to
 secondary from primary to keep secondary tcp connection,and rewrite
 tcp packet to primary from secondary make tcp packet can be handled by
 client.
+At most max_connections=@var{n} connections (default 16384) are tracked;
+beyond that the least recently used one is forgotten.  Connections closed
+by a FIN or RST are forgotten after 10 seconds without packets, any other
+connection after idle_timeout=@var{ms} without packets (default 0, never).
+The read-only expired_connections and evicted_connections properties
+count the connections forgotten for being idle or closed and for making
+room, respectively.
 
 usage:
 colo secondary:
@@ -3900,13 +4012,54 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+The packets are written by a separate thread. When the file cannot keep up
+with the traffic, packets are left out of the dump rather than slowing down
+the netdev; the read-only @option{dropped} property counts them.
+
 @item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},
-outdev=@var{chardevid}
+outdev=@var{chardevid}[,workers=@var{n}][,flush_threshold=@var{bytes}]
+[,compare_timeout=@var{ms}][,check_interval=@var{ms}][,adaptive_timeout=on|off]
+[,tcp_stream=on|off][,max_connections=@var{n}][,idle_timeout=@var{ms}]
+[,checkpoint_min_interval=@var{ms}][,primary_in_ring=@var{ringid}]
+[,secondary_in_ring=@var{ringid}][,outdev_ring=@var{ringid}]
+[,iothread=@var{iothreadid}]
 
 Colo-compare gets packet from primary_in@var{chardevid} and secondary_in@var{chardevid}, than compare primary packet with
 secondary packet. If the packets are same, we will output primary
 packet to outdev@var{chardevid}, else we will notify colo-frame
 do checkpoint and send primary packet to outdev@var{chardevid}.
+primary_in_ring, secondary_in_ring and outdev_ring can replace primary_in,
+secondary_in and outdev with colo-ring objects.
+workers=@var{n} spreads the connections over @var{n} compare threads
+(default 1); all packets of one connection are compared by the same thread.
+With iothread=@var{iothreadid}, the first of them, which also reads the
+inputs, runs in that IOThread instead of a thread of its own.
+Packets released by one comparison pass are written to outdev@var{chardevid}
+with a single write, or earlier once flush_threshold=@var{bytes} are pending
+(default 65536, 0 writes every packet on its own).
+Every check_interval=@var{ms} (default 3000) colo-compare looks for primary
+packets that the secondary did not match within compare_timeout=@var{ms}
+(default 3000).  With adaptive_timeout=on, the timeout and the scan interval
+follow twice the slowest primary/secondary match seen in the last seconds,
+bounded by compare_timeout.
+With tcp_stream=on, the payload of TCP segments is compared as a byte stream
+by sequence number, so primary and secondary may segment the same data
+differently; segments without payload are still compared packet by packet.
+max_connections=@var{n} and idle_timeout=@var{ms} bound the connection
+table as for filter-rewriter; the limit is shared evenly by the workers.
+A miscompare or an old primary packet asks the COLO framework for an
+immediate checkpoint.  Requests made while one is pending are merged, and
+two checkpoint requests are at least checkpoint_min_interval=@var{ms} apart
+(default 100).
+
+The read-only stats_matched, stats_miscompared, stats_dropped and
+stats_checkpoint_requests properties count the primary packets released
+after a match, the comparisons that failed, the packets dropped because a
+connection queue was full and the checkpoints asked for.
+stats_max_queue_depth is the longest primary queue seen on a connection.
+stats_latency_avg, stats_latency_max and stats_latency_histogram describe
+how many ms the released primary packets waited for the secondary.  They
+can be read with qom-get.
 
 we must use it with the help of filter-mirror and filter-redirector.
 
@@ -3939,6 +4092,28 @@ secondary:
 If you want to know the detail of above command line, you can read
 the colo-compare git log.
 
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{divisor}][,thread-pool-min=@var{n}][,thread-pool-max=@var{n}][,numa-node=@var{node}]
+
+Creates a dedicated event loop thread that devices can be assigned to.
+
+Before going to sleep, the thread busy-waits for new events for up to
+@option{poll-max-ns} nanoseconds (32768 by default, 0 disables polling),
+as long as all of its event sources can be polled.  The polling time adapts
+to the observed event rate: it is multiplied by @option{poll-grow} (2 by
+default) while events arrive within the maximum, and divided by
+@option{poll-shrink} (reset to 0 by default) when they do not.
+
+Blocking work of the devices in the thread, such as @option{aio=threads}
+I/O, flushes and discards, runs in a pool of worker threads that belongs
+to it.  The workers are created by the iothread and inherit its CPU
+affinity, so pinning an iothread to a NUMA node keeps its pool local.
+@option{thread-pool-min} workers (0 by default) are kept waiting for work
+and at most @option{thread-pool-max} (64 by default) run.
+
+If @option{numa-node} is given, the thread runs on the @samp{host-cpus}
+of that guest NUMA node (see @option{-numa}), close to the devices and
+memory it serves.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
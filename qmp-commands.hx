@@ -865,7 +865,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,detach:b?,begin:i?,end:i?,format:s?",
+        .args_type  = "paging:b,protocol:s,detach:b?,begin:i?,end:i?,format:s?,"
+                      "exclude-zero:b?,live:b?",
         .params     = "-p protocol [-d] [begin] [length] [format]",
         .help       = "dump guest memory to file",
         .mhandler.cmd_new = qmp_marshal_dump_guest_memory,
@@ -892,6 +893,11 @@ Arguments:
 - "format": the format of guest memory dump. It's optional, and can be
             elf|kdump-zlib|kdump-lzo|kdump-snappy, but non-elf formats will
             conflict with paging and filter, ie. begin and length (json-string)
+- "exclude-zero": leave zero-filled pages out of a kdump-compressed dump
+                  (json-bool)
+- "live": keep the guest running during the dump, pausing it only to
+          refresh the pages dirtied meanwhile; needs detach and a seekable
+          elf dump without paging (json-bool)
 
 Example:
 
@@ -1435,7 +1441,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1452,6 +1458,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image when it is closed; qcow2
+                images with compat=1.1 only (json-bool, optional,
+                default false)
 
 Example:
 
@@ -1667,7 +1676,7 @@ EQMP
         .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
                       "format:s?,node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_drive_mirror,
     },
@@ -1711,6 +1720,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": "background" to copy data in the background only, or
+  "write-blocking" to also write guest data to the target before it
+  reaches the source, so that the job converges even under heavy write
+  load (MirrorCopyMode, optional, default "background")
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1732,7 +1745,7 @@ EQMP
         .name       = "blockdev-mirror",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,replaces:s?,speed:i?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_blockdev_mirror,
     },
 
@@ -1764,6 +1777,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "background" to copy data in the background only, or
+  "write-blocking" to also write guest data to the target before it
+  reaches the source, so that the job converges even under heavy write
+  load (MirrorCopyMode, optional, default "background")
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2072,7 +2089,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,group_weight:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2105,6 +2122,8 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "group_weight": share of the group's limits relative to the other members,
+                  between 1 and 1000, defaults to 100 (json-int, optional)
 
 Example:
 
@@ -2125,6 +2144,41 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Manage read, write and flush latency histograms for a block drive.  With
+only "device", all latency histograms of the drive are removed.  Each
+histogram that is set starts out empty.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": interval boundaries in nanoseconds for all histograms
+                (json-array of json-int, optional)
+- "boundaries-read": interval boundaries for the read histogram
+                     (json-array of json-int, optional)
+- "boundaries-write": interval boundaries for the write histogram
+                      (json-array of json-int, optional)
+- "boundaries-flush": interval boundaries for the flush histogram
+                      (json-array of json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": [10000, 100000, 1000000, 10000000] } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2227,6 +2281,45 @@ Example:
 
 Note: This command must be issued before issuing any other command.
 
+EQMP
+
+    {
+        .name       = "batch",
+        .args_type  = "commands:q",
+        .mhandler.cmd_new = qmp_marshal_batch,
+    },
+
+SQMP
+batch
+-----
+
+Execute a list of commands in order, with a single memory topology update
+and a single drained section of all block devices around the whole list.
+Stops at the first command that fails; commands before it stay in effect.
+
+Arguments:
+
+- "commands": list of commands, each with:
+  - "execute": command name (json-string)
+  - "arguments": command arguments (json-object, optional)
+
+Returns a json-array with one json-object per command, whose "return" member
+holds what the command returned.
+
+Example:
+
+-> { "execute": "batch",
+     "arguments": { "commands": [
+         { "execute": "blockdev-add",
+           "arguments": { "options": { "driver": "qcow2", "id": "disk1",
+                                       "file": { "driver": "file",
+                                                 "filename": "disk1.qcow2" }
+                        } } },
+         { "execute": "device_add",
+           "arguments": { "driver": "virtio-blk-pci", "drive": "disk1",
+                          "id": "vdisk1" } } ] } }
+<- { "return": [ { "return": {} }, { "return": {} } ] }
+
 EQMP
 
     {
@@ -2723,6 +2816,14 @@ Each json-object contain the following:
     - "account_failed": whether failed operations are included in the
                          latency and last access statistics
                          (json-bool)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms set with
+                     block-latency-histogram-set (json-object, optional),
+                     with the following members:
+        - "boundaries": interval boundaries in nanoseconds
+                        (json-array of json-int)
+        - "bins": number of requests in each interval, one more
+                  than the boundaries (json-array of json-int)
     - "timed_stats": A json-array containing statistics collected in
                      specific intervals, with the following members:
         - "interval_length": interval used for calculating the
@@ -2870,6 +2971,7 @@ EQMP
         .name       = "query-blockstats",
         .args_type  = "query-nodes:b?",
         .mhandler.cmd_new = qmp_marshal_query_blockstats,
+        .oob        = true,
     },
 
 SQMP
@@ -2927,6 +3029,109 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_cpus,
     },
 
+SQMP
+query-vcpu-stats
+----------------
+
+Show execution, exit and halt statistics of each vCPU.
+
+Return a json-array with one json-object per vCPU:
+
+- "cpu-index": the vCPU index (json-int)
+- "run-time-ns": time spent running guest code (json-int)
+- "halts": number of waits for work while halted (json-int)
+- "halt-time-ns": time spent in those waits (json-int)
+- "exits": json-array of json-objects, one for each exit reason seen:
+    - "reason": the exit reason, e.g. "io", "mmio" or "hlt" (json-string)
+    - "count": number of exits (json-int)
+    - "time-ns": time spent in QEMU handling them (json-int)
+
+Example:
+
+-> { "execute": "query-vcpu-stats" }
+<- { "return": [
+       { "cpu-index": 0, "run-time-ns": 9152413210,
+         "halts": 0, "halt-time-ns": 0,
+         "exits": [ { "reason": "io", "count": 1234, "time-ns": 4300210 },
+                    { "reason": "mmio", "count": 567,
+                      "time-ns": 3010022 },
+                    { "reason": "intr", "count": 89, "time-ns": 602113 } ] } ] }
+
+EQMP
+
+    {
+        .name       = "query-vcpu-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vcpu_stats,
+    },
+
+SQMP
+callback-profile-set
+--------------------
+
+Start or stop timing the fd handlers, bottom halves and timer callbacks run
+by all event loops.  Callbacks that run for longer than the threshold are
+counted by function, and logged each time they beat their worst run time.
+
+Arguments:
+
+- "threshold-us": threshold in microseconds, 0 to stop profiling (json-int)
+- "reset": clear the collected data (json-bool, optional)
+
+Example:
+
+-> { "execute": "callback-profile-set", "arguments": { "threshold-us": 10000 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "callback-profile-set",
+        .args_type  = "threshold-us:i,reset:b?",
+        .mhandler.cmd_new = qmp_marshal_callback_profile_set,
+    },
+
+SQMP
+query-callback-profile
+----------------------
+
+Show the event loop callback profiling data.
+
+Return a json-object with:
+
+- "enabled": whether callbacks are being timed (json-bool)
+- "threshold-us": the reporting threshold in microseconds (json-int)
+- "histograms": json-array of json-objects, one per kind of callback:
+    - "kind": "fd", "bh" or "timer" (json-string)
+    - "buckets": json-array of json-int; element i counts callbacks that
+      ran for less than 2^i microseconds, the last one all longer ones
+- "stalls": json-array of json-objects, one per function over the threshold:
+    - "kind": "fd", "bh" or "timer" (json-string)
+    - "function": symbol or address of the function (json-string)
+    - "count": number of runs over the threshold (json-int)
+    - "max-ns": longest run (json-int)
+    - "total-ns": total time of the runs over the threshold (json-int)
+
+Example:
+
+-> { "execute": "query-callback-profile" }
+<- { "return": { "enabled": true, "threshold-us": 10000,
+                 "histograms": [ { "kind": "fd", "buckets": [ 812, 95, 3 ] },
+                                 { "kind": "bh", "buckets": [ 5012, 12 ] },
+                                 { "kind": "timer", "buckets": [ 301 ] } ],
+                 "stalls": [ { "kind": "fd",
+                               "function": "qemu-system-x86_64(+0x3a1f20)",
+                               "count": 2, "max-ns": 14250311,
+                               "total-ns": 25112093 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-callback-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_callback_profile,
+    },
+
 SQMP
 query-iothreads
 ---------------
@@ -2941,6 +3146,9 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 for the default (json-int)
 
 Example:
 
@@ -2949,11 +3157,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3245,6 +3459,7 @@ EQMP
         .name       = "query-status",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_status,
+        .oob        = true,
     },
 
 SQMP
@@ -3545,7 +3760,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "completed", "failed", "cancelled",
+       "colo"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3576,6 +3792,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": total time spent synchronizing dirty ram, in
+            microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3592,6 +3810,34 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-eviction": number of pages evicted from the XBZRLE page
+           cache to make room for another one
+- "postcopy-faults": only present on the destination of a postcopy migration
+  once postcopy has started.  It is a json-object with the latencies of the
+  page faults serviced, in microseconds:
+         - "faults": number of faults serviced (json-int)
+         - "average": average latency (json-int)
+         - "p50", "p90", "p99": latency that 50%, 90% and 99% of the faults
+           didn't exceed, rounded up to a power of two (json-int)
+         - "max": longest latency (json-int)
+         - "histogram": number of faults that took less than 1us, then between
+           1us and 2us, 2us and 4us and so on (json-array of json-int)
+         - "vcpu-blocktime": milliseconds each vCPU spent waiting for pages,
+           only present if the host reports the faulting threads (json-array
+           of json-int)
+- "prediction": only present on the source while status is "active", once
+  bandwidth has been measured.  It is a json-object with the smoothed rates
+  the migration has been running at and where they lead:
+         - "bandwidth": bytes sent per second (json-int)
+         - "dirty-rate": bytes of RAM dirtied per second (json-int)
+         - "remaining": bytes of RAM and disks left to send (json-int)
+         - "converging": whether the dirty rate is below the bandwidth
+           (json-bool)
+         - "remaining-time": milliseconds until the migration can complete,
+           only present when converging (json-int)
+         - "stop-downtime": milliseconds of downtime to send what remains
+           with the guest stopped (json-int)
 
 Examples:
 
@@ -3697,7 +3943,9 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":9543,
+            "cache-eviction":1874
          }
       }
    }
@@ -3708,6 +3956,7 @@ EQMP
         .name       = "query-migrate",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_query_migrate,
+        .oob        = true,
     },
 
 SQMP
@@ -3723,6 +3972,12 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several additional connections
+- "parallel-device-state": save the state of devices in several threads
+- "zero-copy-send": send RAM pages without copying them
+- "x-colo": keep taking COLO checkpoints once the migration has completed
+- "x-fixed-ram": store each RAM page at a fixed offset of the migration file
+- "x-postcopy-preempt": send requested postcopy pages on their own connection
 
 Arguments:
 
@@ -3753,6 +4008,15 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple RAM page connections state (json-bool)
+         - "parallel-device-state": parallel device state saving state
+           (json-bool)
+         - "zero-copy-send": zero copy RAM page sending state (json-bool)
+         - "x-colo": COLO checkpointing state (json-bool)
+         - "x-fixed-ram": fixed RAM offsets in migration files state
+           (json-bool)
+         - "x-postcopy-preempt": postcopy page request connection state
+           (json-bool)
 
 Arguments:
 
@@ -3766,7 +4030,13 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "parallel-device-state"},
+     {"state": false, "capability": "zero-copy-send"},
+     {"state": false, "capability": "x-colo"},
+     {"state": false, "capability": "x-fixed-ram"},
+     {"state": false, "capability": "x-postcopy-preempt"}
    ]}
 
 EQMP
@@ -3790,6 +4060,30 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set the number of additional connections for RAM
+                        pages with x-multifd (json-int)
+- "compress-method": set the codec for compressed pages, "zlib", "lz4" or
+                     "zstd" (json-string)
+- "postcopy-prefetch-pages": set the number of pages requested along with a
+                             faulting page during postcopy (json-int)
+- "cpu-throttle-convergence-time": set the time in milliseconds auto-converge
+                                   throttles each vcpu by dirty rate to
+                                   converge in, 0 to throttle all of them in
+                                   steps (json-int)
+- "rdma-queue-pairs": set the number of queue pairs RDMA migration writes
+                      RAM with (json-int)
+- "block-inflight-depth": set the number of reads block migration keeps in
+                          flight on each disk (json-int)
+- "send-iov-depth": set the number of pieces of data gathered before each
+                    write of the migration stream (json-int)
+- "x-checkpoint-delay": set the time in milliseconds between two COLO
+                        checkpoints (json-int)
+- "x-checkpoint-dirty-limit": set the MB of dirty RAM waiting to be sent that
+                              trigger a COLO checkpoint, 0 for none
+                              (json-int)
+- "x-colo-heartbeat-timeout": set the time in milliseconds without news from
+                              the primary after which a COLO secondary takes
+                              over, 0 for never (json-int)
 
 Arguments:
 
@@ -3803,7 +4097,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?,x-multifd-channels:i?,compress-method:s?,postcopy-prefetch-pages:i?,cpu-throttle-convergence-time:i?,rdma-queue-pairs:i?,block-inflight-depth:i?,send-iov-depth:i?,x-checkpoint-delay:i?,x-checkpoint-dirty-limit:i?,x-colo-heartbeat-timeout:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3820,6 +4114,28 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of additional connections for RAM
+                                  pages (json-int)
+         - "compress-method" : codec for compressed pages (json-string)
+         - "postcopy-prefetch-pages" : number of pages requested along with
+                                       a faulting page (json-int)
+         - "cpu-throttle-convergence-time" : time in milliseconds
+                                             auto-converge aims to converge
+                                             in (json-int)
+         - "rdma-queue-pairs" : number of queue pairs RDMA migration writes
+                                RAM with (json-int)
+         - "block-inflight-depth" : number of reads block migration keeps
+                                    in flight on each disk (json-int)
+         - "send-iov-depth" : number of pieces of data gathered before
+                              each write of the migration stream (json-int)
+         - "x-checkpoint-delay" : time in milliseconds between two COLO
+                                  checkpoints (json-int)
+         - "x-checkpoint-dirty-limit" : MB of dirty RAM waiting to be sent
+                                        that trigger a COLO checkpoint
+                                        (json-int)
+         - "x-colo-heartbeat-timeout" : time in milliseconds without news
+                                        from the primary after which a
+                                        COLO secondary takes over (json-int)
 
 Arguments:
 
@@ -3832,7 +4148,17 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "compress-method": "zlib",
+         "postcopy-prefetch-pages": 0,
+         "cpu-throttle-convergence-time": 0,
+         "rdma-queue-pairs": 1,
+         "block-inflight-depth": 512,
+         "send-iov-depth": 64,
+         "x-checkpoint-delay": 200,
+         "x-checkpoint-dirty-limit": 0,
+         "x-colo-heartbeat-timeout": 0
       }
    }
 
@@ -3844,6 +4170,141 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate_parameters,
     },
 
+SQMP
+calc-dirty-rate
+---------------
+
+Start estimating the rate at which the guest dirties its RAM, by hashing
+a random sample of the pages of each RAM block at the start and at the end
+of the measurement.  Dirty logging is not used.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+- "sample-pages": pages to sample per GiB of RAM, 1 to 16384, default 512
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last dirty rate measurement.
+
+Return a json-object with:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "dirty-rate": estimated dirty rate of the guest RAM in MB/s, once measured
+  (json-int, optional)
+- "start-time": start of the measurement in seconds since the epoch
+  (json-int)
+- "calc-time": length of the measurement in seconds (json-int)
+- "sample-pages": pages sampled per GiB of RAM (json-int)
+- "blocks": json-array of json-objects, one per RAM block, once measured:
+    - "id": name of the RAM block (json-string)
+    - "dirty-rate": estimated dirty rate of the block in MB/s (json-int)
+    - "sample-pages": number of pages sampled (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "dirty-rate": 108,
+                 "start-time": 1476432000, "calc-time": 1,
+                 "sample-pages": 512,
+                 "blocks": [ { "id": "pc.ram", "dirty-rate": 108,
+                               "sample-pages": 2048 },
+                             { "id": "vga.vram", "dirty-rate": 0,
+                               "sample-pages": 8 } ] } }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-colo-status
+-----------------
+
+Show how the COLO primary schedules its checkpoints, since it last started.
+
+Return a json-object with:
+
+- "active": whether checkpoints are being taken (json-bool)
+- "checkpoints": number of checkpoints (json-int)
+- "interval-checkpoints": taken because x-checkpoint-delay elapsed (json-int)
+- "miscompare-checkpoints": taken because the outputs of the two VMs
+  differ (json-int)
+- "output-latency-checkpoints": taken to release packets the COLO proxy
+  held for too long (json-int)
+- "dirty-limit-checkpoints": taken because more than x-checkpoint-dirty-limit
+  MB of dirty RAM were waiting (json-int)
+- "last-reason": "interval", "miscompare", "output-latency" or "dirty-limit",
+  once a checkpoint was taken (json-string, optional)
+- "last-interval": milliseconds between the last two checkpoints (json-int)
+- "average-interval": average milliseconds between two checkpoints (json-int)
+- "last-downtime": milliseconds the VM was stopped for the last checkpoint
+  (json-int)
+- "average-downtime": average milliseconds the VM is stopped per checkpoint
+  (json-int)
+- "last-size": bytes sent for the last checkpoint while the VM was stopped
+  (json-int)
+
+Example:
+
+-> { "execute": "query-colo-status" }
+<- { "return": { "active": true, "checkpoints": 412,
+                 "interval-checkpoints": 380, "miscompare-checkpoints": 25,
+                 "output-latency-checkpoints": 4,
+                 "dirty-limit-checkpoints": 3, "last-reason": "interval",
+                 "last-interval": 212, "average-interval": 187,
+                 "last-downtime": 9, "average-downtime": 11,
+                 "last-size": 1843210 } }
+
+EQMP
+
+    {
+        .name       = "query-colo-status",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_colo_status,
+    },
+
+SQMP
+x-colo-lost-heartbeat
+---------------------
+
+Tell a COLO primary or secondary that its peer is gone, so that it fails over
+right away instead of waiting for x-colo-heartbeat-timeout.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "x-colo-lost-heartbeat" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "x-colo-lost-heartbeat",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_x_colo_lost_heartbeat,
+    },
+
 SQMP
 query-balloon
 -------------
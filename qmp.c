@@ -35,6 +35,7 @@
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "qemu/callback-profile.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -707,3 +708,68 @@ ACPIOSTInfoList *qmp_query_acpi_ospm_status(Error **errp)
 
     return head;
 }
+
+void qmp_callback_profile_set(int64_t threshold_us, bool has_reset,
+                              bool reset, Error **errp)
+{
+    if (threshold_us < 0) {
+        error_setg(errp, "threshold-us must not be negative");
+        return;
+    }
+    callback_profile_set(threshold_us * 1000, has_reset && reset);
+}
+
+static void add_callback_stall(CallbackProfileStall *stall, void *opaque)
+{
+    CallbackStallList ***prev = opaque;
+    CallbackStallList *entry = g_new0(CallbackStallList, 1);
+
+    entry->value = g_new0(CallbackStall, 1);
+    entry->value->kind = (CallbackKind)stall->kind;
+    entry->value->function = callback_profile_symbol(stall->fn);
+    entry->value->count = stall->count;
+    entry->value->max_ns = stall->max_ns;
+    entry->value->total_ns = stall->total_ns;
+    **prev = entry;
+    *prev = &entry->next;
+}
+
+CallbackProfile *qmp_query_callback_profile(Error **errp)
+{
+    CallbackProfile *info = g_new0(CallbackProfile, 1);
+    CallbackHistogramList **prev_hist = &info->histograms;
+    CallbackStallList **prev_stall = &info->stalls;
+    uint64_t buckets[CALLBACK_PROFILE_BUCKETS];
+    int kind, i, n;
+
+    QEMU_BUILD_BUG_ON(CALLBACK_PROFILE_KIND_MAX != CALLBACK_KIND__MAX);
+
+    info->enabled = atomic_read(&callback_profile_enabled);
+    info->threshold_us = callback_profile_get_threshold() / 1000;
+
+    for (kind = 0; kind < CALLBACK_PROFILE_KIND_MAX; kind++) {
+        CallbackHistogramList *entry = g_new0(CallbackHistogramList, 1);
+        intList **prev;
+
+        callback_profile_get_histogram(kind, buckets);
+
+        /* Leave out the empty buckets at the end */
+        for (n = CALLBACK_PROFILE_BUCKETS; n > 0 && !buckets[n - 1]; n--) {
+            continue;
+        }
+
+        entry->value = g_new0(CallbackHistogram, 1);
+        entry->value->kind = kind;
+        prev = &entry->value->buckets;
+        for (i = 0; i < n; i++) {
+            *prev = g_new0(intList, 1);
+            (*prev)->value = buckets[i];
+            prev = &(*prev)->next;
+        }
+        *prev_hist = entry;
+        prev_hist = &entry->next;
+    }
+
+    callback_profile_foreach_stall(add_callback_stall, &prev_stall);
+    return info;
+}
@@ -359,19 +359,66 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
     return 0;
 }
 
+/* Same state machine as json_lexer_feed_char(), but instead of appending
+ * characters to lexer->token one at a time, remember where the pending
+ * part of the current token starts in @buffer and copy it in one go when
+ * the token ends, or when the buffer does.
+ */
 int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
 {
-    size_t i;
+    size_t start = 0, end, i;
+    bool char_consumed;
+    int new_state;
 
     for (i = 0; i < size; i++) {
-        int err;
+        char ch = buffer[i];
+
+        lexer->x++;
+        if (ch == '\n') {
+            lexer->x = 0;
+            lexer->y++;
+        }
 
-        err = json_lexer_feed_char(lexer, buffer[i], false);
-        if (err < 0) {
-            return err;
+        do {
+            assert(lexer->state <= ARRAY_SIZE(json_lexer));
+            new_state = json_lexer[lexer->state][(uint8_t)ch];
+            char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
+            end = i + char_consumed;
+
+            if (new_state == IN_ERROR) {
+                /* See json_lexer_feed_char() */
+                g_string_append_len(lexer->token, buffer + start, end - start);
+                lexer->emit(lexer, lexer->token, JSON_ERROR,
+                            lexer->x, lexer->y);
+                g_string_truncate(lexer->token, 0);
+                lexer->state = IN_START;
+                start = i + 1;
+                break;
+            }
+            if (new_state >= JSON_MIN) {
+                if (new_state != JSON_SKIP) {
+                    g_string_append_len(lexer->token, buffer + start,
+                                        end - start);
+                    lexer->emit(lexer, lexer->token, new_state,
+                                lexer->x, lexer->y);
+                }
+                g_string_truncate(lexer->token, 0);
+                start = end;
+                new_state = IN_START;
+            }
+            lexer->state = new_state;
+        } while (!char_consumed);
+
+        if (lexer->token->len + (i + 1 - start) > MAX_TOKEN_SIZE) {
+            g_string_append_len(lexer->token, buffer + start, i + 1 - start);
+            lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
+            g_string_truncate(lexer->token, 0);
+            lexer->state = IN_START;
+            start = i + 1;
         }
     }
 
+    g_string_append_len(lexer->token, buffer + start, size - start);
     return 0;
 }
 
@@ -226,7 +226,7 @@ out:
  */
 static JSONToken *parser_context_pop_token(JSONParserContext *ctxt)
 {
-    g_free(ctxt->current);
+    json_token_free(ctxt->current);
     assert(!g_queue_is_empty(ctxt->buf));
     ctxt->current = g_queue_pop_head(ctxt->buf);
     return ctxt->current;
@@ -259,7 +259,7 @@ static void parser_context_free(JSONParserContext *ctxt)
         while (!g_queue_is_empty(ctxt->buf)) {
             parser_context_pop_token(ctxt);
         }
-        g_free(ctxt->current);
+        json_token_free(ctxt->current);
         g_queue_free(ctxt->buf);
         g_free(ctxt);
     }
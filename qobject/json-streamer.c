@@ -20,9 +20,73 @@
 #define MAX_TOKEN_COUNT (2ULL << 20)
 #define MAX_NESTING (1ULL << 10)
 
+/* Tokens are carved out of chunks of this size rather than allocated one
+ * by one; a chunk goes away together with the last token it holds.
+ * Tokens larger than a quarter of it get a chunk of their own.
+ */
+#define TOKEN_CHUNK_SIZE 4096
+
+struct JSONTokenChunk {
+    size_t refcnt;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static JSONTokenChunk *json_token_chunk_new(size_t size)
+{
+    JSONTokenChunk *chunk = g_malloc(sizeof(*chunk) + size);
+
+    chunk->refcnt = 1;
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+static void json_token_chunk_unref(JSONTokenChunk *chunk)
+{
+    if (--chunk->refcnt == 0) {
+        g_free(chunk);
+    }
+}
+
+static JSONToken *json_message_alloc_token(JSONMessageParser *parser,
+                                           size_t len)
+{
+    size_t size = QEMU_ALIGN_UP(sizeof(JSONToken) + len + 1,
+                                sizeof(void *));
+    JSONTokenChunk *chunk;
+    JSONToken *token;
+
+    if (size > TOKEN_CHUNK_SIZE / 4) {
+        chunk = json_token_chunk_new(size);
+    } else {
+        chunk = parser->chunk;
+        if (!chunk || chunk->size - chunk->used < size) {
+            if (chunk) {
+                json_token_chunk_unref(chunk);
+            }
+            chunk = parser->chunk = json_token_chunk_new(TOKEN_CHUNK_SIZE);
+        }
+        chunk->refcnt++;
+    }
+
+    token = (JSONToken *)(chunk->data + chunk->used);
+    chunk->used += size;
+    token->chunk = chunk;
+    return token;
+}
+
+void json_token_free(JSONToken *token)
+{
+    if (token) {
+        json_token_chunk_unref(token->chunk);
+    }
+}
+
 static void json_message_free_token(void *token, void *opaque)
 {
-    g_free(token);
+    json_token_free(token);
 }
 
 static void json_message_free_tokens(JSONMessageParser *parser)
@@ -58,7 +122,7 @@ static void json_message_process_token(JSONLexer *lexer, GString *input,
         break;
     }
 
-    token = g_malloc(sizeof(JSONToken) + input->len + 1);
+    token = json_message_alloc_token(parser, input->len);
     token->type = type;
     memcpy(token->str, input->str, input->len);
     token->str[input->len] = 0;
@@ -114,6 +178,7 @@ void json_message_parser_init(JSONMessageParser *parser,
     parser->bracket_count = 0;
     parser->tokens = g_queue_new();
     parser->token_size = 0;
+    parser->chunk = NULL;
 
     json_lexer_init(&parser->lexer, json_message_process_token);
 }
@@ -133,4 +198,8 @@ void json_message_parser_destroy(JSONMessageParser *parser)
 {
     json_lexer_destroy(&parser->lexer);
     json_message_free_tokens(parser);
+    if (parser->chunk) {
+        json_token_chunk_unref(parser->chunk);
+        parser->chunk = NULL;
+    }
 }
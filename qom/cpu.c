@@ -343,6 +343,7 @@ static void cpu_common_initfn(Object *obj)
     cpu->cpu_index = UNASSIGNED_CPU_INDEX;
     cpu->gdb_num_regs = cpu->gdb_num_g_regs = cc->gdb_num_core_regs;
     qemu_mutex_init(&cpu->work_mutex);
+    qemu_mutex_init(&cpu->tlb_flush_lock);
     QTAILQ_INIT(&cpu->breakpoints);
     QTAILQ_INIT(&cpu->watchpoints);
     bitmap_zero(cpu->trace_dstate, TRACE_VCPU_EVENT_COUNT);
@@ -284,6 +284,11 @@ static void type_initialize(TypeImpl *ti)
         g_assert_cmpint(parent->class_size, <=, ti->class_size);
         memcpy(ti->class, parent->class, parent->class_size);
         ti->class->interfaces = NULL;
+        memset(ti->class->cast_is_a_cache, 0,
+               sizeof(ti->class->cast_is_a_cache));
+        memset(ti->class->cast_is_not_cache, 0,
+               sizeof(ti->class->cast_is_not_cache));
+        ti->class->property_cache = NULL;
         ti->class->properties = g_hash_table_new_full(
             g_str_hash, g_str_equal, g_free, object_property_free);
 
@@ -642,6 +647,30 @@ out:
     return obj;
 }
 
+static bool cast_cache_lookup(Type *cache, const char *typename)
+{
+    int i;
+
+    for (i = 0; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        Type t = atomic_read(&cache[i]);
+
+        if (t && !strcmp(t->name, typename)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cast_cache_add(Type *cache, Type target_type)
+{
+    int i;
+
+    for (i = 1; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        atomic_set(&cache[i - 1], atomic_read(&cache[i]));
+    }
+    atomic_set(&cache[i - 1], target_type);
+}
+
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
                                        const char *typename)
 {
@@ -659,6 +688,18 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
         return class;
     }
 
+    /* The answer for a given class and type never changes, and is either
+     * the class itself or NULL except for casts to interfaces.  The cache
+     * holds types rather than typename pointers, since callers may pass
+     * a string that is freed afterwards.
+     */
+    if (cast_cache_lookup(class->cast_is_a_cache, typename)) {
+        return class;
+    }
+    if (cast_cache_lookup(class->cast_is_not_cache, typename)) {
+        return NULL;
+    }
+
     target_type = type_get_by_name(typename);
     if (!target_type) {
         /* target class type unknown, so fail the cast */
@@ -687,6 +728,11 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
         ret = class;
     }
 
+    if (ret == class) {
+        cast_cache_add(class->cast_is_a_cache, target_type);
+    } else if (!ret) {
+        cast_cache_add(class->cast_is_not_cache, target_type);
+    }
     return ret;
 }
 
@@ -948,6 +994,14 @@ object_property_add(Object *obj, const char *name, const char *type,
     return prop;
 }
 
+/*
+ * Bumped whenever a class gains a property, which may change the result of
+ * lookups in any of its subclasses.  Class properties are added from
+ * class_init in practice, so caches settle down once the types in use are
+ * initialized.
+ */
+static unsigned int class_property_gen;
+
 ObjectProperty *
 object_class_property_add(ObjectClass *klass,
                           const char *name,
@@ -978,6 +1032,7 @@ object_class_property_add(ObjectClass *klass,
     prop->opaque = opaque;
 
     g_hash_table_insert(klass->properties, g_strdup(name), prop);
+    class_property_gen++;
 
     return prop;
 }
@@ -1022,21 +1077,57 @@ ObjectProperty *object_property_iter_next(ObjectPropertyIterator *iter)
     return val;
 }
 
-ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
-                                           Error **errp)
+static ObjectProperty *class_property_find_uncached(ObjectClass *klass,
+                                                    const char *name)
 {
     ObjectProperty *prop;
     ObjectClass *parent_klass;
 
     parent_klass = object_class_get_parent(klass);
     if (parent_klass) {
-        prop = object_class_property_find(parent_klass, name, NULL);
+        prop = class_property_find_uncached(parent_klass, name);
         if (prop) {
             return prop;
         }
     }
 
-    prop = g_hash_table_lookup(klass->properties, name);
+    return g_hash_table_lookup(klass->properties, name);
+}
+
+/* Bounds the cache for callers that probe many distinct instance
+ * property names, such as "child[N]"s.
+ */
+#define CLASS_PROPERTY_CACHE_MAX 256
+
+ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
+                                           Error **errp)
+{
+    ObjectProperty *prop;
+    gpointer value;
+
+    /* Misses are cached too, as object_property_find() checks the class
+     * before the object's own properties.
+     */
+    if (!klass->property_cache) {
+        klass->property_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+    } else if (klass->property_cache_gen != class_property_gen) {
+        g_hash_table_remove_all(klass->property_cache);
+    }
+    klass->property_cache_gen = class_property_gen;
+
+    if (g_hash_table_lookup_extended(klass->property_cache, name,
+                                     NULL, &value)) {
+        prop = value;
+    } else {
+        prop = class_property_find_uncached(klass, name);
+        if (g_hash_table_size(klass->property_cache) >=
+            CLASS_PROPERTY_CACHE_MAX) {
+            g_hash_table_remove_all(klass->property_cache);
+        }
+        g_hash_table_insert(klass->property_cache, g_strdup(name), prop);
+    }
+
     if (!prop) {
         error_setg(errp, "Property '.%s' not found", name);
     }
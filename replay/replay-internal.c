@@ -10,11 +10,14 @@
  */
 
 #include "qemu/osdep.h"
+#include <zlib.h>
 #include "qemu-common.h"
 #include "sysemu/replay.h"
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 
 unsigned int replay_data_kind = -1;
 static unsigned int replay_has_unread_data;
@@ -29,10 +32,308 @@ static QemuMutex lock;
 /* File for replay writing */
 FILE *replay_file;
 
+/* In record mode, the log goes through a ring that a writer thread drains
+   to replay_file, deflating it on the way if asked to.  There is a single
+   producer at a time, since writers hold the replay mutex, so head and
+   tail are plain counters published with barriers.  The writer is only
+   woken once REPLAY_RING_WAKEUP bytes are pending, or when the ring is
+   full, to keep the per-byte cost of recording low.  */
+#define REPLAY_RING_SIZE    (4 * 1024 * 1024)
+#define REPLAY_RING_WAKEUP  (64 * 1024)
+#define REPLAY_ZBUF_SIZE    (64 * 1024)
+
+static uint8_t *replay_ring;
+static size_t replay_ring_head;
+static size_t replay_ring_tail;
+static size_t replay_ring_woken;
+static bool replay_writer_quit;
+static QemuEvent replay_ring_data;
+static QemuEvent replay_ring_space;
+static QemuThread replay_writer;
+
+/* Deflate state of the writer, or inflate state of the reader.  The log
+   is a sequence of raw deflate streams, a new one starting wherever the
+   writer was synced for a snapshot, so that replay can resume there.  */
+static bool replay_zlib;
+static bool replay_compress;
+static z_stream replay_zstream;
+static uint8_t *replay_zbuf;
+static uint8_t *replay_zout;
+static size_t replay_zout_pos, replay_zout_len;
+static bool replay_zeof, replay_zerror;
+
+static void replay_file_write(const uint8_t *buf, size_t size, int flush)
+{
+    if (!replay_zlib) {
+        if (fwrite(buf, 1, size, replay_file) != size) {
+            replay_zerror = true;
+        }
+        return;
+    }
+
+    replay_zstream.next_in = (uint8_t *)buf;
+    replay_zstream.avail_in = size;
+    do {
+        size_t len;
+
+        replay_zstream.next_out = replay_zbuf;
+        replay_zstream.avail_out = REPLAY_ZBUF_SIZE;
+        if (deflate(&replay_zstream, flush) == Z_STREAM_ERROR) {
+            replay_zerror = true;
+            return;
+        }
+        len = REPLAY_ZBUF_SIZE - replay_zstream.avail_out;
+        if (fwrite(replay_zbuf, 1, len, replay_file) != len) {
+            replay_zerror = true;
+        }
+    } while (replay_zstream.avail_out == 0);
+}
+
+static void *replay_writer_thread(void *opaque)
+{
+    while (true) {
+        size_t head, tail, len;
+
+        qemu_event_reset(&replay_ring_data);
+        head = atomic_mb_read(&replay_ring_head);
+        tail = replay_ring_tail;
+        if (head == tail) {
+            if (atomic_mb_read(&replay_writer_quit)) {
+                break;
+            }
+            qemu_event_wait(&replay_ring_data);
+            continue;
+        }
+
+        len = MIN(head - tail, REPLAY_RING_SIZE - tail % REPLAY_RING_SIZE);
+        replay_file_write(replay_ring + tail % REPLAY_RING_SIZE, len,
+                          Z_NO_FLUSH);
+        atomic_mb_set(&replay_ring_tail, tail + len);
+        qemu_event_set(&replay_ring_space);
+    }
+
+    if (replay_zlib) {
+        replay_file_write(NULL, 0, Z_FINISH);
+    }
+    return NULL;
+}
+
+void replay_writer_start(bool compress)
+{
+    replay_zlib = replay_compress = compress;
+    if (compress) {
+        memset(&replay_zstream, 0, sizeof(replay_zstream));
+        if (deflateInit2(&replay_zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error_report("Replay: cannot initialize compression");
+            exit(1);
+        }
+        replay_zbuf = g_malloc(REPLAY_ZBUF_SIZE);
+    }
+
+    replay_ring = g_malloc(REPLAY_RING_SIZE);
+    replay_ring_head = replay_ring_tail = replay_ring_woken = 0;
+    replay_writer_quit = false;
+    qemu_event_init(&replay_ring_data, false);
+    qemu_event_init(&replay_ring_space, false);
+    qemu_thread_create(&replay_writer, "replay-writer", replay_writer_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+/* Drains the ring; later writes go straight to the file, uncompressed */
+void replay_writer_stop(void)
+{
+    if (!replay_ring) {
+        return;
+    }
+
+    atomic_mb_set(&replay_writer_quit, true);
+    qemu_event_set(&replay_ring_data);
+    qemu_thread_join(&replay_writer);
+    qemu_event_destroy(&replay_ring_data);
+    qemu_event_destroy(&replay_ring_space);
+    g_free(replay_ring);
+    replay_ring = NULL;
+
+    if (replay_zlib) {
+        deflateEnd(&replay_zstream);
+        g_free(replay_zbuf);
+        replay_zbuf = NULL;
+        replay_zlib = false;
+    }
+    if (replay_zerror) {
+        error_report("Replay: error writing the log");
+    }
+}
+
+static void replay_write(const uint8_t *buf, size_t size)
+{
+    if (!replay_ring) {
+        if (fwrite(buf, 1, size, replay_file) != size) {
+            replay_zerror = true;
+        }
+        return;
+    }
+
+    while (size) {
+        size_t head = replay_ring_head;
+        size_t tail = atomic_mb_read(&replay_ring_tail);
+        size_t len = REPLAY_RING_SIZE - (head - tail);
+
+        if (!len) {
+            /* Make sure the writer is not waiting for more data */
+            replay_ring_woken = head;
+            qemu_event_set(&replay_ring_data);
+            qemu_event_reset(&replay_ring_space);
+            if (atomic_mb_read(&replay_ring_tail) == tail) {
+                qemu_event_wait(&replay_ring_space);
+            }
+            continue;
+        }
+
+        len = MIN(len, REPLAY_RING_SIZE - head % REPLAY_RING_SIZE);
+        len = MIN(len, size);
+        memcpy(replay_ring + head % REPLAY_RING_SIZE, buf, len);
+        atomic_mb_set(&replay_ring_head, head + len);
+        buf += len;
+        size -= len;
+    }
+
+    if (replay_ring_head - replay_ring_woken >= REPLAY_RING_WAKEUP) {
+        replay_ring_woken = replay_ring_head;
+        qemu_event_set(&replay_ring_data);
+    }
+}
+
+void replay_reader_start(bool compressed)
+{
+    replay_zlib = compressed;
+    replay_zeof = replay_zerror = false;
+    if (compressed) {
+        memset(&replay_zstream, 0, sizeof(replay_zstream));
+        if (inflateInit2(&replay_zstream, -MAX_WBITS) != Z_OK) {
+            error_report("Replay: cannot initialize decompression");
+            exit(1);
+        }
+        replay_zbuf = g_malloc(REPLAY_ZBUF_SIZE);
+        replay_zout = g_malloc(REPLAY_ZBUF_SIZE);
+        replay_zout_pos = replay_zout_len = 0;
+    }
+}
+
+void replay_reader_stop(void)
+{
+    if (replay_zlib) {
+        inflateEnd(&replay_zstream);
+        g_free(replay_zbuf);
+        g_free(replay_zout);
+        replay_zbuf = replay_zout = NULL;
+        replay_zlib = false;
+    }
+}
+
+/* Inflates the next chunk of the log into replay_zout */
+static bool replay_inflate(void)
+{
+    int ret;
+
+    replay_zstream.next_out = replay_zout;
+    replay_zstream.avail_out = REPLAY_ZBUF_SIZE;
+    while (replay_zstream.avail_out == REPLAY_ZBUF_SIZE && !replay_zeof) {
+        if (!replay_zstream.avail_in) {
+            size_t len = fread(replay_zbuf, 1, REPLAY_ZBUF_SIZE, replay_file);
+
+            if (!len) {
+                replay_zeof = true;
+                replay_zerror = ferror(replay_file);
+                break;
+            }
+            replay_zstream.next_in = replay_zbuf;
+            replay_zstream.avail_in = len;
+        }
+        ret = inflate(&replay_zstream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* Another stream may follow */
+            inflateReset(&replay_zstream);
+        } else if (ret != Z_OK) {
+            replay_zeof = replay_zerror = true;
+        }
+    }
+
+    replay_zout_pos = 0;
+    replay_zout_len = REPLAY_ZBUF_SIZE - replay_zstream.avail_out;
+    return replay_zout_len != 0;
+}
+
+uint64_t replay_log_sync(void)
+{
+    uint64_t offset;
+
+    if (!replay_ring) {
+        return -1;
+    }
+
+    replay_writer_stop();
+    fflush(replay_file);
+    offset = ftello(replay_file);
+    replay_writer_start(replay_compress);
+    return offset;
+}
+
+void replay_log_seek(uint64_t offset)
+{
+    if (replay_ring) {
+        /* Recording again from an earlier point: drop what follows it */
+        replay_writer_stop();
+        fflush(replay_file);
+        if (ftruncate(fileno(replay_file), offset) < 0) {
+            error_report("Replay: cannot truncate the log: %s",
+                         strerror(errno));
+        }
+        fseeko(replay_file, offset, SEEK_SET);
+        replay_writer_start(replay_compress);
+        return;
+    }
+
+    clearerr(replay_file);
+    fseeko(replay_file, offset, SEEK_SET);
+    if (replay_zlib) {
+        inflateReset(&replay_zstream);
+        replay_zstream.avail_in = 0;
+        replay_zout_pos = replay_zout_len = 0;
+        replay_zeof = replay_zerror = false;
+    }
+    replay_has_unread_data = 0;
+    replay_state.instructions_count = 0;
+    replay_fetch_data_kind();
+}
+
+static size_t replay_read(uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+
+    if (!replay_zlib) {
+        return fread(buf, 1, size, replay_file);
+    }
+
+    while (done < size) {
+        size_t len;
+
+        if (replay_zout_pos == replay_zout_len && !replay_inflate()) {
+            break;
+        }
+        len = MIN(size - done, replay_zout_len - replay_zout_pos);
+        memcpy(buf + done, replay_zout + replay_zout_pos, len);
+        replay_zout_pos += len;
+        done += len;
+    }
+    return done;
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        replay_write(&byte, 1);
     }
 }
 
@@ -45,8 +346,11 @@ void replay_put_event(uint8_t event)
 
 void replay_put_word(uint16_t word)
 {
-    replay_put_byte(word >> 8);
-    replay_put_byte(word);
+    uint8_t buf[2] = { word >> 8, word };
+
+    if (replay_file) {
+        replay_write(buf, sizeof(buf));
+    }
 }
 
 void replay_put_dword(uint32_t dword)
@@ -65,7 +369,7 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        replay_write(buf, size);
     }
 }
 
@@ -73,7 +377,11 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (!replay_zlib) {
+            byte = getc(replay_file);
+        } else if (replay_zout_pos < replay_zout_len || replay_inflate()) {
+            byte = replay_zout[replay_zout_pos++];
+        }
     }
     return byte;
 }
@@ -115,7 +423,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (replay_read(buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -126,7 +434,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (replay_read(*buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -135,11 +443,21 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        bool eof, err;
+
+        if (replay_zlib) {
+            err = replay_zerror;
+            eof = !err && replay_zeof && replay_zout_pos == replay_zout_len;
+        } else {
+            eof = feof(replay_file);
+            err = ferror(replay_file);
+        }
+
+        if (eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (err) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
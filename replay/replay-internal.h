@@ -62,6 +62,8 @@ typedef struct ReplayState {
     uint64_t current_step;
     /*! Number of instructions to be executed before other events happen. */
     int instructions_count;
+    /*! Log offset at which a snapshot was taken. */
+    uint64_t file_offset;
 } ReplayState;
 extern ReplayState replay_state;
 
@@ -84,6 +86,33 @@ int64_t replay_get_qword(void);
 void replay_get_array(uint8_t *buf, size_t *size);
 void replay_get_array_alloc(uint8_t **buf, size_t *size);
 
+/*! Starts the thread that writes the log in record mode,
+    deflating it if @compress. */
+void replay_writer_start(bool compress);
+/*! Flushes the log and stops the writer thread. */
+void replay_writer_stop(void);
+/*! Prepares reading the log, which is deflated if @compressed. */
+void replay_reader_start(bool compressed);
+void replay_reader_stop(void);
+/*! Writes out everything recorded so far and returns the log offset from
+    which replay can resume, or -1 if not recording. */
+uint64_t replay_log_sync(void);
+/*! Continues replaying, or recording, from @offset in the log. */
+void replay_log_seek(uint64_t offset);
+
+/* Snapshots */
+
+/*! Registers the replay state for saving along with snapshots. */
+void replay_vmstate_init(void);
+/*! Sets up snapshotting every @period_ms milliseconds while recording, and
+    starting the replay from the last snapshot at or before @seek_step if
+    @seek.  The snapshots are listed in @fname.idx. */
+void replay_snapshot_init(const char *fname, int64_t period_ms,
+                          bool seek, uint64_t seek_step);
+/*! Starts the periodic snapshot timer. */
+void replay_snapshot_start(void);
+void replay_snapshot_finish(void);
+
 /* Mutex functions for protecting replay log file */
 
 void replay_mutex_init(void);
@@ -0,0 +1,194 @@
+/*
+ * replay-snapshot.c
+ *
+ * Copyright (c) 2010-2016 Institute for System Programming
+ *                         of the Russian Academy of Sciences.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "migration/vmstate.h"
+
+/* Index of the snapshots taken while recording, one "<step> <name>" line
+   each, in <rrfile>.idx.  */
+static FILE *replay_index;
+static char *replay_index_name;
+static int64_t replay_snapshot_period;
+static bool replay_seek_requested;
+static uint64_t replay_seek_step;
+static QEMUTimer *replay_snapshot_timer;
+
+static void replay_pre_save(void *opaque)
+{
+    ReplayState *state = opaque;
+
+    /* The vCPUs are stopped, so this covers every executed instruction */
+    replay_save_instructions();
+    state->file_offset = replay_log_sync();
+}
+
+static int replay_post_load(void *opaque, int version_id)
+{
+    ReplayState *state = opaque;
+
+    if (replay_mode == REPLAY_MODE_NONE) {
+        return 0;
+    }
+    if (state->file_offset == (uint64_t)-1) {
+        error_report("Replay: the snapshot was not taken while recording");
+        return -EINVAL;
+    }
+    replay_log_seek(state->file_offset);
+    return 0;
+}
+
+static const VMStateDescription vmstate_replay = {
+    .name = "replay",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = replay_pre_save,
+    .post_load = replay_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT64_ARRAY(cached_clock, ReplayState, REPLAY_CLOCK_COUNT),
+        VMSTATE_UINT64(current_step, ReplayState),
+        VMSTATE_UINT64(file_offset, ReplayState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static void replay_snapshot_timer_cb(void *opaque)
+{
+    Error *err = NULL;
+    uint64_t step;
+    char *name;
+    int ret;
+
+    if (!runstate_is_running()) {
+        /* Paused by the user: nothing has executed to snapshot */
+        goto out;
+    }
+
+    /* Taking the snapshot must leave no trace in the log: stop the VM
+       while still recording, as a savevm from the monitor would, then
+       save with replay out of the way so that clock reads made by the
+       save itself are not logged.  Nothing else can queue events while
+       this runs, since the main loop does not get to run.  */
+    vm_stop(RUN_STATE_SAVE_VM);
+    replay_save_instructions();
+    step = replay_get_current_step();
+    name = g_strdup_printf("replay-%" PRIu64, step);
+
+    replay_mode = REPLAY_MODE_NONE;
+    ret = save_vmstate(name, false, &err);
+    replay_mode = REPLAY_MODE_RECORD;
+    vm_start();
+
+    if (ret < 0) {
+        error_reportf_err(err, "Replay: periodic snapshots disabled: ");
+        g_free(name);
+        return;
+    }
+
+    fprintf(replay_index, "%" PRIu64 " %s\n", step, name);
+    fflush(replay_index);
+    g_free(name);
+
+out:
+    timer_mod(replay_snapshot_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + replay_snapshot_period);
+}
+
+void replay_vmstate_init(void)
+{
+    vmstate_register(NULL, 0, &vmstate_replay, &replay_state);
+}
+
+void replay_snapshot_init(const char *fname, int64_t period_ms,
+                          bool seek, uint64_t seek_step)
+{
+    replay_index_name = g_strdup_printf("%s.idx", fname);
+    replay_snapshot_period = period_ms;
+    replay_seek_requested = seek;
+    replay_seek_step = seek_step;
+    if (replay_mode != REPLAY_MODE_RECORD || !period_ms) {
+        return;
+    }
+
+    replay_index = fopen(replay_index_name, "w");
+    if (!replay_index) {
+        error_report("Replay: open %s: %s", replay_index_name,
+                     strerror(errno));
+        exit(1);
+    }
+}
+
+void replay_snapshot_start(void)
+{
+    if (!replay_index) {
+        return;
+    }
+
+    /* A realtime timer: it runs no replay checkpoint */
+    replay_snapshot_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                         replay_snapshot_timer_cb, NULL);
+    timer_mod(replay_snapshot_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + replay_snapshot_period);
+}
+
+void replay_snapshot_finish(void)
+{
+    if (replay_snapshot_timer) {
+        timer_del(replay_snapshot_timer);
+        timer_free(replay_snapshot_timer);
+        replay_snapshot_timer = NULL;
+    }
+    if (replay_index) {
+        fclose(replay_index);
+        replay_index = NULL;
+    }
+    g_free(replay_index_name);
+    replay_index_name = NULL;
+}
+
+char *replay_get_seek_snapshot(void)
+{
+    char line[256], name[256];
+    char *best = NULL;
+    uint64_t best_step = 0, s;
+    FILE *f;
+
+    if (replay_mode != REPLAY_MODE_PLAY || !replay_seek_requested) {
+        return NULL;
+    }
+
+    f = fopen(replay_index_name, "r");
+    if (!f) {
+        error_report("Replay: open %s: %s", replay_index_name,
+                     strerror(errno));
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%" SCNu64 " %255s", &s, name) == 2 &&
+            s <= replay_seek_step && (!best || s >= best_step)) {
+            g_free(best);
+            best = g_strdup(name);
+            best_step = s;
+        }
+    }
+    fclose(f);
+    if (!best) {
+        error_report("Replay: no snapshot at or before step %" PRIu64
+                     ", replaying from the start", replay_seek_step);
+    }
+    return best;
+}
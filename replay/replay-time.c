@@ -23,6 +23,8 @@ int64_t replay_save_clock(ReplayClockKind kind, int64_t clock)
         replay_mutex_lock();
         replay_put_event(EVENT_CLOCK + kind);
         replay_put_qword(clock);
+        /* What replay will have cached at this point, for snapshots */
+        replay_state.cached_clock[kind] = clock;
         replay_mutex_unlock();
     }
 
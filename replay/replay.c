@@ -25,6 +25,9 @@
 /* Size of replay log header */
 #define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
 
+/* Flags in the 64-bit word following the version in the header */
+#define REPLAY_FLAG_COMPRESSED      (1ULL << 0)
+
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 
 /* Name of replay file  */
@@ -207,7 +210,11 @@ out:
     return res;
 }
 
-static void replay_enable(const char *fname, int mode)
+static uint64_t replay_flags;
+
+static void replay_enable(const char *fname, int mode, bool compress,
+                          int64_t snapshot_period, bool seek,
+                          uint64_t seek_step)
 {
     const char *fmode = NULL;
     assert(!replay_file);
@@ -244,18 +251,28 @@ static void replay_enable(const char *fname, int mode)
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_flags = compress ? REPLAY_FLAG_COMPRESSED : 0;
+        replay_writer_start(compress);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
         unsigned int version = replay_get_dword();
         if (version != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
+        replay_flags = replay_get_qword();
+        if (replay_flags & ~REPLAY_FLAG_COMPRESSED) {
+            fprintf(stderr, "Replay: unknown input log file flags\n");
+            exit(1);
+        }
         /* go to the beginning */
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_reader_start(replay_flags & REPLAY_FLAG_COMPRESSED);
         replay_fetch_data_kind();
     }
 
     replay_init_events();
+    replay_vmstate_init();
+    replay_snapshot_init(fname, snapshot_period, seek, seek_step);
 }
 
 void replay_configure(QemuOpts *opts)
@@ -263,6 +280,8 @@ void replay_configure(QemuOpts *opts)
     const char *fname;
     const char *rr;
     ReplayMode mode = REPLAY_MODE_NONE;
+    uint64_t period;
+    bool seek;
     Location loc;
 
     if (!opts) {
@@ -291,7 +310,26 @@ void replay_configure(QemuOpts *opts)
         exit(1);
     }
 
-    replay_enable(fname, mode);
+    if (qemu_opt_get_bool(opts, "rrcompress", false) &&
+        mode != REPLAY_MODE_RECORD) {
+        error_report("rrcompress only applies to rr=record; compressed logs "
+                     "are detected on replay");
+        exit(1);
+    }
+
+    period = qemu_opt_get_number(opts, "rrsnapshot-period", 0);
+    if (period && mode != REPLAY_MODE_RECORD) {
+        error_report("rrsnapshot-period only applies to rr=record");
+        exit(1);
+    }
+    seek = qemu_opt_get(opts, "rrseek") != NULL;
+    if (seek && mode != REPLAY_MODE_PLAY) {
+        error_report("rrseek only applies to rr=replay");
+        exit(1);
+    }
+
+    replay_enable(fname, mode, qemu_opt_get_bool(opts, "rrcompress", false),
+                  period * 1000, seek, qemu_opt_get_number(opts, "rrseek", 0));
 
 out:
     loc_pop(&loc);
@@ -312,8 +350,7 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
-
+    replay_snapshot_start();
     replay_enable_events();
 }
 
@@ -323,6 +360,7 @@ void replay_finish(void)
         return;
     }
 
+    replay_snapshot_finish();
     replay_save_instructions();
 
     /* finalize the file */
@@ -330,10 +368,14 @@ void replay_finish(void)
         if (replay_mode == REPLAY_MODE_RECORD) {
             /* write end event */
             replay_put_event(EVENT_END);
+            replay_writer_stop();
 
             /* write header */
             fseek(replay_file, 0, SEEK_SET);
             replay_put_dword(REPLAY_VERSION);
+            replay_put_qword(replay_flags);
+        } else {
+            replay_reader_stop();
         }
 
         fclose(replay_file);
@@ -138,7 +138,9 @@ diddit:
 	/*
 	 * This prevents us from malloc()ing too many mbufs
 	 */
-	if_start(ifm->slirp);
+        if (!slirp->if_start_defer) {
+                if_start(ifm->slirp);
+        }
 #endif
 }
 
@@ -166,6 +168,7 @@ void if_start(Slirp *slirp)
         return;
     }
     slirp->if_start_busy = true;
+    slirp_output_burst(slirp->opaque, true);
 
     if (slirp->if_fastq.qh_link != &slirp->if_fastq) {
         ifm_next = (struct mbuf *) slirp->if_fastq.qh_link;
@@ -235,5 +238,6 @@ void if_start(Slirp *slirp)
         m_free(ifm);
     }
 
+    slirp_output_burst(slirp->opaque, false);
     slirp->if_start_busy = false;
 }
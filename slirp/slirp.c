@@ -280,7 +280,7 @@ Slirp *slirp_init(int restricted, bool in_enabled, struct in_addr vnetwork,
                   const char *tftp_path, const char *bootfile,
                   struct in_addr vdhcp_start, struct in_addr vnameserver,
                   struct in6_addr vnameserver6, const char **vdnssearch,
-                  void *opaque)
+                  int tcp_sndbuf, int tcp_rcvbuf, void *opaque)
 {
     Slirp *slirp = g_malloc0(sizeof(Slirp));
 
@@ -314,6 +314,8 @@ Slirp *slirp_init(int restricted, bool in_enabled, struct in_addr vnetwork,
     slirp->vdhcp_startaddr = vdhcp_start;
     slirp->vnameserver_addr = vnameserver;
     slirp->vnameserver_addr6 = vnameserver6;
+    slirp->tcp_sndspace = tcp_sndbuf ? tcp_sndbuf : TCP_SNDSPACE;
+    slirp->tcp_rcvspace = tcp_rcvbuf ? tcp_rcvbuf : TCP_RCVSPACE;
 
     if (vdnssearch) {
         translate_dnssearch(slirp, vdnssearch);
@@ -562,6 +564,12 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        /*
+         * Queue up everything the sockets produce and hand it to the
+         * guest in one go below, rather than one packet per segment.
+         */
+        slirp->if_start_defer = true;
+
         /*
          * See if anything has timed out
          */
@@ -767,6 +775,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
             }
         }
 
+        slirp->if_start_defer = false;
         if_start(slirp);
     }
 }
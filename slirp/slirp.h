@@ -185,6 +185,7 @@ struct Slirp {
     struct quehead if_batchq;  /* queue for non-interactive data */
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
+    bool if_start_defer;    /* if_output leaves if_start to the caller */
 
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
@@ -197,6 +198,8 @@ struct Slirp {
     uint8_t *vdnssearch;
 
     /* tcp states */
+    int tcp_sndspace;       /* socket buffer sizes for new connections */
+    int tcp_rcvspace;
     struct socket tcb;
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
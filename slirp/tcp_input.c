@@ -102,6 +102,16 @@ static void tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt,
                           struct tcpiphdr *ti);
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt);
 
+/* Do window scaling on this connection, if both sides asked for it */
+static void tcp_setscale(struct tcpcb *tp)
+{
+    if ((tp->t_flags & (TF_RCVD_SCALE | TF_REQ_SCALE)) ==
+        (TF_RCVD_SCALE | TF_REQ_SCALE)) {
+        tp->snd_scale = tp->requested_s_scale;
+        tp->rcv_scale = tp->request_r_scale;
+    }
+}
+
 static int
 tcp_reass(register struct tcpcb *tp, register struct tcpiphdr *ti,
           struct mbuf *m)
@@ -436,8 +446,8 @@ findso:
 	    goto dropwithreset;
 	  }
 
-	  sbreserve(&so->so_snd, TCP_SNDSPACE);
-	  sbreserve(&so->so_rcv, TCP_RCVSPACE);
+          sbreserve(&so->so_snd, slirp->tcp_sndspace);
+          sbreserve(&so->so_rcv, slirp->tcp_rcvspace);
 
 	  so->lhost.ss = lhost;
 	  so->fhost.ss = fhost;
@@ -476,6 +486,9 @@ findso:
 		goto drop;
 
 	tiwin = ti->ti_win;
+        if ((tiflags & TH_SYN) == 0) {
+                tiwin <<= tp->snd_scale;
+        }
 
 	/*
 	 * Segment received on connection.
@@ -804,6 +817,7 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+                        tcp_setscale(tp);
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -984,6 +998,7 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+                tcp_setscale(tp);
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1439,6 +1454,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+                case TCPOPT_WINDOW:
+                        if (optlen != TCPOLEN_WINDOW ||
+                            !(ti->ti_flags & TH_SYN)) {
+                                continue;
+                        }
+                        tp->t_flags |= TF_RCVD_SCALE;
+                        tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+                        break;
 		}
 	}
 }
@@ -1578,6 +1602,8 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
+        int sndspace = so->slirp->tcp_sndspace;
+        int rcvspace = so->slirp->tcp_rcvspace;
 	int mss;
 
 	DEBUG_CALL("tcp_mss");
@@ -1605,12 +1631,12 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+        sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) :
+                                           0));
+        sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) :
+                                           0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
@@ -274,6 +274,18 @@ send:
 			mss = htons((uint16_t) tcp_mss(tp, 0));
 			memcpy((caddr_t)(opt + 2), (caddr_t)&mss, sizeof(mss));
 			optlen = 4;
+
+                        /*
+                         * Offer window scaling, or answer the peer's offer.
+                         */
+                        if ((tp->t_flags & TF_REQ_SCALE) &&
+                            ((flags & TH_ACK) == 0 ||
+                             (tp->t_flags & TF_RCVD_SCALE))) {
+                                opt[optlen++] = TCPOPT_NOP;
+                                opt[optlen++] = TCPOPT_WINDOW;
+                                opt[optlen++] = TCPOLEN_WINDOW;
+                                opt[optlen++] = tp->request_r_scale;
+                        }
 		}
  	}
 
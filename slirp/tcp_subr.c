@@ -258,6 +258,20 @@ tcp_newtcpcb(struct socket *so)
 	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
 	tp->t_socket = so;
 
+        /*
+         * Windows beyond 64k need scaling.  Keep the historic behaviour
+         * with the default buffer sizes.
+         */
+        if (so->slirp->tcp_sndspace > TCP_MAXWIN ||
+            so->slirp->tcp_rcvspace > TCP_MAXWIN) {
+                tp->t_flags |= TF_REQ_SCALE;
+                while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+                       (TCP_MAXWIN << tp->request_r_scale) <
+                       so->slirp->tcp_rcvspace) {
+                        tp->request_r_scale++;
+                }
+        }
+
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
 	 * rtt estimate.  Set rttvar so that srtt + 2 * rttvar gives
@@ -7778,6 +7778,46 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     gen_exception_internal_insn(s, 4, EXCP_STREX);
 }
 #else
+/* strex{b,h,} as one cmpxchg against the value loaded by ldrex, so that
+   no store from another vCPU can come between the compare and the store.
+   As before, a store of the same value in between goes unnoticed.  */
+static void gen_store_exclusive_atomic(DisasContext *s, int rd, int rt,
+                                       TCGv_i32 addr, int size)
+{
+    TCGLabel *done_label = gen_new_label();
+    TCGLabel *fail_label = gen_new_label();
+    TCGv_i64 extaddr = tcg_temp_new_i64();
+    TCGv taddr = tcg_temp_new();
+    TCGv_i32 cmpv, newv, oldv;
+
+    tcg_gen_extu_i32_i64(extaddr, addr);
+    tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
+    tcg_temp_free_i64(extaddr);
+
+#if TARGET_LONG_BITS == 32
+    tcg_gen_mov_i32(taddr, addr);
+#else
+    tcg_gen_extu_i32_i64(taddr, addr);
+#endif
+    cmpv = tcg_temp_new_i32();
+    tcg_gen_extrl_i64_i32(cmpv, cpu_exclusive_val);
+    newv = load_reg(s, rt);
+    oldv = tcg_temp_new_i32();
+    tcg_gen_atomic_cmpxchg_i32(oldv, taddr, cmpv, newv, get_mem_index(s),
+                               size | s->be_data);
+    tcg_gen_setcond_i32(TCG_COND_NE, cpu_R[rd], oldv, cmpv);
+    tcg_temp_free_i32(oldv);
+    tcg_temp_free_i32(newv);
+    tcg_temp_free_i32(cmpv);
+    tcg_temp_free(taddr);
+    tcg_gen_br(done_label);
+
+    gen_set_label(fail_label);
+    tcg_gen_movi_i32(cpu_R[rd], 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+}
+
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
@@ -7786,6 +7826,12 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGLabel *done_label;
     TCGLabel *fail_label;
 
+    /* strexd and BE32 byte lanes still take the sequence below */
+    if (size < 3 && !s->sctlr_b) {
+        gen_store_exclusive_atomic(s, rd, rt, addr, size);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -37,6 +37,9 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* The translator honours CF_SUPERBLOCK */
+#define TARGET_HAS_SUPERBLOCKS
+
 #ifdef TARGET_X86_64
 #define I386_ELF_MACHINE  EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
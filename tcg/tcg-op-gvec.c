@@ -0,0 +1,159 @@
+/*
+ * Generic vector operation expansion for TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+/* The top bit of every element of size VECE */
+static uint64_t gvec_sign_mask(unsigned vece)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x8080808080808080ull;
+    case MO_16:
+        return 0x8000800080008000ull;
+    case MO_32:
+        return 0x8000000080000000ull;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Add the elements with the top bits cleared, so that no carry leaves an
+   element, then put the top bits back as a + b without carry in.  */
+static void gen_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    m = tcg_const_i64(gvec_sign_mask(vece));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+
+    tcg_gen_xor_i64(t2, a, b);
+    tcg_gen_and_i64(t2, t2, m);
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(d, b, m);
+    tcg_gen_add_i64(d, t1, d);
+    tcg_gen_xor_i64(d, d, t2);
+
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(m);
+}
+
+/* Likewise, with the top bits of the minuend set so that no borrow
+   leaves an element.  */
+static void gen_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    m = tcg_const_i64(gvec_sign_mask(vece));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+
+    tcg_gen_eqv_i64(t2, a, b);
+    tcg_gen_and_i64(t2, t2, m);
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(d, b, m);
+    tcg_gen_sub_i64(d, t1, d);
+    tcg_gen_xor_i64(d, d, t2);
+
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(m);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void expand_3(GVecGen3Fn *fn, unsigned vece, uint32_t dofs,
+                     uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+        fn(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(gen_add_i64, vece, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    expand_3(gen_sub_i64, vece, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    expand_3(gen_and_i64, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz)
+{
+    expand_3(gen_or_i64, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    expand_3(gen_xor_i64, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz)
+{
+    expand_3(gen_andc_i64, MO_64, dofs, aofs, bofs, oprsz);
+}
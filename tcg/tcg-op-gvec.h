@@ -0,0 +1,38 @@
+/*
+ * Generic vector operation expansion for TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_OP_GVEC_H
+#define TCG_OP_GVEC_H
+
+/*
+ * "Generic" vectors are guest vector registers stored in the CPU state:
+ * DOFS, AOFS and BOFS are offsets from tcg_ctx.tcg_env, and OPRSZ is
+ * the size of the vector in bytes, a multiple of 8.  VECE is the log2
+ * size of one element, as MO_8 ... MO_64.
+ *
+ * The operations are expanded inline with 64-bit integer ops, eight
+ * bytes at a time, with carries kept inside each element, instead of
+ * calling an out-of-line helper.  The destination may overlap either
+ * source.
+ */
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+
+void tcg_gen_gvec_and(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+void tcg_gen_gvec_or(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                     uint32_t oprsz);
+void tcg_gen_gvec_xor(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+/* D = A & ~B */
+void tcg_gen_gvec_andc(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                       uint32_t oprsz);
+
+#endif
@@ -1849,6 +1849,18 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+void tcg_gen_lookup_and_goto_ptr(void)
+{
+    if (TCG_TARGET_HAS_goto_ptr && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr, tcg_ctx.tcg_env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     /* Trigger the asserts within as early as possible.  */
@@ -1958,3 +1970,225 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
                                addr, trace_mem_get_info(memop, 1));
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
+
+static void gen_ext_i32(TCGv_i32 ret, TCGv_i32 val, TCGMemOp opc)
+{
+    switch (opc & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i32(ret, val);
+        break;
+    case MO_UB:
+        tcg_gen_ext8u_i32(ret, val);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i32(ret, val);
+        break;
+    case MO_UW:
+        tcg_gen_ext16u_i32(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i32(ret, val);
+        break;
+    }
+}
+
+static void gen_ext_i64(TCGv_i64 ret, TCGv_i64 val, TCGMemOp opc)
+{
+    switch (opc & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i64(ret, val);
+        break;
+    case MO_UB:
+        tcg_gen_ext8u_i64(ret, val);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i64(ret, val);
+        break;
+    case MO_UW:
+        tcg_gen_ext16u_i64(ret, val);
+        break;
+    case MO_SL:
+        tcg_gen_ext32s_i64(ret, val);
+        break;
+    case MO_UL:
+        tcg_gen_ext32u_i64(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i64(ret, val);
+        break;
+    }
+}
+
+/* With softmmu the atomic operations call a helper that does the TLB
+   lookup and then uses a host atomic on the RAM behind it.  Without it
+   they are expanded as a plain load and store: user mode targets still
+   serialize their atomic instructions themselves.  */
+#ifdef CONFIG_SOFTMMU
+# define ATOMIC_HELPER(NAME)  gen_helper_atomic_##NAME
+#else
+# define ATOMIC_HELPER(NAME)  NULL
+#endif
+
+typedef void (*gen_atomic_op_i32)(TCGv_i32, TCGv_env, TCGv,
+                                  TCGv_i32, TCGv_i32);
+typedef void (*gen_atomic_op_i64)(TCGv_i64, TCGv_env, TCGv,
+                                  TCGv_i64, TCGv_i32);
+
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
+                                TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+#ifdef CONFIG_SOFTMMU
+    {
+        TCGv_i32 oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+
+        gen_helper_atomic_cmpxchg_i32(t1, tcg_ctx.tcg_env, addr, cmpv, newv,
+                                      oi);
+        tcg_temp_free_i32(oi);
+    }
+#else
+    {
+        TCGv_i32 t2 = tcg_temp_new_i32();
+
+        gen_ext_i32(t2, cmpv, memop & MO_SIZE);
+        tcg_gen_qemu_ld_i32(t1, addr, idx, memop & ~MO_SIGN);
+        tcg_gen_movcond_i32(TCG_COND_EQ, t2, t1, t2, newv, t1);
+        tcg_gen_qemu_st_i32(t2, addr, idx, memop);
+        tcg_temp_free_i32(t2);
+    }
+#endif
+    gen_ext_i32(retv, t1, memop);
+    tcg_temp_free_i32(t1);
+}
+
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv addr, TCGv_i64 cmpv,
+                                TCGv_i64 newv, TCGArg idx, TCGMemOp memop)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+#ifdef CONFIG_SOFTMMU
+    {
+        TCGv_i32 oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+
+        gen_helper_atomic_cmpxchg_i64(t1, tcg_ctx.tcg_env, addr, cmpv, newv,
+                                      oi);
+        tcg_temp_free_i32(oi);
+    }
+#else
+    {
+        TCGv_i64 t2 = tcg_temp_new_i64();
+
+        gen_ext_i64(t2, cmpv, memop & MO_SIZE);
+        tcg_gen_qemu_ld_i64(t1, addr, idx, memop & ~MO_SIGN);
+        tcg_gen_movcond_i64(TCG_COND_EQ, t2, t1, t2, newv, t1);
+        tcg_gen_qemu_st_i64(t2, addr, idx, memop);
+        tcg_temp_free_i64(t2);
+    }
+#endif
+    gen_ext_i64(retv, t1, memop);
+    tcg_temp_free_i64(t1);
+}
+
+static void do_atomic_op_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
+                             TCGArg idx, TCGMemOp memop, bool new_val,
+                             void (*gen)(TCGv_i32, TCGv_i32, TCGv_i32),
+                             gen_atomic_op_i32 fn)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    if (fn) {
+        TCGv_i32 oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+
+        fn(t1, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+        if (new_val) {
+            gen(t1, t1, val);
+        }
+    } else {
+        TCGv_i32 t2 = tcg_temp_new_i32();
+
+        tcg_gen_qemu_ld_i32(t1, addr, idx, memop & ~MO_SIGN);
+        gen(t2, t1, val);
+        tcg_gen_qemu_st_i32(t2, addr, idx, memop);
+        if (new_val) {
+            tcg_gen_mov_i32(t1, t2);
+        }
+        tcg_temp_free_i32(t2);
+    }
+    gen_ext_i32(ret, t1, memop);
+    tcg_temp_free_i32(t1);
+}
+
+static void do_atomic_op_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 val,
+                             TCGArg idx, TCGMemOp memop, bool new_val,
+                             void (*gen)(TCGv_i64, TCGv_i64, TCGv_i64),
+                             gen_atomic_op_i64 fn)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if (fn) {
+        TCGv_i32 oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+
+        fn(t1, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+        if (new_val) {
+            gen(t1, t1, val);
+        }
+    } else {
+        TCGv_i64 t2 = tcg_temp_new_i64();
+
+        tcg_gen_qemu_ld_i64(t1, addr, idx, memop & ~MO_SIGN);
+        gen(t2, t1, val);
+        tcg_gen_qemu_st_i64(t2, addr, idx, memop);
+        if (new_val) {
+            tcg_gen_mov_i64(t1, t2);
+        }
+        tcg_temp_free_i64(t2);
+    }
+    gen_ext_i64(ret, t1, memop);
+    tcg_temp_free_i64(t1);
+}
+
+#define GEN_ATOMIC_OP(NAME, OP, NEW, HELPER)                            \
+void tcg_gen_atomic_##NAME##_i32                                        \
+    (TCGv_i32 ret, TCGv addr, TCGv_i32 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i32(ret, addr, val, idx, memop, NEW,                   \
+                     tcg_gen_##OP##_i32, ATOMIC_HELPER(HELPER##_i32));  \
+}                                                                       \
+void tcg_gen_atomic_##NAME##_i64                                        \
+    (TCGv_i64 ret, TCGv addr, TCGv_i64 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i64(ret, addr, val, idx, memop, NEW,                   \
+                     tcg_gen_##OP##_i64, ATOMIC_HELPER(HELPER##_i64));  \
+}
+
+GEN_ATOMIC_OP(fetch_add, add, 0, fetch_add)
+GEN_ATOMIC_OP(fetch_and, and, 0, fetch_and)
+GEN_ATOMIC_OP(fetch_or, or, 0, fetch_or)
+GEN_ATOMIC_OP(fetch_xor, xor, 0, fetch_xor)
+
+GEN_ATOMIC_OP(add_fetch, add, 1, fetch_add)
+GEN_ATOMIC_OP(and_fetch, and, 1, fetch_and)
+GEN_ATOMIC_OP(or_fetch, or, 1, fetch_or)
+GEN_ATOMIC_OP(xor_fetch, xor, 1, fetch_xor)
+
+static void tcg_gen_mov2_i32(TCGv_i32 r, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_mov_i32(r, b);
+}
+
+static void tcg_gen_mov2_i64(TCGv_i64 r, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_mov_i64(r, b);
+}
+
+GEN_ATOMIC_OP(xchg, mov2, 0, xchg)
+
+#undef GEN_ATOMIC_OP
+#undef ATOMIC_HELPER
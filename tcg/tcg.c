@@ -406,9 +406,9 @@ void tcg_prologue_init(TCGContext *s)
     s->code_gen_buffer_size = total_size;
 
     /* Compute a high-water mark, at which we voluntarily flush the buffer
-       and start over.  The size here is arbitrary, significantly larger
-       than we expect the code generation for any one opcode to require.  */
-    s->code_gen_highwater = s->code_gen_buffer + (total_size - 1024);
+       and start over.  translate-all.c narrows it down to the region
+       being filled once it splits the buffer.  */
+    s->code_gen_highwater = s->code_gen_buffer + (total_size - TCG_HIGHWATER);
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
@@ -933,6 +933,8 @@ static void tcg_reg_alloc_start(TCGContext *s)
     }
 
     memset(s->reg_to_temp, 0, sizeof(s->reg_to_temp));
+    s->reg_ld_count = 0;
+    s->reg_st_count = 0;
 }
 
 static char *tcg_get_arg_str_ptr(TCGContext *s, char *buf, int buf_size,
@@ -1949,6 +1951,7 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
             if (free_or_dead
                 && tcg_out_sti(s, ts->type, ts->val,
                                ts->mem_base->reg, ts->mem_offset)) {
+                s->reg_st_count++;
                 break;
             }
             temp_load(s, ts, tcg_target_available_regs[ts->type],
@@ -1958,6 +1961,7 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
         case TEMP_VAL_REG:
             tcg_out_st(s, ts->type, ts->reg,
                        ts->mem_base->reg, ts->mem_offset);
+            s->reg_st_count++;
             break;
 
         case TEMP_VAL_MEM:
@@ -1983,13 +1987,53 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
     }
 }
 
+/* Number of ops tcg_reg_alloc() looks at when choosing what to spill */
+#define TCG_SPILL_LOOKAHEAD 32
+
+/* Return how many ops after the current one TS is next read, or
+   TCG_SPILL_LOOKAHEAD if it is not read before that or before the end
+   of the basic block, where it would have to go back to memory anyway.  */
+static int temp_next_use(TCGContext *s, TCGTemp *ts)
+{
+    TCGArg idx = temp_idx(s, ts);
+    int oi = s->gen_op_buf[s->cur_op_idx].next;
+    int dist;
+
+    for (dist = 0; oi != 0 && dist < TCG_SPILL_LOOKAHEAD; dist++) {
+        TCGOp *op = &s->gen_op_buf[oi];
+        TCGArg *args = &s->gen_opparam_buf[op->args];
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        int nb_oargs, nb_iargs, i;
+
+        if (op->opc == INDEX_op_call) {
+            nb_oargs = op->callo;
+            nb_iargs = op->calli;
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+        }
+        for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+            if (args[i] == idx) {
+                return dist;
+            }
+        }
+        if (def->flags & TCG_OPF_BB_END) {
+            break;
+        }
+        oi = op->next;
+    }
+    return TCG_SPILL_LOOKAHEAD;
+}
+
 /* Allocate a register belonging to reg1 & ~reg2 */
 static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
                             TCGRegSet allocated_regs, bool rev)
 {
     int i, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
     const int *order;
-    TCGReg reg;
+    TCGReg reg, best_reg = -1;
+    int score, best_score = -1;
+    TCGTemp *ts;
     TCGRegSet reg_ct;
 
     tcg_regset_andnot(reg_ct, desired_regs, allocated_regs);
@@ -2002,13 +2046,29 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
             return reg;
     }
 
-    /* XXX: do better spill choice */
-    for(i = 0; i < n; i++) {
+    /* Spill the temp that is read again the latest, so that the reload
+       is as far away as possible and may not be needed at all; among
+       those, prefer one that is already in sync with memory, which can
+       be dropped without a store.  */
+    for (i = 0; i < n; i++) {
         reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg)) {
-            tcg_reg_free(s, reg, allocated_regs);
-            return reg;
+        if (!tcg_regset_test_reg(reg_ct, reg)) {
+            continue;
         }
+        ts = s->reg_to_temp[reg];
+        score = ts ? temp_next_use(s, ts) * 2 + ts->mem_coherent
+                   : TCG_SPILL_LOOKAHEAD * 2 + 1;
+        if (score > best_score) {
+            best_score = score;
+            best_reg = reg;
+            if (score > TCG_SPILL_LOOKAHEAD * 2) {
+                break;
+            }
+        }
+    }
+    if (best_reg != -1) {
+        tcg_reg_free(s, best_reg, allocated_regs);
+        return best_reg;
     }
 
     tcg_abort();
@@ -2032,6 +2092,7 @@ static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
     case TEMP_VAL_MEM:
         reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
         tcg_out_ld(s, ts->type, reg, ts->mem_base->reg, ts->mem_offset);
+        s->reg_ld_count++;
         ts->mem_coherent = 1;
         break;
     case TEMP_VAL_DEAD:
@@ -2616,6 +2677,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         TCGLifeData arg_life = op->life;
 
         oi_next = op->next;
+        s->cur_op_idx = oi;
 #ifdef CONFIG_PROFILER
         tcg_table_op_count[opc]++;
 #endif
@@ -65,6 +65,11 @@
 # endif
 #endif
 
+/* Oversized TCG guests make things like MTTCG hard
+ * as we can't use atomics for cputlb updates.
+ */
+#define TCG_OVERSIZED_GUEST (TARGET_LONG_BITS > TCG_TARGET_REG_BITS)
+
 #if TCG_TARGET_REG_BITS == 32
 typedef int32_t tcg_target_long;
 typedef uint32_t tcg_target_ulong;
@@ -228,6 +233,11 @@ typedef struct TCGPool {
 #define TCG_MAX_TEMPS 512
 #define TCG_MAX_INSNS 512
 
+/* Room left at the end of the code buffer, or of a region of it; the
+   size is arbitrary, significantly larger than we expect the code
+   generation for any one opcode to require.  */
+#define TCG_HIGHWATER 1024
+
 /* when the size of the arguments of a called function is smaller than
    this value, they are statically allocated in the TB stack frame */
 #define TCG_STATIC_CALL_ARGS_SIZE 128
@@ -663,17 +673,32 @@ struct TCGContext {
     int gen_next_op_idx;
     int gen_next_parm_idx;
 
+    /* Op being allocated, for the spill lookahead of tcg_reg_alloc() */
+    int cur_op_idx;
+
+    /* Loads and stores of temps emitted by the register allocator for
+       the last TB, and totals over all TBs along with the guest insns
+       and host code bytes; see CPU_LOG_TB_STATS and "info jit".  */
+    int reg_ld_count;
+    int reg_st_count;
+    int64_t reg_ld_total;
+    int64_t reg_st_total;
+    int64_t guest_insn_total;
+    int64_t host_bytes_total;
+
     /* Code generation.  Note that we specifically do not use tcg_insn_unit
        here, because there's too much arithmetic throughout that relies
        on addition and subtraction working on bytes.  Rely on the GCC
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     void *code_gen_ptr;
 
-    /* Threshold to flush the translated code buffer.  */
+    /* Threshold to move to the next region of the translated code
+       buffer.  */
     void *code_gen_highwater;
 
     TBContext tb_ctx;
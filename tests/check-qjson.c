@@ -14,6 +14,8 @@
 
 #include "qapi/qmp/types.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/json-streamer.h"
 #include "qemu-common.h"
 
 static void escaped_string(void)
@@ -1502,6 +1504,58 @@ static void limits_nesting(void)
     g_assert(obj == NULL);
 }
 
+typedef struct SplitFeed {
+    JSONMessageParser parser;
+    QObject *objs[5];
+    int count;
+} SplitFeed;
+
+static void split_feed_emit(JSONMessageParser *parser, GQueue *tokens)
+{
+    SplitFeed *s = container_of(parser, SplitFeed, parser);
+
+    g_assert(s->count < ARRAY_SIZE(s->objs));
+    s->objs[s->count++] = json_parser_parse(tokens, NULL);
+}
+
+static void split_feed(void)
+{
+    const char *json = "{ 'a': [ 1, 2.5, \"x\\ny\" ], 'b': true } "
+                       "[ null, { 'c': -17 } ] 'str' 42";
+    const char *expected[] = {
+        "{\"a\": [1, 2.5, \"x\\ny\"], \"b\": true}",
+        "[null, {\"c\": -17}]",
+        "\"str\"",
+        "42",
+    };
+    size_t len = strlen(json);
+    size_t step, i;
+
+    /* Whatever the split, the lexer must see the same tokens */
+    for (step = 1; step <= len; step++) {
+        SplitFeed s = { .count = 0 };
+
+        json_message_parser_init(&s.parser, split_feed_emit);
+        for (i = 0; i < len; i += step) {
+            json_message_parser_feed(&s.parser, json + i,
+                                     MIN(step, len - i));
+        }
+        json_message_parser_flush(&s.parser);
+        json_message_parser_destroy(&s.parser);
+
+        g_assert_cmpint(s.count, ==, ARRAY_SIZE(expected));
+        for (i = 0; i < ARRAY_SIZE(expected); i++) {
+            QString *str;
+
+            g_assert(s.objs[i] != NULL);
+            str = qobject_to_json(s.objs[i]);
+            g_assert_cmpstr(qstring_get_str(str), ==, expected[i]);
+            QDECREF(str);
+            qobject_decref(s.objs[i]);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1539,5 +1593,7 @@ int main(int argc, char **argv)
     g_test_add_func("/errors/unterminated/literal", unterminated_literal);
     g_test_add_func("/errors/limits/nesting", limits_nesting);
 
+    g_test_add_func("/streamer/split_feed", split_feed);
+
     return g_test_run();
 }
@@ -193,6 +193,7 @@ typedef struct DummyBackendClass DummyBackendClass;
 #define TYPE_DUMMY_DEV "qemu-dummy-dev"
 #define TYPE_DUMMY_BUS "qemu-dummy-bus"
 #define TYPE_DUMMY_BACKEND "qemu-dummy-backend"
+#define TYPE_DUMMY_BACKEND_CHILD "qemu-dummy-backend-child"
 
 #define DUMMY_DEV(obj)                               \
     OBJECT_CHECK(DummyDev, (obj), TYPE_DUMMY_DEV)
@@ -304,6 +305,11 @@ static const TypeInfo dummy_backend_info = {
     .class_size = sizeof(DummyBackendClass),
 };
 
+static const TypeInfo dummy_backend_child_info = {
+    .name          = TYPE_DUMMY_BACKEND_CHILD,
+    .parent        = TYPE_DUMMY_BACKEND,
+};
+
 
 
 static void test_dummy_createv(void)
@@ -497,6 +503,31 @@ static void test_dummy_delchild(void)
     object_unparent(OBJECT(dev));
 }
 
+static void test_dummy_class_caches(void)
+{
+    ObjectClass *parent = object_class_by_name(TYPE_DUMMY_BACKEND);
+    ObjectClass *child;
+    ObjectProperty *prop;
+    char *name = g_strdup(TYPE_DUMMY_BACKEND_CHILD);
+
+    /* The child class must not inherit the parent's failed casts */
+    g_assert(!object_class_dynamic_cast(parent, name));
+    g_assert(!object_class_dynamic_cast(parent, name));
+    child = object_class_by_name(TYPE_DUMMY_BACKEND_CHILD);
+    g_assert(object_class_dynamic_cast(child, name) == child);
+    g_assert(object_class_dynamic_cast(child, name) == child);
+    g_assert(!object_class_dynamic_cast(child, TYPE_DUMMY_DEV));
+    g_assert(!object_class_dynamic_cast(child, TYPE_DUMMY_DEV));
+    g_free(name);
+
+    /* Adding a property to the parent invalidates the child's lookups */
+    g_assert(!object_class_property_find(child, "late", NULL));
+    object_class_property_add_bool(parent, "late", NULL, NULL, &error_abort);
+    prop = object_class_property_find(child, "late", &error_abort);
+    g_assert_cmpstr(prop->type, ==, "bool");
+    g_assert(object_class_property_find(child, "late", NULL) == prop);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -506,6 +537,7 @@ int main(int argc, char **argv)
     type_register_static(&dummy_dev_info);
     type_register_static(&dummy_bus_info);
     type_register_static(&dummy_backend_info);
+    type_register_static(&dummy_backend_child_info);
 
     g_test_add_func("/qom/proplist/createlist", test_dummy_createlist);
     g_test_add_func("/qom/proplist/createv", test_dummy_createv);
@@ -513,6 +545,7 @@ int main(int argc, char **argv)
     g_test_add_func("/qom/proplist/getenum", test_dummy_getenum);
     g_test_add_func("/qom/proplist/iterator", test_dummy_iterator);
     g_test_add_func("/qom/proplist/delchild", test_dummy_delchild);
+    g_test_add_func("/qom/proplist/classcaches", test_dummy_class_caches);
 
     return g_test_run();
 }
@@ -0,0 +1,482 @@
+/*
+ * colo-compare benchmark
+ *
+ * Starts QEMU with a colo-compare object under qtest and feeds it
+ * synthetic TCP traffic on its primary and secondary inputs, then
+ * measures how fast, and how late, the primary packets come out of
+ * outdev.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <poll.h>
+#include "libqtest.h"
+#include "qapi/error.h"
+#include "qemu/sockets.h"
+#include "qemu/bswap.h"
+#include "qapi/qmp/qdict.h"
+
+#define FRAME_HDR_LEN   (14 + 20 + 20)
+#define STALL_TIMEOUT_MS 2000
+
+typedef struct Chan {
+    int fd;
+    GByteArray *buf;
+    size_t off;
+} Chan;
+
+static const char commands_string[] =
+    " -d = duration, in seconds\n"
+    " -n = number of connections\n"
+    " -w = window: packets in flight at any time\n"
+    " -b = batch: secondary packets sent back to back\n"
+    " -s = TCP payload size, in bytes\n"
+    " -r = percentage of adjacent secondary packets swapped\n"
+    " -m = percentage of packet pairs that miscompare\n"
+    " -W = number of colo-compare workers\n"
+    " -t = enable colo-compare's tcp_stream mode\n";
+
+static unsigned int duration = 5;
+static unsigned int n_conns = 64;
+static unsigned int window = 256;
+static unsigned int batch = 32;
+static unsigned int payload_size = 256;
+static unsigned int reorder_rate;
+static unsigned int mismatch_rate;
+static unsigned int n_workers = 1;
+static bool tcp_stream;
+
+static Chan pri, sec, out;
+static uint32_t *conn_seq;
+static uint32_t mismatch_conns;
+static uint64_t next_id;
+static int64_t *sent_us;
+static uint8_t **sec_batch;
+static size_t sec_batch_n;
+static unsigned int in_flight;
+static GArray *latencies;
+static uint64_t n_sent, n_released, n_mismatched;
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:n:w:b:s:r:m:W:th");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_conns = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 's':
+            payload_size = atoi(optarg);
+            break;
+        case 'r':
+            reorder_rate = atoi(optarg);
+            break;
+        case 'm':
+            mismatch_rate = atoi(optarg);
+            break;
+        case 'W':
+            n_workers = atoi(optarg);
+            break;
+        case 't':
+            tcp_stream = true;
+            break;
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        default:
+            usage_complete(argv);
+        }
+    }
+    if (!duration || !n_conns || !window || !batch ||
+        payload_size < sizeof(uint64_t) || payload_size > 1400 ||
+        reorder_rate > 100 || mismatch_rate > 100 || !n_workers) {
+        usage_complete(argv);
+    }
+}
+
+/*
+ * Build one Ethernet/IPv4/TCP frame, prefixed with the 4-byte big-endian
+ * length that the colo-compare chardevs expect.  Connection @conn is told
+ * apart by its source address; the payload starts with @id.
+ */
+static uint8_t *build_frame(uint32_t conn, uint32_t seq, uint64_t id)
+{
+    size_t len = FRAME_HDR_LEN + payload_size;
+    uint8_t *f = g_malloc0(4 + len);
+    uint8_t *eth = f + 4, *ip = eth + 14, *tcp = ip + 20;
+
+    stl_be_p(f, len);
+    memcpy(eth, "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x12\x34\x57", 12);
+    stw_be_p(eth + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + payload_size);
+    stw_be_p(ip + 4, seq);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a000000 | conn);
+    stl_be_p(ip + 16, 0x0b000001);
+
+    stw_be_p(tcp, 1024 + conn % 60000);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;                 /* PSH|ACK */
+    stw_be_p(tcp + 14, 65535);
+
+    stq_be_p(tcp + 20, id);
+    return f;
+}
+
+static void chan_queue(Chan *c, const uint8_t *frame)
+{
+    g_byte_array_append(c->buf, frame, ldl_be_p(frame) + 4);
+}
+
+static void chan_open(Chan *c, const char *path)
+{
+    c->fd = unix_connect(path, &error_abort);
+    qemu_set_nonblock(c->fd);
+    c->buf = g_byte_array_new();
+    c->off = 0;
+}
+
+static void chan_flush(Chan *c)
+{
+    ssize_t ret;
+
+    while (c->off < c->buf->len) {
+        ret = write(c->fd, c->buf->data + c->off, c->buf->len - c->off);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            perror("write");
+            exit(1);
+        }
+        c->off += ret;
+    }
+    if (c->off == c->buf->len) {
+        g_byte_array_set_size(c->buf, 0);
+        c->off = 0;
+    }
+}
+
+static void flush_sec_batch(void)
+{
+    int64_t now = g_get_monotonic_time();
+    size_t i;
+
+    for (i = 0; i < sec_batch_n; i++) {
+        if (i + 1 < sec_batch_n && g_random_int_range(0, 100) < reorder_rate) {
+            uint8_t *tmp = sec_batch[i];
+
+            sec_batch[i] = sec_batch[i + 1];
+            sec_batch[i + 1] = tmp;
+            i++;
+        }
+    }
+    for (i = 0; i < sec_batch_n; i++) {
+        uint64_t id = ldq_be_p(sec_batch[i] + 4 + FRAME_HDR_LEN);
+
+        /* Release latency counts from the moment both copies are out */
+        sent_us[id % window] = now;
+        chan_queue(&sec, sec_batch[i]);
+        g_free(sec_batch[i]);
+    }
+    sec_batch_n = 0;
+}
+
+/* Queue one packet pair on the primary and the secondary */
+static void send_pair(void)
+{
+    uint8_t *p, *s;
+    uint32_t conn;
+
+    if (g_random_int_range(0, 100) < mismatch_rate) {
+        /*
+         * Without COLO nothing ever releases a miscompared packet, and it
+         * blocks its connection; so use a fresh connection each time.
+         */
+        conn = n_conns + mismatch_conns++;
+        p = build_frame(conn, 1, UINT64_MAX);
+        s = build_frame(conn, 1, UINT64_MAX);
+        s[4 + FRAME_HDR_LEN + payload_size - 1] ^= 1;
+        chan_queue(&pri, p);
+        chan_queue(&sec, s);
+        g_free(p);
+        g_free(s);
+        n_mismatched++;
+        return;
+    }
+
+    conn = next_id % n_conns;
+    p = build_frame(conn, conn_seq[conn], next_id);
+    s = g_memdup(p, 4 + FRAME_HDR_LEN + payload_size);
+    conn_seq[conn] += payload_size;
+    next_id++;
+
+    chan_queue(&pri, p);
+    g_free(p);
+    sec_batch[sec_batch_n++] = s;
+    in_flight++;
+    n_sent++;
+}
+
+static void read_out(bool record)
+{
+    uint8_t tmp[65536];
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(out.fd, tmp, sizeof(tmp));
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "outdev closed\n");
+            exit(1);
+        }
+        g_byte_array_append(out.buf, tmp, ret);
+    }
+
+    while (out.buf->len - out.off >= 4) {
+        uint32_t len = ldl_be_p(out.buf->data + out.off);
+        uint64_t id;
+
+        if (out.buf->len - out.off < 4 + len) {
+            break;
+        }
+        id = ldq_be_p(out.buf->data + out.off + 4 + FRAME_HDR_LEN);
+        out.off += 4 + len;
+        if (id == UINT64_MAX) {
+            continue;
+        }
+        if (record) {
+            uint32_t us = g_get_monotonic_time() - sent_us[id % window];
+
+            g_array_append_val(latencies, us);
+        }
+        in_flight--;
+        n_released++;
+    }
+    if (out.off == out.buf->len) {
+        g_byte_array_set_size(out.buf, 0);
+        out.off = 0;
+    }
+}
+
+/*
+ * Keep @window pairs in flight until @deadline (in microseconds, 0 to
+ * only send @count pairs), then wait for them to drain.  Returns false
+ * if colo-compare stops releasing packets.
+ */
+static bool run(int64_t deadline, uint64_t count, bool record)
+{
+    uint64_t stop = n_sent + count;
+
+    for (;;) {
+        struct pollfd pfd[3];
+        bool sending = deadline ? g_get_monotonic_time() < deadline
+                                : n_sent < stop;
+        int ret;
+
+        while (sending && in_flight < window && sec_batch_n < batch) {
+            send_pair();
+            sending = deadline ? sending : n_sent < stop;
+        }
+        if (sec_batch_n &&
+            (sec_batch_n == batch || !sending || in_flight == window)) {
+            flush_sec_batch();
+        }
+        if (!sending && !in_flight && !pri.buf->len && !sec.buf->len) {
+            return true;
+        }
+
+        chan_flush(&pri);
+        chan_flush(&sec);
+        pfd[0] = (struct pollfd) { pri.fd, pri.buf->len ? POLLOUT : 0 };
+        pfd[1] = (struct pollfd) { sec.fd, sec.buf->len ? POLLOUT : 0 };
+        pfd[2] = (struct pollfd) { out.fd, POLLIN };
+        ret = poll(pfd, ARRAY_SIZE(pfd), STALL_TIMEOUT_MS);
+        if (ret < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (ret == 0) {
+            return false;
+        }
+        if (pfd[2].revents) {
+            read_out(record);
+        }
+    }
+}
+
+static long rss_kb(pid_t pid)
+{
+    char *path = g_strdup_printf("/proc/%d/statm", pid);
+    long size = 0, resident = 0;
+    FILE *f = fopen(path, "r");
+
+    g_free(path);
+    if (!f) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * (getpagesize() / 1024);
+}
+
+static uint64_t qom_get_uint(const char *prop)
+{
+    QDict *rsp;
+    uint64_t val;
+
+    rsp = qmp("{ 'execute': 'qom-get', 'arguments': {"
+              " 'path': '/objects/cmp0', 'property': %s } }", prop);
+    val = qdict_get_int(rsp, "return");
+    QDECREF(rsp);
+    return val;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" duration:          %u s\n", duration);
+    printf(" connections:       %u\n", n_conns);
+    printf(" window:            %u\n", window);
+    printf(" batch:             %u\n", batch);
+    printf(" payload size:      %u bytes\n", payload_size);
+    printf(" reorder rate:      %u %%\n", reorder_rate);
+    printf(" mismatch rate:     %u %%\n", mismatch_rate);
+    printf(" workers:           %u\n", n_workers);
+    printf(" tcp_stream:        %s\n", tcp_stream ? "on" : "off");
+}
+
+static void pr_stats(double secs, long mem_kb, bool drained)
+{
+    uint32_t *lat = (uint32_t *)latencies->data;
+    size_t n = latencies->len;
+
+    qsort(lat, n, sizeof(*lat), cmp_uint32);
+    printf("Results:\n");
+    printf(" packets released:  %" PRIu64 "\n", n_released);
+    printf(" throughput:        %.2f Kpkt/s\n", n_released / secs / 1e3);
+    if (n) {
+        printf(" latency p50:       %u us\n", lat[n / 2]);
+        printf(" latency p99:       %u us\n", lat[n * 99 / 100]);
+        printf(" latency max:       %u us\n", lat[n - 1]);
+    }
+    printf(" memory/connection: %.2f KiB\n", (double)mem_kb / n_conns);
+    printf(" miscompared sent:  %" PRIu64 "\n", n_mismatched);
+    printf(" colo-compare:      matched %" PRIu64 ", miscompared %" PRIu64
+           ", dropped %" PRIu64 "\n", qom_get_uint("stats_matched"),
+           qom_get_uint("stats_miscompared"), qom_get_uint("stats_dropped"));
+    if (!drained) {
+        printf(" stalled with %u packets in flight\n", in_flight);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char pri_path[] = "colo-compare-bench-pri.XXXXXX";
+    char sec_path[] = "colo-compare-bench-sec.XXXXXX";
+    char out_path[] = "colo-compare-bench-out.XXXXXX";
+    char *cmdline;
+    long rss_before, rss_after;
+    int64_t start, end;
+    bool drained;
+    int fd;
+
+    parse_args(argc, argv);
+    pr_params();
+
+    fd = mkstemp(pri_path);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+    fd = mkstemp(sec_path);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+    fd = mkstemp(out_path);
+    g_assert_cmpint(fd, !=, -1);
+    close(fd);
+
+    cmdline = g_strdup_printf("-chardev socket,id=pri0,path=%s,server,nowait "
+                              "-chardev socket,id=sec0,path=%s,server,nowait "
+                              "-chardev socket,id=out0,path=%s,server,nowait "
+                              "-object colo-compare,id=cmp0,primary_in=pri0,"
+                              "secondary_in=sec0,outdev=out0,workers=%u,"
+                              "tcp_stream=%s",
+                              pri_path, sec_path, out_path, n_workers,
+                              tcp_stream ? "on" : "off");
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    chan_open(&pri, pri_path);
+    chan_open(&sec, sec_path);
+    chan_open(&out, out_path);
+    /* Make sure the chardevs have seen the connections */
+    qmp_discard_response("{ 'execute': 'query-status' }");
+
+    conn_seq = g_new0(uint32_t, n_conns);
+    sent_us = g_new0(int64_t, window);
+    sec_batch = g_new0(uint8_t *, batch);
+    latencies = g_array_new(false, false, sizeof(uint32_t));
+
+    /* Warm up: one packet on each connection sets up its tracking state */
+    rss_before = rss_kb(qtest_pid(global_qtest));
+    if (!run(0, n_conns, false)) {
+        fprintf(stderr, "colo-compare released nothing during warm-up\n");
+        exit(1);
+    }
+    rss_after = rss_kb(qtest_pid(global_qtest));
+    n_released = 0;
+
+    start = g_get_monotonic_time();
+    drained = run(start + duration * G_USEC_PER_SEC, 0, true);
+    end = g_get_monotonic_time();
+
+    pr_stats((end - start) / (double)G_USEC_PER_SEC,
+             rss_after - rss_before, drained);
+
+    close(pri.fd);
+    close(sec.fd);
+    close(out.fd);
+    qtest_end();
+    unlink(pri_path);
+    unlink(sec_path);
+    unlink(out_path);
+    return 0;
+}
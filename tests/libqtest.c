@@ -212,6 +212,11 @@ QTestState *qtest_init(const char *extra_args)
     return s;
 }
 
+pid_t qtest_pid(QTestState *s)
+{
+    return s->qemu_pid;
+}
+
 void qtest_quit(QTestState *s)
 {
     qtest_instances = g_list_remove(qtest_instances, s);
@@ -39,6 +39,14 @@ QTestState *qtest_init(const char *extra_args);
  */
 void qtest_quit(QTestState *s);
 
+/**
+ * qtest_pid:
+ * @s: #QTestState instance to operate on.
+ *
+ * Returns: the process id of the QEMU process associated to @s.
+ */
+pid_t qtest_pid(QTestState *s);
+
 /**
  * qtest_qmp_discard_response:
  * @s: #QTestState instance to operate on.
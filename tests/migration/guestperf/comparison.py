@@ -121,4 +121,19 @@ COMPARISONS = [
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of the guest dirtying rate and
+    # pattern on convergence
+    Comparison("dirty-rate", scenarios = [
+        Scenario("dirty-rate-100mbs", dirty_rate=100),
+        Scenario("dirty-rate-300mbs", dirty_rate=300),
+        Scenario("dirty-rate-1000mbs", dirty_rate=1000),
+        Scenario("dirty-rate-100mbs-random",
+                 dirty_rate=100, dirty_pattern="random"),
+        Scenario("dirty-rate-300mbs-random",
+                 dirty_rate=300, dirty_pattern="random"),
+        Scenario("dirty-rate-1000mbs-random",
+                 dirty_rate=1000, dirty_pattern="random"),
+    ]),
 ]
@@ -94,7 +94,8 @@ class Engine(object):
                 info["ram"].get("normal-bytes", 0),
                 info["ram"].get("dirty-pages-rate", 0),
                 info["ram"].get("mbps", 0),
-                info["ram"].get("dirty-sync-count", 0)
+                info["ram"].get("dirty-sync-count", 0),
+                info["ram"].get("dirty-sync-time", 0)
             ),
             time.time(),
             info.get("total-time", 0),
@@ -227,12 +228,14 @@ class Engine(object):
                 return [progress_history, src_qemu_time, src_vcpu_time]
 
             if self._verbose and (loop % 20) == 0:
-                print "Iter %d: remain %5dMB of %5dMB (total %5dMB @ %5dMb/sec)" % (
+                print ("Iter %d: remain %5dMB of %5dMB "
+                       "(total %5dMB @ %5dMb/sec, sync %5dms)") % (
                     progress._ram._iterations,
                     progress._ram._remaining_bytes / (1024 * 1024),
                     progress._ram._total_bytes / (1024 * 1024),
                     progress._ram._transferred_bytes / (1024 * 1024),
                     progress._ram._transfer_rate_mbs,
+                    progress._ram._dirty_sync_time_us / 1000,
                 )
 
             if progress._ram._iterations > scenario._max_iters:
@@ -263,7 +266,7 @@ class Engine(object):
                 resp = src.command("stop")
                 paused = True
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -279,6 +282,8 @@ class Engine(object):
             args.append("quiet")
 
         args.append("ramsize=%s" % hardware._mem)
+        args.append("dirtyrate=%d" % scenario._dirty_rate)
+        args.append("dirtypattern=%s" % scenario._dirty_pattern)
 
         cmdline = " ".join(args)
         if tunnelled:
@@ -309,14 +314,14 @@ class Engine(object):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
 
-    def _get_dst_args(self, hardware, uri):
+    def _get_dst_args(self, hardware, scenario, uri):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
         return argv + ["-incoming", uri]
 
     @staticmethod
@@ -385,14 +390,14 @@ class Engine(object):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = qemu.QEMUMachine(self._binary,
-                               args=self._get_src_args(hardware),
+                               args=self._get_src_args(hardware, scenario),
                                wrapper=self._get_src_wrapper(hardware),
                                name="qemu-src-%d" % os.getpid(),
                                monitor_address=srcmonaddr,
                                debug=self._debug)
 
         dst = qemu.QEMUMachine(self._binary,
-                               args=self._get_dst_args(hardware, uri),
+                               args=self._get_dst_args(hardware, scenario, uri),
                                wrapper=self._get_dst_wrapper(hardware),
                                name="qemu-dst-%d" % os.getpid(),
                                monitor_address=dstmonaddr,
@@ -29,7 +29,8 @@ class Scenario(object):
                  post_copy=False, post_copy_iters=5,
                  auto_converge=False, auto_converge_step=10,
                  compression_mt=False, compression_mt_threads=1,
-                 compression_xbzrle=False, compression_xbzrle_cache=10):
+                 compression_xbzrle=False, compression_xbzrle_cache=10,
+                 dirty_rate=0, dirty_pattern="sequential"):
 
         self._name = name
 
@@ -56,6 +57,10 @@ class Scenario(object):
         self._compression_xbzrle = compression_xbzrle
         self._compression_xbzrle_cache = compression_xbzrle_cache # percentage of guest RAM
 
+        # Guest workload
+        self._dirty_rate = dirty_rate # MiB per second per vCPU, 0 for unlimited
+        self._dirty_pattern = dirty_pattern # 'sequential' or 'random'
+
     def serialize(self):
         return {
             "name": self._name,
@@ -73,6 +78,8 @@ class Scenario(object):
             "compression_mt_threads": self._compression_mt_threads,
             "compression_xbzrle": self._compression_xbzrle,
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
+            "dirty_rate": self._dirty_rate,
+            "dirty_pattern": self._dirty_pattern,
         }
 
     @classmethod
@@ -92,4 +99,6 @@ class Scenario(object):
             data["compression_mt"],
             data["compression_mt_threads"],
             data["compression_xbzrle"],
-            data["compression_xbzrle_cache"])
+            data["compression_xbzrle_cache"],
+            data.get("dirty_rate", 0),
+            data.get("dirty_pattern", "sequential"))
@@ -121,6 +121,10 @@ class Shell(BaseShell):
         parser.add_argument("--compression-xbzrle", dest="compression_xbzrle", default=False, action="store_true")
         parser.add_argument("--compression-xbzrle-cache", dest="compression_xbzrle_cache", default=10, type=int)
 
+        parser.add_argument("--dirty-rate", dest="dirty_rate", default=0, type=int)
+        parser.add_argument("--dirty-pattern", dest="dirty_pattern", default="sequential",
+                            choices=["sequential", "random"])
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -141,7 +145,10 @@ class Shell(BaseShell):
                         compression_mt_threads=args.compression_mt_threads,
 
                         compression_xbzrle=args.compression_xbzrle,
-                        compression_xbzrle_cache=args.compression_xbzrle_cache)
+                        compression_xbzrle_cache=args.compression_xbzrle_cache,
+
+                        dirty_rate=args.dirty_rate,
+                        dirty_pattern=args.dirty_pattern)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
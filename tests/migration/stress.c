@@ -37,6 +37,11 @@ const char *argv0;
 
 #define PAGE_SIZE 4096
 
+/* Per-thread dirtying rate limit in MB/s, 0 for none */
+static unsigned long long dirtyrateMB;
+/* Dirty pages in random order rather than sequentially */
+static int dirtyrandom;
+
 static int gettid(void)
 {
     return syscall(SYS_gettid);
@@ -175,16 +180,27 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
+static void dirtypage(char *ramptr, const char *data)
+{
+    size_t k;
+
+    for (k = 0; k < PAGE_SIZE; k += sizeof(long long)) {
+        *(unsigned long long *)(ramptr + k) ^=
+            *(const unsigned long long *)(data + k);
+    }
+}
+
 static int stressone(unsigned long long ramsizeMB)
 {
     size_t pagesPerMB = 1024 * 1024 / PAGE_SIZE;
+    size_t npages = ramsizeMB * pagesPerMB;
     char *ram = malloc(ramsizeMB * 1024 * 1024);
-    char *ramptr;
-    size_t i, j, k;
+    size_t i, j, page;
     char *data = malloc(PAGE_SIZE);
-    char *dataptr;
     size_t nMB = 0;
-    unsigned long long before, after;
+    unsigned long long totalMB = 0;
+    unsigned long long seed = gettid();
+    unsigned long long start, before, after;
 
     if (!ram) {
         fprintf(stderr, "%s (%05d): ERROR: cannot allocate %llu MB of RAM: %s\n",
@@ -211,18 +227,29 @@ static int stressone(unsigned long long ramsizeMB)
         return -1;
     }
 
-    before = now();
+    start = before = now();
 
     while (1) {
 
-        ramptr = ram;
-        for (i = 0; i < ramsizeMB; i++, nMB++) {
+        for (i = 0; i < ramsizeMB; i++, nMB++, totalMB++) {
             for (j = 0; j < pagesPerMB; j++) {
-                dataptr = data;
-                for (k = 0; k < PAGE_SIZE; k += sizeof(long long)) {
-                    ramptr += sizeof(long long);
-                    dataptr += sizeof(long long);
-                    *(unsigned long long *)ramptr ^= *(unsigned long long *)dataptr;
+                if (dirtyrandom) {
+                    seed = seed * 6364136223846793005ull +
+                        1442695040888963407ull;
+                    page = (seed >> 33) % npages;
+                } else {
+                    page = i * pagesPerMB + j;
+                }
+                dirtypage(ram + page * PAGE_SIZE, data);
+            }
+
+            if (dirtyrateMB) {
+                unsigned long long due = start + (totalMB + 1) * 1000 /
+                    dirtyrateMB;
+                unsigned long long cur = now();
+
+                if (due > cur) {
+                    usleep((due - cur) * 1000);
                 }
             }
 
@@ -301,14 +328,17 @@ static int mount_all(void)
 int main(int argc, char **argv)
 {
     unsigned long long ramsizeGB = 1;
+    char *pattern = NULL;
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:d:p:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "dirty-rate", required_argument, NULL, 'd' },
+        { "dirty-pattern", required_argument, NULL, 'p' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
@@ -338,9 +368,26 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'd':
+            errno = 0;
+            dirtyrateMB = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr,
+                        "%s (%05d): ERROR: Cannot parse dirty rate %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
+        case 'p':
+            pattern = optarg;
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--dirty-rate MB/s][--dirty-pattern sequential|random]\n",
+                    argv0);
             exit_failure();
         }
     }
@@ -352,13 +399,33 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+        ret = get_command_arg_ull("dirtyrate", &dirtyrateMB);
+        if (ret < 0) {
+            exit_failure();
+        }
+        ret = get_command_arg_str("dirtypattern", &pattern);
+        if (ret < 0) {
+            exit_failure();
+        }
+    }
+
+    if (pattern) {
+        if (strcmp(pattern, "random") == 0) {
+            dirtyrandom = 1;
+        } else if (strcmp(pattern, "sequential") != 0) {
+            fprintf(stderr, "%s (%05d): ERROR: Unknown dirty pattern %s\n",
+                    argv0, gettid(), pattern);
+            exit_failure();
+        }
     }
 
     if (ncpus == 0)
         ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
-            argv0, gettid(), ramsizeGB, ncpus);
+    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs, "
+            "dirtying %s at %llu MB/s per CPU (0 = unlimited)\n",
+            argv0, gettid(), ramsizeGB, ncpus,
+            dirtyrandom ? "randomly" : "sequentially", dirtyrateMB);
 
     if (stress(ramsizeGB, ncpus) < 0)
         exit_failure();
@@ -355,6 +355,7 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 static void pr_stats(void)
 {
     struct thread_stats s = {};
+    struct qht_stats hst;
     double tx;
 
     add_stats(&s, rw_info, n_rw_threads);
@@ -383,6 +384,18 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    qht_statistics_init(&ht, &hst);
+    printf(" Lookup retries:    %zu (%.4f%% of reads)\n",
+           hst.lookup_retries,
+           (double)hst.lookup_retries / (s.rd + s.not_rd) * 100);
+    printf(" Lock contentions:  %zu (%.4f%% of updates)\n",
+           hst.lock_contentions,
+           (double)hst.lock_contentions /
+           (s.in + s.not_in + s.rm + s.not_rm) * 100);
+    printf(" Head buckets:      %zu (%zu pending resize)\n",
+           hst.head_buckets, hst.resize_pending);
+    qht_statistics_destroy(&hst);
 }
 
 static void run_test(void)
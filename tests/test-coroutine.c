@@ -176,6 +176,54 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that the coroutine pool grows to the queue depth in use
+ */
+
+#define POOL_TEST_DEPTH 256
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void pool_test_rounds(unsigned int rounds)
+{
+    Coroutine *co[POOL_TEST_DEPTH];
+    unsigned int i, j;
+
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < POOL_TEST_DEPTH; j++) {
+            co[j] = qemu_coroutine_create(yield_once, NULL);
+            qemu_coroutine_enter(co[j]);
+        }
+        for (j = 0; j < POOL_TEST_DEPTH; j++) {
+            qemu_coroutine_enter(co[j]);
+        }
+    }
+}
+
+static void test_pool_adapt(void)
+{
+    CoroutinePoolStats before, after;
+
+    if (!CONFIG_COROUTINE_POOL) {
+        return;
+    }
+
+    /* Let the pool see the peak for a few sizing windows */
+    pool_test_rounds(64);
+    qemu_coroutine_pool_get_stats(&before);
+
+    pool_test_rounds(128);
+    qemu_coroutine_pool_get_stats(&after);
+
+    /* At most a partially published window may still miss the pool */
+    g_assert_cmpuint(after.hits - before.hits, >, 0);
+    g_assert_cmpuint(after.stack_allocs - before.stack_allocs, <=,
+                     POOL_TEST_DEPTH);
+}
+
 
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
@@ -384,6 +432,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+    g_test_add_func("/basic/pool-adapt", test_pool_adapt);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
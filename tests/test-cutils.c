@@ -1429,6 +1429,50 @@ static void test_qemu_strtosz_suffix_unit(void)
     g_assert_cmpint(res, ==, 12345000);
 }
 
+static void test_buffer_is_equal(void)
+{
+    uint8_t a[1000], b[1000];
+    size_t off, len;
+
+    for (off = 0; off < sizeof(a); off++) {
+        a[off] = b[off] = off * 7;
+    }
+
+    /* all lengths and misalignments up to a few vector iterations */
+    for (off = 0; off < 33; off++) {
+        for (len = 0; len < sizeof(a) - off; len += 37) {
+            g_assert(buffer_is_equal(a + off, b + off, len));
+            if (len) {
+                b[off + len - 1] ^= 1;
+                g_assert(!buffer_is_equal(a + off, b + off, len));
+                b[off + len - 1] ^= 1;
+                b[off] ^= 0x80;
+                g_assert(!buffer_is_equal(a + off, b + off, len));
+                b[off] ^= 0x80;
+            }
+        }
+    }
+}
+
+static void test_buffer_copy_if_changed(void)
+{
+    uint8_t a[1000], b[1000];
+    size_t off;
+
+    for (off = 0; off < sizeof(a); off++) {
+        a[off] = b[off] = off * 7;
+    }
+    g_assert(!buffer_copy_if_changed(a, b, sizeof(a)));
+    g_assert(!buffer_copy_if_changed(a, b, 0));
+
+    for (off = 0; off < sizeof(a); off += 97) {
+        b[off] ^= 1;
+        b[sizeof(b) - 1] ^= 1;
+        g_assert(buffer_copy_if_changed(a + off, b + off, sizeof(a) - off));
+        g_assert(memcmp(a, b, sizeof(a)) == 0);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1590,5 +1634,9 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/strtosz/suffix-unit",
                     test_qemu_strtosz_suffix_unit);
 
+    g_test_add_func("/cutils/buffer_is_equal", test_buffer_is_equal);
+    g_test_add_func("/cutils/buffer_copy_if_changed",
+                    test_buffer_copy_if_changed);
+
     return g_test_run();
 }
@@ -442,6 +442,114 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+/* Check hbitmap_next_zero and hbitmap_next_dirty_area against the shadow
+ * bitmap, for a granularity-0 bitmap.
+ */
+static void hbitmap_test_check_areas(TestHBitmapData *data,
+                                     uint64_t start, uint64_t count)
+{
+    uint64_t end = MIN(start + count, data->size);
+    uint64_t i, area_start, area_count;
+    int64_t next_zero = -1, next_set = -1, next_set_end = end;
+    bool found;
+
+    for (i = start; i < end; i++) {
+        bool set = data->bits[i >> LOG_BITS_PER_LONG] &
+                   (1UL << (i & (BITS_PER_LONG - 1)));
+        if (!set && next_zero < 0) {
+            next_zero = i;
+        }
+        if (set && next_set < 0) {
+            next_set = i;
+        }
+        if (!set && next_set >= 0 && next_set_end == end) {
+            next_set_end = i;
+        }
+    }
+
+    g_assert_cmpint(hbitmap_next_zero(data->hb, start, count), ==, next_zero);
+
+    area_start = start;
+    area_count = count;
+    found = hbitmap_next_dirty_area(data->hb, &area_start, &area_count);
+    if (next_set < 0) {
+        g_assert(!found);
+        g_assert_cmpint(area_start, ==, start);
+        g_assert_cmpint(area_count, ==, count);
+    } else {
+        g_assert(found);
+        g_assert_cmpint(area_start, ==, next_set);
+        g_assert_cmpint(area_count, ==, next_set_end - next_set);
+    }
+}
+
+static void test_hbitmap_next_zero_and_area(TestHBitmapData *data,
+                                            const void *unused)
+{
+    static const uint64_t starts[] = { 0, 1, L1 - 1, L1, L1 + 7, L2 - 1, L2,
+                                       L2 + L1 + 3, L3 - 1 };
+    static const uint64_t counts[] = { 1, 2, L1, L1 + 1, L2, L3 };
+    int i, j;
+
+    hbitmap_test_init(data, L3, 0);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        for (j = 0; j < ARRAY_SIZE(counts); j++) {
+            hbitmap_test_check_areas(data, starts[i], counts[j]);
+        }
+    }
+
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2, L1 * 3);
+    hbitmap_test_set(data, L3 - 1, 1);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        for (j = 0; j < ARRAY_SIZE(counts); j++) {
+            hbitmap_test_check_areas(data, starts[i], counts[j]);
+        }
+    }
+
+    hbitmap_test_set(data, 0, L3);
+    for (i = 0; i < ARRAY_SIZE(starts); i++) {
+        for (j = 0; j < ARRAY_SIZE(counts); j++) {
+            hbitmap_test_check_areas(data, starts[i], counts[j]);
+        }
+    }
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, UINT64_MAX), <, 0);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    uint64_t start, count;
+
+    hbitmap_test_init(data, L2 << 4, 4);
+    hbitmap_test_set(data, (L1 << 4) + 3, 1);
+    hbitmap_test_set(data, (L1 + 1) << 4, 5 << 4);
+
+    /* Both ends of a dirty area are rounded to the granularity */
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 << 4), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 << 4, L2 << 4), ==,
+                    (L1 + 6) << 4);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, (L1 << 4) + 5, 4), <, 0);
+
+    start = 0;
+    count = L2 << 4;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, L1 << 4);
+    g_assert_cmpint(count, ==, 6 << 4);
+
+    /* The area found starts at the requested start if that is dirty */
+    start = (L1 << 4) + 9;
+    count = 3;
+    g_assert(hbitmap_next_dirty_area(data->hb, &start, &count));
+    g_assert_cmpint(start, ==, (L1 << 4) + 9);
+    g_assert_cmpint(count, ==, 3);
+
+    start = (L1 + 6) << 4;
+    count = L2 << 4;
+    g_assert(!hbitmap_next_dirty_area(data->hb, &start, &count));
+}
+
 static void hbitmap_test_set_boundary_bits(TestHBitmapData *data, ssize_t diff)
 {
     size_t size = data->size;
@@ -649,6 +757,10 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/iter/empty", test_hbitmap_iter_empty);
     hbitmap_test_add("/hbitmap/iter/partial", test_hbitmap_iter_partial);
     hbitmap_test_add("/hbitmap/iter/granularity", test_hbitmap_iter_granularity);
+    hbitmap_test_add("/hbitmap/next_zero/general",
+                     test_hbitmap_next_zero_and_area);
+    hbitmap_test_add("/hbitmap/next_zero/granularity",
+                     test_hbitmap_next_zero_granularity);
     hbitmap_test_add("/hbitmap/get/all", test_hbitmap_get_all);
     hbitmap_test_add("/hbitmap/get/some", test_hbitmap_get_some);
     hbitmap_test_add("/hbitmap/set/all", test_hbitmap_set_all);
@@ -0,0 +1,128 @@
+/*
+ * Interval tree unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N 512
+
+static IntervalTree tree;
+static int model[N];
+
+static void set(uint64_t start, uint64_t last, int value)
+{
+    uint64_t i;
+
+    interval_tree_set(&tree, start, last, value);
+    for (i = start; i <= last; i++) {
+        model[i] = value;
+    }
+}
+
+/* Check every lookup against the flat model */
+static void check(void)
+{
+    IntervalTreeRange range;
+    int i, j;
+
+    for (i = 0; i < N; i++) {
+        g_assert_cmpint(interval_tree_get(&tree, i), ==, model[i]);
+
+        for (j = i; j < N && !model[j]; j++) {
+            continue;
+        }
+        if (j == N) {
+            g_assert_false(interval_tree_find_next(&tree, i, &range));
+        } else {
+            uint64_t start = j, last = j;
+
+            while (start > 0 && model[start - 1] == model[j]) {
+                start--;
+            }
+            while (last < N - 1 && model[last + 1] == model[j]) {
+                last++;
+            }
+            g_assert_true(interval_tree_find_next(&tree, i, &range));
+            g_assert_cmpuint(range.start, ==, start);
+            g_assert_cmpuint(range.last, ==, last);
+            g_assert_cmpint(range.value, ==, model[j]);
+        }
+
+        for (j = i; j >= 0 && !model[j]; j--) {
+            continue;
+        }
+        if (j < 0) {
+            g_assert_false(interval_tree_find_prev(&tree, i, &range));
+        } else {
+            g_assert_true(interval_tree_find_prev(&tree, i, &range));
+            g_assert_cmpuint(range.start, <=, j);
+            g_assert_cmpuint(range.last, >=, j);
+            g_assert_cmpint(range.value, ==, model[j]);
+        }
+    }
+}
+
+static void test_basic(void)
+{
+    interval_tree_init(&tree);
+    memset(model, 0, sizeof(model));
+
+    set(10, 19, 1);
+    set(20, 29, 1);         /* merges with the previous range */
+    set(40, 49, 2);
+    set(15, 44, 3);         /* splits both */
+    check();
+    set(0, N - 1, 0);
+    check();
+
+    interval_tree_destroy(&tree);
+}
+
+static void test_random(void)
+{
+    int i;
+
+    interval_tree_init(&tree);
+    memset(model, 0, sizeof(model));
+
+    for (i = 0; i < 20000; i++) {
+        uint64_t start = g_test_rand_int_range(0, N);
+        uint64_t last = MIN(N - 1, start + g_test_rand_int_range(0, 64));
+
+        set(start, last, g_test_rand_int_range(0, 4));
+        if (i % 64 == 0) {
+            check();
+        }
+    }
+    check();
+
+    interval_tree_destroy(&tree);
+}
+
+static void test_limits(void)
+{
+    IntervalTreeRange range;
+
+    interval_tree_init(&tree);
+
+    interval_tree_set(&tree, 0, UINT64_MAX, 1);
+    g_assert_cmpint(interval_tree_get(&tree, UINT64_MAX), ==, 1);
+    interval_tree_set(&tree, UINT64_MAX, UINT64_MAX, 0);
+    g_assert_true(interval_tree_find_prev(&tree, UINT64_MAX, &range));
+    g_assert_cmpuint(range.last, ==, UINT64_MAX - 1);
+    g_assert_false(interval_tree_find_next(&tree, UINT64_MAX, &range));
+
+    interval_tree_destroy(&tree);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/basic", test_basic);
+    g_test_add_func("/interval-tree/random", test_random);
+    g_test_add_func("/interval-tree/limits", test_limits);
+    return g_test_run();
+}
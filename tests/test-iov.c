@@ -145,6 +145,65 @@ static void test_to_from_buf(void)
     }
 }
 
+static void test_cursor(void)
+{
+    unsigned niov, niov2;
+    struct iovec *iov, *iov2;
+    IOVCursor cur, cur2;
+    size_t sz, sz2, i, n, step;
+    unsigned char *ibuf, *obuf;
+
+    iov_random(&iov, &niov);
+    iov_random(&iov2, &niov2);
+    sz = iov_size(iov, niov);
+    sz2 = iov_size(iov2, niov2);
+    ibuf = g_malloc(sz);
+    obuf = g_malloc(sz);
+    for (i = 0; i < sz; i++) {
+        ibuf[i] = i & 255;
+    }
+
+    /* sequential chunks of varying size, as a device model would do */
+    iov_cursor_init(&cur, iov, niov);
+    iov_memset(iov, niov, 0, 0xff, -1);
+    for (i = 0; i < sz; i += step) {
+        step = g_test_rand_int_range(1, 8);
+        n = iov_cursor_from_buf(&cur, i, ibuf + i, step);
+        g_assert(n == MIN(step, sz - i));
+    }
+    g_assert(iov_cursor_from_buf(&cur, sz, ibuf, 1) == 0);
+    test_iov_bytes(iov, niov, 0, sz);
+
+    memset(obuf, 0, sz);
+    for (i = 0; i < sz; i += step) {
+        step = g_test_rand_int_range(1, 8);
+        n = iov_cursor_to_buf(&cur, i, obuf + i, step);
+        g_assert(n == MIN(step, sz - i));
+    }
+    g_assert(memcmp(ibuf, obuf, sz) == 0);
+
+    /* going backwards rewinds the cursor */
+    for (i = sz; i-- > 0; ) {
+        g_assert(iov_cursor_to_buf(&cur, i, obuf, 1) == 1);
+        g_assert(obuf[0] == (i & 255));
+    }
+
+    /* iov to iov, the destination filling up first or not */
+    iov_cursor_init(&cur2, iov2, niov2);
+    iov_memset(iov2, niov2, 0, 0xff, -1);
+    for (i = 0; i < MIN(sz, sz2); i += step) {
+        step = g_test_rand_int_range(1, 8);
+        n = iov_cursor_copy(&cur2, i, &cur, i, step);
+        g_assert(n == MIN(step, MIN(sz, sz2) - i));
+    }
+    test_iov_bytes(iov2, niov2, 0, MIN(sz, sz2));
+
+    g_free(ibuf);
+    g_free(obuf);
+    iov_free(iov, niov);
+    iov_free(iov2, niov2);
+}
+
 static void test_io(void)
 {
 #ifndef _WIN32
@@ -403,6 +462,7 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_rand_int();
     g_test_add_func("/basic/iov/from-to-buf", test_to_from_buf);
+    g_test_add_func("/basic/iov/cursor", test_cursor);
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
@@ -0,0 +1,99 @@
+/*
+ * Migration compression codecs unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "migration/compress.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *page)
+{
+    int i;
+
+    /* half repetitive, half pseudo random, like most guest pages */
+    for (i = 0; i < PAGE_SIZE / 2; i++) {
+        page[i] = i % 16;
+    }
+    for (; i < PAGE_SIZE; i++) {
+        page[i] = g_test_rand_int();
+    }
+}
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    MigrationCodec *codec;
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc0(PAGE_SIZE);
+    uint8_t *comp;
+    size_t bound;
+    ssize_t len;
+    int level;
+
+    fill_page(page);
+    for (level = 0; level <= 9; level++) {
+        codec = migration_codec_new(method, level, &error_abort);
+        bound = migration_codec_bound(codec, PAGE_SIZE);
+        g_assert_cmpint(bound, >=, PAGE_SIZE);
+        comp = g_malloc(bound);
+
+        len = migration_codec_compress(codec, comp, bound, page, PAGE_SIZE);
+        g_assert_cmpint(len, >, 0);
+        g_assert_cmpint(len, <=, bound);
+
+        memset(out, 0, PAGE_SIZE);
+        g_assert_cmpint(migration_codec_decompress(codec, out, PAGE_SIZE,
+                                                   comp, len),
+                        ==, PAGE_SIZE);
+        g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+        /* a truncated page must not decompress past the buffer */
+        g_assert_cmpint(migration_codec_decompress(codec, out, PAGE_SIZE / 2,
+                                                   comp, len),
+                        ==, -1);
+
+        g_free(comp);
+        migration_codec_free(codec);
+    }
+
+    g_free(page);
+    g_free(out);
+}
+
+static void test_unsupported(void)
+{
+    MigrationCompressMethod method;
+    Error *err = NULL;
+
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        if (!migration_codec_supported(method)) {
+            g_assert(!migration_codec_new(method, 1, &err));
+            error_free_or_abort(&err);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    MigrationCompressMethod method;
+    char *path;
+
+    g_test_init(&argc, &argv, NULL);
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        if (!migration_codec_supported(method)) {
+            continue;
+        }
+        path = g_strdup_printf("/migration/compress/%s/roundtrip",
+                               MigrationCompressMethod_lookup[method]);
+        g_test_add_data_func(path, GINT_TO_POINTER(method), test_roundtrip);
+        g_free(path);
+    }
+    g_test_add_func("/migration/compress/unsupported", test_unsupported);
+    return g_test_run();
+}
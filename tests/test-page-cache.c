@@ -0,0 +1,149 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define CACHE_PAGES 64
+/* addresses this far apart go to the same set */
+#define SET_STRIDE ((uint64_t)CACHE_PAGES / 8 * PAGE_SIZE)
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+/* unlike cache_is_cached(), get_cached_data() doesn't count as a hit */
+static void check_data(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    g_assert(data);
+    fill_page(page, addr);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+}
+
+static void check_cached(PageCache *cache, uint64_t addr)
+{
+    g_assert(cache_is_cached(cache, addr, 0));
+    check_data(cache, addr);
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr, 0));
+        g_assert(!get_cached_data(cache, addr));
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, 0), ==, 0);
+    }
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        check_cached(cache, addr);
+    }
+
+    /* updating a cached page doesn't evict anything */
+    fill_page(page, 0);
+    g_assert_cmpint(cache_insert(cache, 0, page, 1), ==, 0);
+
+    cache_fini(cache);
+}
+
+static void test_collisions(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    /* a direct mapped cache would only keep the last of these */
+    for (i = 0; i < 8; i++) {
+        fill_page(page, i * SET_STRIDE);
+        g_assert_cmpint(cache_insert(cache, i * SET_STRIDE, page, 0), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        check_cached(cache, i * SET_STRIDE);
+    }
+
+    /* the set is full now */
+    fill_page(page, 8 * SET_STRIDE);
+    g_assert_cmpint(cache_insert(cache, 8 * SET_STRIDE, page, 0), ==, 1);
+    check_cached(cache, 8 * SET_STRIDE);
+
+    cache_fini(cache);
+}
+
+static void test_clock(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        fill_page(page, i * SET_STRIDE);
+        cache_insert(cache, i * SET_STRIDE, page, 0);
+    }
+
+    /* a page that keeps being hit survives a stream of other pages */
+    for (i = 8; i < 100; i++) {
+        g_assert(cache_is_cached(cache, 0, 0));
+        fill_page(page, i * SET_STRIDE);
+        g_assert_cmpint(cache_insert(cache, i * SET_STRIDE, page, 0), ==, 1);
+        check_data(cache, i * SET_STRIDE);
+    }
+    check_cached(cache, 0);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int n = 0;
+
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        fill_page(page, addr);
+        cache_insert(cache, addr, page, addr / PAGE_SIZE);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 2 * CACHE_PAGES), ==,
+                    2 * CACHE_PAGES);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        check_cached(cache, addr);
+    }
+
+    /* shrinking keeps as many pages as fit */
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES / 4), ==,
+                    CACHE_PAGES / 4);
+    for (addr = 0; addr < CACHE_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr, 0)) {
+            check_cached(cache, addr);
+            n++;
+        }
+    }
+    g_assert_cmpint(n, ==, CACHE_PAGES / 4);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert", test_insert);
+    g_test_add_func("/page_cache/collisions", test_collisions);
+    g_test_add_func("/page_cache/clock", test_clock);
+    g_test_add_func("/page_cache/resize", test_resize);
+
+    return g_test_run();
+}
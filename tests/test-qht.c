@@ -107,6 +107,11 @@ static void qht_do_test(unsigned int mode, size_t init_entries)
     check(-N, -1, false);
     iter_check(N);
 
+    qht_resize(&ht, N * 4);
+    check(0, N, true);
+    check_n(N);
+    iter_check(N);
+
     rm(101, 102);
     check_n(N - 1);
     insert(N, N * 2);
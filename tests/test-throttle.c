@@ -639,10 +639,21 @@ static void test_groups(void)
     throttle_group_get_config(blk3, &cfg2);
     g_assert(!memcmp(&cfg1, &cfg2, sizeof(cfg1)));
 
+    /* Weights belong to the members, not to the group */
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==,
+                    THROTTLE_GROUP_DEFAULT_WEIGHT);
+    throttle_group_set_weight(blk1, 500);
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==, 500);
+    g_assert_cmpint(throttle_group_get_weight(blk3), ==,
+                    THROTTLE_GROUP_DEFAULT_WEIGHT);
+
     throttle_group_unregister_blk(blk1);
     throttle_group_unregister_blk(blk2);
     throttle_group_unregister_blk(blk3);
 
+    /* ... and survive leaving it */
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==, 500);
+
     g_assert(blkp1->throttle_state == NULL);
     g_assert(blkp2->throttle_state == NULL);
     g_assert(blkp3->throttle_state == NULL);
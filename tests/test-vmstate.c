@@ -471,6 +471,59 @@ static void test_load_skip(void)
     qemu_fclose(loading);
 }
 
+/* Integer arrays are staged before they get to the file, make sure
+ * they still come out in order, around other fields and across stage
+ * flushes.
+ */
+typedef struct TestArrays {
+    uint16_t w[300];
+    uint8_t tag[4];
+    uint8_t bytes[600];
+    int64_t q[3];
+} TestArrays;
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "test/arrays",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(w, TestArrays, 300),
+        VMSTATE_BUFFER(tag, TestArrays),
+        VMSTATE_UINT8_ARRAY(bytes, TestArrays, 600),
+        VMSTATE_INT64_ARRAY(q, TestArrays, 3),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_save_arrays(void)
+{
+    TestArrays obj;
+    uint8_t expected[600 + 4 + 600 + 24 + 1], *p = expected;
+    int i;
+
+    for (i = 0; i < 300; i++) {
+        obj.w[i] = 0x100 * i + 1;
+        *p++ = obj.w[i] >> 8;
+        *p++ = obj.w[i];
+    }
+    memcpy(obj.tag, "tag!", 4);
+    memcpy(p, "tag!", 4);
+    p += 4;
+    for (i = 0; i < 600; i++) {
+        obj.bytes[i] = i;
+        *p++ = i;
+    }
+    for (i = 0; i < 3; i++) {
+        obj.q[i] = -i;
+        stq_be_p(p, -i);
+        p += 8;
+    }
+    *p = QEMU_VM_EOF;
+
+    save_vmstate(&vmstate_arrays, &obj);
+    compare_vmstate(expected, sizeof(expected));
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -485,6 +538,7 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/simple/arrays", test_save_arrays);
     g_test_run();
 
     close(temp_fd);
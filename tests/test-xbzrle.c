@@ -174,6 +174,66 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Build a page out of runs of random length straddling any vector size,
+ * the encoding is then fully determined by the list of runs.
+ */
+static void encode_runs(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *expected = g_malloc(2 * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(2 * PAGE_SIZE);
+    int i = 0, len, elen = 0, dlen, zrun, end = 0;
+    bool changed = false;
+
+    while (i < PAGE_SIZE) {
+        len = g_test_rand_int_range(1, 80);
+        len = MIN(len, PAGE_SIZE - i);
+        if (changed) {
+            elen += uleb128_encode_small(expected + elen, len);
+            for (; len; len--, i++) {
+                old_buf[i] = g_test_rand_int();
+                new_buf[i] = old_buf[i] ^ g_test_rand_int_range(1, 256);
+                expected[elen++] = new_buf[i];
+            }
+            end = i;
+        } else {
+            zrun = len;
+            for (; len; len--, i++) {
+                old_buf[i] = new_buf[i] = g_test_rand_int();
+            }
+            if (i < PAGE_SIZE) {
+                elen += uleb128_encode_small(expected + elen, zrun);
+            }
+        }
+        changed = !changed;
+    }
+
+    dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                2 * PAGE_SIZE);
+    g_assert_cmpint(dlen, ==, elen);
+    g_assert(memcmp(compressed, expected, elen) == 0);
+
+    g_assert_cmpint(xbzrle_decode_buffer(compressed, dlen, old_buf,
+                                         PAGE_SIZE), ==, end);
+    g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void test_encode_runs(void)
+{
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        encode_runs();
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +246,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_runs", test_encode_runs);
 
     return g_test_run();
 }
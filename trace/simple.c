@@ -13,6 +13,8 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -29,12 +31,19 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Each thread that emits trace events gets its own ring buffer, so that
+ * tracing does not make the threads contend with each other.  A ring has a
+ * single producer, its thread, and a single consumer, the writeout thread,
+ * which merges all of the rings into the trace file in timestamp order.
+ * When a ring is full its events are dropped and counted.
+ *
+ * Rings are never freed: when a thread exits, its ring is left to be
+ * drained by the writeout thread and is handed to the next thread that
+ * needs one.
+ *
+ * The writeout thread waits for records to become available, writes them
+ * out, and then waits again.
  */
 static CompatGMutex trace_lock;
 static CompatGCond trace_available_cond;
@@ -44,14 +53,24 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 64, /* per thread, must be a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+struct TraceThreadBuf {
+    uint8_t buf[TRACE_BUF_LEN];
+    unsigned int head;      /* written by the owner thread only */
+    unsigned int tail;      /* written by the writeout thread only */
+    unsigned int limit;     /* head as last seen by the writeout thread */
+    int dropped;
+    int in_use;
+    TraceThreadBuf *next;
+};
+
+static TraceThreadBuf *trace_thread_bufs;
+static __thread TraceThreadBuf *trace_thread_buf;
+static __thread Notifier trace_thread_exit_notifier;
+static uint64_t trace_dropped_total;
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -72,53 +91,55 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size);
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    const void *dataptr, size_t size);
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void trace_thread_buf_release(Notifier *n, void *unused)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    atomic_mb_set(&trace_thread_buf->in_use, 0);
+    trace_thread_buf = NULL;
 }
+
 /**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * Get the calling thread's trace buffer
  *
- * Returns false if the record is not valid.
+ * Reuses the buffer of a thread that has exited if there is one.  Returns
+ * NULL if no memory is available.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceThreadBuf *get_trace_thread_buf(void)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    TraceThreadBuf *tb = trace_thread_buf;
+    TraceThreadBuf *head;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    if (likely(tb)) {
+        return tb;
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+        if (!atomic_read(&tb->in_use) &&
+            !atomic_cmpxchg(&tb->in_use, 0, 1)) {
+            break;
+        }
+    }
+    if (!tb) {
+        /* don't use g_malloc, can deadlock when traced */
+        tb = calloc(1, sizeof(*tb));
+        if (!tb) {
+            return NULL;
+        }
+        tb->in_use = 1;
+        do {
+            head = atomic_read(&trace_thread_bufs);
+            tb->next = head;
+        } while (atomic_cmpxchg(&trace_thread_bufs, head, tb) != head);
+    }
+
+    trace_thread_buf = tb;
+    trace_thread_exit_notifier.notify = trace_thread_buf_release;
+    qemu_thread_atexit_add(&trace_thread_exit_notifier);
+    return tb;
 }
 
 /**
@@ -150,40 +171,90 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static void write_dropped_record(void)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
+    TraceThreadBuf *tb;
+    uint64_t dropped_count = 0;
     size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+        if (atomic_read(&tb->dropped)) {
+            dropped_count += atomic_xchg(&tb->dropped, 0);
+        }
+    }
+    if (!dropped_count) {
+        return;
+    }
+
+    trace_dropped_total += dropped_count;
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.pid = trace_pid;
+    dropped.rec.arguments[0] = dropped_count;
+    unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+}
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+/**
+ * Write out the records that are complete in all the ring buffers
+ *
+ * The records of each ring are in timestamp order already; pick the oldest
+ * head among the rings until they are all empty.  Records completed while
+ * this runs are left for the next round.
+ */
+static void write_records(void)
+{
+    TraceThreadBuf *tb, *oldest;
+    TraceRecord record, oldest_record;
+    unsigned int idx, len;
+    size_t unused __attribute__ ((unused));
+
+    for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+        tb->limit = atomic_read(&tb->head);
+    }
+    smp_rmb(); /* read the heads before the records they cover */
+
+    for (;;) {
+        oldest = NULL;
+        for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+            if (tb->tail == tb->limit) {
+                continue;
+            }
+            read_from_buffer(tb, tb->tail, &record, sizeof(record));
+            if (!oldest || record.timestamp_ns < oldest_record.timestamp_ns) {
+                oldest = tb;
+                oldest_record = record;
+            }
+        }
+        if (!oldest) {
+            return;
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        /* Write the record straight from the ring, in two pieces if it
+         * wraps around */
+        idx = oldest->tail & (TRACE_BUF_LEN - 1);
+        len = MIN(oldest_record.length, TRACE_BUF_LEN - idx);
+        unused = fwrite(&oldest->buf[idx], len, 1, trace_fp);
+        if (len < oldest_record.length) {
+            unused = fwrite(oldest->buf, oldest_record.length - len, 1,
+                            trace_fp);
         }
 
+        smp_mb(); /* finish reading the record before releasing its space */
+        atomic_set(&oldest->tail, oldest->tail + oldest_record.length);
+    }
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        write_dropped_record();
+        write_records();
         fflush(trace_fp);
     }
     return NULL;
@@ -191,84 +262,74 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &val,
+                                   sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, &slen,
+                                   sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    TraceThreadBuf *tb = get_trace_thread_buf();
+    TraceRecord record = {
+        .event = event,
+        .timestamp_ns = get_clock(),
+        .length = sizeof(TraceRecord) + datasize,
+        .pid = trace_pid,
+    };
+
+    if (!tb) {
+        return -ENOMEM;
+    }
+    if (tb->head - atomic_read(&tb->tail) + record.length > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        atomic_inc(&tb->dropped);
+        return -ENOSPC;
+    }
+    smp_mb(); /* read tail before overwriting the space it released */
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->tbuf_idx = tb->head;
+    rec->rec_off = write_to_buffer(tb, tb->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size)
 {
     uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+        data_ptr[x++] = tb->buf[idx++ & (TRACE_BUF_LEN - 1)];
     }
 }
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint8_t *data_ptr = dataptr;
+    const uint8_t *data_ptr = dataptr;
     uint32_t x = 0;
     while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
+        tb->buf[idx++ & (TRACE_BUF_LEN - 1)] = data_ptr[x++];
     }
     return idx; /* most callers wants to know where to write next */
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    TraceThreadBuf *tb = rec->tbuf;
+
+    smp_wmb(); /* write the record before publishing it */
+    atomic_set(&tb->head, rec->rec_off);
+
+    if (rec->rec_off - atomic_read(&tb->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -338,6 +399,10 @@ void st_print_trace_file_status(FILE *stream, int (*stream_printf)(FILE *stream,
 {
     stream_printf(stream, "Trace file \"%s\" %s.\n",
                   trace_file_name, trace_fp ? "on" : "off");
+    if (trace_dropped_total) {
+        stream_printf(stream, "%" PRIu64 " events dropped.\n",
+                      trace_dropped_total);
+    }
 }
 
 void st_flush_trace_buffer(void)
@@ -21,7 +21,10 @@ void st_set_trace_file(const char *file);
 bool st_init(void);
 void st_flush_trace_buffer(void);
 
+typedef struct TraceThreadBuf TraceThreadBuf;
+
 typedef struct {
+    TraceThreadBuf *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
@@ -29,7 +32,8 @@ typedef struct {
 /* Note for hackers: Make sure MAX_TRACE_LEN < sizeof(uint32_t) */
 #define MAX_TRACE_STRLEN 512
 /**
- * Initialize a trace record and claim space for it in the buffer
+ * Initialize a trace record and claim space for it in the calling thread's
+ * buffer
  *
  * @arglen  number of bytes required for arguments
  */
@@ -47,6 +47,7 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -54,6 +55,7 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/interval-tree.h"
 #include "exec/log.h"
 
 //#define DEBUG_TB_INVALIDATE
@@ -114,43 +116,52 @@ typedef struct PageDesc {
 uintptr_t qemu_host_page_size;
 intptr_t qemu_host_page_mask;
 
+#ifndef CONFIG_SOFTMMU
 /* The bottom level has pointers to PageDesc */
 static void *l1_map[V_L1_SIZE];
+#endif
 
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* translate with CF_EXEC_COUNT and record per-TB costs for "info tbs" */
+bool tb_profile_enabled;
+
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
-__thread int have_tb_lock;
-#endif
+static __thread int have_tb_lock;
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
+}
+
+/* Take tb_lock unless this thread already holds it; returns true if the
+ * lock was taken and must be released with tb_unlock().
+ */
+static bool tb_lock_maybe(void)
+{
+    if (have_tb_lock) {
+        return false;
+    }
+    tb_lock();
+    return true;
 }
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -298,6 +309,8 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool locked = tb_lock_maybe();
+    bool r = false;
 
     tb = tb_find_pc(retaddr);
     if (tb) {
@@ -307,9 +320,12 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        r = true;
     }
-    return false;
+    if (locked) {
+        tb_unlock();
+    }
+    return r;
 }
 
 void page_size_init(void)
@@ -396,6 +412,36 @@ static void page_init(void)
 #endif
 }
 
+#ifdef CONFIG_SOFTMMU
+/* Code pages are RAM offsets, so each RAMBlock carries a flat array of
+ * descriptors for its pages instead of walking a radix tree sized for
+ * the whole physical address space.  The array lives as long as the
+ * block, so this must be called from an RCU critical section; if
+ * alloc=1, with tb_lock held.
+ */
+static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
+{
+    ram_addr_t addr = (ram_addr_t)index << TARGET_PAGE_BITS;
+    RAMBlock *block;
+    PageDesc *pd;
+
+    block = qemu_ram_block_lookup(addr);
+    if (block == NULL) {
+        return NULL;
+    }
+    pd = atomic_rcu_read(&block->page_desc);
+    if (pd == NULL) {
+        if (!alloc) {
+            return NULL;
+        }
+        pd = g_new0(PageDesc, DIV_ROUND_UP(block->max_length,
+                                           TARGET_PAGE_SIZE));
+        atomic_rcu_set(&block->page_desc, pd);
+    }
+
+    return pd + ((addr - block->offset) >> TARGET_PAGE_BITS);
+}
+#else
 /* If alloc=1:
  * Called with mmap_lock held for user-mode emulation.
  */
@@ -434,6 +480,7 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 
     return pd + (index & (V_L2_SIZE - 1));
 }
+#endif
 
 static inline PageDesc *page_find(tb_page_addr_t index)
 {
@@ -761,30 +808,87 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+static void tb_region_set_current(int i)
+{
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[i];
+
+    tcg_ctx.tb_ctx.cur_region = i;
+    tcg_ctx.code_gen_ptr = r->start;
+    tcg_ctx.code_gen_highwater = r->end - TCG_HIGHWATER;
+}
+
+/* Split the code buffer left by tcg_prologue_init() into regions, each
+   with an equal share of the TBs, and start over from the first one.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size / TB_REGION_COUNT;
+    int i;
+
+    size &= ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->max_region_tbs = tcg_ctx.code_gen_max_blocks / TB_REGION_COUNT;
+    for (i = 0; i < TB_REGION_COUNT; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * size;
+        r->end = r->start + size;
+        r->ptr = r->start;
+        r->tbs = ctx->tbs + i * ctx->max_region_tbs;
+        r->nb_tbs = 0;
+    }
+    /* The last region takes whatever the rounding left over */
+    ctx->regions[TB_REGION_COUNT - 1].end =
+        tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size;
+    ctx->nb_tbs = 0;
+    tb_region_set_current(0);
+}
+
+static inline void *tb_region_ptr(TBRegion *r)
+{
+    if (r == &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region]) {
+        return tcg_ctx.code_gen_ptr;
+    }
+    return r->ptr;
+}
+
+/* Allocate a new translation block in the current region.  Returns NULL
+   if the region has no TBs left; running out of code space is reported
+   by tcg_gen_code() instead.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(ctx->regions[0].end == NULL)) {
+        tb_regions_init();
+    }
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs >= ctx->max_region_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    /* until tb_link_page(), so that evicting the region skips it if the
+       translation is abandoned */
+    tb->invalid = true;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -798,6 +902,28 @@ static inline void invalidate_page_bitmap(PageDesc *p)
 }
 
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
+#ifdef CONFIG_SOFTMMU
+static void page_flush_tb(void)
+{
+    RAMBlock *block;
+    PageDesc *pd;
+    ram_addr_t i, n;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        pd = atomic_rcu_read(&block->page_desc);
+        if (pd == NULL) {
+            continue;
+        }
+        n = DIV_ROUND_UP(block->max_length, TARGET_PAGE_SIZE);
+        for (i = 0; i < n; i++) {
+            pd[i].first_tb = NULL;
+            invalidate_page_bitmap(pd + i);
+        }
+    }
+    rcu_read_unlock();
+}
+#else
 static void page_flush_tb_1(int level, void **lp)
 {
     int i;
@@ -829,12 +955,19 @@ static void page_flush_tb(void)
         page_flush_tb_1(V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
     }
 }
+#endif
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+/* flush all the translation blocks; called with tb_lock held and, with
+ * MTTCG, while no vCPU is executing.  @data is the flush count the flush
+ * was requested at, so that requests racing with each other only flush
+ * once.
+ */
+static void do_tb_flush(void *data)
 {
-    if (!tcg_enabled()) {
+    CPUState *cpu;
+    int tb_flush_req = (uintptr_t)data;
+
+    if (tcg_ctx.tb_ctx.tb_flush_count != tb_flush_req) {
         return;
     }
 #if defined(DEBUG_FLUSH)
@@ -846,9 +979,8 @@ void tb_flush(CPUState *cpu)
 #endif
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
-        cpu_abort(cpu, "Internal error: code buffer overflow\n");
+        cpu_abort(first_cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
@@ -858,10 +990,126 @@ void tb_flush(CPUState *cpu)
     qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    /* Before the first TB, the regions are not even set up yet */
+    if (tcg_ctx.tb_ctx.regions[0].end) {
+        tb_regions_init();
+    }
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
+                  tcg_ctx.tb_ctx.tb_flush_count + 1);
+}
+
+#ifndef CONFIG_USER_ONLY
+static void do_tb_flush_safe(void *data)
+{
+    tb_lock();
+    do_tb_flush(data);
+    tb_unlock();
+}
+#endif
+
+void tb_flush(CPUState *cpu)
+{
+    void *data;
+    bool locked;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+    data = (void *)(uintptr_t)atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_count);
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Other vCPUs may be running the code we are about to discard */
+        async_safe_run_on_cpu(cpu, do_tb_flush_safe, data);
+        return;
+    }
+#endif
+    locked = tb_lock_maybe();
+    do_tb_flush(data);
+    if (locked) {
+        tb_unlock();
+    }
+}
+
+/* Switch per-TB profiling on or off.  The counters are generated into
+ * the TBs, so the cache is flushed to retranslate everything with (or
+ * without) them; this also starts a new profile from zero.
+ */
+void tb_profile_set(CPUState *cpu, bool enable)
+{
+    atomic_set(&tb_profile_enabled, enable);
+    tb_flush(cpu);
+}
+
+/* Move code generation to the next region, invalidating the TBs left
+ * there from the previous round; this also unlinks the jumps into them
+ * from the TBs that stay.  Called with tb_lock held and, with MTTCG,
+ * while no vCPU is executing.  @data is the eviction count the request
+ * was made at, as for do_tb_flush.
+ */
+static void do_tb_region_evict(void *data)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int evict_req = (uintptr_t)data;
+    CPUState *cpu;
+    TBRegion *r;
+    int i;
+
+    if (ctx->tb_region_evict_count != evict_req) {
+        return;
+    }
+    ctx->regions[ctx->cur_region].ptr = tcg_ctx.code_gen_ptr;
+
+    r = &ctx->regions[(ctx->cur_region + 1) % TB_REGION_COUNT];
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (!r->tbs[i].invalid) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+
+    /* The TB a vCPU is about to chain from may have been evicted */
+    CPU_FOREACH(cpu) {
+        cpu->tb_flushed = true;
+    }
+
+    tb_region_set_current(r - ctx->regions);
+    atomic_mb_set(&ctx->tb_region_evict_count,
+                  ctx->tb_region_evict_count + 1);
+}
+
+#ifndef CONFIG_USER_ONLY
+static void do_tb_region_evict_safe(void *data)
+{
+    tb_lock();
+    do_tb_region_evict(data);
+    tb_unlock();
+}
+#endif
+
+/* Make room for new code when the current region is full */
+static void tb_region_evict(CPUState *cpu)
+{
+    void *data;
+    bool locked;
+
+    data = (void *)(uintptr_t)
+        atomic_mb_read(&tcg_ctx.tb_ctx.tb_region_evict_count);
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Other vCPUs may be running the code we are about to discard */
+        async_safe_run_on_cpu(cpu, do_tb_region_evict_safe, data);
+        return;
+    }
+#endif
+    locked = tb_lock_maybe();
+    do_tb_region_evict(data);
+    if (locked) {
+        tb_unlock();
+    }
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -990,6 +1238,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     uint32_t h;
     tb_page_addr_t phys_pc;
 
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
@@ -1010,8 +1260,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1124,6 +1374,8 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 {
     uint32_t h;
 
+    atomic_set(&tb->invalid, false);
+
     /* add in the hash table */
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
     qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
@@ -1152,6 +1404,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int64_t gen_start = 0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1160,12 +1413,35 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (tb_profile_enabled && !(cflags & CF_NOCACHE)) {
+        cflags |= CF_EXEC_COUNT;
+        gen_start = get_clock();
+    }
+#ifdef TARGET_HAS_SUPERBLOCKS
+    /* Superblock side exits look up their successor with goto_ptr;
+       without it they would go back to the main loop, which costs more
+       than the longer TB saves.  */
+    if (TCG_TARGET_HAS_goto_ptr &&
+        !(cflags & (CF_COUNT_MASK | CF_LAST_IO | CF_NOCACHE |
+                    CF_SUPERBLOCK))) {
+        cflags |= CF_HOT_COUNT;
+    }
+#endif
+    if (cflags & CF_SUPERBLOCK) {
+        tcg_ctx.tb_ctx.tb_superblock_count++;
+    }
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the current region is full, evict the oldest one */
+        tb_region_evict(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction only happens once every vCPU has stopped;
+             * leave the execution loop so that this one can, too.
+             */
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1176,6 +1452,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->exec_count = 0;
+    tb->exit_count = 0;
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1216,10 +1494,12 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
        re-initialize it per above, and re-do the actual code generation.  */
     gen_code_size = tcg_gen_code(&tcg_ctx, tb);
     if (unlikely(gen_code_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
     search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
     if (unlikely(search_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
 
@@ -1230,6 +1510,21 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_ctx.search_out_len += search_size;
 #endif
 
+    tb->tc_size = gen_code_size;
+    tb->gen_time = gen_start ? get_clock() - gen_start : 0;
+    tcg_ctx.guest_insn_total += tb->icount;
+    tcg_ctx.host_bytes_total += gen_code_size;
+    tcg_ctx.reg_ld_total += tcg_ctx.reg_ld_count;
+    tcg_ctx.reg_st_total += tcg_ctx.reg_st_count;
+    if (qemu_loglevel_mask(CPU_LOG_TB_STATS) &&
+        qemu_log_in_addr_range(tb->pc)) {
+        qemu_log("TB " TARGET_FMT_lx ": %d insns, %d host bytes "
+                 "(%0.1f/insn), %d reg loads, %d reg stores\n",
+                 tb->pc, tb->icount, gen_code_size,
+                 tb->icount ? (double)gen_code_size / tb->icount : 0,
+                 tcg_ctx.reg_ld_count, tcg_ctx.reg_st_count);
+    }
+
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM) &&
         qemu_log_in_addr_range(tb->pc)) {
@@ -1413,6 +1708,14 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
+    if (!p->first_tb) {
+        /* The last TB went away through another page it spans; stop
+           trapping writes here rather than counting them towards a
+           bitmap of nothing.  */
+        invalidate_page_bitmap(p);
+        tlb_unprotect_code(start);
+        return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
         /* build code bitmap */
@@ -1507,23 +1810,32 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
     int m_min, m_max, m;
     uintptr_t v;
+    size_t i;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (ctx->nb_tbs <= 0) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    /* The TBs are only sorted within each region */
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) /
+        (ctx->regions[0].end - ctx->regions[0].start);
+    r = &ctx->regions[MIN(i, TB_REGION_COUNT - 1)];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_ptr(r)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1533,7 +1845,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1551,11 +1863,42 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
         return;
     }
     ram_addr = memory_region_get_ram_addr(mr) + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
+
+/* Invalidate the TBs in @block before it is freed, so that none of them
+ * outlives its page descriptors or runs from a block later reallocated
+ * at the same offset.  The descriptors are freed with the block.
+ */
+void tb_invalidate_ram_block(RAMBlock *block)
+{
+    PageDesc *pd = block->page_desc;
+    ram_addr_t i, n, addr;
+    bool locked;
+
+    if (pd == NULL) {
+        return;
+    }
+    locked = tb_lock_maybe();
+    rcu_read_lock();
+    n = DIV_ROUND_UP(block->max_length, TARGET_PAGE_SIZE);
+    for (i = 0; i < n; i++) {
+        if (pd[i].first_tb) {
+            addr = block->offset + (i << TARGET_PAGE_BITS);
+            tb_invalidate_phys_page_range(addr, addr + TARGET_PAGE_SIZE, 0);
+        }
+    }
+    rcu_read_unlock();
+    if (locked) {
+        tb_unlock();
+    }
+}
 #endif /* !defined(CONFIG_USER_ONLY) */
 
+/* Called with tb_lock held.  */
 void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
@@ -1592,6 +1935,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint32_t flags;
 
+    /* Released by tb_lock_reset() when we longjmp out below.  */
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1702,41 +2047,61 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
     cpu_fprintf(f, "TB hash avg chain   %0.3f buckets. Histogram: %s\n",
                 qdist_avg(&hst.chain), hgram);
     g_free(hgram);
+
+    cpu_fprintf(f, "TB hash contention  %zu lookup retries, %zu lock waits\n",
+                hst.lookup_retries, hst.lock_contentions);
+    if (hst.resize_pending) {
+        cpu_fprintf(f, "TB hash resize      %zu head buckets pending\n",
+                    hst.resize_pending);
+    }
 }
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t host_code_size;
     TranslationBlock *tb;
+    TBRegion *r;
     struct qht_stats hst;
 
+    tb_lock();
+
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
+    host_code_size = 0;
+    for (i = 0; i < TB_REGION_COUNT; i++) {
+        r = &tcg_ctx.tb_ctx.regions[i];
+        if (!r->nb_tbs) {
+            continue;
         }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+        host_code_size += tb_region_ptr(r) - r->start;
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+                host_code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d, filling region %d\n",
+                TB_REGION_COUNT, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1744,12 +2109,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? host_code_size /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) host_code_size /
+                                        target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1760,6 +2123,14 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "host bytes/insn     %0.1f "
+                "(reg loads %0.2f, stores %0.2f)\n",
+                tcg_ctx.guest_insn_total ?
+                (double)tcg_ctx.host_bytes_total / tcg_ctx.guest_insn_total : 0,
+                tcg_ctx.guest_insn_total ?
+                (double)tcg_ctx.reg_ld_total / tcg_ctx.guest_insn_total : 0,
+                tcg_ctx.guest_insn_total ?
+                (double)tcg_ctx.reg_st_total / tcg_ctx.guest_insn_total : 0);
 
     qht_statistics_init(&tcg_ctx.tb_ctx.htable, &hst);
     print_qht_statistics(f, cpu_fprintf, hst);
@@ -1767,10 +2138,17 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tcg_ctx.tb_ctx.tb_region_evict_count);
+    cpu_fprintf(f, "TB superblocks      %d\n",
+            tcg_ctx.tb_ctx.tb_superblock_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB flush elided    %d\n", tlb_flush_elided_count);
     tcg_dump_info(f, cpu_fprintf);
+
+    tb_unlock();
 }
 
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
@@ -1778,6 +2156,68 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+static int tb_exec_count_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(const TranslationBlock **)a;
+    const TranslationBlock *tb = *(const TranslationBlock **)b;
+    uint64_t wa = (uint64_t)ta->exec_count * ta->icount;
+    uint64_t wb = (uint64_t)tb->exec_count * tb->icount;
+
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/* Print the COUNT translation blocks that executed the most guest
+ * instructions since profiling was enabled.
+ */
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    TranslationBlock **tbs;
+    TranslationBlock *tb;
+    TBRegion *r;
+    uint64_t total = 0;
+    int i, j, n = 0;
+
+    if (!tb_profile_enabled) {
+        cpu_fprintf(f, "TB profiling is disabled, use \"tb_profile on\"\n");
+        return;
+    }
+
+    tb_lock();
+
+    tbs = g_new(TranslationBlock *, tcg_ctx.tb_ctx.nb_tbs);
+    for (i = 0; i < TB_REGION_COUNT; i++) {
+        r = &tcg_ctx.tb_ctx.regions[i];
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &r->tbs[j];
+            if (tb->invalid || !(tb->cflags & CF_EXEC_COUNT) ||
+                n == tcg_ctx.tb_ctx.nb_tbs) {
+                continue;
+            }
+            total += (uint64_t)tb->exec_count * tb->icount;
+            tbs[n++] = tb;
+        }
+    }
+    qsort(tbs, n, sizeof(*tbs), tb_exec_count_cmp);
+
+    cpu_fprintf(f, "%-18s %6s %6s %12s %10s %8s %6s\n", "guest pc",
+                "insns", "host", "execs", "exits", "gen ns", "%insn");
+    for (i = 0; i < n && i < count; i++) {
+        uint64_t w;
+
+        tb = tbs[i];
+        w = (uint64_t)tb->exec_count * tb->icount;
+        cpu_fprintf(f, "0x" TARGET_FMT_lx "%*s %6d %6u %12u %10u %8u "
+                    "%5.1f%%\n", tb->pc,
+                    (int)(16 - 2 * sizeof(target_ulong)), "",
+                    tb->icount, tb->tc_size, tb->exec_count,
+                    tb->exit_count, tb->gen_time,
+                    total ? w * 100.0 / total : 0);
+    }
+
+    tb_unlock();
+    g_free(tbs);
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -1787,91 +2227,68 @@ void cpu_interrupt(CPUState *cpu, int mask)
 }
 
 /*
- * Walks guest process memory "regions" one by one
- * and calls callback function 'fn' for each region.
+ * The flags set by page_set_flags(), kept as ranges so that walks and range
+ * checks need not visit l1_map one page at a time.  Unlike PageDesc.flags,
+ * PAGE_WRITE is not cleared here while a page holds translated code.
+ * Updates happen with mmap_lock held and take the lock for writing; lookups
+ * can come from any thread and only take it for reading.
  */
-struct walk_memory_regions_data {
-    walk_memory_regions_fn fn;
-    void *priv;
-    target_ulong start;
-    int prot;
-};
-
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   target_ulong end, int new_prot)
-{
-    if (data->start != -1u) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
-    }
-
-    data->start = (new_prot ? end : -1u);
-    data->prot = new_prot;
+static IntervalTree page_ranges;
+static pthread_rwlock_t page_ranges_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-    return 0;
+/* Keep page_ranges_lock usable in the child of a fork(), see fork_start() */
+void page_fork_start(void)
+{
+    pthread_rwlock_wrlock(&page_ranges_lock);
 }
 
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 target_ulong base, int level, void **lp)
+void page_fork_end(int child)
 {
-    target_ulong pa;
-    int i, rc;
-
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
+    if (child) {
+        pthread_rwlock_init(&page_ranges_lock, NULL);
+    } else {
+        pthread_rwlock_unlock(&page_ranges_lock);
     }
+}
 
-    if (level == 0) {
-        PageDesc *pd = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+bool page_find_next_range(target_ulong address, target_ulong *start,
+                          target_ulong *last)
+{
+    IntervalTreeRange range;
+    bool found;
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
+    pthread_rwlock_rdlock(&page_ranges_lock);
+    found = interval_tree_find_next(&page_ranges, address, &range);
+    pthread_rwlock_unlock(&page_ranges_lock);
 
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((target_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
-        }
+    if (found) {
+        *start = range.start;
+        *last = range.last;
     }
-
-    return 0;
+    return found;
 }
 
+/*
+ * Walks guest process memory "regions" one by one
+ * and calls callback function 'fn' for each region.
+ */
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    uintptr_t i;
+    IntervalTreeRange range;
+    uint64_t addr = 0;
+    int rc = 0;
 
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1u;
-    data.prot = 0;
-
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (target_ulong)i << (V_L1_SHIFT + TARGET_PAGE_BITS),
-                                       V_L1_SHIFT / V_L2_BITS - 1, l1_map + i);
-        if (rc != 0) {
-            return rc;
+    pthread_rwlock_rdlock(&page_ranges_lock);
+    while (interval_tree_find_next(&page_ranges, addr, &range)) {
+        rc = fn(priv, range.start, range.last + 1, range.value);
+        if (rc != 0 || range.last == UINT64_MAX) {
+            break;
         }
+        addr = range.last + 1;
     }
+    pthread_rwlock_unlock(&page_ranges_lock);
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, target_ulong start,
@@ -1945,13 +2362,19 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+
+    pthread_rwlock_wrlock(&page_ranges_lock);
+    interval_tree_set(&page_ranges, start, end - 1, flags);
+    pthread_rwlock_unlock(&page_ranges_lock);
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
+    IntervalTreeRange range;
     PageDesc *p;
     target_ulong end;
     target_ulong addr;
+    int ret = 0;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -1972,6 +2395,30 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     end = TARGET_PAGE_ALIGN(start + len);
     start = start & TARGET_PAGE_MASK;
 
+    /* Check whole ranges first; the result does not depend on
+       translated code.  */
+    pthread_rwlock_rdlock(&page_ranges_lock);
+    addr = start;
+    while (true) {
+        if (!interval_tree_find_next(&page_ranges, addr, &range) ||
+            range.start > addr ||
+            !(range.value & PAGE_VALID) ||
+            ((flags & PAGE_READ) && !(range.value & PAGE_READ)) ||
+            ((flags & PAGE_WRITE) && !(range.value & PAGE_WRITE_ORG))) {
+            ret = -1;
+            break;
+        }
+        if (range.last >= (target_ulong)(end - 1)) {
+            break;
+        }
+        addr = range.last + 1;
+    }
+    pthread_rwlock_unlock(&page_ranges_lock);
+
+    if (ret < 0 || !(flags & PAGE_WRITE)) {
+        return ret;
+    }
+
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
@@ -1979,24 +2426,12 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
         if (!p) {
             return -1;
         }
-        if (!(p->flags & PAGE_VALID)) {
-            return -1;
-        }
-
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
-            return -1;
-        }
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+        /* unprotect the page if it was put read-only because it
+           contains translated code */
+        if (!(p->flags & PAGE_WRITE)) {
+            if (!page_unprotect(addr, 0)) {
                 return -1;
             }
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0)) {
-                    return -1;
-                }
-            }
         }
     }
     return 0;
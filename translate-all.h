@@ -31,6 +31,10 @@ void tb_check_watchpoint(CPUState *cpu);
 
 #ifdef CONFIG_USER_ONLY
 int page_unprotect(target_ulong address, uintptr_t pc);
+bool page_find_next_range(target_ulong address, target_ulong *start,
+                          target_ulong *last);
+void page_fork_start(void);
+void page_fork_end(int child);
 #endif
 
 #endif /* TRANSLATE_ALL_H */
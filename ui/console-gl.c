@@ -114,23 +114,61 @@ void surface_gl_create_texture(ConsoleGLState *gls,
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    pixman_region32_init(&surface->gldirty);
 }
 
+/*
+ * Updates are only recorded here and uploaded by the next
+ * surface_gl_render_texture(), so that an area which the guest redraws
+ * several times between two display refreshes is copied only once.
+ */
 void surface_gl_update_texture(ConsoleGLState *gls,
                                DisplaySurface *surface,
                                int x, int y, int w, int h)
+{
+    assert(gls);
+
+    if (!surface->texture) {
+        return;
+    }
+    pixman_region32_union_rect(&surface->gldirty, &surface->gldirty,
+                               x, y, w, h);
+}
+
+/* Above this many rectangles, upload their bounding box in one go */
+#define SURFACE_GL_MAX_DIRTY_RECTS 16
+
+static void surface_gl_flush_texture(DisplaySurface *surface)
 {
     uint8_t *data = (void *)surface_data(surface);
+    pixman_box32_t *rects;
+    int i, n;
 
-    assert(gls);
+    if (!pixman_region32_not_empty(&surface->gldirty)) {
+        return;
+    }
 
+    rects = pixman_region32_rectangles(&surface->gldirty, &n);
+    if (n > SURFACE_GL_MAX_DIRTY_RECTS) {
+        rects = pixman_region32_extents(&surface->gldirty);
+        n = 1;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, surface->texture);
     glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
                   surface_stride(surface) / surface_bytes_per_pixel(surface));
-    glTexSubImage2D(GL_TEXTURE_2D, 0,
-                    x, y, w, h,
-                    surface->glformat, surface->gltype,
-                    data + surface_stride(surface) * y
-                    + surface_bytes_per_pixel(surface) * x);
+    for (i = 0; i < n; i++) {
+        int x = rects[i].x1, y = rects[i].y1;
+
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        x, y, rects[i].x2 - x, rects[i].y2 - y,
+                        surface->glformat, surface->gltype,
+                        data + surface_stride(surface) * y
+                        + surface_bytes_per_pixel(surface) * x);
+    }
+    pixman_region32_fini(&surface->gldirty);
+    pixman_region32_init(&surface->gldirty);
 }
 
 void surface_gl_render_texture(ConsoleGLState *gls,
@@ -138,6 +176,8 @@ void surface_gl_render_texture(ConsoleGLState *gls,
 {
     assert(gls);
 
+    surface_gl_flush_texture(surface);
+
     glClearColor(0.1f, 0.1f, 0.1f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT);
 
@@ -153,6 +193,7 @@ void surface_gl_destroy_texture(ConsoleGLState *gls,
     }
     glDeleteTextures(1, &surface->texture);
     surface->texture = 0;
+    pixman_region32_fini(&surface->gldirty);
 }
 
 void surface_gl_setup_viewport(ConsoleGLState *gls,
@@ -42,6 +42,30 @@ static QTAILQ_HEAD(QemuInputEventQueueHead, QemuInputEventQueue) kbd_queue =
 static QEMUTimer *kbd_timer;
 static uint32_t kbd_default_delay_ms = 10;
 
+/*
+ * Pointer motion is coalesced between sync frames: a host UI may report
+ * motion far more often than any guest input device can consume it, so
+ * relative deltas are summed and absolute positions collapse to the last
+ * one.  Motion-only frames arriving within INPUT_MOTION_COALESCE_MS of
+ * the previous delivery are held back on a timer; buttons and keys flush
+ * pending motion first so event ordering is preserved.
+ */
+#define INPUT_MOTION_COALESCE_MS 5
+
+typedef struct QemuInputMotion {
+    QemuConsole *src;
+    bool pending;
+    bool frame_other;
+    uint32_t abs_mask;
+    uint32_t rel_mask;
+    int abs[INPUT_AXIS__MAX];
+    int rel[INPUT_AXIS__MAX];
+    int64_t last_ms;
+    QEMUTimer *timer;
+} QemuInputMotion;
+
+static QemuInputMotion motion;
+
 QemuInputHandlerState *qemu_input_handler_register(DeviceState *dev,
                                                    QemuInputHandler *handler)
 {
@@ -328,12 +352,93 @@ void qemu_input_event_send_impl(QemuConsole *src, InputEvent *evt)
     s->events++;
 }
 
+static void qemu_input_motion_flush(void)
+{
+    InputEvent *evt;
+    int axis;
+
+    if (!motion.pending) {
+        return;
+    }
+    motion.pending = false;
+
+    for (axis = 0; axis < INPUT_AXIS__MAX; axis++) {
+        if (motion.rel_mask & (1 << axis)) {
+            evt = qemu_input_event_new_move(INPUT_EVENT_KIND_REL, axis,
+                                            motion.rel[axis]);
+            replay_input_event(motion.src, evt);
+            qapi_free_InputEvent(evt);
+        }
+        if (motion.abs_mask & (1 << axis)) {
+            evt = qemu_input_event_new_move(INPUT_EVENT_KIND_ABS, axis,
+                                            motion.abs[axis]);
+            replay_input_event(motion.src, evt);
+            qapi_free_InputEvent(evt);
+        }
+    }
+    motion.rel_mask = 0;
+    motion.abs_mask = 0;
+    memset(motion.rel, 0, sizeof(motion.rel));
+}
+
+static bool qemu_input_motion_merge(QemuConsole *src, InputEvent *evt)
+{
+    InputMoveEvent *move;
+
+    switch (evt->type) {
+    case INPUT_EVENT_KIND_REL:
+    case INPUT_EVENT_KIND_ABS:
+        break;
+    default:
+        return false;
+    }
+
+    if (motion.pending && motion.src != src) {
+        qemu_input_motion_flush();
+    }
+    motion.src = src;
+    motion.pending = true;
+
+    if (evt->type == INPUT_EVENT_KIND_REL) {
+        move = evt->u.rel.data;
+        motion.rel[move->axis] += move->value;
+        motion.rel_mask |= 1 << move->axis;
+    } else {
+        move = evt->u.abs.data;
+        motion.abs[move->axis] = move->value;
+        motion.abs_mask |= 1 << move->axis;
+    }
+    return true;
+}
+
+static void qemu_input_motion_deliver(void)
+{
+    qemu_input_motion_flush();
+    motion.frame_other = false;
+    motion.last_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    replay_input_sync_event();
+}
+
+static void qemu_input_motion_timer(void *opaque)
+{
+    if (!runstate_is_running() && !runstate_check(RUN_STATE_SUSPENDED)) {
+        return;
+    }
+    qemu_input_motion_deliver();
+}
+
 void qemu_input_event_send(QemuConsole *src, InputEvent *evt)
 {
     if (!runstate_is_running() && !runstate_check(RUN_STATE_SUSPENDED)) {
         return;
     }
 
+    if (qemu_input_motion_merge(src, evt)) {
+        return;
+    }
+
+    qemu_input_motion_flush();
+    motion.frame_other = true;
     replay_input_event(src, evt);
 }
 
@@ -360,7 +465,27 @@ void qemu_input_event_sync(void)
         return;
     }
 
-    replay_input_sync_event();
+    if (motion.pending && !motion.frame_other) {
+        int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        if (now - motion.last_ms < INPUT_MOTION_COALESCE_MS) {
+            if (!motion.timer) {
+                motion.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                            qemu_input_motion_timer, NULL);
+            }
+            if (!timer_pending(motion.timer)) {
+                timer_mod(motion.timer,
+                          motion.last_ms + INPUT_MOTION_COALESCE_MS);
+            }
+            trace_input_motion_coalesce(motion.rel_mask, motion.abs_mask);
+            return;
+        }
+    }
+
+    if (motion.timer) {
+        timer_del(motion.timer);
+    }
+    qemu_input_motion_deliver();
 }
 
 InputEvent *qemu_input_event_new_key(KeyValue *key, bool down)
@@ -44,7 +44,9 @@
 #endif
 
 #include "qemu/bswap.h"
+#include "qemu/timer.h"
 #include "qapi/qmp/qint.h"
+#include "trace.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
 #include "vnc-palette.h"
@@ -95,6 +97,17 @@ static const struct {
     { 0.4, 14, 0, 0 },
     { 0.5, 16, 0, 0 },
 };
+
+/*
+ * Regions updated more often than jpeg_freq_threshold are treated as
+ * video.  Their JPEG quality starts at the level the client asked for and
+ * follows what the client connection can take: it drops while output is
+ * piling up for the client, and creeps back up once the output is drained.
+ */
+#define VNC_TIGHT_VIDEO_QUALITY_MIN   10
+#define VNC_TIGHT_VIDEO_QUALITY_STEP  5
+#define VNC_TIGHT_VIDEO_BACKLOG       (256 * 1024)
+#define VNC_TIGHT_VIDEO_ADJUST_MS     100
 #endif
 
 #ifdef CONFIG_VNC_PNG
@@ -1422,6 +1435,32 @@ static int send_sub_rect_nojpeg(VncState *vs, int x, int y, int w, int h,
 }
 
 #ifdef CONFIG_VNC_JPEG
+static int tight_video_quality(VncState *vs)
+{
+    int max = tight_conf[vs->tight.quality].jpeg_quality;
+    int min = MIN(max, VNC_TIGHT_VIDEO_QUALITY_MIN);
+    int quality = vs->tight.video_quality;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (!quality || quality > max) {
+        quality = max;
+    }
+    if (now - vs->tight.video_adjust_ms >= VNC_TIGHT_VIDEO_ADJUST_MS) {
+        if (vs->output_backlog > VNC_TIGHT_VIDEO_BACKLOG) {
+            quality = MAX(min, quality * 3 / 4);
+        } else if (vs->output_backlog == 0) {
+            quality = MIN(max, quality + VNC_TIGHT_VIDEO_QUALITY_STEP);
+        }
+        vs->tight.video_adjust_ms = now;
+    }
+    if (quality != vs->tight.video_quality) {
+        trace_vnc_tight_video_quality(vs, quality, vs->output_backlog);
+        vs->tight.video_quality = quality;
+    }
+    return quality;
+}
+
+/* @force is set for video regions, see tight_video_quality() */
 static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                               int bg, int fg, int colors,
                               VncPalette *palette, bool force)
@@ -1429,8 +1468,10 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     int ret;
 
     if (colors == 0) {
-        if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
-                      tight_detect_smooth_image(vs, w, h))) {
+        if (force) {
+            ret = send_jpeg_rect(vs, x, y, w, h, tight_video_quality(vs));
+        } else if (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
+                   tight_detect_smooth_image(vs, w, h)) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
@@ -1442,9 +1483,11 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     } else if (colors == 2) {
         ret = send_mono_rect(vs, x, y, w, h, bg, fg);
     } else if (colors <= 256) {
-        if (force || (colors > 96 &&
-                      tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
-                      tight_detect_smooth_image(vs, w, h))) {
+        if (force) {
+            ret = send_jpeg_rect(vs, x, y, w, h, tight_video_quality(vs));
+        } else if (colors > 96 &&
+                   tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
+                   tight_detect_smooth_image(vs, w, h)) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
@@ -96,8 +96,9 @@ static int vnc_zlib_stop(VncState *vs)
         vs->zlib.level = vs->tight.compression;
     }
 
-    // reserve memory in output buffer
-    buffer_reserve(&vs->output, vs->zlib.zlib.offset + 64);
+    /* reserve memory in output buffer, enough for incompressible data */
+    buffer_reserve(&vs->output,
+                   deflateBound(zstream, vs->zlib.zlib.offset) + 64);
 
     // set pointers
     zstream->next_in = vs->zlib.zlib.buffer;
@@ -129,6 +130,7 @@ int vnc_zlib_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 
     // compress the stream
     vnc_zlib_start(vs);
+    buffer_reserve(&vs->output, w * h * vs->client_pf.bytes_per_pixel);
     vnc_raw_send_framebuffer_update(vs, x, y, w, h);
     bytes_written = vnc_zlib_stop(vs);
 
@@ -92,8 +92,9 @@ static int zrle_compress_data(VncState *vs, int level)
         zstream->opaque = vs;
     }
 
-    /* reserve memory in output buffer */
-    buffer_reserve(&vs->zrle.zlib, vs->zrle.zrle.offset + 64);
+    /* reserve memory in output buffer, enough for incompressible data */
+    buffer_reserve(&vs->zrle.zlib,
+                   deflateBound(zstream, vs->zrle.zrle.offset) + 64);
 
     /* set pointers */
     zstream->next_in = vs->zrle.zrle.buffer;
@@ -278,6 +279,12 @@ static int zrle_send_framebuffer_update(VncState *vs, int x, int y,
 
     vnc_zrle_start(vs);
 
+    /* room for all tiles sent raw, so that encoding does not reallocate */
+    buffer_reserve(&vs->output,
+                   w * h * vs->client_pf.bytes_per_pixel +
+                   DIV_ROUND_UP(w, VNC_ZRLE_TILE_WIDTH) *
+                   DIV_ROUND_UP(h, VNC_ZRLE_TILE_HEIGHT));
+
     switch (vs->client_pf.bytes_per_pixel) {
     case 1:
         zrle_encode_8ne(vs, x, y, w, h, zywrle_level);
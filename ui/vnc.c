@@ -45,6 +45,10 @@
 #include "crypto/tlscredsx509.h"
 #include "qom/object_interfaces.h"
 #include "qemu/cutils.h"
+#ifdef CONFIG_LINUX
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#endif
 
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
 #define VNC_REFRESH_INTERVAL_INC  50
@@ -52,6 +56,11 @@
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
+/* Per-client update rate control, see vnc_update_throttle() */
+#define VNC_UPDATE_INTERVAL_MIN   10
+#define VNC_UPDATE_INTERVAL_MAX   1000
+#define VNC_SEND_QUEUE_HIGH       (64 * 1024)
+
 #include "vnc_keysym.h"
 #include "crypto/cipher.h"
 
@@ -728,6 +737,7 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
     qemu_pixman_image_unref(vd->guest.fb);
     vd->guest.fb = pixman_image_ref(surface->image);
     vd->guest.format = surface->format;
+    vd->guest.exact_damage = surface_has_exact_damage(surface);
 
     QTAILQ_FOREACH(vs, &vd->clients, next) {
         vnc_colordepth(vs);
@@ -1029,6 +1039,60 @@ static int find_and_clear_dirty_height(VncState *vs,
     return h;
 }
 
+/*
+ * Look at how the client keeps up: bytes still in the kernel send queue,
+ * and the TCP round trip time.  Returns false if not known.
+ */
+static bool vnc_client_send_queue(VncState *vs, int *queued, int *rtt_ms)
+{
+#ifdef CONFIG_LINUX
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (!vs->sioc || ioctl(vs->sioc->fd, SIOCOUTQ, queued) < 0) {
+        return false;
+    }
+    *rtt_ms = 0;
+    if (getsockopt(vs->sioc->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *rtt_ms = info.tcpi_rtt / 1000;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Adapt the client's update rate.  The interval doubles while data piles
+ * up in the socket and halves again whenever the socket is drained; while
+ * anything is queued, updates are also kept at least a round trip apart.
+ * Meanwhile the dirty map keeps accumulating, so a client that is behind gets fewer, larger
+ * updates instead of a backlog of stale frames.
+ */
+static void vnc_update_throttle(VncState *vs)
+{
+    int queued, rtt_ms, interval = vs->update_interval_ms;
+
+    if (!vnc_client_send_queue(vs, &queued, &rtt_ms)) {
+        return;
+    }
+
+    if (queued > VNC_SEND_QUEUE_HIGH) {
+        interval = MAX(interval * 2, VNC_UPDATE_INTERVAL_MIN);
+    } else if (queued == 0) {
+        interval /= 2;
+    }
+    if (queued) {
+        interval = MAX(interval, rtt_ms);
+    }
+    interval = MIN(interval, VNC_UPDATE_INTERVAL_MAX);
+
+    if (interval != vs->update_interval_ms) {
+        trace_vnc_client_throttle(vs, interval, queued, rtt_ms);
+        vs->update_interval_ms = interval;
+    }
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     if (vs->disconnecting) {
@@ -1051,6 +1115,17 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         if (!vs->has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
+        if (!vs->audio_cap && !vs->force_update) {
+            int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+            if (now - vs->last_update_ms < vs->update_interval_ms) {
+                /* client is behind, let the dirty map coalesce */
+                return 0;
+            }
+            vs->last_update_ms = now;
+        }
+        vnc_update_throttle(vs);
+
         /*
          * Send screen updates to the vnc client using the server
          * surface and server dirty map.  guest surface updates
@@ -2879,7 +2954,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        int x, bits;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2891,7 +2966,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2899,22 +2974,25 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+        /* Only visit the dirty chunks of the line */
+        bits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        for (; x < bits; x = find_next_bit(vd->guest.dirty[y], bits, x + 1)) {
             int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
+
+            clear_bit(x, vd->guest.dirty[y]);
             if ((x + 1) * cmp_bytes > line_bytes) {
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (vd->guest.exact_damage) {
+                memcpy(server_ptr + x * cmp_bytes, guest_ptr + x * cmp_bytes,
+                       _cmp_bytes);
+            } else if (!buffer_copy_if_changed(server_ptr + x * cmp_bytes,
+                                               guest_ptr + x * cmp_bytes,
+                                               _cmp_bytes)) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -123,6 +123,7 @@ struct VncSurface
     VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
     pixman_image_t *fb;
     pixman_format_code_t format;
+    bool exact_damage;  /* see QEMU_EXACT_DAMAGE_FLAG */
 };
 
 typedef enum VncShareMode {
@@ -157,6 +158,7 @@ struct VncDisplay
     int lock_key_sync;
     int key_delay_ms;
     QemuMutex mutex;
+    int encoders;   /* workers reading the server surface, under mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -201,6 +203,8 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    int video_quality;          /* JPEG quality for video regions */
+    int64_t video_adjust_ms;    /* last change of video_quality */
 } VncTight;
 
 typedef struct VncHextile {
@@ -245,6 +249,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;   /* picked by a worker, protected by the queue lock */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -260,11 +265,14 @@ struct VncState
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
+    size_t output_backlog; /* Output not yet sent when the job started */
 
     VncDisplay *vd;
     int need_update;
     int force_update;
     int has_dirty;
+    int64_t last_update_ms;     /* when the last update was queued */
+    int update_interval_ms;     /* minimum time between two updates */
     uint32_t features;
     int absolute;
     int last_x;
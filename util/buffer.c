@@ -84,8 +84,6 @@ void buffer_shrink(Buffer *buffer)
         new >= BUFFER_MIN_SHRINK_SIZE) {
         buffer_adj_size(buffer, buffer_get_avg_size(buffer));
     }
-
-    buffer_adj_size(buffer, 0);
 }
 
 void buffer_reserve(Buffer *buffer, size_t len)
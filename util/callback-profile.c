@@ -0,0 +1,156 @@
+/*
+ * Timing of event loop callbacks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/callback-profile.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "trace.h"
+#ifdef CONFIG_BACKTRACE
+#include <execinfo.h>
+#endif
+
+static const char *const kind_names[CALLBACK_PROFILE_KIND_MAX] = {
+    [CALLBACK_PROFILE_FD] = "fd handler",
+    [CALLBACK_PROFILE_BH] = "bottom half",
+    [CALLBACK_PROFILE_TIMER] = "timer",
+};
+
+bool callback_profile_enabled;
+static int64_t threshold;
+
+/* Callbacks run in every event loop thread: the histograms are updated
+ * atomically, stalls are rare enough to take a lock. */
+static unsigned long histogram[CALLBACK_PROFILE_KIND_MAX]
+                              [CALLBACK_PROFILE_BUCKETS];
+static QemuMutex stall_lock;
+static GHashTable *stalls;
+
+static void __attribute__((__constructor__)) callback_profile_init(void)
+{
+    qemu_mutex_init(&stall_lock);
+    stalls = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+}
+
+char *callback_profile_symbol(void *fn)
+{
+#ifdef CONFIG_BACKTRACE
+    char **names = backtrace_symbols(&fn, 1);
+
+    if (names) {
+        char *name = g_strdup(names[0]);
+
+        free(names);
+        return name;
+    }
+#endif
+    return g_strdup_printf("%p", fn);
+}
+
+void callback_profile_record(CallbackProfileKind kind, void *fn, int64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - clz64(us) : 0;
+    int64_t limit = atomic_read(&threshold);
+    CallbackProfileStall *stall;
+    bool worst = false;
+
+    bucket = MIN(bucket, CALLBACK_PROFILE_BUCKETS - 1);
+    atomic_inc(&histogram[kind][bucket]);
+
+    /* limit is 0 if profiling was disabled while the callback ran */
+    if (!limit || ns < limit) {
+        return;
+    }
+
+    trace_callback_profile_stall(kind_names[kind], fn, ns);
+
+    /* Functions are told apart by address; an fd handler and a timer
+     * never share one. */
+    qemu_mutex_lock(&stall_lock);
+    stall = g_hash_table_lookup(stalls, fn);
+    if (!stall) {
+        stall = g_new0(CallbackProfileStall, 1);
+        stall->kind = kind;
+        stall->fn = fn;
+        g_hash_table_insert(stalls, fn, stall);
+    }
+    stall->count++;
+    stall->total_ns += ns;
+    if (ns > stall->max_ns) {
+        stall->max_ns = ns;
+        worst = true;
+    }
+    qemu_mutex_unlock(&stall_lock);
+
+    if (worst) {
+        char *name = callback_profile_symbol(fn);
+
+        error_report("%s %s blocked its event loop for %" PRId64 " us",
+                     kind_names[kind], name, ns / 1000);
+        g_free(name);
+    }
+}
+
+void callback_profile_set(int64_t threshold_ns, bool reset)
+{
+    if (reset) {
+        int i, j;
+
+        for (i = 0; i < CALLBACK_PROFILE_KIND_MAX; i++) {
+            for (j = 0; j < CALLBACK_PROFILE_BUCKETS; j++) {
+                atomic_set(&histogram[i][j], 0);
+            }
+        }
+        qemu_mutex_lock(&stall_lock);
+        g_hash_table_remove_all(stalls);
+        qemu_mutex_unlock(&stall_lock);
+    }
+
+    atomic_set(&threshold, threshold_ns);
+    atomic_set(&callback_profile_enabled, threshold_ns > 0);
+}
+
+int64_t callback_profile_get_threshold(void)
+{
+    return atomic_read(&threshold);
+}
+
+void callback_profile_get_histogram(CallbackProfileKind kind,
+                                    uint64_t *buckets)
+{
+    int i;
+
+    for (i = 0; i < CALLBACK_PROFILE_BUCKETS; i++) {
+        buckets[i] = atomic_read(&histogram[kind][i]);
+    }
+}
+
+void callback_profile_foreach_stall(void (*fn)(CallbackProfileStall *stall,
+                                               void *opaque),
+                                    void *opaque)
+{
+    GHashTableIter iter;
+    CallbackProfileStall *stall, copy;
+    GArray *copies = g_array_new(false, false, sizeof(copy));
+    int i;
+
+    /* @fn may be slow (symbol lookup); don't run it under the lock */
+    qemu_mutex_lock(&stall_lock);
+    g_hash_table_iter_init(&iter, stalls);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stall)) {
+        g_array_append_val(copies, *stall);
+    }
+    qemu_mutex_unlock(&stall_lock);
+
+    for (i = 0; i < copies->len; i++) {
+        copy = g_array_index(copies, CallbackProfileStall, i);
+        fn(&copy, opaque);
+    }
+    g_array_free(copies, true);
+}
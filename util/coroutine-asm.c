@@ -0,0 +1,226 @@
+/*
+ * Assembly coroutine switching for x86_64 and aarch64 hosts
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2011  Kevin Wolf <kwolf@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error The asm coroutine backend only supports x86_64 and aarch64 hosts
+#endif
+
+/*
+ * Unlike sigsetjmp()/siglongjmp(), a switch saves nothing but the stack
+ * pointer (plus the resume address on aarch64).  The inline assembly
+ * declares every other register as clobbered, so the compiler spills
+ * exactly the values that are live across the switch and nothing else.
+ */
+typedef struct {
+#ifdef __aarch64__
+    void *pc;
+#endif
+    void *sp;
+} CoroutineAsmContext;
+
+typedef struct {
+    Coroutine base;
+    CoroutineAsmContext ctx;
+    void *stack;
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+
+} CoroutineAsm;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+#ifdef __x86_64__
+/*
+ * The return address pushed by "call" becomes the resume point: switching
+ * to a context means loading its stack pointer and returning.  The red zone
+ * below the stack pointer may hold live data, so step over it first.
+ */
+static inline CoroutineAction coroutine_asm_switch(CoroutineAsmContext *from,
+                                                   CoroutineAsmContext *to,
+                                                   CoroutineAction action)
+{
+    uintptr_t action_ = action;
+
+    asm volatile(
+        "subq $128, %%rsp\n"
+        "pushq %%rbp\n"
+        "call 1f\n"
+        "jmp 2f\n"
+        "1: movq %%rsp, (%[from])\n"
+        "movq (%[to]), %%rsp\n"
+        "ret\n"
+        "2: popq %%rbp\n"
+        "addq $128, %%rsp\n"
+        : "+a" (action_), [from] "+b" (from), [to] "+D" (to)
+        :
+        : "rcx", "rdx", "rsi", "r8", "r9", "r10", "r11",
+          "r12", "r13", "r14", "r15",
+          "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",
+          "xmm15", "cc", "memory");
+    return action_;
+}
+
+static void coroutine_asm_init_context(CoroutineAsmContext *ctx, void *top,
+                                       void (*fn)(void))
+{
+    void **sp = (void **)((uintptr_t)top & ~(uintptr_t)15) - 2;
+
+    /* "ret" pops fn, leaving the stack aligned as after a call */
+    sp[0] = fn;
+    ctx->sp = sp;
+}
+#else
+static inline CoroutineAction coroutine_asm_switch(CoroutineAsmContext *from,
+                                                   CoroutineAsmContext *to,
+                                                   CoroutineAction action)
+{
+    register uintptr_t action_ asm("x0") = action;
+    register CoroutineAsmContext *from_ asm("x1") = from;
+    register CoroutineAsmContext *to_ asm("x2") = to;
+
+    asm volatile(
+        "str x29, [sp, #-16]!\n"
+        "adr x3, 1f\n"
+        "mov x4, sp\n"
+        "stp x3, x4, [%[from]]\n"
+        "ldp x3, x4, [%[to]]\n"
+        "mov sp, x4\n"
+        "br x3\n"
+        "1: ldr x29, [sp], #16\n"
+        : "+r" (action_), [from] "+r" (from_), [to] "+r" (to_)
+        :
+        : "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",
+          "x13", "x14", "x15", "x16", "x17", "x19", "x20", "x21", "x22",
+          "x23", "x24", "x25", "x26", "x27", "x28", "x30",
+          "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7", "v8", "v9", "v10",
+          "v11", "v12", "v13", "v14", "v15", "v16", "v17", "v18", "v19",
+          "v20", "v21", "v22", "v23", "v24", "v25", "v26", "v27", "v28",
+          "v29", "v30", "v31", "cc", "memory");
+    return action_;
+}
+
+static void coroutine_asm_init_context(CoroutineAsmContext *ctx, void *top,
+                                       void (*fn)(void))
+{
+    ctx->pc = fn;
+    ctx->sp = (void *)((uintptr_t)top & ~(uintptr_t)15);
+}
+#endif
+
+/* Entered on the new stack by the first switch to the coroutine, which
+ * has set "current" to it just before.
+ */
+static void __attribute__((noreturn)) coroutine_trampoline(void)
+{
+    Coroutine *co = current;
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    const size_t stack_size = 1 << 20;
+    CoroutineAsm *co;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = g_malloc(stack_size);
+    coroutine_asm_init_context(&co->ctx, co->stack + stack_size,
+                               coroutine_trampoline);
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + stack_size);
+#endif
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#ifdef CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    g_free(co->stack);
+    g_free(co);
+}
+
+/* Like in the ucontext backend, this must not be inlined: a coroutine may
+ * be resumed in a different thread, and the address of the TLS variable
+ * "current" must not be cached across the switch.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+
+    current = to_;
+    return coroutine_asm_switch(&from->ctx, &to->ctx, action);
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
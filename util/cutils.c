@@ -184,6 +184,7 @@ int qemu_fdatasync(int fd)
 #define SPLAT(p)       _mm_set1_epi8(*(p))
 #define ALL_EQ(v1, v2) (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) == 0xFFFF)
 #define VEC_OR(v1, v2) (_mm_or_si128(v1, v2))
+#define VEC_HAVE_LOADU
 #elif defined(__aarch64__)
 #include "arm_neon.h"
 #define VECTYPE        uint64x2_t
@@ -263,6 +264,48 @@ static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+/*
+ * Checks if two buffers of @len bytes have the same content.  Unlike
+ * buffer_find_nonzero_offset() there are no alignment or length
+ * restrictions.
+ */
+#ifdef VEC_HAVE_LOADU
+static bool buffer_is_equal_inner(const void *a, const void *b, size_t len)
+{
+    const uint8_t *p = a;
+    const uint8_t *q = b;
+
+    while (len >= 4 * sizeof(__m128i)) {
+        const __m128i *vp = (const __m128i *)p;
+        const __m128i *vq = (const __m128i *)q;
+        __m128i t0 = _mm_cmpeq_epi8(_mm_loadu_si128(vp + 0),
+                                    _mm_loadu_si128(vq + 0));
+        __m128i t1 = _mm_cmpeq_epi8(_mm_loadu_si128(vp + 1),
+                                    _mm_loadu_si128(vq + 1));
+        __m128i t2 = _mm_cmpeq_epi8(_mm_loadu_si128(vp + 2),
+                                    _mm_loadu_si128(vq + 2));
+        __m128i t3 = _mm_cmpeq_epi8(_mm_loadu_si128(vp + 3),
+                                    _mm_loadu_si128(vq + 3));
+        __m128i t = _mm_and_si128(_mm_and_si128(t0, t1),
+                                  _mm_and_si128(t2, t3));
+
+        if (_mm_movemask_epi8(t) != 0xFFFF) {
+            return false;
+        }
+        p += 4 * sizeof(__m128i);
+        q += 4 * sizeof(__m128i);
+        len -= 4 * sizeof(__m128i);
+    }
+
+    return memcmp(p, q, len) == 0;
+}
+#else
+static bool buffer_is_equal_inner(const void *a, const void *b, size_t len)
+{
+    return memcmp(a, b, len) == 0;
+}
+#endif
+
 #if defined CONFIG_AVX2_OPT
 #pragma GCC push_options
 #pragma GCC target("avx2")
@@ -318,6 +361,40 @@ static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
     return i * sizeof(AVX2_VECTYPE);
 }
 
+/*
+ * Compare 4 * 32 bytes per iteration; packets are not aligned so use
+ * unaligned loads.
+ */
+static bool buffer_is_equal_avx2(const void *a, const void *b, size_t len)
+{
+    const uint8_t *p = a;
+    const uint8_t *q = b;
+
+    while (len >= 4 * sizeof(AVX2_VECTYPE)) {
+        const AVX2_VECTYPE *vp = (const AVX2_VECTYPE *)p;
+        const AVX2_VECTYPE *vq = (const AVX2_VECTYPE *)q;
+        AVX2_VECTYPE t0 = _mm256_cmpeq_epi8(_mm256_loadu_si256(vp + 0),
+                                            _mm256_loadu_si256(vq + 0));
+        AVX2_VECTYPE t1 = _mm256_cmpeq_epi8(_mm256_loadu_si256(vp + 1),
+                                            _mm256_loadu_si256(vq + 1));
+        AVX2_VECTYPE t2 = _mm256_cmpeq_epi8(_mm256_loadu_si256(vp + 2),
+                                            _mm256_loadu_si256(vq + 2));
+        AVX2_VECTYPE t3 = _mm256_cmpeq_epi8(_mm256_loadu_si256(vp + 3),
+                                            _mm256_loadu_si256(vq + 3));
+        AVX2_VECTYPE t = _mm256_and_si256(_mm256_and_si256(t0, t1),
+                                          _mm256_and_si256(t2, t3));
+
+        if (_mm256_movemask_epi8(t) != 0xFFFFFFFF) {
+            return false;
+        }
+        p += 4 * sizeof(AVX2_VECTYPE);
+        q += 4 * sizeof(AVX2_VECTYPE);
+        len -= 4 * sizeof(AVX2_VECTYPE);
+    }
+
+    return buffer_is_equal_inner(p, q, len);
+}
+
 static bool avx2_support(void)
 {
     int a, b, c, d;
@@ -352,6 +429,17 @@ static void *can_use_buffer_find_nonzero_offset_ifunc(void)
 
     return func;
 }
+
+bool buffer_is_equal(const void *a, const void *b, size_t len) \
+         __attribute__ ((ifunc("buffer_is_equal_ifunc")));
+
+static void *buffer_is_equal_ifunc(void)
+{
+    typeof(buffer_is_equal) *func = (avx2_support()) ?
+        buffer_is_equal_avx2 : buffer_is_equal_inner;
+
+    return func;
+}
 #pragma GCC pop_options
 #else
 bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
@@ -363,8 +451,37 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
 {
     return buffer_find_nonzero_offset_inner(buf, len);
 }
+
+bool buffer_is_equal(const void *a, const void *b, size_t len)
+{
+    return buffer_is_equal_inner(a, b, len);
+}
 #endif
 
+/*
+ * Copy @len bytes from @src to @dst, unless they already have the same
+ * content.  The buffers are compared a block at a time and only the part
+ * from the first differing block on is copied, so that an unchanged
+ * buffer is read once and never written.  Returns true if @dst changed.
+ */
+#define BUFFER_COPY_BLOCK 256
+
+bool buffer_copy_if_changed(void *dst, const void *src, size_t len)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    size_t off, n;
+
+    for (off = 0; off < len; off += n) {
+        n = MIN(len - off, BUFFER_COPY_BLOCK);
+        if (!buffer_is_equal(d + off, s + off, n)) {
+            memcpy(d + off, s + off, len - off);
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
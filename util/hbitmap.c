@@ -378,6 +378,74 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t first = start >> hb->granularity;
+    uint64_t end, pos, end_pos;
+    unsigned long cur;
+    int64_t res;
+
+    if (count == 0 || first >= hb->size) {
+        return -1;
+    }
+
+    /* Granule after the last one in the range, clipped to the bitmap */
+    if (count - 1 > UINT64_MAX - start) {
+        end = hb->size;
+    } else {
+        end = MIN(((start + count - 1) >> hb->granularity) + 1, hb->size);
+    }
+
+    /* Pretend that the bits before the first are set and skip whole words
+     * of set bits */
+    pos = first >> BITS_PER_LEVEL;
+    end_pos = (end - 1) >> BITS_PER_LEVEL;
+    cur = last_lev[pos] | ((1UL << (first & (BITS_PER_LONG - 1))) - 1);
+    while (cur == ~0UL && pos < end_pos) {
+        cur = last_lev[++pos];
+    }
+    if (cur == ~0UL) {
+        return -1;
+    }
+
+    res = (pos << BITS_PER_LEVEL) + ctol(cur);
+    if (res >= end) {
+        return -1;
+    }
+
+    /* @start may lie in the middle of the zero granule that was found */
+    return MAX(res << hb->granularity, start);
+}
+
+bool hbitmap_next_dirty_area(const HBitmap *hb, uint64_t *start,
+                             uint64_t *count)
+{
+    HBitmapIter hbi;
+    uint64_t end, area_start;
+    int64_t next_set, next_zero;
+
+    if (*count == 0 || (*start >> hb->granularity) >= hb->size) {
+        return false;
+    }
+
+    end = *count > UINT64_MAX - *start ? UINT64_MAX : *start + *count;
+    end = MIN(end, hb->size << hb->granularity);
+
+    hbitmap_iter_init(&hbi, hb, *start);
+    next_set = hbitmap_iter_next(&hbi);
+    if (next_set < 0 || next_set >= end) {
+        return false;
+    }
+
+    area_start = MAX(next_set, *start);
+    next_zero = hbitmap_next_zero(hb, area_start, end - area_start);
+
+    *start = area_start;
+    *count = (next_zero < 0 ? end : next_zero) - area_start;
+    return true;
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -0,0 +1,259 @@
+/*
+ * Interval map backed by a balanced search tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/*
+ * An AVL tree keyed by range start.  Since ranges never overlap, ordering
+ * by start also orders them by last, which is all the lookups need.
+ */
+struct IntervalTreeNode {
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    IntervalTreeRange range;
+    int height;
+};
+
+static inline int node_height(IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+static inline void node_update(IntervalTreeNode *n)
+{
+    n->height = 1 + MAX(node_height(n->left), node_height(n->right));
+}
+
+static IntervalTreeNode *node_rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *node_rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+/* Restore the AVL invariant at @n once its subtrees are balanced */
+static IntervalTreeNode *node_rebalance(IntervalTreeNode *n)
+{
+    int balance = node_height(n->left) - node_height(n->right);
+
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = node_rotate_left(n->left);
+        }
+        return node_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = node_rotate_right(n->right);
+        }
+        return node_rotate_left(n);
+    }
+    node_update(n);
+    return n;
+}
+
+static IntervalTreeNode *node_insert(IntervalTreeNode *n,
+                                     IntervalTreeNode *new)
+{
+    if (!n) {
+        return new;
+    }
+    if (new->range.start < n->range.start) {
+        n->left = node_insert(n->left, new);
+    } else {
+        n->right = node_insert(n->right, new);
+    }
+    return node_rebalance(n);
+}
+
+/* Detach the leftmost node below @n and return it in @min */
+static IntervalTreeNode *node_remove_min(IntervalTreeNode *n,
+                                         IntervalTreeNode **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = node_remove_min(n->left, min);
+    return node_rebalance(n);
+}
+
+/* Free the node that starts at @start, which must exist below @n */
+static IntervalTreeNode *node_remove(IntervalTreeNode *n, uint64_t start)
+{
+    assert(n);
+    if (start < n->range.start) {
+        n->left = node_remove(n->left, start);
+    } else if (start > n->range.start) {
+        n->right = node_remove(n->right, start);
+    } else {
+        IntervalTreeNode *left = n->left, *right = n->right, *min;
+
+        g_free(n);
+        if (!right) {
+            return left;
+        }
+        right = node_remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return node_rebalance(min);
+    }
+    return node_rebalance(n);
+}
+
+static IntervalTreeNode *node_find_next(IntervalTreeNode *n, uint64_t addr)
+{
+    IntervalTreeNode *best = NULL;
+
+    while (n) {
+        if (n->range.last < addr) {
+            n = n->right;
+        } else {
+            best = n;
+            n = n->left;
+        }
+    }
+    return best;
+}
+
+static IntervalTreeNode *node_find_prev(IntervalTreeNode *n, uint64_t addr)
+{
+    IntervalTreeNode *best = NULL;
+
+    while (n) {
+        if (n->range.start > addr) {
+            n = n->left;
+        } else {
+            best = n;
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+static void node_free_all(IntervalTreeNode *n)
+{
+    if (n) {
+        node_free_all(n->left);
+        node_free_all(n->right);
+        g_free(n);
+    }
+}
+
+static void tree_insert(IntervalTree *tree, uint64_t start, uint64_t last,
+                        int value)
+{
+    IntervalTreeNode *n = g_new0(IntervalTreeNode, 1);
+
+    n->range.start = start;
+    n->range.last = last;
+    n->range.value = value;
+    n->height = 1;
+    tree->root = node_insert(tree->root, n);
+}
+
+void interval_tree_init(IntervalTree *tree)
+{
+    tree->root = NULL;
+}
+
+void interval_tree_destroy(IntervalTree *tree)
+{
+    node_free_all(tree->root);
+    tree->root = NULL;
+}
+
+void interval_tree_set(IntervalTree *tree, uint64_t start, uint64_t last,
+                       int value)
+{
+    IntervalTreeNode *n;
+
+    assert(start <= last);
+
+    /* Cut [start, last] out of the ranges that overlap it */
+    while ((n = node_find_next(tree->root, start)) &&
+           n->range.start <= last) {
+        IntervalTreeRange old = n->range;
+
+        tree->root = node_remove(tree->root, old.start);
+        if (old.start < start) {
+            tree_insert(tree, old.start, start - 1, old.value);
+        }
+        if (old.last > last) {
+            tree_insert(tree, last + 1, old.last, old.value);
+        }
+    }
+
+    if (!value) {
+        return;
+    }
+
+    /* Absorb adjacent ranges with the same value */
+    if (start > 0) {
+        n = node_find_prev(tree->root, start - 1);
+        if (n && n->range.last == start - 1 && n->range.value == value) {
+            start = n->range.start;
+            tree->root = node_remove(tree->root, start);
+        }
+    }
+    if (last < UINT64_MAX) {
+        n = node_find_next(tree->root, last + 1);
+        if (n && n->range.start == last + 1 && n->range.value == value) {
+            uint64_t next = n->range.start;
+
+            last = n->range.last;
+            tree->root = node_remove(tree->root, next);
+        }
+    }
+    tree_insert(tree, start, last, value);
+}
+
+int interval_tree_get(IntervalTree *tree, uint64_t addr)
+{
+    IntervalTreeNode *n = node_find_next(tree->root, addr);
+
+    return n && n->range.start <= addr ? n->range.value : 0;
+}
+
+bool interval_tree_find_next(IntervalTree *tree, uint64_t addr,
+                             IntervalTreeRange *range)
+{
+    IntervalTreeNode *n = node_find_next(tree->root, addr);
+
+    if (!n) {
+        return false;
+    }
+    *range = n->range;
+    return true;
+}
+
+bool interval_tree_find_prev(IntervalTree *tree, uint64_t addr,
+                             IntervalTreeRange *range)
+{
+    IntervalTreeNode *n = node_find_prev(tree->root, addr);
+
+    if (!n) {
+        return false;
+    }
+    *range = n->range;
+    return true;
+}
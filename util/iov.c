@@ -60,6 +60,87 @@ size_t iov_to_buf_full(const struct iovec *iov, const unsigned int iov_cnt,
     return done;
 }
 
+void iov_cursor_init(IOVCursor *cur, const struct iovec *iov,
+                     unsigned int iov_cnt)
+{
+    cur->iov = iov;
+    cur->iov_cnt = iov_cnt;
+    cur->idx = 0;
+    cur->base = 0;
+}
+
+/* Move @cur to the element that contains @offset; false if past the end */
+static bool iov_cursor_seek(IOVCursor *cur, size_t offset)
+{
+    if (offset < cur->base) {
+        cur->idx = 0;
+        cur->base = 0;
+    }
+    while (cur->idx < cur->iov_cnt &&
+           offset >= cur->base + cur->iov[cur->idx].iov_len) {
+        cur->base += cur->iov[cur->idx].iov_len;
+        cur->idx++;
+    }
+    if (cur->idx == cur->iov_cnt) {
+        assert(offset <= cur->base);
+        return false;
+    }
+    return true;
+}
+
+size_t iov_cursor_from_buf(IOVCursor *cur, size_t offset,
+                           const void *buf, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes && iov_cursor_seek(cur, offset + done)) {
+        const struct iovec *e = &cur->iov[cur->idx];
+        size_t skip = offset + done - cur->base;
+        size_t len = MIN(e->iov_len - skip, bytes - done);
+
+        memcpy(e->iov_base + skip, buf + done, len);
+        done += len;
+    }
+    return done;
+}
+
+size_t iov_cursor_to_buf(IOVCursor *cur, size_t offset,
+                         void *buf, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes && iov_cursor_seek(cur, offset + done)) {
+        const struct iovec *e = &cur->iov[cur->idx];
+        size_t skip = offset + done - cur->base;
+        size_t len = MIN(e->iov_len - skip, bytes - done);
+
+        memcpy(buf + done, e->iov_base + skip, len);
+        done += len;
+    }
+    return done;
+}
+
+size_t iov_cursor_copy(IOVCursor *dst, size_t dst_offset,
+                       IOVCursor *src, size_t src_offset, size_t bytes)
+{
+    size_t done = 0;
+
+    while (done < bytes && iov_cursor_seek(src, src_offset + done)) {
+        const struct iovec *e = &src->iov[src->idx];
+        size_t skip = src_offset + done - src->base;
+        size_t len = MIN(e->iov_len - skip, bytes - done);
+        size_t copied;
+
+        copied = iov_cursor_from_buf(dst, dst_offset + done,
+                                     e->iov_base + skip, len);
+        done += copied;
+        if (copied < len) {
+            break;
+        }
+    }
+    return done;
+}
+
 size_t iov_memset(const struct iovec *iov, const unsigned int iov_cnt,
                   size_t offset, int fillc, size_t bytes)
 {
@@ -272,6 +272,9 @@ const QEMULogItem qemu_log_items[] = {
     { CPU_LOG_TB_NOCHAIN, "nochain",
       "do not chain compiled TBs so that \"exec\" and \"cpu\" show\n"
       "complete traces" },
+    { CPU_LOG_TB_STATS, "tb_stats",
+      "show host code size and register allocator loads/stores\n"
+      "per guest instruction for each translated TB" },
     { 0, NULL, NULL },
 };
 
@@ -39,6 +39,7 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -311,18 +312,108 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    QemuThread pgthread;
+    sigjmp_buf env;
+} MemsetThread;
+
+static MemsetThread *memset_thread;
+static int memset_num_threads;
+static bool memset_thread_failed;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    int i;
+
+    for (i = 0; i < memset_num_threads; i++) {
+        if (qemu_thread_is_self(&memset_thread[i].pgthread)) {
+            siglongjmp(memset_thread[i].env, 1);
+        }
+    }
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = arg;
+    sigset_t set, oldset;
+
+    /* new threads start with every signal blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    if (sigsetjmp(memset_args->env, 1)) {
+        memset_thread_failed = true;
+    } else {
+        size_t i;
+
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            memset(memset_args->addr + memset_args->hpagesize * i, 0, 1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+/* Fault in every page of @area from up to @max_threads threads, each
+ * taking a contiguous share; the kernel zeroes (and, with huge pages,
+ * reserves) pages independently, so this scales with the thread count.
+ * Returns false if a page could not be allocated.
+ */
+static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                            int max_threads)
+{
+    size_t numpages_per_thread, leftover;
+    char *addr = area;
+    long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    memset_num_threads = MAX(1, MIN(max_threads,
+                                    MAX_MEM_PREALLOC_THREAD_COUNT));
+    if (host_cpus > 0) {
+        memset_num_threads = MIN(memset_num_threads, host_cpus);
+    }
+    memset_num_threads = MIN(memset_num_threads, numpages);
+    memset_thread_failed = false;
+
+    memset_thread = g_new0(MemsetThread, memset_num_threads);
+    numpages_per_thread = numpages / memset_num_threads;
+    leftover = numpages % memset_num_threads;
+    for (i = 0; i < memset_num_threads; i++) {
+        memset_thread[i].addr = addr;
+        memset_thread[i].numpages = numpages_per_thread + (i < leftover);
+        memset_thread[i].hpagesize = hpagesize;
+        addr += memset_thread[i].numpages * hpagesize;
+    }
+    /* the handler scans the array, so fill it in before any thread runs */
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].pgthread);
+    }
+    g_free(memset_thread);
+    memset_thread = NULL;
+    memset_num_threads = 0;
+
+    return !memset_thread_failed;
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -335,23 +426,9 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    if (!touch_all_pages(area, hpagesize, numpages, max_threads)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
     }
 
     ret = sigaction(SIGBUS, &oldact, NULL);
@@ -360,7 +437,6 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 }
 
 
@@ -22,6 +22,10 @@
 
 enum {
     POOL_BATCH_SIZE = 64,
+    /* Upper bound for the adaptive per-thread pool */
+    POOL_MAX_SIZE = 1024,
+    /* Number of creations after which a thread resizes its pool */
+    POOL_WINDOW = 4096,
 };
 
 /** Free list to speed up creation */
@@ -31,6 +35,39 @@ static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(po
 static __thread unsigned int alloc_pool_size;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
+/* Each AioContext runs in its own thread, and a coroutine normally
+ * terminates in the thread that created it, so the thread-local pool acts
+ * as the per-AioContext pool.  It is sized for the peak number of
+ * coroutines the thread had in flight during the last window, so deep
+ * queues keep their stacks instead of mmap'ing and freeing them.  The
+ * global release_pool only takes what overflows.
+ */
+static __thread unsigned int alloc_pool_target = POOL_BATCH_SIZE;
+static __thread unsigned int pool_in_flight;
+static __thread unsigned int pool_window_peak;
+static __thread unsigned int pool_window_count;
+static __thread CoroutinePoolStats pool_stats;
+
+static QemuMutex pool_stats_lock;
+static CoroutinePoolStats pool_stats_total;
+
+static void coroutine_pool_publish_stats(void)
+{
+    qemu_mutex_lock(&pool_stats_lock);
+    pool_stats_total.hits += pool_stats.hits;
+    pool_stats_total.stack_allocs += pool_stats.stack_allocs;
+    pool_stats_total.stack_frees += pool_stats.stack_frees;
+    qemu_mutex_unlock(&pool_stats_lock);
+    memset(&pool_stats, 0, sizeof(pool_stats));
+}
+
+void qemu_coroutine_pool_get_stats(CoroutinePoolStats *stats)
+{
+    qemu_mutex_lock(&pool_stats_lock);
+    *stats = pool_stats_total;
+    qemu_mutex_unlock(&pool_stats_lock);
+}
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
@@ -40,6 +77,53 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
         QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
         qemu_coroutine_delete(co);
     }
+    coroutine_pool_publish_stats();
+}
+
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!coroutine_pool_cleanup_notifier.notify) {
+        coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+    }
+}
+
+static void coroutine_pool_resize(void)
+{
+    Coroutine *co;
+
+    alloc_pool_target = MIN(MAX(pool_window_peak, POOL_BATCH_SIZE),
+                            POOL_MAX_SIZE);
+    pool_window_peak = pool_in_flight;
+    pool_window_count = 0;
+
+    while (alloc_pool_size > alloc_pool_target) {
+        co = QSLIST_FIRST(&alloc_pool);
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        alloc_pool_size--;
+        pool_stats.stack_frees++;
+        qemu_coroutine_delete(co);
+    }
+
+    trace_qemu_coroutine_pool_resize(alloc_pool_target, pool_stats.hits,
+                                     pool_stats.stack_allocs,
+                                     pool_stats.stack_frees);
+    coroutine_pool_publish_stats();
+}
+
+static void coroutine_pool_account_create(bool hit)
+{
+    if (hit) {
+        pool_stats.hits++;
+    } else {
+        pool_stats.stack_allocs++;
+    }
+
+    pool_in_flight++;
+    pool_window_peak = MAX(pool_window_peak, pool_in_flight);
+    if (++pool_window_count == POOL_WINDOW) {
+        coroutine_pool_resize();
+    }
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
@@ -51,10 +135,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
                 /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
+                coroutine_pool_register_cleanup();
 
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
@@ -69,6 +150,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
             QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
             alloc_pool_size--;
         }
+        coroutine_pool_account_create(co != NULL);
     }
 
     if (!co) {
@@ -86,21 +168,32 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            atomic_inc(&release_pool_size);
-            return;
+        /* May have been created by another thread */
+        if (pool_in_flight) {
+            pool_in_flight--;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (alloc_pool_size < alloc_pool_target) {
+            coroutine_pool_register_cleanup();
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;
         }
+        if (release_pool_size < POOL_BATCH_SIZE * 2) {
+            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+            atomic_inc(&release_pool_size);
+            return;
+        }
+        pool_stats.stack_frees++;
     }
 
     qemu_coroutine_delete(co);
 }
 
+static void __attribute__((__constructor__)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_stats_lock);
+}
+
 void qemu_coroutine_enter(Coroutine *co)
 {
     Coroutine *self = qemu_coroutine_self();
@@ -18,6 +18,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitops.h"
 
 static bool name_threads;
 
@@ -491,6 +492,35 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+/* Restrict @thread to the host CPUs set in the @nbits wide @host_cpus */
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t *set;
+    size_t size;
+    unsigned long cpu;
+    int err;
+
+    set = CPU_ALLOC(nbits);
+    if (!set) {
+        return -ENOMEM;
+    }
+    size = CPU_ALLOC_SIZE(nbits);
+    CPU_ZERO_S(size, set);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        CPU_SET_S(cpu, size, set);
+    }
+    err = pthread_setaffinity_np(thread->thread, size, set);
+    CPU_FREE(set);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
@@ -22,8 +22,9 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done incrementally and concurrently with
+ *   both readers and writers; only writes to the bucket being migrated at a
+ *   given time are held up.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +44,21 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing is done by creating a new map, pointed to by the old map's
+ * resize_to, and then migrating the old map's head buckets to it one at a
+ * time, in index order: the bucket's lock is taken, its entries are copied
+ * into the new map, and the bucket is marked as moved by bumping the old
+ * map's n_moved inside a seqlock write section. Auto-resizes are carried out
+ * a few buckets at a time by inserters; explicit resizes migrate all buckets
+ * straight away, but still one bucket at a time. Once all buckets have been
+ * moved, the ht->map pointer is set to the new map, and the old map is freed
+ * once no RCU readers can see it anymore.
  *
- * Writers check for concurrent resizes by comparing ht->map before and after
- * acquiring their bucket lock. If they don't match, a resize has occured
- * while the bucket spinlock was being acquired.
+ * Readers and writers that find their head bucket moved (after acquiring the
+ * seqlock or the bucket lock, respectively) simply repeat the operation on
+ * the map pointed to by resize_to. A map that is no longer ht->map has all
+ * of its buckets marked as moved, so the same check also catches writers
+ * that raced with the end of a resize.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -116,6 +124,11 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  *       find the whole struct.
  * @buckets: array of head buckets. It is constant once the map is created.
  * @n_buckets: number of head buckets. It is constant once the map is created.
+ * @resize_to: map this map is being resized to, or NULL. Once set, it is
+ *             constant.
+ * @n_moved: number of head buckets, starting from index 0, that have been
+ *           migrated to @resize_to. Only increases, under ht->lock and the
+ *           lock of the bucket being moved.
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
@@ -126,6 +139,8 @@ struct qht_map {
     struct rcu_head rcu;
     struct qht_bucket *buckets;
     size_t n_buckets;
+    struct qht_map *resize_to;
+    size_t n_moved;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
 };
@@ -133,7 +148,9 @@ struct qht_map {
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
-static void qht_do_resize(struct qht *ht, struct qht_map *new);
+/* number of head buckets an insertion migrates during an auto-resize */
+#define QHT_RESIZE_STEP 64
+
 static void qht_grow_maybe(struct qht *ht);
 
 #ifdef QHT_DEBUG
@@ -223,47 +240,29 @@ static void qht_map_unlock_buckets(struct qht_map *map)
     }
 }
 
-/*
- * Call with at least a bucket lock held.
- * @map should be the value read before acquiring the lock (or locks).
- */
-static inline bool qht_map_is_stale__locked(struct qht *ht, struct qht_map *map)
+/* acquire a bucket lock, accounting for contention */
+static inline void qht_bucket_lock(struct qht *ht, struct qht_bucket *b)
 {
-    return map != ht->map;
+    if (unlikely(qemu_spin_trylock(&b->lock))) {
+        atomic_inc(&ht->n_lock_contentions);
+        qemu_spin_lock(&b->lock);
+    }
 }
 
 /*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
- *
- * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
- *
- * Note: callers cannot have ht->lock held.
+ * Call with either @head->lock or @head's seqlock held. Once a bucket has
+ * been moved, it stays moved.
  */
-static inline
-void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
+static inline bool qht_map_bucket_is_moved(struct qht_map *map,
+                                           struct qht_bucket *head)
 {
-    struct qht_map *map;
-
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qemu_mutex_lock(&ht->lock);
-    map = ht->map;
-    qht_map_lock_buckets(map);
-    qemu_mutex_unlock(&ht->lock);
-    *pmap = map;
-    return;
+    return unlikely(atomic_rcu_read(&map->resize_to)) &&
+           (size_t)(head - map->buckets) < atomic_read(&map->n_moved);
 }
 
 /*
- * Get a head bucket and lock it, making sure its parent map is not stale.
- * @pmap is filled with a pointer to the bucket's parent map.
+ * Get a head bucket and lock it, making sure it hasn't been migrated by a
+ * resize. @pmap is filled with a pointer to the bucket's parent map.
  *
  * Unlock with qemu_spin_unlock(&b->lock).
  *
@@ -277,23 +276,25 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
     struct qht_map *map;
 
     map = atomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    for (;;) {
+        b = qht_map_to_bucket(map, hash);
+        qht_bucket_lock(ht, b);
+        if (likely(!qht_map_bucket_is_moved(map, b))) {
+            *pmap = map;
+            return b;
+        }
+        qemu_spin_unlock(&b->lock);
 
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
+        /* we raced with a resize; the bucket now lives in the new map */
+        map = atomic_rcu_read(&map->resize_to);
     }
-    qemu_spin_unlock(&b->lock);
+}
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qemu_mutex_lock(&ht->lock);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qemu_mutex_unlock(&ht->lock);
-    *pmap = map;
-    return b;
+static inline bool qht_is_resizing(struct qht *ht)
+{
+    struct qht_map *map = atomic_rcu_read(&ht->map);
+
+    return atomic_rcu_read(&map->resize_to) != NULL;
 }
 
 static inline bool qht_map_needs_resize(struct qht_map *map)
@@ -332,6 +333,8 @@ static struct qht_map *qht_map_create(size_t n_buckets)
 
     map = g_malloc(sizeof(*map));
     map->n_buckets = n_buckets;
+    map->resize_to = NULL;
+    map->n_moved = 0;
 
     map->n_added_buckets = 0;
     map->n_added_buckets_threshold = n_buckets /
@@ -356,6 +359,8 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
     size_t n_buckets = qht_elems_to_buckets(n_elems);
 
     ht->mode = mode;
+    ht->n_lookup_retries = 0;
+    ht->n_lock_contentions = 0;
     qemu_mutex_init(&ht->lock);
     map = qht_map_create(n_buckets);
     atomic_rcu_set(&ht->map, map);
@@ -364,6 +369,9 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->resize_to) {
+        qht_map_destroy(ht->map->resize_to);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -399,13 +407,55 @@ static void qht_map_reset__all_locked(struct qht_map *map)
     qht_map_debug__all_locked(map);
 }
 
+/*
+ * Call with ht->lock held. @map must be ht->map, and @map->resize_to must be
+ * set.
+ *
+ * Marks all of @map's remaining buckets as moved and makes @map->resize_to
+ * the current map. Callers must have migrated all of @map's entries, or have
+ * dropped them while holding all of @map's bucket locks; in the latter case
+ * the locks must be released before freeing @map with call_rcu().
+ */
+static void qht_map_retire__locked(struct qht *ht, struct qht_map *map)
+{
+    atomic_set(&map->n_moved, map->n_buckets);
+    atomic_rcu_set(&ht->map, map->resize_to);
+}
+
+/*
+ * Call with ht->lock held. Resets all entries, including those of the map
+ * being resized to, in which case that resize is completed without migrating
+ * anything.
+ *
+ * Returns the resulting ht->map, with all of its bucket locks held.
+ */
+static struct qht_map *qht_reset__locked(struct qht *ht)
+{
+    struct qht_map *map = ht->map;
+    struct qht_map *to = map->resize_to;
+
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    if (likely(to == NULL)) {
+        return map;
+    }
+
+    qht_map_lock_buckets(to);
+    qht_map_reset__all_locked(to);
+    qht_map_retire__locked(ht, map);
+    qht_map_unlock_buckets(map);
+    call_rcu(map, qht_map_destroy, rcu);
+    return to;
+}
+
 void qht_reset(struct qht *ht)
 {
     struct qht_map *map;
 
-    qht_map_lock_buckets__no_stale(ht, &map);
-    qht_map_reset__all_locked(map);
+    qemu_mutex_lock(&ht->lock);
+    map = qht_reset__locked(ht);
     qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
 }
 
 bool qht_reset_size(struct qht *ht, size_t n_elems)
@@ -418,20 +468,24 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qemu_mutex_lock(&ht->lock);
-    map = ht->map;
+    map = ht->map->resize_to ? ht->map->resize_to : ht->map;
     if (n_buckets != map->n_buckets) {
         new = qht_map_create(n_buckets);
         resize = true;
     }
 
-    qht_map_lock_buckets(map);
-    qht_map_reset__all_locked(map);
+    map = qht_reset__locked(ht);
     if (resize) {
-        qht_do_resize(ht, new);
+        /* there is nothing to migrate, so switch to @new right away */
+        atomic_rcu_set(&map->resize_to, new);
+        qht_map_retire__locked(ht, map);
     }
     qht_map_unlock_buckets(map);
     qemu_mutex_unlock(&ht->lock);
 
+    if (resize) {
+        call_rcu(map, qht_map_destroy, rcu);
+    }
     return resize;
 }
 
@@ -463,17 +517,27 @@ void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
 }
 
 static __attribute__((noinline))
-void *qht_lookup__slowpath(struct qht_bucket *b, qht_lookup_func_t func,
+void *qht_lookup__slowpath(struct qht *ht, struct qht_map *map,
+                           struct qht_bucket *b, qht_lookup_func_t func,
                            const void *userp, uint32_t hash)
 {
     unsigned int version;
     void *ret;
 
-    do {
+    for (;;) {
         version = seqlock_read_begin(&b->sequence);
+        if (qht_map_bucket_is_moved(map, b)) {
+            /* the bucket's entries have been migrated by a resize */
+            map = atomic_rcu_read(&map->resize_to);
+            b = qht_map_to_bucket(map, hash);
+            continue;
+        }
         ret = qht_do_lookup(b, func, userp, hash);
-    } while (seqlock_read_retry(&b->sequence, version));
-    return ret;
+        if (likely(!seqlock_read_retry(&b->sequence, version))) {
+            return ret;
+        }
+        atomic_inc(&ht->n_lookup_retries);
+    }
 }
 
 void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
@@ -488,15 +552,18 @@ void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
-    ret = qht_do_lookup(b, func, userp, hash);
-    if (likely(!seqlock_read_retry(&b->sequence, version))) {
-        return ret;
+    if (likely(!qht_map_bucket_is_moved(map, b))) {
+        ret = qht_do_lookup(b, func, userp, hash);
+        if (likely(!seqlock_read_retry(&b->sequence, version))) {
+            return ret;
+        }
+        atomic_inc(&ht->n_lookup_retries);
     }
     /*
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    return qht_lookup__slowpath(ht, map, b, func, userp, hash);
 }
 
 /* call with head->lock held */
@@ -545,26 +612,95 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     return true;
 }
 
+/*
+ * Call with ht->lock held. Migrates the next head bucket of @map, which must
+ * be ht->map, to the map it is being resized to.
+ */
+static void qht_map_migrate_bucket__locked(struct qht *ht, struct qht_map *map)
+{
+    struct qht_map *to = map->resize_to;
+    size_t idx = map->n_moved;
+    struct qht_bucket *head = &map->buckets[idx];
+    struct qht_bucket *b = head;
+    int i;
+
+    qemu_spin_lock(&head->lock);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *dst;
+
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            dst = qht_map_to_bucket(to, b->hashes[i]);
+            qemu_spin_lock(&dst->lock);
+            qht_insert__locked(ht, to, dst, b->pointers[i], b->hashes[i],
+                               NULL);
+            qemu_spin_unlock(&dst->lock);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    /*
+     * The old entries are left in place; lookups that raced with the
+     * migration retry and then go to @to.
+     */
+    seqlock_write_begin(&head->sequence);
+    atomic_set(&map->n_moved, idx + 1);
+    seqlock_write_end(&head->sequence);
+    qemu_spin_unlock(&head->lock);
+}
+
+/*
+ * Call with ht->lock held. Migrates up to @n head buckets of an ongoing
+ * resize, and completes the resize once all buckets have been migrated.
+ */
+static void qht_resize_step__locked(struct qht *ht, size_t n)
+{
+    struct qht_map *map = ht->map;
+
+    if (map->resize_to == NULL) {
+        return;
+    }
+    while (n-- && map->n_moved < map->n_buckets) {
+        qht_map_migrate_bucket__locked(ht, map);
+    }
+    if (map->n_moved == map->n_buckets) {
+        qht_map_retire__locked(ht, map);
+        call_rcu(map, qht_map_destroy, rcu);
+    }
+}
+
+/*
+ * Call with ht->lock held. Creating the @new map here would add unnecessary
+ * delay while the lock is held; we let callers create it.
+ */
+static void qht_resize_start__locked(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *map = ht->map;
+
+    g_assert(map->resize_to == NULL);
+    g_assert_cmpuint(new->n_buckets, !=, map->n_buckets);
+    atomic_rcu_set(&map->resize_to, new);
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
 
     /*
-     * If the lock is taken it probably means there's an ongoing resize,
-     * so bail out.
+     * If the lock is taken it probably means another thread is migrating
+     * buckets, so bail out.
      */
     if (qemu_mutex_trylock(&ht->lock)) {
         return;
     }
     map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_map_lock_buckets(map);
-        qht_do_resize(ht, new);
-        qht_map_unlock_buckets(map);
+    /* another thread might have just started the resize we were after */
+    if (map->resize_to == NULL && qht_map_needs_resize(map)) {
+        qht_resize_start__locked(ht, qht_map_create(map->n_buckets * 2));
     }
+    qht_resize_step__locked(ht, QHT_RESIZE_STEP);
     qemu_mutex_unlock(&ht->lock);
 }
 
@@ -583,7 +719,8 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash)
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
 
-    if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
+    if (unlikely(needs_resize || qht_is_resizing(ht)) &&
+        ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
     }
     return ret;
@@ -721,43 +858,28 @@ static inline void qht_map_iter__all_locked(struct qht *ht, struct qht_map *map,
 void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
 {
     struct qht_map *map;
+    struct qht_map *to;
+    size_t i;
 
-    map = atomic_rcu_read(&ht->map);
+    /* ht->lock keeps an ongoing resize from migrating buckets under us */
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    to = map->resize_to;
     qht_map_lock_buckets(map);
+    if (to) {
+        qht_map_lock_buckets(to);
+    }
+
     /* Note: ht here is merely for carrying ht->mode; ht->map won't be read */
-    qht_map_iter__all_locked(ht, map, func, userp);
+    for (i = to ? map->n_moved : 0; i < map->n_buckets; i++) {
+        qht_bucket_iter(ht, &map->buckets[i], func, userp);
+    }
+    if (to) {
+        qht_map_iter__all_locked(ht, to, func, userp);
+        qht_map_unlock_buckets(to);
+    }
     qht_map_unlock_buckets(map);
-}
-
-static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
-{
-    struct qht_map *new = userp;
-    struct qht_bucket *b = qht_map_to_bucket(new, hash);
-
-    /* no need to acquire b->lock because no thread has seen this map yet */
-    qht_insert__locked(ht, new, b, p, hash, NULL);
-}
-
-/*
- * Call with ht->lock and all bucket locks held.
- *
- * Creating the @new map here would add unnecessary delay while all the locks
- * are held--holding up the bucket locks is particularly bad, since no writes
- * can occur while these are held. Thus, we let callers create the new map,
- * hopefully without the bucket locks held.
- */
-static void qht_do_resize(struct qht *ht, struct qht_map *new)
-{
-    struct qht_map *old;
-
-    old = ht->map;
-    g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
-
-    qht_map_iter__all_locked(ht, old, qht_map_copy, new);
-    qht_map_debug__all_locked(new);
-
-    atomic_rcu_set(&ht->map, new);
-    call_rcu(old, qht_map_destroy, rcu);
+    qemu_mutex_unlock(&ht->lock);
 }
 
 bool qht_resize(struct qht *ht, size_t n_elems)
@@ -766,14 +888,11 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qemu_mutex_lock(&ht->lock);
+    /* complete any auto-resize in progress first */
+    qht_resize_step__locked(ht, SIZE_MAX);
     if (n_buckets != ht->map->n_buckets) {
-        struct qht_map *new;
-        struct qht_map *old = ht->map;
-
-        new = qht_map_create(n_buckets);
-        qht_map_lock_buckets(old);
-        qht_do_resize(ht, new);
-        qht_map_unlock_buckets(old);
+        qht_resize_start__locked(ht, qht_map_create(n_buckets));
+        qht_resize_step__locked(ht, SIZE_MAX);
         ret = true;
     }
     qemu_mutex_unlock(&ht->lock);
@@ -781,60 +900,86 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
+static void qht_bucket_statistics(struct qht_bucket *head,
+                                  struct qht_stats *stats)
+{
+    struct qht_bucket *b;
+    unsigned int version;
+    size_t buckets;
+    size_t entries;
+    int j;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        buckets = 0;
+        entries = 0;
+        b = head;
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (atomic_read(&b->pointers[j]) == NULL) {
+                    break;
+                }
+                entries++;
+            }
+            buckets++;
+            b = atomic_rcu_read(&b->next);
+        } while (b);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    stats->head_buckets++;
+    if (entries) {
+        qdist_inc(&stats->chain, buckets);
+        qdist_inc(&stats->occupancy,
+                  (double)entries / QHT_BUCKET_ENTRIES / buckets);
+        stats->used_head_buckets++;
+        stats->entries += entries;
+    } else {
+        qdist_inc(&stats->occupancy, 0);
+    }
+}
+
 /* pass @stats to qht_statistics_destroy() when done */
 void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
 {
     struct qht_map *map;
-    int i;
+    struct qht_map *to;
+    size_t i;
 
     map = atomic_rcu_read(&ht->map);
 
+    stats->head_buckets = 0;
     stats->used_head_buckets = 0;
     stats->entries = 0;
+    stats->resize_pending = 0;
+    stats->lookup_retries = 0;
+    stats->lock_contentions = 0;
     qdist_init(&stats->chain);
     qdist_init(&stats->occupancy);
     /* bail out if the qht has not yet been initialized */
     if (unlikely(map == NULL)) {
-        stats->head_buckets = 0;
         return;
     }
-    stats->head_buckets = map->n_buckets;
 
-    for (i = 0; i < map->n_buckets; i++) {
-        struct qht_bucket *head = &map->buckets[i];
-        struct qht_bucket *b;
-        unsigned int version;
-        size_t buckets;
-        size_t entries;
-        int j;
+    stats->lookup_retries = atomic_read(&ht->n_lookup_retries);
+    stats->lock_contentions = atomic_read(&ht->n_lock_contentions);
 
-        do {
-            version = seqlock_read_begin(&head->sequence);
-            buckets = 0;
-            entries = 0;
-            b = head;
-            do {
-                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
-                    if (atomic_read(&b->pointers[j]) == NULL) {
-                        break;
-                    }
-                    entries++;
-                }
-                buckets++;
-                b = atomic_rcu_read(&b->next);
-            } while (b);
-        } while (seqlock_read_retry(&head->sequence, version));
-
-        if (entries) {
-            qdist_inc(&stats->chain, buckets);
-            qdist_inc(&stats->occupancy,
-                      (double)entries / QHT_BUCKET_ENTRIES / buckets);
-            stats->used_head_buckets++;
-            stats->entries += entries;
-        } else {
-            qdist_inc(&stats->occupancy, 0);
+    /* keep an ongoing resize from completing, and freeing @map, under us */
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    to = map->resize_to;
+    if (to) {
+        stats->resize_pending = map->n_buckets - map->n_moved;
+    }
+
+    for (i = to ? map->n_moved : 0; i < map->n_buckets; i++) {
+        qht_bucket_statistics(&map->buckets[i], stats);
+    }
+    if (to) {
+        for (i = 0; i < to->n_buckets; i++) {
+            qht_bucket_statistics(&to->buckets[i], stats);
         }
     }
+    qemu_mutex_unlock(&ht->lock);
 }
 
 void qht_statistics_destroy(struct qht_stats *stats)
@@ -32,6 +32,8 @@
 #include "qemu/atomic.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 /*
  * Global grace period counter.  Bit 0 is always one in rcu_gp_ctr.
@@ -46,6 +48,10 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Protected by rcu_stats_lock.  */
+static RCUStats rcu_stats;
+static QemuMutex rcu_stats_lock;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -139,7 +145,10 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    int64_t start, ns;
+
     qemu_mutex_lock(&rcu_sync_lock);
+    start = get_clock();
     qemu_mutex_lock(&rcu_registry_lock);
 
     if (!QLIST_EMPTY(&registry)) {
@@ -164,12 +173,33 @@ void synchronize_rcu(void)
     }
 
     qemu_mutex_unlock(&rcu_registry_lock);
+    ns = get_clock() - start;
     qemu_mutex_unlock(&rcu_sync_lock);
+
+    qemu_mutex_lock(&rcu_stats_lock);
+    rcu_stats.grace_periods++;
+    rcu_stats.gp_total_ns += ns;
+    rcu_stats.gp_max_ns = MAX(rcu_stats.gp_max_ns, ns);
+    qemu_mutex_unlock(&rcu_stats_lock);
+    trace_synchronize_rcu_done(ns);
+}
+
+void rcu_get_stats(RCUStats *stats)
+{
+    qemu_mutex_lock(&rcu_stats_lock);
+    *stats = rcu_stats;
+    qemu_mutex_unlock(&rcu_stats_lock);
 }
 
 
 #define RCU_CALL_MIN_SIZE        30
 
+/* Callbacks a registered thread collects before handing them over */
+#define RCU_CALL_BATCH_SIZE      16
+
+/* Above this many queued callbacks, call_rcu1() stops batching */
+#define RCU_CALL_MAX_BACKLOG     10000
+
 /* Multi-producer, single-consumer queue based on urcu/static/wfqueue.h
  * from liburcu.  Note that head is only used by the consumer.
  */
@@ -178,13 +208,19 @@ static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
 
-static void enqueue(struct rcu_head *node)
+/* Append the chain first..last, whose next pointers are already set */
+static void enqueue_list(struct rcu_head *first, struct rcu_head *last)
 {
     struct rcu_head **old_tail;
 
-    node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
-    atomic_mb_set(old_tail, node);
+    last->next = NULL;
+    old_tail = atomic_xchg(&tail, &last->next);
+    atomic_mb_set(old_tail, first);
+}
+
+static void enqueue(struct rcu_head *node)
+{
+    enqueue_list(node, node);
 }
 
 static struct rcu_head *try_dequeue(void)
@@ -227,6 +263,54 @@ retry:
     return node;
 }
 
+static void rcu_account_backlog(int n)
+{
+    qemu_mutex_lock(&rcu_stats_lock);
+    rcu_stats.backlog_max = MAX(rcu_stats.backlog_max, n);
+    qemu_mutex_unlock(&rcu_stats_lock);
+}
+
+/* Move the callbacks batched by @reader to the global queue, oldest first */
+static void flush_batch(struct rcu_reader_data *reader)
+{
+    struct rcu_head *node, *next, *first = NULL, *last;
+    int n = 0;
+
+    node = atomic_xchg(&reader->batch, NULL);
+    if (!node) {
+        return;
+    }
+
+    last = node;
+    while (node) {
+        next = node->next;
+        node->next = first;
+        first = node;
+        node = next;
+        n++;
+    }
+    enqueue_list(first, last);
+    atomic_add(&rcu_call_count, n);
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+/* Called by the call_rcu thread to pick up partially filled batches.
+ * rcu_sync_lock keeps synchronize_rcu() from hiding readers in its
+ * private list while we walk the registry.
+ */
+static void flush_all_batches(void)
+{
+    struct rcu_reader_data *index;
+
+    qemu_mutex_lock(&rcu_sync_lock);
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_FOREACH(index, &registry, node) {
+        flush_batch(index);
+    }
+    qemu_mutex_unlock(&rcu_registry_lock);
+    qemu_mutex_unlock(&rcu_sync_lock);
+}
+
 static void *call_rcu_thread(void *opaque)
 {
     struct rcu_head *node;
@@ -235,7 +319,10 @@ static void *call_rcu_thread(void *opaque)
 
     for (;;) {
         int tries = 0;
-        int n = atomic_read(&rcu_call_count);
+        int n, n_run;
+
+        flush_all_batches();
+        n = atomic_read(&rcu_call_count);
 
         /* Heuristically wait for a decent number of callbacks to pile up.
          * Fetch rcu_call_count now, we only must process elements that were
@@ -245,15 +332,20 @@ static void *call_rcu_thread(void *opaque)
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
+                flush_all_batches();
                 n = atomic_read(&rcu_call_count);
                 if (n == 0) {
                     qemu_event_wait(&rcu_call_ready_event);
                 }
             }
+            flush_all_batches();
             n = atomic_read(&rcu_call_count);
         }
 
+        rcu_account_backlog(n);
+        trace_call_rcu_batch(n, atomic_read(&rcu_call_count));
         atomic_sub(&rcu_call_count, n);
+        n_run = n;
         synchronize_rcu();
         qemu_mutex_lock_iothread();
         while (n > 0) {
@@ -273,16 +365,55 @@ static void *call_rcu_thread(void *opaque)
             node->func(node);
         }
         qemu_mutex_unlock_iothread();
+
+        qemu_mutex_lock(&rcu_stats_lock);
+        rcu_stats.callbacks += n_run;
+        qemu_mutex_unlock(&rcu_stats_lock);
     }
     abort();
 }
 
+/* Registered threads collect callbacks in rcu_reader.batch, so that
+ * frequent callers touch the shared queue once per RCU_CALL_BATCH_SIZE
+ * callbacks only.  The call_rcu thread picks up whatever is left over
+ * when it looks for work.  Once the backlog exceeds RCU_CALL_MAX_BACKLOG,
+ * callbacks go straight to the shared queue so that none of them waits
+ * in a batch while the call_rcu thread catches up.
+ */
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
+    struct rcu_reader_data *p_rcu_reader = &rcu_reader;
+    struct rcu_head *old;
+    int backlog;
+
     node->func = func;
-    enqueue(node);
-    atomic_inc(&rcu_call_count);
-    qemu_event_set(&rcu_call_ready_event);
+
+    backlog = atomic_read(&rcu_call_count);
+    if (!p_rcu_reader->registered || backlog >= RCU_CALL_MAX_BACKLOG) {
+        if (p_rcu_reader->registered) {
+            trace_call_rcu_backlog(backlog);
+            flush_batch(p_rcu_reader);
+        }
+        enqueue(node);
+        atomic_inc(&rcu_call_count);
+        qemu_event_set(&rcu_call_ready_event);
+        return;
+    }
+
+    do {
+        old = atomic_read(&p_rcu_reader->batch);
+        node->next = old;
+    } while (atomic_cmpxchg(&p_rcu_reader->batch, old, node) != old);
+
+    if (!old) {
+        /* The batch was empty or taken by the call_rcu thread */
+        p_rcu_reader->batch_count = 0;
+        qemu_event_set(&rcu_call_ready_event);
+    }
+    if (++p_rcu_reader->batch_count >= RCU_CALL_BATCH_SIZE) {
+        p_rcu_reader->batch_count = 0;
+        flush_batch(p_rcu_reader);
+    }
 }
 
 void rcu_register_thread(void)
@@ -290,12 +421,15 @@ void rcu_register_thread(void)
     assert(rcu_reader.ctr == 0);
     qemu_mutex_lock(&rcu_registry_lock);
     QLIST_INSERT_HEAD(&registry, &rcu_reader, node);
+    rcu_reader.registered = true;
     qemu_mutex_unlock(&rcu_registry_lock);
 }
 
 void rcu_unregister_thread(void)
 {
     qemu_mutex_lock(&rcu_registry_lock);
+    flush_batch(&rcu_reader);
+    rcu_reader.registered = false;
     QLIST_REMOVE(&rcu_reader, node);
     qemu_mutex_unlock(&rcu_registry_lock);
 }
@@ -306,6 +440,7 @@ static void rcu_init_complete(void)
 
     qemu_mutex_init(&rcu_registry_lock);
     qemu_mutex_init(&rcu_sync_lock);
+    qemu_mutex_init(&rcu_stats_lock);
     qemu_event_init(&rcu_gp_event, true);
 
     qemu_event_init(&rcu_call_ready_event, false);
@@ -1293,7 +1293,8 @@ void xen_hvm_init(PCMachineState *pcms, MemoryRegion **ram_memory)
     state->bufioreq_local_port = rc;
 
     /* Init RAM management */
-    xen_map_cache_init(xen_phys_offset_to_gaddr, state);
+    xen_map_cache_init(xen_phys_offset_to_gaddr, state,
+                       MACHINE(pcms)->xen_mapcache_bucket);
     xen_ram_init(pcms, ram_size, ram_memory);
 
     qemu_add_vm_change_state_handler(xen_hvm_change_state_handler, state);
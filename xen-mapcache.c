@@ -15,6 +15,9 @@
 #include "hw/xen/xen_backend.h"
 #include "sysemu/blockdev.h"
 #include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/rcu_queue.h"
 
 #include <xen/hvm/params.h>
 
@@ -39,7 +42,9 @@
 #  define MCACHE_BUCKET_SHIFT 20
 #  define MCACHE_MAX_SIZE     (1UL<<35) /* 32GB Cap */
 #endif
-#define MCACHE_BUCKET_SIZE (1UL << MCACHE_BUCKET_SHIFT)
+#define MCACHE_BUCKET_SHIFT_MAX 30
+
+#define MCACHE_BUCKET_SIZE (1UL << mapcache->mcache_bucket_shift)
 
 /* This is the size of the virtual address space reserve to QEMU that will not
  * be use by MapCache.
@@ -48,29 +53,45 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
+/*
+ * Entries are hashed by bucket index.  The hash chains are RCU lists, so
+ * that unlocked lookups of a bucket that is already mapped take no lock;
+ * everything else runs under mapcache->lock.  An entry that is published
+ * on a chain never changes its mapping: remapping a bucket replaces the
+ * entry, and the old mapping is torn down once the readers are gone.
+ *
+ * Entries that are not locked sit on an LRU list.  Once the mapped size
+ * reaches max_mcache_size, new mappings evict from its head; the lockless
+ * lookup only sets "referenced", which gives the entry a second chance.
+ */
 typedef struct MapCacheEntry {
+    struct rcu_head rcu;
     hwaddr paddr_index;
     uint8_t *vaddr_base;
     unsigned long *valid_mapping;
-    uint8_t lock;
+    unsigned int lock;
+    bool referenced;
     hwaddr size;
-    struct MapCacheEntry *next;
+    QLIST_ENTRY(MapCacheEntry) next;
+    QTAILQ_ENTRY(MapCacheEntry) lru;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
-    hwaddr size;
+    MapCacheEntry *entry;
     QTAILQ_ENTRY(MapCacheRev) next;
 } MapCacheRev;
 
+QLIST_HEAD(MapCacheChain, MapCacheEntry);
+
 typedef struct MapCache {
-    MapCacheEntry *entry;
+    struct MapCacheChain *hash;
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
+    QTAILQ_HEAD(map_cache_lru, MapCacheEntry) lru;
 
-    /* For most cases (>99.9%), the page address is the same. */
-    MapCacheEntry *last_entry;
+    hwaddr mapped_size;
     unsigned long max_mcache_size;
     unsigned int mcache_bucket_shift;
 
@@ -100,7 +121,8 @@ static inline int test_bits(int nr, int size, const unsigned long *addr)
         return 0;
 }
 
-void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
+void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque,
+                        uint64_t bucket_size)
 {
     unsigned long size;
     struct rlimit rlimit_as;
@@ -112,6 +134,19 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->lru);
+
+    if (!bucket_size) {
+        mapcache->mcache_bucket_shift = MCACHE_BUCKET_SHIFT;
+    } else if (!is_power_of_2(bucket_size) || bucket_size < XC_PAGE_SIZE ||
+               bucket_size > (1UL << MCACHE_BUCKET_SHIFT_MAX)) {
+        error_report("xen-mapcache-bucket must be a power of two between "
+                     "%lu and %lu bytes", (unsigned long)XC_PAGE_SIZE,
+                     1UL << MCACHE_BUCKET_SHIFT_MAX);
+        exit(1);
+    } else {
+        mapcache->mcache_bucket_shift = ctz64(bucket_size);
+    }
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -137,20 +172,19 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
-          (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
-         (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT));
+          (1UL << (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) - 1) >>
+         (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT));
 
-    size = mapcache->nr_buckets * sizeof (MapCacheEntry);
+    size = mapcache->nr_buckets * sizeof(struct MapCacheChain);
     size = (size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
     DPRINTF("%s, nr_buckets = %lx size %lu\n", __func__,
             mapcache->nr_buckets, size);
-    mapcache->entry = g_malloc0(size);
+    mapcache->hash = g_malloc0(size);
 }
 
-static void xen_remap_bucket(MapCacheEntry *entry,
-                             hwaddr size,
-                             hwaddr address_index)
+static MapCacheEntry *xen_map_bucket(hwaddr size, hwaddr address_index)
 {
+    MapCacheEntry *entry;
     uint8_t *vaddr_base;
     xen_pfn_t *pfns;
     int *err;
@@ -162,17 +196,9 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     pfns = g_malloc0(nb_pfn * sizeof (xen_pfn_t));
     err = g_malloc0(nb_pfn * sizeof (int));
 
-    if (entry->vaddr_base != NULL) {
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-    }
-    g_free(entry->valid_mapping);
-    entry->valid_mapping = NULL;
-
     for (i = 0; i < nb_pfn; i++) {
-        pfns[i] = (address_index << (MCACHE_BUCKET_SHIFT-XC_PAGE_SHIFT)) + i;
+        pfns[i] = (address_index <<
+                   (mapcache->mcache_bucket_shift - XC_PAGE_SHIFT)) + i;
     }
 
     vaddr_base = xenforeignmemory_map(xen_fmem, xen_domid, PROT_READ|PROT_WRITE,
@@ -182,13 +208,11 @@ static void xen_remap_bucket(MapCacheEntry *entry,
         exit(-1);
     }
 
+    entry = g_new0(MapCacheEntry, 1);
     entry->vaddr_base = vaddr_base;
     entry->paddr_index = address_index;
     entry->size = size;
-    entry->valid_mapping = (unsigned long *) g_malloc0(sizeof(unsigned long) *
-            BITS_TO_LONGS(size >> XC_PAGE_SHIFT));
-
-    bitmap_zero(entry->valid_mapping, nb_pfn);
+    entry->valid_mapping = bitmap_new(nb_pfn);
     for (i = 0; i < nb_pfn; i++) {
         if (!err[i]) {
             bitmap_set(entry->valid_mapping, i, 1);
@@ -197,12 +221,83 @@ static void xen_remap_bucket(MapCacheEntry *entry,
 
     g_free(pfns);
     g_free(err);
+    return entry;
+}
+
+static void xen_map_bucket_free(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    g_free(entry->valid_mapping);
+    g_free(entry);
+}
+
+/* Unpublish an unlocked entry; lockless readers may still be using it */
+static void xen_map_cache_drop(MapCacheEntry *entry)
+{
+    assert(!entry->lock);
+    trace_xen_map_cache_drop(entry->paddr_index, entry->size);
+    QLIST_REMOVE_RCU(entry, next);
+    QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+    mapcache->mapped_size -= entry->size;
+    call_rcu(entry, xen_map_bucket_free, rcu);
+}
+
+/* Make room for @size more bytes of mappings, if unlocked entries allow */
+static void xen_map_cache_evict(hwaddr size)
+{
+    MapCacheEntry *entry, *first_spared = NULL;
+
+    while (mapcache->mapped_size + size > mapcache->max_mcache_size &&
+           (entry = QTAILQ_FIRST(&mapcache->lru)) != NULL) {
+        /* Spare recently used entries, but only for one lap */
+        if (entry != first_spared && atomic_read(&entry->referenced)) {
+            if (!first_spared) {
+                first_spared = entry;
+            }
+            atomic_set(&entry->referenced, false);
+            QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+            QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+            continue;
+        }
+        xen_map_cache_drop(entry);
+    }
+}
+
+/*
+ * Look for a mapping of @address_index that covers the pages at
+ * [@address_offset, @address_offset + @test_bit_size).  @cache_size 0
+ * accepts any entry size.  Runs either under mapcache->lock or, for
+ * unlocked lookups, within an RCU critical section.
+ */
+static MapCacheEntry *xen_map_cache_find(hwaddr address_index,
+                                         hwaddr address_offset,
+                                         hwaddr cache_size,
+                                         hwaddr test_bit_size)
+{
+    struct MapCacheChain *chain;
+    MapCacheEntry *entry;
+
+    chain = &mapcache->hash[address_index % mapcache->nr_buckets];
+    QLIST_FOREACH_RCU(entry, chain, next) {
+        if (entry->paddr_index == address_index &&
+            (!cache_size || entry->size == cache_size) &&
+            test_bits(address_offset >> XC_PAGE_SHIFT,
+                      test_bit_size >> XC_PAGE_SHIFT,
+                      entry->valid_mapping)) {
+            return entry;
+        }
+    }
+    return NULL;
 }
 
 static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
                                        uint8_t lock)
 {
-    MapCacheEntry *entry, *pentry = NULL;
+    MapCacheEntry *entry, *old;
+    struct MapCacheChain *chain;
     hwaddr address_index;
     hwaddr address_offset;
     hwaddr cache_size = size;
@@ -210,7 +305,7 @@ static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
     bool translated = false;
 
 tryagain:
-    address_index  = phys_addr >> MCACHE_BUCKET_SHIFT;
+    address_index  = phys_addr >> mapcache->mcache_bucket_shift;
     address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
 
     trace_xen_map_cache(phys_addr);
@@ -226,16 +321,6 @@ tryagain:
         test_bit_size = XC_PAGE_SIZE;
     }
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == address_index &&
-        !lock && !size &&
-        test_bits(address_offset >> XC_PAGE_SHIFT,
-                  test_bit_size >> XC_PAGE_SHIFT,
-                  mapcache->last_entry->valid_mapping)) {
-        trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-        return mapcache->last_entry->vaddr_base + address_offset;
-    }
-
     /* size is always a multiple of MCACHE_BUCKET_SIZE */
     if (size) {
         cache_size = size + address_offset;
@@ -246,34 +331,31 @@ tryagain:
         cache_size = MCACHE_BUCKET_SIZE;
     }
 
-    entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != cache_size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT,
-                 test_bit_size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
-        pentry = entry;
-        entry = entry->next;
-    }
+    entry = xen_map_cache_find(address_index, address_offset, cache_size,
+                               test_bit_size);
     if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
-        xen_remap_bucket(entry, cache_size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != cache_size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT,
-                    test_bit_size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, cache_size, address_index);
+        /* Retry a stale, unlocked mapping of the bucket rather than
+         * keeping both around.
+         */
+        chain = &mapcache->hash[address_index % mapcache->nr_buckets];
+        QLIST_FOREACH(old, chain, next) {
+            if (old->paddr_index == address_index &&
+                old->size == cache_size && !old->lock) {
+                xen_map_cache_drop(old);
+                break;
+            }
         }
+
+        xen_map_cache_evict(cache_size);
+        entry = xen_map_bucket(cache_size, address_index);
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+        mapcache->mapped_size += entry->size;
+        QLIST_INSERT_HEAD_RCU(chain, entry, next);
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT,
                 test_bit_size >> XC_PAGE_SHIFT,
                 entry->valid_mapping)) {
-        mapcache->last_entry = NULL;
         if (!translated && mapcache->phys_offset_to_gaddr) {
             phys_addr = mapcache->phys_offset_to_gaddr(phys_addr, size, mapcache->opaque);
             translated = true;
@@ -283,25 +365,44 @@ tryagain:
         return NULL;
     }
 
-    mapcache->last_entry = entry;
     if (lock) {
         MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
-        entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
-        reventry->size = entry->size;
+        if (!entry->lock++) {
+            QTAILQ_REMOVE(&mapcache->lru, entry, lru);
+        }
+        reventry->vaddr_req = entry->vaddr_base + address_offset;
+        reventry->paddr_index = entry->paddr_index;
+        reventry->entry = entry;
         QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
+    } else {
+        atomic_set(&entry->referenced, true);
     }
 
-    trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
-    return mapcache->last_entry->vaddr_base + address_offset;
+    trace_xen_map_cache_return(entry->vaddr_base + address_offset);
+    return entry->vaddr_base + address_offset;
 }
 
+/* Called within RCU critical section when @lock is 0.  */
 uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
                        uint8_t lock)
 {
+    MapCacheEntry *entry;
+    hwaddr address_offset;
     uint8_t *p;
 
+    if (!lock && !size) {
+        address_offset = phys_addr & (MCACHE_BUCKET_SIZE - 1);
+        entry = xen_map_cache_find(phys_addr >> mapcache->mcache_bucket_shift,
+                                   address_offset, 0, XC_PAGE_SIZE);
+        if (entry) {
+            if (!atomic_read(&entry->referenced)) {
+                atomic_set(&entry->referenced, true);
+            }
+            trace_xen_map_cache_return(entry->vaddr_base + address_offset);
+            return entry->vaddr_base + address_offset;
+        }
+    }
+
     mapcache_lock();
     p = xen_map_cache_unlocked(phys_addr, size, lock);
     mapcache_unlock();
@@ -312,21 +413,16 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 {
     MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
-    hwaddr paddr_index;
-    hwaddr size;
     ram_addr_t raddr;
-    int found = 0;
 
     mapcache_lock();
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == ptr) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
+            entry = reventry->entry;
             break;
         }
     }
-    if (!found) {
+    if (!entry) {
         fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
@@ -336,38 +432,24 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
         return 0;
     }
 
-    entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        entry = entry->next;
-    }
-    if (!entry) {
-        DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
-        raddr = 0;
-    } else {
-        raddr = (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
-             ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
-    }
+    raddr = (entry->paddr_index << mapcache->mcache_bucket_shift) +
+         ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
     mapcache_unlock();
     return raddr;
 }
 
 static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
 {
-    MapCacheEntry *entry = NULL, *pentry = NULL;
+    MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
-    hwaddr paddr_index;
-    hwaddr size;
-    int found = 0;
 
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == buffer) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
+            entry = reventry->entry;
             break;
         }
     }
-    if (!found) {
+    if (!entry) {
         DPRINTF("%s, could not find %p\n", __func__, buffer);
         QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
             DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index, reventry->vaddr_req);
@@ -377,32 +459,12 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
     g_free(reventry);
 
-    if (mapcache->last_entry != NULL &&
-        mapcache->last_entry->paddr_index == paddr_index) {
-        mapcache->last_entry = NULL;
-    }
-
-    entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        pentry = entry;
-        entry = entry->next;
-    }
-    if (!entry) {
-        DPRINTF("Trying to unmap address %p that is not in the mapcache!\n", buffer);
-        return;
-    }
-    entry->lock--;
-    if (entry->lock > 0 || pentry == NULL) {
-        return;
-    }
-
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
+    /* Keep the mapping for reuse; eviction unmaps it when space runs out */
+    assert(entry->lock > 0);
+    if (!--entry->lock) {
+        QTAILQ_INSERT_TAIL(&mapcache->lru, entry, lru);
+        xen_map_cache_evict(0);
     }
-    g_free(entry->valid_mapping);
-    g_free(entry);
 }
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
@@ -414,7 +476,7 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
 
 void xen_invalidate_map_cache(void)
 {
-    unsigned long i;
+    MapCacheEntry *entry, *tmp;
     MapCacheRev *reventry;
 
     /* Flush pending AIO before destroying the mapcache */
@@ -428,29 +490,9 @@ void xen_invalidate_map_cache(void)
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
-    for (i = 0; i < mapcache->nr_buckets; i++) {
-        MapCacheEntry *entry = &mapcache->entry[i];
-
-        if (entry->vaddr_base == NULL) {
-            continue;
-        }
-        if (entry->lock > 0) {
-            continue;
-        }
-
-        if (munmap(entry->vaddr_base, entry->size) != 0) {
-            perror("unmap fails");
-            exit(-1);
-        }
-
-        entry->paddr_index = 0;
-        entry->vaddr_base = NULL;
-        entry->size = 0;
-        g_free(entry->valid_mapping);
-        entry->valid_mapping = NULL;
+    QTAILQ_FOREACH_SAFE(entry, &mapcache->lru, lru, tmp) {
+        xen_map_cache_drop(entry);
     }
 
-    mapcache->last_entry = NULL;
-
     mapcache_unlock();
 }